@@ -18,8 +18,6 @@ src\ASF\sam\drivers\udp\udp_device.c
 
 src\ASF\common\utils\stdio\write.c
 
-src\ASF\common\services\usb\class\cdc\device\udi_cdc_desc.c
-
 src\ASF\sam\drivers\pio\pio.c
 
 src\ASF\sam\drivers\tc\tc.c
@@ -42,5 +40,41 @@ src\ASF\sam\utils\cmsis\sam4e\source\templates\system_sam4e.c
 
 src\ASF\sam\utils\syscalls\gcc\syscalls.c
 
+src\profile.c
+
+src\udi_vendor_bulk.c
+
+src\usb_desc.c
+
+src\reply.c
+
+src\command.c
+
+src\rle.c
+
+src\sd.c
+
+src\eth.c
+
+src\flash.c
+
+src\ring.c
+
+src\trace.c
+
+src\crc.c
+
+src\pool.c
+
+src\rice.c
+
+src\lz4.c
+
+src\udi_msc.c
+
+src\msc_fat.c
+
+src\udi_dfu.c
+
 src\main.c
 
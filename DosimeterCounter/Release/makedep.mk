@@ -0,0 +1,80 @@
+################################################################################
+# Automatically-generated file. Do not edit or delete the file
+################################################################################
+
+src\ASF\common\services\sleepmgr\sam\sleepmgr.c
+
+src\ASF\common\services\usb\class\cdc\device\udi_cdc.c
+
+src\ASF\common\services\usb\udc\udc.c
+
+src\ASF\common\utils\stdio\read.c
+
+src\ASF\common\utils\stdio\stdio_usb\stdio_usb.c
+
+src\ASF\sam\drivers\pio\pio_handler.c
+
+src\ASF\sam\drivers\udp\udp_device.c
+
+src\ASF\common\utils\stdio\write.c
+
+src\ASF\sam\drivers\pio\pio.c
+
+src\ASF\sam\drivers\tc\tc.c
+
+src\ASF\common\services\clock\sam4e\sysclk.c
+
+src\ASF\common\utils\interrupt\interrupt_sam_nvic.c
+
+src\ASF\sam\boards\sam4e_ek\init.c
+
+src\ASF\sam\drivers\pmc\pmc.c
+
+src\ASF\sam\drivers\pmc\sleep.c
+
+src\ASF\sam\utils\cmsis\sam4e\source\templates\exceptions.c
+
+src\ASF\sam\utils\cmsis\sam4e\source\templates\gcc\startup_sam4e.c
+
+src\ASF\sam\utils\cmsis\sam4e\source\templates\system_sam4e.c
+
+src\ASF\sam\utils\syscalls\gcc\syscalls.c
+
+src\profile.c
+
+src\udi_vendor_bulk.c
+
+src\usb_desc.c
+
+src\reply.c
+
+src\command.c
+
+src\rle.c
+
+src\sd.c
+
+src\eth.c
+
+src\flash.c
+
+src\ring.c
+
+src\trace.c
+
+src\crc.c
+
+src\pool.c
+
+src\rice.c
+
+src\lz4.c
+
+src\udi_msc.c
+
+src\msc_fat.c
+
+src\udi_dfu.c
+
+src\main.c
+
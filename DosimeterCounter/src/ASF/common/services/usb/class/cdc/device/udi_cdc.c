@@ -47,8 +47,35 @@
 #include "udd.h"
 #include "udc.h"
 #include "udi_cdc.h"
+#include "trace.h"
 #include <string.h>
 
+/*
+ * Local change: the buffer updates below only race with the USB
+ * interrupt, so instead of masking everything they raise BASEPRI to
+ * UDD_USB_INT_LEVEL.  Higher priority interrupts (the counter's step
+ * interrupt) keep running while text is printed.
+ */
+#ifndef UDD_USB_INT_LEVEL
+#  define UDD_USB_INT_LEVEL 5
+#endif
+#define UDI_CDC_BASEPRI (UDD_USB_INT_LEVEL << (8 - __NVIC_PRIO_BITS))
+
+static inline irqflags_t udi_cdc_irq_save(void)
+{
+	irqflags_t basepri = __get_BASEPRI();
+	if (basepri == 0 || basepri > UDI_CDC_BASEPRI) {
+		__set_BASEPRI(UDI_CDC_BASEPRI);
+		__ISB();
+	}
+	return basepri;
+}
+
+static inline void udi_cdc_irq_restore(irqflags_t basepri)
+{
+	__set_BASEPRI(basepri);
+}
+
 #ifdef UDI_CDC_LOW_RATE
 #  ifdef USB_DEVICE_HS_SUPPORT
 #    define UDI_CDC_TX_BUFFERS     (UDI_CDC_DATA_EPS_HS_SIZE)
@@ -259,6 +286,15 @@ static uint16_t udi_cdc_tx_sof_num[UDI_CDC_PORT_NB];
 static volatile bool udi_cdc_tx_trans_ongoing[UDI_CDC_PORT_NB];
 //! Signal that both buffer content data to send
 static volatile bool udi_cdc_tx_both_buf_to_send[UDI_CDC_PORT_NB];
+//! Signal a direct (zero-copy) transfer on-going
+static volatile bool udi_cdc_tx_direct[UDI_CDC_PORT_NB];
+//! Local change: frames seen by udi_cdc_data_sof_notify(), the clock of
+//! the write timeouts
+static volatile uint32_t udi_cdc_frames;
+//! Local change: most bytes held in the TX buffers at once
+static iram_size_t udi_cdc_tx_peak[UDI_CDC_PORT_NB];
+//! Local change: most received bytes waiting to be read at once
+static iram_size_t udi_cdc_rx_peak[UDI_CDC_PORT_NB];
 
 //@}
 
@@ -333,6 +369,7 @@ bool udi_cdc_data_enable(void)
 	// Initialize TX management
 	udi_cdc_tx_trans_ongoing[port] = false;
 	udi_cdc_tx_both_buf_to_send[port] = false;
+	udi_cdc_tx_direct[port] = false;
 	udi_cdc_tx_buf_sel[port] = 0;
 	udi_cdc_tx_buf_nb[port][0] = 0;
 	udi_cdc_tx_buf_nb[port][1] = 0;
@@ -442,6 +479,10 @@ void udi_cdc_data_sof_notify(void)
 {
 	static uint8_t port_notify = 0;
 
+	if (port_notify == 0) {
+		udi_cdc_frames++;
+	}
+
 	// A call of udi_cdc_data_sof_notify() is done for each port
 	udi_cdc_tx_send(port_notify);
 #if UDI_CDC_PORT_NB != 1 // To optimize code
@@ -492,13 +533,13 @@ static void udi_cdc_ctrl_state_change(uint8_t port, bool b_set, le16_t bit_mask)
 #endif
 
 	// Update state
-	flags = cpu_irq_save(); // Protect udi_cdc_state
+	flags = udi_cdc_irq_save(); // Protect udi_cdc_state
 	if (b_set) {
 		udi_cdc_state[port] |= bit_mask;
 	} else {
 		udi_cdc_state[port] &= ~(unsigned)bit_mask;
 	}
-	cpu_irq_restore(flags);
+	udi_cdc_irq_restore(flags);
 
 	// Send it if possible and state changed
 	switch (port) {
@@ -588,12 +629,12 @@ static bool udi_cdc_rx_start(uint8_t port)
 	port = 0;
 #endif
 
-	flags = cpu_irq_save();
+	flags = udi_cdc_irq_save();
 	buf_sel_trans = udi_cdc_rx_buf_sel[port];
 	if (udi_cdc_rx_trans_ongoing[port] ||
 		(udi_cdc_rx_pos[port] < udi_cdc_rx_buf_nb[port][buf_sel_trans])) {
 		// Transfer already on-going or current buffer no empty
-		cpu_irq_restore(flags);
+		udi_cdc_irq_restore(flags);
 		return false;
 	}
 
@@ -603,7 +644,7 @@ static bool udi_cdc_rx_start(uint8_t port)
 
 	// Start transfer on RX
 	udi_cdc_rx_trans_ongoing[port] = true;
-	cpu_irq_restore(flags);
+	udi_cdc_irq_restore(flags);
 
 	if (udi_cdc_multi_is_rx_ready(port)) {
 		UDI_CDC_RX_NOTIFY(port);
@@ -658,7 +699,23 @@ static void udi_cdc_data_received(udd_ep_status_t status, iram_size_t n, udd_ep_
 				udi_cdc_data_received);
 		return;
 	}
+#ifdef UDI_CDC_RX_FILTER
+	// Local change: the application may take a packet for itself, and
+	// the buffer is filled again as if it had been empty
+	if (!UDI_CDC_RX_FILTER(port, udi_cdc_rx_buf[port][buf_sel_trans], n)) {
+		udd_ep_run( ep,
+				true,
+				udi_cdc_rx_buf[port][buf_sel_trans],
+				UDI_CDC_RX_BUFFERS,
+				udi_cdc_data_received);
+		return;
+	}
+#endif
 	udi_cdc_rx_buf_nb[port][buf_sel_trans] = n;
+	n += udi_cdc_rx_buf_nb[port][udi_cdc_rx_buf_sel[port]] - udi_cdc_rx_pos[port];
+	if (n > udi_cdc_rx_peak[port]) {
+		udi_cdc_rx_peak[port] = n;
+	}
 	udi_cdc_rx_trans_ongoing[port] = false;
 	udi_cdc_rx_start(port);
 }
@@ -669,6 +726,8 @@ static void udi_cdc_data_sent(udd_ep_status_t status, iram_size_t n, udd_ep_id_t
 	uint8_t port;
 	UNUSED(n);
 
+	trace(TRACE_CDC_SENT, n);
+
 	switch (ep) {
 #define UDI_CDC_DATA_EP_IN_TO_PORT(index, unused) \
 	case UDI_CDC_DATA_EP_IN_##index: \
@@ -681,8 +740,15 @@ static void udi_cdc_data_sent(udd_ep_status_t status, iram_size_t n, udd_ep_id_t
 		break;
 	}
 
+	bool b_direct = udi_cdc_tx_direct[port];
+	udi_cdc_tx_direct[port] = false;
 	if (UDD_EP_TRANSFER_OK != status) {
 		// Abort transfer
+		// Local change: a direct write that timed out gives the
+		// endpoint back to the TX buffers
+		if (b_direct) {
+			udi_cdc_tx_trans_ongoing[port] = false;
+		}
 		return;
 	}
 	udi_cdc_tx_buf_nb[port][(udi_cdc_tx_buf_sel[port]==0)?1:0] = 0;
@@ -721,13 +787,13 @@ static void udi_cdc_tx_send(uint8_t port)
 		}
 	}
 
-	flags = cpu_irq_save(); // to protect udi_cdc_tx_buf_sel
+	flags = udi_cdc_irq_save(); // to protect udi_cdc_tx_buf_sel
 	buf_sel_trans = udi_cdc_tx_buf_sel[port];
 	if (udi_cdc_tx_buf_nb[port][buf_sel_trans] == 0) {
 		sof_zlp_counter++;
 		if (((!udd_is_high_speed()) && (sof_zlp_counter < 100))
 				|| (udd_is_high_speed() && (sof_zlp_counter < 800))) {
-			cpu_irq_restore(flags);
+			udi_cdc_irq_restore(flags);
 			return;
 		}
 	}
@@ -743,7 +809,7 @@ static void udi_cdc_tx_send(uint8_t port)
 		buf_sel_trans = (buf_sel_trans==0)?1:0;
 	}
 	udi_cdc_tx_trans_ongoing[port] = true;
-	cpu_irq_restore(flags);
+	udi_cdc_irq_restore(flags);
 
 	b_short_packet = (udi_cdc_tx_buf_nb[port][buf_sel_trans] != UDI_CDC_TX_BUFFERS);
 	if (b_short_packet) {
@@ -841,10 +907,10 @@ iram_size_t udi_cdc_multi_get_nb_received_data(uint8_t port)
 #if UDI_CDC_PORT_NB == 1 // To optimize code
 	port = 0;
 #endif
-	flags = cpu_irq_save();
+	flags = udi_cdc_irq_save();
 	pos = udi_cdc_rx_pos[port];
 	nb_received = udi_cdc_rx_buf_nb[port][udi_cdc_rx_buf_sel[port]] - pos;
-	cpu_irq_restore(flags);
+	udi_cdc_irq_restore(flags);
 	return nb_received;
 }
 
@@ -879,10 +945,10 @@ int udi_cdc_multi_getc(uint8_t port)
 
 udi_cdc_getc_process_one_byte:
 	// Check available data
-	flags = cpu_irq_save();
+	flags = udi_cdc_irq_save();
 	pos = udi_cdc_rx_pos[port];
 	buf_sel = udi_cdc_rx_buf_sel[port];
-	cpu_irq_restore(flags);
+	udi_cdc_irq_restore(flags);
 	while (pos >= udi_cdc_rx_buf_nb[port][buf_sel]) {
 		if (!udi_cdc_data_running) {
 			return 0;
@@ -924,10 +990,10 @@ iram_size_t udi_cdc_multi_read_buf(uint8_t port, void* buf, iram_size_t size)
 
 udi_cdc_read_buf_loop_wait:
 	// Check available data
-	flags = cpu_irq_save();
+	flags = udi_cdc_irq_save();
 	pos = udi_cdc_rx_pos[port];
 	buf_sel = udi_cdc_rx_buf_sel[port];
-	cpu_irq_restore(flags);
+	udi_cdc_irq_restore(flags);
 	while (pos >= udi_cdc_rx_buf_nb[port][buf_sel]) {
 		if (!udi_cdc_data_running) {
 			return size;
@@ -967,7 +1033,7 @@ iram_size_t udi_cdc_multi_get_free_tx_buffer(uint8_t port)
 	port = 0;
 #endif
 
-	flags = cpu_irq_save();
+	flags = udi_cdc_irq_save();
 	buf_sel = udi_cdc_tx_buf_sel[port];
 	buf_sel_nb = udi_cdc_tx_buf_nb[port][buf_sel];
 	buf_nosel_nb = udi_cdc_tx_buf_nb[port][(buf_sel == 0)? 1 : 0];
@@ -984,7 +1050,7 @@ iram_size_t udi_cdc_multi_get_free_tx_buffer(uint8_t port)
 		}
 	}
 	retval = UDI_CDC_TX_BUFFERS - buf_sel_nb;  
-	cpu_irq_restore(flags);
+	udi_cdc_irq_restore(flags);
 	return retval;
 }
 
@@ -1003,6 +1069,15 @@ bool udi_cdc_is_tx_ready(void)
 	return udi_cdc_multi_is_tx_ready(0);
 }
 
+//! Local change: called with the TX buffers protected
+static void udi_cdc_tx_note_peak(uint8_t port)
+{
+	iram_size_t nb = udi_cdc_tx_buf_nb[port][0] + udi_cdc_tx_buf_nb[port][1];
+	if (nb > udi_cdc_tx_peak[port]) {
+		udi_cdc_tx_peak[port] = nb;
+	}
+}
+
 int udi_cdc_multi_putc(uint8_t port, int value)
 {
 	irqflags_t flags;
@@ -1025,10 +1100,11 @@ udi_cdc_putc_process_one_byte:
 	}
 
 	// Write value
-	flags = cpu_irq_save();
+	flags = udi_cdc_irq_save();
 	buf_sel = udi_cdc_tx_buf_sel[port];
 	udi_cdc_tx_buf[port][buf_sel][udi_cdc_tx_buf_nb[port][buf_sel]++] = value;
-	cpu_irq_restore(flags);
+	udi_cdc_tx_note_peak(port);
+	udi_cdc_irq_restore(flags);
 
 	if (b_databit_9) {
 		// Send MSB
@@ -1070,7 +1146,7 @@ udi_cdc_write_buf_loop_wait:
 	}
 
 	// Write values
-	flags = cpu_irq_save();
+	flags = udi_cdc_irq_save();
 	buf_sel = udi_cdc_tx_buf_sel[port];
 	buf_nb = udi_cdc_tx_buf_nb[port][buf_sel];
 	copy_nb = UDI_CDC_TX_BUFFERS - buf_nb;
@@ -1079,7 +1155,8 @@ udi_cdc_write_buf_loop_wait:
 	}
 	memcpy(&udi_cdc_tx_buf[port][buf_sel][buf_nb], ptr_buf, copy_nb);
 	udi_cdc_tx_buf_nb[port][buf_sel] = buf_nb + copy_nb;
-	cpu_irq_restore(flags);
+	udi_cdc_tx_note_peak(port);
+	udi_cdc_irq_restore(flags);
 
 	// Update buffer pointer
 	ptr_buf = ptr_buf + copy_nb;
@@ -1097,4 +1174,216 @@ iram_size_t udi_cdc_write_buf(const void* buf, iram_size_t size)
 	return udi_cdc_multi_write_buf(0, buf, size);
 }
 
+//! Local change: copy what fits in the TX buffers without waiting
+static iram_size_t udi_cdc_tx_copy(uint8_t port, const uint8_t *buf, iram_size_t size)
+{
+	irqflags_t flags;
+	uint8_t buf_sel;
+	uint16_t buf_nb;
+	iram_size_t copy_nb;
+
+	// Also moves to the other buffer once the selected one is full
+	if (!udi_cdc_multi_is_tx_ready(port)) {
+		return 0;
+	}
+
+	flags = udi_cdc_irq_save();
+	buf_sel = udi_cdc_tx_buf_sel[port];
+	buf_nb = udi_cdc_tx_buf_nb[port][buf_sel];
+	copy_nb = UDI_CDC_TX_BUFFERS - buf_nb;
+	if (copy_nb > size) {
+		copy_nb = size;
+	}
+	memcpy(&udi_cdc_tx_buf[port][buf_sel][buf_nb], buf, copy_nb);
+	udi_cdc_tx_buf_nb[port][buf_sel] = buf_nb + copy_nb;
+	udi_cdc_tx_note_peak(port);
+	udi_cdc_irq_restore(flags);
+	return copy_nb;
+}
+
+iram_size_t udi_cdc_multi_write_buf_timeout(uint8_t port, const void* buf, iram_size_t size, uint16_t timeout_ms)
+{
+	const uint8_t *ptr_buf = buf;
+	uint32_t start;
+
+#if UDI_CDC_PORT_NB == 1 // To optimize code
+	port = 0;
+#endif
+
+	start = udi_cdc_frames;
+	while (size && udi_cdc_data_running) {
+		iram_size_t copy_nb = udi_cdc_tx_copy(port, ptr_buf, size);
+		if (copy_nb) {
+			ptr_buf += copy_nb;
+			size -= copy_nb;
+			start = udi_cdc_frames;
+		} else if (udi_cdc_frames - start >= timeout_ms) {
+			break;
+		}
+	}
+	return size;
+}
+
+int udi_cdc_multi_putc_timeout(uint8_t port, int value, uint16_t timeout_ms)
+{
+	uint8_t bytes[2] = { value, value >> 8 };
+
+#if UDI_CDC_PORT_NB == 1 // To optimize code
+	port = 0;
+#endif
+
+	// A 9 bit value is sent LSB first like udi_cdc_multi_putc()
+	iram_size_t size = (9 == udi_cdc_line_coding[port].bDataBits) ? 2 : 1;
+	return udi_cdc_multi_write_buf_timeout(port, bytes, size, timeout_ms) == 0;
+}
+
+iram_size_t udi_cdc_multi_write_direct(uint8_t port, const void* buf, iram_size_t size)
+{
+	irqflags_t flags;
+	udd_ep_id_t ep;
+
+#if UDI_CDC_PORT_NB == 1 // To optimize code
+	port = 0;
+#endif
+
+	if (size == 0) {
+		return 0;
+	}
+
+udi_cdc_write_direct_loop_wait:
+	// Wait until the buffered data has been sent
+	flags = udi_cdc_irq_save();
+	if (udi_cdc_tx_trans_ongoing[port]
+			|| udi_cdc_tx_buf_nb[port][0]
+			|| udi_cdc_tx_buf_nb[port][1]) {
+		udi_cdc_irq_restore(flags);
+		if (!udi_cdc_data_running) {
+			return size;
+		}
+		goto udi_cdc_write_direct_loop_wait;
+	}
+	// Take the endpoint, udi_cdc_tx_send() stays idle until the end
+	udi_cdc_tx_trans_ongoing[port] = true;
+	udi_cdc_tx_direct[port] = true;
+	udi_cdc_irq_restore(flags);
+
+	switch (port) {
+#define UDI_CDC_PORT_TO_DATA_EP_IN(index, unused) \
+	case index: \
+		ep = UDI_CDC_DATA_EP_IN_##index; \
+		break;
+	MREPEAT(UDI_CDC_PORT_NB, UDI_CDC_PORT_TO_DATA_EP_IN, ~)
+#undef UDI_CDC_PORT_TO_DATA_EP_IN
+	default:
+		ep = UDI_CDC_DATA_EP_IN_0;
+		break;
+	}
+	if (!udd_ep_run(ep, false, (uint8_t *)buf, size, udi_cdc_data_sent)) {
+		udi_cdc_tx_direct[port] = false;
+		udi_cdc_tx_trans_ongoing[port] = false;
+		return size;
+	}
+
+	// The caller buffer is used by the endpoint until the end of transfer
+	while (udi_cdc_tx_direct[port]) {
+		if (!udi_cdc_data_running) {
+			return size;
+		}
+	}
+	return 0;
+}
+
+iram_size_t udi_cdc_multi_write_direct_timeout(uint8_t port, const void* buf, iram_size_t size, uint16_t timeout_ms)
+{
+	irqflags_t flags;
+	udd_ep_id_t ep;
+	uint32_t start;
+
+#if UDI_CDC_PORT_NB == 1 // To optimize code
+	port = 0;
+#endif
+
+	if (size == 0) {
+		return 0;
+	}
+
+	// Wait until the buffered data has been sent
+	start = udi_cdc_frames;
+	while (1) {
+		if (!udi_cdc_data_running) {
+			return size;
+		}
+		flags = udi_cdc_irq_save();
+		if (!udi_cdc_tx_trans_ongoing[port]
+				&& !udi_cdc_tx_buf_nb[port][0]
+				&& !udi_cdc_tx_buf_nb[port][1]) {
+			break;
+		}
+		udi_cdc_irq_restore(flags);
+		if (udi_cdc_frames - start >= timeout_ms) {
+			return size;
+		}
+	}
+	// Take the endpoint, udi_cdc_tx_send() stays idle until the end
+	udi_cdc_tx_trans_ongoing[port] = true;
+	udi_cdc_tx_direct[port] = true;
+	udi_cdc_irq_restore(flags);
+
+	switch (port) {
+#define UDI_CDC_PORT_TO_DATA_EP_IN(index, unused) \
+	case index: \
+		ep = UDI_CDC_DATA_EP_IN_##index; \
+		break;
+	MREPEAT(UDI_CDC_PORT_NB, UDI_CDC_PORT_TO_DATA_EP_IN, ~)
+#undef UDI_CDC_PORT_TO_DATA_EP_IN
+	default:
+		ep = UDI_CDC_DATA_EP_IN_0;
+		break;
+	}
+	if (!udd_ep_run(ep, false, (uint8_t *)buf, size, udi_cdc_data_sent)) {
+		udi_cdc_tx_direct[port] = false;
+		udi_cdc_tx_trans_ongoing[port] = false;
+		return size;
+	}
+
+	// The transfer gets one more frame per 8 packets, well under what a
+	// full-speed bulk endpoint moves in a frame.  The endpoint must be done
+	// with the caller buffer on return, so a transfer that runs over is
+	// aborted.
+	start = udi_cdc_frames;
+	while (udi_cdc_tx_direct[port]) {
+		if (!udi_cdc_data_running) {
+			return size;
+		}
+		if (udi_cdc_frames - start >= timeout_ms + size / (8 * UDI_CDC_DATA_EPS_FS_SIZE)) {
+			udd_ep_abort(ep);
+			return size;
+		}
+	}
+	return 0;
+}
+
+iram_size_t udi_cdc_write_direct(const void* buf, iram_size_t size)
+{
+	return udi_cdc_multi_write_direct(0, buf, size);
+}
+
+iram_size_t udi_cdc_multi_get_peaks(uint8_t port, iram_size_t *tx, iram_size_t *rx, bool clear)
+{
+	irqflags_t flags;
+
+#if UDI_CDC_PORT_NB == 1 // To optimize code
+	port = 0;
+#endif
+	flags = udi_cdc_irq_save();
+	*tx = udi_cdc_tx_peak[port];
+	*rx = udi_cdc_rx_peak[port];
+	if (clear) {
+		udi_cdc_tx_peak[port] = 0;
+		udi_cdc_rx_peak[port] = 0;
+	}
+	udi_cdc_irq_restore(flags);
+	return 2 * UDI_CDC_TX_BUFFERS;
+}
+
 //@}
@@ -440,6 +440,21 @@ int udi_cdc_putc(int value);
  * \return the number of data remaining
  */
 iram_size_t udi_cdc_write_buf(const void* buf, iram_size_t size);
+
+/**
+ * \brief Writes a RAM buffer on CDC line without copy
+ *
+ * The buffer is given directly to the data IN endpoint, after the data
+ * already stored in the TX buffers has been sent. The function returns
+ * at the end of transfer, so the buffer can be reused after the call.
+ * The 9 bits data mode is not handled: values are sent as bytes.
+ *
+ * \param buf       Values to write
+ * \param size      Number of value to write
+ *
+ * \return the number of data remaining
+ */
+iram_size_t udi_cdc_write_direct(const void* buf, iram_size_t size);
 //@}
 
 /**
@@ -562,6 +577,76 @@ int udi_cdc_multi_putc(uint8_t port, int value);
  * \return the number of data remaining
  */
 iram_size_t udi_cdc_multi_write_buf(uint8_t port, const void* buf, iram_size_t size);
+
+/**
+ * \brief Writes a RAM buffer on CDC line without copy
+ *
+ * \param port       Communication port number to manage
+ * \param buf       Values to write
+ * \param size      Number of value to write
+ *
+ * \return the number of data remaining
+ */
+iram_size_t udi_cdc_multi_write_direct(uint8_t port, const void* buf, iram_size_t size);
+
+/**
+ * \brief Puts a byte on CDC line, giving up after a timeout (local change)
+ *
+ * \param port       Communication port number to manage
+ * \param value      Value to put
+ * \param timeout_ms Frames to wait for room in the TX buffers, 0 to not wait
+ *
+ * \return \c 1 if the value was put, otherwise \c 0.
+ */
+int udi_cdc_multi_putc_timeout(uint8_t port, int value, uint16_t timeout_ms);
+
+/**
+ * \brief Writes a RAM buffer on CDC line, giving up after a timeout
+ * (local change)
+ *
+ * Copies as much as the TX buffers take and waits for more room for at
+ * most timeout_ms frames without progress, so a host that stops reading
+ * cannot hold the caller.  The 9 bits data mode is not handled: values
+ * are sent as bytes.
+ *
+ * \param port       Communication port number to manage
+ * \param buf        Values to write
+ * \param size       Number of value to write
+ * \param timeout_ms Frames to wait without progress, 0 to not wait
+ *
+ * \return the number of data remaining, the tail of buf that was not written
+ */
+iram_size_t udi_cdc_multi_write_buf_timeout(uint8_t port, const void* buf, iram_size_t size, uint16_t timeout_ms);
+
+/**
+ * \brief Writes a RAM buffer on CDC line without copy, giving up after a
+ * timeout (local change)
+ *
+ * Waits at most timeout_ms frames for the TX buffers to drain, then gives
+ * the transfer timeout_ms frames plus one per 512 bytes and aborts it
+ * when it runs over.  Any part of the buffer may have been sent when it
+ * fails.
+ *
+ * \param port       Communication port number to manage
+ * \param buf        Values to write
+ * \param size       Number of value to write
+ * \param timeout_ms Frames to wait
+ *
+ * \return \c 0 once the whole buffer is sent, otherwise size
+ */
+iram_size_t udi_cdc_multi_write_direct_timeout(uint8_t port, const void* buf, iram_size_t size, uint16_t timeout_ms);
+
+/**
+ * \brief Reads the buffer high-water marks (local change)
+ *
+ * \param port       Communication port number to manage
+ * \param tx         Most bytes held in the TX buffers at once
+ * \param rx         Most received bytes waiting to be read at once
+ * \param clear      Restart both marks from 0
+ *
+ * \return the size of the TX and of the RX buffers
+ */
+iram_size_t udi_cdc_multi_get_peaks(uint8_t port, iram_size_t *tx, iram_size_t *rx, bool clear);
 //@}
 
 //@}
@@ -196,6 +196,24 @@ uint8_t udd_getaddress(void);
  */
 uint16_t udd_get_frame_number(void);
 
+/**
+ * \brief Returns the bytes sent by completed IN transfers since reset
+ *
+ * The count wraps at 32 bits; callers work with differences.
+ *
+ * \return IN bytes sent on the data endpoints
+ */
+uint32_t udd_get_in_bytes(void);
+
+/**
+ * \brief Returns the bytes received by completed OUT transfers since reset
+ *
+ * The count wraps at 32 bits; callers work with differences.
+ *
+ * \return OUT bytes received on the data endpoints
+ */
+uint32_t udd_get_out_bytes(void);
+
 /**
  * \brief Returns the current micro start of frame number
  *
@@ -45,6 +45,7 @@
 #include "sysclk.h"
 #include "udd.h"
 #include "udp_device.h"
+#include "trace.h"
 #include <string.h>
 
 #ifndef UDD_NO_SLEEP_MGR
@@ -349,6 +350,10 @@ typedef struct {
 //! Array to register a job on bulk/interrupt/isochronous endpoint
 static udd_ep_job_t udd_ep_job[USB_DEVICE_MAX_EP];
 
+//! Bytes moved by completed transfers, for udd_get_in_bytes() and udd_get_out_bytes()
+static volatile uint32_t udd_in_bytes;
+static volatile uint32_t udd_out_bytes;
+
 //! \brief Reset all job table
 static void udd_ep_job_table_reset(void);
 
@@ -679,6 +684,18 @@ uint16_t udd_get_frame_number(void)
 }
 
 
+uint32_t udd_get_in_bytes(void)
+{
+	return udd_in_bytes;
+}
+
+
+uint32_t udd_get_out_bytes(void)
+{
+	return udd_out_bytes;
+}
+
+
 uint16_t udd_get_micro_frame_number(void)
 {
 	return 0;
@@ -871,7 +888,12 @@ bool udd_ep_run(udd_ep_id_t ep, bool b_shortpacket,
 	// Request first transfer
 	if (b_dir_in) {
 		if (Is_udd_in_pending(ep)) {
-			// Append more data (handled in interrupt service)
+			// The last bank of the previous job is still on the bus:
+			// load the idle bank now so the interrupt only has to mark
+			// it ready, keeping back-to-back jobs streaming
+			if (udd_get_endpoint_bank_max_nbr(ep) > 1) {
+				udd_ep_in_sent(ep, false);
+			}
 		} else {
 			// Start new, try to fill 1~2 banks before handling status
 			if (udd_ep_in_sent(ep, true)) {
@@ -1332,7 +1354,12 @@ static void udd_ep_finish_job(udd_ep_job_t * ptr_job, int status,
 	}
 	if (Is_udd_endpoint_type_in(ep_num)) {
 		ep_num |= USB_EP_DIR_IN;
-	}	
+		if (status != UDD_EP_TRANSFER_ABORT) {
+			udd_in_bytes += ptr_job->buf_size;
+		}
+	} else if (status != UDD_EP_TRANSFER_ABORT) {
+		udd_out_bytes += ptr_job->buf_size;
+	}
 	ptr_job->call_trans((status == UDD_EP_TRANSFER_ABORT) ?
 		UDD_EP_TRANSFER_ABORT : UDD_EP_TRANSFER_OK, ptr_job->buf_size, ep_num);
 }
@@ -1481,6 +1508,8 @@ static bool udd_ep_interrupt(void)
 	udd_ep_id_t ep;
 	udd_ep_job_t *ptr_job;
 
+	trace(TRACE_USB_EP, UDP->UDP_ISR);
+
 	// For each endpoint different of control endpoint (0)
 	for (ep = 1; ep <= USB_DEVICE_MAX_EP; ep++) {
 		// Check RXRDY and TXEMPTY event for none DMA endpoints
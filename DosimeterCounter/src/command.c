@@ -0,0 +1,105 @@
+#include <string.h>
+#include "command.h"
+
+// Whether p is inside the text, which ends at end or at its terminator.
+// A NULL end is never reached.
+static inline bool in_text(const char *p, const char *end)
+{
+	return p != end && *p != '\0';
+}
+
+static inline bool is_digit(const char *p, const char *end)
+{
+	return in_text(p, end) && *p >= '0' && *p <= '9';
+}
+
+static bool parse_int_to(const char **text, const char *end, int32_t *value)
+{
+	const char *p = *text;
+	while (in_text(p, end) && (*p == ' ' || *p == '\t'))
+		p++;
+
+	bool negative = in_text(p, end) && *p == '-';
+	if (in_text(p, end) && (*p == '-' || *p == '+'))
+		p++;
+
+	if (!is_digit(p, end))
+		return false;
+
+	uint32_t magnitude = 0;
+	while (is_digit(p, end))
+	{
+		uint32_t digit = *p++ - '0';
+		magnitude = magnitude > (INT32_MAX - digit) / 10 ? INT32_MAX : magnitude * 10 + digit;
+	}
+
+	*value = negative ? -(int32_t)magnitude : (int32_t)magnitude;
+	*text = p;
+	return true;
+}
+
+static uint32_t parse_code_to(const char **text, const char *end, uint32_t limit)
+{
+	const char *p = *text;
+	uint32_t code = 0;
+	if (in_text(p, end) && *p++ == 'M')
+		while (is_digit(p, end) && code <= limit)
+			code = code * 10 + (*p++ - '0');
+
+	*text = p;
+	return code;
+}
+
+static uint8_t parse_args_to(const char **text, const char *end, int32_t *argv, uint8_t max)
+{
+	uint8_t argc = 0;
+	while (argc < max && parse_int_to(text, end, &argv[argc]))
+		argc++;
+
+	return argc;
+}
+
+bool parse_int(const char **text, int32_t *value)
+{
+	return parse_int_to(text, NULL, value);
+}
+
+uint32_t parse_code(const char **text, uint32_t limit)
+{
+	return parse_code_to(text, NULL, limit);
+}
+
+uint8_t parse_args(const char **text, int32_t *argv, uint8_t max)
+{
+	return parse_args_to(text, NULL, argv, max);
+}
+
+uint32_t parse_command(const char *text, const char *end, uint32_t limit, int32_t *argv, uint8_t max,
+	uint8_t *argc)
+{
+	const char *p = text;
+	uint32_t code = parse_code_to(&p, end, limit);
+	*argc = 0;
+	if (in_text(p, end) && *p != ' ')
+		return 0;
+
+	*argc = parse_args_to(&p, end, argv, max);
+	return code;
+}
+
+bool frame_check(const uint8_t *frame, uint16_t length, frame_header_t *header)
+{
+	memcpy(header, frame, sizeof(*header));
+	// The arguments fill whole int32_t of argv, and a length past it must not
+	// wrap payload_end onto the header
+	if (header->length > COMMAND_MAX_ARGS * sizeof(int32_t) || header->length % sizeof(int32_t))
+		return false;
+
+	uint32_t payload_end = sizeof(*header) + header->length;
+	uint16_t crc;
+	if (length != payload_end + sizeof(crc))
+		return false;
+
+	memcpy(&crc, &frame[payload_end], sizeof(crc));
+	return crc == crc16_update(0xFFFF, frame, payload_end);
+}
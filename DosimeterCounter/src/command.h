@@ -0,0 +1,60 @@
+#ifndef COMMAND_H_INCLUDED
+#define COMMAND_H_INCLUDED
+
+// Command syntax and framing, kept free of ASF and register access so
+// that it also builds natively on a host for benchmarking and fuzzing.
+#include <stdbool.h>
+#include <stdint.h>
+#include "crc.h"
+
+// Binary command protocol (see M1028).  Frames in both directions are a
+// frame_header_t, length payload bytes and the CRC-16 of header and payload.
+// Reply frames carry the same text a command replies with in text mode.
+#define FRAME_SYNC_COMMAND 0xA5
+#define FRAME_SYNC_REPLY 0x5A
+
+// Most arguments taken by any command, and so a command frame's payload
+// in int32_t; main.c checks that M1040's ranges fit
+#define COMMAND_MAX_ARGS 10
+
+// More reply frames (or binary data) for the same command follow
+#define FRAME_FLAG_MORE 0x01
+// The command frame was corrupt or named an unknown command
+#define FRAME_FLAG_ERROR 0x02
+
+typedef struct
+{
+	uint8_t sync;      // FRAME_SYNC_*
+	uint8_t opcode;    // M-code - 1000
+	uint8_t sequence;  // Chosen by the host, echoed in the reply frames
+	uint8_t flags;     // FRAME_FLAG_*, 0 in command frames
+	uint16_t length;   // Payload length in bytes
+} frame_header_t;
+
+// Parse a decimal integer, skipping leading spaces, and advance *text past it.
+// Returns false and leaves *value untouched if there is no number.
+// Values beyond the int32_t range saturate, so range checks still reject them.
+bool parse_int(const char **text, int32_t *value);
+
+// Read "M<code>" from the start of a line, leaving *text after the digits.
+// Digits stop being accumulated once the code exceeds limit.
+uint32_t parse_code(const char **text, uint32_t limit);
+
+// Parse up to max integers into argv, returning how many were found
+uint8_t parse_args(const char **text, int32_t *argv, uint8_t max);
+
+// Split one command, "M<code>" then a space and its arguments, reading no
+// further than end (NULL for up to the terminator), so a command of a
+// batch is parsed where it lies.  Up to max arguments go into argv and
+// their number into *argc.  Returns the code, or 0 if anything but a
+// space follows its digits.  Nothing is kept between calls or taken
+// from the heap, so any context may parse with its own argv.
+uint32_t parse_command(const char *text, const char *end, uint32_t limit, int32_t *argv, uint8_t max,
+	uint8_t *argc);
+
+// Copy the header out of a received frame of length bytes and check
+// that the length and CRC agree with it and that the payload is whole
+// arguments, at most COMMAND_MAX_ARGS
+bool frame_check(const uint8_t *frame, uint16_t length, frame_header_t *header);
+
+#endif /* COMMAND_H_INCLUDED */
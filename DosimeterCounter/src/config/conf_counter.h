@@ -0,0 +1,166 @@
+#ifndef CONF_COUNTER_H_INCLUDED
+#define CONF_COUNTER_H_INCLUDED
+
+#include <compiler.h>
+
+// Board description: every TC channel and input pin the counter uses.
+// A board variant is a change to this file alone.  main.c builds its
+// channel tables, peripheral setup and TC interrupt handlers from it,
+// so they cannot disagree with each other, and the checks at the end
+// reject a channel that does not exist or a unit put on a channel it
+// cannot use.
+//
+// TC channels are numbered 0 to 8 as in the datasheet: TCn is channel
+// n % 3 of block TC0, TC1 or TC2, with peripheral ID ID_TCn and handler
+// TCn_Handler.  The macros below give each of them from the number
+// alone, and are constant expressions.
+#define COUNTER_TC_COUNT 9
+#define COUNTER_TC_VALID(n) ((n) >= 0 && (n) < COUNTER_TC_COUNT)
+#define COUNTER_TC_BLOCK(n) ((n) < 3 ? TC0 : (n) < 6 ? TC1 : TC2)
+#define COUNTER_TC_CHANNEL(n) ((n) % 3)
+#define COUNTER_TC_REGS(n) (&COUNTER_TC_BLOCK(n)->TC_CHANNEL[COUNTER_TC_CHANNEL(n)])
+#define COUNTER_TC_ID(n) (ID_TC0 + (n))
+#define COUNTER_TC_IRQn(n) ((IRQn_Type)(TC0_IRQn + (n)))
+#define COUNTER_TC_HANDLER(n) COUNTER_TC_HANDLER_(n)
+#define COUNTER_TC_HANDLER_(n) TC##n##_Handler
+
+// Step/dir pair of the head, on the PIO that also takes the trigger inputs
+#define COUNTER_PIO PIOA
+#define COUNTER_PIO_ID ID_PIOA
+#define COUNTER_STEP_PIN PIO_PA15
+#define COUNTER_DIR_PIN PIO_PA14
+
+// Step/dir pair of the second axis, which selects the row
+#define ROW_STEP_PIN PIO_PA16
+#define ROW_DIR_PIN PIO_PA17
+
+// Sync line (M1046), start input (M1084) and home input (M1086)
+#define SYNC_IN_PIN PIO_PA24
+#define SYNC_OUT_PIN PIO_PA25
+#define START_PIN PIO_PA2
+#define HOME_PIN PIO_PA5
+
+// Counter channels in order, as X(index, tc, xc, pio, clock_pin, latch_pin):
+// TC channel tc counts the pulses on clock_pin through clock XC xc of
+// its block, and COUNT_MODE_LATCH captures on latch_pin, its TIOA.
+// The wide channels are the three of the TC0 block, which TC_BCR
+// restarts together and whose overflow interrupts extend the counts.
+// The others are given to the counters in order as COUNTER_CHANNELS
+// grows, and each must be the TC channel of its own index.
+#define COUNTER_BOARD_WIDE_CHANNELS(X) \
+	X(0, 1, 0, PIOA, PIO_PA4B_TCLK0, PIO_PA15B_TIOA1) \
+	X(1, 2, 1, PIOA, PIO_PA28B_TCLK1, PIO_PA26B_TIOA2) \
+	X(2, 0, 2, PIOA, PIO_PA29B_TCLK2, PIO_PA0B_TIOA0)
+
+#define COUNTER_BOARD_EXTRA_CHANNELS(X) \
+	X(3, 3, 0, PIOC, PIO_PC25B_TCLK3, PIO_PC23B_TIOA3) \
+	X(4, 4, 1, PIOC, PIO_PC28B_TCLK4, PIO_PC26B_TIOA4) \
+	X(5, 5, 2, PIOC, PIO_PC31B_TCLK5, PIO_PC29B_TIOA5) \
+	X(6, 6, 0, PIOC, PIO_PC7B_TCLK6, PIO_PC5B_TIOA6) \
+	X(7, 7, 1, PIOC, PIO_PC10B_TCLK7, PIO_PC8B_TIOA7) \
+	X(8, 8, 2, PIOC, PIO_PC14B_TCLK8, PIO_PC11B_TIOA8)
+
+#define COUNTER_BOARD_ONE(...) + 1
+#define COUNTER_BOARD_WIDE_COUNT (0 COUNTER_BOARD_WIDE_CHANNELS(COUNTER_BOARD_ONE))
+#define COUNTER_BOARD_CHANNEL_COUNT (COUNTER_BOARD_WIDE_COUNT \
+	COUNTER_BOARD_EXTRA_CHANNELS(COUNTER_BOARD_ONE))
+
+// Step-edge capture (COUNT_MODE_CAPTURE): the channel given up by the
+// tertiary counter, loading RA on its TIOA
+#define CAPTURE_TC_NUMBER 0
+#define CAPTURE_PIO PIOA
+#define CAPTURE_PIN PIO_PA0B_TIOA0
+
+// Quadrature decoder (COUNTER_POSITION_QDEC), on channel 0 of a block
+// and the channel after it, with PHA and PHB on TIOA and TIOB
+#define QDEC_TC_NUMBER 6
+#define QDEC_PIO PIOC
+#define QDEC_PIO_ID ID_PIOC
+#define QDEC_PINS (PIO_PC5B_TIOA6 | PIO_PC6B_TIOB6)
+
+// Step check counter, clocked by XC0, i.e. the first TCLK of its block
+#define STEP_CHECK_TC_NUMBER 6
+#define STEP_CHECK_PIO PIOC
+#define STEP_CHECK_PIO_ID ID_PIOC
+#define STEP_CHECK_PIN PIO_PC7B_TCLK6
+
+// Time-based acquisition (M1032)
+#define TIMED_TC_NUMBER 4
+
+// Load generator outputs (M1043) on TIOA, output 0 also stepping the
+// scans (M1088), and the M1042 benchmark
+#define GENERATOR_PIO PIOC
+#define GENERATOR_OUTPUT0_TC 5
+#define GENERATOR_OUTPUT0_PIN PIO_PC29B_TIOA5
+#define GENERATOR_OUTPUT1_TC 3
+#define GENERATOR_OUTPUT1_PIN PIO_PC23B_TIOA3
+#define GENERATOR_OUTPUT2_TC 7
+#define GENERATOR_OUTPUT2_PIN PIO_PC8B_TIOA7
+#define GENERATOR_OUTPUT3_TC 8
+#define GENERATOR_OUTPUT3_PIN PIO_PC11B_TIOA8
+#define BENCH_TC_NUMBER 5
+#define BENCH_PIO PIOC
+#define BENCH_PIN PIO_PC29B_TIOA5
+
+// Pulse capture (M1070), sharing the timer of generator output 3
+#define PULSE_TC_NUMBER 8
+#define PULSE_PIO PIOC
+#define PULSE_PIN PIO_PC11B_TIOA8
+
+// Self-test pulse train (M1127), on the timer of generator output 1 in
+// the block of the time-based acquisition
+#define SELFTEST_TC_NUMBER 3
+#define SELFTEST_PIO PIOC
+#define SELFTEST_PIN PIO_PC23B_TIOA3
+
+// Checks on the description, all at compile time
+#if !COUNTER_TC_VALID(CAPTURE_TC_NUMBER) || !COUNTER_TC_VALID(QDEC_TC_NUMBER) \
+	|| !COUNTER_TC_VALID(STEP_CHECK_TC_NUMBER) || !COUNTER_TC_VALID(TIMED_TC_NUMBER) \
+	|| !COUNTER_TC_VALID(GENERATOR_OUTPUT0_TC) || !COUNTER_TC_VALID(GENERATOR_OUTPUT1_TC) \
+	|| !COUNTER_TC_VALID(GENERATOR_OUTPUT2_TC) || !COUNTER_TC_VALID(GENERATOR_OUTPUT3_TC) \
+	|| !COUNTER_TC_VALID(BENCH_TC_NUMBER) || !COUNTER_TC_VALID(PULSE_TC_NUMBER) \
+	|| !COUNTER_TC_VALID(SELFTEST_TC_NUMBER)
+#error Every TC number in conf_counter.h must be between 0 and 8
+#endif
+
+#if COUNTER_BOARD_WIDE_COUNT != 3
+#error The TC0 block gives exactly three wide counter channels
+#endif
+
+#if COUNTER_BOARD_CHANNEL_COUNT > COUNTER_TC_COUNT
+#error More counter channels than TC channels
+#endif
+
+#if COUNTER_TC_CHANNEL(QDEC_TC_NUMBER) != 0
+#error The quadrature decoder must start on channel 0 of a block
+#endif
+
+#if CAPTURE_TC_NUMBER >= 3
+#error Step-edge capture needs the PDC of the TC0 block
+#endif
+
+#if PULSE_TC_NUMBER != GENERATOR_OUTPUT3_TC
+#error Pulse capture shares the timer of generator output 3
+#endif
+
+#if SELFTEST_TC_NUMBER / 3 != TIMED_TC_NUMBER / 3 || SELFTEST_TC_NUMBER == TIMED_TC_NUMBER
+#error The self-test pulses need another channel of the block of the time-based acquisition
+#endif
+
+#define COUNTER_BOARD_CHECK_WIDE(index, tc, xc, pio, clock_pin, latch_pin) \
+	_Static_assert(tc >= 0 && tc < 3, "wide counter channel " #index " is not in the TC0 block"); \
+	_Static_assert(xc >= 0 && xc < 3, "counter channel " #index " has no clock XC" #xc); \
+	_Static_assert(index != 0 || xc == 0, "COUNT_MODE_CAPTURE counts the primary input on XC0"); \
+	_Static_assert(index != 2 || tc == CAPTURE_TC_NUMBER, "COUNT_MODE_CAPTURE takes the tertiary TC channel");
+COUNTER_BOARD_WIDE_CHANNELS(COUNTER_BOARD_CHECK_WIDE)
+
+#define COUNTER_BOARD_CHECK_EXTRA(index, tc, xc, pio, clock_pin, latch_pin) \
+	_Static_assert(tc == index, "counter channel " #index " must be TC" #index); \
+	_Static_assert(xc >= 0 && xc < 3, "counter channel " #index " has no clock XC" #xc);
+COUNTER_BOARD_EXTRA_CHANNELS(COUNTER_BOARD_CHECK_EXTRA)
+
+#define COUNTER_BOARD_WIDE_BIT(index, tc, ...) | 1u << (tc)
+_Static_assert((0 COUNTER_BOARD_WIDE_CHANNELS(COUNTER_BOARD_WIDE_BIT)) == 7,
+	"the wide counter channels must be the three TC0 channels, once each");
+
+#endif /* CONF_COUNTER_H_INCLUDED */
@@ -59,6 +59,9 @@
 #define  USB_DEVICE_POWER                 100 // Consumption on Vbus line (mA)
 #define  USB_DEVICE_ATTR                  USB_CONFIG_ATTR_BUS_POWERED
 
+//! Below the counting interrupts (see COUNTER_IRQ_PRIORITY in main.c)
+#define  UDD_USB_INT_LEVEL                5
+
 //! USB Device string definitions (Optional)
 #define  USB_DEVICE_MANUFACTURE_NAME      "VUW"
 #define  USB_DEVICE_PRODUCT_NAME          "2D Dosimeter counter"
@@ -83,8 +86,8 @@
  */
 // #define  UDC_VBUS_EVENT(b_vbus_high)      user_callback_vbus_action(b_vbus_high)
 // extern void user_callback_vbus_action(bool b_vbus_high);
-// #define  UDC_SOF_EVENT()                  user_callback_sof_action()
-// extern void user_callback_sof_action(void);
+#define  UDC_SOF_EVENT()                  main_sof_action()
+extern void main_sof_action(void);
 // #define  UDC_SUSPEND_EVENT()              user_callback_suspend_action()
 // extern void user_callback_suspend_action(void);
 // #define  UDC_RESUME_EVENT()               user_callback_resume_action()
@@ -106,18 +109,44 @@
  * USB Interface Configuration
  * @{
  */
+
+//! 1 to add a read-only mass storage interface (udi_msc.c) showing the
+//! scan log as files (msc_fat.c), in place of the second CDC port
+#ifndef USB_MSC_ENABLE
+#define  USB_MSC_ENABLE 0
+#endif
+
+//! 1 to add a DFU interface (udi_dfu.c) that takes a new program image
+//! over the control pipe, e.g. dfu-util -d 03eb:2404 -D DosimeterCounter.bin
+#ifndef USB_DFU_ENABLE
+#define  USB_DFU_ENABLE 1
+#endif
 /**
  * Configuration of CDC interface
  * @{
  */
 
-//! Number of communication port used (1 to 3)
+//! Number of communication ports used (1 or 2).  Port 0 carries the
+//! commands; a second port can carry binary data instead (M1027 2), so
+//! the host reads it on its own thread.  The UDP has endpoints for no
+//! more than two ports next to the vendor bulk interface, so the
+//! mass storage interface below takes the second port's endpoints.
+#if USB_MSC_ENABLE
 #define  UDI_CDC_PORT_NB 1
+#else
+#define  UDI_CDC_PORT_NB 2
+#endif
 
 //! Interface callback definition
-#define  UDI_CDC_ENABLE_EXT(port)          stdio_usb_enable()
-#define  UDI_CDC_DISABLE_EXT(port)         stdio_usb_disable()
-#define  UDI_CDC_RX_NOTIFY(port)
+#define  UDI_CDC_ENABLE_EXT(port)          main_cdc_enable(port)
+extern bool main_cdc_enable(uint8_t port);
+#define  UDI_CDC_DISABLE_EXT(port)         main_cdc_disable(port)
+extern void main_cdc_disable(uint8_t port);
+#define  UDI_CDC_RX_NOTIFY(port)          main_cdc_rx_notify(port)
+extern void main_cdc_rx_notify(uint8_t port);
+//! Returns false to take a received packet out of the stream
+#define  UDI_CDC_RX_FILTER(port, data, length) main_cdc_rx_filter(port, data, length)
+extern bool main_cdc_rx_filter(uint8_t port, const uint8_t *data, uint32_t length);
 #define  UDI_CDC_TX_EMPTY_NOTIFY(port)
 #define  UDI_CDC_SET_CODING_EXT(port,cfg)
 #define  UDI_CDC_SET_DTR_EXT(port,set)
@@ -139,8 +168,13 @@
 // extern void my_callback_cdc_set_rts(uint8_t port, bool b_enable);
 
 //! Define it when the transfer CDC Device to Host is a low rate (<512000 bauds)
-//! to reduce CDC buffers size
-#define  UDI_CDC_LOW_RATE
+//! to reduce CDC buffers size. Left undefined so readouts get the
+//! 5-packet (320 byte) double TX buffers.
+// #define  UDI_CDC_LOW_RATE
+
+//! Local change: frames (ms) a write waits on a host that has stopped
+//! reading before it gives up (main.c and reply.c)
+#define  UDI_CDC_TX_TIMEOUT_MS            100
 
 //! Default configuration of communication port
 #define  UDI_CDC_DEFAULT_RATE             115200
@@ -150,6 +184,41 @@
 //@}
 //@}
 
+/**
+ * Configuration of the vendor bulk interface (udi_vendor_bulk.c)
+ * used to send count data next to the CDC command port
+ * @{
+ */
+#if UDI_CDC_PORT_NB > 1
+#define  UDI_VENDOR_BULK_EP_IN            (7 | USB_EP_DIR_IN)
+#else
+#define  UDI_VENDOR_BULK_EP_IN            (4 | USB_EP_DIR_IN)
+#endif
+#define  UDI_VENDOR_BULK_IFACE_NUMBER     (2 * UDI_CDC_PORT_NB)
+//@}
+
+/**
+ * Configuration of the mass storage interface (udi_msc.c), after the
+ * vendor bulk interface
+ * @{
+ */
+#define  UDI_MSC_EP_IN                    (5 | USB_EP_DIR_IN)
+#define  UDI_MSC_EP_OUT                   (6 | USB_EP_DIR_OUT)
+#define  UDI_MSC_IFACE_NUMBER             (UDI_VENDOR_BULK_IFACE_NUMBER + 1)
+//@}
+
+/**
+ * Configuration of the DFU interface (udi_dfu.c), the last one.  It has
+ * no endpoints of its own.
+ * @{
+ */
+#define  UDI_DFU_IFACE_NUMBER             (UDI_VENDOR_BULK_IFACE_NUMBER + 1 + USB_MSC_ENABLE)
+//! False to refuse the flash programming, which masks the interrupts
+//! for each page, while an acquisition runs
+#define  UDI_DFU_ALLOWED_EXT()            main_dfu_allowed()
+extern bool main_dfu_allowed(void);
+//@}
+
 
 /**
  * USB Device Driver Configuration
@@ -161,4 +230,9 @@
 #include <udi_cdc_conf.h>
 #include <stdio_usb.h>
 
+//! udi_cdc_conf.h only counts the CDC endpoints, add the vendor bulk IN
+//! and the mass storage pair
+#undef   USB_DEVICE_MAX_EP
+#define  USB_DEVICE_MAX_EP                (3 * UDI_CDC_PORT_NB + 1 + 2 * USB_MSC_ENABLE)
+
 #endif // _CONF_USB_H_
@@ -0,0 +1,24 @@
+#ifndef CRC_H_INCLUDED
+#define CRC_H_INCLUDED
+
+// Checksums of the command frames and readouts, four bytes per step.
+// Free of ASF like command.c, so both also build on a host.
+#include <stdint.h>
+
+// CRC-16/CCITT (polynomial 0x1021, initial value 0xFFFF)
+uint16_t crc16_update(uint16_t crc, const uint8_t *data, uint32_t length);
+
+// The CRC-16 is linear, so that of a || b is the CRC of a run on over as
+// many zero bytes as b has, xor that of b from 0.  crc16_zeros runs a CRC
+// on over length zero bytes; crc16_shift_table gives the same run as 16
+// values, one per bit of the CRC, and crc16_shift applies them in 16
+// steps whatever the length.
+uint16_t crc16_zeros(uint16_t crc, uint32_t length);
+void crc16_shift_table(uint16_t shift[16], uint32_t length);
+uint16_t crc16_shift(const uint16_t shift[16], uint16_t crc);
+
+// CRC-32 as in zlib and Ethernet (reflected polynomial 0xEDB88320).
+// Start from 0 and feed the result back in to continue.
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, uint32_t length);
+
+#endif /* CRC_H_INCLUDED */
@@ -0,0 +1,569 @@
+#include <asf.h>
+#include <string.h>
+#include "eth.h"
+#include "profile.h"
+
+#define ETH_PIO PIOD
+#define ETH_PIO_ID ID_PIOD
+// All 18 MII signals; the header names PD6 GRX0 although it is GRX1
+#define ETH_PINS (PIO_PD0A_GTXCK | PIO_PD1A_GTXEN | PIO_PD2A_GTX0 | PIO_PD3A_GTX1 \
+	| PIO_PD4A_GRXDV | PIO_PD5A_GRX0 | PIO_PD6A_GRX0 | PIO_PD7A_GRXER \
+	| PIO_PD8A_GMDC | PIO_PD9A_GMDIO | PIO_PD10A_GCRS | PIO_PD11A_GRX2 \
+	| PIO_PD12A_GRX3 | PIO_PD13A_GCOL | PIO_PD14A_GRXCK | PIO_PD15A_GTX2 \
+	| PIO_PD16A_GTX3 | PIO_PD17A_GTXER)
+
+// IEEE 802.3 clause 22 PHY registers
+#define PHY_BMCR 0
+#define PHY_BMSR 1
+#define PHY_ID1 2
+#define PHY_ANAR 4
+#define PHY_ANLPAR 5
+#define PHY_BMCR_ANENABLE 0x1000
+#define PHY_BMCR_ANRESTART 0x0200
+#define PHY_BMSR_LINK 0x0004
+#define PHY_ANAR_100FULL 0x0100
+#define PHY_ANAR_100HALF 0x0080
+#define PHY_ANAR_10FULL 0x0040
+
+// Link state is read from the PHY every ETH_LINK_POLL_MS
+#define ETH_LINK_POLL_MS 100
+
+// Only wakes the main loop, so below USB and the counting interrupts
+#define ETH_IRQ_PRIORITY 6
+
+// Whole frames fit one receive buffer (DRBS counts 64-byte units)
+#define ETH_RX_BUFFERS 4
+#define ETH_RX_BUFFER_BYTES 1536
+
+// Each frame takes two descriptors: the headers in the slot, then the
+// payload, either later in the slot or wherever the caller's data is
+#define ETH_TX_SLOTS 4
+
+// Receive descriptor bits
+#define RX_OWNERSHIP 0x00000001
+#define RX_WRAP 0x00000002
+#define RX_LENGTH_MASK 0x00001FFF
+#define RX_SOF 0x00004000
+#define RX_EOF 0x00008000
+
+// Transmit descriptor bits
+#define TX_LENGTH_MASK 0x00003FFF
+#define TX_LAST 0x00008000
+#define TX_WRAP 0x40000000
+#define TX_USED 0x80000000
+
+#define ETHERTYPE_IPV4 0x0800
+#define ETHERTYPE_ARP 0x0806
+#define IP_PROTOCOL_ICMP 1
+#define IP_PROTOCOL_UDP 17
+#define ICMP_ECHO_REQUEST 8
+#define ICMP_ECHO_REPLY 0
+
+typedef struct
+{
+	uint32_t address;
+	uint32_t status;
+} eth_descriptor_t;
+
+COMPILER_PACK_SET(1)
+typedef struct
+{
+	uint8_t destination[6];
+	uint8_t source[6];
+	uint16_t type;  // Big-endian, as every multi-byte field on the wire
+} eth_header_t;
+
+typedef struct
+{
+	uint8_t version_length;
+	uint8_t tos;
+	uint16_t length;
+	uint16_t id;
+	uint16_t fragment;
+	uint8_t ttl;
+	uint8_t protocol;
+	uint16_t checksum;
+	uint8_t source[4];
+	uint8_t destination[4];
+} ip_header_t;
+
+typedef struct
+{
+	uint16_t source;
+	uint16_t destination;
+	uint16_t length;
+	uint16_t checksum;
+} udp_header_t;
+
+typedef struct
+{
+	uint16_t hardware;
+	uint16_t protocol;
+	uint8_t hardware_length;
+	uint8_t protocol_length;
+	uint16_t operation;
+	uint8_t sender_mac[6];
+	uint8_t sender_ip[4];
+	uint8_t target_mac[6];
+	uint8_t target_ip[4];
+} arp_packet_t;
+
+// Headers of a stream datagram, all sent from the slot
+typedef struct
+{
+	eth_header_t eth;
+	ip_header_t ip;
+	udp_header_t udp;
+	uint32_t offset;  // Little-endian, like the rest of the stream
+} stream_headers_t;
+COMPILER_PACK_RESET()
+
+#define ETH_MIN_FRAME_BYTES 60
+#define ETH_SLOT_BYTES (sizeof(stream_headers_t) + ETH_CHUNK_BYTES)
+
+static COMPILER_ALIGNED(8) eth_descriptor_t eth_rx_descriptors[ETH_RX_BUFFERS];
+static COMPILER_ALIGNED(8) eth_descriptor_t eth_tx_descriptors[2 * ETH_TX_SLOTS];
+static COMPILER_WORD_ALIGNED uint8_t eth_rx_buffers[ETH_RX_BUFFERS][ETH_RX_BUFFER_BYTES];
+static COMPILER_WORD_ALIGNED uint8_t eth_tx_slots[ETH_TX_SLOTS][ETH_SLOT_BYTES];
+
+static uint8_t eth_rx_next;
+static uint8_t eth_tx_next;
+
+static uint8_t eth_phy;
+static bool eth_running;
+static bool eth_link;
+static uint32_t eth_link_checked;
+
+static uint8_t eth_ip[4] = ETH_DEFAULT_IP;
+static uint8_t eth_mac[6];
+
+// Where the stream goes: the source of the last command datagram
+static bool eth_peer_known;
+static uint8_t eth_peer_mac[6];
+static uint8_t eth_peer_ip[4];
+static uint16_t eth_peer_port;
+static uint32_t eth_stream_offset;
+static uint16_t eth_ip_id;
+
+static uint16_t phy_read(uint8_t reg)
+{
+	GMAC->GMAC_MAN = GMAC_MAN_CLTTO | GMAC_MAN_OP(2) | GMAC_MAN_WTN(2)
+		| GMAC_MAN_PHYA(eth_phy) | GMAC_MAN_REGA(reg);
+	while (!(GMAC->GMAC_NSR & GMAC_NSR_IDLE))
+		;
+	return (uint16_t)GMAC->GMAC_MAN;
+}
+
+static void phy_write(uint8_t reg, uint16_t value)
+{
+	GMAC->GMAC_MAN = GMAC_MAN_CLTTO | GMAC_MAN_OP(1) | GMAC_MAN_WTN(2)
+		| GMAC_MAN_PHYA(eth_phy) | GMAC_MAN_REGA(reg) | GMAC_MAN_DATA(value);
+	while (!(GMAC->GMAC_NSR & GMAC_NSR_IDLE))
+		;
+}
+
+// One's complement sum for the IP and ICMP checksums
+static uint16_t ip_checksum(const void *data, uint32_t length)
+{
+	const uint8_t *p = data;
+	uint32_t sum = 0;
+	for (; length > 1; length -= 2, p += 2)
+		sum += (p[0] << 8) | p[1];
+	if (length)
+		sum += p[0] << 8;
+	while (sum >> 16)
+		sum = (sum & 0xFFFF) + (sum >> 16);
+	return swap16(~sum);
+}
+
+void eth_set_address(const uint8_t *ip)
+{
+	memcpy(eth_ip, ip, sizeof(eth_ip));
+
+	// Locally administered, unique as long as the IP addresses are
+	eth_mac[0] = 0x02;
+	eth_mac[1] = 0x44;
+	eth_mac[2] = 0x43;
+	memcpy(&eth_mac[3], &eth_ip[1], 3);
+
+	GMAC->GMAC_SA[0].GMAC_SAB = eth_mac[0] | (eth_mac[1] << 8) | (eth_mac[2] << 16) | (eth_mac[3] << 24);
+	GMAC->GMAC_SA[0].GMAC_SAT = eth_mac[4] | (eth_mac[5] << 8);
+	eth_peer_known = false;
+}
+
+const uint8_t *eth_address(void)
+{
+	return eth_ip;
+}
+
+bool eth_init(void)
+{
+	pmc_enable_periph_clk(ETH_PIO_ID);
+	pio_configure(ETH_PIO, PIO_TYPE_PIO_PERIPH_A, ETH_PINS, 0);
+	pmc_enable_periph_clk(ID_GMAC);
+
+	GMAC->GMAC_NCR = 0;
+	GMAC->GMAC_IDR = UINT32_MAX;
+	GMAC->GMAC_NCR = GMAC_NCR_CLRSTAT;
+	GMAC->GMAC_RSR = GMAC_RSR_BNA | GMAC_RSR_REC | GMAC_RSR_RXOVR | GMAC_RSR_HNO;
+	GMAC->GMAC_TSR = UINT32_MAX;
+	(void)GMAC->GMAC_ISR;
+
+	// MII, MDC at MCK / 48 (2 MHz), frames stored without their FCS
+	GMAC->GMAC_UR = GMAC_UR_RMIIMII;
+	GMAC->GMAC_NCFGR = GMAC_NCFGR_CLK_MCK_48 | GMAC_NCFGR_RFCS | GMAC_NCFGR_SPD | GMAC_NCFGR_FD;
+	GMAC->GMAC_DCFGR = GMAC_DCFGR_FBLDO_INCR4 | GMAC_DCFGR_DRBS(ETH_RX_BUFFER_BYTES / 64);
+	GMAC->GMAC_NCR = GMAC_NCR_MPE;
+
+	// First address that answers with an ID
+	for (eth_phy = 0; eth_phy < 32; eth_phy++)
+	{
+		uint16_t id = phy_read(PHY_ID1);
+		if (id != 0 && id != 0xFFFF)
+			break;
+	}
+	if (eth_phy == 32)
+	{
+		GMAC->GMAC_NCR = 0;
+		return false;
+	}
+	phy_write(PHY_BMCR, PHY_BMCR_ANENABLE | PHY_BMCR_ANRESTART);
+
+	for (uint8_t i = 0; i < ETH_RX_BUFFERS; i++)
+	{
+		eth_rx_descriptors[i].address = (uint32_t)eth_rx_buffers[i] | (i == ETH_RX_BUFFERS - 1 ? RX_WRAP : 0);
+		eth_rx_descriptors[i].status = 0;
+	}
+	for (uint8_t i = 0; i < 2 * ETH_TX_SLOTS; i++)
+	{
+		eth_tx_descriptors[i].address = 0;
+		eth_tx_descriptors[i].status = TX_USED | (i == 2 * ETH_TX_SLOTS - 1 ? TX_WRAP : 0);
+	}
+	eth_rx_next = 0;
+	eth_tx_next = 0;
+	GMAC->GMAC_RBQB = (uint32_t)eth_rx_descriptors;
+	GMAC->GMAC_TBQB = (uint32_t)eth_tx_descriptors;
+
+	eth_set_address(eth_ip);
+	eth_running = true;
+	eth_link = false;
+	eth_link_checked = profile_cycles();
+	GMAC->GMAC_IER = GMAC_IER_RCOMP;
+	NVIC_SetPriority(GMAC_IRQn, ETH_IRQ_PRIORITY);
+	NVIC_EnableIRQ(GMAC_IRQn);
+	GMAC->GMAC_NCR = GMAC_NCR_MPE | GMAC_NCR_RXEN | GMAC_NCR_TXEN;
+	return true;
+}
+
+bool eth_link_up(void)
+{
+	return eth_link;
+}
+
+void eth_poll(void)
+{
+	if (!eth_running)
+		return;
+
+	// The cycle counter stops while the main loop sleeps, so a frame
+	// arriving while the link still looks down has it checked at once
+	uint32_t now = profile_cycles();
+	if (now - eth_link_checked < sysclk_get_cpu_hz() / 1000 * ETH_LINK_POLL_MS
+		&& (eth_link || !eth_rx_pending()))
+		return;
+	eth_link_checked = now;
+
+	// BMSR latches link failures, the second read is the current state
+	phy_read(PHY_BMSR);
+	bool link = phy_read(PHY_BMSR) & PHY_BMSR_LINK;
+	if (link && !eth_link)
+	{
+		uint16_t common = phy_read(PHY_ANAR) & phy_read(PHY_ANLPAR);
+		uint32_t ncfgr = GMAC->GMAC_NCFGR & ~(GMAC_NCFGR_SPD | GMAC_NCFGR_FD);
+		if (common & (PHY_ANAR_100FULL | PHY_ANAR_100HALF))
+			ncfgr |= GMAC_NCFGR_SPD;
+		if (common & (PHY_ANAR_100FULL | PHY_ANAR_10FULL))
+			ncfgr |= GMAC_NCFGR_FD;
+		GMAC->GMAC_NCFGR = ncfgr;
+	}
+	eth_link = link;
+}
+
+static bool slot_free(uint8_t slot)
+{
+	return eth_tx_descriptors[2 * slot].status & TX_USED;
+}
+
+// Hand a frame of header bytes in the slot and payload bytes at payload
+// to the GMAC.  The payload GMAC reads last, so its descriptor is
+// released first.
+static void slot_send(uint8_t slot, uint32_t header, const void *payload, uint32_t length)
+{
+	eth_descriptor_t *first = &eth_tx_descriptors[2 * slot];
+	eth_descriptor_t *second = first + 1;
+
+	first->address = (uint32_t)eth_tx_slots[slot];
+	second->address = (uint32_t)payload;
+	second->status = (second->status & TX_WRAP) | TX_LAST | (length & TX_LENGTH_MASK);
+	__DMB();
+	first->status = header & TX_LENGTH_MASK;
+	__DMB();
+	GMAC->GMAC_NCR |= GMAC_NCR_TSTART;
+}
+
+// Wait for a slot to be sent, false if the link went away meanwhile
+static bool slot_wait(uint8_t slot)
+{
+	while (!slot_free(slot))
+	{
+		eth_poll();
+		if (!eth_link)
+			return false;
+	}
+	return true;
+}
+
+// Send a frame built whole in the slot, split as slot_send needs
+static void slot_send_frame(uint8_t slot, uint32_t length)
+{
+	if (length < ETH_MIN_FRAME_BYTES)
+	{
+		memset(&eth_tx_slots[slot][length], 0, ETH_MIN_FRAME_BYTES - length);
+		length = ETH_MIN_FRAME_BYTES;
+	}
+	slot_send(slot, sizeof(eth_header_t), &eth_tx_slots[slot][sizeof(eth_header_t)], length - sizeof(eth_header_t));
+}
+
+static bool next_slot(uint8_t *slot)
+{
+	*slot = eth_tx_next;
+	if (!slot_wait(*slot))
+		return false;
+	eth_tx_next = (eth_tx_next + 1) % ETH_TX_SLOTS;
+	return true;
+}
+
+static void fill_ip(ip_header_t *ip, uint8_t protocol, uint16_t length, const uint8_t *destination)
+{
+	ip->version_length = 0x45;
+	ip->tos = 0;
+	ip->length = swap16(length);
+	ip->id = swap16(eth_ip_id);
+	eth_ip_id++;
+	ip->fragment = 0;
+	ip->ttl = 64;
+	ip->protocol = protocol;
+	ip->checksum = 0;
+	memcpy(ip->source, eth_ip, sizeof(eth_ip));
+	memcpy(ip->destination, destination, 4);
+	ip->checksum = ip_checksum(ip, sizeof(*ip));
+}
+
+static void answer_arp(const eth_header_t *eth, const arp_packet_t *arp)
+{
+	uint8_t slot;
+	if (arp->operation != swap16(1) || memcmp(arp->target_ip, eth_ip, 4) || !next_slot(&slot))
+		return;
+
+	eth_header_t *reply_eth = (eth_header_t *)eth_tx_slots[slot];
+	arp_packet_t *reply = (arp_packet_t *)(reply_eth + 1);
+	memcpy(reply_eth->destination, eth->source, 6);
+	memcpy(reply_eth->source, eth_mac, 6);
+	reply_eth->type = swap16(ETHERTYPE_ARP);
+	*reply = *arp;
+	reply->operation = swap16(2);
+	memcpy(reply->target_mac, arp->sender_mac, 6);
+	memcpy(reply->target_ip, arp->sender_ip, 4);
+	memcpy(reply->sender_mac, eth_mac, 6);
+	memcpy(reply->sender_ip, eth_ip, 4);
+	slot_send_frame(slot, sizeof(eth_header_t) + sizeof(arp_packet_t));
+}
+
+static void answer_ping(const eth_header_t *eth, const ip_header_t *ip, const uint8_t *icmp, uint32_t length)
+{
+	uint8_t slot;
+	if (icmp[0] != ICMP_ECHO_REQUEST || sizeof(eth_header_t) + sizeof(ip_header_t) + length > ETH_SLOT_BYTES
+		|| !next_slot(&slot))
+		return;
+
+	eth_header_t *reply_eth = (eth_header_t *)eth_tx_slots[slot];
+	ip_header_t *reply_ip = (ip_header_t *)(reply_eth + 1);
+	uint8_t *reply = (uint8_t *)(reply_ip + 1);
+	memcpy(reply_eth->destination, eth->source, 6);
+	memcpy(reply_eth->source, eth_mac, 6);
+	reply_eth->type = swap16(ETHERTYPE_IPV4);
+	fill_ip(reply_ip, IP_PROTOCOL_ICMP, sizeof(ip_header_t) + length, ip->source);
+	memcpy(reply, icmp, length);
+	reply[0] = ICMP_ECHO_REPLY;
+	reply[2] = reply[3] = 0;
+	uint16_t checksum = ip_checksum(reply, length);
+	memcpy(&reply[2], &checksum, sizeof(checksum));
+	slot_send_frame(slot, sizeof(eth_header_t) + sizeof(ip_header_t) + length);
+}
+
+// Handle one received frame; returns the command bytes copied to data
+static uint16_t receive_frame(const uint8_t *frame, uint32_t length, uint8_t *data, uint16_t size)
+{
+	const eth_header_t *eth = (const eth_header_t *)frame;
+	if (length < sizeof(eth_header_t))
+		return 0;
+	frame += sizeof(eth_header_t);
+	length -= sizeof(eth_header_t);
+
+	if (eth->type == swap16(ETHERTYPE_ARP) && length >= sizeof(arp_packet_t))
+	{
+		answer_arp(eth, (const arp_packet_t *)frame);
+		return 0;
+	}
+
+	const ip_header_t *ip = (const ip_header_t *)frame;
+	if (eth->type != swap16(ETHERTYPE_IPV4) || length < sizeof(ip_header_t)
+		|| (ip->version_length >> 4) != 4 || memcmp(ip->destination, eth_ip, 4)
+		|| (swap16(ip->fragment) & 0x3FFF))
+		return 0;
+
+	uint32_t header = (ip->version_length & 0x0F) * 4;
+	uint32_t total = swap16(ip->length);
+	if (header < sizeof(ip_header_t) || total < header || total > length)
+		return 0;
+	frame += header;
+	length = total - header;
+
+	if (ip->protocol == IP_PROTOCOL_ICMP)
+	{
+		answer_ping(eth, ip, frame, length);
+		return 0;
+	}
+
+	// The UDP length counts its own header, so one shorter than that
+	// would wrap the payload length below
+	const udp_header_t *udp = (const udp_header_t *)frame;
+	if (ip->protocol != IP_PROTOCOL_UDP || length < sizeof(udp_header_t)
+		|| swap16(udp->length) < sizeof(udp_header_t)
+		|| udp->destination != swap16(ETH_UDP_PORT))
+		return 0;
+
+	// A new peer starts its own stream
+	uint16_t port = swap16(udp->source);
+	if (!eth_peer_known || memcmp(eth_peer_ip, ip->source, 4) || eth_peer_port != port)
+	{
+		memcpy(eth_peer_ip, ip->source, 4);
+		eth_peer_port = port;
+		eth_stream_offset = 0;
+		eth_peer_known = true;
+	}
+	memcpy(eth_peer_mac, eth->source, 6);
+
+	length = Min(Min(swap16(udp->length), length) - sizeof(udp_header_t), size);
+	memcpy(data, udp + 1, length);
+	return length;
+}
+
+bool eth_rx_pending(void)
+{
+	return eth_running && (eth_rx_descriptors[eth_rx_next].address & RX_OWNERSHIP);
+}
+
+// Received frames are handled from the main loop, so the interrupt
+// only ends its sleep
+void GMAC_Handler(void)
+{
+	(void)GMAC->GMAC_ISR;
+}
+
+uint16_t eth_receive(uint8_t *data, uint16_t size)
+{
+	if (!eth_running)
+		return 0;
+
+	while (eth_rx_descriptors[eth_rx_next].address & RX_OWNERSHIP)
+	{
+		eth_descriptor_t *descriptor = &eth_rx_descriptors[eth_rx_next];
+		uint16_t length = 0;
+
+		// Frames spilling over a buffer are larger than any command
+		if ((descriptor->status & (RX_SOF | RX_EOF)) == (RX_SOF | RX_EOF))
+			length = receive_frame((const uint8_t *)(descriptor->address & ~(RX_OWNERSHIP | RX_WRAP)),
+				descriptor->status & RX_LENGTH_MASK, data, size);
+
+		descriptor->address &= ~RX_OWNERSHIP;
+		eth_rx_next = (eth_rx_next + 1) % ETH_RX_BUFFERS;
+		if (length)
+			return length;
+	}
+	return 0;
+}
+
+uint32_t eth_stream_space(void)
+{
+	if (!eth_link || !eth_peer_known)
+		return 0;
+
+	uint32_t space = 0;
+	for (uint8_t i = 0; i < ETH_TX_SLOTS; i++)
+		if (slot_free((eth_tx_next + i) % ETH_TX_SLOTS))
+			space += ETH_CHUNK_BYTES;
+		else
+			break;
+	return space;
+}
+
+// Fill in the headers of a stream datagram carrying length bytes
+static void stream_headers(uint8_t slot, uint32_t length)
+{
+	stream_headers_t *headers = (stream_headers_t *)eth_tx_slots[slot];
+	uint16_t udp_length = sizeof(udp_header_t) + sizeof(headers->offset) + length;
+
+	memcpy(headers->eth.destination, eth_peer_mac, 6);
+	memcpy(headers->eth.source, eth_mac, 6);
+	headers->eth.type = swap16(ETHERTYPE_IPV4);
+	fill_ip(&headers->ip, IP_PROTOCOL_UDP, sizeof(ip_header_t) + udp_length, eth_peer_ip);
+	headers->udp.source = swap16(ETH_UDP_PORT);
+	headers->udp.destination = swap16(eth_peer_port);
+	headers->udp.length = swap16(udp_length);
+	headers->udp.checksum = 0;  // Optional over IPv4
+	headers->offset = eth_stream_offset;
+	eth_stream_offset += length;
+}
+
+bool eth_stream_write(const void *data, uint32_t length)
+{
+	const uint8_t *p = data;
+	while (length)
+	{
+		uint8_t slot;
+		if (!eth_peer_known || !next_slot(&slot))
+			return false;
+
+		uint32_t chunk = Min(length, ETH_CHUNK_BYTES);
+		stream_headers(slot, chunk);
+		memcpy(&eth_tx_slots[slot][sizeof(stream_headers_t)], p, chunk);
+		slot_send(slot, sizeof(stream_headers_t), &eth_tx_slots[slot][sizeof(stream_headers_t)], chunk);
+		p += chunk;
+		length -= chunk;
+	}
+	return true;
+}
+
+bool eth_stream_write_direct(const void *data, uint32_t length)
+{
+	const uint8_t *p = data;
+	while (length)
+	{
+		uint8_t slot;
+		if (!eth_peer_known || !next_slot(&slot))
+			return false;
+
+		uint32_t chunk = Min(length, ETH_CHUNK_BYTES);
+		stream_headers(slot, chunk);
+		slot_send(slot, sizeof(stream_headers_t), p, chunk);
+		p += chunk;
+		length -= chunk;
+	}
+
+	// The caller may change data once this returns
+	for (uint8_t slot = 0; slot < ETH_TX_SLOTS; slot++)
+		if (!slot_wait(slot))
+			return false;
+	return true;
+}
@@ -0,0 +1,55 @@
+#ifndef ETH_H_INCLUDED
+#define ETH_H_INCLUDED
+
+#include <compiler.h>
+
+// Ethernet transport on the GMAC (MII PHY on PD0-PD17).
+//
+// There is no IP stack: the driver answers ARP and ICMP echo itself and
+// carries everything else in UDP datagrams on ETH_UDP_PORT.  Datagrams
+// to the port hold whole command lines or binary frames, read exactly as
+// from the CDC port.  The host that sent the last command is the peer,
+// and the byte stream the CDC port would carry (replies, binary readouts,
+// stream blocks) goes to it as datagrams that each start with the uint32
+// stream offset of their first byte, so the host can spot a lost one.
+// Set to 0 to leave the GMAC unused
+#define ETH_ENABLE 1
+
+#define ETH_UDP_PORT 4700
+#define ETH_DEFAULT_IP { 192, 168, 1, 50 }
+
+// Stream bytes per datagram, within a 1500-byte MTU
+#define ETH_CHUNK_BYTES 1400
+
+// Start the GMAC and PHY; false if no PHY answers.  The link comes up
+// later, from eth_poll.
+bool eth_init(void);
+
+// Set the IP address; the locally administered MAC follows from it
+void eth_set_address(const uint8_t *ip);
+const uint8_t *eth_address(void);
+
+bool eth_link_up(void);
+
+// Reclaim sent frames and watch the link; called from the main loop
+void eth_poll(void);
+
+// Whether a received frame is waiting for eth_receive
+bool eth_rx_pending(void);
+
+// Copy the next command datagram into data and return its length, or 0
+// when none is waiting.  ARP and ping requests are answered on the way.
+uint16_t eth_receive(uint8_t *data, uint16_t size);
+
+// Stream bytes that can be queued without waiting for the wire
+uint32_t eth_stream_space(void);
+
+// Queue stream bytes to the peer, copied, waiting for frames as needed.
+// False without a link or a peer.
+bool eth_stream_write(const void *data, uint32_t length);
+
+// Send stream bytes with the frames pointing straight at data, returning
+// once all of it is on the wire
+bool eth_stream_write_direct(const void *data, uint32_t length);
+
+#endif /* ETH_H_INCLUDED */
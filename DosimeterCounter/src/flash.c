@@ -0,0 +1,387 @@
+#include <asf.h>
+#include <string.h>
+#include "flash.h"
+#include "crc.h"
+
+#define FLASH_SETTINGS_PAGE ((FLASH_SETTINGS_ADDR - IFLASH_ADDR) / IFLASH_PAGE_SIZE)
+
+// FARG of EPA: the first page with the low bits selecting 8 pages
+#define FLASH_ERASE_8_PAGES 1
+#define FLASH_BLOCK_PAGES 8
+
+#define FLASH_ERRORS (EEFC_FSR_FCMDE | EEFC_FSR_FLOCKE | EEFC_FSR_FLERR)
+
+// Start a command and wait for the plane to be readable again.  Nothing
+// in flash may run until then, interrupt handlers included.
+static RAMFUNC uint32_t flash_command(uint32_t command, uint32_t argument)
+{
+	EFC->EEFC_FCR = EEFC_FCR_FKEY_PASSWD | EEFC_FCR_FARG(argument) | command;
+
+	uint32_t status;
+	do
+		status = EFC->EEFC_FSR;
+	while (!(status & EEFC_FSR_FRDY));
+	return status;
+}
+
+static bool flash_run(uint32_t command, uint32_t argument)
+{
+	irqflags_t flags = cpu_irq_save();
+	uint32_t status = flash_command(command, argument);
+	cpu_irq_restore(flags);
+
+	// Drop anything cached from the old contents
+	if (CMCC->CMCC_SR & CMCC_SR_CSTS)
+		CMCC->CMCC_MAINT0 = CMCC_MAINT0_INVALL;
+	return !(status & FLASH_ERRORS);
+}
+
+// Program flash page page (numbered from IFLASH_ADDR) with the first
+// bytes of data, padding the rest with the erased value
+static bool flash_program(uint32_t page, const uint32_t *data, uint32_t bytes)
+{
+	// Fill the latch buffer through the flash mapping
+	volatile uint32_t *latch = (volatile uint32_t *)(IFLASH_ADDR + page * IFLASH_PAGE_SIZE);
+	for (uint32_t i = 0; i < IFLASH_PAGE_SIZE / 4; i++)
+		latch[i] = i * 4 < bytes ? data[i] : 0xFFFFFFFF;
+
+	return flash_run(EEFC_FCR_FCMD_WP, page);
+}
+
+bool flash_settings_erase(void)
+{
+	return flash_run(EEFC_FCR_FCMD_EPA, FLASH_SETTINGS_PAGE | FLASH_ERASE_8_PAGES);
+}
+
+bool flash_settings_write(const void *data, uint32_t bytes)
+{
+	if (bytes > FLASH_SETTINGS_BYTES || !flash_settings_erase())
+		return false;
+
+	const uint32_t *source = data;
+	for (uint32_t page = 0; page * IFLASH_PAGE_SIZE < bytes; page++)
+		if (!flash_program(FLASH_SETTINGS_PAGE + page, source + page * IFLASH_PAGE_SIZE / 4,
+			bytes - page * IFLASH_PAGE_SIZE))
+			return false;
+	return true;
+}
+
+#define FLASH_POWERFAIL_PAGE ((FLASH_POWERFAIL_ADDR - IFLASH_ADDR) / IFLASH_PAGE_SIZE)
+
+static bool powerfail_blank(uint32_t page)
+{
+	const uint32_t *word = flash_powerfail_page(page);
+	for (uint32_t i = 0; i < IFLASH_PAGE_SIZE / 4; i++)
+		if (word[i] != 0xFFFFFFFF)
+			return false;
+	return true;
+}
+
+// Pages are used in order, so the used ones come first
+uint32_t flash_powerfail_used(void)
+{
+	uint32_t page = FLASH_POWERFAIL_PAGES;
+	while (page && powerfail_blank(page - 1))
+		page--;
+	return page;
+}
+
+bool flash_powerfail_write(const void *data, uint32_t bytes)
+{
+	uint32_t page = flash_powerfail_used();
+	return page < FLASH_POWERFAIL_PAGES && bytes <= IFLASH_PAGE_SIZE
+		&& flash_program(FLASH_POWERFAIL_PAGE + page, data, bytes);
+}
+
+bool flash_powerfail_erase(void)
+{
+	return flash_run(EEFC_FCR_FCMD_EPA, FLASH_POWERFAIL_PAGE | FLASH_ERASE_8_PAGES);
+}
+
+#define FLASH_UPDATE_PAGE ((FLASH_UPDATE_ADDR - IFLASH_ADDR) / IFLASH_PAGE_SIZE)
+
+bool flash_update_write(uint32_t page, const void *data, uint32_t bytes)
+{
+	if (page >= FLASH_UPDATE_PAGES || bytes > IFLASH_PAGE_SIZE)
+		return false;
+	if (page % FLASH_BLOCK_PAGES == 0
+		&& !flash_run(EEFC_FCR_FCMD_EPA, (FLASH_UPDATE_PAGE + page) | FLASH_ERASE_8_PAGES))
+		return false;
+	return flash_program(FLASH_UPDATE_PAGE + page, data, bytes)
+		&& memcmp(flash_update_page(page), data, bytes) == 0;
+}
+
+// The copy, which erases the program it was loaded from, so nothing it
+// runs may be in flash.  Each block of the program is erased as its
+// first page is written, and the update area is read between commands.
+static RAMFUNC __attribute__((noreturn)) void flash_update_copy(uint32_t pages)
+{
+	const uint32_t *source = (const uint32_t *)FLASH_UPDATE_ADDR;
+	for (uint32_t page = 0; page < pages; page++)
+	{
+		if (page % FLASH_BLOCK_PAGES == 0)
+			flash_command(EEFC_FCR_FCMD_EPA, page | FLASH_ERASE_8_PAGES);
+
+		volatile uint32_t *latch = (volatile uint32_t *)(IFLASH_ADDR + page * IFLASH_PAGE_SIZE);
+		for (uint32_t i = 0; i < IFLASH_PAGE_SIZE / 4; i++)
+			latch[i] = source[page * (IFLASH_PAGE_SIZE / 4) + i];
+		flash_command(EEFC_FCR_FCMD_WP, page);
+	}
+
+	RSTC->RSTC_CR = RSTC_CR_KEY(0xA5) | RSTC_CR_PROCRST | RSTC_CR_PERRST;
+	for (;;)
+		;
+}
+
+void flash_update_install(uint32_t bytes)
+{
+	cpu_irq_disable();
+	flash_update_copy((Min(bytes, FLASH_UPDATE_BYTES) + IFLASH_PAGE_SIZE - 1) / IFLASH_PAGE_SIZE);
+}
+
+// End of the program image in flash: the code, then the initial values
+// of .relocate
+extern uint32_t _etext, _srelocate, _erelocate;
+
+// The log area in pages from IFLASH_ADDR, in whole blocks
+static uint32_t log_start;
+static uint32_t log_pages;
+
+// Next record, as pages into the log: its header goes at log_head, and
+// the pages from there up to log_erased are erased
+static uint32_t log_head;
+static uint32_t log_erased;
+static uint32_t log_serial;
+static uint32_t log_lap;
+
+// Record being written
+static uint32_t log_page;      // Next payload page
+static uint32_t log_fill;      // Bytes in log_buffer
+static uint16_t log_crc;
+static flash_log_header_t log_record;
+static uint32_t log_buffer[IFLASH_PAGE_SIZE / 4];
+
+static const uint8_t *log_address(uint32_t page)
+{
+	return (const uint8_t *)(IFLASH_ADDR + (log_start + page) * IFLASH_PAGE_SIZE);
+}
+
+static bool log_blank(uint32_t page)
+{
+	const uint32_t *word = (const uint32_t *)log_address(page);
+	for (uint32_t i = 0; i < IFLASH_PAGE_SIZE / 4; i++)
+		if (word[i] != 0xFFFFFFFF)
+			return false;
+	return true;
+}
+
+static uint16_t log_header_crc(const flash_log_header_t *header)
+{
+	return crc16_update(0xFFFF, (const uint8_t *)header, offsetof(flash_log_header_t, crc));
+}
+
+uint32_t flash_log_record_pages(const flash_log_header_t *header)
+{
+	return 1 + (header->bytes + IFLASH_PAGE_SIZE - 1) / IFLASH_PAGE_SIZE;
+}
+
+// The header at page, if it starts a whole record
+static const flash_log_header_t *log_valid(uint32_t page)
+{
+	const flash_log_header_t *header = (const flash_log_header_t *)log_address(page);
+	if (header->magic != FLASH_LOG_MAGIC || header->crc != log_header_crc(header)
+		|| header->bytes > (log_pages - page - 1) * IFLASH_PAGE_SIZE)
+		return NULL;
+	return header;
+}
+
+// Make page writable, erasing the blocks up to it
+static bool log_erase_to(uint32_t page)
+{
+	while (log_erased <= page)
+	{
+		if (!flash_run(EEFC_FCR_FCMD_EPA, (log_start + log_erased) | FLASH_ERASE_8_PAGES))
+			return false;
+		log_erased += FLASH_BLOCK_PAGES;
+	}
+	return true;
+}
+
+void flash_log_init(void)
+{
+	uint32_t image_end = (uint32_t)&_etext + ((uint32_t)&_erelocate - (uint32_t)&_srelocate);
+	uint32_t block_bytes = FLASH_BLOCK_PAGES * IFLASH_PAGE_SIZE;
+	log_start = (image_end - IFLASH_ADDR + block_bytes - 1) / block_bytes * FLASH_BLOCK_PAGES;
+	log_pages = FLASH_UPDATE_PAGE - log_start;
+
+	// The newest record ends at the head
+	const flash_log_header_t *newest = NULL;
+	uint32_t page = 0;
+	log_head = 0;
+	while (page < log_pages)
+	{
+		const flash_log_header_t *header = log_valid(page);
+		if (!header)
+		{
+			page++;
+			continue;
+		}
+
+		if (!newest || header->serial > newest->serial)
+		{
+			newest = header;
+			log_head = page + flash_log_record_pages(header);
+		}
+		page += flash_log_record_pages(header);
+	}
+
+	log_serial = newest ? newest->serial + 1 : 0;
+	log_lap = newest ? newest->lap : 0;
+
+	// The rest of the head's block was erased with it, unless a record
+	// was cut short there
+	log_erased = (log_head + FLASH_BLOCK_PAGES - 1) / FLASH_BLOCK_PAGES * FLASH_BLOCK_PAGES;
+	for (page = log_head; page < log_erased; page++)
+		if (!log_blank(page))
+		{
+			log_head = log_erased;
+			break;
+		}
+}
+
+bool flash_log_begin(uint32_t bytes)
+{
+	log_record.bytes = bytes;
+	uint32_t pages = flash_log_record_pages(&log_record);
+	if (pages > log_pages)
+		return false;
+
+	if (log_head + pages > log_pages)
+	{
+		log_head = 0;
+		log_erased = 0;
+		log_lap++;
+	}
+
+	log_record.magic = FLASH_LOG_MAGIC;
+	log_record.serial = log_serial;
+	log_record.lap = log_lap;
+	log_page = log_head + 1;
+	log_fill = 0;
+	log_crc = 0xFFFF;
+	return log_erase_to(log_head);
+}
+
+static bool log_program(uint32_t page, const uint32_t *data, uint32_t bytes)
+{
+	return log_erase_to(page) && flash_program(log_start + page, data, bytes);
+}
+
+bool flash_log_write(const void *data, uint32_t bytes)
+{
+	const uint8_t *source = data;
+	log_crc = crc16_update(log_crc, source, bytes);
+	while (bytes)
+	{
+		uint32_t length = Min(bytes, IFLASH_PAGE_SIZE - log_fill);
+		memcpy((uint8_t *)log_buffer + log_fill, source, length);
+		log_fill += length;
+		source += length;
+		bytes -= length;
+
+		if (log_fill == IFLASH_PAGE_SIZE)
+		{
+			if (!log_program(log_page++, log_buffer, IFLASH_PAGE_SIZE))
+				return false;
+			log_fill = 0;
+		}
+	}
+	return true;
+}
+
+bool flash_log_commit(void)
+{
+	if (log_fill && !log_program(log_page++, log_buffer, log_fill))
+		return false;
+
+	log_record.payload_crc = log_crc;
+	log_record.crc = log_header_crc(&log_record);
+	bool ok = flash_program(log_start + log_head, (const uint32_t *)&log_record, sizeof(log_record));
+
+	// The pages are used either way
+	log_head = log_page;
+	if (ok)
+		log_serial++;
+	return ok;
+}
+
+bool flash_log_erase(void)
+{
+	log_head = 0;
+	log_erased = 0;
+	log_serial = 0;
+	log_lap = 0;
+	return log_erase_to(log_pages - 1);
+}
+
+// The next whole record from page on, up to the end of the log
+static uint32_t log_find(uint32_t page, uint32_t end)
+{
+	for (; page < end; page++)
+		if (log_valid(page))
+			return page;
+	return FLASH_LOG_NONE;
+}
+
+// Records from the head on are from the lap before, and older than the
+// ones before the head
+uint32_t flash_log_first(void)
+{
+	uint32_t page = log_find(log_head, log_pages);
+	return page != FLASH_LOG_NONE ? page : log_find(0, log_head);
+}
+
+uint32_t flash_log_next(uint32_t page)
+{
+	bool last_lap = page >= log_head;
+	page += flash_log_record_pages(flash_log_header(page));
+	if (last_lap)
+	{
+		uint32_t next = log_find(page, log_pages);
+		if (next != FLASH_LOG_NONE)
+			return next;
+		page = 0;
+	}
+	return log_find(page, log_head);
+}
+
+const flash_log_header_t *flash_log_header(uint32_t page)
+{
+	return (const flash_log_header_t *)log_address(page);
+}
+
+const void *flash_log_payload(uint32_t page)
+{
+	return log_address(page + 1);
+}
+
+uint32_t flash_log_pages(void)
+{
+	return log_pages;
+}
+
+uint32_t flash_log_free_pages(void)
+{
+	uint32_t first = flash_log_first();
+	return first != FLASH_LOG_NONE && first >= log_head ? first - log_head : log_pages - log_head;
+}
+
+uint32_t flash_log_serial(void)
+{
+	return log_serial;
+}
+
+uint32_t flash_log_lap(void)
+{
+	return log_lap;
+}
@@ -0,0 +1,137 @@
+#ifndef FLASH_H_INCLUDED
+#define FLASH_H_INCLUDED
+
+#include <compiler.h>
+
+// Minimal EEFC driver for a settings area in the top pages of the
+// internal flash, which the program never reaches, a power-fail block
+// below it, a firmware update area below that, and a record log in the
+// pages between the program and the update area.
+//
+// The SAM4E has a single flash plane, so it cannot be read while it is
+// being programmed: the commands run from SRAM with interrupts masked,
+// for tens of milliseconds per erase.
+
+#define FLASH_SETTINGS_PAGES 8
+#define FLASH_SETTINGS_BYTES (FLASH_SETTINGS_PAGES * IFLASH_PAGE_SIZE)
+#define FLASH_SETTINGS_ADDR (IFLASH_ADDR + IFLASH_SIZE - FLASH_SETTINGS_BYTES)
+
+// The settings area, read directly through the flash mapping
+static inline const void *flash_settings(void)
+{
+	return (const void *)FLASH_SETTINGS_ADDR;
+}
+
+// Erase the settings area and program bytes of data (word aligned, at
+// most FLASH_SETTINGS_BYTES) from its start.  Returns false if the
+// EEFC reported an error, which leaves the area erased or partly written.
+bool flash_settings_write(const void *data, uint32_t bytes);
+
+// Erase the settings area
+bool flash_settings_erase(void);
+
+// Power-fail block, one erase block.  Its pages are only programmed
+// while blank, one per save, so a save is a single page program with no
+// erase ahead of it, short enough for the hold-up time of the supply.
+#define FLASH_POWERFAIL_PAGES 8
+#define FLASH_POWERFAIL_ADDR (FLASH_SETTINGS_ADDR - FLASH_POWERFAIL_PAGES * IFLASH_PAGE_SIZE)
+
+static inline const void *flash_powerfail_page(uint32_t page)
+{
+	return (const void *)(FLASH_POWERFAIL_ADDR + page * IFLASH_PAGE_SIZE);
+}
+
+// Program the first blank page with bytes of data (word aligned, at
+// most IFLASH_PAGE_SIZE).  Returns false if every page is used or the
+// EEFC reported an error.  May be called from an interrupt handler,
+// though one that cuts into another write spoils the page that write
+// was filling.
+bool flash_powerfail_write(const void *data, uint32_t bytes);
+
+// Pages programmed since the block was last erased
+uint32_t flash_powerfail_used(void);
+
+bool flash_powerfail_erase(void);
+
+// Firmware update area, where udi_dfu.c stages a new program image.  It
+// also bounds the image, which is copied over the program from
+// IFLASH_ADDR.
+#define FLASH_UPDATE_BYTES (256 * 1024)
+#define FLASH_UPDATE_PAGES (FLASH_UPDATE_BYTES / IFLASH_PAGE_SIZE)
+#define FLASH_UPDATE_ADDR (FLASH_POWERFAIL_ADDR - FLASH_UPDATE_BYTES)
+
+static inline const void *flash_update_page(uint32_t page)
+{
+	return (const void *)(FLASH_UPDATE_ADDR + page * IFLASH_PAGE_SIZE);
+}
+
+// Program page of the update area with bytes of data (word aligned, at
+// most IFLASH_PAGE_SIZE), erasing each block as its first page is
+// written.  Returns false if the EEFC reported an error or the page
+// does not read back as data.
+bool flash_update_write(uint32_t page, const void *data, uint32_t bytes);
+
+// Copy the first bytes of the update area over the program and reset.
+// The copy runs from SRAM with interrupts masked, and a power loss
+// part way through leaves the ROM bootloader (SAM-BA, through the ERASE
+// pin) as the way back.
+__attribute__((noreturn)) void flash_update_install(uint32_t bytes);
+
+// Scan log.  Records are appended to the free pages as a ring:
+//   flash_log_header_t, alone in the first page
+//   the payload, in the pages after it, the last one padded with 0xFF
+// A record never wraps around the end of the area, and the 8 page
+// blocks ahead of it are erased as it is written, so every block is
+// erased once per lap however the records fall.  The header page is
+// programmed last, so a record cut short by a reset is never found.
+// The log is found again at boot from the newest valid header.
+#define FLASH_LOG_MAGIC 0x474C4644  // "DFLG"
+#define FLASH_LOG_NONE UINT32_MAX
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t serial;       // Records written before this one, over every lap
+	uint32_t lap;          // Times the log had wrapped around
+	uint32_t bytes;        // Payload bytes
+	uint16_t payload_crc;  // CRC-16 of the payload
+	uint16_t crc;          // CRC-16 of the fields before
+} flash_log_header_t;
+
+// Find the end of the log left by the last run
+void flash_log_init(void);
+
+// Start a record of bytes of payload, which must arrive through
+// flash_log_write before flash_log_commit.  Returns false if it can
+// never fit or an erase ahead of it failed.
+bool flash_log_begin(uint32_t bytes);
+
+// Add payload.  Programs a page each time one fills, so a call with at
+// most IFLASH_PAGE_SIZE bytes masks the interrupts for one page program
+// and at most one block erase.
+bool flash_log_write(const void *data, uint32_t bytes);
+
+// Program the last payload page and then the header
+bool flash_log_commit(void);
+
+// Erase every block of the log
+bool flash_log_erase(void);
+
+// Records in address order from the oldest, by the page of their header
+// within the log: the first, and the one after page, or FLASH_LOG_NONE
+uint32_t flash_log_first(void);
+uint32_t flash_log_next(uint32_t page);
+
+// Header and payload of the record at page, read through the flash mapping
+const flash_log_header_t *flash_log_header(uint32_t page);
+const void *flash_log_payload(uint32_t page);
+
+// Pages a record takes, header page included
+uint32_t flash_log_record_pages(const flash_log_header_t *header);
+
+uint32_t flash_log_pages(void);       // Pages in the log area
+uint32_t flash_log_free_pages(void);  // Pages to write before the oldest record goes
+uint32_t flash_log_serial(void);      // Serial of the next record
+uint32_t flash_log_lap(void);
+
+#endif /* FLASH_H_INCLUDED */
@@ -0,0 +1,154 @@
+#include <string.h>
+#include "lz4.h"
+
+// Frame magic, FLG (version 1, independent blocks) and BD (64 KB blocks),
+// then the header checksum, the second byte of XXH32 of FLG and BD
+static const uint8_t lz4_frame_header[] = { 0x04, 0x22, 0x4D, 0x18, 0x60, 0x40, 0x82 };
+static const uint8_t lz4_end_mark[4] = { 0 };
+
+// Matches are at least LZ4_MIN_MATCH bytes, the last LZ4_LAST_LITERALS
+// bytes of a block are literals, and no match starts in its last
+// LZ4_MATCH_LIMIT bytes, as the block format requires
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MATCH_LIMIT 12
+#define LZ4_UNCOMPRESSED 0x80000000u
+
+static inline uint32_t lz4_read32(const uint8_t *p)
+{
+	uint32_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static inline uint32_t lz4_hash(uint32_t value)
+{
+	return (value * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+// Write a length beyond the 15 its token holds as 255s and a remainder,
+// returning the part for the token
+static uint8_t lz4_length(uint8_t **out, uint32_t length)
+{
+	if (length < 15)
+		return length;
+
+	for (length -= 15; length >= 255; length -= 255)
+		*(*out)++ = 255;
+	*(*out)++ = length;
+	return 15;
+}
+
+// Compress src into dst, returning the compressed length, or 0 if it
+// would not be smaller than the input
+static uint32_t lz4_block(uint16_t *table, const uint8_t *src, uint32_t length, uint8_t *dst)
+{
+	const uint8_t *ip = src, *anchor = src, *end = src + length;
+	uint8_t *out = dst, *limit = dst + length;
+
+	if (length > LZ4_MATCH_LIMIT)
+	{
+		const uint8_t *match_end = end - LZ4_LAST_LITERALS, *ip_end = end - LZ4_MATCH_LIMIT;
+		memset(table, 0, sizeof(uint16_t) << LZ4_HASH_BITS);
+		for (ip++; ip < ip_end;)
+		{
+			uint32_t h = lz4_hash(lz4_read32(ip));
+			const uint8_t *ref = src + table[h];
+			table[h] = ip - src;
+			if (ref >= ip || lz4_read32(ref) != lz4_read32(ip))
+			{
+				ip++;
+				continue;
+			}
+
+			while (ip > anchor && ref > src && ip[-1] == ref[-1])
+			{
+				ip--;
+				ref--;
+			}
+
+			const uint8_t *next = ip + LZ4_MIN_MATCH;
+			for (ref += LZ4_MIN_MATCH; next < match_end && *next == *ref; next++, ref++)
+				;
+
+			// Token, both lengths at their longest, literals and offset
+			uint32_t literals = ip - anchor, match = next - ip - LZ4_MIN_MATCH;
+			if (out + 1 + (literals + 240) / 255 + literals + 2 + (match + 240) / 255 > limit)
+				return 0;
+
+			uint8_t *token = out++;
+			*token = lz4_length(&out, literals) << 4;
+			memcpy(out, anchor, literals);
+			out += literals;
+			uint32_t offset = next - ref;
+			*out++ = offset;
+			*out++ = offset >> 8;
+			*token |= lz4_length(&out, match);
+			ip = anchor = next;
+		}
+	}
+
+	uint32_t literals = end - anchor;
+	if (out + 1 + (literals + 240) / 255 + literals >= limit)
+		return 0;
+
+	uint8_t *token = out++;
+	*token = lz4_length(&out, literals) << 4;
+	memcpy(out, anchor, literals);
+	out += literals;
+	return out - dst;
+}
+
+// Send the staged input as one block
+static bool lz4_flush(lz4_stream_t *stream)
+{
+	uint32_t size = lz4_block(stream->table, stream->input, stream->length, &stream->output[4]);
+	uint32_t word = size;
+	if (!size)
+	{
+		memcpy(&stream->output[4], stream->input, stream->length);
+		size = stream->length;
+		word = size | LZ4_UNCOMPRESSED;
+	}
+
+	memcpy(stream->output, &word, sizeof(word));
+	stream->length = 0;
+	stream->total += 4 + size;
+	return stream->emit(stream->output, 4 + size);
+}
+
+bool lz4_begin(lz4_stream_t *stream, lz4_emit_t emit)
+{
+	stream->length = 0;
+	stream->total = sizeof(lz4_frame_header);
+	stream->emit = emit;
+	return emit(lz4_frame_header, sizeof(lz4_frame_header));
+}
+
+bool lz4_write(lz4_stream_t *stream, const void *data, uint32_t length)
+{
+	const uint8_t *bytes = data;
+	while (length)
+	{
+		uint32_t part = sizeof(stream->input) - stream->length;
+		if (part > length)
+			part = length;
+		memcpy(&stream->input[stream->length], bytes, part);
+		stream->length += part;
+		bytes += part;
+		length -= part;
+		if (stream->length == sizeof(stream->input) && !lz4_flush(stream))
+			return false;
+	}
+
+	return true;
+}
+
+bool lz4_finish(lz4_stream_t *stream)
+{
+	if (stream->length && !lz4_flush(stream))
+		return false;
+
+	stream->total += sizeof(lz4_end_mark);
+	return stream->emit(lz4_end_mark, sizeof(lz4_end_mark));
+}
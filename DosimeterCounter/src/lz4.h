@@ -0,0 +1,40 @@
+#ifndef LZ4_H_INCLUDED
+#define LZ4_H_INCLUDED
+
+// LZ4 frame compressor for the compressed readouts (M1102).
+// Everything written between lz4_begin and lz4_finish goes out as one
+// standard LZ4 frame, so any LZ4 decoder reads it back: the frame
+// header (independent blocks, no checksums, 64 KB maximum block size),
+// then blocks of up to LZ4_BLOCK_BYTES of input, each compressed with a
+// greedy single-probe hash search or stored as is when that does not
+// make it smaller, then the end mark.
+// Like rle.c it has no hardware dependencies.
+#include <stdbool.h>
+#include <stdint.h>
+
+#define LZ4_BLOCK_BYTES 2048
+#define LZ4_HASH_BITS 10
+
+// Sends each finished piece of the frame
+typedef bool (*lz4_emit_t)(const void *data, uint32_t length);
+
+// Input staging, the compressed block with its size in front, and the
+// hash table of input offsets, about 6 KB in all
+typedef struct
+{
+	uint8_t input[LZ4_BLOCK_BYTES];
+	uint32_t length;
+	uint32_t total;   // Bytes produced so far
+	uint8_t output[4 + LZ4_BLOCK_BYTES];
+	uint16_t table[1u << LZ4_HASH_BITS];
+	lz4_emit_t emit;
+} lz4_stream_t;
+
+bool lz4_begin(lz4_stream_t *stream, lz4_emit_t emit);
+
+bool lz4_write(lz4_stream_t *stream, const void *data, uint32_t length);
+
+// Send the last block and the end mark
+bool lz4_finish(lz4_stream_t *stream);
+
+#endif /* LZ4_H_INCLUDED */
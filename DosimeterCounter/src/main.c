@@ -1,229 +1,14701 @@
 #include <asf.h>
-#include <inttypes.h>
 #include <string.h>
+#include <math.h>
+#include <arm_math.h>
+#include "profile.h"
+#include "trace.h"
+#include "udi_vendor_bulk.h"
+#if USB_MSC_ENABLE
+#include "udi_msc.h"
+#endif
+#if USB_DFU_ENABLE
+#include "udi_dfu.h"
+#endif
+#include "reply.h"
+#include "command.h"
+#include "rle.h"
+#include "rice.h"
+#include "lz4.h"
+#include "ring.h"
+#include "pool.h"
+#include "sd.h"
+#include "flash.h"
+#include "eth.h"
+#include "conf_counter.h"
 
-#define COUNTER_PIO PIOA
-#define COUNTER_PIO_ID ID_PIOA
+// Interrupt priorities, lower values preempting higher ones:
+//   COUNTER_IRQ_PRIORITY   step PIO, QDEC and timed TCs, clear DMAC:
+//                          everything that commits columns, and the
+//                          counter overflows it extends them with
+//   GENERATOR_IRQ_PRIORITY M1043 outputs
+//   UDD_USB_INT_LEVEL      USB (conf_usb.h)
+//   ETH_IRQ_PRIORITY       GMAC wake-up (eth.c)
+// irq_priority_check() enforces this at boot.  The supply monitor
+// (POWERFAIL_IRQ_PRIORITY), set up after it, shares the counting
+// priority since it only runs as the power goes.  Main loop critical
+// sections still mask everything, so they only copy a few words.
 #define COUNTER_IRQ_PRIORITY 0
-#define COUNTER_STEP_PIN PIO_PA15
-#define COUNTER_DIR_PIN PIO_PA14
+// Where irq_priority_check() moves anything else that would compete
+#define BACKGROUND_IRQ_PRIORITY 8
 
-#define COUNTER_TC TC0
-#define PRIMARY_TC_CHANNEL 1
-#define PRIMARY_TC_CHANNEL_ID ID_TC1
-#define SECONDARY_TC_CHANNEL 2
-#define SECONDARY_TC_CHANNEL_ID ID_TC2
-#define TERTIARY_TC_CHANNEL 3
-#define TERTIARY_TC_CHANNEL_ID ID_TC3
+// Number of counter channels, up to COUNTER_CHANNELS_MAX, the channels
+// conf_counter.h describes.
+// The first three are the TC0 channels.  Each one beyond takes the next
+// TC1 or TC2 channel (TC3 to TC8) from the timed acquisition, step
+// generators, benchmark and step check, which then refuse to run.
+// Each one beyond also shrinks the count arena (COUNT_ARENA_CHANNEL_BYTES)
+// and the background map columns (BACKGROUND_COLUMNS) to stay in SRAM.
+#define COUNTER_CHANNELS 3
+#define COUNTER_CHANNELS_MAX COUNTER_BOARD_CHANNEL_COUNT
 
+#if COUNTER_CHANNELS < 3 || COUNTER_CHANNELS > COUNTER_CHANNELS_MAX
+#error COUNTER_CHANNELS must be between 3 and the channels of conf_counter.h
+#endif
 
-// The maximum offset of the head in steps
-// This defines the size of the count buffers
-#define HEAD_STEPS_MAX 8000
+// Whether the counters take the TC channel with peripheral ID id
+#define COUNTER_USES_TC(id) ((id) >= ID_TC3 && (id) - ID_TC3 + 3 < COUNTER_CHANNELS)
+
+// Counter synchronisation is done on TC0 by TC_BCR
+#define COUNTER_TC COUNTER_TC_BLOCK(0)
+
+// Log each bank swapped out for readout to an SD card on the HSMCI (M1044).
+// The HSMCI takes PA26-PA31, so of the TC0 channels only the primary
+// (TCLK0, PA4) counts and COUNT_MODE_LATCH loses TIOA2.
+// Set to 1 on boards with the SD slot fitted.
+#define COUNTER_SD_LOG 0
+
+#if COUNTER_SD_LOG
+#define COUNTER_SD_PINS (PIO_PA26 | PIO_PA28 | PIO_PA29)
+#else
+#define COUNTER_SD_PINS 0
+#endif
+
+// Gate the TC0 counters with the beam-on signal of a pulsed machine
+// (M1083), so nothing is counted between pulses.  The signal must be
+// jumpered to TCLK2 (PA29).  With the gate on, the primary and secondary
+// channels only count while it is high (TC_CMR_BURST on XC2), and the
+// tertiary channel counts BEAM_GATE_CLOCK under the same gate instead of
+// its input, so its bins hold how long the beam was on in each column.
+// Not with COUNTER_SD_LOG, which takes PA29, nor with the TC1 and TC2
+// channels, which have no gate.
+// Set to 1 on boards with the gate wired.
+#define COUNTER_BEAM_GATE 0
+
+#if COUNTER_BEAM_GATE
+#if COUNTER_SD_LOG || COUNTER_CHANNELS > 3
+#error COUNTER_BEAM_GATE needs COUNTER_SD_LOG set to 0 and 3 COUNTER_CHANNELS
+#endif
+// MCK/128, about a microsecond, so a 16-bit bin holds 70 ms of beam
+#define BEAM_GATE_CLOCK TC_CMR_TCCLKS_TIMER_CLOCK4
+#define BEAM_GATE_DIVIDER 128
+// The channel timing the gate
+#define BEAM_GATE_TIMER 2
+#endif
+
+// Keep whole 2D frames in an asynchronous SRAM on the SMC's NCS0 (M1079,
+// M1080).
+// Rows sealed by M1077 are copied there by the DMAC and given back, so
+// the step interrupt only writes the on-chip rows.  The EBI data bus is
+// 8 bits wide and takes D0-D7, NWE, NRD, NCS0 and A0-A13 on PIOC, which
+// leaves no PIOC pins to the TC1 and TC2 channels (extra counter
+// channels, the quadrature decoder, step check, generator outputs,
+// benchmark and pulse input), and A14 upwards on PIOA.
+// FRAME_STORE_ADDRESS_LINES sets the size: 19 lines (512 KB) take PA0
+// from COUNT_MODE_CAPTURE and COUNT_MODE_LATCH, 21 lines (2 MB, a
+// million 16-bit bins) also take PA23 and PA24 from the direction
+// capture and the sync input.
+// Set to 1 on boards with the SRAM fitted.
+#define COUNTER_FRAME_STORE 0
+#define FRAME_STORE_ADDRESS_LINES 19
+
+#if COUNTER_FRAME_STORE
+#define FRAME_STORE_PIOC_PINS (0xFFFC0000 | PIO_PC0A_D0 | PIO_PC1A_D1 | PIO_PC2A_D2 | PIO_PC3A_D3 \
+	| PIO_PC4A_D4 | PIO_PC5A_D5 | PIO_PC6A_D6 | PIO_PC7A_D7 | PIO_PC8A_NWE | PIO_PC11A_NRD | PIO_PC14A_NCS0)
+#if FRAME_STORE_ADDRESS_LINES == 17
+#define FRAME_STORE_PIOA_PINS (PIO_PA18C_A14 | PIO_PA19C_A15 | PIO_PA20C_A16)
+#elif FRAME_STORE_ADDRESS_LINES == 19
+#define FRAME_STORE_PIOA_PINS (PIO_PA18C_A14 | PIO_PA19C_A15 | PIO_PA20C_A16 | PIO_PA0C_A17 | PIO_PA1C_A18)
+#elif FRAME_STORE_ADDRESS_LINES == 21
+#define FRAME_STORE_PIOA_PINS (PIO_PA18C_A14 | PIO_PA19C_A15 | PIO_PA20C_A16 | PIO_PA0C_A17 | PIO_PA1C_A18 \
+	| PIO_PA23C_A19 | PIO_PA24C_A20)
+#else
+#error FRAME_STORE_ADDRESS_LINES must be 17, 19 or 21
+#endif
+#define FRAME_STORE_BYTES (1UL << FRAME_STORE_ADDRESS_LINES)
+#define FRAME_STORE_BIN(index) (((volatile count_t *)EBI_CS0_ADDR)[index])
+// Whether the EBI has taken any of pins on pio
+#define FRAME_STORE_TAKES(pio, pins) \
+	((((pio) == PIOC ? FRAME_STORE_PIOC_PINS : (pio) == PIOA ? FRAME_STORE_PIOA_PINS : 0) & (pins)) != 0)
+#else
+#define FRAME_STORE_PIOA_PINS 0
+#define FRAME_STORE_TAKES(pio, pins) false
+#endif
+
+// Track the head position with the TC2 quadrature decoder instead of
+// the step/dir interrupt.  PHA and PHB come from an encoder on TIOA6
+// (PC5) and TIOB6 (PC6), and the CPU only wakes when the position
+// crosses into another column.
+// Set to 0 to count steps on COUNTER_STEP_PIN in software.
+#define COUNTER_POSITION_QDEC 0
+
+#define QDEC_TC COUNTER_TC_BLOCK(QDEC_TC_NUMBER)
+#define QDEC_TC_CHANNEL COUNTER_TC_CHANNEL(QDEC_TC_NUMBER)
+#define QDEC_TC_CHANNEL_ID COUNTER_TC_ID(QDEC_TC_NUMBER)
+#define QDEC_TC_IRQn COUNTER_TC_IRQn(QDEC_TC_NUMBER)
+
+// Quadrature counts per column as a power of two.
+// The decoder counts both edges of both phases, so 2 gives
+// one column per encoder cycle.
+#define QDEC_COLUMN_SHIFT 2
+
+#if COUNTER_POSITION_QDEC && (COUNTER_USES_TC(QDEC_TC_CHANNEL_ID) || COUNTER_USES_TC(QDEC_TC_CHANNEL_ID + 1))
+#error The quadrature decoder needs two TC channels the counters do not take
+#endif
+
+// Hardware step counter used to detect steps the interrupt missed.
+// TC6 counts edges on TCLK6 (PC7), which must be jumpered to the
+// step signal.  Edges that arrive while PIO_ISR is already set are
+// coalesced into one interrupt but still reach this counter.
+#define STEP_CHECK_TC COUNTER_TC_BLOCK(STEP_CHECK_TC_NUMBER)
+#define STEP_CHECK_TC_CHANNEL COUNTER_TC_CHANNEL(STEP_CHECK_TC_NUMBER)
+#define STEP_CHECK_TC_CHANNEL_ID COUNTER_TC_ID(STEP_CHECK_TC_NUMBER)
+
+// PIOA edge interrupts that drive the head position
+#if COUNTER_POSITION_QDEC
+#define COUNTER_STEP_PINS ROW_STEP_PIN
+#else
+#define COUNTER_STEP_PINS (COUNTER_STEP_PIN | ROW_STEP_PIN)
+#endif
+
+// Shared sync line between boards on one scanner (M1046).  A master
+// toggles SYNC_OUT_PIN at each column commit; a slave commits a column
+// on either edge of SYNC_IN_PIN, so every board closes its columns
+// at the same instant.  Wire each master output to the slave inputs.
+// In pulse mode the rising edges of SYNC_IN_PIN come from the beam sync
+// of a pulsed source instead, and each one commits the column.
+// Set to 0 to remove the sync test from the commit path.
+#define COUNTER_SYNC 1
+
+// Service the step pin from a dedicated PIOA vector instead of
+// going through the pio_handler_process source table.
+// Set to 0 to fall back to the generic ASF dispatch.
+#define COUNTER_FAST_STEP_ISR 1
+
+// Place the counting interrupt handlers in SRAM (the .ramfunc part of
+// .relocate), so the step path runs without flash wait states and the
+// first fetch after a quiet period does not miss.
+// Set to 0 to leave them in flash.
+#define COUNTER_ISR_IN_RAM 1
+
+#if COUNTER_ISR_IN_RAM
+#define COUNTER_ISR RAMFUNC
+#else
+#define COUNTER_ISR
+#endif
+
+// Enable the CMCC instruction cache for everything still run from flash
+#define COUNTER_ENABLE_CACHE 1
+
+// Sleep (WFI) in the main loop whenever it has nothing left to do.
+// Clocks and peripherals keep running, so counting goes on, and the USB,
+// step, timer, DMAC and GMAC interrupts all wake the core.
+// Set to 0 to keep polling at full speed.
+#define COUNTER_IDLE_SLEEP 1
+
+// Divide MCK down (CLOCK_IDLE_PRES) while counting is off and no command
+// has arrived for CLOCK_IDLE_MS.  PLLA keeps running, so the 48 MHz USB
+// clock is untouched.
+// Set to 0 to stay at the conf_clock.h speed.
+#define COUNTER_CLOCK_SCALING 1
+
+// Take the millisecond tick (sof_count) from the RTT on the slow clock
+// rather than from the USB start of frame, so timed stops, cine, rates,
+// timeouts and the idle clock drop keep time on a battery unit with no
+// USB host, and through any sleep that keeps the slow clock.
+// Set to 0 to tick on SOFs, which stop with the bus.
+#define COUNTER_RTT_TICK 1
+
+// Write performance counters to the ITM stimulus ports from SysTick, so a
+// debug probe on TRACESWO (PB5) watches a running scan without going
+// through USB.  Set to 1 to enable it.
+#define COUNTER_TELEMETRY 0
+
+// Width of each count bin in bits (16 or 32).
+// 16-bit bins saturate at 0xFFFF and flag the column in count_overflow.
+// 32-bit bins use the same arena, so they halve the number of bins.
+#define COUNT_WIDTH 16
+
+// Memory layout of the count bins.
+// 0 stores each channel in its own plane (struct-of-arrays).
+// 1 stores the channels of a column together (array-of-structs),
+// so each step writes a single contiguous group and the interleaved
+// readout is a straight copy of the buffer.
+#define COUNT_LAYOUT_INTERLEAVED 0
+
+// Storage of the channels after the primary, which see only a handful of
+// counts per cell.  0 gives every channel count_t bins.  1 packs them into
+// 8-bit bins: a bin that reaches COUNT_PACKED_ESCAPE keeps its count in
+// the escape table of its bank (count_escape_t) instead, so readouts
+// still send count_t values while a cell takes less of the arena.
+// Planar layout only, and not with COUNTER_SD_LOG, which logs the bank
+// as it is in the arena.
+#define COUNT_PACKED_CHANNELS 0
+
+// Size of the arena shared by all count bins.
+// M1023 divides it into columns for the enabled channels.
+// Must be a multiple of 128 so that whole banks of COUNT_BANK_ALIGN
+// 32-bit bins fit.  Each channel past three gives up COUNT_ARENA_CHANNEL_BYTES
+// for its per-channel state, so the RAM budget below holds up to
+// COUNTER_CHANNELS_MAX.
+#define COUNT_ARENA_CHANNEL_BYTES 1152
+#define COUNT_ARENA_BASE_BYTES (48000 - (COUNTER_CHANNELS - 3) * COUNT_ARENA_CHANNEL_BYTES)
+#if COUNT_PACKED_CHANNELS
+// The escape tables of the two banks come out of it
+#define COUNT_ESCAPE_SHIFT 8
+#define COUNT_ESCAPE_ENTRIES (1 << COUNT_ESCAPE_SHIFT)
+#define COUNT_ARENA_BYTES (COUNT_ARENA_BASE_BYTES - 2 * COUNT_ESCAPE_ENTRIES * 8)
+#else
+#define COUNT_ARENA_BYTES COUNT_ARENA_BASE_BYTES
+#endif
+
+#if COUNT_WIDTH == 32
+typedef uint32_t count_t;
+#elif COUNT_WIDTH == 16
+typedef uint16_t count_t;
+#else
+#error COUNT_WIDTH must be 16 or 32
+#endif
+
+#define COUNT_ARENA_BINS (COUNT_ARENA_BYTES / sizeof(count_t))
+
+// Each counter channel counts pulses on a TCLK input, routed through
+// the XC clock of its block.  COUNT_MODE_LATCH captures on the TIOA
+// pin, which must be jumpered to the step signal; PA15 is both the
+// step input and TIOA1.
+typedef struct
+{
+	Tc *tc;
+	uint8_t channel;
+	uint8_t id;
+	uint32_t clock;      // TC_CMR_TCCLKS_XC* carrying clock_pin
+	Pio *pio;
+	uint32_t clock_pin;
+	uint32_t latch_pin;
+} counter_channel_t;
+
+#define COUNTER_CHANNEL_ENTRY(index, tc, xc, pio, clock_pin, latch_pin) \
+	{ COUNTER_TC_BLOCK(tc), COUNTER_TC_CHANNEL(tc), COUNTER_TC_ID(tc), TC_CMR_TCCLKS_XC0 + (xc), \
+		pio, clock_pin, latch_pin },
+
+static const counter_channel_t counter_channels[COUNTER_CHANNELS_MAX] =
+{
+	COUNTER_BOARD_WIDE_CHANNELS(COUNTER_CHANNEL_ENTRY)
+	COUNTER_BOARD_EXTRA_CHANNELS(COUNTER_CHANNEL_ENTRY)
+};
+
+// Registers of each counter channel, filled in by configure_counters
+// so that the step path indexes them directly
+static TcChannel *counter_regs[COUNTER_CHANNELS];
+
+// Counters stored, bit n for counter channel n, set by M1106.  The set
+// counters are stored, read and cleared as channels 0 up in order, and
+// the others are not read at all.  channel_regs gives the registers of
+// each stored channel for the step path, and counter_slot the stored
+// channel of each counter, COUNTER_CHANNELS for none.
+static uint16_t channel_mask = 0x7;
+static TcChannel *channel_regs[COUNTER_CHANNELS];
+static uint8_t counter_slot[COUNTER_CHANNELS];
+
+// Threshold ladder (M1126): counters 0 up to energy_channels - 1 count
+// one detector through discriminators at rising thresholds, stored as
+// channels 0 up.  With energy_binned set each commit hands energy_commit
+// the counts, to keep the bin between a threshold and the next instead
+// of everything above it.  Off (0) unless those counters are all stored.
+static volatile uint8_t energy_channels;
+static volatile bool energy_binned;
+
+// Counts that end a point of time-based acquisition, 0 with early stop
+// off (M1130, further down)
+static volatile uint32_t early_target;
+static void early_configure(void);
+
+static void channel_map(void)
+{
+	uint8_t stored = 0;
+	for (uint8_t c = 0; c < COUNTER_CHANNELS; c++)
+	{
+		counter_slot[c] = COUNTER_CHANNELS;
+		if (channel_mask & (1u << c))
+		{
+			counter_slot[c] = stored;
+			channel_regs[stored++] = counter_regs[c];
+		}
+	}
+
+	uint16_t ladder = (1u << energy_channels) - 1;
+	if ((channel_mask & ladder) != ladder)
+	{
+		energy_channels = 0;
+		energy_binned = false;
+	}
+	// The primary may have moved to another counter
+	if (early_target)
+		early_configure();
+}
 
 // The current relative position (in steps) of the head
 volatile int32_t head_position;
 
-// Counter buffers
-volatile bool enable_count = false;
-volatile uint16_t primary_count[HEAD_STEPS_MAX];
-volatile uint16_t secondary_count[HEAD_STEPS_MAX];
-volatile uint16_t tertiary_count[HEAD_STEPS_MAX];
+// The current row, and the index of its first cell (head_row * column_count)
+volatile int32_t head_row;
+static uint32_t head_row_base;
+
+// Number of steps accumulated into each column, set by M1022.
+// head_position counts columns, so the buffer covers bin_factor
+// times the travel.  bin_phase is the step offset inside the column.
+volatile uint16_t bin_factor = 1;
+static int32_t bin_phase;
+
+// Bidirectional passes, set by M1053.  The counts gathered between two
+// steps belong to the span the head crossed, which starts at the old
+// position going forward but at the new one in reverse.  Committing
+// before the move in both directions puts every reverse column one step
+// ahead of the forward pass on the same cell.  With this set a reverse
+// step moves first and commits on arriving at phase 0, so both
+// directions bin each span by the same cell and can share one frame.
+static volatile bool step_bidirectional = false;
+
+// Backlash compensation, set by M1115 or measured by M1114.  Reverse
+// passes land backlash_shift columns further on than forward passes
+// over the same film, so the head moves back by that much when it
+// turns to reverse and forward again when it turns back.
+// backlash_direction is the way it last went.
+static volatile int32_t backlash_shift = 0;
+static int32_t backlash_direction = 1;
+
+// Both step edges, set by M1065.  Each edge then moves the head by a
+// column, so positions, columns and bin_factor count half steps and the
+// buffer resolves twice as finely at the same motor step rate.
+static bool step_both_edges = false;
+
+#if COUNTER_BEAM_GATE
+// Counting gated by the beam-on signal, set by M1083
+static bool beam_gate = false;
+#endif
+
+// Primary channel chained to a 32-bit hardware count, set by M1105.
+// TIOA1 rises as TC0 channel 1 passes 0x8000 and falls as it wraps,
+// and TC0 channel 0, the tertiary channel's counter, counts its rising
+// edges on XC2 as the high half.  The TCs route TIOA only within a
+// block, so only the primary is chained, and the tertiary input is not
+// counted meanwhile.
+#define COUNTER_CHAIN_CHANNELS 2
+#define COUNTER_CHAIN_HIGH 2
+static volatile bool counter_chained = false;
+// Chained count at the last commit, for COUNT_MODE_DELTA
+static uint32_t chain_snapshot;
+
+// Steps handled by Trigger_Step, compared against STEP_CHECK_TC
+volatile uint16_t steps_serviced;
+
+// Throughput totals for M1052, only ever incremented where the work is
+// done; rate_poll() turns them into per-second rates
+static volatile uint32_t steps_processed;
+static volatile uint32_t count_totals[COUNTER_CHANNELS];
+static uint32_t commands_processed;
+// sof_count when counting last started
+static volatile uint32_t count_started;
+// time_us() when counting last started and stopped, for the wall clock
+// stamps (M1123); stopped is 0 while counting
+static uint64_t time_us(void);
+static volatile uint64_t count_started_us;
+static volatile uint64_t count_stopped_us;
+
+// How the counter channels are sampled on each step
+enum count_mode
+{
+	// Read each TC_CV in turn then reset all channels with TC_BCR SYNC
+	COUNT_MODE_RESET = 0,
+	// The step edge on TIOA captures each channel into RA and resets
+	// it in hardware, so all channels latch on the same edge
+	COUNT_MODE_LATCH = 1,
+	// The channels free-run and each step stores the difference from
+	// the previous snapshot, so nothing is written to the TC per step
+	COUNT_MODE_DELTA = 2,
+	// The step edge captures the primary count and the PDC stores it,
+	// so no code runs per step (see capture_poll)
+	COUNT_MODE_CAPTURE = 3,
+};
+
+volatile uint8_t count_mode = COUNT_MODE_RESET;
+
+// Last TC_CV seen by COUNT_MODE_DELTA for each channel
+static uint16_t count_snapshot[COUNTER_CHANNELS];
+
+// Running totals of the bank being filled, kept by count_add so they
+// can be read at any time (M1039).  readout_totals holds those of the
+// readout bank from the moment it was swapped out.
+typedef struct
+{
+	uint64_t total[COUNTER_CHANNELS];      // Counts added since the bank was cleared
+	uint32_t peak[COUNTER_CHANNELS];       // Largest bin
+	uint32_t peak_cell[COUNTER_CHANNELS];  // Cell holding it
+} totals_t;
+
+static volatile totals_t live_totals;
+static volatile totals_t readout_totals;
+
+// Cells touched since the last dirty readout (M1041), one bit per block
+// of DIRTY_BLOCK_CELLS cells.  Like the totals, dirty_live follows the
+// bank being filled and dirty_readout the readout bank.
+#define DIRTY_BLOCK_SHIFT 5
+#define DIRTY_BLOCK_CELLS (1 << DIRTY_BLOCK_SHIFT)
+#define DIRTY_WORDS (65536 / DIRTY_BLOCK_CELLS / 32)
+
+static volatile uint32_t dirty_live[DIRTY_WORDS];
+static volatile uint32_t dirty_readout[DIRTY_WORDS];
+
+#define DIRTY_TEST(map, block) ((map)[(block) >> 5] & (1UL << ((block) & 31)))
+
+// Counter buffers
+volatile bool enable_count = false;
+COMPILER_WORD_ALIGNED volatile count_t count_arena[COUNT_ARENA_BINS];
+
+// Partition of the arena, set by M1023.
+// column_count is the number of columns the head wraps around,
+// row_count the number of rows selected by the second axis and
+// channel_count the number of channels stored, starting with primary.
+// Each (row, column) pair is a cell numbered row * column_count + column;
+// readouts address cells, so a range can span several whole rows.
+volatile uint16_t column_count = COUNT_ARENA_BINS / 3;
+volatile uint16_t row_count = 1;
+volatile uint16_t cell_count = COUNT_ARENA_BINS / 3;
+
+// Acquisition window, set by M1054.  head_position wraps at
+// travel_columns, and only the column_count columns from window_start
+// on are stored, so the buffer and its readouts cover just the film
+// while the head overtravels it.  M1023 resets it to the whole buffer.
+static volatile uint16_t window_start = 0;
+static volatile uint16_t travel_columns = COUNT_ARENA_BINS / 3;
+
+// Travel ends, set by M1055.  By default the head wraps around from one
+// end of the travel to the other.  With hard limits it carries on past
+// the ends instead, and nothing is stored until it comes back, so
+// overtravel cannot land in a column at the far end.  head_origin is
+// the travel column reported as position 0.
+static volatile bool head_limits = false;
+static volatile uint16_t head_origin = 0;
+// Steps taken beyond the hard limits since counting started
+static volatile uint32_t limit_steps;
+
+// Row alignment (M1131).  Each of the first ROW_ALIGN_ROWS rows has a
+// shift in columns that is added to the head's column while it is in
+// that row, so rows the head crossed a few columns off each other are
+// stored registered and the frame needs no pass on the host.  A column
+// shifted outside the window is dropped like overtravel.  head_shift
+// is the shift of the head's row, taken whenever the row is selected,
+// so a commit pays one add.  Every row change by the row input or a
+// sealing reversal also marks the head_position and time_us() where the
+// row was ended and the new one started.
+#define ROW_ALIGN_ROWS 128
+
+typedef struct
+{
+	int32_t start;     // head_position where the head last entered the row
+	int32_t end;       // and left it
+	uint32_t started;  // time_us() then, low words, 0 if not yet
+	uint32_t ended;
+} row_mark_t;
+
+static int16_t row_shift[ROW_ALIGN_ROWS];
+static row_mark_t row_marks[ROW_ALIGN_ROWS];
+static volatile int32_t head_shift;
+
+// Buffer column under the head, column_count or more outside the window
+static __always_inline uint32_t head_column(void)
+{
+	return (uint32_t)(head_position - window_start + head_shift);
+}
+
+static __always_inline void head_row_select(int32_t row)
+{
+	head_row = row;
+	head_row_base = row * column_count;
+	head_shift = row < ROW_ALIGN_ROWS ? row_shift[row] : 0;
+}
+
+// Moves the head to row, marking where it left the last one.  Kept out
+// of line, off the usual step path.
+COUNTER_ISR static __attribute__((noinline)) void head_row_change(int32_t row)
+{
+	int32_t position = head_position;
+	uint32_t now = (uint32_t)time_us();
+	if (head_row < ROW_ALIGN_ROWS)
+	{
+		row_marks[head_row].end = position;
+		row_marks[head_row].ended = now;
+	}
+	head_row_select(row);
+	if (row < ROW_ALIGN_ROWS)
+	{
+		row_marks[row].start = position;
+		row_marks[row].started = now;
+		row_marks[row].ended = 0;
+	}
+}
+volatile uint8_t channel_count = 3;
+
+// Ping-pong banks for acquiring while the host reads (M1025).
+// Each bank holds COUNT_CELL_BINS(cell_count, channel_count) bins (plus
+// any timestamp track), rounded up so that
+// it owns whole words of count_overflow.  count_bank is the offset of
+// the bank the step interrupt fills and readout_bank that of the bank
+// the readout commands see; they differ after the first swap.
+#define COUNT_BANK_ALIGN 32
+volatile uint32_t bank_bins = COUNT_ARENA_BINS;
+volatile uint32_t count_bank;
+volatile uint32_t readout_bank;
+
+#if COUNTER_SD_LOG
+// Swaps completed by DMAC_Handler, and frames finished by the head
+// wrapping around its last row (or column in timed acquisition)
+static volatile uint32_t bank_swaps;
+static volatile uint32_t frame_ends;
+#endif
+
+#if COUNT_LAYOUT_INTERLEAVED
+// One group of channel_count bins per cell
+#define COUNT_INDEX(channel, cell) ((cell) * channel_count + (channel))
+#else
+// One plane of cell_count bins per channel
+#define COUNT_INDEX(channel, cell) ((channel) * cell_count + (cell))
+#endif
+
+#if COUNT_PACKED_CHANNELS
+#if COUNT_LAYOUT_INTERLEAVED || COUNTER_SD_LOG
+#error COUNT_PACKED_CHANNELS needs the planar layout and no SD frame log
+#endif
+
+// The primary plane of cell_count bins, then one plane of cell_count
+// bytes per other channel
+#define COUNT_CELL_BINS(cells, channels) \
+	((cells) + (((channels) - 1) * (cells) + sizeof(count_t) - 1) / sizeof(count_t))
+#define COUNT_PACKED(bank, channel, cell) \
+	(((volatile uint8_t *)&count_arena[(bank) + cell_count])[((channel) - 1) * cell_count + (cell)])
+#define COUNT_PACKED_ESCAPE UINT8_MAX
+#define COUNT_MAX ((count_t)~0u)
+
+// A packed bin at COUNT_PACKED_ESCAPE holds its count here, found by
+// linear probing from a hash of the bin.  A bin that finds none of
+// COUNT_ESCAPE_PROBES slots free stays at COUNT_PACKED_ESCAPE and reads
+// as an overflow.  Each bank has a table of its own, cleared with it.
+#define COUNT_ESCAPE_PROBES 8
+
+typedef struct
+{
+	uint32_t key;    // 1 + offset of the bin in the packed planes, 0 when free
+	uint32_t value;
+} count_escape_t;
+
+static count_escape_t count_escape[2][COUNT_ESCAPE_ENTRIES];
+static volatile uint32_t count_escape_used[2];
+static volatile uint32_t count_escape_peak;  // Most slots taken in one table (M1050)
+
+// Enough for the largest bank to be either one
+#define COUNT_ESCAPE_TABLE(bank) ((bank) ? 1 : 0)
+
+// Slot of a bin in the escape table of a bank, or NULL if it has none.
+// With claim set, a bin without one takes the first free slot it meets.
+static count_escape_t *count_escape_slot(uint32_t bank, uint32_t key, bool claim)
+{
+	uint8_t table = COUNT_ESCAPE_TABLE(bank);
+	uint32_t hash = (key * 2654435761u) >> (32 - COUNT_ESCAPE_SHIFT);
+	for (uint32_t probe = 0; probe < COUNT_ESCAPE_PROBES; probe++)
+	{
+		count_escape_t *entry = &count_escape[table][(hash + probe) & (COUNT_ESCAPE_ENTRIES - 1)];
+		if (entry->key == key)
+			return entry;
+
+		if (entry->key == 0)
+		{
+			if (!claim)
+				return NULL;
+
+			entry->key = key;
+			entry->value = 0;
+			if (++count_escape_used[table] > count_escape_peak)
+				count_escape_peak = count_escape_used[table];
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+static __always_inline uint32_t count_escape_key(uint8_t channel, uint32_t cell)
+{
+	return 1 + (channel - 1) * cell_count + cell;
+}
+
+// Count of a packed bin at COUNT_PACKED_ESCAPE, saturated to count_t
+static __attribute__((noinline)) count_t count_escaped(uint32_t bank, uint8_t channel, uint32_t cell)
+{
+	count_escape_t *entry = count_escape_slot(bank, count_escape_key(channel, cell), false);
+	return entry ? Min(entry->value, COUNT_MAX) : COUNT_PACKED_ESCAPE;
+}
+
+static __always_inline count_t count_read(uint32_t bank, uint8_t channel, uint32_t cell)
+{
+	if (channel == 0)
+		return count_arena[bank + cell];
+
+	uint8_t packed = COUNT_PACKED(bank, channel, cell);
+	return likely(packed < COUNT_PACKED_ESCAPE) ? packed : count_escaped(bank, channel, cell);
+}
+
+#define COUNT_BIN(channel, cell) count_read(readout_bank, channel, cell)
+#else
+#define COUNT_CELL_BINS(cells, channels) ((cells) * (channels))
+#define COUNT_BIN(channel, cell) count_arena[readout_bank + COUNT_INDEX(channel, cell)]
+#endif
+
+// Millisecond count: of USB start of frames while the bus is active or,
+// with COUNTER_RTT_TICK, of RTT ticks
+static volatile uint32_t sof_count;
+
+static void stop_tick(void);
+static void cine_tick(void);
+
+static void ms_tick(void)
+{
+	sof_count++;
+	stop_tick();
+	cine_tick();
+}
+
+void main_sof_action(void)
+{
+#if !COUNTER_RTT_TICK
+	ms_tick();
+#endif
+}
+
+#if COUNTER_RTT_TICK
+// The RTT increments at 32768 / RTT_PRESCALER = 1024 Hz, and 1000 of
+// every 1024 increments tick, the others spread evenly between them,
+// so a millisecond lasts 0.98 or 1.95 ms but a second is exact.  At the
+// USB priority, as SOFs were, so the ticks preempt the same code.
+#define RTT_PRESCALER 32
+#define RTT_HZ (BOARD_FREQ_SLCK_XTAL / RTT_PRESCALER)
+
+void RTT_Handler(void)
+{
+	static uint16_t fraction;
+	(void)RTT->RTT_SR;
+	fraction += 1000;
+	if (fraction >= RTT_HZ)
+	{
+		fraction -= RTT_HZ;
+		ms_tick();
+	}
+}
+
+static void rtt_init(void)
+{
+	RTT->RTT_MR = RTT_MR_RTPRES(RTT_PRESCALER) | RTT_MR_RTTINCIEN | RTT_MR_RTTRST;
+	NVIC_SetPriority(RTT_IRQn, UDD_USB_INT_LEVEL);
+	NVIC_EnableIRQ(RTT_IRQn);
+}
+#endif
+
+// Per-cell timestamp track, enabled by M1030.  It takes the end of each
+// bank and holds the low 16 bits of sof_count when the head last left the
+// cell, so the host can work out head velocity and dose rate.
+volatile bool time_track = false;
+#define TIME_TRACK_BINS(cells) (((cells) * sizeof(uint16_t) + sizeof(count_t) - 1) / sizeof(count_t))
+#define COUNT_TIME_BANK(bank, cell) \
+	(((volatile uint16_t *)&count_arena[(bank) + COUNT_CELL_BINS(cell_count, channel_count)])[cell])
+#define COUNT_TIME(cell) COUNT_TIME_BANK(readout_bank, cell)
+
+// Per-cell coincidence track, enabled by M1073.  It follows the timestamp
+// track and holds the coincidences counted while the head was over the
+// cell (see coincidence_edge), saturated to 16 bits.
+static volatile bool coincidence_track = false;
+#define COINCIDENCE_TRACK_BINS(cells) TIME_TRACK_BINS(cells)
+#define COUNT_COINCIDENCE_BANK(bank, cell) \
+	(((volatile uint16_t *)&count_arena[(bank) + COUNT_CELL_BINS(cell_count, channel_count) \
+		+ (time_track ? TIME_TRACK_BINS(cell_count) : 0)])[cell])
+#define COUNT_COINCIDENCE(cell) COUNT_COINCIDENCE_BANK(readout_bank, cell)
+
+// Per-cell analog track, enabled by M1093.  It follows the coincidence
+// track and holds, for each AFEC input in turn, the sample the AFEC had
+// last converted when the head left the cell (see analog_commit).
+#define ANALOG_INPUTS 2
+static volatile bool analog_track = false;
+static uint32_t analog_offset;
+#define ANALOG_TRACK_BINS(cells) TIME_TRACK_BINS((cells) * ANALOG_INPUTS)
+#define COUNT_ANALOG_BANK(bank, input, cell) \
+	(((volatile uint16_t *)&count_arena[(bank) + analog_offset])[(input) * cell_count + (cell)])
+#define COUNT_ANALOG(input, cell) COUNT_ANALOG_BANK(readout_bank, input, cell)
+
+// Per-cell dwell track, enabled by M1075.  It comes last, word aligned
+// at dwell_offset bins into each bank, and holds the CPU cycles the head
+// spent in the cell over every pass, saturated to 32 bits (about 35 s),
+// so M1076 can turn the counts into rates.
+static volatile bool dwell_track = false;
+static uint32_t dwell_offset;
+#define DWELL_TRACK_BINS(cells) ((cells) * sizeof(uint32_t) / sizeof(count_t))
+#define COUNT_DWELL_BANK(bank, cell) (((volatile uint32_t *)&count_arena[(bank) + dwell_offset])[cell])
+#define COUNT_DWELL(cell) COUNT_DWELL_BANK(readout_bank, cell)
+
+// Tracks that partition_arena places after the count bins
+#define ARENA_TRACK_TIME 0x01
+#define ARENA_TRACK_COINCIDENCES 0x02
+#define ARENA_TRACK_DWELL 0x04
+#define ARENA_TRACK_ANALOG 0x08
+
+#if COUNT_WIDTH == 16
+// One bit per arena bin, set when the bin saturated
+#define COUNT_OVERFLOW_WORDS ((COUNT_ARENA_BINS + 31) / 32)
+volatile uint32_t count_overflow[COUNT_OVERFLOW_WORDS];
+#define COUNT_BIN_OVERFLOWED(channel, cell) \
+	(count_overflow[(readout_bank + COUNT_INDEX(channel, cell)) >> 5] \
+		& (1UL << ((readout_bank + COUNT_INDEX(channel, cell)) & 31)))
+#else
+#define COUNT_BIN_OVERFLOWED(channel, cell) false
+#endif
+
+#if COUNT_PACKED_CHANNELS
+// Packed bins overflow when their escaped count does not fit in count_t
+// or they found no escape slot
+static bool count_overflowed(uint8_t channel, uint32_t cell)
+{
+	if (channel == 0)
+		return COUNT_BIN_OVERFLOWED(channel, cell);
+
+	if (COUNT_PACKED(readout_bank, channel, cell) < COUNT_PACKED_ESCAPE)
+		return false;
+
+	count_escape_t *entry = count_escape_slot(readout_bank, count_escape_key(channel, cell), false);
+	return !entry || entry->value > COUNT_MAX;
+}
+
+#define COUNT_OVERFLOWED(channel, cell) count_overflowed(channel, cell)
+#elif COUNT_WIDTH == 16
+#define COUNT_OVERFLOWED(channel, cell) COUNT_BIN_OVERFLOWED(channel, cell)
+#endif
+
+// Header sent ahead of each binary readout payload.
+// All fields are little-endian, and the payload that follows
+// is the raw count_t array for the requested columns.
+typedef struct
+{
+	uint16_t channel;  // Channel index, or one of the READOUT_ALL_* layouts
+	uint16_t start;
+	uint16_t end;
+	uint16_t crc;     // CRC-16/CCITT of the payload
+	uint32_t length;  // Payload length in bytes
+	uint8_t width;    // Bytes per count value
+	uint8_t flags;    // READOUT_FLAG_*
+	uint16_t reserved; // Timestamp readouts: low 16 bits of sof_count when read;
+	                   // multi-channel readouts: mask of the channels sent;
+	                   // flat-field readouts: 1 if the background was subtracted;
+	                   // pass mean readouts: fewest passes over any cell sent;
+	                   // coincidence readouts: the window in ns;
+	                   // rate, uncertainty, smoothed and predictive
+	                   // readouts: the channel;
+	                   // flash log dumps: records sent;
+	                   // analog readouts: the input
+} readout_header_t;
+
+// At least one column in the range saturated (see M1019)
+#define READOUT_FLAG_OVERFLOW 0x01
+// The payload is run-length/delta encoded (see rle_payload)
+#define READOUT_FLAG_RLE 0x02
+// The payload is dead-time corrected uint32_t counts (see M1034)
+#define READOUT_FLAG_CORRECTED 0x04
+// The payload is uint32_t dose from the calibration curve (see M1036)
+#define READOUT_FLAG_DOSE 0x08
+// The payload is uint32_t sums of decimated column runs (see M1040)
+#define READOUT_FLAG_DECIMATED 0x10
+// The payload is dirty_region_t headers each followed by its counts (see M1041)
+#define READOUT_FLAG_DIRTY 0x20
+// Steps beyond the hard limits were dropped since counting started (see M1055)
+#define READOUT_FLAG_LIMIT 0x40
+// The counts were scaled by the column gain map (see M1058)
+#define READOUT_FLAG_GAIN 0x80
+
+// Multi-channel readout layouts reported in readout_header_t.channel
+// Planar sends each selected channel's range in turn (primary, secondary, ...),
+// interleaved sends the selected channels together for each column.
+#define READOUT_ALL_PLANAR 0x100
+#define READOUT_ALL_INTERLEAVED 0x101
+// The timestamp track (see M1031), uint16_t per cell
+#define READOUT_TIMESTAMPS 0x102
+// Secondary/primary and tertiary/primary as Q15 pairs per column (see M1037)
+#define READOUT_RATIOS 0x103
+// Passes over each cell (see M1062), uint16_t per cell
+#define READOUT_PASS_VISITS 0x104
+// Pulse interval histogram (see M1071), uint32_t per bin
+#define READOUT_HISTOGRAM 0x105
+// The coincidence track (see M1074), uint16_t per cell
+#define READOUT_COINCIDENCES 0x106
+// Counts per second of one channel over its dwell (see M1076), uint32_t per cell
+#define READOUT_RATES 0x107
+// The flash scan log (M1082): each record's pages as they are in flash
+#define READOUT_FLASH_LOG 0x108
+// The analog track of one AFEC input (see M1094), uint16_t per cell
+#define READOUT_ANALOG 0x109
+// Counts of one channel and their Poisson uncertainty (see M1095),
+// two uint32_t per cell
+#define READOUT_UNCERTAINTY 0x10A
+// Counts of one channel through the M1096 FIR filter (see M1097),
+// uint32_t per cell
+#define READOUT_SMOOTHED 0x10B
+// Counts of one channel predicted from the row above and Rice coded
+// (see predicted_payload)
+#define READOUT_PREDICTED 0x10C
+// Counts of one row resampled onto a uniform grid in micrometres
+// through the M1107 calibration (see M1108), uint32_t per grid point
+#define READOUT_RESAMPLED 0x10D
+// Coarse bins of one channel from the count pyramid (see M1110),
+// uint32_t per bin
+#define READOUT_PYRAMID 0x10E
+// A rectangle of one channel's counts as whole square tiles (see M1111)
+#define READOUT_TILES 0x10F
+// Set in readout_header_t.channel when the payload is sent as an LZ4
+// frame (see M1102).  The rest of the header describes the payload
+// within it, so its length and CRC are those of the frame's content.
+#define READOUT_LZ4 0x8000
+// Set in readout_header_t.channel when the payload comes as stripe chunks
+// spread over several pipes (see M1129).  The rest of the header
+// describes the payload as the host has it once the chunks are in place.
+#define READOUT_STRIPED 0x4000
+
+// Self-describing container for a readout (M1056), the same on the wire
+// and in archive files: a container_header_t, then blocks of
+// CONTAINER_BLOCK_COLUMNS columns (the last may be shorter), each
+// followed by the uint32_t CRC-32 of its payload.  A block holds every
+// selected channel, planar or interleaved like M1016, so with the header
+// a reader can seek straight to any column of any row.
+#define CONTAINER_MAGIC 0x52464344  // "DCFR"
+#define CONTAINER_VERSION 2
+#define CONTAINER_BLOCK_COLUMNS READOUT_SLICE_COLUMNS
+
+typedef struct
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t header_bytes;  // sizeof(container_header_t), later versions may add fields
+	uint32_t build_id;      // CRC-32 of the firmware build date and time
+	uint16_t firmware;      // USB bcdDevice
+	uint16_t mask;          // Channels sent, bit n for channel n
+	uint16_t start;         // Cell range
+	uint16_t end;
+	uint16_t columns;       // Cells per row (column_count)
+	uint16_t rows;
+	uint16_t bin_factor;
+	uint16_t block_columns;
+	uint8_t width;          // Bytes per count value
+	uint8_t interleaved;
+	uint8_t flags;          // READOUT_FLAG_*
+	uint8_t reserved;
+	uint32_t started;       // sof_count (ms) when counting last started
+	uint32_t read;          // sof_count when the readout was taken
+	uint32_t blocks;
+	// Version 2: Unix time (M1123) when counting last started and
+	// stopped, and the microseconds into that second.  0 if the clock
+	// is not set, and stop 0 while counting.
+	uint32_t wall_started;
+	uint32_t wall_started_us;
+	uint32_t wall_stopped;
+	uint32_t wall_stopped_us;
+	uint32_t crc;           // CRC-32 of the fields above
+} container_header_t;
+
+// Streaming of completed columns while counting is active.
+// Trigger_Step is the only producer and the main loop the only consumer,
+// so the ring indices need no locking: each side only writes its own index.
+// The ring size must be a power of two.
+#define STREAM_RING_SIZE 512
+#define STREAM_MAGIC 0x5AA5
+
+// The counts added to a column by a single step
+typedef struct
+{
+	uint16_t position;
+	uint16_t primary;
+	uint16_t secondary;
+	uint16_t tertiary;
+} stream_record_t;
+
+// A pulse recorded in list mode (M1072), in the same 8 bytes so it
+// shares the stream ring
+typedef struct
+{
+	uint32_t time;       // TIMER_CLOCK1 ticks since list mode started, wrapping
+	uint16_t position;   // Cell under the head, EVENT_OUTSIDE beyond the window
+	uint8_t channel;
+	uint8_t flags;       // EVENT_FLAG_*
+} stream_event_t;
+
+#define STREAM_EVENT_MAGIC 0x5AA7
+
+// The counts of a beam pulse in sync pulse mode (M1046 3), in the same
+// 8 bytes.  The tertiary channel is binned but not streamed.
+typedef struct
+{
+	uint16_t pulse;      // Index of the pulse since M1003, wrapping
+	uint16_t position;   // Cell under the head
+	uint16_t primary;
+	uint16_t secondary;
+} stream_pulse_t;
+
+#define STREAM_PULSE_MAGIC 0x5AA9
+#define EVENT_OUTSIDE 0xFFFF
+// Pulses were missed between this event and the one before it
+#define EVENT_FLAG_MISSED 0x01
+
+// Header sent ahead of each block of streamed records.
+// The magic value can never start a text reply, so the host
+// can separate stream blocks from command responses.
+typedef struct
+{
+	uint16_t magic;
+	uint16_t records;
+	uint32_t dropped;  // Records lost to ring overflow since streaming was enabled
+} stream_header_t;
+
+// Records that fill one full-speed packet with their header
+#define STREAM_BLOCK_RECORDS ((UDI_CDC_DATA_EPS_FS_SIZE - sizeof(stream_header_t)) / sizeof(stream_record_t))
+
+// Aggregation, set by M1067 <bytes> <us>: a block is sent once the queued
+// records fill <bytes> (header included) or the oldest of them has waited
+// <us>, whichever comes first.  The wait is timed by the millisecond
+// tick, so it is rounded up to whole milliseconds and a wait of 0 sends
+// whatever is queued on every pass (the boot default, with one packet
+// per block).
+#define STREAM_BLOCK_MAX_BYTES (8 * UDI_CDC_DATA_EPS_FS_SIZE)
+#define STREAM_BLOCK_MAX_RECORDS ((STREAM_BLOCK_MAX_BYTES - sizeof(stream_header_t)) / sizeof(stream_record_t))
+#define STREAM_WAIT_MAX_US 1000000
+
+volatile bool enable_stream = false;
+static stream_record_t stream_ring[STREAM_RING_SIZE];
+static ring_t stream_queue;
+static volatile uint32_t stream_dropped;
+static uint16_t stream_magic = STREAM_MAGIC;  // Of the records in the ring
+static volatile bool stream_events;  // List mode is filling the ring
+static uint16_t stream_block_records = STREAM_BLOCK_RECORDS;
+static uint32_t stream_wait_us;
+static uint32_t stream_wait_ms;
+static volatile uint32_t stream_oldest; // sof_count when the oldest queued record was queued
+
+// Credit flow control, set by M1069 <0|1> [<records>].  Under credit a
+// block is only sent within the records the host has granted, so a host
+// that falls behind can no longer stall the main loop in a blocking CDC
+// write; the producer keeps counting and what the ring cannot hold shows
+// up in stream_dropped.  Restarting the stream (M1017) clears the credits.
+static bool stream_credit;
+static uint32_t stream_credits;
+static bool stream_stalled;
+static uint32_t stream_stalls;  // Times records were queued with no credit left
+
+// Deferred accumulation (M1047).  commit_column only queues the cell,
+// its time and the counts of each stored channel, and the main loop adds
+// them to the arena in batches, so the counting interrupts return right
+// after the TC reads.  Those interrupts share one priority and never
+// preempt each other, so together they are the ring's single producer.
+// The ring size must be a power of two.
+#define DEFER_RING_SIZE 256
+
+typedef struct
+{
+	uint16_t cell;
+	uint16_t time;  // Low 16 bits of sof_count when the head left the cell
+	uint32_t counts[COUNTER_CHANNELS];
+} defer_record_t;
+
+static volatile bool defer_columns = false;
+static defer_record_t defer_ring[DEFER_RING_SIZE];
+static ring_t defer_queue;
+static volatile uint32_t defer_dropped;
+
+// A bank swap left by DMAC_Handler to defer_poll, which makes it after
+// adding the records queued before it
+static volatile bool defer_swap;
+static volatile uint32_t defer_swap_at;
+
+void parse_gcode(const char *line, uint16_t length);
+static const char *parse_batch(const char *line);
+
+#if COUNT_PACKED_CHANNELS
+// Adds to a packed bin that reaches COUNT_PACKED_ESCAPE, out of line as
+// it is rare.  Returns the new count.
+static __attribute__((noinline)) uint32_t count_escape_add(uint8_t channel, uint32_t cell, uint32_t value)
+{
+	volatile uint8_t *bin = &COUNT_PACKED(count_bank, channel, cell);
+	bool escaped = *bin == COUNT_PACKED_ESCAPE;
+	count_escape_t *entry = count_escape_slot(count_bank, count_escape_key(channel, cell), !escaped);
+	if (!entry)
+	{
+		// Left at the escape value, which reads back as an overflow
+		*bin = COUNT_PACKED_ESCAPE;
+		return COUNT_PACKED_ESCAPE;
+	}
+
+	if (!escaped)
+	{
+		entry->value = *bin;
+		*bin = COUNT_PACKED_ESCAPE;
+	}
+	entry->value += value;
+	return entry->value;
+}
+#endif
+
+static __always_inline void count_add(uint8_t channel, uint32_t cell, uint32_t value)
+{
+	uint32_t sum;
+#if COUNT_PACKED_CHANNELS
+	if (channel != 0)
+	{
+		volatile uint8_t *bin = &COUNT_PACKED(count_bank, channel, cell);
+		sum = *bin + value;
+		if (likely(sum < COUNT_PACKED_ESCAPE))
+			*bin = sum;
+		else
+			sum = count_escape_add(channel, cell, value);
+	}
+	else
+#endif
+	{
+		uint32_t index = count_bank + COUNT_INDEX(channel, cell);
+#if COUNT_WIDTH == 16
+		sum = count_arena[index] + value;
+		if (sum > 0xFFFF)
+		{
+			sum = 0xFFFF;
+			count_overflow[index >> 5] |= 1UL << (index & 31);
+		}
+		count_arena[index] = sum;
+#else
+		sum = count_arena[index] + value;
+		count_arena[index] = sum;
+#endif
+	}
+
+	// Bins only grow between clears, so the largest sum seen is the peak
+	totals_t *totals = (totals_t *)&live_totals;
+	totals->total[channel] += value;
+	if (sum > totals->peak[channel])
+	{
+		totals->peak[channel] = sum;
+		totals->peak_cell[channel] = cell;
+	}
+}
+
+#if COUNTER_SYNC
+#define SYNC_MODE_NONE 0
+#define SYNC_MODE_MASTER 1
+#define SYNC_MODE_SLAVE 2
+#define SYNC_MODE_PULSE 3
+
+static uint8_t sync_mode = SYNC_MODE_NONE;
+
+// Set by M1003 on a slave, which starts counting on the next sync edge
+static volatile bool sync_armed;
+
+// Beam pulse edges in pulse mode since M1003
+static volatile uint32_t sync_pulses;
+#endif
+
+// Hardware-timed start (M1084).  Once armed, counting starts in the
+// interrupt of the first step edge or of a rising edge on START_PIN,
+// with the same reset as M1003, instead of whenever the command gets
+// through USB.
+#define START_ARMED_NONE 0
+#define START_ARMED_STEP 1
+#define START_ARMED_PIN 2
+
+static volatile uint8_t start_armed = START_ARMED_NONE;
+
+#if !COUNTER_POSITION_QDEC
+// Home input (M1086), from an index or limit switch.  Its rising edge
+// puts the head at home_offset from the origin in the interrupt itself,
+// so homing needs no M1002 round trip and can happen during a pass.
+// The position the head had is kept either way.
+#define HOME_OFF 0
+#define HOME_ONCE 1
+#define HOME_EVERY 2
+#define HOME_RECORD 3
+
+static volatile uint8_t home_mode = HOME_OFF;
+static int32_t home_offset;
+static volatile uint32_t home_edges;
+static volatile int32_t home_position;  // At the last edge, from the origin
+#endif
+
+// Stop conditions (M1085).  Counting stops, from the interrupt that
+// met the condition, once stop_target columns have been committed, the
+// head reaches column stop_target or stop_target ms have been counted.
+// stop_poll then swaps the frame out with stop_swap and pushes a
+// stop_push_t.  A condition only fires once.  The end of an M1087 scan
+// stops counting the same way, swapping with stop_scan_swap.
+// A trigger (M1112) waits with the arena as a ring of the columns
+// before it, then stops stop_target columns after it.
+#define STOP_OFF 0
+#define STOP_COLUMNS 1
+#define STOP_POSITION 2
+#define STOP_TIME 3
+#define STOP_SCAN 4
+#define STOP_CINE 5
+#define STOP_TRIGGER 6
+#define STOP_MAGIC 0x5AAA
+
+typedef struct
+{
+	uint16_t magic;
+	uint8_t kind;       // STOP_* that stopped counting
+	uint8_t swapped;    // The frame was swapped out for readout
+	int32_t position;   // Of the head at the stop, from the origin
+	int32_t row;
+	uint32_t columns;   // Committed since the condition was set or counting started
+	uint32_t elapsed;   // ms counted
+} stop_push_t;
+
+static volatile uint8_t stop_kind = STOP_OFF;
+static int32_t stop_target;
+static bool stop_swap;
+static bool stop_scan_swap;
+static volatile uint32_t stop_columns;
+static volatile bool stop_fired;
+static volatile bool stop_triggered;
+static stop_push_t stop_event;
+
+#if !COUNTER_POSITION_QDEC
+// Set while an adaptive scan (M1088) counts, for each commit to hand
+// motion_column the primary counts of the column
+static volatile bool motion_adapting;
+static void motion_column(uint32_t counts);
+#endif
+
+// Set while a threshold sweep (M1092) counts, for each commit to hand
+// sweep_column the counts of its window
+static volatile bool sweep_active;
+static void sweep_column(const uint32_t *counts, uint8_t channels);
+
+// SRAM pool (M1078) for the buffers of modes that are not always in
+// use.  It takes whatever the linker leaves above the stack, from _end
+// to __ram_end__ (flash.ld): nothing calls malloc, so the heap that would
+// start there is never used.  The buffers are reserved when their mode
+// is first configured and stay until M1078 0 gives everything back.
+extern uint32_t _end;
+extern uint32_t __ram_end__;
+static pool_t sram_pool;
+
+// Multi-pass accumulation (M1060).  Every time the head leaves one of the
+// first PASS_CELLS cells the counts it gathered are added to 32-bit sums
+// of that cell, and its pass count goes up by one, so repeated scans of
+// the same film average on the device rather than saturating the bins.
+// A cell stops accumulating after UINT16_MAX passes, which also keeps
+// its sums from wrapping.  Its own PASS_BYTES cover the sums, alongside
+// the arena rather than in it.
+#define PASS_BYTES 6144
+#define PASS_CELLS (PASS_BYTES / (COUNTER_CHANNELS * sizeof(uint32_t)))
+// Fraction bits of the mean counts per pass sent by M1061
+#define PASS_MEAN_SHIFT 8
+
+static volatile bool pass_accumulate = false;
+// Reserved from the SRAM pool by the first M1060 1
+static uint32_t (*pass_sum)[PASS_CELLS];
+static uint16_t *pass_visits;
+
+static bool pass_reserve(void)
+{
+	if (pass_visits)
+		return true;
+
+	pass_sum = pool_reserve(&sram_pool, "passes", COUNTER_CHANNELS * PASS_CELLS * sizeof(uint32_t));
+	if (pass_sum)
+		pass_visits = pool_reserve(&sram_pool, "visits", PASS_CELLS * sizeof(uint16_t));
+	return pass_visits;
+}
+
+static void pass_clear(void)
+{
+	if (!pass_visits)
+		return;
+
+	irqflags_t flags = cpu_irq_save();
+	memset(pass_sum, 0, COUNTER_CHANNELS * PASS_CELLS * sizeof(uint32_t));
+	memset(pass_visits, 0, PASS_CELLS * sizeof(uint16_t));
+	cpu_irq_restore(flags);
+}
+
+// Count pyramid (M1109).  Each channel's counts in the first
+// PYRAMID_CELLS cells of the live bank are also summed into bins of 8,
+// 64 and 512 consecutive cells as they are stored, so M1110 can send a
+// coarse preview of a large arena at any time, acquisition included,
+// without walking every bin.  Bins cross row ends unless the columns
+// are a multiple of their size.  The sums start over with the live
+// bank, on a clear, a bank swap or a new cine frame.
+#define PYRAMID_LEVELS 3
+#define PYRAMID_SHIFT 3
+#define PYRAMID_CELLS 8192
+// Bins of level l (1 to PYRAMID_LEVELS) start at PYRAMID_OFFSET(l)
+#define PYRAMID_OFFSET(l) ((l) == 1 ? 0 : (l) == 2 ? PYRAMID_CELLS >> PYRAMID_SHIFT \
+	: (PYRAMID_CELLS >> PYRAMID_SHIFT) + (PYRAMID_CELLS >> (2 * PYRAMID_SHIFT)))
+#define PYRAMID_BINS PYRAMID_OFFSET(PYRAMID_LEVELS + 1)
+
+static volatile bool pyramid_on = false;
+// Reserved from the SRAM pool by the first M1109 1, with room for a
+// copy of the bins being read so that they match their CRC
+static uint32_t (*pyramid)[PYRAMID_BINS];
+static uint32_t *pyramid_copy;
+
+// Called with interrupts off or from the counter interrupt
+static __always_inline void pyramid_clear(void)
+{
+	if (pyramid_on)
+		memset(pyramid, 0, COUNTER_CHANNELS * PYRAMID_BINS * sizeof(uint32_t));
+}
+
+// Bins of a level over the cells in use
+static uint32_t pyramid_bins(uint8_t level)
+{
+	uint32_t shift = level * PYRAMID_SHIFT;
+	return (Min(cell_count, PYRAMID_CELLS) + (1u << shift) - 1) >> shift;
+}
+
+// Goes up whenever bins are stored or cleared, so work done on the
+// counts can tell they have not changed since (see readout_precompute)
+static volatile uint32_t count_epoch;
+
+// Adds the counts of the first channels to a cell left at time
+static __always_inline void store_cell(uint32_t cell, const uint32_t *counts, uint8_t channels, uint16_t time)
+{
+	count_epoch++;
+	dirty_live[cell >> (DIRTY_BLOCK_SHIFT + 5)] |= 1UL << ((cell >> DIRTY_BLOCK_SHIFT) & 31);
+	for (uint8_t c = 0; c < channels; c++)
+	{
+		count_add(c, cell, counts[c]);
+		count_totals[c] += counts[c];
+	}
+	if (time_track)
+		COUNT_TIME_BANK(count_bank, cell) = time;
+
+	if (pass_accumulate && cell < PASS_CELLS && pass_visits[cell] != UINT16_MAX)
+	{
+		pass_visits[cell]++;
+		for (uint8_t c = 0; c < channels; c++)
+			pass_sum[c][cell] += counts[c];
+	}
+
+	if (pyramid_on && cell < PYRAMID_CELLS)
+	{
+		for (uint8_t c = 0; c < channels; c++)
+		{
+			pyramid[c][cell >> PYRAMID_SHIFT] += counts[c];
+			pyramid[c][PYRAMID_OFFSET(2) + (cell >> (2 * PYRAMID_SHIFT))] += counts[c];
+			pyramid[c][PYRAMID_OFFSET(3) + (cell >> (3 * PYRAMID_SHIFT))] += counts[c];
+		}
+	}
+
+	// Records carry the first three channels, saturated to 16 bits
+	if (enable_stream)
+	{
+		uint32_t slot;
+		if (ring_reserve(&stream_queue, STREAM_RING_SIZE, &slot))
+		{
+			stream_record_t *record = &stream_ring[slot];
+			if (ring_count(&stream_queue) == 0)
+				stream_oldest = sof_count;
+#if COUNTER_SYNC
+			if (unlikely(stream_magic == STREAM_PULSE_MAGIC))
+			{
+				stream_pulse_t *pulse = (stream_pulse_t *)record;
+				pulse->pulse = sync_pulses - 1;
+				pulse->position = cell;
+				pulse->primary = Min(counts[0], UINT16_MAX);
+				pulse->secondary = channels > 1 ? Min(counts[1], UINT16_MAX) : 0;
+				ring_commit(&stream_queue, 1);
+				return;
+			}
+#endif
+			record->position = cell;
+			record->primary = Min(counts[0], UINT16_MAX);
+			record->secondary = channels > 1 ? Min(counts[1], UINT16_MAX) : 0;
+			record->tertiary = channels > 2 ? Min(counts[2], UINT16_MAX) : 0;
+			ring_commit(&stream_queue, 1);
+		}
+		else
+			stream_dropped++;
+	}
+}
+
+// Adds the counts of the first channels to the cell under the head
+static __always_inline void store_column(const uint32_t *counts, uint8_t channels)
+{
+	store_cell(head_row_base + head_column(), counts, channels, sof_count);
+}
+
+// Coincidence detection (M1073).  The pulse inputs of the first three
+// channels are also jumpered to COINCIDENCE_PINS, whose rising edges
+// interrupt with the DWT cycle count as their time.  Edges on two or
+// more of them within coincidence_window cycles of the first are one
+// coincidence, however many channels fire, and commit_column adds the
+// coincidences since the last column to the coincidence track.  The
+// interrupt latency, about a microsecond under step load, is the
+// shortest useful window: edges that arrive together are seen in one
+// interrupt and always coincide.
+#define COINCIDENCE_PIO PIOE
+#define COINCIDENCE_PIO_ID ID_PIOE
+#define COINCIDENCE_IRQn PIOE_IRQn
+#define COINCIDENCE_PINS (PIO_PE0 | PIO_PE1 | PIO_PE2)
+#define COINCIDENCE_IRQ_PRIORITY (COUNTER_IRQ_PRIORITY + 1)
+#define COINCIDENCE_WINDOW_NS 1000
+#define COINCIDENCE_WINDOW_MAX_NS UINT16_MAX
+
+static uint32_t coincidence_window_ns = COINCIDENCE_WINDOW_NS;
+static uint32_t coincidence_window;  // In CPU cycles
+// Inputs seen since the first edge of the group, at coincidence_time
+static uint32_t coincidence_seen;
+static uint32_t coincidence_time;
+// Only the edge interrupt writes the total and only the column commit
+// the committed count, so neither needs locking
+static volatile uint32_t coincidence_total;
+static uint32_t coincidence_committed;
+
+// PIOE source handler, called once for each input that has an edge
+static void coincidence_edge(uint32_t id, uint32_t pin)
+{
+	uint32_t now = profile_cycles();
+	if (now - coincidence_time > coincidence_window)
+	{
+		coincidence_seen = 0;
+		coincidence_time = now;
+	}
+
+	// Counted once, as the group reaches its second input
+	uint32_t seen = coincidence_seen | pin;
+	if (seen != coincidence_seen && coincidence_seen && !(coincidence_seen & (coincidence_seen - 1)))
+		coincidence_total++;
+	coincidence_seen = seen;
+}
+
+// Adds the coincidences since the last commit to the cell under the head
+static __always_inline void coincidence_commit(void)
+{
+	uint32_t total = coincidence_total;
+	uint32_t count = total - coincidence_committed;
+	coincidence_committed = total;
+
+	uint32_t column = head_column();
+	if (count && column < column_count)
+	{
+		volatile uint16_t *bin = &COUNT_COINCIDENCE_BANK(count_bank, head_row_base + column);
+		*bin = Min(*bin + count, UINT16_MAX);
+	}
+}
+
+// Adds the cycles since the last commit to the dwell of the cell under
+// the head.  Counting restarts the clock (see counter_restart), and the
+// cycles a column spends in overtravel are dropped.
+static uint32_t dwell_last;
+
+static __always_inline void dwell_commit(void)
+{
+	uint32_t now = profile_cycles();
+	uint32_t cycles = now - dwell_last;
+	dwell_last = now;
+
+	uint32_t column = head_column();
+	if (column < column_count)
+	{
+		volatile uint32_t *bin = &COUNT_DWELL_BANK(count_bank, head_row_base + column);
+		uint32_t sum = *bin + cycles;
+		*bin = sum < cycles ? UINT32_MAX : sum;
+	}
+}
+
+// AFEC1 converts AFE1_AD0 (PB2) and AFE1_AD1 (PB3), the detector bias
+// current and HV monitor, free-running, so each input's own data register
+// always holds a fresh sample and a commit just copies it: no trigger,
+// transfer or interrupt per column.
+#define ANALOG_AFEC AFEC1
+#define ANALOG_AFEC_ID ID_AFEC1
+#define ANALOG_PINS (PIO_PB2X1_AFE1_AD0 | PIO_PB3X1_AFE1_AD1)
+#define ANALOG_CLOCK_HZ 12000000
+
+static __always_inline void analog_commit(void)
+{
+	uint32_t column = head_column();
+	if (column < column_count)
+	{
+		uint32_t cell = head_row_base + column;
+		for (uint8_t input = 0; input < ANALOG_INPUTS; input++)
+		{
+			ANALOG_AFEC->AFEC_CSELR = input;
+			COUNT_ANALOG_BANK(count_bank, input, cell) = ANALOG_AFEC->AFEC_CDR;
+		}
+	}
+}
+
+// Restarts every counter channel from zero
+static __always_inline void counter_reset(void)
+{
+	COUNTER_TC->TC_BCR = TC_BCR_SYNC;
+#if COUNTER_CHANNELS > 3
+	// A block sync would also restart the other timers of TC1 and TC2
+	for (uint8_t c = 3; c < COUNTER_CHANNELS; c++)
+		counter_regs[c]->TC_CCR = TC_CCR_SWTRG;
+#endif
+}
+
+// Counter overflow extension.  The TCs are 16 bits wide, so a column
+// that dwells long at a high rate wraps its channels.  The overflow
+// interrupt of each of the first COUNTER_WIDE_CHANNELS channels, the TC0
+// block whose interrupts nothing else takes, counts the wraps at the
+// counting priority, so it never lands in the middle of a commit.
+// commit_column tests one word for wraps and one for a pending overflow
+// and only then calls counter_extend, which keeps per-column counts
+// exact up to 2^32.  The other channels, and COUNT_MODE_CAPTURE, stay
+// at 16 bits.
+#define COUNTER_WIDE_CHANNELS COUNTER_BOARD_WIDE_COUNT
+#define COUNTER_WRAP_IRQ(index, tc, ...) | 1UL << COUNTER_TC_ID(tc)
+#define COUNTER_WRAP_IRQS (0 COUNTER_BOARD_WIDE_CHANNELS(COUNTER_WRAP_IRQ))
+
+static volatile uint16_t counter_wraps[COUNTER_WIDE_CHANNELS];
+// Bit n set while counter_wraps[n] is not zero
+static volatile uint32_t counter_wrapped;
+
+// Early stop takes the compare of the primary's counter (M1130)
+static void early_arm(void);
+static void early_compare(void);
+static uint8_t early_counter;
+
+static __always_inline void counter_overflow(uint8_t c)
+{
+	// Reading TC_SR acknowledges the overflow, and the early stop compare
+	uint32_t status = counter_regs[c]->TC_SR;
+	if (status & TC_SR_COVFS)
+	{
+		counter_wraps[c]++;
+		counter_wrapped |= 1u << c;
+	}
+	if (unlikely(status & TC_SR_CPCS) && c == early_counter && early_target)
+		early_compare();
+}
+
+// The overflow handler of each wide channel
+#define COUNTER_WRAP_HANDLER(index, tc, ...) \
+	COUNTER_ISR void COUNTER_TC_HANDLER(tc)(void) \
+	{ \
+		counter_overflow(index); \
+	}
+COUNTER_BOARD_WIDE_CHANNELS(COUNTER_WRAP_HANDLER)
+
+// Reads both halves of the chained count.  The high half changes as
+// the low one passes 0x8000, so it counts one wrap ahead of the low half
+// from there on.  Reading the high half on either side of the low one
+// and taking the low half again if it moved gives a pair from after
+// the edge, well away from the next one.
+static __always_inline uint32_t counter_chain_read(void)
+{
+	TcChannel *low = counter_regs[0], *high = counter_regs[COUNTER_CHAIN_HIGH];
+	uint16_t wraps = high->TC_CV, cv = low->TC_CV, again = high->TC_CV;
+	if (again != wraps)
+	{
+		wraps = again;
+		cv = low->TC_CV;
+	}
+
+	wraps -= cv >> 15;
+	return (uint32_t)wraps << 16 | cv;
+}
+
+// Restarts the counters for a new acquisition, dropping any wraps seen
+// while nothing was being committed
+static void counter_restart(void)
+{
+	counter_reset();
+	chain_snapshot = 0;
+	for (uint8_t c = 0; c < COUNTER_WIDE_CHANNELS; c++)
+	{
+		(void)counter_regs[c]->TC_SR;
+		counter_wraps[c] = 0;
+	}
+	counter_wrapped = 0;
+	NVIC->ICPR[0] = COUNTER_WRAP_IRQS;
+	dwell_last = profile_cycles();
+	if (early_target)
+		early_arm();
+}
+
+// Cine acquisition (M1103).  The arena holds cine_frames banks in a
+// ring, and frame f is counted into bank f % cine_frames.  Counting
+// moves on to the next frame every cine_period ms, or at the end of each
+// scan of the field with no period, and the frames before it are held
+// until the host selects a later one with M1104.  cine_poll clears the
+// bank of the next frame ahead of time; if it is not clear, or would
+// still hold a frame, counting stops with STOP_CINE instead of
+// overwriting.  The totals and dirty map are those of the last frame
+// completed, as after a bank swap.
+#define CINE_FRAMES_MAX 32
+
+static volatile bool cine_on = false;
+static uint8_t cine_frames;
+static uint32_t cine_period;
+static volatile uint32_t cine_ms;
+static volatile uint32_t cine_written;   // Frame being counted
+static volatile uint32_t cine_read;      // Oldest frame held for the host
+static volatile uint32_t cine_ready;     // Last frame with a cleared bank
+static uint32_t cine_clearing;           // and the one being cleared, once past it
+
+#define cine_bank(frame) (((frame) % cine_frames) * bank_bins)
+
+// Starts counting from a reset of every channel, from M1003 with the
+// interrupts held off or from the edge M1084 armed.  Kept out of line,
+// off the usual step path.
+COUNTER_ISR static __attribute__((noinline)) void count_start(void)
+{
+	// The first delta is measured from the reset
+	for (uint8_t c = 0; c < COUNTER_CHANNELS; c++)
+		count_snapshot[c] = 0;
+	counter_restart();
+	enable_count = true;
+	count_started = sof_count;
+	count_started_us = time_us();
+	count_stopped_us = 0;
+	cine_ms = 0;
+	limit_steps = 0;
+	start_armed = START_ARMED_NONE;
+	stop_columns = 0;
+#if COUNTER_SYNC
+	sync_pulses = 0;
+	// Slaves start with the same reset
+	if (sync_mode == SYNC_MODE_MASTER)
+		COUNTER_PIO->PIO_ODSR ^= SYNC_OUT_PIN;
+#endif
+}
+
+// Stops counting for stop_poll to report, with interrupts held off
+static void stop_fire(uint8_t kind, uint32_t elapsed)
+{
+	enable_count = false;
+	count_stopped_us = time_us();
+	stop_event.kind = kind;
+	stop_event.position = head_position - head_origin;
+	stop_event.row = head_row;
+	stop_event.columns = stop_columns;
+	stop_event.elapsed = elapsed;
+	stop_fired = true;
+}
+
+// Stops counting if the M1085 condition is met, after the commit and
+// head move of the interrupt calling it.  Kept out of line, off the
+// usual step path.
+COUNTER_ISR static __attribute__((noinline)) void stop_check(void)
+{
+	uint8_t kind = stop_kind;
+	if (!enable_count || kind == STOP_OFF)
+		return;
+
+	uint32_t elapsed = sof_count - count_started;
+	if (kind == STOP_COLUMNS ? stop_columns < (uint32_t)stop_target
+		: kind == STOP_TRIGGER ? !stop_triggered || stop_columns < (uint32_t)stop_target
+		: kind == STOP_POSITION ? head_position != stop_target
+		: elapsed < (uint32_t)stop_target)
+		return;
+
+	stop_kind = STOP_OFF;
+	stop_fire(kind, elapsed);
+}
+
+// Starts the columns after an M1112 trigger, from START_PIN or M1113
+static __always_inline void stop_trigger(void)
+{
+	if (stop_kind != STOP_TRIGGER || !enable_count || stop_triggered)
+		return;
+
+	stop_columns = 0;
+	stop_triggered = true;
+}
+
+// The time condition, checked on each millisecond tick
+static void stop_tick(void)
+{
+	if (unlikely(stop_kind == STOP_TIME))
+	{
+		irqflags_t flags = cpu_irq_save();
+		stop_check();
+		cpu_irq_restore(flags);
+	}
+}
+
+// Adds the wraps of each channel to the counts just read from it and
+// leaves those the next column starts with.  An overflow still pending
+// came before the read if the counter read low, or just after it if it
+// read high: half a wrap's worth of counts cannot arrive in between.
+// A delta already carries the one wrap it went back over.  Kept out of
+// line, off the usual step path.
+COUNTER_ISR static __attribute__((noinline)) void counter_extend(uint32_t *counts, uint8_t channels)
+{
+	uint32_t pending = NVIC->ISPR[0] & COUNTER_WRAP_IRQS;
+	uint32_t wrapped = 0;
+	bool delta = count_mode == COUNT_MODE_DELTA;
+	// A chained primary is 32 bits already, and the wraps of counters
+	// not stored are dropped
+	for (uint8_t k = counter_chained; k < COUNTER_WIDE_CHANNELS; k++)
+	{
+		uint8_t c = counter_slot[k];
+		uint32_t wraps = counter_wraps[k], next = 0;
+		if (c >= channels)
+		{
+			counter_wraps[k] = 0;
+			continue;
+		}
+
+		uint16_t read = delta ? count_snapshot[c] : counts[c];
+		if ((pending & (1UL << counter_channels[k].id)) && (counter_regs[k]->TC_SR & TC_SR_COVFS))
+		{
+			if (read < 0x8000)
+				wraps++;
+			else if (delta)
+				next = 1;  // Reset and latch modes restarted the count
+		}
+
+		if (delta && counts[c] > read)
+			wraps--;
+		counts[c] += wraps << 16;
+		counter_wraps[k] = next;
+		wrapped |= next << k;
+	}
+	counter_wrapped = wrapped;
+	NVIC->ICPR[0] = pending;
+}
+
+// Turns the counts of the threshold ladder into energy bins.  A pulse
+// over a threshold is over every one below it too, so each channel but
+// the top keeps what it counted less the channel above.  The edges of
+// one pulse reach the counters a few ns apart, and one that straddles
+// the commit can leave a bin short by a count, which is taken as 0
+// rather than wrapped.  Kept out of line, off the usual step path.
+COUNTER_ISR static __attribute__((noinline)) void energy_commit(uint32_t *counts, uint8_t channels)
+{
+	uint8_t top = Min(energy_channels, channels);
+	for (uint8_t c = 0; c + 1 < top; c++)
+		counts[c] = counts[c] > counts[c + 1] ? counts[c] - counts[c + 1] : 0;
+}
+
+// Row sealing for continuous film transport (M1077).  The rows of the
+// counting bank form a ring: when the head reverses after a run of at
+// least row_seal_min steps (encoder columns with COUNTER_POSITION_QDEC),
+// the row it was on is sealed, queued with its time for row_push_poll to
+// send, and the head carries on in the next row.  Once sent, a row is
+// cleared and given back, so it can be counted into again on the next
+// lap.  A reversal that finds the next row still queued leaves the head
+// where it is and counts an overrun.  It takes over the row axis from
+// the row step input.
+#define ROW_QUEUE_SIZE 8
+#define ROW_SEAL_MIN_STEPS 16
+#define ROW_MAGIC 0x5AA8
+
+// The summary pushed after each sealed row, a header and an entry for
+// each stored channel, gathered by commit_column as it counts into the
+// row: host indexing and triage need not go through the bins.  It covers
+// the columns committed since the row was started or M1077 turned
+// sealing on, less those M1047 deferred, which the flag marks.
+#define ROW_SUMMARY_MAGIC 0x5AAE
+#define ROW_SUMMARY_DEFERRED 0x01
+
+typedef struct
+{
+	uint16_t magic;     // ROW_SUMMARY_MAGIC
+	uint16_t row;
+	uint32_t sequence;  // Of the row push it follows
+	uint16_t first;     // Lowest column committed in the row
+	uint16_t last;      // and highest; first > last if none was
+	uint8_t channels;   // Entries that follow
+	uint8_t flags;
+	uint16_t overflow;  // Bit c set if a bin of channel c saturated
+	uint32_t commits;   // Columns committed into the row
+	uint32_t dwell;     // sof_count from the first commit to the reversal
+} row_summary_header_t;
+
+typedef struct
+{
+	uint32_t sum;
+	uint32_t peak;          // Largest bin of the row
+	uint16_t peak_column;   // Its column, the first if several are equal
+	uint16_t reserved;
+} row_summary_channel_t;
+
+typedef struct
+{
+	uint32_t started;   // sof_count at the first commit
+	uint32_t commits;
+	uint16_t first;
+	uint16_t last;
+	uint16_t overflow;
+	uint8_t flags;
+	row_summary_channel_t channels[COUNTER_CHANNELS];
+} row_summary_t;
+
+typedef struct
+{
+	uint16_t row;
+	uint16_t reserved;
+	uint32_t sequence;  // Rows sealed before this one
+	uint32_t sealed;    // sof_count at the reversal
+	uint64_t sealed_us; // time_us() at it
+	row_summary_t summary;
+} row_sealed_t;
+
+static volatile bool row_sealing = false;
+static uint16_t row_seal_min = ROW_SEAL_MIN_STEPS;
+static int32_t row_seal_direction;
+static uint32_t row_seal_run;       // Steps since the last reversal
+static uint32_t row_sequence;
+static volatile uint32_t row_overruns;
+static row_sealed_t row_ring[ROW_QUEUE_SIZE];
+static ring_t row_queue;
+static row_summary_t row_live;  // Of the row the head is in
+
+static void row_summary_reset(row_summary_t *summary)
+{
+	memset(summary, 0, sizeof(*summary));
+	summary->first = UINT16_MAX;
+}
+
+#if !COUNT_PACKED_CHANNELS
+// Row prefetch.  While rows are sealed the main loop checksums the row
+// the head is in a block at a time, behind the head as it goes, each
+// channel's part of a block from 0.  When the row comes to be pushed
+// its header CRC is folded together from the blocks (crc16_shift), with
+// only those the head was still in checksummed then, so the header and
+// the first slice go out straight after the seal rather than after a
+// pass over every bin of the row.  The step interrupt marks a block
+// stale whenever it commits into it.  Two rows are kept, the one being
+// counted and the one sealed before it; a row whose buffer has been
+// taken for a later one, whose columns were deferred (M1047) or that is
+// wider than ROW_PREFETCH_COLUMNS takes the full pass.
+#define ROW_PREFETCH_BLOCK_SHIFT 6
+#define ROW_PREFETCH_BLOCK_COLUMNS (1 << ROW_PREFETCH_BLOCK_SHIFT)
+#define ROW_PREFETCH_BLOCKS 64
+#define ROW_PREFETCH_COLUMNS (ROW_PREFETCH_BLOCKS * ROW_PREFETCH_BLOCK_COLUMNS)
+
+typedef struct
+{
+	uint32_t sequence;   // Of the row, as row_sequence numbers them
+	uint16_t columns;    // column_count and readout_bank when started
+	uint32_t bank;
+	volatile uint32_t done[ROW_PREFETCH_BLOCKS / 32];  // Blocks checksummed, one bit each
+	uint16_t crc[COUNTER_CHANNELS][ROW_PREFETCH_BLOCKS];
+} row_prefetch_t;
+
+static row_prefetch_t row_prefetch[2];
+
+#define ROW_PREFETCH_DONE(pre, block) ((pre)->done[(block) >> 5] & (1UL << ((block) & 31)))
+
+// Runs a CRC on over a whole block of one channel, and over the last,
+// which may be shorter, for the columns they were worked out for
+static uint16_t row_shift_block[16];
+static uint16_t row_shift_last[16];
+static uint16_t row_shift_columns;
+
+static void row_prefetch_reset(void)
+{
+	for (uint8_t i = 0; i < 2; i++)
+		row_prefetch[i].sequence = UINT32_MAX;
+}
+
+// Adds a column just stored to the summary of the head's row.  The bins
+// only grow until the row is sealed, so the peak is that of the bins as
+// they end up.  Kept out of line, off the usual step path.
+COUNTER_ISR static __attribute__((noinline)) void row_summary_commit(const uint32_t *counts, uint8_t channels)
+{
+	row_summary_t *live = &row_live;
+	uint32_t column = head_column();
+	uint32_t cell = head_row_base + column;
+	uint32_t block = column >> ROW_PREFETCH_BLOCK_SHIFT;
+	if (block < ROW_PREFETCH_BLOCKS)
+		row_prefetch[row_sequence & 1].done[block >> 5] &= ~(1UL << (block & 31));
+	if (live->commits++ == 0)
+		live->started = sof_count;
+	if (column < live->first)
+		live->first = column;
+	if (column > live->last)
+		live->last = column;
+
+	for (uint8_t c = 0; c < channels; c++)
+	{
+		row_summary_channel_t *channel = &live->channels[c];
+		count_t bin = COUNT_BIN(c, cell);
+		channel->sum += counts[c];
+		if (bin > channel->peak)
+		{
+			channel->peak = bin;
+			channel->peak_column = column;
+		}
+#ifdef COUNT_OVERFLOWED
+		if (COUNT_OVERFLOWED(c, cell))
+			live->overflow |= 1 << c;
+#endif
+	}
+}
+#endif
+
+// Adds the counts gathered since the last call to the column under the head.
+// The PIO and TC registers are accessed directly rather than through
+// pio_get/tc_read_cv so that the step path makes no function calls.
+// mode is count_mode, or a constant in the step handler specialised for
+// it, which then keeps only that mode's reads.
+static __always_inline void commit_column_mode(uint8_t mode)
+{
+#if COUNTER_SYNC
+	// Only SYNC_OUT_PIN is enabled in PIO_OWSR, so this leaves the
+	// other PIOA outputs alone
+	if (sync_mode == SYNC_MODE_MASTER)
+		COUNTER_PIO->PIO_ODSR ^= SYNC_OUT_PIN;
+#endif
+
+	if (enable_count)
+	{
+		uint32_t counts[COUNTER_CHANNELS];
+		uint8_t channels = channel_count;
+		uint32_t chained = 0;
+		if (unlikely(counter_chained))
+			chained = counter_chain_read();
+
+		if (mode == COUNT_MODE_LATCH)
+		{
+			// Values were captured by the step edge itself
+			for (uint8_t c = 0; c < channels; c++)
+				counts[c] = (uint16_t)channel_regs[c]->TC_RA;
+		}
+		else if (mode == COUNT_MODE_DELTA)
+		{
+			// Unsigned 16-bit subtraction handles counter wrap
+			for (uint8_t c = 0; c < channels; c++)
+			{
+				uint16_t cv = (uint16_t)channel_regs[c]->TC_CV;
+				counts[c] = cv - count_snapshot[c];
+				count_snapshot[c] = cv;
+			}
+		}
+		else if (mode == COUNT_MODE_RESET)
+		{
+			for (uint8_t c = 0; c < channels; c++)
+				counts[c] = (uint16_t)channel_regs[c]->TC_CV;
+			counter_reset();
+		}
+		else
+		{
+			// Captured counts are added by capture_poll
+			return;
+		}
+
+		if (unlikely(counter_chained))
+		{
+			counts[0] = chained - chain_snapshot;
+			if (mode == COUNT_MODE_DELTA)
+				chain_snapshot = chained;
+		}
+
+		if (unlikely(counter_wrapped | (NVIC->ISPR[0] & COUNTER_WRAP_IRQS)))
+			counter_extend(counts, channels);
+
+		if (unlikely(coincidence_track))
+			coincidence_commit();
+		if (unlikely(dwell_track))
+			dwell_commit();
+		if (unlikely(analog_track))
+			analog_commit();
+		if (unlikely(sweep_active))
+			sweep_column(counts, channels);
+
+		// Overtravel is read out of the counters but not kept
+		if (head_column() >= column_count)
+			return;
+
+#if !COUNTER_POSITION_QDEC
+		if (unlikely(motion_adapting))
+			motion_column(counts[0]);
+#endif
+		if (unlikely(stop_kind == STOP_COLUMNS || stop_kind == STOP_TRIGGER))
+			stop_columns++;
+
+		if (unlikely(energy_binned))
+			energy_commit(counts, channels);
+
+		if (defer_columns)
+		{
+			uint32_t slot;
+			if (ring_reserve(&defer_queue, DEFER_RING_SIZE, &slot))
+			{
+				defer_record_t *record = &defer_ring[slot];
+				record->cell = head_row_base + head_column();
+				record->time = sof_count;
+				for (uint8_t c = 0; c < channels; c++)
+					record->counts[c] = counts[c];
+				ring_commit(&defer_queue, 1);
+			}
+			else
+				defer_dropped++;
+			if (unlikely(row_sealing))
+				row_live.flags |= ROW_SUMMARY_DEFERRED;
+			return;
+		}
+
+		store_column(counts, channels);
+#if !COUNT_PACKED_CHANNELS
+		if (unlikely(row_sealing))
+			row_summary_commit(counts, channels);
+#endif
+	}
+}
+
+static __always_inline void commit_column(void)
+{
+	commit_column_mode(count_mode);
+}
+
+// Moves counting on to the next cine frame, once the counts of this one
+// are committed.  Kept out of line, off the usual step path.
+COUNTER_ISR static __attribute__((noinline)) void cine_advance(void)
+{
+	uint32_t next = cine_written + 1;
+	if (!enable_count)
+		return;
+
+	if (cine_ready != next)
+	{
+		stop_fire(STOP_CINE, sof_count - count_started);
+		return;
+	}
+
+	cine_written = next;
+	count_bank = cine_bank(next);
+	readout_totals = live_totals;
+	memset((void *)&live_totals, 0, sizeof(live_totals));
+	pyramid_clear();
+	memcpy((void *)dirty_readout, (const void *)dirty_live, sizeof(dirty_readout));
+	memset((void *)dirty_live, 0, sizeof(dirty_live));
+}
+
+// The cine period, checked on each millisecond tick
+static void cine_tick(void)
+{
+	if (likely(!cine_on || !cine_period) || !enable_count || ++cine_ms < cine_period)
+		return;
+
+	cine_ms = 0;
+	irqflags_t flags = cpu_irq_save();
+	commit_column();
+	cine_advance();
+	cpu_irq_restore(flags);
+}
+
+#if PROFILE_ENABLE
+// Channel of the step generator (M1043 output 0) while it runs.  Its
+// counter has moved on from the rising edge at RA by the time the step
+// interrupt reads it, which gives the latency under any load.
+static TcChannel *volatile step_latency_source;
+
+// In CPU cycles, as TIMER_CLOCK1 runs at MCK / 2
+static __always_inline uint32_t step_latency(TcChannel *source)
+{
+	uint32_t cv = source->TC_CV, ra = source->TC_RA;
+	return 2 * (cv >= ra ? cv - ra : cv + source->TC_RC - ra);
+}
+#endif
+
+// Brings a position outside the travel back into it, or with hard limits
+// leaves it outside.  Kept out of line, off the usual step path.
+COUNTER_ISR static __attribute__((noinline)) int32_t head_outside(int32_t position)
+{
+	if (head_limits)
+		return position;
+
+	position %= travel_columns;
+	return position < 0 ? position + travel_columns : position;
+}
+
+// Moves the head by a column.  Inside the travel this costs one compare
+// that is rarely taken.
+static __always_inline void head_move(int32_t head_step)
+{
+	int32_t position = head_position + head_step;
+	if (unlikely((uint32_t)position >= travel_columns))
+		position = head_outside(position);
+	head_position = position;
+}
+
+// Takes up the backlash as the head turns.  Kept out of line, off the
+// usual step path.
+COUNTER_ISR static __attribute__((noinline)) void backlash_turn(int32_t head_step)
+{
+	backlash_direction = head_step;
+	int32_t position = head_position + (head_step < 0 ? -backlash_shift : backlash_shift);
+	if ((uint32_t)position >= travel_columns)
+		position = head_outside(position);
+	head_position = position;
+}
+
+#if COUNTER_FRAME_STORE
+#if COUNTER_POSITION_QDEC || COUNTER_CHANNELS > 3
+#error The frame store takes the PIOC pins of the TC1 and TC2 channels
+#endif
+#if COUNT_PACKED_CHANNELS
+#error The frame store takes rows sealed by M1077, which packed channels cannot clear
+#endif
+
+// SMC timing in MCK cycles, for a 10 ns SRAM at up to 120 MHz.  The bus
+// only gets faster than the part at higher clocks, and CLOCK_IDLE_PRES
+// only stretches it.
+#define FRAME_STORE_SETUP_CYCLES 1
+#define FRAME_STORE_PULSE_CYCLES 3
+#define FRAME_STORE_CYCLE_CYCLES 5
+
+// Copies the sealed rows; the clear uses CLEAR_DMA_CHANNEL
+#define FRAME_DMA_CHANNEL 1
+
+// Rows in the store at most, for the saturation bitmap
+#define FRAME_STORE_ROWS_MAX 4096
+
+// Each sealed row moves from the counting bank into store row
+// sequence % frame_rows, laid out as it is in the arena, one DMAC
+// transfer per block: a plane of column_count bins per channel, or
+// the row's groups of channels together when interleaved
+static bool frame_store_present;   // The boot check read back what it wrote
+static bool frame_store_on = false;
+static uint16_t frame_rows;
+static uint32_t frame_stored;      // Rows stored since M1079 1
+static bool frame_store_busy;      // DMAC copying the front of row_queue
+static uint8_t frame_store_block;  // Block being copied
+static uint32_t frame_overflow[FRAME_STORE_ROWS_MAX / 32];
+#else
+#define frame_store_on false
+#endif
+
+COUNTER_ISR static __attribute__((noinline)) void row_reverse(int32_t head_step)
+{
+	uint32_t run = row_seal_run;
+	row_seal_direction = head_step;
+	row_seal_run = 1;
+	if (run < row_seal_min)
+		return;
+
+	// The row after this one must have been sent and cleared
+	uint32_t slot;
+	if (ring_count(&row_queue) + 2 > row_count || !ring_reserve(&row_queue, ROW_QUEUE_SIZE, &slot))
+	{
+		row_overruns++;
+		return;
+	}
+
+	row_sealed_t *sealed = &row_ring[slot];
+	sealed->row = head_row;
+	sealed->reserved = 0;
+	sealed->sequence = row_sequence++;
+	sealed->sealed = sof_count;
+	sealed->sealed_us = time_us();
+	sealed->summary = row_live;
+	ring_commit(&row_queue, 1);
+	row_summary_reset(&row_live);
+
+	int32_t row = head_row + 1;
+	if (row >= row_count)
+		row = 0;
+	head_row_change(row);
+}
+
+// Follows the direction of each step (or encoder column) for row sealing
+static __always_inline void row_seal_step(int32_t head_step)
+{
+	if (unlikely(row_sealing))
+	{
+		if (head_step == row_seal_direction)
+			row_seal_run++;
+		else
+			row_reverse(head_step);
+	}
+}
+
+// Moves the head without committing, for the step edges of sync pulse mode
+#define STEP_MODE_TRACK 0xFF
+
+// A step edge, with pins the PIOA inputs sampled as the interrupt was
+// entered, committed as in count mode mode
+static __always_inline void step_edge_mode(uint32_t pins, uint8_t mode)
+{
+#if PROFILE_ENABLE
+	static uint32_t last_start;
+	uint32_t start = profile_cycles();
+	bool fp_pending = FPU->FPCCR & FPU_FPCCR_LSPACT_Msk;
+	TcChannel *source = step_latency_source;
+	if (source)
+		profile_record(&profile_latency, step_latency(source));
+	if (profile_duration.count)
+		profile_record(&profile_interval, start - last_start);
+	last_start = start;
+#endif
+	trace(TRACE_STEP, head_position);
+
+	int32_t head_step = (pins & COUNTER_DIR_PIN) ? 1 : -1;
+	steps_serviced++;
+	steps_processed++;
+	if (unlikely(backlash_shift) && head_step != backlash_direction)
+		backlash_turn(head_step);
+
+	// The counters keep accumulating until the head leaves the column
+	int32_t phase = bin_phase + head_step;
+	if (head_step < 0 && step_bidirectional)
+	{
+		if (phase < 0)
+		{
+			phase = bin_factor - 1;
+			head_move(-1);
+		}
+
+		if (phase == 0 && mode != STEP_MODE_TRACK)
+			commit_column_mode(mode);
+	}
+	else if (phase < 0 || phase >= bin_factor)
+	{
+		phase = phase < 0 ? bin_factor - 1 : 0;
+
+		if (mode != STEP_MODE_TRACK)
+			commit_column_mode(mode);
+		head_move(head_step);
+	}
+	bin_phase = phase;
+
+	// After the commit, so the column the head turned in stays in the row
+	row_seal_step(head_step);
+
+	// Only ever true with hard limits
+	if (unlikely((uint32_t)head_position >= travel_columns))
+		limit_steps++;
+
+	if (unlikely(stop_kind))
+		stop_check();
+
+	trace(TRACE_STEP | TRACE_END, head_position);
+#if PROFILE_ENABLE
+	profile_record(&profile_duration, profile_cycles() - start);
+	if (unlikely(fp_pending) && !(FPU->FPCCR & FPU_FPCCR_LSPACT_Msk))
+		profile_fp_saves++;
+#endif
+}
+
+static __always_inline void step_edge(uint32_t pins)
+{
+#if COUNTER_SYNC
+	if (unlikely(sync_mode == SYNC_MODE_PULSE))
+	{
+		step_edge_mode(pins, STEP_MODE_TRACK);
+		return;
+	}
+#endif
+	step_edge_mode(pins, count_mode);
+}
+
+static __always_inline void Trigger_Step(uint32_t id, uint32_t pin)
+{
+	step_edge(COUNTER_PIO->PIO_PDSR);
+	if (unlikely(start_armed == START_ARMED_STEP))
+		count_start();
+}
+
+// START_PIN always interrupts, so that no edge from before M1084 2 is
+// still pending once it arms the start.  While counting it is the
+// M1112 trigger.
+static __always_inline void Trigger_Start(uint32_t id, uint32_t pin)
+{
+	if (start_armed == START_ARMED_PIN)
+		count_start();
+	else
+		stop_trigger();
+}
+
+#if !COUNTER_POSITION_QDEC
+// Home edge.  The column the head moves to starts afresh, so the
+// columns line up with the switch.
+static __always_inline void Trigger_Home(uint32_t id, uint32_t pin)
+{
+	uint8_t mode = home_mode;
+	if (mode == HOME_OFF)
+		return;
+
+	home_edges++;
+	home_position = head_position - head_origin;
+	if (mode == HOME_RECORD)
+		return;
+
+	head_position = head_origin + home_offset;
+	bin_phase = 0;
+	if (mode == HOME_ONCE)
+		home_mode = HOME_OFF;
+}
+#endif
+
+// Second axis step: counts gathered so far belong to the row being left
+static __always_inline void row_edge(uint32_t pins)
+{
+	int32_t row = head_row + ((pins & ROW_DIR_PIN) ? 1 : -1);
+
+	commit_column();
+	if (unlikely(cine_on) && !cine_period && (row < 0 || row >= row_count))
+		cine_advance();
+
+#if COUNTER_SD_LOG
+	if (row < 0 || row >= row_count)
+		frame_ends++;
+#endif
+
+	if (row < 0)
+		row += row_count;
+
+	if (row >= row_count)
+		row -= row_count;
+
+	head_row_change(row);
+}
+
+static __always_inline void Trigger_Row(uint32_t id, uint32_t pin)
+{
+	row_edge(COUNTER_PIO->PIO_PDSR);
+}
+
+// Commits the column and moves on to the next one, wrapping at
+// travel_columns, for acquisition that is not driven by the head
+static __always_inline void commit_next_column(void)
+{
+	commit_column();
+
+	int32_t position = head_position + 1;
+	head_position = position < travel_columns ? position : 0;
+	if (unlikely(cine_on) && !cine_period && position >= travel_columns)
+		cine_advance();
+#if COUNTER_SD_LOG
+	if (position >= travel_columns)
+		frame_ends++;
+#endif
+
+	if (unlikely(stop_kind))
+		stop_check();
+}
+
+#if COUNTER_SYNC
+// Beam pulse edge in pulse mode.  Each one closes the pulse the one
+// before it opened and commits its counts to the cell under the head,
+// so the counts from M1003 up to the first edge are dropped.
+static __always_inline void sync_pulse_edge(void)
+{
+	if (!enable_count)
+		return;
+
+	if (sync_pulses++ == 0)
+	{
+		for (uint8_t c = 0; c < COUNTER_CHANNELS; c++)
+			count_snapshot[c] = 0;
+		counter_restart();
+		return;
+	}
+
+	commit_column();
+	if (unlikely(stop_kind))
+		stop_check();
+}
+
+// Edge from the master on a slave.  The first one after M1003 starts
+// counting from column 0, in step with the master's own start.
+static __always_inline void Trigger_Sync(uint32_t id, uint32_t pin)
+{
+	if (sync_mode == SYNC_MODE_PULSE)
+	{
+		sync_pulse_edge();
+		return;
+	}
+
+	if (sync_armed)
+	{
+		for (uint8_t c = 0; c < COUNTER_CHANNELS; c++)
+			count_snapshot[c] = 0;
+		counter_restart();
+		head_position = head_origin;
+		sync_armed = false;
+		enable_count = true;
+		count_started = sof_count;
+		count_started_us = time_us();
+		count_stopped_us = 0;
+		cine_ms = 0;
+		limit_steps = 0;
+		return;
+	}
+
+	commit_next_column();
+}
+#endif
+
+// Where binary readouts and stream blocks go, selected by M1027: the
+// command port, the vendor bulk interface or the second CDC port
+#define DATA_INTERFACE_CDC 0
+#define DATA_INTERFACE_BULK 1
+#define DATA_INTERFACE_CDC_DATA 2
+static uint8_t data_interface = DATA_INTERFACE_CDC;
+
+// The CDC port given its own data, when UDI_CDC_PORT_NB has room for it
+#define CDC_DATA_PORT 1
+
+static volatile bool cdc_enabled[UDI_CDC_PORT_NB];
+
+bool main_cdc_enable(uint8_t port)
+{
+	cdc_enabled[port] = true;
+	return port != 0 || stdio_usb_enable();
+}
+
+void main_cdc_disable(uint8_t port)
+{
+	cdc_enabled[port] = false;
+	if (port == 0)
+		stdio_usb_disable();
+}
+
+// CDC writes at least this long skip the TX buffers and are handed to the
+// endpoint straight from the caller's memory (e.g. a run of the count arena)
+#define CDC_DIRECT_MIN_BYTES (4 * UDI_CDC_DATA_EPS_FS_SIZE)
+
+// Sends through the port's TX buffers or, from CDC_DIRECT_MIN_BYTES,
+// straight from data.  A host that stops reading for UDI_CDC_TX_TIMEOUT_MS
+// fails the write rather than holding up the main loop.
+// Writes to the command port under way, for position_quiet
+static volatile uint8_t cdc_command_writes;
+
+static bool cdc_write(uint8_t port, const void *data, uint32_t length)
+{
+	bool sent;
+	cdc_command_writes += port == 0;
+	if (length >= CDC_DIRECT_MIN_BYTES)
+		sent = udi_cdc_multi_write_direct_timeout(port, data, length, UDI_CDC_TX_TIMEOUT_MS) == 0;
+	else
+		sent = udi_cdc_multi_write_buf_timeout(port, data, length, UDI_CDC_TX_TIMEOUT_MS) == 0;
+	cdc_command_writes -= port == 0;
+	return sent;
+}
+
+// Where the command being run came from.  Its replies and data go back
+// the same way, and stream blocks follow the last command.
+#define COMMAND_SOURCE_USB 0
+#define COMMAND_SOURCE_ETH 1
+
+static uint8_t command_source = COMMAND_SOURCE_USB;
+
+static void select_source(uint8_t source)
+{
+	command_source = source;
+#if ETH_ENABLE
+	reply_to_eth(source == COMMAND_SOURCE_ETH);
+#endif
+}
+
+// Push a block of binary data to the host in endpoint-sized chunks.
+// Returns false if the USB interface went away part way through.
+static bool write_binary(const void *data, uint32_t length)
+{
+	// The host reads the text reply before the data that follows it
+	reply_drain();
+
+#if ETH_ENABLE
+	if (command_source == COMMAND_SOURCE_ETH)
+		return length >= CDC_DIRECT_MIN_BYTES ? eth_stream_write_direct(data, length)
+			: eth_stream_write(data, length);
+#endif
+
+	if (data_interface == DATA_INTERFACE_BULK)
+		return udi_vendor_bulk_write(data, length);
+
+#if UDI_CDC_PORT_NB > 1
+	if (data_interface == DATA_INTERFACE_CDC_DATA)
+		return cdc_enabled[CDC_DATA_PORT] && cdc_write(CDC_DATA_PORT, data, length);
+#endif
+
+	return cdc_write(0, data, length);
+}
+
+// Device timebase (M1119, M1120).  SysTick interrupts once a millisecond
+// and adds the period to time_base, and time_us() adds the part of the
+// period counted so far, so the time is a 64-bit count of microseconds
+// since boot that never goes back.  SysTick divides the CPU clock, which
+// runs on through the WFI sleep, and time_clock() carries the part of a
+// period already counted over a change of the clock.  The host relates
+// it to its own clock with the TIME_QUERY exchange or M1119
+// (host/readout.py clock_fit), and with M1120 1 each push and readout
+// header is preceded by a time push stamping it.
+#define TIME_MAGIC 0x5AAC
+
+typedef struct
+{
+	uint16_t magic;    // TIME_MAGIC
+	uint16_t stamped;  // Magic of the push that follows, 0 before a readout header
+	uint32_t low;      // time_us() when it was written
+	uint32_t high;
+} time_push_t;
+
+static volatile uint64_t time_base;
+static bool time_pushes = false;
+// When the command being run was queued (M1119)
+static uint64_t command_received;
+
+#if COUNTER_TELEMETRY
+static void telemetry_tick(void);
+#endif
+
+static uint64_t time_us(void)
+{
+	irqflags_t flags = cpu_irq_save();
+	uint32_t load = SysTick->LOAD;
+	uint32_t count = SysTick->VAL;
+	uint64_t base = time_base;
+	// A period that has ended before the handler could run
+	if (SCB->ICSR & SCB_ICSR_PENDSTSET_Msk)
+	{
+		count = SysTick->VAL;
+		base += 1000;
+	}
+	cpu_irq_restore(flags);
+	return base + (load - count) * 1000 / (load + 1);
+}
+
+// Below everything else, so a tick only ever delays the main loop
+void SysTick_Handler(void)
+{
+	time_base += 1000;
+#if COUNTER_TELEMETRY
+	telemetry_tick();
+#endif
+}
+
+static void time_clock(uint32_t cpu_hz)
+{
+	irqflags_t flags = cpu_irq_save();
+	time_base = time_us();
+	SCB->ICSR = SCB_ICSR_PENDSTCLR_Msk;
+	SysTick_Config(cpu_hz / 1000);
+	NVIC_SetPriority(SysTick_IRQn, BACKGROUND_IRQ_PRIORITY);
+	cpu_irq_restore(flags);
+}
+
+static void push_time(uint16_t stamped)
+{
+	if (!time_pushes)
+		return;
+
+	uint64_t now = time_us();
+	time_push_t push;
+	push.magic = TIME_MAGIC;
+	push.stamped = stamped;
+	push.low = now;
+	push.high = now >> 32;
+	write_binary(&push, sizeof(push));
+}
+
+// Wall clock (M1123).  The RTC keeps the UTC calendar in the backup
+// domain, on the 32 kHz crystal, so it runs on through resets.  Each of
+// its second events gives the Unix time of one time_us() instant, from
+// which wall_time() places any other to the microsecond.  M1123 writes
+// the calendar at the next second event, and the event after that
+// measures how far the host's second boundaries are from the RTC's, so
+// the stamps follow the host's clock rather than the RTC's phase until
+// the next reset.  Counting start and stop and each sealed row are taken
+// in time_us() and go out in the container header, the row push and
+// the scan log records.
+#define WALL_EPOCH_YEAR 2024  // An earlier calendar has never been set
+#define WALL_EPOCH 1704067200 // 2024-01-01 in Unix time
+
+#define WALL_IDLE 0
+#define WALL_UPDATE 1     // Waiting for the RTC to take a new calendar
+#define WALL_CALIBRATE 2  // Waiting for the second event after
+
+static volatile uint32_t wall_second;     // Unix time at the last second event, 0 if not set
+static volatile uint64_t wall_second_us;  // time_us() at that event
+static volatile int32_t wall_offset_us;   // Of the host's second boundaries after the RTC's
+static volatile uint8_t wall_state = WALL_IDLE;
+static uint64_t wall_set_us;              // The time M1123 gave, in Unix microseconds
+static uint64_t wall_set_at;              // time_us() when that command arrived
+
+static inline uint32_t wall_bcd(uint32_t value)
+{
+	return (value / 10) << 4 | value % 10;
+}
+
+static inline uint32_t wall_binary(uint32_t bcd)
+{
+	return (bcd >> 4) * 10 + (bcd & 0xF);
+}
+
+// Days from 1970-01-01 to a date, counting years from March so that
+// the leap day comes last
+static uint32_t wall_days(uint32_t year, uint32_t month, uint32_t day)
+{
+	year -= month <= 2;
+	uint32_t era = year / 400, year_of_era = year - era * 400;
+	uint32_t day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+	return era * 146097 + year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year - 719468;
+}
+
+// The reverse of wall_days
+static void wall_date(uint32_t days, uint32_t *year, uint32_t *month, uint32_t *day)
+{
+	days += 719468;
+	uint32_t era = days / 146097, day_of_era = days - era * 146097;
+	uint32_t year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+	uint32_t day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+	uint32_t march_month = (5 * day_of_year + 2) / 153;
+	*day = day_of_year - (153 * march_month + 2) / 5 + 1;
+	*month = march_month < 10 ? march_month + 3 : march_month - 9;
+	*year = era * 400 + year_of_era + (*month <= 2);
+}
+
+// Unix time of the RTC calendar, or 0 if it has not been set.  Read
+// until two reads agree, as the registers are not latched together.
+static uint32_t wall_read(void)
+{
+	uint32_t time, date;
+	do
+	{
+		time = RTC->RTC_TIMR;
+		date = RTC->RTC_CALR;
+	}
+	while (time != RTC->RTC_TIMR || date != RTC->RTC_CALR);
+
+	uint32_t year = wall_binary(date & RTC_CALR_CENT_Msk) * 100
+		+ wall_binary((date & RTC_CALR_YEAR_Msk) >> RTC_CALR_YEAR_Pos);
+	if (year < WALL_EPOCH_YEAR)
+		return 0;
+
+	uint32_t days = wall_days(year, wall_binary((date & RTC_CALR_MONTH_Msk) >> RTC_CALR_MONTH_Pos),
+		wall_binary((date & RTC_CALR_DATE_Msk) >> RTC_CALR_DATE_Pos));
+	return days * 86400 + wall_binary((time & RTC_TIMR_HOUR_Msk) >> RTC_TIMR_HOUR_Pos) * 3600
+		+ wall_binary((time & RTC_TIMR_MIN_Msk) >> RTC_TIMR_MIN_Pos) * 60
+		+ wall_binary(time & RTC_TIMR_SEC_Msk);
+}
+
+static void wall_write(uint32_t seconds)
+{
+	uint32_t days = seconds / 86400, second = seconds % 86400, year, month, day;
+	wall_date(days, &year, &month, &day);
+	RTC->RTC_TIMR = RTC_TIMR_HOUR(wall_bcd(second / 3600)) | RTC_TIMR_MIN(wall_bcd(second / 60 % 60))
+		| RTC_TIMR_SEC(wall_bcd(second % 60));
+	// Day of the week from 1 for Monday; 1970-01-01 was a Thursday
+	RTC->RTC_CALR = RTC_CALR_CENT(wall_bcd(year / 100)) | RTC_CALR_YEAR(wall_bcd(year % 100))
+		| RTC_CALR_MONTH(wall_bcd(month)) | RTC_CALR_DAY((days + 3) % 7 + 1) | RTC_CALR_DATE(wall_bcd(day));
+}
+
+// At BACKGROUND_IRQ_PRIORITY, once a second
+void RTC_Handler(void)
+{
+	uint32_t status = RTC->RTC_SR;
+	if (status & RTC_SR_SEC)
+	{
+		RTC->RTC_SCCR = RTC_SCCR_SECCLR;
+		uint64_t now = time_us();
+		uint32_t second = wall_read();
+		if (wall_state == WALL_CALIBRATE && second)
+		{
+			wall_offset_us = (int64_t)(wall_set_us + (now - wall_set_at)) - (int64_t)second * 1000000;
+			wall_state = WALL_IDLE;
+		}
+		wall_second = second;
+		wall_second_us = now;
+	}
+
+	// Only ever raised at a second event, so the calendar written starts
+	// its second about when the host's time does
+	if ((status & RTC_SR_ACKUPD) && wall_state == WALL_UPDATE)
+	{
+		RTC->RTC_SCCR = RTC_SCCR_ACKCLR;
+		RTC->RTC_IDR = RTC_IDR_ACKDIS;
+		wall_write((wall_set_us + (time_us() - wall_set_at)) / 1000000);
+		RTC->RTC_CR &= ~(RTC_CR_UPDTIM | RTC_CR_UPDCAL);
+		wall_state = WALL_CALIBRATE;
+	}
+}
+
+// Unix time of a time_us() instant, as seconds and microseconds into
+// the second, or both 0 for no instant or an unset clock
+static void wall_time(uint64_t us, uint32_t *seconds, uint32_t *micros)
+{
+	irqflags_t flags = cpu_irq_save();
+	uint32_t second = wall_second;
+	int64_t since = (int64_t)(us - wall_second_us) + wall_offset_us;
+	cpu_irq_restore(flags);
+
+	if (!us || !second)
+	{
+		*seconds = 0;
+		*micros = 0;
+		return;
+	}
+
+	int64_t wall = (int64_t)second * 1000000 + since;
+	*seconds = wall / 1000000;
+	*micros = wall % 1000000;
+}
+
+static void wall_init(void)
+{
+	// The slow clock moves over from the RC oscillator once the crystal
+	// has started, and stays on it until VDDBU is lost
+	osc_enable(OSC_SLCK_32K_XTAL);
+
+	// The wall clock stays unset until the first second event
+	RTC->RTC_MR &= ~RTC_MR_HRMOD;
+	RTC->RTC_SCCR = RTC_SCCR_SECCLR | RTC_SCCR_ACKCLR;
+	RTC->RTC_IER = RTC_IER_SECEN;
+	NVIC_SetPriority(RTC_IRQn, BACKGROUND_IRQ_PRIORITY);
+	NVIC_EnableIRQ(RTC_IRQn);
+}
+
+static bool validate_column_range(int32_t start, int32_t end)
+{
+	if (start < 0 || start >= cell_count || end < 0 || end >= cell_count || start > end)
+	{
+		reply_str("error: invalid column range\n");
+		return false;
+	}
+
+	return true;
+}
+
+// As validate_column_range, but a start past the end is a range that
+// wraps from the last cell to the first, as a scan across cell 0 covers
+static bool validate_wrapped_range(int32_t start, int32_t end)
+{
+	return start > end ? validate_column_range(end, start) : validate_column_range(start, end);
+}
+
+// Cells of a range that may wrap
+static uint32_t wrapped_cells(int32_t start, int32_t end)
+{
+	return start > end ? cell_count - (uint32_t)(start - end - 1) : (uint32_t)(end - start + 1);
+}
+
+// Whether the queued stream records are due to be sent under the
+// aggregation policy.  Once streaming stops the remainder goes at once.
+static bool stream_due(void)
+{
+	uint32_t queued = ring_count(&stream_queue);
+	if (queued == 0 || (stream_credit && stream_credits == 0))
+		return false;
+
+	// Under credit a block holds no more than the host has room for
+	uint32_t block = stream_credit ? Min(stream_block_records, stream_credits) : stream_block_records;
+	return !(enable_stream || stream_events) || queued >= block || sof_count - stream_oldest >= stream_wait_ms;
+}
+
+// Send a block of the streamed records that have accumulated since the
+// last call, once the aggregation policy says they are due
+static void flush_stream(void)
+{
+	if (stream_credit && stream_credits == 0 && ring_count(&stream_queue))
+	{
+		if (!stream_stalled)
+			stream_stalls++;
+		stream_stalled = true;
+		return;
+	}
+
+	if (!stream_due())
+		return;
+
+	struct
+	{
+		stream_header_t header;
+		stream_record_t records[STREAM_BLOCK_MAX_RECORDS];
+	} block;
+
+	block.header.magic = stream_magic;
+	block.header.dropped = stream_dropped;
+	block.header.records = ring_pop(&stream_queue, stream_ring, STREAM_RING_SIZE, sizeof(stream_record_t),
+		block.records, stream_credit ? Min(stream_block_records, stream_credits) : stream_block_records);
+	if (stream_credit)
+		stream_credits -= block.header.records;
+
+	// What is left over was queued after the block filled
+	if (ring_count(&stream_queue))
+		stream_oldest = sof_count;
+
+	push_time(stream_magic);
+	write_binary(&block, sizeof(stream_header_t) + block.header.records * sizeof(stream_record_t));
+}
+
+// Position push, set by M1029 <mode> [<n>]: instead of polling M1001 the
+// host is sent a position_push_t on the data interface every n ms
+// (POSITION_PUSH_PERIOD) or whenever the head has moved n columns
+// (POSITION_PUSH_COLUMNS).  The magic value keeps it apart from text
+// replies and stream blocks.
+#define POSITION_PUSH_OFF 0
+#define POSITION_PUSH_PERIOD 1
+#define POSITION_PUSH_COLUMNS 2
+#define POSITION_MAGIC 0x5AA6
+
+typedef struct
+{
+	uint16_t magic;
+	uint16_t frame;  // USB frame number (1 ms) when sampled
+	int32_t position;
+	int32_t row;
+} position_push_t;
+
+static uint8_t position_push_mode = POSITION_PUSH_OFF;
+static uint32_t position_push_interval;
+// SOF count or head position at the last push
+static uint32_t position_push_last;
+
+static void push_position(void)
+{
+	if (position_push_mode == POSITION_PUSH_OFF)
+		return;
+
+	irqflags_t flags = cpu_irq_save();
+	int32_t position = head_position;
+	int32_t row = head_row;
+	cpu_irq_restore(flags);
+
+	if (position_push_mode == POSITION_PUSH_PERIOD)
+	{
+		uint32_t now = sof_count;
+		if (now - position_push_last < position_push_interval)
+			return;
+		position_push_last = now;
+	}
+	else
+	{
+		// The head wraps around the travel, so take the shorter way round
+		uint32_t moved = abs(position - (int32_t)position_push_last);
+		if (!head_limits && moved > (uint32_t)travel_columns / 2)
+			moved = travel_columns - moved;
+		if (moved < position_push_interval)
+			return;
+		position_push_last = position;
+	}
+
+	position_push_t push;
+	push.magic = POSITION_MAGIC;
+	push.frame = udd_get_frame_number();
+	push.position = position - head_origin;
+	push.row = row;
+	push_time(POSITION_MAGIC);
+	write_binary(&push, sizeof(push));
+}
+
+// Live preview, set by M1125: every period ms the row the head is on, each
+// channel summed over runs of stride columns into at most PREVIEW_POINTS
+// points, is sent as a preview_header_t and its uint32_t planes, so a
+// display follows the scan at a bandwidth that does not grow with the
+// columns.  With the pyramid on (M1109) and the row in its cells, points
+// are summed from its coarsest bins that neither cross the row's ends nor
+// a point's, a stride rounded up to the bins of level 1 where need be;
+// otherwise from the live bins, at most a few hundred thousand cycles a
+// period.  The pyramid covers what was counted since M1109 1.  Like stream
+// blocks it goes out between readout jobs; a preview that falls due
+// during one goes after it, and counts as late.
+#define PREVIEW_MAGIC 0x5AAD
+#define PREVIEW_POINTS 256
+#define PREVIEW_PERIOD_MS 100
+
+typedef struct
+{
+	uint16_t magic;
+	uint16_t points;    // Per channel
+	uint16_t stride;    // Columns summed into each point; the last may have fewer
+	uint16_t mask;      // Channels sent, a plane of points each in mask order
+	int32_t row;
+	uint32_t sequence;  // Previews sent since M1125 turned them on
+	uint32_t built;     // sof_count when summed
+} preview_header_t;
+
+static bool preview_on = false;
+static uint16_t preview_points_max;
+static uint16_t preview_period;
+static uint16_t preview_mask;
+static uint32_t preview_last;   // sof_count at the last preview
+static uint32_t preview_sequence;
+static uint32_t preview_late;   // Sent more than a period after it fell due
+static uint8_t preview_level;   // Pyramid level of the last, 0 for the bins
+// Reserved from the SRAM pool by the first M1125 on: a header and a plane
+// of PREVIEW_POINTS for each channel
+static preview_header_t *preview;
+
+static __always_inline uint32_t preview_bin(uint8_t channel, uint32_t cell)
+{
+#if COUNT_PACKED_CHANNELS
+	return count_read(count_bank, channel, cell);
+#else
+	return count_arena[count_bank + COUNT_INDEX(channel, cell)];
+#endif
+}
+
+// The highest pyramid level whose bins tile both the row and the points
+static uint8_t preview_pyramid_level(uint32_t first, uint32_t stride)
+{
+	if (!pyramid_on || first + column_count > PYRAMID_CELLS)
+		return 0;
+	for (uint8_t level = PYRAMID_LEVELS; level > 0; level--)
+	{
+		uint32_t bin = 1u << (level * PYRAMID_SHIFT);
+		if (column_count % bin == 0 && stride % bin == 0)
+			return level;
+	}
+	return 0;
+}
+
+static void preview_poll(void)
+{
+	if (!preview_on)
+		return;
+	uint32_t now = sof_count;
+	if (now - preview_last < preview_period)
+		return;
+	if (now - preview_last >= 2u * preview_period)
+		preview_late++;
+	preview_last = now;
+
+	int32_t row = head_row;
+	uint32_t first = row * column_count;
+	uint32_t stride = (column_count + preview_points_max - 1) / preview_points_max;
+	// Rounded up so the finest bins serve, if the row is a whole number of them
+	uint32_t fine = 1u << PYRAMID_SHIFT;
+	if (pyramid_on && column_count % fine == 0 && stride % fine)
+		stride += fine - stride % fine;
+	uint32_t points = (column_count + stride - 1) / stride;
+	uint8_t level = preview_pyramid_level(first, stride);
+	uint32_t shift = level * PYRAMID_SHIFT;
+
+	uint32_t *sums = (uint32_t *)(preview + 1);
+	for (uint8_t c = 0; c < channel_count; c++)
+	{
+		if (!(preview_mask & (1u << c)))
+			continue;
+		for (uint32_t p = 0; p < points; p++)
+		{
+			uint32_t from = first + p * stride, to = Min(from + stride, first + column_count);
+			uint32_t sum = 0;
+			if (level)
+				for (uint32_t bin = from >> shift; bin < to >> shift; bin++)
+					sum += pyramid[c][PYRAMID_OFFSET(level) + bin];
+			else
+				for (uint32_t cell = from; cell < to; cell++)
+					sum += preview_bin(c, cell);
+			*sums++ = sum;
+		}
+	}
+
+	preview->magic = PREVIEW_MAGIC;
+	preview->points = points;
+	preview->stride = stride;
+	preview->mask = preview_mask;
+	preview->row = row;
+	preview->sequence = preview_sequence++;
+	preview->built = now;
+	preview_level = level;
+	push_time(PREVIEW_MAGIC);
+	write_binary(preview, (uint8_t *)sums - (uint8_t *)preview);
+}
+
+// Returns READOUT_FLAG_OVERFLOW if any column of the range saturated
+static uint8_t readout_flags(uint8_t channel, int32_t start, int32_t end)
+{
+	uint8_t flags = limit_steps ? READOUT_FLAG_LIMIT : 0;
+#ifdef COUNT_OVERFLOWED
+	for (int32_t i = start; i <= end; i++)
+		if (COUNT_OVERFLOWED(channel, i))
+			return flags | READOUT_FLAG_OVERFLOW;
+#endif
+	return flags;
+}
+
+// readout_flags of a range that may wrap
+static uint8_t wrapped_flags(uint8_t channel, int32_t start, int32_t end)
+{
+	if (start <= end)
+		return readout_flags(channel, start, end);
+	return readout_flags(channel, start, cell_count - 1) | readout_flags(channel, 0, end);
+}
+
+// Staging buffer for readouts whose wire order does not match the memory layout
+typedef struct
+{
+	count_t values[UDI_CDC_DATA_EPS_FS_SIZE / sizeof(count_t)];
+	uint32_t length;
+} readout_block_t;
+
+// While set, sent payload is also folded into this CRC-32 (container blocks)
+static uint32_t *readout_crc32 = NULL;
+
+// Compressed readouts (M1102).  While readout_compress is set every
+// binary readout job but containers, which are seekable archives, and
+// striped readouts, whose chunks are placed by their offsets, sends
+// its payload through the LZ4 stream reserved from the SRAM pool, opened
+// when the job starts and finished with it.
+static bool readout_compress;
+static lz4_stream_t *readout_lz4;
+static bool readout_lz4_open;
+
+// Either fold a block of payload into *crc, or send it if crc is NULL
+static bool readout_emit(const volatile void *data, uint32_t length, uint16_t *crc)
+{
+	if (crc)
+	{
+		*crc = crc16_update(*crc, (const uint8_t *)data, length);
+		return true;
+	}
+
+	if (readout_crc32)
+		*readout_crc32 = crc32_update(*readout_crc32, (const uint8_t *)data, length);
+	if (readout_lz4_open)
+		return lz4_write(readout_lz4, (const void *)data, length);
+	return write_binary((const void *)data, length);
+}
+
+// Send the header of a readout whose payload the job sends, marked
+// READOUT_LZ4 while compression is on
+static bool readout_send_header(readout_header_t *header)
+{
+	if (readout_compress && !(header->channel & READOUT_STRIPED))
+		header->channel |= READOUT_LZ4;
+	push_time(0);
+	return write_binary(header, sizeof(*header));
+}
+
+static bool readout_push(readout_block_t *block, count_t value, uint16_t *crc)
+{
+	block->values[block->length++] = value;
+	if (block->length < sizeof(block->values) / sizeof(block->values[0]))
+		return true;
+
+	block->length = 0;
+	return readout_emit(block->values, sizeof(block->values), crc);
+}
+
+#if !COUNT_LAYOUT_INTERLEAVED
+// Send one channel's range of the readout bank, in place unless its bins
+// are packed
+static bool readout_plane(uint8_t channel, int32_t start, int32_t end, uint16_t *crc)
+{
+#if COUNT_PACKED_CHANNELS
+	if (channel != 0)
+	{
+		readout_block_t block;
+		block.length = 0;
+		for (int32_t i = start; i <= end; i++)
+			if (!readout_push(&block, COUNT_BIN(channel, i), crc))
+				return false;
+		return block.length == 0 || readout_emit(block.values, block.length * sizeof(count_t), crc);
+	}
+#endif
+	return readout_emit(&count_arena[readout_bank + COUNT_INDEX(channel, start)], (end - start + 1) * sizeof(count_t), crc);
+}
+#endif
+
+// Produce the payload for the channels set in mask over a column range,
+// either planar (each channel's range in turn) or interleaved per column.
+// Contiguous parts of the count buffers are sent in place, anything
+// else is gathered into endpoint-sized blocks.
+// With crc set the payload is only checksummed, so a readout calls this
+// twice: once to fill in the header and once to send.
+static bool readout_payload(uint16_t mask, int32_t start, int32_t end, bool interleave, uint16_t *crc)
+{
+	uint8_t channels = channel_count;
+
+#if COUNT_LAYOUT_INTERLEAVED
+	if (interleave && mask == (1u << channels) - 1)
+		return readout_emit(&COUNT_BIN(0, start), channels * (end - start + 1) * sizeof(count_t), crc);
+#else
+	if (!interleave || !(mask & (mask - 1)))
+	{
+		for (uint8_t c = 0; c < channels; c++)
+			if ((mask & (1u << c)) && !readout_plane(c, start, end, crc))
+				return false;
+		return true;
+	}
+#endif
+
+	readout_block_t block;
+	block.length = 0;
+	if (interleave)
+	{
+		for (int32_t i = start; i <= end; i++)
+			for (uint8_t c = 0; c < channels; c++)
+				if ((mask & (1u << c)) && !readout_push(&block, COUNT_BIN(c, i), crc))
+					return false;
+	}
+	else
+	{
+		for (uint8_t c = 0; c < channels; c++)
+			if (mask & (1u << c))
+				for (int32_t i = start; i <= end; i++)
+					if (!readout_push(&block, COUNT_BIN(c, i), crc))
+						return false;
+	}
+
+	return block.length == 0 || readout_emit(block.values, block.length * sizeof(count_t), crc);
+}
+
+// readout_payload over a range that may wrap, in the order the readout
+// job sends it: each part in turn, channel by channel when planar.  Each
+// part is contiguous in the arena, so neither costs more than a range
+// that does not wrap.
+static bool wrapped_payload(uint16_t mask, int32_t start, int32_t end, bool interleave, uint16_t *crc)
+{
+	if (start <= end)
+		return readout_payload(mask, start, end, interleave, crc);
+
+	if (interleave)
+		return readout_payload(mask, start, cell_count - 1, true, crc) && readout_payload(mask, 0, end, true, crc);
+
+	for (uint16_t rest = mask; rest; rest &= rest - 1)
+	{
+		uint16_t one = rest & -rest;
+		if (!readout_payload(one, start, cell_count - 1, false, crc) || !readout_payload(one, 0, end, false, crc))
+			return false;
+	}
+	return true;
+}
+
+// Encode the next columns of a channel.  The encoder state carries
+// over, so a range can be encoded in consecutive pieces.
+static bool rle_columns(rle_block_t *block, uint8_t channel, int32_t start, int32_t end, uint16_t *crc)
+{
+	for (int32_t i = start; i <= end; i++)
+		if (!rle_value(block, COUNT_BIN(channel, i), crc))
+			return false;
+
+	return true;
+}
+
+// Produce the compressed payload for one channel over a column range
+// (see rle.h).  Empty and flat regions collapse into single run tokens,
+// and small fluctuations around background cost one byte per column.
+// Like readout_payload, with crc set the payload is only checksummed,
+// and its length is returned through *length.
+static bool rle_payload(uint8_t channel, int32_t start, int32_t end, uint16_t *crc, uint32_t *length)
+{
+	rle_block_t block;
+	rle_begin(&block, readout_emit);
+	if (!rle_columns(&block, channel, start, end, crc) || !rle_finish(&block, crc))
+		return false;
+
+	if (length)
+		*length = block.total;
+
+	return true;
+}
+
+// LOCO-I median predictor from the cells to the left (a), above (b) and
+// above left (c): the lesser of a and b where c is above both, the
+// greater where c is below both, and the plane through all three
+// otherwise, so edges along either axis are followed
+static __always_inline uint32_t median_predict(uint32_t a, uint32_t b, uint32_t c)
+{
+	uint32_t low = Min(a, b), high = Max(a, b);
+	if (c >= high)
+		return low;
+	if (c <= low)
+		return high;
+	return a + b - c;
+}
+
+// Encode the next cells of a channel as residuals to their prediction.
+// Only cells from first on are neighbours, since the reader has no
+// others: the first row is predicted from the left, the first column
+// from above, and the first cell from 0.  Residuals wrap to the width of
+// count_t, which the reader undoes by adding its prediction back modulo
+// the same width.
+static bool predicted_columns(rice_block_t *block, uint8_t channel, int32_t first, uint32_t columns,
+	int32_t start, int32_t end, uint16_t *crc)
+{
+	uint32_t column = start % columns;
+	for (int32_t i = start; i <= end; i++)
+	{
+		bool left = column > 0 && i > first, above = i - (int32_t)columns >= first;
+		uint32_t prediction = 0;
+		if (left && above)
+		{
+			uint32_t b = COUNT_BIN(channel, i - columns);
+			uint32_t c = i - (int32_t)columns - 1 >= first ? COUNT_BIN(channel, i - columns - 1) : b;
+			prediction = median_predict(COUNT_BIN(channel, i - 1), b, c);
+		}
+		else if (left)
+			prediction = COUNT_BIN(channel, i - 1);
+		else if (above)
+			prediction = COUNT_BIN(channel, i - columns);
+
+		count_t residual = COUNT_BIN(channel, i) - prediction;
+#if COUNT_WIDTH == 16
+		if (!rice_residual(block, (int16_t)residual, crc))
+#else
+		if (!rice_residual(block, (int32_t)residual, crc))
+#endif
+			return false;
+		if (++column == columns)
+			column = 0;
+	}
+
+	return true;
+}
+
+// Produce the predictive payload for one channel over a cell range: the
+// uint16_t columns per row the predictor used, then the Rice coded
+// residuals (see rice.h).  Neighbouring rows of a 2D map are alike, so
+// most residuals are a few counts and take a few bits.
+// Like readout_payload, with crc set the payload is only checksummed,
+// and its length is returned through *length.
+static bool predicted_payload(uint8_t channel, int32_t start, int32_t end, uint16_t columns,
+	uint16_t *crc, uint32_t *length)
+{
+	rice_block_t block;
+	rice_begin(&block, sizeof(count_t) * 8, readout_emit);
+	if (!readout_emit(&columns, sizeof(columns), crc)
+		|| !predicted_columns(&block, channel, start, columns, start, end, crc) || !rice_finish(&block, crc))
+		return false;
+
+	if (length)
+		*length = sizeof(columns) + block.total;
+
+	return true;
+}
+
+// Non-paralyzable dead-time model for the corrected readout (M1033):
+// a column holding m counts over a dwell time T with dead time tau had
+// a true count of m / (1 - m * tau / T).  Only the ratio tau / T is
+// kept, and the default of 0 sends the counts unchanged.
+static float deadtime_ratio = 0.0f;
+
+// Per-channel calibration curves for the dose readout (M1035).
+// Each curve is piecewise linear through the origin and up to
+// CALIBRATION_POINTS uploaded (count, dose) points in ascending count
+// order, extended past the last point along the last segment.
+// Dose is in whatever integer unit the points were uploaded in.
+#define CALIBRATION_POINTS 8
+
+typedef struct
+{
+	uint8_t points;
+	float count[CALIBRATION_POINTS];  // Upper count of each segment
+	float dose[CALIBRATION_POINTS];   // Dose at count[]
+	float slope[CALIBRATION_POINTS];  // Dose per count up to count[]
+} calibration_t;
+
+static calibration_t calibration[COUNTER_CHANNELS];
+
+static __always_inline uint32_t calibrate_count(const calibration_t *curve, uint32_t count)
+{
+	if (count == UINT32_MAX)
+		return UINT32_MAX;
+
+	float value = count;
+	uint8_t i = 0;
+	while (i < curve->points - 1 && value > curve->count[i])
+		i++;
+
+	float dose = curve->dose[i] + (value - curve->count[i]) * curve->slope[i] + 0.5f;
+	if (dose <= 0.0f)
+		return 0;
+	return dose < 4294967040.0f ? (uint32_t)dose : UINT32_MAX;
+}
+
+// Columns corrected per pass, sized like the other binary slices
+#define CORRECTED_BLOCK_COLUMNS 64
+
+// Corrected count, or UINT32_MAX at or beyond saturation
+static __always_inline uint32_t correct_count(float measured, float ratio)
+{
+	float live = 1.0f - measured * ratio;
+	if (live <= 0.0f)
+		return UINT32_MAX;
+
+	float corrected = measured / live + 0.5f;
+	return corrected < 4294967040.0f ? (uint32_t)corrected : UINT32_MAX;
+}
+
+// Correct a run of columns of one channel into values[].
+// Four independent columns per iteration keep the FPU pipeline busy
+// while each divide completes.
+static void correct_columns(uint8_t channel, int32_t start, uint32_t columns, uint32_t *values)
+{
+	const float ratio = deadtime_ratio;
+	uint32_t i = 0;
+
+	for (; i + 4 <= columns; i += 4)
+	{
+		values[i] = correct_count(COUNT_BIN(channel, start + i), ratio);
+		values[i + 1] = correct_count(COUNT_BIN(channel, start + i + 1), ratio);
+		values[i + 2] = correct_count(COUNT_BIN(channel, start + i + 2), ratio);
+		values[i + 3] = correct_count(COUNT_BIN(channel, start + i + 3), ratio);
+	}
+
+	for (; i < columns; i++)
+		values[i] = correct_count(COUNT_BIN(channel, start + i), ratio);
+}
+
+// Produce the corrected payload for one channel over a column range,
+// converted to dose with the channel's calibration curve if dose is set.
+// Like readout_payload, with crc set the payload is only checksummed.
+static bool corrected_payload(uint8_t channel, int32_t start, int32_t end, bool dose, uint16_t *crc)
+{
+	uint32_t values[CORRECTED_BLOCK_COLUMNS];
+	while (start <= end)
+	{
+		uint32_t columns = Min(end - start + 1, CORRECTED_BLOCK_COLUMNS);
+		correct_columns(channel, start, columns, values);
+		if (dose)
+			for (uint32_t i = 0; i < columns; i++)
+				values[i] = calibrate_count(&calibration[channel], values[i]);
+		if (!readout_emit(values, columns * sizeof(uint32_t), crc))
+			return false;
+		start += columns;
+	}
+
+	return true;
+}
+
+// Ratio numerator / denominator as unsigned Q15, saturating at 0x7FFF
+// (just under 1.0).  A column with no primary counts reads as 0.
+static __always_inline uint32_t ratio_q15(uint32_t numerator, uint32_t denominator)
+{
+	if (!denominator)
+		return 0;
+
+#if COUNT_WIDTH == 16
+	// 16-bit counts shifted by 15 still fit in the 32-bit divide
+	int32_t q = (numerator << 15) / denominator;
+#else
+	int32_t q = numerator >= denominator ? 0x8000 : (int32_t)(((uint64_t)numerator << 15) / denominator);
+#endif
+	return __USAT(q, 15);
+}
+
+// Produce the ratio payload over a column range: for each column the
+// secondary/primary and tertiary/primary ratios as two Q15 halfwords,
+// packed into one word with PKHBT.  A channel that is not stored reads
+// as 0.  Like readout_payload, with crc set the payload is only checksummed.
+static bool ratio_payload(int32_t start, int32_t end, uint16_t *crc)
+{
+	uint32_t values[CORRECTED_BLOCK_COLUMNS];
+	uint8_t channels = channel_count;
+	while (start <= end)
+	{
+		uint32_t columns = Min(end - start + 1, CORRECTED_BLOCK_COLUMNS);
+		for (uint32_t i = 0; i < columns; i++)
+		{
+			uint32_t primary = COUNT_BIN(0, start + i);
+			uint32_t secondary = ratio_q15(COUNT_BIN(1, start + i), primary);
+			uint32_t tertiary = channels > 2 ? ratio_q15(COUNT_BIN(2, start + i), primary) : 0;
+			values[i] = __PKHBT(secondary, tertiary, 16);
+		}
+		if (!readout_emit(values, columns * sizeof(uint32_t), crc))
+			return false;
+		start += columns;
+	}
+
+	return true;
+}
+
+// Per-column gain map for the flat-field readout (M1057, M1058).  Gains
+// are unsigned Q1.15, GAIN_ONE being 1.0, so a column can be scaled up to
+// just under 2.  The same map applies to every channel and row, and
+// columns past GAIN_MAP_COLUMNS keep a gain of 1.
+#define GAIN_MAP_COLUMNS 8192
+#define GAIN_ONE 0x8000
+
+static uint16_t gain_map[GAIN_MAP_COLUMNS];
+
+static void gain_map_reset(void)
+{
+	for (uint32_t i = 0; i < GAIN_MAP_COLUMNS; i++)
+		gain_map[i] = GAIN_ONE;
+}
+
+static __always_inline uint32_t gain_at(uint32_t column)
+{
+	return column < GAIN_MAP_COLUMNS ? gain_map[column] : GAIN_ONE;
+}
+
+// Dark background per column of each channel (M1059), captured from one
+// row of the readout bank and subtracted by the flat-field readout.  Held
+// as uint16_t whatever COUNT_WIDTH, so darker than 65535 saturates, and
+// word aligned so two columns load together.  Columns past
+// BACKGROUND_COLUMNS have no background.  The map keeps the size it has
+// with three channels, so each channel beyond takes columns from all.
+#define BACKGROUND_COLUMNS ((3 * 2048 / COUNTER_CHANNELS) & ~31)
+
+static COMPILER_WORD_ALIGNED uint16_t background[COUNTER_CHANNELS][BACKGROUND_COLUMNS];
+
+static __always_inline uint32_t background_at(uint8_t channel, uint32_t column)
+{
+	return column < BACKGROUND_COLUMNS ? background[channel][column] : 0;
+}
+
+// Count scaled by a Q1.15 gain, rounded and saturated to count_t
+static __always_inline count_t gain_count(count_t count, uint32_t gain)
+{
+#if COUNT_WIDTH == 16
+	// 16-bit count times 16-bit gain still fits in 32 bits
+	return __USAT((count * gain + GAIN_ONE / 2) >> 15, 16);
+#else
+	uint64_t value = ((uint64_t)count * gain + GAIN_ONE / 2) >> 15;
+	return value > UINT32_MAX ? UINT32_MAX : (count_t)value;
+#endif
+}
+
+// Produce the flat-field payload for one channel over a cell range, a
+// block of columns at a time as it is sent: each count less the column's
+// background if subtract is set, then scaled by its gain.  The column of
+// each cell is tracked rather than divided out.  Like readout_payload,
+// with crc set the payload is only checksummed.
+static bool gain_payload(uint8_t channel, int32_t start, int32_t end, bool subtract, uint16_t *crc)
+{
+	count_t values[CORRECTED_BLOCK_COLUMNS];
+	uint32_t columns_per_row = column_count;
+	uint32_t column = start % columns_per_row;
+	while (start <= end)
+	{
+		uint32_t cells = Min(end - start + 1, CORRECTED_BLOCK_COLUMNS);
+		uint32_t i = 0;
+#if COUNT_WIDTH == 16
+		// Two columns per UQSUB16, which stops at 0 in each half
+		if (subtract)
+			for (; i + 2 <= cells; i += 2)
+			{
+				uint32_t next = column + 1 == columns_per_row ? 0 : column + 1;
+				uint32_t counts = __PKHBT(COUNT_BIN(channel, start + i), COUNT_BIN(channel, start + i + 1), 16);
+				uint32_t dark = __PKHBT(background_at(channel, column), background_at(channel, next), 16);
+				uint32_t net = __UQSUB16(counts, dark);
+				values[i] = gain_count(net & 0xFFFF, gain_at(column));
+				values[i + 1] = gain_count(net >> 16, gain_at(next));
+				column = next + 1 == columns_per_row ? 0 : next + 1;
+			}
+#endif
+		for (; i < cells; i++)
+		{
+			count_t count = COUNT_BIN(channel, start + i);
+			if (subtract)
+			{
+				uint32_t dark = background_at(channel, column);
+				count = count > dark ? count - dark : 0;
+			}
+			values[i] = gain_count(count, gain_at(column));
+			if (++column == columns_per_row)
+				column = 0;
+		}
+		if (!readout_emit(values, cells * sizeof(count_t), crc))
+			return false;
+		start += cells;
+	}
+
+	return true;
+}
+
+// Counts per second of a channel from the dwell track, saturated to
+// 32 bits, or 0 where the head never dwelt
+static bool rate_payload(uint8_t channel, int32_t start, int32_t end, uint16_t *crc)
+{
+	uint32_t values[CORRECTED_BLOCK_COLUMNS];
+	uint64_t cpu_hz = sysclk_get_cpu_hz();
+	while (start <= end)
+	{
+		uint32_t cells = Min(end - start + 1, CORRECTED_BLOCK_COLUMNS);
+		for (uint32_t i = 0; i < cells; i++)
+		{
+			uint32_t dwell = COUNT_DWELL(start + i);
+			uint64_t rate = dwell ? (COUNT_BIN(channel, start + i) * cpu_hz + dwell / 2) / dwell : 0;
+			values[i] = Min(rate, UINT32_MAX);
+		}
+		if (!readout_emit(values, cells * sizeof(uint32_t), crc))
+			return false;
+		start += cells;
+	}
+
+	return true;
+}
+
+// Fraction bits of the uncertainties of M1095
+#define UNCERTAINTY_SHIFT 8
+
+// sqrt(count) in UNCERTAINTY_SHIFT fixed point, rounded
+static __always_inline uint32_t count_uncertainty(float count)
+{
+	float sigma;
+	arm_sqrt_f32(count, &sigma);
+	return (uint32_t)(sigma * (1u << UNCERTAINTY_SHIFT) + 0.5f);
+}
+
+// Produce the payload of M1095 for one channel over a column range:
+// each cell's count followed by its uncertainty, a column pair at a
+// time so the square roots of a block go through the FPU back to back.
+// Like readout_payload, with crc set the payload is only checksummed.
+static bool uncertainty_payload(uint8_t channel, int32_t start, int32_t end, uint16_t *crc)
+{
+	uint32_t values[CORRECTED_BLOCK_COLUMNS * 2];
+	while (start <= end)
+	{
+		uint32_t cells = Min(end - start + 1, CORRECTED_BLOCK_COLUMNS);
+		uint32_t i = 0;
+		for (; i + 2 <= cells; i += 2)
+		{
+			uint32_t a = COUNT_BIN(channel, start + i), b = COUNT_BIN(channel, start + i + 1);
+			values[2 * i] = a;
+			values[2 * i + 1] = count_uncertainty(a);
+			values[2 * i + 2] = b;
+			values[2 * i + 3] = count_uncertainty(b);
+		}
+		for (; i < cells; i++)
+		{
+			values[2 * i] = COUNT_BIN(channel, start + i);
+			values[2 * i + 1] = count_uncertainty(values[2 * i]);
+		}
+		if (!readout_emit(values, cells * 2 * sizeof(uint32_t), crc))
+			return false;
+		start += cells;
+	}
+
+	return true;
+}
+
+// FIR smoothing of readouts: the Q15 taps uploaded with M1096, in order
+#define SMOOTH_TAPS_MAX 32
+static int16_t smooth_taps[SMOOTH_TAPS_MAX];
+static uint8_t smooth_tap_count;
+
+// The filter of the readout under way.  CMSIS-DSP takes the taps
+// time-reversed, and its state carries the last inputs from one block
+// to the next, so a range filters the same however it is sliced.
+static q31_t smooth_coeffs[SMOOTH_TAPS_MAX];
+static q31_t smooth_state[SMOOTH_TAPS_MAX + CORRECTED_BLOCK_COLUMNS - 1];
+static arm_fir_instance_q31 smooth_fir;
+static uint8_t smooth_channel;
+static int32_t smooth_first, smooth_last;
+static int32_t smooth_delay;
+
+// A column's count as filter input.  Beyond the range the edge columns
+// repeat, so the readout does not depend on cells outside it.
+static __always_inline q31_t smooth_input(int32_t column)
+{
+	column = Max(smooth_first, Min(column, smooth_last));
+	return Min(COUNT_BIN(smooth_channel, column), INT32_MAX);
+}
+
+// The filter is centred: output n is input n + delay, delay being half
+// the taps, so the inputs up to the first column's go in first.
+static void smooth_begin(uint8_t channel, int32_t start, int32_t end)
+{
+	for (uint8_t i = 0; i < smooth_tap_count; i++)
+		smooth_coeffs[i] = (q31_t)smooth_taps[smooth_tap_count - 1 - i] << 16;
+	arm_fir_init_q31(&smooth_fir, smooth_tap_count, smooth_coeffs, smooth_state, CORRECTED_BLOCK_COLUMNS);
+	smooth_channel = channel;
+	smooth_first = start;
+	smooth_last = end;
+	smooth_delay = (smooth_tap_count - 1) / 2;
+
+	q31_t in[SMOOTH_TAPS_MAX], out[SMOOTH_TAPS_MAX];
+	for (int32_t i = 0; i < 2 * smooth_delay; i++)
+		in[i] = smooth_input(start - smooth_delay + i);
+	if (smooth_delay)
+		arm_fir_q31(&smooth_fir, in, out, 2 * smooth_delay);
+}
+
+// Produce the smoothed payload for the next columns of the range set by
+// smooth_begin.  Integer counts times Q31 taps come out of the 64-bit
+// accumulator as whole counts, truncated; negative taps can take a
+// column below zero, which is sent as 0.
+// Like readout_payload, with crc set the payload is only checksummed.
+static bool smoothed_payload(int32_t start, int32_t end, uint16_t *crc)
+{
+	q31_t in[CORRECTED_BLOCK_COLUMNS], out[CORRECTED_BLOCK_COLUMNS];
+	while (start <= end)
+	{
+		uint32_t cells = Min(end - start + 1, CORRECTED_BLOCK_COLUMNS);
+		for (uint32_t i = 0; i < cells; i++)
+			in[i] = smooth_input(start + smooth_delay + i);
+		arm_fir_q31(&smooth_fir, in, out, cells);
+		for (uint32_t i = 0; i < cells; i++)
+			out[i] = Max(out[i], 0);
+		if (!readout_emit(out, cells * sizeof(uint32_t), crc))
+			return false;
+		start += cells;
+	}
+
+	return true;
+}
+
+// Position calibration of the head (M1107): the position in micrometres
+// of every head_knot_spacing'th column from column 0, increasing,
+// reserved from the SRAM pool by the first upload.  Positions between
+// knots are linear in the column.
+#define HEAD_KNOTS 256
+static float *head_calibration;
+static uint32_t head_knots;
+static uint16_t head_knot_spacing;
+
+// The resampled readout under way (M1108): grid point i is at
+// resample_first + i * resample_pitch um
+#define RESAMPLE_WINDOW 64
+static uint8_t resample_channel;
+static int32_t resample_row_base;
+static float resample_first, resample_pitch;
+
+// Fractional column at position um, by bisecting the knots.  Positions
+// beyond the calibration or the columns take the end column.
+static float head_column_at(float um)
+{
+	uint32_t low = 0, high = head_knots - 1;
+	if (um <= head_calibration[0])
+		return 0.0f;
+	if (um >= head_calibration[high])
+		return Min((float)(high * head_knot_spacing), (float)(column_count - 1));
+
+	while (high - low > 1)
+	{
+		uint32_t mid = (low + high) / 2;
+		if (head_calibration[mid] <= um)
+			low = mid;
+		else
+			high = mid;
+	}
+
+	float column = (low + (um - head_calibration[low]) / (head_calibration[high] - head_calibration[low])) * head_knot_spacing;
+	return Min(column, (float)(column_count - 1));
+}
+
+// Produce the payload of M1108 for grid points first..last: each point's
+// count interpolated between the columns either side of it, rounded.
+// The counts go through arm_linear_interp_f32 from a window of up to
+// RESAMPLE_WINDOW columns, loaded again once a point passes its end, so
+// a fine grid loads each column once.  The window holds a copy of its
+// last column past the end, which arm_linear_interp_f32 reads for a
+// point right on it.
+// Like readout_payload, with crc set the payload is only checksummed.
+static bool resampled_payload(int32_t first, int32_t last, uint16_t *crc)
+{
+	float window[RESAMPLE_WINDOW + 1];
+	arm_linear_interp_instance_f32 interp = { 0, 0.0f, 1.0f, window };
+	uint32_t values[CORRECTED_BLOCK_COLUMNS];
+	while (first <= last)
+	{
+		uint32_t points = Min(last - first + 1, CORRECTED_BLOCK_COLUMNS);
+		for (uint32_t i = 0; i < points; i++)
+		{
+			float column = head_column_at(resample_first + (first + i) * resample_pitch);
+			if (!interp.nValues || column < interp.x1 || column >= interp.x1 + interp.nValues - 1)
+			{
+				int32_t base = (int32_t)column;
+				uint32_t n = Min(RESAMPLE_WINDOW, column_count - base);
+				for (uint32_t j = 0; j < n; j++)
+					window[j] = COUNT_BIN(resample_channel, resample_row_base + base + j);
+				window[n] = window[n - 1];
+				interp.nValues = n;
+				interp.x1 = base;
+			}
+			values[i] = (uint32_t)(arm_linear_interp_f32(&interp, column) + 0.5f);
+		}
+		if (!readout_emit(values, points * sizeof(uint32_t), crc))
+			return false;
+		first += points;
+	}
+
+	return true;
+}
+
+// Region of a tiled readout (M1111), set before it starts.  It goes
+// ahead of the tiles so the host can put them back together.
+#define TILE_SIZE 16
+#define TILE_BINS (TILE_SIZE * TILE_SIZE)
+
+typedef struct
+{
+	uint16_t row;
+	uint16_t column;
+	uint16_t rows;
+	uint16_t columns;
+} tile_region_t;
+
+static uint8_t tile_channel;
+static tile_region_t tile_region;
+
+// Tiles of the region, TILE_SIZE rows by TILE_SIZE columns from its
+// corner, in rows of tiles
+static __always_inline uint32_t tile_columns(void)
+{
+	return (tile_region.columns + TILE_SIZE - 1) / TILE_SIZE;
+}
+
+// Produce tiles first..last of M1111, each gathered from the rows it
+// covers into one block.  Bins beyond the region are 0, so every tile
+// is whole.
+// Like readout_payload, with crc set the payload is only checksummed.
+static bool tile_payload(int32_t first, int32_t last, uint16_t *crc)
+{
+	count_t values[TILE_BINS];
+	for (int32_t tile = first; tile <= last; tile++)
+	{
+		uint32_t row = tile_region.row + tile / tile_columns() * TILE_SIZE;
+		uint32_t column = tile_region.column + tile % tile_columns() * TILE_SIZE;
+		uint32_t rows = Min(TILE_SIZE, tile_region.row + tile_region.rows - row);
+		uint32_t columns = Min(TILE_SIZE, tile_region.column + tile_region.columns - column);
+		if (rows < TILE_SIZE || columns < TILE_SIZE)
+			memset(values, 0, sizeof(values));
+		for (uint32_t y = 0; y < rows; y++)
+		{
+			uint32_t cell = (row + y) * column_count + column;
+			for (uint32_t x = 0; x < columns; x++)
+				values[y * TILE_SIZE + x] = COUNT_BIN(tile_channel, cell + x);
+		}
+		if (!readout_emit(values, sizeof(values), crc))
+			return false;
+	}
+
+	return true;
+}
+
+// Produce the mean counts per pass for one channel over a cell range, in
+// PASS_MEAN_SHIFT fixed point and rounded, or 0 for a cell not yet
+// passed.  Like readout_payload, with crc set the payload is only
+// checksummed.
+static bool pass_payload(uint8_t channel, int32_t start, int32_t end, uint16_t *crc)
+{
+	uint32_t values[CORRECTED_BLOCK_COLUMNS];
+	while (start <= end)
+	{
+		uint32_t cells = Min(end - start + 1, CORRECTED_BLOCK_COLUMNS);
+		for (uint32_t i = 0; i < cells; i++)
+		{
+			uint32_t visits = pass_visits[start + i];
+			uint64_t sum = (uint64_t)pass_sum[channel][start + i] << PASS_MEAN_SHIFT;
+			values[i] = visits ? (uint32_t)((sum + visits / 2) / visits) : 0;
+		}
+		if (!readout_emit(values, cells * sizeof(uint32_t), crc))
+			return false;
+		start += cells;
+	}
+
+	return true;
+}
+
+// Last column at or above level on the way out from column i by step,
+// or limit if the profile never drops below it
+static int32_t edge_walk(uint8_t channel, int32_t i, int32_t limit, int32_t step, uint32_t level)
+{
+#if COUNT_WIDTH == 16
+	// Two columns per USUB16, whose GE flags SEL turns into a mask of
+	// the halves below level
+	uint32_t levels = __PKHBT(level, level, 16);
+	while ((limit - i) * step >= 2)
+	{
+		__USUB16(__PKHBT(COUNT_BIN(channel, i + step), COUNT_BIN(channel, i + 2 * step), 16), levels);
+		uint32_t below = __SEL(0, UINT32_MAX);
+		if (below)
+			return below & 0xFFFF ? i : i + step;
+		i += 2 * step;
+	}
+#endif
+	while (i != limit && COUNT_BIN(channel, i + step) >= level)
+		i += step;
+	return i;
+}
+
+// Column at which the profile crosses level on the way out from *from,
+// interpolated between the last column at or above level and the first
+// one below it.  Stops at limit if the profile never drops below level.
+// *from is left at the last column at or above level, where the walk
+// for a lower level can carry on.
+static float level_crossing(uint8_t channel, int32_t *from, int32_t limit, int32_t step, float level)
+{
+	float threshold = ceilf(level);
+	int32_t i = edge_walk(channel, *from, limit, step, (uint32_t)threshold);
+	*from = i;
+	if (i == limit)
+		return limit;
+
+	float inside = COUNT_BIN(channel, i), outside = COUNT_BIN(channel, i + step);
+	return i + step * (inside - level) / (inside - outside);
+}
+
+// Send a value in hundredths as a decimal with two places
+static void reply_hundredths(float value)
+{
+	uint32_t fixed = (uint32_t)(value * 100.0f + 0.5f);
+	reply_u32(fixed / 100);
+	reply_char('.');
+	reply_char('0' + fixed / 10 % 10);
+	reply_char('0' + fixed % 10);
+}
+
+// Summarise one channel over a column range in a single pass, plus a
+// walk out from the peak for the width
+static void profile_statistics(uint8_t channel, int32_t start, int32_t end)
+{
+	uint64_t sum = 0, moment = 0;
+	uint32_t peak_value = 0;
+	int32_t peak = start;
+	for (int32_t i = start; i <= end; i++)
+	{
+		uint32_t value = COUNT_BIN(channel, i);
+		sum += value;
+		moment += (uint64_t)value * (uint32_t)(i - start);
+		if (value > peak_value)
+		{
+			peak_value = value;
+			peak = i;
+		}
+	}
+
+	float centroid = 0.0f, width = 0.0f;
+	if (sum)
+	{
+		float half = peak_value / 2.0f;
+		int32_t right = peak, left = peak;
+		centroid = start + (float)moment / (float)sum;
+		width = level_crossing(channel, &right, end, 1, half) - level_crossing(channel, &left, start, -1, half);
+	}
+
+	reply_u64(sum);
+	reply_char(' ');
+	reply_u32(peak_value);
+	reply_char(' ');
+	reply_i32(peak);
+	reply_char(' ');
+	reply_hundredths(centroid);
+	reply_char(' ');
+	reply_hundredths(width);
+	reply_char('\n');
+}
+
+// Peak of one channel over a column range, *column set to the first
+// column holding it
+static uint32_t profile_peak(uint8_t channel, int32_t start, int32_t end, int32_t *column)
+{
+	uint32_t peak = 0;
+	int32_t i = start;
+	*column = start;
+#if COUNT_WIDTH == 16
+	// Each half of a USUB16 keeps the best of its columns, and the same
+	// GE flags pick that column's index in a second SEL.  Cells are
+	// counted in uint16_t, so the indices fit.
+	uint32_t peaks = 0, columns = __PKHBT(start, start, 16);
+	for (; i < end; i += 2)
+	{
+		uint32_t pair = __PKHBT(COUNT_BIN(channel, i), COUNT_BIN(channel, i + 1), 16);
+		__USUB16(peaks, pair);
+		peaks = __SEL(peaks, pair);
+		columns = __SEL(columns, __PKHBT(i, i + 1, 16));
+	}
+
+	uint32_t low = peaks & 0xFFFF, high = peaks >> 16;
+	int32_t low_column = columns & 0xFFFF, high_column = columns >> 16;
+	if (high > low || (high == low && high_column < low_column))
+	{
+		peak = high;
+		*column = high_column;
+	}
+	else
+	{
+		peak = low;
+		*column = low_column;
+	}
+#endif
+	for (; i <= end; i++)
+	{
+		uint32_t value = COUNT_BIN(channel, i);
+		if (value > peak)
+		{
+			peak = value;
+			*column = i;
+		}
+	}
+
+	return peak;
+}
+
+// Field edges of one channel over a column range: the peak, then the
+// left and right crossings of 20, 50 and 80% of it, walking out from
+// the peak.  Each level carries on from where the one above stopped,
+// so the columns out to the 20% edges are read once.
+static void profile_edges(uint8_t channel, int32_t start, int32_t end)
+{
+	static const uint8_t percents[] = { 80, 50, 20 };
+	float left[sizeof(percents)], right[sizeof(percents)];
+	int32_t peak;
+	uint32_t peak_value = profile_peak(channel, start, end, &peak);
+	int32_t from_left = peak, from_right = peak;
+	for (uint8_t i = 0; i < sizeof(percents); i++)
+	{
+		float level = peak_value * percents[i] / 100.0f;
+		left[i] = level_crossing(channel, &from_left, start, -1, level);
+		right[i] = level_crossing(channel, &from_right, end, 1, level);
+	}
+
+	reply_u32(peak_value);
+	reply_char(' ');
+	reply_i32(peak);
+	for (int8_t i = sizeof(percents) - 1; i >= 0; i--)
+	{
+		reply_char(' ');
+		reply_hundredths(left[i]);
+		reply_char(' ');
+		reply_hundredths(right[i]);
+	}
+	reply_char('\n');
+}
+
+// Reference profile for the gamma comparison (M1099, M1100), one float
+// per cell from cell 0, reserved from the SRAM pool by the first upload
+#define REFERENCE_CELLS 2048
+static float *reference;
+static uint32_t reference_cells;
+
+// Columns searched either side of each cell for the distance to agreement
+#define GAMMA_WINDOW_MAX 32
+// Worst cells reported by M1100
+#define GAMMA_WORST 4
+
+typedef struct
+{
+	uint32_t evaluated;  // Cells at or above the dose threshold
+	uint32_t passed;     // and those of them with gamma at most 1
+	int32_t worst[GAMMA_WORST];
+	float worst_gamma[GAMMA_WORST];
+	uint8_t worst_count;
+} gamma_result_t;
+
+// Keep the GAMMA_WORST highest gammas, worst first
+static void gamma_rank(gamma_result_t *result, int32_t cell, float gamma)
+{
+	uint8_t i = result->worst_count;
+	if (i == GAMMA_WORST)
+	{
+		if (gamma <= result->worst_gamma[GAMMA_WORST - 1])
+			return;
+		i--;
+	}
+	else
+		result->worst_count++;
+
+	for (; i > 0 && result->worst_gamma[i - 1] < gamma; i--)
+	{
+		result->worst[i] = result->worst[i - 1];
+		result->worst_gamma[i] = result->worst_gamma[i - 1];
+	}
+	result->worst[i] = cell;
+	result->worst_gamma[i] = gamma;
+}
+
+// 1D gamma index of one channel against the reference over a cell range.
+// Dose differences are global, dose a fraction of the reference peak,
+// and distance is in columns.  Cells whose reference is below threshold,
+// a fraction of the peak, are left out.  With normalise the counts are
+// scaled so their peak over the range meets the reference peak.
+// For each cell the squared dose differences to the reference around it
+// and the squared distances go through CMSIS-DSP a window at a time,
+// and the least of their sums is its squared gamma.  The window is
+// three distances either side, at most GAMMA_WINDOW_MAX columns, which
+// is as far as a gamma of 3 needs to look.
+static void gamma_evaluate(uint8_t channel, int32_t start, int32_t end, float dose, float distance,
+	float threshold, bool normalise, gamma_result_t *result)
+{
+	float reference_peak;
+	uint32_t index;
+	memset(result, 0, sizeof(*result));
+	arm_max_f32(reference, reference_cells, &reference_peak, &index);
+	if (reference_peak <= 0.0f)
+		return;
+
+	float scale = 1.0f;
+	if (normalise)
+	{
+		int32_t column;
+		uint32_t peak = profile_peak(channel, start, end, &column);
+		if (peak)
+			scale = reference_peak / peak;
+	}
+
+	float reach = ceilf(3.0f * distance);
+	int32_t window = Min((int32_t)reach, GAMMA_WINDOW_MAX);
+	float distances[2 * GAMMA_WINDOW_MAX + 1], squares[2 * GAMMA_WINDOW_MAX + 1];
+	for (int32_t k = -window; k <= window; k++)
+		distances[k + window] = (k / distance) * (k / distance);
+
+	float dose_scale = 1.0f / (dose * reference_peak * dose * reference_peak);
+	float cutoff = threshold * reference_peak;
+	for (int32_t i = start; i <= end; i++)
+	{
+		if (reference[i] < cutoff)
+			continue;
+
+		int32_t first = Max(i - window, 0), last = Min(i + window, (int32_t)reference_cells - 1);
+		uint32_t cells = last - first + 1;
+		float gamma;
+		arm_offset_f32(&reference[first], -scale * COUNT_BIN(channel, i), squares, cells);
+		arm_mult_f32(squares, squares, squares, cells);
+		arm_scale_f32(squares, dose_scale, squares, cells);
+		arm_add_f32(squares, &distances[first - (i - window)], squares, cells);
+		arm_min_f32(squares, cells, &gamma, &index);
+		arm_sqrt_f32(gamma, &gamma);
+
+		result->evaluated++;
+		if (gamma <= 1.0f)
+			result->passed++;
+		else
+			gamma_rank(result, i, gamma);
+	}
+}
+
+// Produce the decimated payload for one channel over a column range:
+// the sum of each run of stride columns, the last run possibly shorter.
+// Like readout_payload, with crc set the payload is only checksummed.
+static bool decimated_payload(uint8_t channel, int32_t start, int32_t end, uint16_t stride, uint16_t *crc)
+{
+	uint32_t values[CORRECTED_BLOCK_COLUMNS];
+	uint32_t length = 0;
+	for (int32_t i = start; i <= end; i += stride)
+	{
+		int32_t last = Min(i + stride - 1, end);
+		uint64_t sum = 0;
+		for (int32_t j = i; j <= last; j++)
+			sum += COUNT_BIN(channel, j);
+
+		values[length++] = Min(sum, UINT32_MAX);
+		if (length == CORRECTED_BLOCK_COLUMNS)
+		{
+			length = 0;
+			if (!readout_emit(values, sizeof(values), crc))
+				return false;
+		}
+	}
+
+	return length == 0 || readout_emit(values, length * sizeof(uint32_t), crc);
+}
+
+// Each run of dirty blocks in a dirty readout is sent as this header
+// followed by the count_t values of its cells
+typedef struct
+{
+	uint16_t start;
+	uint16_t cells;
+} dirty_region_t;
+
+// Find the first run of dirty blocks at or after cell from.
+// The run is returned as a cell range clipped to cell_count.
+static bool dirty_next_region(int32_t from, int32_t *start, int32_t *end)
+{
+	uint32_t blocks = (cell_count + DIRTY_BLOCK_CELLS - 1) >> DIRTY_BLOCK_SHIFT;
+	uint32_t block = (uint32_t)from >> DIRTY_BLOCK_SHIFT;
+	while (block < blocks && !DIRTY_TEST(dirty_readout, block))
+		block++;
+	if (block >= blocks)
+		return false;
+
+	uint32_t last = block;
+	while (last + 1 < blocks && DIRTY_TEST(dirty_readout, last + 1))
+		last++;
+
+	*start = block << DIRTY_BLOCK_SHIFT;
+	*end = Min(((last + 1) << DIRTY_BLOCK_SHIFT) - 1, cell_count - 1U);
+	return true;
+}
+
+static bool dirty_region(int32_t start, int32_t end, uint16_t *crc)
+{
+	dirty_region_t region;
+	region.start = start;
+	region.cells = end - start + 1;
+	return readout_emit(&region, sizeof(region), crc);
+}
+
+// Produce the dirty payload for one channel: every dirty run with its
+// region header.  Like readout_payload, with crc set the payload is
+// only checksummed, and its length is returned through *length.
+static bool dirty_payload(uint8_t channel, uint16_t *crc, uint32_t *length)
+{
+	int32_t start, end = -1;
+	uint32_t total = 0;
+	while (dirty_next_region(end + 1, &start, &end))
+	{
+		if (!dirty_region(start, end, crc) || !readout_payload(1u << channel, start, end, false, crc))
+			return false;
+		total += sizeof(dirty_region_t) + (end - start + 1) * sizeof(count_t);
+	}
+
+	if (length)
+		*length = total;
+	return true;
+}
+
+// Readouts run as a job that sends a slice of columns per main loop pass,
+// so commands queued behind a large transfer can run in between
+// (see command_may_overlap)
+#define READOUT_JOB_NONE 0
+#define READOUT_JOB_TEXT 1
+#define READOUT_JOB_BINARY 2
+#define READOUT_JOB_RLE 3
+#define READOUT_JOB_TIME 4
+#define READOUT_JOB_CORRECTED 5
+#define READOUT_JOB_DOSE 6
+#define READOUT_JOB_RATIO 7
+#define READOUT_JOB_DECIMATED 8
+#define READOUT_JOB_DIRTY 9
+#define READOUT_JOB_CONTAINER 10
+#define READOUT_JOB_GAIN 11
+#define READOUT_JOB_PASS 12
+#define READOUT_JOB_VISITS 13
+#define READOUT_JOB_COINCIDENCES 14
+#define READOUT_JOB_RATES 15
+#define READOUT_JOB_FRAME 16
+#define READOUT_JOB_FLASH_LOG 17
+#define READOUT_JOB_ANALOG 18
+#define READOUT_JOB_UNCERTAINTY 19
+#define READOUT_JOB_SMOOTHED 20
+#define READOUT_JOB_PREDICTED 21
+#define READOUT_JOB_RESAMPLED 22
+#define READOUT_JOB_PYRAMID 23
+#define READOUT_JOB_TILES 24
+#define READOUT_JOB_STRIPED 25
+
+// At most 64 * 3 * 4 bytes of binary data, about a frame at full speed,
+// or 32 values of up to 11 characters per pass
+#define READOUT_SLICE_COLUMNS 64
+#define READOUT_TEXT_SLICE_COLUMNS 32
+
+// Most a text slice can add to the reply ring: its values, the closing
+// "\nok\n", and the headers and CRCs of the two reply frames it may span
+#define READOUT_TEXT_SLICE_BYTES (READOUT_TEXT_SLICE_COLUMNS * (REPLY_U32_DIGITS + 1) + 4 \
+	+ 2 * (sizeof(frame_header_t) + sizeof(uint16_t)))
+
+// Column ranges a decimated readout (M1040) can send in one request
+#define READOUT_MAX_ROIS 4
+
+typedef struct
+{
+	uint8_t kind;        // READOUT_JOB_*
+	uint8_t channel;     // Channel being sent, or the first one when interleaved
+	uint16_t mask;       // Channels to send, one bit each
+	bool interleave;
+	int32_t start;
+	int32_t end;         // Of the range, or of its first part if it wraps
+	int32_t wrap_end;    // End of the part from cell 0 of a wrapped range, or -1
+	int32_t next;        // First column of the next slice
+	uint8_t opcode;      // Reply framing of the command that started the job
+	uint8_t sequence;
+	bool framed;
+	uint8_t source;      // COMMAND_SOURCE_* to send to
+	rle_block_t rle;
+	rice_block_t rice;   // Predictive readouts: the coder
+	uint16_t columns;    // and the columns per row it predicts from
+	bool subtract;       // Flat-field readouts: take off the background
+	uint16_t stride;     // Decimated readouts: columns summed per value
+	uint8_t roi;         // and the ranges still to send after start..end
+	uint8_t rois;
+	int32_t roi_start[READOUT_MAX_ROIS];
+	int32_t roi_end[READOUT_MAX_ROIS];
+	uint8_t pipes;       // Striped readouts: the pipes, bit n for DATA_INTERFACE_* n
+	uint16_t chunk;      // and the next chunk, of chunks
+	uint16_t chunks;
+	uint32_t offset;     // Of the next chunk in the payload
+} readout_job_t;
+
+static readout_job_t readout_job;
+
+// The command being run, so a job can frame the replies it sends later
+static uint8_t command_opcode;
+static uint8_t command_sequence;
+static bool command_framed;
+
+// A text or binary count readout with a start past the end is a range
+// that wraps from the last cell to the first (M1005, M1015 and M1016),
+// sent as its two parts in turn
+static void readout_job_start(uint8_t kind, uint16_t mask, bool interleave, int32_t start, int32_t end)
+{
+	bool wraps = start > end && (kind == READOUT_JOB_TEXT || kind == READOUT_JOB_BINARY);
+	readout_job.channel = __builtin_ctz(mask);
+	readout_job.mask = mask;
+	readout_job.interleave = interleave;
+	readout_job.start = start;
+	readout_job.end = wraps ? (int32_t)cell_count - 1 : end;
+	readout_job.wrap_end = wraps ? end : -1;
+	readout_job.next = start;
+	readout_job.opcode = command_opcode;
+	readout_job.sequence = command_sequence;
+	readout_job.framed = command_framed;
+	readout_job.source = command_source;
+	if (kind == READOUT_JOB_RLE)
+		rle_begin(&readout_job.rle, readout_emit);
+	else if (kind == READOUT_JOB_SMOOTHED)
+		smooth_begin(readout_job.channel, start, end);
+	else if (kind == READOUT_JOB_PREDICTED)
+		rice_begin(&readout_job.rice, sizeof(count_t) * 8, readout_emit);
+	if (readout_compress && kind != READOUT_JOB_TEXT && kind != READOUT_JOB_CONTAINER && kind != READOUT_JOB_STRIPED)
+		readout_lz4_open = lz4_begin(readout_lz4, write_binary);
+	readout_job.kind = kind;
+}
+
+// Striped readouts (M1129) send the payload M1016 would as chunks of a
+// slice each, chunk k going to the (k mod P)th of the P pipes selected,
+// so that a host reading the command port, the vendor bulk interface and
+// the data port at once keeps each of their endpoints busy.  Each chunk
+// is a stripe_chunk_t and its bytes, which offset places in the payload.
+#define STRIPE_MAGIC 0x5AAF
+
+// Pipes of a striped readout, one bit per DATA_INTERFACE_*
+#define STRIPE_PIPE_CDC (1u << DATA_INTERFACE_CDC)
+#define STRIPE_PIPE_BULK (1u << DATA_INTERFACE_BULK)
+#define STRIPE_PIPE_CDC_DATA (1u << DATA_INTERFACE_CDC_DATA)
+
+typedef struct
+{
+	uint16_t magic;    // STRIPE_MAGIC
+	uint16_t chunk;    // From 0
+	uint16_t chunks;   // Of the readout
+	uint8_t pipe;      // DATA_INTERFACE_* it was sent on
+	uint8_t sequence;  // Of the M1129 frame, to match the chunks to it (0 in text)
+	uint32_t offset;   // Of its bytes in the payload
+	uint32_t length;
+} stripe_chunk_t;
+
+// Whether a striped readout is sending chunks on the command port, where
+// nothing else may come between a chunk header and its bytes
+static bool stripe_on_command_port(void)
+{
+	return readout_job.kind == READOUT_JOB_STRIPED && (readout_job.pipes & STRIPE_PIPE_CDC);
+}
+
+// The pipe of a chunk: the (chunk mod P)th set bit of pipes
+static uint8_t stripe_pipe(uint8_t pipes, uint16_t chunk)
+{
+	for (uint8_t n = chunk % __builtin_popcount(pipes); n; n--)
+		pipes &= pipes - 1;
+	return __builtin_ctz(pipes);
+}
+
+// Send the slice next..slice_end of the channel being sent, or of every
+// channel when interleaved, as the next chunk
+static bool stripe_send(readout_job_t *job, int32_t slice_end)
+{
+	uint16_t mask = job->interleave ? job->mask : 1u << job->channel;
+	stripe_chunk_t chunk;
+	chunk.magic = STRIPE_MAGIC;
+	chunk.chunk = job->chunk++;
+	chunk.chunks = job->chunks;
+	chunk.pipe = stripe_pipe(job->pipes, chunk.chunk);
+	chunk.sequence = job->framed ? job->sequence : 0;
+	chunk.offset = job->offset;
+	chunk.length = __builtin_popcount(mask) * (slice_end - job->next + 1) * sizeof(count_t);
+	job->offset += chunk.length;
+
+	// write_binary sends wherever data_interface says
+	uint8_t selected = data_interface;
+	data_interface = chunk.pipe;
+	bool sent = write_binary(&chunk, sizeof(chunk))
+		&& readout_payload(mask, job->next, slice_end, job->interleave, NULL);
+	data_interface = selected;
+	return sent;
+}
+
+static void readout_job_step(void)
+{
+	readout_job_t *job = &readout_job;
+	int32_t slice_end;
+	// Whether this part is the last of the range
+	bool last_part = job->wrap_end < 0 || job->end == job->wrap_end;
+
+	if (job->kind == READOUT_JOB_TEXT)
+	{
+		// Wait for room rather than block on a full reply ring
+		if (reply_space() < READOUT_TEXT_SLICE_BYTES)
+			return;
+
+		slice_end = Min(job->next + READOUT_TEXT_SLICE_COLUMNS - 1, job->end);
+		if (job->framed)
+			reply_frame_begin(job->opcode, job->sequence);
+
+		// TODO: This really should transfer in binary,
+		// but text is easier to debug using a terminal.
+		// The slice is built up here and goes to the ring in one copy.
+		char text[READOUT_TEXT_SLICE_COLUMNS * (REPLY_U32_DIGITS + 1)];
+		uint32_t length = 0;
+		for (int32_t i = job->next; i <= slice_end; i++)
+		{
+			length += reply_format_u32(&text[length], COUNT_BIN(job->channel, i));
+			text[length++] = ' ';
+		}
+		reply_write(text, length);
+
+		bool done = last_part && slice_end == job->end;
+		if (done)
+		{
+			reply_char('\n');
+			reply_str("ok\n");
+		}
+
+		if (job->framed)
+			reply_frame_end(done ? 0 : FRAME_FLAG_MORE);
+
+		// Hand the slice to whichever CDC bank is idle now, so it goes out
+		// while the next slice is formatted rather than after the pass
+		reply_flush();
+	}
+	else
+	{
+		// Decimated slices hold whole runs so that the values line up
+		int32_t slice_columns = READOUT_SLICE_COLUMNS;
+		if (job->kind == READOUT_JOB_DECIMATED)
+			slice_columns *= job->stride;
+		// A flash log dump goes a page at a time, and tiles one at a time
+		else if (job->kind == READOUT_JOB_FLASH_LOG || job->kind == READOUT_JOB_TILES)
+			slice_columns = 1;
+		slice_end = Min(job->next + slice_columns - 1, job->end);
+
+		// Each dirty run starts with its region header
+		bool sent;
+		if (job->kind == READOUT_JOB_DIRTY && job->next == job->start && !dirty_region(job->start, job->end, NULL))
+			sent = false;
+		else if (job->kind == READOUT_JOB_TIME)
+			sent = readout_emit(&COUNT_TIME(job->next), (slice_end - job->next + 1) * sizeof(uint16_t), NULL);
+		else if (job->kind == READOUT_JOB_COINCIDENCES)
+			sent = readout_emit(&COUNT_COINCIDENCE(job->next), (slice_end - job->next + 1) * sizeof(uint16_t), NULL);
+		else if (job->kind == READOUT_JOB_ANALOG)
+			sent = readout_emit(&COUNT_ANALOG(job->channel, job->next), (slice_end - job->next + 1) * sizeof(uint16_t), NULL);
+		else if (job->kind == READOUT_JOB_CORRECTED || job->kind == READOUT_JOB_DOSE)
+			sent = corrected_payload(job->channel, job->next, slice_end, job->kind == READOUT_JOB_DOSE, NULL);
+		else if (job->kind == READOUT_JOB_DECIMATED)
+			sent = decimated_payload(job->channel, job->next, slice_end, job->stride, NULL);
+		else if (job->kind == READOUT_JOB_RATIO)
+			sent = ratio_payload(job->next, slice_end, NULL);
+		else if (job->kind == READOUT_JOB_GAIN)
+			sent = gain_payload(job->channel, job->next, slice_end, job->subtract, NULL);
+		else if (job->kind == READOUT_JOB_PASS)
+			sent = pass_payload(job->channel, job->next, slice_end, NULL);
+		else if (job->kind == READOUT_JOB_RATES)
+			sent = rate_payload(job->channel, job->next, slice_end, NULL);
+		else if (job->kind == READOUT_JOB_UNCERTAINTY)
+			sent = uncertainty_payload(job->channel, job->next, slice_end, NULL);
+		else if (job->kind == READOUT_JOB_SMOOTHED)
+			sent = smoothed_payload(job->next, slice_end, NULL);
+		else if (job->kind == READOUT_JOB_RESAMPLED)
+			sent = resampled_payload(job->next, slice_end, NULL);
+		// The region goes ahead of the first tile
+		else if (job->kind == READOUT_JOB_TILES)
+			sent = (job->next > job->start || readout_emit(&tile_region, sizeof(tile_region), NULL))
+				&& tile_payload(job->next, slice_end, NULL);
+		else if (job->kind == READOUT_JOB_PYRAMID)
+			sent = readout_emit(&pyramid_copy[job->next], (slice_end - job->next + 1) * sizeof(uint32_t), NULL);
+		else if (job->kind == READOUT_JOB_VISITS)
+			sent = readout_emit(&pass_visits[job->next], (slice_end - job->next + 1) * sizeof(uint16_t), NULL);
+		else if (job->kind == READOUT_JOB_FLASH_LOG)
+			sent = readout_emit(flash_log_header(job->next), (slice_end - job->next + 1) * IFLASH_PAGE_SIZE, NULL);
+#if COUNTER_FRAME_STORE
+		else if (job->kind == READOUT_JOB_FRAME)
+			sent = readout_emit(&FRAME_STORE_BIN(job->next), (slice_end - job->next + 1) * sizeof(count_t), NULL);
+#endif
+		else if (job->kind == READOUT_JOB_RLE)
+			sent = rle_columns(&job->rle, job->channel, job->next, slice_end, NULL)
+				&& (slice_end < job->end || rle_finish(&job->rle, NULL));
+		// The row width goes ahead of the first slice
+		else if (job->kind == READOUT_JOB_PREDICTED)
+			sent = (job->next > job->start || readout_emit(&job->columns, sizeof(job->columns), NULL))
+				&& predicted_columns(&job->rice, job->channel, job->start, job->columns, job->next, slice_end, NULL)
+				&& (slice_end < job->end || rice_finish(&job->rice, NULL));
+		else if (job->kind == READOUT_JOB_CONTAINER)
+		{
+			// One block per slice, checksummed as it goes out
+			uint32_t crc = 0;
+			readout_crc32 = &crc;
+			sent = readout_payload(job->mask, job->next, slice_end, job->interleave, NULL);
+			readout_crc32 = NULL;
+			sent = sent && write_binary(&crc, sizeof(crc));
+		}
+		else if (job->kind == READOUT_JOB_STRIPED)
+			sent = stripe_send(job, slice_end);
+		else if (job->interleave)
+			sent = readout_payload(job->mask, job->next, slice_end, true, NULL);
+		else
+			sent = readout_payload(1u << job->channel, job->next, slice_end, false, NULL);
+
+		// The interface went away, drop the readout without the final "ok"
+		if (!sent)
+		{
+			readout_lz4_open = false;
+			job->kind = READOUT_JOB_NONE;
+			return;
+		}
+	}
+
+	job->next = slice_end + 1;
+	if (job->next <= job->end)
+		return;
+
+	// A wrapped range goes on from cell 0
+	if (!last_part)
+	{
+		job->end = job->wrap_end;
+		job->next = 0;
+		return;
+	}
+
+	// Planar readouts send each channel's range in turn
+	// (container blocks already hold every channel)
+	uint16_t rest = job->mask & ~((2u << job->channel) - 1);
+	if (!job->interleave && rest && job->kind != READOUT_JOB_CONTAINER)
+	{
+		job->channel = __builtin_ctz(rest);
+		if (job->wrap_end >= 0)
+			job->end = cell_count - 1;
+		job->next = job->start;
+		return;
+	}
+
+	if (job->kind == READOUT_JOB_DECIMATED && ++job->roi < job->rois)
+	{
+		job->start = job->roi_start[job->roi];
+		job->end = job->roi_end[job->roi];
+		job->next = job->start;
+		return;
+	}
+
+	// Flash log records one after another, oldest first
+	if (job->kind == READOUT_JOB_FLASH_LOG)
+	{
+		uint32_t page = flash_log_next(job->start);
+		if (page != FLASH_LOG_NONE)
+		{
+			job->start = page;
+			job->end = page + flash_log_record_pages(flash_log_header(page)) - 1;
+			job->next = job->start;
+			return;
+		}
+	}
+
+	if (job->kind == READOUT_JOB_DIRTY)
+	{
+		if (dirty_next_region(job->end + 1, &job->start, &job->end))
+		{
+			job->next = job->start;
+			return;
+		}
+
+		// Everything has been sent, so nothing is dirty any more
+		memset((void *)dirty_readout, 0, sizeof(dirty_readout));
+	}
+
+	if (readout_lz4_open)
+	{
+		readout_lz4_open = false;
+		if (!lz4_finish(readout_lz4))
+		{
+			job->kind = READOUT_JOB_NONE;
+			return;
+		}
+	}
+
+	if (job->kind != READOUT_JOB_TEXT)
+	{
+		if (job->framed)
+			reply_frame_begin(job->opcode, job->sequence);
+		reply_str("ok\n");
+		if (job->framed)
+			reply_frame_end(0);
+	}
+
+	job->kind = READOUT_JOB_NONE;
+}
+
+// Readout scheduling, set by M1063.  Each main loop pass sends at least
+// readout_min_slices slices of a readout job, which sets the least
+// bandwidth it gets however busy the step interrupt keeps the CPU, then
+// more while the pass has spent under readout_budget_us.  The budget,
+// measured with the DWT cycle counter, bounds how long the polls the
+// rest of the loop makes (deferred columns, captures, commands that may
+// overlap) wait behind a readout.  The step interrupt preempts all of
+// it, so USB work never delays a step.
+#define READOUT_BUDGET_US 500
+
+static uint32_t readout_budget_us = READOUT_BUDGET_US;
+static uint8_t readout_min_slices = 1;
+
+// Scheduling totals since M1063 last set the budget
+static uint32_t readout_passes;
+static uint32_t readout_slices;
+static uint32_t readout_overruns;      // Passes that went past the budget
+static uint32_t readout_pass_max;      // Longest pass, in cycles
+
+static void readout_schedule(void)
+{
+	uint32_t budget = readout_budget_us * (sysclk_get_cpu_hz() / 1000000);
+	uint32_t start = profile_cycles(), elapsed;
+	uint32_t slices = 0;
+	do
+	{
+		int32_t next = readout_job.next;
+		uint8_t channel = readout_job.channel;
+		readout_job_step();
+		elapsed = profile_cycles() - start;
+
+		// A text job waiting for reply space makes no progress
+		if (next == readout_job.next && channel == readout_job.channel)
+			break;
+		slices++;
+	}
+	while (readout_job.kind != READOUT_JOB_NONE && (slices < readout_min_slices || elapsed < budget));
+
+	readout_passes++;
+	readout_slices += slices;
+	if (elapsed > budget)
+		readout_overruns++;
+	readout_pass_max = Max(readout_pass_max, elapsed);
+}
+
+// Parse and validate the "<channel> <start> <end>" arguments shared by the readout commands
+static bool parse_readout_args(const int32_t *argv, uint8_t argc, int32_t *channel, int32_t *start, int32_t *end)
+{
+	if (argc < 3)
+	{
+		reply_str("error: read command requires three arguments\n");
+		return false;
+	}
+
+	*channel = argv[0];
+	*start = argv[1];
+	*end = argv[2];
+
+	if (*channel < 0 || *channel >= channel_count)
+	{
+		reply_str("error: invalid counter\n");
+		return false;
+	}
+
+	return validate_column_range(*start, *end);
+}
+
+// As parse_readout_args, also taking a range that wraps (see
+// validate_wrapped_range)
+static bool parse_wrapped_readout_args(const int32_t *argv, uint8_t argc, int32_t *channel, int32_t *start,
+	int32_t *end)
+{
+	if (argc < 3 || argv[1] <= argv[2])
+		return parse_readout_args(argv, argc, channel, start, end);
+
+	// Checked the other way round, which puts the ends back as given
+	const int32_t swapped[] = { argv[0], argv[2], argv[1] };
+	return parse_readout_args(swapped, 3, channel, end, start);
+}
+
+#if !COUNTER_POSITION_QDEC
+// Step-edge capture for COUNT_MODE_CAPTURE.  TC0 channel 0 counts the
+// primary input on XC0 (TCLK0) and loads its free-running value into RA
+// on each rising edge of TIOA0 (PA0), which must be jumpered to the step
+// signal.  The TC0 PDC copies every capture from TC_RAB into one half of
+// capture_ring while the main loop folds the other half into the count
+// arena, so the step rate no longer depends on interrupt latency.
+// The tertiary channel is given up for it.
+#define CAPTURE_TC COUNTER_TC_BLOCK(CAPTURE_TC_NUMBER)
+#define CAPTURE_TC_CHANNEL COUNTER_TC_CHANNEL(CAPTURE_TC_NUMBER)
+#define CAPTURE_PDC PDC_TC0
+#define CAPTURE_HALF_ENTRIES 256
+
+static uint32_t capture_ring[2][CAPTURE_HALF_ENTRIES];
+// Half being filled first, and the entries of it already folded
+static uint8_t capture_half;
+static uint32_t capture_next;
+
+#if !COUNTER_SD_LOG
+// Direction capture (M1066).  Without it capture_poll moves the head by
+// the direction pin as it reads when polled.  With it the PIOA parallel
+// capture samples PA24-PA31 on every rising edge of PIODCCLK (PA23),
+// jumpered to the step signal like TIOA0, and the PIOA PDC stores a
+// byte per step into capture_dirs in step with capture_ring.  The
+// direction must also be jumpered to PIODC3 (PA27), which the HSMCI
+// takes on boards with the SD slot.  PIODCCLK only samples rising
+// edges, so with both step edges counted (M1065) the pin is polled as
+// before.
+#define CAPTURE_DIRS 1
+#define CAPTURE_DIR_PDC PDC_PIOA
+#define CAPTURE_DIR_CLOCK_PIN PIO_PA23
+#define CAPTURE_DIR_PIN PIO_PA27
+#define CAPTURE_DIR_BIT (1u << (27 - 24))
+
+static bool capture_dirs_enabled = false;
+static bool capture_dirs_active;
+static uint8_t capture_dirs[2][CAPTURE_HALF_ENTRIES];
+#else
+#define CAPTURE_DIRS 0
+#endif
+
+// Entries of a half of a ring the PDC has written, with write its RPR
+static __always_inline uint32_t capture_filled(const void *half, const void *write, uint32_t entry_bytes)
+{
+	const uint8_t *start = half, *at = write;
+	return at >= start && at < start + CAPTURE_HALF_ENTRIES * entry_bytes
+		? (at - start) / entry_bytes : CAPTURE_HALF_ENTRIES;
+}
+
+static void capture_start(void)
+{
+	uint32_t cmr = TC_CMR_TCCLKS_XC0 | (step_both_edges ? TC_CMR_LDRA_EDGE : TC_CMR_LDRA_RISING);
+#if COUNTER_BEAM_GATE
+	if (beam_gate)
+		cmr |= TC_CMR_BURST_XC2;
+#endif
+	tc_init(CAPTURE_TC, CAPTURE_TC_CHANNEL, cmr);
+	pio_configure(CAPTURE_PIO, PIO_TYPE_PIO_PERIPH_B, CAPTURE_PIN, 0);
+
+	CAPTURE_PDC->PERIPH_PTCR = PERIPH_PTCR_RXTDIS;
+	CAPTURE_PDC->PERIPH_RPR = (uint32_t)capture_ring[0];
+	CAPTURE_PDC->PERIPH_RCR = CAPTURE_HALF_ENTRIES;
+	CAPTURE_PDC->PERIPH_RNPR = (uint32_t)capture_ring[1];
+	CAPTURE_PDC->PERIPH_RNCR = CAPTURE_HALF_ENTRIES;
+	capture_half = 0;
+	capture_next = 0;
+
+#if CAPTURE_DIRS
+	// Both rings start on the same edge as long as the head is still
+	capture_dirs_active = capture_dirs_enabled && !step_both_edges;
+	pio_capture_disable(COUNTER_PIO);
+	CAPTURE_DIR_PDC->PERIPH_PTCR = PERIPH_PTCR_RXTDIS;
+	if (capture_dirs_active)
+	{
+		pio_configure(COUNTER_PIO, PIO_TYPE_PIO_INPUT, CAPTURE_DIR_CLOCK_PIN | CAPTURE_DIR_PIN, 0);
+		CAPTURE_DIR_PDC->PERIPH_RPR = (uint32_t)capture_dirs[0];
+		CAPTURE_DIR_PDC->PERIPH_RCR = CAPTURE_HALF_ENTRIES;
+		CAPTURE_DIR_PDC->PERIPH_RNPR = (uint32_t)capture_dirs[1];
+		CAPTURE_DIR_PDC->PERIPH_RNCR = CAPTURE_HALF_ENTRIES;
+		CAPTURE_DIR_PDC->PERIPH_PTCR = PERIPH_PTCR_RXTEN;
+		pio_capture_set_mode(COUNTER_PIO, PIO_PCMR_DSIZE_BYTE | PIO_PCMR_ALWYS);
+		pio_capture_enable(COUNTER_PIO);
+	}
+#endif
+
+	CAPTURE_PDC->PERIPH_PTCR = PERIPH_PTCR_RXTEN;
+	tc_start(CAPTURE_TC, CAPTURE_TC_CHANNEL);
+}
+
+static void capture_stop(void)
+{
+	CAPTURE_PDC->PERIPH_PTCR = PERIPH_PTCR_RXTDIS;
+#if CAPTURE_DIRS
+	if (capture_dirs_active)
+	{
+		pio_capture_disable(COUNTER_PIO);
+		CAPTURE_DIR_PDC->PERIPH_PTCR = PERIPH_PTCR_RXTDIS;
+		capture_dirs_active = false;
+	}
+#endif
+}
+#endif
+
+// (Re)configure the counter channels for the given count_mode.
+// Each channel counts pulses on its external clock input as before;
+// the latch mode additionally captures into RA and resets the channel
+// on the rising edge of TIOA, or on both with step_both_edges.  With
+// beam_gate the TC0 channels are gated by XC2 and the timer channel
+// counts BEAM_GATE_CLOCK.
+static void configure_counters(uint8_t mode)
+{
+	uint32_t cmr = 0;
+	if (mode == COUNT_MODE_LATCH && step_both_edges)
+		cmr = TC_CMR_LDRA_EDGE | TC_CMR_ABETRG | TC_CMR_ETRGEDG_EDGE;
+	else if (mode == COUNT_MODE_LATCH)
+		cmr = TC_CMR_LDRA_RISING | TC_CMR_ABETRG | TC_CMR_ETRGEDG_RISING;
+
+	for (uint8_t c = 0; c < COUNTER_CHANNELS; c++)
+	{
+		const counter_channel_t *counter = &counter_channels[c];
+		uint32_t latch_pin = counter->latch_pin;
+		if (counter->pio == PIOA)
+			latch_pin &= ~(COUNTER_SD_PINS | FRAME_STORE_PIOA_PINS);
+
+		uint32_t clock = counter->clock;
+#if COUNTER_BEAM_GATE
+		if (beam_gate)
+			clock = (c == BEAM_GATE_TIMER ? BEAM_GATE_CLOCK : clock) | TC_CMR_BURST_XC2;
+#endif
+		if (counter_chained && c == 0)
+		{
+			// Waveform mode, for TIOA1 to clock the high half
+			tc_init(counter->tc, counter->channel, clock | TC_CMR_WAVE | TC_CMR_WAVSEL_UP
+				| TC_CMR_ACPA_SET | TC_CMR_ACPC_CLEAR | TC_CMR_ASWTRG_CLEAR);
+			tc_write_ra(counter->tc, counter->channel, 0x8000);
+			tc_write_rc(counter->tc, counter->channel, 0);
+		}
+		else
+			tc_init(counter->tc, counter->channel, clock | cmr);
+
+		// The PIO edge interrupt on the step pin keeps working while
+		// the pin is assigned to the TC peripheral
+		if (mode == COUNT_MODE_LATCH)
+			pio_configure(counter->pio, PIO_TYPE_PIO_PERIPH_B, latch_pin, 0);
+		else
+			pio_configure(counter->pio, PIO_TYPE_PIO_INPUT, latch_pin, PIO_DEGLITCH);
+
+		counter_regs[c] = &counter->tc->TC_CHANNEL[counter->channel];
+		if (c < COUNTER_WIDE_CHANNELS && mode != COUNT_MODE_CAPTURE && !(counter_chained && c != 1))
+			tc_enable_interrupt(counter->tc, counter->channel, TC_IER_COVFS);
+		else if (c < COUNTER_WIDE_CHANNELS)
+			tc_disable_interrupt(counter->tc, counter->channel, TC_IDR_COVFS);
+		tc_start(counter->tc, counter->channel);
+	}
+
+	tc_set_block_mode(COUNTER_TC, counter_chained ? TC_BMR_TC2XC2S_TIOA1 : TC_BMR_TC2XC2S_TCLK2);
+	count_mode = mode;
+	channel_map();
+	for (uint8_t c = 0; c < COUNTER_WIDE_CHANNELS; c++)
+	{
+		NVIC_SetPriority((IRQn_Type)counter_channels[c].id, COUNTER_IRQ_PRIORITY);
+		NVIC_EnableIRQ((IRQn_Type)counter_channels[c].id);
+	}
+
+#if !COUNTER_POSITION_QDEC
+	if (mode == COUNT_MODE_CAPTURE)
+		capture_start();
+	else
+		capture_stop();
+#endif
+}
+
+#if COUNTER_POSITION_QDEC
+// Column holding the current decoder position, before wrapping
+static int32_t qdec_column;
+
+// Sets RC to the first count outside qdec_column in the current
+// direction of travel, so that the next compare marks the boundary.
+static __always_inline void qdec_arm(void)
+{
+	if (QDEC_TC->TC_QISR & TC_QISR_DIR)
+		QDEC_TC->TC_CHANNEL[QDEC_TC_CHANNEL].TC_RC = qdec_column * (1 << QDEC_COLUMN_SHIFT) - 1;
+	else
+		QDEC_TC->TC_CHANNEL[QDEC_TC_CHANNEL].TC_RC = (qdec_column + 1) * (1 << QDEC_COLUMN_SHIFT);
+}
+
+// Woken by an RC compare at a column boundary or by a change of direction
+COUNTER_ISR void COUNTER_TC_HANDLER(QDEC_TC_NUMBER)(void)
+{
+	// Reading both status registers acknowledges the interrupts
+	(void)QDEC_TC->TC_CHANNEL[QDEC_TC_CHANNEL].TC_SR;
+	(void)QDEC_TC->TC_QISR;
+
+	// Moving on while RC is being rewritten would step over the
+	// new compare value, so loop until the position is stable
+	for (;;)
+	{
+		int32_t column = (int32_t)QDEC_TC->TC_CHANNEL[QDEC_TC_CHANNEL].TC_CV >> QDEC_COLUMN_SHIFT;
+		if (column != qdec_column)
+		{
+#if COUNTER_SYNC
+			if (sync_mode != SYNC_MODE_PULSE)
+#endif
+				commit_column();
+			row_seal_step(column > qdec_column ? 1 : -1);
+
+			qdec_column = column;
+			// Counts encoder columns rather than steps beyond the limits
+			column += head_origin;
+			if (unlikely((uint32_t)column >= travel_columns))
+			{
+				column = head_outside(column);
+				limit_steps += (uint32_t)column >= travel_columns;
+			}
+			head_position = column;
+			if (unlikely(stop_kind))
+				stop_check();
+		}
+
+		qdec_arm();
+
+		if ((int32_t)QDEC_TC->TC_CHANNEL[QDEC_TC_CHANNEL].TC_CV >> QDEC_COLUMN_SHIFT == qdec_column)
+			break;
+	}
+}
+
+static void qdec_zero(void)
+{
+	irqflags_t flags = cpu_irq_save();
+	tc_start(QDEC_TC, QDEC_TC_CHANNEL);
+	qdec_column = 0;
+	head_position = head_origin;
+	qdec_arm();
+	cpu_irq_restore(flags);
+}
+
+static void qdec_init(void)
+{
+	pmc_enable_periph_clk(QDEC_TC_CHANNEL_ID);
+	pmc_enable_periph_clk(QDEC_PIO_ID);
+	pio_configure(QDEC_PIO, PIO_TYPE_PIO_PERIPH_B, QDEC_PINS, 0);
+
+	tc_init(QDEC_TC, QDEC_TC_CHANNEL, TC_CMR_TCCLKS_XC0 | TC_CMR_ETRGEDG_RISING | TC_CMR_ABETRG);
+	tc_set_block_mode(QDEC_TC, TC_BMR_QDEN | TC_BMR_POSEN | TC_BMR_FILTER | TC_BMR_MAXFILT(1));
+	qdec_zero();
+
+	tc_enable_interrupt(QDEC_TC, QDEC_TC_CHANNEL, TC_IER_CPCS);
+	tc_enable_qdec_interrupt(QDEC_TC, TC_QIER_DIRCHG);
+	NVIC_SetPriority(QDEC_TC_IRQn, COUNTER_IRQ_PRIORITY);
+	NVIC_EnableIRQ(QDEC_TC_IRQn);
+}
+#endif
+
+#if COUNTER_FAST_STEP_ISR
+// Copy of the vector table in SRAM, allowing the PIOA entry to point
+// straight at Step_Handler while every other vector is unchanged.
+// VTOR requires alignment to the table size rounded up to a power of two.
+#define VECTOR_TABLE_ENTRIES (16 + PERIPH_COUNT_IRQn)
+COMPILER_ALIGNED(256) static void *ram_vectors[VECTOR_TABLE_ENTRIES];
+
+static void step_handler_select(uint8_t mode);
+
+// The PIOA inputs beside the head step, as X(pin, handler).  Each
+// handler takes the pins sampled on entry to the interrupt.  The step
+// handlers read PIO_ISR once and step_handler_other calls the handler
+// of each line set in it from pioa_inputs, so an input added here costs
+// the edges that do not come from it nothing, and takes no source of
+// the ASF table.
+#if COUNTER_POSITION_QDEC
+#define PIOA_INPUT_HOME(X)
+#else
+#define PIOA_INPUT_HOME(X) X(HOME_PIN, input_home)
+#endif
+#if COUNTER_SYNC
+#define PIOA_INPUT_SYNC(X) X(SYNC_IN_PIN, input_sync)
+#else
+#define PIOA_INPUT_SYNC(X)
+#endif
+#define PIOA_INPUTS(X) \
+	X(START_PIN, input_start) \
+	PIOA_INPUT_HOME(X) \
+	X(ROW_STEP_PIN, row_edge) \
+	PIOA_INPUT_SYNC(X)
+
+#define PIOA_INPUT_LINE(pin) __builtin_ctz(pin)
+#define PIOA_INPUT_MASK(pin, handler) | (pin)
+#define PIOA_INPUT_PINS (0 PIOA_INPUTS(PIOA_INPUT_MASK))
+#define PIOA_INPUT_ENTRY(pin, handler) [PIOA_INPUT_LINE(pin)] = handler,
+#define PIOA_INPUT_CHECK(pin, handler) \
+	_Static_assert((pin) && !((pin) & ((pin) - 1)), #pin " is not a single PIOA line"); \
+	_Static_assert(!((pin) & COUNTER_STEP_PIN), #pin " is the head step");
+
+typedef void (*pioa_input_t)(uint32_t pins);
+
+COUNTER_ISR static __attribute__((noinline)) void input_start(uint32_t pins)
+{
+	Trigger_Start(COUNTER_PIO_ID, START_PIN);
+}
+
+#if !COUNTER_POSITION_QDEC
+COUNTER_ISR static __attribute__((noinline)) void input_home(uint32_t pins)
+{
+	Trigger_Home(COUNTER_PIO_ID, HOME_PIN);
+}
+#endif
+
+#if COUNTER_SYNC
+COUNTER_ISR static __attribute__((noinline)) void input_sync(uint32_t pins)
+{
+	Trigger_Sync(COUNTER_PIO_ID, SYNC_IN_PIN);
+}
+#endif
+
+PIOA_INPUTS(PIOA_INPUT_CHECK)
+
+// Indexed by PIOA line.  In SRAM, with the handlers, so the dispatch
+// reads no flash.
+static pioa_input_t pioa_inputs[32] =
+{
+	PIOA_INPUTS(PIOA_INPUT_ENTRY)
+};
+
+// The edges of the other inputs, which the specialised handlers leave
+// out of line, lowest line first
+COUNTER_ISR static __attribute__((noinline)) void step_handler_other(uint32_t status, uint32_t pins)
+{
+	status &= PIOA_INPUT_PINS;
+	while (status)
+	{
+		uint32_t line = __builtin_ctz(status);
+		status &= status - 1;
+		pioa_inputs[line](pins);
+	}
+}
+
+#if !COUNTER_POSITION_QDEC
+// Step_Handler specialised for each count mode that commits from the
+// step interrupt, so the installed one carries no test of count_mode
+// and only its own TC reads.  set_count_mode installs the one for the
+// new mode; capture mode takes no step interrupts and keeps the generic
+// handler.
+static __always_inline void step_handler_mode(uint8_t mode)
+{
+	uint32_t pins = COUNTER_PIO->PIO_PDSR;
+	uint32_t status = COUNTER_PIO->PIO_ISR;
+	if (status & COUNTER_STEP_PIN)
+		step_edge_mode(pins, mode);
+	if (unlikely(status & ~COUNTER_STEP_PIN))
+		step_handler_other(status, pins);
+}
+
+COUNTER_ISR static void Step_Handler_Reset(void)
+{
+	step_handler_mode(COUNT_MODE_RESET);
+}
+
+COUNTER_ISR static void Step_Handler_Latch(void)
+{
+	step_handler_mode(COUNT_MODE_LATCH);
+}
+
+COUNTER_ISR static void Step_Handler_Delta(void)
+{
+	step_handler_mode(COUNT_MODE_DELTA);
+}
+
+#if COUNTER_SYNC
+COUNTER_ISR static void Step_Handler_Track(void)
+{
+	step_handler_mode(STEP_MODE_TRACK);
+}
+#endif
+
+// Installed by M1084 1.  The edge moves the head as before counting, so
+// the counts from it on go to the column it brought the head to.
+COUNTER_ISR static void Step_Handler_Armed(void)
+{
+	uint32_t pins = COUNTER_PIO->PIO_PDSR;
+	uint32_t status = COUNTER_PIO->PIO_ISR;
+	if (status & COUNTER_STEP_PIN)
+	{
+		step_edge(pins);
+		if (start_armed == START_ARMED_STEP)
+		{
+			count_start();
+			step_handler_select(count_mode);
+		}
+	}
+	if (unlikely(status & ~COUNTER_STEP_PIN))
+		step_handler_other(status, pins);
+}
+#endif
+
+COUNTER_ISR static void Step_Handler(void)
+{
+	// The direction pins are sampled before anything else, in the same
+	// read for both axes, so that a reversal set up just ahead of the
+	// edge is seen however long the rest of the entry takes
+	uint32_t pins = COUNTER_PIO->PIO_PDSR;
+
+	// Reading PIO_ISR acknowledges the edges.  The step pin and
+	// PIOA_INPUTS are the only PIOA sources, so no source table is walked.
+	uint32_t status = COUNTER_PIO->PIO_ISR;
+#if !COUNTER_POSITION_QDEC
+	if (status & COUNTER_STEP_PIN)
+		step_edge(pins);
+#endif
+	step_handler_other(status, pins);
+}
+
+// Points the PIOA vector at the step handler for mode.  A single word
+// store, so an edge arriving meanwhile takes one handler or the other.
+static void step_handler_select(uint8_t mode)
+{
+	void *handler = (void *)Step_Handler;
+#if !COUNTER_POSITION_QDEC
+	if (mode == COUNT_MODE_RESET)
+		handler = (void *)Step_Handler_Reset;
+	else if (mode == COUNT_MODE_LATCH)
+		handler = (void *)Step_Handler_Latch;
+	else if (mode == COUNT_MODE_DELTA)
+		handler = (void *)Step_Handler_Delta;
+#if COUNTER_SYNC
+	// Beam pulses commit the columns, so the steps only move the head
+	if (sync_mode == SYNC_MODE_PULSE && mode != COUNT_MODE_CAPTURE)
+		handler = (void *)Step_Handler_Track;
+#endif
+	if (start_armed == START_ARMED_STEP)
+		handler = (void *)Step_Handler_Armed;
+#endif
+	ram_vectors[16 + PIOA_IRQn] = handler;
+	__DSB();
+}
+
+static void install_step_handler(void)
+{
+	const void *const *flash_vectors = (const void *const *)(SCB->VTOR & SCB_VTOR_TBLOFF_Msk);
+	for (uint32_t i = 0; i < VECTOR_TABLE_ENTRIES; i++)
+		ram_vectors[i] = (void *)flash_vectors[i];
+
+	step_handler_select(count_mode);
+
+	irqflags_t flags = cpu_irq_save();
+	SCB->VTOR = (uint32_t)ram_vectors & SCB_VTOR_TBLOFF_Msk;
+	__DSB();
+	cpu_irq_restore(flags);
+}
+#endif
+
+static void zero_position(void)
+{
+#if COUNTER_POSITION_QDEC
+	qdec_zero();
+#endif
+	irqflags_t flags = cpu_irq_save();
+#if !COUNTER_POSITION_QDEC
+	head_position = head_origin;
+	bin_phase = 0;
+#endif
+	head_row_select(0);
+	cpu_irq_restore(flags);
+}
+
+// Time-based acquisition (M1032): TC1 channel 1 runs in waveform mode
+// and commits a column on every RC compare instead of on step edges.
+// The column advances with each period and wraps at column_count, so
+// the buffer holds a time series that the usual readouts return.
+// Row steps still select the row.
+#define TIMED_TC COUNTER_TC_BLOCK(TIMED_TC_NUMBER)
+#define TIMED_TC_CHANNEL COUNTER_TC_CHANNEL(TIMED_TC_NUMBER)
+#define TIMED_TC_CHANNEL_ID COUNTER_TC_ID(TIMED_TC_NUMBER)
+#define TIMED_TC_IRQn COUNTER_TC_IRQn(TIMED_TC_NUMBER)
+#define TIMED_MAX_HZ 100000
+
+static bool timed_active = false;
+
+// Statistical early stop (M1130).  Each point of time-based acquisition
+// ends once the primary channel has counted early_target, for a relative
+// uncertainty of 1/sqrt(early_target), or when the period runs out
+// first.  RC of the primary's counter is set early_target counts on from
+// where the point started, and its compare raises the overflow interrupt
+// of the wide channel, which commits the point and restarts the period,
+// so nothing is polled.  RC matches once every 65536 counts, so a target
+// past 16 bits ends the point at the compare that makes it up.  A commit
+// reads TC_SR and may drop a compare of the point just ended, which the
+// new one no longer wants.
+static volatile uint16_t early_compares;     // Still to come in this point
+static volatile uint32_t early_points;       // Ended by the target
+static volatile uint32_t early_timeouts;     // Ended by the period
+
+// Sets RC for the point that starts now.  Reset mode counts it from 0,
+// delta mode from the last snapshot.
+COUNTER_ISR static __attribute__((noinline)) void early_arm(void)
+{
+	uint16_t base = count_mode == COUNT_MODE_DELTA ? count_snapshot[0] : 0;
+	counter_regs[early_counter]->TC_RC = (uint16_t)(base + early_target);
+	early_compares = (early_target + 0xFFFF) >> 16;
+}
+
+COUNTER_ISR static __attribute__((noinline)) void early_compare(void)
+{
+	if (!enable_count || --early_compares)
+		return;
+
+	commit_next_column();
+	early_arm();
+	early_points++;
+
+	// The next point gets the whole period, and a compare of the period
+	// timer that came meanwhile is dropped rather than ending it empty
+	TIMED_TC->TC_CHANNEL[TIMED_TC_CHANNEL].TC_CCR = TC_CCR_SWTRG;
+	(void)TIMED_TC->TC_CHANNEL[TIMED_TC_CHANNEL].TC_SR;
+	NVIC_ClearPendingIRQ(TIMED_TC_IRQn);
+}
+
+static void early_off(void)
+{
+	if (!early_target)
+		return;
+
+	const counter_channel_t *counter = &counter_channels[early_counter];
+	tc_disable_interrupt(counter->tc, counter->channel, TC_IDR_CPCS);
+	early_target = 0;
+}
+
+// Enables the compare on the primary's counter, after channel_map or
+// M1130.  A primary outside the wide channels has no interrupt to
+// take it, and a latched or chained count no free-running counter, so
+// early stop turns off instead.
+static void early_configure(void)
+{
+	uint32_t target = early_target;
+	early_off();
+	uint8_t counter = __builtin_ctz(channel_mask);
+	if (counter >= COUNTER_WIDE_CHANNELS || counter_chained
+		|| (count_mode != COUNT_MODE_RESET && count_mode != COUNT_MODE_DELTA))
+		return;
+
+	early_counter = counter;
+	irqflags_t flags = cpu_irq_save();
+	early_target = target;
+	early_arm();
+	(void)counter_regs[counter]->TC_SR;
+	tc_enable_interrupt(counter_channels[counter].tc, counter_channels[counter].channel, TC_IER_CPCS);
+	cpu_irq_restore(flags);
+}
+
+COUNTER_ISR void COUNTER_TC_HANDLER(TIMED_TC_NUMBER)(void)
+{
+	// Reading TC_SR acknowledges the compare
+	(void)TIMED_TC->TC_CHANNEL[TIMED_TC_CHANNEL].TC_SR;
+
+	commit_next_column();
+	if (early_target)
+	{
+		early_arm();
+		if (enable_count)
+			early_timeouts++;
+	}
+}
+
+#if !COUNTER_POSITION_QDEC
+// The step check in step interrupts taken, as TCLK6 counts rising
+// edges only
+static uint16_t step_check_count(void)
+{
+	uint16_t edges = (uint16_t)STEP_CHECK_TC->TC_CHANNEL[STEP_CHECK_TC_CHANNEL].TC_CV;
+	return step_both_edges ? 2 * edges : edges;
+}
+#endif
+
+// Stop or start following the head axis
+static void head_tracking(bool enable)
+{
+#if COUNTER_POSITION_QDEC
+	if (enable)
+		NVIC_EnableIRQ(QDEC_TC_IRQn);
+	else
+		NVIC_DisableIRQ(QDEC_TC_IRQn);
+#else
+	if (enable)
+	{
+		// Steps taken meanwhile are not missed steps
+		steps_serviced = step_check_count();
+		pio_enable_interrupt(COUNTER_PIO, COUNTER_STEP_PIN);
+	}
+	else
+		pio_disable_interrupt(COUNTER_PIO, COUNTER_STEP_PIN);
+#endif
+}
+
+static void timed_stop(void)
+{
+	if (!timed_active)
+		return;
+
+	early_off();
+	tc_stop(TIMED_TC, TIMED_TC_CHANNEL);
+	tc_disable_interrupt(TIMED_TC, TIMED_TC_CHANNEL, TC_IER_CPCS);
+	NVIC_DisableIRQ(TIMED_TC_IRQn);
+	NVIC_ClearPendingIRQ(TIMED_TC_IRQn);
+	timed_active = false;
+
+	// The time series position has no relation to the head
+	head_tracking(true);
+	zero_position();
+}
+
+// Commits a column every ticks of TIMER_CLOCK1
+static void timed_start_ticks(uint32_t ticks)
+{
+	timed_stop();
+	head_tracking(false);
+	zero_position();
+
+	pmc_enable_periph_clk(TIMED_TC_CHANNEL_ID);
+	tc_init(TIMED_TC, TIMED_TC_CHANNEL, TC_CMR_TCCLKS_TIMER_CLOCK1 | TC_CMR_WAVE | TC_CMR_WAVSEL_UP_RC);
+	tc_write_rc(TIMED_TC, TIMED_TC_CHANNEL, ticks);
+	tc_enable_interrupt(TIMED_TC, TIMED_TC_CHANNEL, TC_IER_CPCS);
+	NVIC_SetPriority(TIMED_TC_IRQn, COUNTER_IRQ_PRIORITY);
+	NVIC_EnableIRQ(TIMED_TC_IRQn);
+	timed_active = true;
+	tc_start(TIMED_TC, TIMED_TC_CHANNEL);
+}
+
+static void timed_start(uint32_t hz)
+{
+	// TIMER_CLOCK1 is MCK/2 and RC is 32 bits wide, so every
+	// rate down to 1 Hz fits without a prescaler search
+	timed_start_ticks(sysclk_get_peripheral_hz() / 2 / hz);
+}
+
+// Discriminator thresholds (M1091) from the DACC, DAC0 (PB13) for
+// channel 0 and DAC1 (PB14) for channel 1.  The SAM4E has no third
+// DAC output, so channel 2 keeps its external setting.  Codes are 12
+// bits over 1/6 to 5/6 of ADVREF, written with the channel in the tag
+// bits so one register serves both outputs.
+#define THRESHOLD_CHANNELS 2
+#define THRESHOLD_MAX 4095
+
+static bool threshold_enabled;
+static uint16_t thresholds[THRESHOLD_CHANNELS];
+
+static void threshold_write(uint8_t dac, uint16_t code)
+{
+	while (!(DACC->DACC_ISR & DACC_ISR_TXRDY))
+		;
+	DACC->DACC_CDR = ((uint32_t)dac << 12) | code;
+}
+
+static void threshold_set(uint8_t dac, uint16_t code)
+{
+	if (!threshold_enabled)
+	{
+		// MCK/4 stays within the DAC clock at every MCK, and refreshing
+		// every 1024 DAC clocks holds the outputs
+		pmc_enable_periph_clk(ID_DACC);
+		DACC->DACC_CR = DACC_CR_SWRST;
+		DACC->DACC_MR = DACC_MR_TAG_EN | DACC_MR_CLKDIV_DIV_4 | DACC_MR_STARTUP_512 | DACC_MR_REFRESH(1);
+		DACC->DACC_CHER = DACC_CHER_CH0 | DACC_CHER_CH1;
+		threshold_enabled = true;
+	}
+
+	thresholds[dac] = code;
+	threshold_write(dac, code);
+}
+
+// Threshold sweep (M1092): time-based acquisition with a window per DAC
+// step, each commit moving the DAC on to the next code for the window
+// that follows and keeping the counts in sweep_counts instead of the
+// buffer's columns.  Once the last window has been committed, counting
+// stops and sweep_poll sends the S-curve as a sweep_push_t and the
+// counts of every step, then sets the threshold back.
+#define SWEEP_MAX_STEPS 512
+#define SWEEP_MIN_WINDOW_US (1000000 / TIMED_MAX_HZ)
+#define SWEEP_MAX_WINDOW_US 30000000
+#define SWEEP_MAGIC 0x5AAB
+
+typedef struct
+{
+	uint16_t magic;
+	uint8_t dac;
+	uint8_t channels;   // Counts per step, for the channels in use
+	uint16_t first;     // DAC codes of the first step and between steps
+	uint16_t step;
+	uint16_t steps;
+	uint16_t crc;       // CRC-16/CCITT of the counts that follow
+	uint32_t window_us;
+} sweep_push_t;
+
+// steps * channels counts, step by step, in the SRAM pool
+static uint32_t *sweep_counts;
+static sweep_push_t sweep_header;
+static volatile uint16_t sweep_index;
+static volatile bool sweep_done;
+
+// Keeps the counts of the window just committed and moves the DAC on.
+// Kept out of line, off the usual step path.
+COUNTER_ISR static __attribute__((noinline)) void sweep_column(const uint32_t *counts, uint8_t channels)
+{
+	uint32_t index = sweep_index;
+	for (uint8_t c = 0; c < channels; c++)
+		sweep_counts[index * channels + c] = counts[c];
+
+	if (++index == sweep_header.steps)
+	{
+		enable_count = false;
+		count_stopped_us = time_us();
+		sweep_active = false;
+		sweep_done = true;
+		return;
+	}
+
+	sweep_index = index;
+	threshold_write(sweep_header.dac, sweep_header.first + index * sweep_header.step);
+}
+
+static void sweep_poll(void)
+{
+	// M1004 or a stop condition ends the sweep early, with the steps done
+	irqflags_t flags = cpu_irq_save();
+	if (sweep_active && !enable_count)
+	{
+		sweep_active = false;
+		sweep_header.steps = sweep_index;
+		sweep_done = true;
+	}
+	cpu_irq_restore(flags);
+
+	if (!sweep_done)
+		return;
+
+	sweep_done = false;
+	timed_stop();
+	threshold_set(sweep_header.dac, thresholds[sweep_header.dac]);
+
+	uint32_t length = (uint32_t)sweep_header.steps * sweep_header.channels * sizeof(uint32_t);
+	sweep_header.magic = SWEEP_MAGIC;
+	sweep_header.crc = crc16_update(0xFFFF, (const uint8_t *)sweep_counts, length);
+	push_time(SWEEP_MAGIC);
+	if (write_binary(&sweep_header, sizeof(sweep_header)))
+		write_binary(sweep_counts, length);
+}
+
+// M1091 reports the thresholds of channels 0 and 1 as DAC codes;
+// M1091 <channel> <code> sets one (0 to 4095).
+static void command_m1091(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_str("ok\n");
+		reply_u32(thresholds[0]);
+		reply_char(' ');
+		reply_u32(thresholds[1]);
+		reply_char('\n');
+		return;
+	}
+
+	if (argc < 2 || argv[0] < 0 || argv[0] >= THRESHOLD_CHANNELS || argv[1] < 0 || argv[1] > THRESHOLD_MAX)
+	{
+		reply_str("error: threshold command requires a channel of 0 or 1 and a code of 0 to 4095\n");
+		return;
+	}
+
+	if (sweep_active)
+	{
+		reply_str("error: a threshold sweep is running\n");
+		return;
+	}
+
+	threshold_set(argv[0], argv[1]);
+	reply_str("ok\n");
+}
+
+// M1092 reports the sweep as "<running> <step> <steps>".  M1092
+// <channel> <first> <last> <step> <window us> steps the threshold of
+// the channel from code <first> to <last>, counting every channel in
+// use for <window us> at each code, as time-based acquisition would
+// (which it replaces until the sweep is done).  The counts follow as
+// one binary reply, then the threshold goes back to its M1091 setting.
+static void command_m1092(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_str("ok\n");
+		reply_u32(sweep_active);
+		reply_char(' ');
+		reply_u32(sweep_index);
+		reply_char(' ');
+		reply_u32(sweep_header.steps);
+		reply_char('\n');
+		return;
+	}
+
+	int32_t dac = argv[0], first = argv[1], last = argv[2], step = argv[3], window = argv[4];
+	if (argc < 5 || dac < 0 || dac >= THRESHOLD_CHANNELS || first < 0 || last > THRESHOLD_MAX || last < first
+		|| step < 1 || (last - first) / step >= SWEEP_MAX_STEPS)
+	{
+		reply_str("error: invalid threshold sweep\n");
+		return;
+	}
+
+	if (window < SWEEP_MIN_WINDOW_US || window > SWEEP_MAX_WINDOW_US)
+	{
+		reply_str("error: window out of range\n");
+		return;
+	}
+
+	if (enable_count || start_armed != START_ARMED_NONE || sweep_active || sweep_done)
+	{
+		reply_str("error: counter is active\n");
+		return;
+	}
+
+	if (timed_active)
+	{
+		reply_str("error: timed acquisition is active\n");
+		return;
+	}
+
+	if (COUNTER_USES_TC(TIMED_TC_CHANNEL_ID))
+	{
+		reply_str("error: timer is used by a counter channel\n");
+		return;
+	}
+
+	// The counts are read on the window's compare, not captured by a step edge
+	if (count_mode != COUNT_MODE_RESET && count_mode != COUNT_MODE_DELTA)
+	{
+		reply_str("error: sweeps need reset or delta mode\n");
+		return;
+	}
+
+#if COUNTER_SYNC
+	if (sync_mode == SYNC_MODE_SLAVE)
+	{
+		reply_str("error: columns follow the sync master\n");
+		return;
+	}
+
+	if (sync_mode == SYNC_MODE_PULSE)
+	{
+		reply_str("error: columns follow the beam pulses\n");
+		return;
+	}
+#endif
+
+#if !COUNTER_POSITION_QDEC
+	if (home_mode != HOME_OFF)
+	{
+		reply_str("error: the home input moves the head\n");
+		return;
+	}
+#endif
+
+	if (!sweep_counts)
+		sweep_counts = pool_reserve(&sram_pool, "sweep", SWEEP_MAX_STEPS * COUNTER_CHANNELS * sizeof(uint32_t));
+	if (!sweep_counts)
+	{
+		reply_str("error: no SRAM for the sweep\n");
+		return;
+	}
+
+	sweep_header.dac = dac;
+	sweep_header.channels = channel_count;
+	sweep_header.first = first;
+	sweep_header.step = step;
+	sweep_header.steps = (last - first) / step + 1;
+	sweep_header.window_us = window;
+	sweep_index = 0;
+	threshold_set(dac, thresholds[dac]);
+	threshold_write(dac, first);
+
+	irqflags_t flags = cpu_irq_save();
+	timed_start_ticks((uint64_t)sysclk_get_peripheral_hz() / 2 * window / 1000000);
+	count_start();
+	sweep_active = true;
+	cpu_irq_restore(flags);
+	reply_str("ok\n");
+}
+
+#if !COUNTER_POSITION_QDEC
+// Folds the captures the PDC has stored since the last call, moving the
+// head one step per capture as Trigger_Step would.  Unless direction
+// capture is on, the direction is sampled once per call, so it should
+// only change while the head is still.  Captures taken while counting
+// is disabled only move the head.
+static void capture_poll(void)
+{
+	if (count_mode != COUNT_MODE_CAPTURE)
+		return;
+
+	// Once the PDC has moved on to the other half, all of this one is ready
+	const uint32_t *half = capture_ring[capture_half];
+	uint32_t ready = capture_filled(half, (const void *)CAPTURE_PDC->PERIPH_RPR, sizeof(uint32_t));
+#if CAPTURE_DIRS
+	// Steps are folded once both rings hold them
+	const uint8_t *dirs = capture_dirs[capture_half];
+	if (capture_dirs_active)
+		ready = Min(ready, capture_filled(dirs, (const void *)CAPTURE_DIR_PDC->PERIPH_RPR, sizeof(uint8_t)));
+#endif
+	if (capture_next == ready)
+		return;
+
+	int32_t head_step = (COUNTER_PIO->PIO_PDSR & COUNTER_DIR_PIN) ? 1 : -1;
+	int32_t phase = bin_phase;
+	uint32_t counts[1] = { 0 };
+	for (uint32_t i = capture_next; i < ready; i++)
+	{
+#if CAPTURE_DIRS
+		if (capture_dirs_active)
+			head_step = (dirs[i] & CAPTURE_DIR_BIT) ? 1 : -1;
+#endif
+		if (unlikely(backlash_shift) && head_step != backlash_direction)
+			backlash_turn(head_step);
+		bool bidirectional = head_step < 0 && step_bidirectional;
+		steps_serviced++;
+		steps_processed++;
+		phase += head_step;
+		bool leaving = phase < 0 || phase >= bin_factor;
+		if (leaving)
+			phase = phase < 0 ? bin_factor - 1 : 0;
+
+		// As in Trigger_Step, bidirectional reverse steps move before
+		// committing, which they do on arriving at phase 0
+		if (leaving && bidirectional)
+			head_move(-1);
+
+		if (bidirectional ? phase == 0 : leaving)
+		{
+			// The counter free-runs, so as in COUNT_MODE_DELTA the
+			// column holds the difference from the previous commit
+			uint16_t cv = (uint16_t)half[i];
+			counts[0] = cv - count_snapshot[0];
+			count_snapshot[0] = cv;
+			if (enable_count && head_column() < column_count)
+				store_column(counts, 1);
+		}
+
+		if (leaving && !bidirectional)
+			head_move(head_step);
+
+		if ((uint32_t)head_position >= travel_columns)
+			limit_steps++;
+	}
+	bin_phase = phase;
+	capture_next = ready;
+
+	// Hand the folded half back to the PDC behind the other one
+	if (ready == CAPTURE_HALF_ENTRIES)
+	{
+#if CAPTURE_DIRS
+		if (capture_dirs_active)
+		{
+			CAPTURE_DIR_PDC->PERIPH_RNPR = (uint32_t)dirs;
+			CAPTURE_DIR_PDC->PERIPH_RNCR = CAPTURE_HALF_ENTRIES;
+		}
+#endif
+		CAPTURE_PDC->PERIPH_RNPR = (uint32_t)half;
+		CAPTURE_PDC->PERIPH_RNCR = CAPTURE_HALF_ENTRIES;
+		capture_half ^= 1;
+		capture_next = 0;
+	}
+}
+#endif
+
+// Scan log (M1081, M1082).  While it is on, each time counting stops
+// the frame the readout commands see goes into the flash log (flash.h),
+// a record per row, so a unit scanning films with nobody connected keeps
+// them for a later M1082 dump.  Programming stalls the single flash
+// plane and every interrupt with it, so the log is only written while
+// counting is off: about a page per main loop pass, with M1003 and
+// anything that clears or swaps the bins finishing the frame first.
+// A record's payload is a flash_log_row_t and then each channel's
+// count_t bins of the row in turn.
+typedef struct
+{
+	uint32_t session;   // sof_count when M1081 turned the log on
+	uint32_t frame;     // Frames logged before this one in the session
+	uint32_t started;   // sof_count when counting started
+	uint32_t stopped;   // sof_count when it stopped
+	uint16_t row;
+	uint16_t rows;
+	uint16_t columns;
+	uint8_t channels;
+	uint8_t width;      // Bytes per bin
+	uint8_t flags;      // READOUT_FLAG_OVERFLOW
+	uint8_t reserved[3];
+	uint32_t wall_started;     // Unix time and microseconds of started and
+	uint32_t wall_started_us;  // stopped (M1123), 0 if the clock is not set
+	uint32_t wall_stopped;
+	uint32_t wall_stopped_us;
+} flash_log_row_t;
+
+// Row of the frame being logged, or FLASH_LOG_IDLE
+#define FLASH_LOG_IDLE -1
+// Column before the record has been started
+#define FLASH_LOG_RECORD -1
+
+static bool flash_log_on = false;
+static bool flash_log_counting;      // enable_count when last polled
+static uint32_t flash_log_session;
+static uint32_t flash_log_frames;
+static uint32_t flash_log_errors;
+static uint32_t flash_log_stopped;
+static int32_t flash_log_row = FLASH_LOG_IDLE;
+static uint8_t flash_log_channel;
+static int32_t flash_log_column;
+
+// Logs the next piece of the frame, up to a page
+static bool flash_log_step(void)
+{
+	uint32_t first = flash_log_row * column_count;
+	if (flash_log_column == FLASH_LOG_RECORD)
+	{
+		flash_log_row_t record;
+		memset(&record, 0, sizeof(record));
+		record.session = flash_log_session;
+		record.frame = flash_log_frames;
+		record.started = count_started;
+		record.stopped = flash_log_stopped;
+		wall_time(count_started_us, &record.wall_started, &record.wall_started_us);
+		wall_time(count_stopped_us, &record.wall_stopped, &record.wall_stopped_us);
+		record.row = flash_log_row;
+		record.rows = row_count;
+		record.columns = column_count;
+		record.channels = channel_count;
+		record.width = sizeof(count_t);
+		for (uint8_t c = 0; c < channel_count; c++)
+			record.flags |= readout_flags(c, first, first + column_count - 1) & READOUT_FLAG_OVERFLOW;
+
+		if (!flash_log_begin(sizeof(record) + channel_count * column_count * sizeof(count_t))
+			|| !flash_log_write(&record, sizeof(record)))
+			return false;
+		flash_log_channel = 0;
+		flash_log_column = 0;
+		return true;
+	}
+
+	count_t values[IFLASH_PAGE_SIZE / sizeof(count_t)];
+	uint32_t columns = Min(sizeof(values) / sizeof(values[0]), column_count - (uint32_t)flash_log_column);
+	for (uint32_t i = 0; i < columns; i++)
+		values[i] = COUNT_BIN(flash_log_channel, first + flash_log_column + i);
+	if (!flash_log_write(values, columns * sizeof(count_t)))
+		return false;
+
+	flash_log_column += columns;
+	if (flash_log_column < column_count)
+		return true;
+	flash_log_column = 0;
+	if (++flash_log_channel < channel_count)
+		return true;
+
+	if (!flash_log_commit())
+		return false;
+	flash_log_column = FLASH_LOG_RECORD;
+	if (++flash_log_row == row_count)
+	{
+		flash_log_row = FLASH_LOG_IDLE;
+		flash_log_frames++;
+	}
+	return true;
+}
+
+static void flash_log_advance(void)
+{
+	// The rest of the frame goes with a failed record
+	if (!flash_log_step())
+	{
+		flash_log_errors++;
+		flash_log_row = FLASH_LOG_IDLE;
+	}
+}
+
+static void flash_log_poll(void)
+{
+	// A dump would see the blocks ahead of the log erased under it
+	if (readout_job.kind == READOUT_JOB_FLASH_LOG)
+		return;
+
+	if (flash_log_row == FLASH_LOG_IDLE)
+	{
+		bool counting = enable_count;
+		bool stopped = flash_log_counting && !counting;
+		flash_log_counting = counting;
+		if (!flash_log_on || !stopped)
+			return;
+
+		flash_log_stopped = sof_count;
+		flash_log_row = 0;
+		flash_log_column = FLASH_LOG_RECORD;
+	}
+
+	flash_log_advance();
+}
+
+// Finishes the frame being logged before its bins change
+static void flash_log_wait(void)
+{
+	while (flash_log_row != FLASH_LOG_IDLE)
+		flash_log_advance();
+}
+
+// Count bins are zeroed by a DMAC memory-to-memory transfer from a
+// fixed zero word, so reset and bank swap commands return at once.
+// clear_busy stays set until the transfer completes; with swap_pending
+// the DMAC interrupt also makes the cleared bank the active one.
+#define CLEAR_DMA_CHANNEL 0
+#define CLEAR_DMA_IRQ_PRIORITY COUNTER_IRQ_PRIORITY
+
+static const uint32_t clear_zero = 0;
+static volatile bool clear_busy;
+static volatile bool swap_pending;
+static uint32_t swap_bank;
+
+// Makes the cleared swap_bank the one being filled
+static __always_inline void bank_switch(void)
+{
+	readout_bank = count_bank;
+	count_bank = swap_bank;
+	swap_pending = false;
+	readout_totals = live_totals;
+	memset((void *)&live_totals, 0, sizeof(live_totals));
+	pyramid_clear();
+	memcpy((void *)dirty_readout, (const void *)dirty_live, sizeof(dirty_readout));
+	memset((void *)dirty_live, 0, sizeof(dirty_live));
+#if COUNTER_SD_LOG
+	bank_swaps++;
+#endif
+}
+
+COUNTER_ISR void DMAC_Handler(void)
+{
+	// Reading EBCISR acknowledges the transfer
+	if (!(DMAC->DMAC_EBCISR & (DMAC_EBCISR_BTC0 << CLEAR_DMA_CHANNEL)))
+		return;
+
+	// Counts gathered up to the swap belong to the old bank
+	if (swap_pending)
+	{
+		commit_column();
+		if (defer_columns)
+		{
+			defer_swap_at = ring_head(&defer_queue);
+			defer_swap = true;
+		}
+		else
+			bank_switch();
+	}
+
+	clear_busy = false;
+}
+
+// Adds the queued records in order, making a pending bank swap once
+// the records queued before it are in the old bank
+static void defer_poll(void)
+{
+	// Reading the head before the flag keeps records queued after a
+	// swap that lands in between out of the old bank
+	uint32_t head = ring_head(&defer_queue);
+	bool swap = defer_swap;
+	if (swap)
+		head = defer_swap_at;
+
+	uint8_t channels = channel_count;
+	for (uint32_t tail = ring_tail(&defer_queue); tail != head; tail++)
+	{
+		const defer_record_t *record = &defer_ring[tail & (DEFER_RING_SIZE - 1)];
+		store_cell(record->cell, record->counts, channels, record->time);
+		ring_release(&defer_queue, 1);
+	}
+
+	if (swap)
+	{
+		bank_switch();
+		defer_swap = false;
+	}
+}
+
+static void clear_init(void)
+{
+	pmc_enable_periph_clk(ID_DMAC);
+	DMAC->DMAC_EN = DMAC_EN_ENABLE;
+	DMAC->DMAC_EBCIER = DMAC_EBCIER_BTC0 << CLEAR_DMA_CHANNEL;
+
+	NVIC_SetPriority(DMAC_IRQn, CLEAR_DMA_IRQ_PRIORITY);
+	NVIC_EnableIRQ(DMAC_IRQn);
+}
+
+static void clear_wait(void)
+{
+	while (clear_busy)
+		;
+}
+
+// Starts zeroing bins [first, first + bins).  Both must be multiples of
+// COUNT_BANK_ALIGN, so the region is whole words of count_t and of the
+// saturation bitmap.  The bitmap is at most 3 KB and cleared directly.
+static void clear_start(uint32_t first, uint32_t bins)
+{
+	clear_wait();
+	clear_busy = true;
+	count_epoch++;
+
+#if COUNT_WIDTH == 16
+	memset((uint8_t *)&count_overflow[first / 32], 0, bins / 8);
+#endif
+#if COUNT_PACKED_CHANNELS
+	// And the escape tables of the banks in the region.  The step
+	// interrupt only claims slots in the bank it fills, never this one.
+	for (uint8_t table = COUNT_ESCAPE_TABLE(first); table <= COUNT_ESCAPE_TABLE(first + bins - bank_bins); table++)
+	{
+		memset(count_escape[table], 0, sizeof(count_escape[table]));
+		count_escape_used[table] = 0;
+	}
+#endif
+
+	DmacCh_num *channel = &DMAC->DMAC_CH_NUM[CLEAR_DMA_CHANNEL];
+	channel->DMAC_SADDR = (uint32_t)&clear_zero;
+	channel->DMAC_DADDR = (uint32_t)&count_arena[first];
+	channel->DMAC_DSCR = 0;
+	channel->DMAC_CTRLA = DMAC_CTRLA_BTSIZE(bins * sizeof(count_t) / 4)
+		| DMAC_CTRLA_SRC_WIDTH_WORD | DMAC_CTRLA_DST_WIDTH_WORD;
+	channel->DMAC_CTRLB = DMAC_CTRLB_SRC_DSCR_FETCH_DISABLE | DMAC_CTRLB_DST_DSCR_FETCH_DISABLE
+		| DMAC_CTRLB_FC_MEM2MEM_DMA_FC | DMAC_CTRLB_SRC_INCR_FIXED | DMAC_CTRLB_DST_INCR_INCREMENTING;
+	channel->DMAC_CFG = DMAC_CFG_SOD_ENABLE | DMAC_CFG_FIFOCFG_ALAP_CFG;
+
+	DMAC->DMAC_CHER = DMAC_CHER_ENA0 << CLEAR_DMA_CHANNEL;
+}
+
+// The readout bank can be read while counting once it has been swapped
+// out, and only after any clear or swap in progress has finished
+static bool readout_stable(void)
+{
+	clear_wait();
+	return !enable_count || readout_bank != count_bank;
+}
+
+static void clear_counts(void)
+{
+	flash_log_wait();
+	defer_poll();
+	clear_start(0, COUNT_ARENA_BINS);
+
+	irqflags_t flags = cpu_irq_save();
+	memset((void *)&live_totals, 0, sizeof(live_totals));
+	memset((void *)&readout_totals, 0, sizeof(readout_totals));
+	memset((void *)dirty_live, 0, sizeof(dirty_live));
+	memset((void *)dirty_readout, 0, sizeof(dirty_readout));
+	pyramid_clear();
+	// Cine starts over from frame 0, with every bank being cleared
+	if (cine_on)
+	{
+		count_bank = 0;
+		readout_bank = 0;
+		cine_written = 0;
+		cine_read = 0;
+		cine_ready = 0;
+		cine_clearing = 1;
+	}
+	cpu_irq_restore(flags);
+}
+
+// Start a bank swap; DMAC_Handler makes the cleared bank the active one.
+// Returns false if two banks do not fit in the arena.
+static bool bank_swap(void)
+{
+	if (2 * bank_bins > COUNT_ARENA_BINS || cine_on)
+		return false;
+
+	// The idle bank is the one the host was reading.
+	// Acquisition stays on the current bank until
+	// DMAC_Handler swaps them once it has been cleared.
+	clear_wait();
+	flash_log_wait();
+	defer_poll();
+#if !COUNTER_POSITION_QDEC
+	capture_poll();
+#endif
+	swap_bank = count_bank ? 0 : bank_bins;
+	swap_pending = true;
+	clear_start(swap_bank, bank_bins);
+	return true;
+}
+
+// Clears the bank of the next cine frame once its last one is released,
+// and marks it ready once the clear has finished
+static void cine_poll(void)
+{
+	if (!cine_on || clear_busy)
+		return;
+
+	cine_ready = cine_clearing;
+	uint32_t next = cine_written + 1;
+	if (cine_ready == next || next - cine_read >= cine_frames)
+		return;
+
+	cine_clearing = next;
+	clear_start(cine_bank(next), bank_bins);
+}
+
+#if COUNTER_SD_LOG
+// Frame log (M1044).  Each bank swapped out for readout, by M1025 or,
+// with auto swap, at the end of every frame, is written to the SD card
+// as one record of whole blocks:
+//   sd_log_header_t, zero padded to a block
+//   the bank as it is in the arena (bins, then any timestamp track),
+//   sent by the PDC straight from count_arena
+//   the rest of the bank, zero padded to a block
+// Records follow each other from the block given to M1044, with no
+// file system; the host reads the raw card up to the first block
+// without SD_LOG_MAGIC and the session of the first record.
+#define SD_LOG_MAGIC 0x474C5344  // "DSLG"
+
+#define SD_LOG_FLAG_ANALOG 0x08
+#define SD_LOG_FLAG_DWELL 0x10
+#define SD_LOG_FLAG_COINCIDENCES 0x20
+#define SD_LOG_FLAG_TIMESTAMPS 0x40
+#define SD_LOG_FLAG_INTERLEAVED 0x80
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t session;   // sof_count when logging started
+	uint32_t record;    // Records before this one in the session
+	uint32_t frames;    // Frame ends folded into the bank; more than 1 if the card fell behind
+	uint32_t sof;       // sof_count when the record was started
+	uint32_t blocks;    // Blocks in the record, this header included
+	uint32_t bytes;     // Bank bytes that follow
+	uint16_t columns;
+	uint16_t rows;
+	uint8_t channels;
+	uint8_t width;      // Bytes per bin
+	uint8_t flags;      // READOUT_FLAG_OVERFLOW and SD_LOG_FLAG_*
+	uint8_t reserved;
+} sd_log_header_t;
+
+#define SD_LOG_BLOCK_WORDS (SD_BLOCK_BYTES / sizeof(uint32_t))
+
+static uint32_t sd_log_header_block[SD_LOG_BLOCK_WORDS];
+static uint32_t sd_log_tail_block[SD_LOG_BLOCK_WORDS];
+
+static bool sd_log_enabled;
+static bool sd_log_auto;
+static bool sd_log_writing;
+static uint32_t sd_log_session;
+static uint32_t sd_log_records;
+static uint32_t sd_log_next_block;
+static uint32_t sd_log_errors;
+static uint32_t sd_log_swaps_seen;
+static uint32_t sd_log_frames_seen;
+static uint32_t sd_log_frames_pending;
+
+// Pieces of the record in flight, handed to the PDC as buffers free up
+static const void *sd_log_piece[3];
+static uint32_t sd_log_piece_blocks[3];
+static uint8_t sd_log_pieces;
+static uint8_t sd_log_queued;
+static uint32_t sd_log_record_blocks;
+
+static void sd_log_start_record(void)
+{
+	uint32_t bytes = bank_bins * sizeof(count_t);
+	uint32_t body = bytes / SD_BLOCK_BYTES;
+	uint32_t tail = bytes % SD_BLOCK_BYTES;
+	uint32_t blocks = 1 + body + (tail ? 1 : 0);
+
+	if (sd_log_next_block + blocks > sd_blocks())
+	{
+		// Card full
+		sd_log_enabled = false;
+		return;
+	}
+
+	memset(sd_log_header_block, 0, sizeof(sd_log_header_block));
+	sd_log_header_t *header = (sd_log_header_t *)sd_log_header_block;
+	header->magic = SD_LOG_MAGIC;
+	header->session = sd_log_session;
+	header->record = sd_log_records;
+	header->frames = sd_log_frames_pending;
+	header->sof = sof_count;
+	header->blocks = blocks;
+	header->bytes = bytes;
+	header->columns = column_count;
+	header->rows = row_count;
+	header->channels = channel_count;
+	header->width = sizeof(count_t);
+	header->flags = (time_track ? SD_LOG_FLAG_TIMESTAMPS : 0) | (coincidence_track ? SD_LOG_FLAG_COINCIDENCES : 0)
+		| (dwell_track ? SD_LOG_FLAG_DWELL : 0) | (analog_track ? SD_LOG_FLAG_ANALOG : 0)
+		| (COUNT_LAYOUT_INTERLEAVED ? SD_LOG_FLAG_INTERLEAVED : 0);
+#if COUNT_WIDTH == 16
+	for (uint32_t word = readout_bank / 32; word < (readout_bank + bank_bins) / 32; word++)
+		if (count_overflow[word])
+		{
+			header->flags |= READOUT_FLAG_OVERFLOW;
+			break;
+		}
+#endif
+
+	const uint8_t *bank = (const uint8_t *)&count_arena[readout_bank];
+	sd_log_pieces = 0;
+	sd_log_piece[sd_log_pieces] = sd_log_header_block;
+	sd_log_piece_blocks[sd_log_pieces++] = 1;
+	if (body)
+	{
+		sd_log_piece[sd_log_pieces] = bank;
+		sd_log_piece_blocks[sd_log_pieces++] = body;
+	}
+	if (tail)
+	{
+		memset(sd_log_tail_block, 0, sizeof(sd_log_tail_block));
+		memcpy(sd_log_tail_block, bank + body * SD_BLOCK_BYTES, tail);
+		sd_log_piece[sd_log_pieces] = sd_log_tail_block;
+		sd_log_piece_blocks[sd_log_pieces++] = 1;
+	}
+
+	if (!sd_write_start(sd_log_next_block, blocks))
+	{
+		sd_log_errors++;
+		sd_log_enabled = false;
+		return;
+	}
+
+	sd_log_frames_pending = 0;
+	sd_log_queued = 0;
+	sd_log_record_blocks = blocks;
+	sd_log_writing = true;
+}
+
+// Run from the main loop: feed the record in flight, start one for a
+// newly swapped out bank, or swap at the end of a frame
+static void sd_log_poll(void)
+{
+	if (sd_log_writing)
+	{
+		while (sd_log_queued < sd_log_pieces
+			&& sd_write_queue(sd_log_piece[sd_log_queued], sd_log_piece_blocks[sd_log_queued]))
+			sd_log_queued++;
+
+		sd_status_t status = sd_write_poll();
+		if (status == SD_BUSY)
+			return;
+
+		sd_log_writing = false;
+		if (status == SD_ERROR)
+		{
+			sd_log_errors++;
+			sd_log_enabled = false;
+			return;
+		}
+		sd_log_next_block += sd_log_record_blocks;
+		sd_log_records++;
+	}
+
+	if (!sd_log_enabled)
+		return;
+
+	uint32_t frames = frame_ends;
+	sd_log_frames_pending += frames - sd_log_frames_seen;
+	sd_log_frames_seen = frames;
+
+	if (bank_swaps != sd_log_swaps_seen)
+	{
+		sd_log_swaps_seen = bank_swaps;
+		sd_log_start_record();
+	}
+	// The card has caught up, so the frames since the last swap can go,
+	// once no readout job is sending from the readout bank the swap clears
+	else if (sd_log_auto && sd_log_frames_pending && enable_count && !swap_pending
+		&& readout_job.kind == READOUT_JOB_NONE)
+		bank_swap();
+}
+#endif
+
+// Report current position
+static void command_m1001(const int32_t *argv, uint8_t argc)
+{
+	reply_str("ok\n");
+	reply_i32(head_position - head_origin);
+	reply_char('\n');
+}
+
+// Report current row
+static void command_m1024(const int32_t *argv, uint8_t argc)
+{
+	reply_str("ok\n");
+	reply_i32(head_row);
+	reply_char('\n');
+}
+
+// Reset current position and row
+static void command_m1002(const int32_t *argv, uint8_t argc)
+{
+	zero_position();
+	reply_str("ok\n");
+}
+
+static void start_disarm(void)
+{
+	start_armed = START_ARMED_NONE;
+#if COUNTER_FAST_STEP_ISR
+	step_handler_select(count_mode);
+#endif
+}
+
+// Enable counting
+static void command_m1003(const int32_t *argv, uint8_t argc)
+{
+	if (enable_count)
+	{
+		reply_str("error: counter is already active\n");
+		return;
+	}
+
+	clear_wait();
+	flash_log_wait();
+
+#if COUNTER_SYNC
+	// The reset happens on the master's start edge instead
+	if (sync_mode == SYNC_MODE_SLAVE)
+	{
+		sync_armed = true;
+		reply_str("ok\n");
+		return;
+	}
+#endif
+
+#if !COUNTER_POSITION_QDEC
+	// Captures from before the reset would be measured against it
+	capture_poll();
+#endif
+
+	// Starting now overrides an armed start
+	irqflags_t flags = cpu_irq_save();
+	start_disarm();
+	count_start();
+	cpu_irq_restore(flags);
+	reply_str("ok\n");
+}
+
+// Disable counting
+static void command_m1004(const int32_t *argv, uint8_t argc)
+{
+#if COUNTER_SYNC
+	if (sync_armed)
+	{
+		sync_armed = false;
+		reply_str("ok\n");
+		return;
+	}
+#endif
+
+	if (start_armed)
+	{
+		start_disarm();
+		reply_str("ok\n");
+		return;
+	}
+
+	if (!enable_count)
+	{
+		reply_str("error: counter is not active\n");
+		return;
+	}
+
+	enable_count = false;
+	count_stopped_us = time_us();
+	reply_str("ok\n");
+}
+
+// M1084 reports what counting is armed to start on; M1084 <source> arms
+// it to start on the next step edge (1) or rising edge of START_PIN (2),
+// or disarms it (0), as does M1004.  The start then resets the counters
+// from the interrupt of that edge, within its latency of the motion.
+static void command_m1084(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_str("ok\n");
+		reply_u32(start_armed);
+		reply_char('\n');
+		return;
+	}
+
+	if (argv[0] < START_ARMED_NONE || argv[0] > START_ARMED_PIN)
+	{
+		reply_str("error: arm command requires 0, 1 or 2\n");
+		return;
+	}
+
+	if (enable_count)
+	{
+		reply_str("error: counter is already active\n");
+		return;
+	}
+
+	if (argv[0] == START_ARMED_NONE)
+	{
+		start_disarm();
+		reply_str("ok\n");
+		return;
+	}
+
+#if COUNTER_SYNC
+	// Slaves already start on the master's edge
+	if (sync_mode == SYNC_MODE_SLAVE)
+	{
+		reply_str("error: columns follow the sync master\n");
+		return;
+	}
+#endif
+
+#if !COUNTER_POSITION_QDEC
+	// The captures taken before the start are folded in by M1003
+	if (count_mode == COUNT_MODE_CAPTURE)
+	{
+		reply_str("error: capture mode is started by M1003\n");
+		return;
+	}
+#endif
+
+#if COUNTER_POSITION_QDEC
+	if (argv[0] == START_ARMED_STEP)
+#else
+	if (argv[0] == START_ARMED_STEP && timed_active)
+#endif
+	{
+		reply_str("error: the head does not follow the step input\n");
+		return;
+	}
+
+	// Nothing may hold off the interrupts once armed
+	clear_wait();
+	flash_log_wait();
+
+	irqflags_t flags = cpu_irq_save();
+	start_armed = argv[0];
+#if COUNTER_FAST_STEP_ISR
+	step_handler_select(count_mode);
+#endif
+	cpu_irq_restore(flags);
+	reply_str("ok\n");
+}
+
+// Read primary counts.  A start past the end reads on from it to the
+// last cell and then from cell 0, as one line.
+static void command_m1005(const int32_t *argv, uint8_t argc)
+{
+	if (!readout_stable())
+	{
+		reply_str("error: cannot read counter while it is active\n");
+		return;
+	}
+
+	int32_t channel, start, end;
+	if (!parse_wrapped_readout_args(argv, argc, &channel, &start, &end))
+		return;
+
+	reply_str("ok\n");
+	readout_job_start(READOUT_JOB_TEXT, 1u << channel, false, start, end);
+}
+
+// Readout precomputation.  Once counting stops the main loop works out,
+// a slice per pass, the CRC and flags each channel's full-range M1015
+// readout puts in its header, so that readout can send its header
+// straight away instead of first reading the whole plane to checksum
+// it.  A store or clear (count_epoch) or another readout bank starts
+// it over.
+#define PRECOMPUTE_SLICE_CELLS 512
+
+typedef struct
+{
+	uint32_t epoch;     // count_epoch the values are of
+	uint32_t bank;      // and readout_bank
+	uint8_t channel;    // Channel being checksummed
+	uint8_t done;       // Channels finished, one bit each
+	int32_t next;       // Its next cell
+	uint16_t crc[COUNTER_CHANNELS];
+	uint8_t overflow[COUNTER_CHANNELS];
+} readout_precompute_t;
+
+// No readout bank is at UINT32_MAX, so nothing is precomputed at first
+static readout_precompute_t readout_precompute = { .bank = UINT32_MAX };
+
+static bool precompute_current(void)
+{
+	return readout_precompute.epoch == count_epoch && readout_precompute.bank == readout_bank;
+}
+
+// Whether precompute_poll has work to do.  It waits for the bank to be
+// idle: counting stopped, no clear running and no job reading it.
+static bool precompute_due(void)
+{
+	if (enable_count || clear_busy || readout_job.kind != READOUT_JOB_NONE)
+		return false;
+
+	return !precompute_current() || readout_precompute.channel < channel_count;
+}
+
+static void precompute_poll(void)
+{
+	readout_precompute_t *pre = &readout_precompute;
+	if (!precompute_due())
+		return;
+
+	uint32_t epoch = count_epoch;
+	if (!precompute_current())
+	{
+		pre->epoch = epoch;
+		pre->bank = readout_bank;
+		pre->channel = 0;
+		pre->done = 0;
+		pre->next = 0;
+		pre->crc[0] = 0xFFFF;
+		pre->overflow[0] = 0;
+	}
+
+	uint8_t c = pre->channel;
+	int32_t end = Min(pre->next + PRECOMPUTE_SLICE_CELLS, cell_count) - 1;
+	readout_payload(1u << c, pre->next, end, false, &pre->crc[c]);
+	pre->overflow[c] |= readout_flags(c, pre->next, end) & READOUT_FLAG_OVERFLOW;
+
+	// Anything stored meanwhile leaves the epoch behind, so the next pass
+	// starts over
+	if (!precompute_current())
+		return;
+
+	pre->next = end + 1;
+	if (pre->next < cell_count)
+		return;
+
+	pre->done |= 1u << c;
+	pre->next = 0;
+	if (++pre->channel < COUNTER_CHANNELS)
+	{
+		pre->crc[pre->channel] = 0xFFFF;
+		pre->overflow[pre->channel] = 0;
+	}
+}
+
+// Fill in the CRC and flags of a full-range binary readout of a channel
+// if they have been precomputed for the counts as they are
+static bool precompute_header(uint8_t channel, int32_t start, int32_t end, readout_header_t *header)
+{
+	readout_precompute_t *pre = &readout_precompute;
+	if (start != 0 || end != cell_count - 1 || !(pre->done & (1u << channel)) || !precompute_current())
+		return false;
+
+	header->crc = pre->crc[channel];
+	header->flags = pre->overflow[channel] | (limit_steps ? READOUT_FLAG_LIMIT : 0);
+	return true;
+}
+
+// Read counts in binary.  A start past the end reads on from it to the
+// last cell and then from cell 0, as one payload whose header keeps the
+// ends as given.
+static void command_m1015(const int32_t *argv, uint8_t argc)
+{
+	if (!readout_stable())
+	{
+		reply_str("error: cannot read counter while it is active\n");
+		return;
+	}
+
+	int32_t channel, start, end;
+	if (!parse_wrapped_readout_args(argv, argc, &channel, &start, &end))
+		return;
+
+	// The readout bank is stable between computing
+	// the CRC and sending the payload
+	readout_header_t header;
+	header.channel = channel;
+	header.start = start;
+	header.end = end;
+	header.length = wrapped_cells(start, end) * sizeof(count_t);
+	header.crc = 0xFFFF;
+	header.width = sizeof(count_t);
+	header.reserved = 0;
+	if (!precompute_header(channel, start, end, &header))
+	{
+		header.flags = wrapped_flags(channel, start, end);
+		wrapped_payload(1u << channel, start, end, false, &header.crc);
+	}
+
+	reply_str("ok\n");
+	if (readout_send_header(&header))
+		readout_job_start(READOUT_JOB_BINARY, 1u << channel, false, start, end);
+}
+
+// Read counts in binary, compressed
+static void command_m1026(const int32_t *argv, uint8_t argc)
+{
+	if (!readout_stable())
+	{
+		reply_str("error: cannot read counter while it is active\n");
+		return;
+	}
+
+	int32_t channel, start, end;
+	if (!parse_readout_args(argv, argc, &channel, &start, &end))
+		return;
+
+	readout_header_t header;
+	header.channel = channel;
+	header.start = start;
+	header.end = end;
+	header.crc = 0xFFFF;
+	header.width = sizeof(count_t);
+	header.flags = readout_flags(channel, start, end) | READOUT_FLAG_RLE;
+	header.reserved = 0;
+	rle_payload(channel, start, end, &header.crc, &header.length);
+
+	reply_str("ok\n");
+	if (readout_send_header(&header))
+		readout_job_start(READOUT_JOB_RLE, 1u << channel, false, start, end);
+}
+
+// Read counts in binary, predicted from the row above and Rice coded:
+// M1101 <channel> <start> <end>.  For full 2D frames; a single row gets
+// no more than a delta code from it.
+static void command_m1101(const int32_t *argv, uint8_t argc)
+{
+	if (!readout_stable())
+	{
+		reply_str("error: cannot read counter while it is active\n");
+		return;
+	}
+
+	int32_t channel, start, end;
+	if (!parse_readout_args(argv, argc, &channel, &start, &end))
+		return;
+
+	readout_header_t header;
+	header.channel = READOUT_PREDICTED;
+	header.start = start;
+	header.end = end;
+	header.crc = 0xFFFF;
+	header.width = sizeof(count_t);
+	header.flags = readout_flags(channel, start, end);
+	header.reserved = channel;
+	predicted_payload(channel, start, end, column_count, &header.crc, &header.length);
+
+	reply_str("ok\n");
+	if (readout_send_header(&header))
+	{
+		readout_job.columns = column_count;
+		readout_job_start(READOUT_JOB_PREDICTED, 1u << channel, false, start, end);
+	}
+}
+
+// Compress binary readouts: M1102 1 sends the payload of every binary
+// readout but containers as an LZ4 frame, marked by READOUT_LZ4 in its
+// header, and M1102 0 goes back to plain payloads.  M1102 alone reports
+// which is in use.
+static void command_m1102(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_str("ok\n");
+		reply_u32(readout_compress);
+		reply_char('\n');
+		return;
+	}
+
+	if (argv[0] != 0 && argv[0] != 1)
+	{
+		reply_str("error: compression command takes 0 or 1\n");
+		return;
+	}
+
+	if (argv[0] && !readout_lz4)
+		readout_lz4 = pool_reserve(&sram_pool, "lz4", sizeof(lz4_stream_t));
+	if (argv[0] && !readout_lz4)
+	{
+		reply_str("error: no SRAM for compression\n");
+		return;
+	}
+
+	readout_compress = argv[0];
+	reply_str("ok\n");
+}
+
+// Read stored channels in binary: M1016 <interleave> <start> <end> [mask],
+// where bit n of mask selects channel n (all stored channels by default).
+// The range may wrap, as with M1015.
+static void command_m1016(const int32_t *argv, uint8_t argc)
+{
+	if (!readout_stable())
+	{
+		reply_str("error: cannot read counter while it is active\n");
+		return;
+	}
+
+	if (argc < 3)
+	{
+		reply_str("error: read command requires three arguments\n");
+		return;
+	}
+
+	int32_t interleave = argv[0], start = argv[1], end = argv[2];
+
+	if (interleave != 0 && interleave != 1)
+	{
+		reply_str("error: invalid layout\n");
+		return;
+	}
+
+	int32_t all = (1 << channel_count) - 1;
+	int32_t mask = argc > 3 ? argv[3] : all;
+	if (mask <= 0 || (mask & ~all))
+	{
+		reply_str("error: invalid channel mask\n");
+		return;
+	}
+
+	if (!validate_wrapped_range(start, end))
+		return;
+
+	readout_header_t header;
+	header.channel = interleave ? READOUT_ALL_INTERLEAVED : READOUT_ALL_PLANAR;
+	header.start = start;
+	header.end = end;
+	header.length = __builtin_popcount(mask) * wrapped_cells(start, end) * sizeof(count_t);
+	header.crc = 0xFFFF;
+	header.width = sizeof(count_t);
+	header.flags = 0;
+	for (uint8_t c = 0; c < channel_count; c++)
+		if (mask & (1 << c))
+			header.flags |= wrapped_flags(c, start, end);
+	header.reserved = mask;
+	wrapped_payload(mask, start, end, interleave, &header.crc);
+
+	reply_str("ok\n");
+	if (readout_send_header(&header))
+		readout_job_start(READOUT_JOB_BINARY, mask, interleave, start, end);
+}
+
+// Check the <interleave> <start> <end> [mask] arguments of M1056 and M1068
+static bool container_args(const int32_t *argv, uint8_t argc, int32_t *mask)
+{
+	if (!readout_stable())
+	{
+		reply_str("error: cannot read counter while it is active\n");
+		return false;
+	}
+
+	if (argc < 3)
+	{
+		reply_str("error: read command requires three arguments\n");
+		return false;
+	}
+
+	if (argv[0] != 0 && argv[0] != 1)
+	{
+		reply_str("error: invalid layout\n");
+		return false;
+	}
+
+	int32_t all = (1 << channel_count) - 1;
+	*mask = argc > 3 ? argv[3] : all;
+	if (*mask <= 0 || (*mask & ~all))
+	{
+		reply_str("error: invalid channel mask\n");
+		return false;
+	}
+
+	return validate_column_range(argv[1], argv[2]);
+}
+
+// Send the header of a container for start..end and start its blocks
+static void container_send(bool interleave, int32_t start, int32_t end, uint16_t mask)
+{
+	static const char build[] = __DATE__ " " __TIME__;
+
+	container_header_t header;
+	header.magic = CONTAINER_MAGIC;
+	header.version = CONTAINER_VERSION;
+	header.header_bytes = sizeof(header);
+	header.build_id = crc32_update(0, (const uint8_t *)build, sizeof(build) - 1);
+	header.firmware = (USB_DEVICE_MAJOR_VERSION << 8) | USB_DEVICE_MINOR_VERSION;
+	header.mask = mask;
+	header.start = start;
+	header.end = end;
+	header.columns = column_count;
+	header.rows = row_count;
+	header.bin_factor = bin_factor;
+	header.block_columns = CONTAINER_BLOCK_COLUMNS;
+	header.width = sizeof(count_t);
+	header.interleaved = interleave;
+	header.flags = 0;
+	for (uint8_t c = 0; c < channel_count; c++)
+		if (mask & (1 << c))
+			header.flags |= readout_flags(c, start, end);
+	header.reserved = 0;
+	header.started = count_started;
+	header.read = sof_count;
+	header.blocks = (end - start + CONTAINER_BLOCK_COLUMNS) / CONTAINER_BLOCK_COLUMNS;
+	wall_time(count_started_us, &header.wall_started, &header.wall_started_us);
+	wall_time(count_stopped_us, &header.wall_stopped, &header.wall_stopped_us);
+	header.crc = crc32_update(0, (const uint8_t *)&header, offsetof(container_header_t, crc));
+
+	reply_str("ok\n");
+	if (write_binary(&header, sizeof(header)))
+		readout_job_start(READOUT_JOB_CONTAINER, mask, interleave, start, end);
+}
+
+// Read stored channels as a container (see container_header_t):
+// M1056 <interleave> <start> <end> [mask], arguments as for M1016
+static void command_m1056(const int32_t *argv, uint8_t argc)
+{
+	int32_t mask;
+	if (container_args(argv, argc, &mask))
+		container_send(argv[0], argv[1], argv[2], mask);
+}
+
+// Resend part of a container: M1068 <interleave> <start> <end> <mask>
+// <first block> [<blocks>] sends, as a container of their own, the blocks
+// from <first block> on (all the rest by default) of the one M1056 would
+// send with the same arguments.  A block's index is its sequence number,
+// so a host whose readout timed out after n whole blocks asks for n on,
+// or for just the blocks whose CRC failed.  The resent header starts at the
+// first block's column, and its started field tells the host the counts
+// are those of the frame it was reading.
+static void command_m1068(const int32_t *argv, uint8_t argc)
+{
+	int32_t mask;
+	if (argc < 5)
+	{
+		reply_str("error: resend command requires five arguments\n");
+		return;
+	}
+
+	if (!container_args(argv, argc, &mask))
+		return;
+
+	int32_t start = argv[1], end = argv[2], first = argv[4];
+	int32_t blocks = (end - start + CONTAINER_BLOCK_COLUMNS) / CONTAINER_BLOCK_COLUMNS;
+	int32_t count = argc > 5 ? argv[5] : blocks - first;
+	if (first < 0 || first >= blocks || count <= 0 || count > blocks - first)
+	{
+		reply_str("error: invalid block range\n");
+		return;
+	}
+
+	start += first * CONTAINER_BLOCK_COLUMNS;
+	end = Min(end, start + count * CONTAINER_BLOCK_COLUMNS - 1);
+	container_send(argv[0], start, end, mask);
+}
+
+// Empty the stream ring for a new producer of records with magic.  The
+// producer must be stopped.
+static void stream_restart(uint16_t magic)
+{
+	ring_flush(&stream_queue);
+	stream_magic = magic;
+	stream_dropped = 0;
+	stream_credits = 0;
+	stream_stalled = false;
+	stream_stalls = 0;
+}
+
+// Enable or disable streaming of counted columns
+static void command_m1017(const int32_t *argv, uint8_t argc)
+{
+	int32_t enable = argv[0];
+	if (argc < 1 || (enable != 0 && enable != 1))
+	{
+		reply_str("error: stream command requires an argument of 0 or 1\n");
+		return;
+	}
+
+	if (stream_events)
+	{
+		reply_str("error: list mode is on\n");
+		return;
+	}
+
+	// Stop the producer before resetting the ring
+	enable_stream = false;
+	if (enable)
+	{
+#if COUNTER_SYNC
+		stream_restart(sync_mode == SYNC_MODE_PULSE ? STREAM_PULSE_MAGIC : STREAM_MAGIC);
+#else
+		stream_restart(STREAM_MAGIC);
+#endif
+		enable_stream = true;
+	}
+
+	reply_str("ok\n");
+}
+
+// M1067 reports the stream aggregation policy as "<bytes> <us>",
+// M1067 <bytes> <us> sets it
+static void command_m1067(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_str("ok\n");
+		reply_u32(sizeof(stream_header_t) + stream_block_records * sizeof(stream_record_t));
+		reply_char(' ');
+		reply_u32(stream_wait_us);
+		reply_char('\n');
+		return;
+	}
+
+	int32_t bytes = argv[0];
+	int32_t wait = argv[1];
+	if (argc < 2 || bytes < (int32_t)(sizeof(stream_header_t) + sizeof(stream_record_t))
+		|| bytes > STREAM_BLOCK_MAX_BYTES || wait < 0 || wait > STREAM_WAIT_MAX_US)
+	{
+		reply_str("error: stream aggregation command requires a block of 16 to 512 bytes and a wait of at most 1000000 us\n");
+		return;
+	}
+
+	stream_block_records = (bytes - sizeof(stream_header_t)) / sizeof(stream_record_t);
+	stream_wait_us = wait;
+	stream_wait_ms = (wait + 999) / 1000;
+	reply_str("ok\n");
+}
+
+// M1069 reports the stream credit state as "<on> <credits> <queued>
+// <dropped> <stalls>".  M1069 1 <records> puts the stream under credit
+// flow control and grants room for <records> more records, M1069 0 goes
+// back to sending whatever is due.
+static void command_m1069(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_str("ok\n");
+		reply_u32(stream_credit);
+		reply_char(' ');
+		reply_u32(stream_credits);
+		reply_char(' ');
+		reply_u32(ring_count(&stream_queue));
+		reply_char(' ');
+		reply_u32(stream_dropped);
+		reply_char(' ');
+		reply_u32(stream_stalls);
+		reply_char('\n');
+		return;
+	}
+
+	int32_t grant = argc > 1 ? argv[1] : 0;
+	if ((argv[0] != 0 && argv[0] != 1) || grant < 0)
+	{
+		reply_str("error: stream credit command requires 0, or 1 and a record count\n");
+		return;
+	}
+
+	stream_credit = argv[0];
+	if (stream_credit)
+	{
+		// Saturate rather than wrap on a host that keeps granting
+		stream_credits = (uint32_t)grant > UINT32_MAX - stream_credits ? UINT32_MAX : stream_credits + grant;
+		stream_stalled = false;
+	}
+	else
+		stream_credits = 0;
+	reply_str("ok\n");
+}
+
+// Select the interface for binary data: 0 CDC, 1 vendor bulk,
+// 2 the second CDC port
+static void command_m1027(const int32_t *argv, uint8_t argc)
+{
+	int32_t interface = argv[0];
+	if (argc < 1 || interface < DATA_INTERFACE_CDC || interface > DATA_INTERFACE_CDC_DATA)
+	{
+		reply_str("error: data interface command requires an argument of 0, 1 or 2\n");
+		return;
+	}
+
+	if (interface == DATA_INTERFACE_BULK && !udi_vendor_bulk_is_enabled())
+	{
+		reply_str("error: bulk interface is not configured\n");
+		return;
+	}
+
+#if UDI_CDC_PORT_NB > 1
+	if (interface == DATA_INTERFACE_CDC_DATA && !cdc_enabled[CDC_DATA_PORT])
+#else
+	if (interface == DATA_INTERFACE_CDC_DATA)
+#endif
+	{
+		reply_str("error: data port is not configured\n");
+		return;
+	}
+
+	data_interface = interface;
+	reply_str("ok\n");
+}
+
+// Switch the count mode, with the head following the steps in all but capture mode
+static void set_count_mode(uint8_t mode)
+{
+#if !COUNTER_POSITION_QDEC
+	if ((mode == COUNT_MODE_CAPTURE) != (count_mode == COUNT_MODE_CAPTURE))
+		head_tracking(mode != COUNT_MODE_CAPTURE);
+#endif
+	configure_counters(mode);
+#if COUNTER_FAST_STEP_ISR
+	step_handler_select(mode);
+#endif
+}
+
+// Select how the counters are sampled on each step
+static void command_m1018(const int32_t *argv, uint8_t argc)
+{
+	if (enable_count || start_armed)
+	{
+		reply_str("error: cannot change count mode while the counter is active\n");
+		return;
+	}
+
+	int32_t mode = argv[0];
+#if COUNTER_POSITION_QDEC
+	if (argc < 1 || mode < COUNT_MODE_RESET || mode > COUNT_MODE_DELTA)
+#else
+	if (argc < 1 || mode < COUNT_MODE_RESET || mode > COUNT_MODE_CAPTURE)
+#endif
+	{
+		reply_str("error: invalid count mode\n");
+		return;
+	}
+
+	if (mode == COUNT_MODE_CAPTURE && stop_kind != STOP_OFF && stop_kind != STOP_TIME)
+	{
+		reply_str("error: a stop condition follows the step interrupt\n");
+		return;
+	}
+
+#if !COUNTER_POSITION_QDEC
+	if (mode == COUNT_MODE_CAPTURE && home_mode != HOME_OFF)
+	{
+		reply_str("error: the home input follows the step interrupt\n");
+		return;
+	}
+#endif
+
+	// Capture mode moves the head itself
+	if (mode == COUNT_MODE_CAPTURE && timed_active)
+	{
+		reply_str("error: timed acquisition is active\n");
+		return;
+	}
+
+	if (mode == COUNT_MODE_CAPTURE && FRAME_STORE_TAKES(CAPTURE_PIO, CAPTURE_PIN))
+	{
+		reply_str("error: pin is used by the frame store\n");
+		return;
+	}
+
+#if COUNTER_SYNC
+	if (mode == COUNT_MODE_CAPTURE && sync_mode == SYNC_MODE_SLAVE)
+	{
+		reply_str("error: columns follow the sync master\n");
+		return;
+	}
+
+	// The TIOA captures follow the step input
+	if ((mode == COUNT_MODE_LATCH || mode == COUNT_MODE_CAPTURE) && sync_mode == SYNC_MODE_PULSE)
+	{
+		reply_str("error: columns follow the beam pulses\n");
+		return;
+	}
+#endif
+
+	// The latch input is TIOA1, and the capture timer the high half
+	if ((mode == COUNT_MODE_LATCH || mode == COUNT_MODE_CAPTURE) && counter_chained)
+	{
+		reply_str("error: the primary channel is chained\n");
+		return;
+	}
+
+	// The step edge resets the counters in latch mode,
+	// so only the last step of a bin would be kept
+	if (mode == COUNT_MODE_LATCH && bin_factor > 1)
+	{
+		reply_str("error: latch mode requires a bin factor of 1\n");
+		return;
+	}
+
+	set_count_mode(mode);
+	reply_str("ok\n");
+}
+
+// Chain the primary channel: M1105 1 counts it in 32 bits in hardware,
+// with no overflow interrupts, taking the tertiary channel's counter for
+// the high half, and M1105 0 goes back to 16 bits extended in software.
+// Needs two channels or fewer and the reset or delta count mode.
+// M1105 reports whether it is chained.
+static void command_m1105(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_str("ok\n");
+		reply_u32(counter_chained);
+		reply_char('\n');
+		return;
+	}
+
+	if (argv[0] != 0 && argv[0] != 1)
+	{
+		reply_str("error: chain command takes 0 or 1\n");
+		return;
+	}
+
+	if (enable_count || start_armed)
+	{
+		reply_str("error: counter is active\n");
+		return;
+	}
+
+	if (argv[0] && (channel_mask & (1u << COUNTER_CHAIN_HIGH)))
+	{
+		reply_str("error: the tertiary channel's counter is in use\n");
+		return;
+	}
+
+	if (argv[0] && !(channel_mask & 1))
+	{
+		reply_str("error: the primary channel is not stored\n");
+		return;
+	}
+
+	if (argv[0] && count_mode != COUNT_MODE_RESET && count_mode != COUNT_MODE_DELTA)
+	{
+		reply_str("error: chaining requires count mode 0 or 2\n");
+		return;
+	}
+
+#if COUNTER_BEAM_GATE
+	if (argv[0] && beam_gate)
+	{
+		reply_str("error: the beam gate is on\n");
+		return;
+	}
+#endif
+
+	counter_chained = argv[0];
+	configure_counters(count_mode);
+	counter_restart();
+	reply_str("ok\n");
+}
+
+#if !COUNTER_POSITION_QDEC
+// Set the number of steps per column
+static void command_m1022(const int32_t *argv, uint8_t argc)
+{
+	if (enable_count)
+	{
+		reply_str("error: cannot change bin factor while the counter is active\n");
+		return;
+	}
+
+	int32_t factor = argv[0];
+	if (argc < 1 || factor < 1 || factor > UINT16_MAX)
+	{
+		reply_str("error: invalid bin factor\n");
+		return;
+	}
+
+	if (count_mode == COUNT_MODE_LATCH && factor > 1)
+	{
+		reply_str("error: latch mode requires a bin factor of 1\n");
+		return;
+	}
+
+	irqflags_t flags = cpu_irq_save();
+	bin_factor = factor;
+	bin_phase = 0;
+	cpu_irq_restore(flags);
+
+	reply_str("ok\n");
+}
+#endif
+
+// List the columns that saturated
+static void command_m1019(const int32_t *argv, uint8_t argc)
+{
+	if (!readout_stable())
+	{
+		reply_str("error: cannot read counter while it is active\n");
+		return;
+	}
+
+	int32_t channel, start, end;
+	if (!parse_readout_args(argv, argc, &channel, &start, &end))
+		return;
+
+	reply_str("ok\n");
+#if COUNT_WIDTH == 16
+	for (int32_t i = start; i <= end; i++)
+		if (COUNT_OVERFLOWED(channel, i))
+		{
+			reply_i32(i);
+			reply_char(' ');
+		}
+#endif
+	reply_char('\n');
+
+	reply_str("ok\n");
+}
+
+#if !COUNTER_POSITION_QDEC
+// Report and clear the number of missed steps
+static void command_m1021(const int32_t *argv, uint8_t argc)
+{
+	if (COUNTER_USES_TC(STEP_CHECK_TC_CHANNEL_ID))
+	{
+		reply_str("error: timer is used by a counter channel\n");
+		return;
+	}
+
+	if (FRAME_STORE_TAKES(STEP_CHECK_PIO, STEP_CHECK_PIN))
+	{
+		reply_str("error: pin is used by the frame store\n");
+		return;
+	}
+
+	// Both counts are compared modulo 2^16, so the difference
+	// is exact as long as fewer than 65536 steps were missed
+	irqflags_t flags = cpu_irq_save();
+	uint16_t edges = step_check_count();
+	uint16_t missed = edges - steps_serviced;
+	steps_serviced = edges;
+	cpu_irq_restore(flags);
+
+	reply_str("ok\n");
+	reply_u32(missed);
+	reply_char('\n');
+}
+#endif
+
+// Report and clear step interrupt timing
+static void command_m1020(const int32_t *argv, uint8_t argc)
+{
+	reply_str("ok\n");
+	profile_report();
+	reply_str("ok\n");
+}
+
+// FP context stacking.  The readout and analysis code of the main loop
+// leaves the FPU in use, so an exception taken from it has S0-S15 and
+// FPSCR to preserve, 17 words on top of the basic frame.  With lazy
+// stacking (the reset value, set again at boot in case a bootloader
+// changed it) entry only reserves their space, and they are saved by
+// the first FP instruction the handler runs.  The step chain, the USB
+// handlers and the pulse generators are integer only, so they never
+// run one (M1020 counts any step that does); only the M1087 ramp in
+// TC5_Handler, below the step interrupt, still uses the FPU.
+static bool fpu_lazy = true;
+
+static void fpu_stacking(bool lazy)
+{
+	uint32_t fpccr = FPU->FPCCR | FPU_FPCCR_ASPEN_Msk;
+	FPU->FPCCR = lazy ? fpccr | FPU_FPCCR_LSPEN_Msk : fpccr & ~FPU_FPCCR_LSPEN_Msk;
+	__DSB();
+	__ISB();
+	fpu_lazy = lazy;
+}
+
+// M1122 reports whether FP context stacking is lazy, M1122 <0|1> stacks
+// every exception's FP context on entry or lazily, for comparing the
+// step latency M1020 measures.  Boots lazy.
+static void command_m1122(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_str("ok\n");
+		reply_u32(fpu_lazy);
+		reply_char('\n');
+		return;
+	}
+
+	if (argv[0] != 0 && argv[0] != 1)
+	{
+		reply_str("error: FP stacking command requires an argument of 0 or 1\n");
+		return;
+	}
+
+	fpu_stacking(argv[0]);
+	reply_str("ok\n");
+}
+
+// M1123 reports the wall clock as "<seconds> <microseconds>", Unix time
+// in UTC, or "0 0" while it is not set.  M1123 <seconds> [<microseconds>]
+// sets it to the host's time as the command arrived: the calendar takes
+// it within a second, and the stamps follow the microseconds a second
+// after that.
+static void command_m1123(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		uint32_t seconds, micros;
+		wall_time(time_us(), &seconds, &micros);
+		reply_str("ok\n");
+		reply_u32(seconds);
+		reply_char(' ');
+		reply_u32(micros);
+		reply_char('\n');
+		return;
+	}
+
+	uint32_t micros = argc > 1 ? argv[1] : 0;
+	if ((uint32_t)argv[0] < WALL_EPOCH || micros >= 1000000)
+	{
+		reply_str("error: wall clock command requires Unix seconds from 2024 and microseconds under 1000000\n");
+		return;
+	}
+
+	irqflags_t flags = cpu_irq_save();
+	wall_set_us = (uint64_t)(uint32_t)argv[0] * 1000000 + micros;
+	wall_set_at = command_received;
+	wall_state = WALL_UPDATE;
+	RTC->RTC_CR |= RTC_CR_UPDTIM | RTC_CR_UPDCAL;
+	RTC->RTC_IER = RTC_IER_ACKEN;
+	cpu_irq_restore(flags);
+	reply_str("ok\n");
+}
+
+// Kernel benchmark (M1124): the CMSIS-DSP kernels readout features are
+// built on, and plain loops and SIMD intrinsics beside them, each timed
+// with the DWT cycle counter over a range of elements the way the
+// features run them, a block at a time.  Every kernel runs on both
+// representations it could be given, F32 and Q15 (Q31 for the FIR the
+// M1097 smoothing uses), so that a feature can take the cheaper one and a
+// toolchain change that slows one down shows.  The scratch space is one
+// pool reservation of the largest block, taken at the first run.
+#define KERNEL_BENCH_BLOCK_MAX 256
+#define KERNEL_BENCH_ELEMENTS 8000   // A whole range of the default arena
+#define KERNEL_BENCH_TAPS 16         // Even, as arm_fir_init_q15 needs
+#define KERNEL_BENCH_REPEATS 5
+
+typedef struct
+{
+	float32_t a[KERNEL_BENCH_BLOCK_MAX];
+	float32_t b[KERNEL_BENCH_BLOCK_MAX];
+	float32_t out[2 * KERNEL_BENCH_BLOCK_MAX - 1];  // Correlations are longest
+	float32_t state[KERNEL_BENCH_TAPS + KERNEL_BENCH_BLOCK_MAX - 1];
+	float32_t coeffs[KERNEL_BENCH_TAPS];
+} kernel_bench_t;
+
+static kernel_bench_t *kernel_bench;
+static arm_fir_instance_f32 kernel_fir_f32;
+static arm_fir_instance_q15 kernel_fir_q15;
+static arm_fir_instance_q31 kernel_fir_q31;
+
+// The Q15 and Q31 kernels work in the same arrays
+#define KERNEL_Q15(array) ((q15_t *)kernel_bench->array)
+#define KERNEL_Q31(array) ((q31_t *)kernel_bench->array)
+
+// Inputs shaped like counts, from a fixed LCG so runs compare
+static void kernel_bench_fill(uint32_t block)
+{
+	uint32_t seed = 1;
+	for (uint32_t i = 0; i < block; i++)
+	{
+		seed = seed * 1664525 + 1013904223;
+		kernel_bench->a[i] = (seed >> 22) + 1.0f;
+		seed = seed * 1664525 + 1013904223;
+		kernel_bench->b[i] = (seed >> 22) + 1.0f;
+	}
+	for (uint32_t i = 0; i < KERNEL_BENCH_TAPS; i++)
+		kernel_bench->coeffs[i] = 1.0f / KERNEL_BENCH_TAPS;
+}
+
+// Converts the F32 inputs in place; the Q15 halves fit in the first
+// half of each array, so it runs from the front
+static void kernel_bench_fill_q15(uint32_t block)
+{
+	kernel_bench_fill(block);
+	for (uint32_t i = 0; i < block; i++)
+	{
+		KERNEL_Q15(a)[i] = (q15_t)kernel_bench->a[i] << 4;
+		KERNEL_Q15(b)[i] = (q15_t)kernel_bench->b[i] << 4;
+	}
+	for (uint32_t i = 0; i < KERNEL_BENCH_TAPS; i++)
+		KERNEL_Q15(coeffs)[i] = 0x8000 / KERNEL_BENCH_TAPS;
+	arm_fir_init_q15(&kernel_fir_q15, KERNEL_BENCH_TAPS, KERNEL_Q15(coeffs), KERNEL_Q15(state), block);
+}
+
+static void kernel_bench_fill_q31(uint32_t block)
+{
+	kernel_bench_fill(block);
+	for (uint32_t i = 0; i < block; i++)
+		KERNEL_Q31(a)[i] = (q31_t)kernel_bench->a[i] << 20;
+	for (uint32_t i = 0; i < KERNEL_BENCH_TAPS; i++)
+		KERNEL_Q31(coeffs)[i] = 0x80000000u / KERNEL_BENCH_TAPS;
+	arm_fir_init_q31(&kernel_fir_q31, KERNEL_BENCH_TAPS, KERNEL_Q31(coeffs), KERNEL_Q31(state), block);
+}
+
+static void kernel_bench_fill_f32(uint32_t block)
+{
+	kernel_bench_fill(block);
+	arm_fir_init_f32(&kernel_fir_f32, KERNEL_BENCH_TAPS, kernel_bench->coeffs, kernel_bench->state, block);
+}
+
+static void kernel_scale_f32(uint32_t n) { arm_scale_f32(kernel_bench->a, 0.75f, kernel_bench->out, n); }
+static void kernel_mult_f32(uint32_t n) { arm_mult_f32(kernel_bench->a, kernel_bench->b, kernel_bench->out, n); }
+static void kernel_offset_f32(uint32_t n) { arm_offset_f32(kernel_bench->a, -3.0f, kernel_bench->out, n); }
+static void kernel_add_f32(uint32_t n) { arm_add_f32(kernel_bench->a, kernel_bench->b, kernel_bench->out, n); }
+static void kernel_fir_f32_run(uint32_t n) { arm_fir_f32(&kernel_fir_f32, kernel_bench->a, kernel_bench->out, n); }
+static void kernel_correlate_f32(uint32_t n) { arm_correlate_f32(kernel_bench->a, n, kernel_bench->b, n, kernel_bench->out); }
+
+static void kernel_min_f32(uint32_t n)
+{
+	uint32_t index;
+	arm_min_f32(kernel_bench->a, n, &kernel_bench->out[0], &index);
+}
+
+static void kernel_sqrt_f32(uint32_t n)
+{
+	for (uint32_t i = 0; i < n; i++)
+		arm_sqrt_f32(kernel_bench->a[i], &kernel_bench->out[i]);
+}
+
+// What arm_mult_f32 is measured against
+static void kernel_loop_mult_f32(uint32_t n)
+{
+	for (uint32_t i = 0; i < n; i++)
+		kernel_bench->out[i] = kernel_bench->a[i] * kernel_bench->b[i];
+}
+
+static void kernel_scale_q15(uint32_t n) { arm_scale_q15(KERNEL_Q15(a), 0x6000, 0, KERNEL_Q15(out), n); }
+static void kernel_mult_q15(uint32_t n) { arm_mult_q15(KERNEL_Q15(a), KERNEL_Q15(b), KERNEL_Q15(out), n); }
+static void kernel_offset_q15(uint32_t n) { arm_offset_q15(KERNEL_Q15(a), -48, KERNEL_Q15(out), n); }
+static void kernel_add_q15(uint32_t n) { arm_add_q15(KERNEL_Q15(a), KERNEL_Q15(b), KERNEL_Q15(out), n); }
+static void kernel_fir_q15_run(uint32_t n) { arm_fir_q15(&kernel_fir_q15, KERNEL_Q15(a), KERNEL_Q15(out), n); }
+static void kernel_fir_fast_q15(uint32_t n) { arm_fir_fast_q15(&kernel_fir_q15, KERNEL_Q15(a), KERNEL_Q15(out), n); }
+static void kernel_correlate_q15(uint32_t n) { arm_correlate_q15(KERNEL_Q15(a), n, KERNEL_Q15(b), n, KERNEL_Q15(out)); }
+
+static void kernel_min_q15(uint32_t n)
+{
+	uint32_t index;
+	arm_min_q15(KERNEL_Q15(a), n, &KERNEL_Q15(out)[0], &index);
+}
+
+static void kernel_sqrt_q15(uint32_t n)
+{
+	for (uint32_t i = 0; i < n; i++)
+		arm_sqrt_q15(KERNEL_Q15(a)[i], &KERNEL_Q15(out)[i]);
+}
+
+// Saturating sums of pairs of halfwords with QADD16, to set against
+// arm_add_q15 and a loop of one element at a time
+static void kernel_simd_add_q15(uint32_t n)
+{
+	const uint32_t *a = (const uint32_t *)KERNEL_Q15(a), *b = (const uint32_t *)KERNEL_Q15(b);
+	uint32_t *out = (uint32_t *)KERNEL_Q15(out);
+	for (uint32_t i = 0; i < n / 2; i++)
+		out[i] = __QADD16(a[i], b[i]);
+}
+
+static void kernel_loop_add_q15(uint32_t n)
+{
+	for (uint32_t i = 0; i < n; i++)
+		KERNEL_Q15(out)[i] = (q15_t)__SSAT((int32_t)KERNEL_Q15(a)[i] + KERNEL_Q15(b)[i], 16);
+}
+
+static void kernel_loop_mult_q15(uint32_t n)
+{
+	for (uint32_t i = 0; i < n; i++)
+		KERNEL_Q15(out)[i] = (q15_t)__SSAT(((int32_t)KERNEL_Q15(a)[i] * KERNEL_Q15(b)[i]) >> 15, 16);
+}
+
+// Dot products of a block, the core of correlation, with SMLAD
+static void kernel_simd_dot_q15(uint32_t n)
+{
+	const uint32_t *a = (const uint32_t *)KERNEL_Q15(a), *b = (const uint32_t *)KERNEL_Q15(b);
+	int32_t sum = 0;
+	for (uint32_t i = 0; i < n / 2; i++)
+		sum = (int32_t)__SMLAD(a[i], b[i], (uint32_t)sum);
+	KERNEL_Q31(out)[0] = sum;
+}
+
+static void kernel_fir_q31_run(uint32_t n) { arm_fir_q31(&kernel_fir_q31, KERNEL_Q31(a), KERNEL_Q31(out), n); }
+
+typedef struct
+{
+	const char *name;
+	void (*fill)(uint32_t block);
+	void (*run)(uint32_t n);
+} kernel_t;
+
+static const kernel_t kernels[] =
+{
+	{ "scale_f32", kernel_bench_fill_f32, kernel_scale_f32 },
+	{ "mult_f32", kernel_bench_fill_f32, kernel_mult_f32 },
+	{ "loop_mult_f32", kernel_bench_fill_f32, kernel_loop_mult_f32 },
+	{ "offset_f32", kernel_bench_fill_f32, kernel_offset_f32 },
+	{ "add_f32", kernel_bench_fill_f32, kernel_add_f32 },
+	{ "min_f32", kernel_bench_fill_f32, kernel_min_f32 },
+	{ "sqrt_f32", kernel_bench_fill_f32, kernel_sqrt_f32 },
+	{ "fir_f32", kernel_bench_fill_f32, kernel_fir_f32_run },
+	{ "correlate_f32", kernel_bench_fill_f32, kernel_correlate_f32 },
+	{ "scale_q15", kernel_bench_fill_q15, kernel_scale_q15 },
+	{ "mult_q15", kernel_bench_fill_q15, kernel_mult_q15 },
+	{ "loop_mult_q15", kernel_bench_fill_q15, kernel_loop_mult_q15 },
+	{ "offset_q15", kernel_bench_fill_q15, kernel_offset_q15 },
+	{ "add_q15", kernel_bench_fill_q15, kernel_add_q15 },
+	{ "loop_add_q15", kernel_bench_fill_q15, kernel_loop_add_q15 },
+	{ "simd_add_q15", kernel_bench_fill_q15, kernel_simd_add_q15 },
+	{ "min_q15", kernel_bench_fill_q15, kernel_min_q15 },
+	{ "sqrt_q15", kernel_bench_fill_q15, kernel_sqrt_q15 },
+	{ "fir_q15", kernel_bench_fill_q15, kernel_fir_q15_run },
+	{ "fir_fast_q15", kernel_bench_fill_q15, kernel_fir_fast_q15 },
+	{ "correlate_q15", kernel_bench_fill_q15, kernel_correlate_q15 },
+	{ "simd_dot_q15", kernel_bench_fill_q15, kernel_simd_dot_q15 },
+	{ "fir_q31", kernel_bench_fill_q31, kernel_fir_q31_run },
+};
+
+// M1124 [<elements> [<block> [<repeats>]]] runs each kernel over elements
+// (default 8000) an even block (default 64, at most 256) at a time, repeats
+// (default 5) times, and replies "ok", "<elements> <block> <repeats>
+// <cpu hz>", then "<kernel> <cycles> <cycles per element x 100>" for the
+// fastest pass of each and a final "ok".  A correlation is of two blocks,
+// so it grows with the block.  The step interrupt still preempts the
+// kernels; taking the fastest pass leaves it out.
+static void command_m1124(const int32_t *argv, uint8_t argc)
+{
+	int32_t elements = argc > 0 ? argv[0] : KERNEL_BENCH_ELEMENTS;
+	int32_t block = argc > 1 ? argv[1] : CORRECTED_BLOCK_COLUMNS;
+	int32_t repeats = argc > 2 ? argv[2] : KERNEL_BENCH_REPEATS;
+	// Even counts, so the SIMD kernels take whole pairs
+	if (elements < 2 || elements > UINT16_MAX || (elements & 1) || block < 2 || block > KERNEL_BENCH_BLOCK_MAX
+		|| (block & 1) || repeats < 1 || repeats > 100)
+	{
+		reply_str("error: kernel benchmark requires an even 2 to 65534 elements and block of 2 to 256, and 1 to 100 repeats\n");
+		return;
+	}
+
+	if (!kernel_bench)
+		kernel_bench = pool_reserve(&sram_pool, "kernels", sizeof(kernel_bench_t));
+	if (!kernel_bench)
+	{
+		reply_str("error: no SRAM for the kernel benchmark\n");
+		return;
+	}
+
+	reply_str("ok\n");
+	reply_u32(elements);
+	reply_char(' ');
+	reply_u32(block);
+	reply_char(' ');
+	reply_u32(repeats);
+	reply_char(' ');
+	reply_u32(sysclk_get_cpu_hz());
+	reply_char('\n');
+
+	for (uint32_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++)
+	{
+		uint32_t best = UINT32_MAX;
+		for (int32_t r = 0; r < repeats; r++)
+		{
+			kernels[k].fill(block);
+			uint32_t start = profile_cycles();
+			for (int32_t done = 0; done < elements; done += block)
+				kernels[k].run(Min(block, elements - done));
+			best = Min(best, profile_cycles() - start);
+		}
+
+		reply_str(kernels[k].name);
+		reply_char(' ');
+		reply_u32(best);
+		reply_char(' ');
+		reply_u32((uint32_t)((uint64_t)best * 100 / elements));
+		reply_char('\n');
+	}
+	reply_str("ok\n");
+}
+
+// M1125 1 [<points> [<period ms> [<mask>]]] sends a preview of the head's
+// row every period ms (default 100) in at most points per channel
+// (default and most 256) of the channels in mask (default all), M1125 0
+// stops.  M1125 alone reports "<on> <points> <period> <mask> <sent>
+// <late> <level>", level the pyramid level the last was summed from, 0
+// for the live bins.
+static void command_m1125(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_str("ok\n");
+		reply_u32(preview_on);
+		reply_char(' ');
+		reply_u32(preview_points_max);
+		reply_char(' ');
+		reply_u32(preview_period);
+		reply_char(' ');
+		reply_u32(preview_mask);
+		reply_char(' ');
+		reply_u32(preview_sequence);
+		reply_char(' ');
+		reply_u32(preview_late);
+		reply_char(' ');
+		reply_u32(preview_level);
+		reply_char('\n');
+		return;
+	}
+
+	int32_t points = argc > 1 ? argv[1] : PREVIEW_POINTS;
+	int32_t period = argc > 2 ? argv[2] : PREVIEW_PERIOD_MS;
+	int32_t mask = argc > 3 ? argv[3] : (1 << Min(channel_count, COUNTER_CHANNELS)) - 1;
+	if ((argv[0] != 0 && argv[0] != 1) || points < 1 || points > PREVIEW_POINTS || period < 1 || period > UINT16_MAX
+		|| mask < 1 || mask >= (1 << Min(channel_count, COUNTER_CHANNELS)))
+	{
+		reply_str("error: preview requires 0 or 1, up to 256 points, a period of 1 to 65535 ms and a mask of counters\n");
+		return;
+	}
+
+	if (argv[0] && !preview)
+		preview = pool_reserve(&sram_pool, "preview",
+			sizeof(preview_header_t) + COUNTER_CHANNELS * PREVIEW_POINTS * sizeof(uint32_t));
+	if (argv[0] && !preview)
+	{
+		reply_str("error: no SRAM for the preview\n");
+		return;
+	}
+
+	preview_on = false;
+	if (argv[0])
+	{
+		preview_points_max = points;
+		preview_period = period;
+		preview_mask = mask;
+		preview_last = sof_count;
+		preview_sequence = 0;
+		preview_late = 0;
+		preview_on = true;
+	}
+	reply_str("ok\n");
+}
+
+// M1126 <channels> [<binned> [<code 0> <code 1>]] counts one detector at
+// channels thresholds at once (2 to the channels stored), its
+// discriminators on counters 0 up in order of rising threshold: the
+// first two set by the DACC as with M1091, given here or kept, and any
+// above from outside.  Binned (default 1) stores each channel's counts
+// less those of the channel above, so one pass gives the energy bins
+// and the top channel everything over the highest threshold; 0 stores
+// each channel's counts above its threshold.  M1126 0 ends the ladder.
+// M1126 alone reports "<channels> <binned> <code 0> <code 1>".  Step-edge
+// capture counts the primary alone, so it bins nothing.
+static void command_m1126(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_str("ok\n");
+		reply_u32(energy_channels);
+		reply_char(' ');
+		reply_u32(energy_binned);
+		reply_char(' ');
+		reply_u32(thresholds[0]);
+		reply_char(' ');
+		reply_u32(thresholds[1]);
+		reply_char('\n');
+		return;
+	}
+
+	int32_t channels = argv[0], binned = argc > 1 ? argv[1] : 1;
+	if ((channels != 0 && (channels < THRESHOLD_CHANNELS || channels > channel_count)) || (binned != 0 && binned != 1)
+		|| argc == 3)
+	{
+		reply_str("error: threshold ladder requires 0 or 2 up to the channels stored, 0 or 1 and two codes or none\n");
+		return;
+	}
+
+	if (argc > 3 && (argv[2] < 0 || argv[3] > THRESHOLD_MAX || argv[2] >= argv[3]))
+	{
+		reply_str("error: ladder codes must rise from 0 to 4095\n");
+		return;
+	}
+
+	uint16_t ladder = (1u << channels) - 1;
+	if ((channel_mask & ladder) != ladder)
+	{
+		reply_str("error: the ladder needs counters 0 up stored\n");
+		return;
+	}
+
+	if (enable_count || start_armed)
+	{
+		reply_str("error: counter is active\n");
+		return;
+	}
+
+	if (sweep_active || sweep_done)
+	{
+		reply_str("error: a threshold sweep is running\n");
+		return;
+	}
+
+	if (argc > 3)
+	{
+		threshold_set(0, argv[2]);
+		threshold_set(1, argv[3]);
+	}
+
+	irqflags_t flags = cpu_irq_save();
+	energy_channels = channels;
+	energy_binned = channels && binned;
+	cpu_irq_restore(flags);
+	reply_str("ok\n");
+}
+
+// Reset counts
+static void command_m1006(const int32_t *argv, uint8_t argc)
+{
+	if (!readout_stable())
+	{
+		reply_str("error: cannot reset counter while it is active\n");
+		return;
+	}
+
+#if COUNTER_SD_LOG
+	if (sd_log_writing)
+	{
+		reply_str("error: the readout bank is being logged\n");
+		return;
+	}
+#endif
+
+	// While acquiring into the other bank only the readout bank is cleared
+	if (enable_count)
+	{
+		clear_start(readout_bank, bank_bins);
+		memset((void *)&readout_totals, 0, sizeof(readout_totals));
+		memset((void *)dirty_readout, 0, sizeof(dirty_readout));
+	}
+	else
+		clear_counts();
+	reply_str("ok\n");
+}
+
+// Continue acquiring into a cleared bank and expose the current one for readout
+static void command_m1025(const int32_t *argv, uint8_t argc)
+{
+	if (row_sealing)
+	{
+		reply_str("error: rows are being sealed\n");
+		return;
+	}
+
+#if COUNTER_SD_LOG
+	if (sd_log_writing)
+	{
+		reply_str("error: the readout bank is being logged\n");
+		return;
+	}
+#endif
+
+	if (cine_on)
+	{
+		reply_str("error: cine frames are being counted\n");
+		return;
+	}
+
+	if (!bank_swap())
+	{
+		reply_str("error: count buffer is too large for two banks\n");
+		return;
+	}
+
+	reply_str("ok\n");
+}
+
+// Cine acquisition: M1103 <frames> [<period ms>] clears the counts and
+// keeps the next frames in a ring of that many banks, moving on every
+// period ms or, with no period, at the end of each scan.  M1103 0 goes
+// back to a single frame from bank 0.  M1103 reports
+// "<frames> <period> <oldest> <counting>", frames 0 when off.
+static void command_m1103(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_str("ok\n");
+		reply_u32(cine_on ? cine_frames : 0);
+		reply_char(' ');
+		reply_u32(cine_period);
+		reply_char(' ');
+		reply_u32(cine_read);
+		reply_char(' ');
+		reply_u32(cine_written);
+		reply_char('\n');
+		return;
+	}
+
+	int32_t frames = argv[0], period = argc > 1 ? argv[1] : 0;
+	if (frames == 1 || frames < 0 || frames > CINE_FRAMES_MAX || period < 0)
+	{
+		reply_str("error: cine command requires 0, or 2-32 frames and a period in ms\n");
+		return;
+	}
+
+	if (enable_count)
+	{
+		reply_str("error: counter is active\n");
+		return;
+	}
+
+#if COUNT_PACKED_CHANNELS
+	if (frames)
+	{
+		reply_str("error: packed channels have escape tables for two banks\n");
+		return;
+	}
+#endif
+
+	if ((uint32_t)frames * bank_bins > COUNT_ARENA_BINS)
+	{
+		reply_str("error: count buffer is too large for that many frames\n");
+		return;
+	}
+
+	if (frames && (row_sealing || defer_columns))
+	{
+		reply_str("error: rows are being sealed or columns deferred\n");
+		return;
+	}
+
+#if COUNTER_SD_LOG
+	if (sd_log_writing)
+	{
+		reply_str("error: the readout bank is being logged\n");
+		return;
+	}
+#endif
+
+	clear_wait();
+	irqflags_t flags = cpu_irq_save();
+	cine_on = frames != 0;
+	cine_frames = frames;
+	cine_period = period;
+	count_bank = 0;
+	readout_bank = 0;
+	cpu_irq_restore(flags);
+	clear_counts();
+	reply_str("ok\n");
+}
+
+// Select a cine frame for readout: M1104 <frame> makes the readouts read
+// frame <frame>, and releases the frames before it for counting.  The
+// frame being counted can only be read once counting has stopped.
+static void command_m1104(const int32_t *argv, uint8_t argc)
+{
+	if (!cine_on)
+	{
+		reply_str("error: cine is off\n");
+		return;
+	}
+
+	if (argc < 1)
+	{
+		reply_str("error: cine frame command requires a frame\n");
+		return;
+	}
+
+	uint32_t frame = argv[0];
+	if (argv[0] < 0 || frame < cine_read || frame > cine_written)
+	{
+		reply_str("error: frame is not held\n");
+		return;
+	}
+
+	if (frame == cine_written && enable_count)
+	{
+		reply_str("error: frame is still being counted\n");
+		return;
+	}
+
+#if COUNTER_SD_LOG
+	if (sd_log_writing)
+	{
+		reply_str("error: the readout bank is being logged\n");
+		return;
+	}
+#endif
+
+	// A job would carry on from the new bank
+	if (readout_job.kind != READOUT_JOB_NONE)
+	{
+		reply_str("error: a readout is being sent\n");
+		return;
+	}
+
+	flash_log_wait();
+	readout_bank = cine_bank(frame);
+	cine_read = frame;
+	reply_str("ok\n");
+}
+
+// Once a stop condition has ended counting, swaps out the frame if asked
+// and pushes the stop to the host
+static void stop_poll(void)
+{
+	if (!stop_fired)
+		return;
+
+	stop_fired = false;
+	bool swap = (stop_event.kind == STOP_SCAN ? stop_scan_swap : stop_swap) && !row_sealing;
+#if COUNTER_SD_LOG
+	swap = swap && !sd_log_writing;
+#endif
+	stop_event.magic = STOP_MAGIC;
+	stop_event.swapped = swap && bank_swap();
+	push_time(STOP_MAGIC);
+	write_binary(&stop_event, sizeof(stop_event));
+}
+
+// M1085 reports the stop condition as "<kind> <target> <swap> <columns>";
+// M1085 <kind> <target> [<swap>] stops counting once <target> columns
+// have been committed (1), the head reaches column <target> from the
+// origin (2) or <target> ms have been counted (3), and M1085 0 clears
+// it.  Columns count from the start of counting, or from M1085 if it
+// comes later.  With <swap> 1 the stopped frame is swapped out for
+// readout as by M1025.  Either way a stop_push_t follows.
+static void command_m1085(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_str("ok\n");
+		reply_u32(stop_kind);
+		reply_char(' ');
+		reply_i32(stop_kind == STOP_POSITION ? stop_target - head_origin : stop_target);
+		reply_char(' ');
+		reply_u32(stop_swap);
+		reply_char(' ');
+		reply_u32(stop_columns);
+		reply_char('\n');
+		return;
+	}
+
+	int32_t kind = argv[0], target = argv[1];
+	bool swap = argc > 2 && argv[2];
+	if (kind < STOP_OFF || kind > STOP_TIME || (kind != STOP_OFF && argc < 2)
+		|| (argc > 2 && argv[2] != 0 && argv[2] != 1))
+	{
+		reply_str("error: stop command requires a kind of 0 to 3, a target and a swap of 0 or 1\n");
+		return;
+	}
+
+	if (kind == STOP_OFF)
+	{
+		stop_kind = STOP_OFF;
+		reply_str("ok\n");
+		return;
+	}
+
+	if (kind == STOP_POSITION ? target + head_origin < 0 || target + head_origin >= travel_columns : target < 1)
+	{
+		reply_str("error: stop target is out of range\n");
+		return;
+	}
+
+#if !COUNTER_POSITION_QDEC
+	// capture_poll moves the head outside the interrupts
+	if (kind != STOP_TIME && count_mode == COUNT_MODE_CAPTURE)
+	{
+		reply_str("error: capture mode does not commit from the step interrupt\n");
+		return;
+	}
+#endif
+
+	if (swap && 2 * bank_bins > COUNT_ARENA_BINS)
+	{
+		reply_str("error: count buffer is too large for two banks\n");
+		return;
+	}
+
+	// The kind goes last, so the interrupts never see it with the old target
+	stop_kind = STOP_OFF;
+	stop_columns = 0;
+	stop_target = kind == STOP_POSITION ? target + head_origin : target;
+	stop_swap = swap;
+	stop_kind = kind;
+	reply_str("ok\n");
+}
+
+// Pre-trigger history: M1112 <post> [<swap>] keeps counting into the
+// arena, the head wrapping around it as the ring of what came before,
+// until a rising edge of START_PIN or M1113 triggers it.  Counting then
+// stops <post> columns later, pushing a stop_push_t of kind
+// STOP_TRIGGER, so the frozen arena holds column_count - <post> columns
+// from before the trigger and <post> from after, the last at the
+// position pushed.  It runs best on the timed commit path (M1032),
+// where columns follow time.  <swap> and M1085 0 are as for M1085.
+// M1112 alone reports "<armed> <triggered> <columns since>".
+static void command_m1112(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_str("ok\n");
+		reply_u32(stop_kind == STOP_TRIGGER);
+		reply_char(' ');
+		reply_u32(stop_triggered);
+		reply_char(' ');
+		reply_u32(stop_triggered ? stop_columns : 0);
+		reply_char('\n');
+		return;
+	}
+
+	int32_t post = argv[0];
+	if (post < 0 || post >= column_count || (argc > 1 && argv[1] != 0 && argv[1] != 1))
+	{
+		reply_str("error: trigger command requires fewer post-trigger columns than the arena and a swap of 0 or 1\n");
+		return;
+	}
+
+#if !COUNTER_POSITION_QDEC
+	if (count_mode == COUNT_MODE_CAPTURE)
+	{
+		reply_str("error: capture mode does not commit from the step interrupt\n");
+		return;
+	}
+#endif
+
+	bool swap = argc > 1 && argv[1];
+	if (swap && 2 * bank_bins > COUNT_ARENA_BINS)
+	{
+		reply_str("error: count buffer is too large for two banks\n");
+		return;
+	}
+
+	// The kind goes last, as for M1085
+	stop_kind = STOP_OFF;
+	stop_triggered = false;
+	stop_columns = 0;
+	stop_target = post;
+	stop_swap = swap;
+	stop_kind = STOP_TRIGGER;
+	reply_str("ok\n");
+}
+
+// Trigger M1112 from the host
+static void command_m1113(const int32_t *argv, uint8_t argc)
+{
+	if (stop_kind != STOP_TRIGGER || !enable_count)
+	{
+		reply_str("error: no trigger is armed while counting\n");
+		return;
+	}
+
+	irqflags_t flags = cpu_irq_save();
+	stop_trigger();
+	cpu_irq_restore(flags);
+	reply_str("ok\n");
+}
+
+#if !COUNTER_POSITION_QDEC
+// M1086 reports "<mode> <offset> <edges> <position>" for the home input;
+// M1086 <mode> [<offset>] sets it to 0 (off), 1 (home on the next edge),
+// 2 (home on every edge) or 3 (only record the position).  Homing puts
+// the head at column <offset> from the origin.  Position is where the
+// head was, from the origin, as the last edge arrived, so against
+// <offset> it gives the steps lost over a pass.
+static void command_m1086(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_str("ok\n");
+		reply_u32(home_mode);
+		reply_char(' ');
+		reply_i32(home_offset);
+		reply_char(' ');
+		reply_u32(home_edges);
+		reply_char(' ');
+		reply_i32(home_position);
+		reply_char('\n');
+		return;
+	}
+
+	int32_t mode = argv[0], offset = argc > 1 ? argv[1] : 0;
+	if (mode < HOME_OFF || mode > HOME_RECORD)
+	{
+		reply_str("error: home command requires a mode of 0 to 3\n");
+		return;
+	}
+
+	if (offset + head_origin < 0 || offset + head_origin >= travel_columns)
+	{
+		reply_str("error: home offset is outside the travel\n");
+		return;
+	}
+
+	// The head follows something other than the step interrupt
+	if (mode != HOME_OFF && (count_mode == COUNT_MODE_CAPTURE || timed_active))
+	{
+		reply_str("error: the head does not follow the step input\n");
+		return;
+	}
+
+#if COUNTER_SYNC
+	if (mode != HOME_OFF && sync_mode == SYNC_MODE_SLAVE)
+	{
+		reply_str("error: columns follow the sync master\n");
+		return;
+	}
+#endif
+
+	home_mode = HOME_OFF;
+	home_offset = offset;
+	home_edges = 0;
+	home_mode = mode;
+	reply_str("ok\n");
+}
+#endif
+
+// The ARENA_TRACK_* of the current partition
+static uint8_t arena_tracks(void)
+{
+	return (time_track ? ARENA_TRACK_TIME : 0) | (coincidence_track ? ARENA_TRACK_COINCIDENCES : 0)
+		| (dwell_track ? ARENA_TRACK_DWELL : 0) | (analog_track ? ARENA_TRACK_ANALOG : 0);
+}
+
+// The current tracks with track added or removed
+static uint8_t arena_tracks_with(uint8_t track, bool enable)
+{
+	return enable ? arena_tracks() | track : arena_tracks() & ~track;
+}
+
+// Apply an arena partition, with the ARENA_TRACK_* in tracks.
+// Returns false, changing nothing, if it does not fit in the arena.
+static bool partition_arena(int32_t columns, int32_t rows, int32_t channels, uint8_t tracks)
+{
+	if (channels < 1 || channels > (counter_chained ? COUNTER_CHAIN_CHANNELS : COUNTER_CHANNELS) || columns < 1 || columns > UINT16_MAX || rows < 1 || rows > UINT16_MAX
+		|| (uint32_t)columns * rows > UINT16_MAX)
+		return false;
+
+	uint32_t cells = columns * rows;
+	uint32_t bins = COUNT_CELL_BINS(cells, channels) + ((tracks & ARENA_TRACK_TIME) ? TIME_TRACK_BINS(cells) : 0)
+		+ ((tracks & ARENA_TRACK_COINCIDENCES) ? COINCIDENCE_TRACK_BINS(cells) : 0);
+	uint32_t analog = bins;
+	if (tracks & ARENA_TRACK_ANALOG)
+		bins += ANALOG_TRACK_BINS(cells);
+	uint32_t dwell = (bins + sizeof(uint32_t) / sizeof(count_t) - 1) & ~(sizeof(uint32_t) / sizeof(count_t) - 1);
+	if (tracks & ARENA_TRACK_DWELL)
+		bins = dwell + DWELL_TRACK_BINS(cells);
+	if (bins > COUNT_ARENA_BINS)
+		return false;
+
+	// The head may be beyond the new last column, so start over
+	clear_wait();
+	defer_poll();
+	irqflags_t flags = cpu_irq_save();
+	column_count = columns;
+	window_start = 0;
+	travel_columns = columns;
+	head_origin = 0;
+	row_count = rows;
+	cell_count = cells;
+	channel_count = channels;
+	time_track = tracks & ARENA_TRACK_TIME;
+	coincidence_track = tracks & ARENA_TRACK_COINCIDENCES;
+	dwell_track = tracks & ARENA_TRACK_DWELL;
+	dwell_offset = dwell;
+	analog_track = tracks & ARENA_TRACK_ANALOG;
+	analog_offset = analog;
+	bank_bins = (bins + COUNT_BANK_ALIGN - 1) & ~(COUNT_BANK_ALIGN - 1);
+	count_bank = 0;
+	readout_bank = 0;
+	cine_on = false;
+	// A new number of channels takes the first counters
+	if (__builtin_popcount(channel_mask) != channels)
+	{
+		channel_mask = (1u << channels) - 1;
+		channel_map();
+	}
+	cpu_irq_restore(flags);
+	zero_position();
+	clear_counts();
+	// Cells are numbered afresh
+	pass_clear();
+	return true;
+}
+
+// Partition the count arena: M1023 <columns> <channels> [<rows>]
+static void command_m1023(const int32_t *argv, uint8_t argc)
+{
+	if (enable_count)
+	{
+		reply_str("error: cannot change the count buffer while the counter is active\n");
+		return;
+	}
+
+	if (frame_store_on)
+	{
+		reply_str("error: the frame store holds rows of the current buffer\n");
+		return;
+	}
+
+	if (argc < 2)
+	{
+		reply_str("error: buffer command requires two or three arguments\n");
+		return;
+	}
+
+	int32_t columns = argv[0], channels = argv[1], rows = argc > 2 ? argv[2] : 1;
+	if (!partition_arena(columns, rows, channels, arena_tracks()))
+	{
+		reply_str("error: invalid buffer size\n");
+		return;
+	}
+
+	reply_str("ok\n");
+}
+
+// Select the channels: M1106 <mask> stores counter channel n for each
+// bit n of mask, as channels 0 up in order, and partitions the arena for
+// that many at the present columns and rows, clearing the counts.  The
+// step interrupt reads only the counters stored.  M1023 stores the
+// first <channels> counters again.  M1106 reports the mask.
+static void command_m1106(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_str("ok\n");
+		reply_u32(channel_mask);
+		reply_char('\n');
+		return;
+	}
+
+	if (argv[0] <= 0 || argv[0] >= (1 << COUNTER_CHANNELS))
+	{
+		reply_str("error: channel mask must select from the counter channels\n");
+		return;
+	}
+
+	if (enable_count || start_armed)
+	{
+		reply_str("error: counter is active\n");
+		return;
+	}
+
+	if (frame_store_on)
+	{
+		reply_str("error: the frame store holds rows of the current buffer\n");
+		return;
+	}
+
+	uint16_t mask = argv[0];
+	if (counter_chained && (!(mask & 1) || (mask & (1u << COUNTER_CHAIN_HIGH))))
+	{
+		reply_str("error: the primary channel is chained\n");
+		return;
+	}
+
+	if (!partition_arena(column_count, row_count, __builtin_popcount(mask), arena_tracks()))
+	{
+		reply_str("error: invalid buffer size\n");
+		return;
+	}
+
+	irqflags_t flags = cpu_irq_save();
+	channel_mask = mask;
+	channel_map();
+	cpu_irq_restore(flags);
+	reply_str("ok\n");
+}
+
+// Place the buffer columns in a longer travel.  Returns false, changing
+// nothing, unless the window fits in the travel.
+static bool set_window(int32_t start, int32_t travel)
+{
+	if (start < 0 || travel > UINT16_MAX || start + column_count > travel || head_origin >= travel)
+		return false;
+
+	irqflags_t flags = cpu_irq_save();
+	window_start = start;
+	travel_columns = travel;
+	cpu_irq_restore(flags);
+	// The head may be beyond the new travel
+	zero_position();
+	return true;
+}
+
+// Acquisition window: M1054 <start> <travel> stores only the columns
+// from start to start + column_count - 1 of a head travel of travel
+// columns.  M1054 reports "<start> <end> <travel>".
+static void command_m1054(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_str("ok\n");
+		reply_u32(window_start);
+		reply_char(' ');
+		reply_u32(window_start + column_count - 1);
+		reply_char(' ');
+		reply_u32(travel_columns);
+		reply_char('\n');
+		return;
+	}
+
+	if (enable_count)
+	{
+		reply_str("error: cannot change the window while the counter is active\n");
+		return;
+	}
+
+	if (argc < 2 || !set_window(argv[0], argv[1]))
+	{
+		reply_str("error: window does not fit in the travel\n");
+		return;
+	}
+
+	reply_str("ok\n");
+}
+
+// Travel ends: M1055 <0|1> [origin] wraps around (0) or stops at hard
+// limits (1), with position 0 at travel column origin.  M1055 reports
+// "<limits> <origin> <steps beyond the limits>".
+static void command_m1055(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_str("ok\n");
+		reply_u32(head_limits);
+		reply_char(' ');
+		reply_u32(head_origin);
+		reply_char(' ');
+		reply_u32(limit_steps);
+		reply_char('\n');
+		return;
+	}
+
+	if (enable_count)
+	{
+		reply_str("error: cannot change the limits while the counter is active\n");
+		return;
+	}
+
+	int32_t origin = argc > 1 ? argv[1] : 0;
+	if ((argv[0] != 0 && argv[0] != 1) || origin < 0 || origin >= travel_columns)
+	{
+		reply_str("error: invalid limits\n");
+		return;
+	}
+
+	head_limits = argv[0];
+	head_origin = origin;
+	limit_steps = 0;
+	zero_position();
+	reply_str("ok\n");
+}
+
+// Record when each cell was last left: M1030 <0/1>
+static void command_m1030(const int32_t *argv, uint8_t argc)
+{
+	if (enable_count)
+	{
+		reply_str("error: cannot change the count buffer while the counter is active\n");
+		return;
+	}
+
+	int32_t enable = argv[0];
+	if (argc < 1 || (enable != 0 && enable != 1))
+	{
+		reply_str("error: timestamp command requires an argument of 0 or 1\n");
+		return;
+	}
+
+	if (!partition_arena(column_count, row_count, channel_count, arena_tracks_with(ARENA_TRACK_TIME, enable)))
+	{
+		reply_str("error: count buffer is too small for timestamps\n");
+		return;
+	}
+
+	reply_str("ok\n");
+}
+
+// Read the timestamp track in binary: M1031 <start> <end>
+static void command_m1031(const int32_t *argv, uint8_t argc)
+{
+	if (!readout_stable())
+	{
+		reply_str("error: cannot read counter while it is active\n");
+		return;
+	}
+
+	if (!time_track)
+	{
+		reply_str("error: timestamps are not enabled\n");
+		return;
+	}
+
+	if (argc < 2)
+	{
+		reply_str("error: read command requires two arguments\n");
+		return;
+	}
+
+	int32_t start = argv[0], end = argv[1];
+	if (!validate_column_range(start, end))
+		return;
+
+	readout_header_t header;
+	header.channel = READOUT_TIMESTAMPS;
+	header.start = start;
+	header.end = end;
+	header.length = (end - start + 1) * sizeof(uint16_t);
+	header.crc = 0xFFFF;
+	header.width = sizeof(uint16_t);
+	header.flags = 0;
+	header.reserved = sof_count;
+	readout_emit(&COUNT_TIME(start), header.length, &header.crc);
+
+	reply_str("ok\n");
+	if (readout_send_header(&header))
+		readout_job_start(READOUT_JOB_TIME, 1, false, start, end);
+}
+
+// Coincidence detection: M1073 <0|1> [<window ns>] adds or removes the
+// coincidence track (a fresh partition, like M1030) and starts or stops
+// timing the inputs.  M1073 reports "<on> <window ns> <coincidences>".
+static void command_m1073(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_str("ok\n");
+		reply_u32(coincidence_track);
+		reply_char(' ');
+		reply_u32(coincidence_window_ns);
+		reply_char(' ');
+		reply_u32(coincidence_total);
+		reply_char('\n');
+		return;
+	}
+
+	if (enable_count)
+	{
+		reply_str("error: cannot change the count buffer while the counter is active\n");
+		return;
+	}
+
+	int32_t enable = argv[0], window = argc > 1 ? argv[1] : COINCIDENCE_WINDOW_NS;
+	if ((enable != 0 && enable != 1) || window < 1 || window > COINCIDENCE_WINDOW_MAX_NS)
+	{
+		reply_str("error: coincidence command requires 0, or 1 and a window of 1-65535 ns\n");
+		return;
+	}
+
+	pio_disable_interrupt(COINCIDENCE_PIO, COINCIDENCE_PINS);
+	if (!partition_arena(column_count, row_count, channel_count, arena_tracks_with(ARENA_TRACK_COINCIDENCES, enable)))
+	{
+		reply_str("error: count buffer is too small for coincidences\n");
+		return;
+	}
+
+	if (enable)
+	{
+		// Rounded up, so that no window is shorter than asked for
+		coincidence_window_ns = window;
+		coincidence_window = ((uint64_t)window * sysclk_get_cpu_hz() + 999999999) / 1000000000;
+		coincidence_seen = 0;
+		coincidence_total = 0;
+		coincidence_committed = 0;
+		(void)COINCIDENCE_PIO->PIO_ISR;
+		pio_enable_interrupt(COINCIDENCE_PIO, COINCIDENCE_PINS);
+	}
+
+	reply_str("ok\n");
+}
+
+// Read the coincidence track in binary: M1074 <start> <end>
+static void command_m1074(const int32_t *argv, uint8_t argc)
+{
+	if (!readout_stable())
+	{
+		reply_str("error: cannot read counter while it is active\n");
+		return;
+	}
+
+	if (!coincidence_track)
+	{
+		reply_str("error: coincidences are not enabled\n");
+		return;
+	}
+
+	if (argc < 2)
+	{
+		reply_str("error: read command requires two arguments\n");
+		return;
+	}
+
+	int32_t start = argv[0], end = argv[1];
+	if (!validate_column_range(start, end))
+		return;
+
+	readout_header_t header;
+	header.channel = READOUT_COINCIDENCES;
+	header.start = start;
+	header.end = end;
+	header.length = (end - start + 1) * sizeof(uint16_t);
+	header.crc = 0xFFFF;
+	header.width = sizeof(uint16_t);
+	header.flags = 0;
+	header.reserved = coincidence_window_ns;
+	readout_emit(&COUNT_COINCIDENCE(start), header.length, &header.crc);
+
+	reply_str("ok\n");
+	if (readout_send_header(&header))
+		readout_job_start(READOUT_JOB_COINCIDENCES, 1, false, start, end);
+}
+
+// Record how long the head dwells in each cell: M1075 <0|1> adds or
+// removes the dwell track, a fresh partition like M1030.  M1075 reports
+// "<on>".
+static void command_m1075(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_str("ok\n");
+		reply_u32(dwell_track);
+		reply_char('\n');
+		return;
+	}
+
+	if (enable_count)
+	{
+		reply_str("error: cannot change the count buffer while the counter is active\n");
+		return;
+	}
+
+	int32_t enable = argv[0];
+	if (enable != 0 && enable != 1)
+	{
+		reply_str("error: dwell command requires an argument of 0 or 1\n");
+		return;
+	}
+
+	if (!partition_arena(column_count, row_count, channel_count, arena_tracks_with(ARENA_TRACK_DWELL, enable)))
+	{
+		reply_str("error: count buffer is too small for dwell times\n");
+		return;
+	}
+
+	reply_str("ok\n");
+}
+
+// Read counts per second in binary: M1076 <channel> <start> <end>
+static void command_m1076(const int32_t *argv, uint8_t argc)
+{
+	if (!readout_stable())
+	{
+		reply_str("error: cannot read counter while it is active\n");
+		return;
+	}
+
+	if (!dwell_track)
+	{
+		reply_str("error: dwell times are not enabled\n");
+		return;
+	}
+
+	int32_t channel, start, end;
+	if (!parse_readout_args(argv, argc, &channel, &start, &end))
+		return;
+
+	readout_header_t header;
+	header.channel = READOUT_RATES;
+	header.start = start;
+	header.end = end;
+	header.length = (end - start + 1) * sizeof(uint32_t);
+	header.crc = 0xFFFF;
+	header.width = sizeof(uint32_t);
+	header.flags = readout_flags(channel, start, end);
+	header.reserved = channel;
+	rate_payload(channel, start, end, &header.crc);
+
+	reply_str("ok\n");
+	if (readout_send_header(&header))
+		readout_job_start(READOUT_JOB_RATES, 1u << channel, false, start, end);
+}
+
+// Codes of M1093 for the AFEC_EMR_RES averaging, 1 to 4 for 13 to 16 bits
+static const uint32_t analog_resolutions[] =
+{
+	AFEC_EMR_RES_NO_AVERAGE, AFEC_EMR_RES_OSR4, AFEC_EMR_RES_OSR16, AFEC_EMR_RES_OSR64, AFEC_EMR_RES_OSR256,
+};
+static uint8_t analog_averaging;
+
+static void analog_start(void)
+{
+	pmc_enable_periph_clk(ANALOG_AFEC_ID);
+	ANALOG_AFEC->AFEC_CR = AFEC_CR_SWRST;
+	// AFEClock is MCK / ((PRESCAL + 1) * 2)
+	uint32_t prescal = (sysclk_get_peripheral_hz() / 2 + ANALOG_CLOCK_HZ - 1) / ANALOG_CLOCK_HZ - 1;
+	ANALOG_AFEC->AFEC_MR = AFEC_MR_FREERUN_ON | AFEC_MR_PRESCAL(prescal) | AFEC_MR_STARTUP_SUT64
+		| AFEC_MR_SETTLING_AST3 | AFEC_MR_TRACKTIM(2) | AFEC_MR_TRANSFER(1);
+	ANALOG_AFEC->AFEC_EMR = analog_resolutions[analog_averaging];
+	ANALOG_AFEC->AFEC_ACR = AFEC_ACR_IBCTL(1);
+	// Single-ended inputs convert about the middle of the offset DAC
+	for (uint8_t input = 0; input < ANALOG_INPUTS; input++)
+	{
+		ANALOG_AFEC->AFEC_CSELR = input;
+		ANALOG_AFEC->AFEC_COCR = AFEC_COCR_AOFF(0x800);
+	}
+	ANALOG_AFEC->AFEC_CHER = (1u << ANALOG_INPUTS) - 1;
+	ANALOG_AFEC->AFEC_CR = AFEC_CR_START;
+}
+
+static void analog_stop(void)
+{
+	ANALOG_AFEC->AFEC_CHDR = (1u << ANALOG_INPUTS) - 1;
+	pmc_disable_periph_clk(ANALOG_AFEC_ID);
+}
+
+// Sample the AFEC inputs per column: M1093 <0|1> [<averaging>] adds or
+// removes the analog track, a fresh partition like M1030, with
+// averaging 0 for 12-bit samples or 1 to 4 for 13 to 16 bits (over 4
+// to 256 conversions).  M1093 reports "<on> <averaging> <input 0>
+// <input 1>", the latest samples.
+static void command_m1093(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		uint32_t samples[ANALOG_INPUTS] = { 0 };
+		if (analog_track)
+		{
+			irqflags_t flags = cpu_irq_save();
+			for (uint8_t input = 0; input < ANALOG_INPUTS; input++)
+			{
+				ANALOG_AFEC->AFEC_CSELR = input;
+				samples[input] = ANALOG_AFEC->AFEC_CDR;
+			}
+			cpu_irq_restore(flags);
+		}
+
+		reply_str("ok\n");
+		reply_u32(analog_track);
+		reply_char(' ');
+		reply_u32(analog_averaging);
+		for (uint8_t input = 0; input < ANALOG_INPUTS; input++)
+		{
+			reply_char(' ');
+			reply_u32(samples[input]);
+		}
+		reply_char('\n');
+		return;
+	}
+
+	if (enable_count)
+	{
+		reply_str("error: cannot change the count buffer while the counter is active\n");
+		return;
+	}
+
+	int32_t enable = argv[0], averaging = argc > 1 ? argv[1] : 0;
+	if ((enable != 0 && enable != 1) || averaging < 0 || averaging >= (int32_t)(sizeof(analog_resolutions) / sizeof(analog_resolutions[0])))
+	{
+		reply_str("error: analog command requires 0, or 1 and an averaging of 0-4\n");
+		return;
+	}
+
+	if (!partition_arena(column_count, row_count, channel_count, arena_tracks_with(ARENA_TRACK_ANALOG, enable)))
+	{
+		reply_str("error: count buffer is too small for analog samples\n");
+		return;
+	}
+
+	if (enable)
+	{
+		analog_averaging = averaging;
+		analog_start();
+	}
+	else
+		analog_stop();
+	reply_str("ok\n");
+}
+
+// Read the analog track of one input in binary: M1094 <input> <start> <end>
+static void command_m1094(const int32_t *argv, uint8_t argc)
+{
+	if (!readout_stable())
+	{
+		reply_str("error: cannot read counter while it is active\n");
+		return;
+	}
+
+	if (!analog_track)
+	{
+		reply_str("error: analog samples are not enabled\n");
+		return;
+	}
+
+	if (argc < 3)
+	{
+		reply_str("error: read command requires three arguments\n");
+		return;
+	}
+
+	int32_t input = argv[0], start = argv[1], end = argv[2];
+	if (input < 0 || input >= ANALOG_INPUTS)
+	{
+		reply_str("error: invalid analog input\n");
+		return;
+	}
+
+	if (!validate_column_range(start, end))
+		return;
+
+	readout_header_t header;
+	header.channel = READOUT_ANALOG;
+	header.start = start;
+	header.end = end;
+	header.length = (end - start + 1) * sizeof(uint16_t);
+	header.crc = 0xFFFF;
+	header.width = sizeof(uint16_t);
+	header.flags = 0;
+	header.reserved = input;
+	readout_emit(&COUNT_ANALOG(input, start), header.length, &header.crc);
+
+	reply_str("ok\n");
+	if (readout_send_header(&header))
+		readout_job_start(READOUT_JOB_ANALOG, 1u << input, false, start, end);
+}
+
+// Read counts with their Poisson uncertainty in binary:
+// M1095 <channel> <start> <end>
+// Each cell is its uint32_t count then sqrt(count) in UNCERTAINTY_SHIFT
+// fixed point.
+static void command_m1095(const int32_t *argv, uint8_t argc)
+{
+	if (!readout_stable())
+	{
+		reply_str("error: cannot read counter while it is active\n");
+		return;
+	}
+
+	int32_t channel, start, end;
+	if (!parse_readout_args(argv, argc, &channel, &start, &end))
+		return;
+
+	readout_header_t header;
+	header.channel = READOUT_UNCERTAINTY;
+	header.start = start;
+	header.end = end;
+	header.length = (end - start + 1) * 2 * sizeof(uint32_t);
+	header.crc = 0xFFFF;
+	header.width = sizeof(uint32_t);
+	header.flags = readout_flags(channel, start, end);
+	header.reserved = channel;
+	uncertainty_payload(channel, start, end, &header.crc);
+
+	reply_str("ok\n");
+	if (readout_send_header(&header))
+		readout_job_start(READOUT_JOB_UNCERTAINTY, 1u << channel, false, start, end);
+}
+
+// Set the FIR filter of M1097, packed like the gain map:
+// M1096 <first> <taps>..., each argument two signed Q15 taps, low half
+// first.  Writing taps from first on makes the filter end with the last
+// of them, so a filter is sent from 0 up, and M1096 0 removes it.
+// M1096 alone reports the taps.
+static void command_m1096(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		for (uint8_t i = 0; i < smooth_tap_count; i++)
+		{
+			if (i)
+				reply_char(' ');
+			reply_i32(smooth_taps[i]);
+		}
+		reply_char('\n');
+		return;
+	}
+
+	int32_t first = argv[0];
+	uint32_t count = 2 * (argc - 1);
+	if (first < 0 || first > smooth_tap_count || first + count > SMOOTH_TAPS_MAX)
+	{
+		reply_str("error: invalid filter taps\n");
+		return;
+	}
+
+	smooth_tap_count = first + count;
+	for (uint8_t i = 1; i < argc; i++)
+	{
+		smooth_taps[first++] = (int16_t)((uint32_t)argv[i] & 0xFFFF);
+		smooth_taps[first++] = (int16_t)((uint32_t)argv[i] >> 16);
+	}
+	reply_str("ok\n");
+}
+
+// Read counts through the M1096 filter in binary: M1097 <channel> <start> <end>
+static void command_m1097(const int32_t *argv, uint8_t argc)
+{
+	if (!readout_stable())
+	{
+		reply_str("error: cannot read counter while it is active\n");
+		return;
+	}
+
+	if (!smooth_tap_count)
+	{
+		reply_str("error: no filter is set\n");
+		return;
+	}
+
+	int32_t channel, start, end;
+	if (!parse_readout_args(argv, argc, &channel, &start, &end))
+		return;
+
+	readout_header_t header;
+	header.channel = READOUT_SMOOTHED;
+	header.start = start;
+	header.end = end;
+	header.length = (end - start + 1) * sizeof(uint32_t);
+	header.crc = 0xFFFF;
+	header.width = sizeof(uint32_t);
+	header.flags = readout_flags(channel, start, end);
+	header.reserved = channel;
+	smooth_begin(channel, start, end);
+	smoothed_payload(start, end, &header.crc);
+
+	reply_str("ok\n");
+	if (readout_send_header(&header))
+		readout_job_start(READOUT_JOB_SMOOTHED, 1u << channel, false, start, end);
+}
+
+// Upload the position calibration of M1108: M1107 <spacing> <first> <um>...
+// gives knots first on, the positions in micrometres of columns
+// (first + i) * spacing, which must increase.  Writing knots from first
+// on makes the calibration end with the last of them, so it is sent
+// from 0 up, and M1107 <spacing> 0 removes it.  M1107 alone reports the
+// knots, their spacing and the first and last positions.
+static void command_m1107(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_str("ok\n");
+		reply_u32(head_knots);
+		reply_char(' ');
+		reply_u32(head_knot_spacing);
+		reply_char(' ');
+		reply_i32(head_knots ? (int32_t)head_calibration[0] : 0);
+		reply_char(' ');
+		reply_i32(head_knots ? (int32_t)head_calibration[head_knots - 1] : 0);
+		reply_char('\n');
+		return;
+	}
+
+	if (argc < 2)
+	{
+		reply_str("error: calibration command requires a spacing and a first knot\n");
+		return;
+	}
+
+	int32_t spacing = argv[0], first = argv[1];
+	uint32_t count = argc - 2;
+	if (spacing < 1 || spacing > UINT16_MAX || (first && spacing != head_knot_spacing))
+	{
+		reply_str("error: invalid knot spacing\n");
+		return;
+	}
+
+	if (first < 0 || (uint32_t)first > head_knots || first + count > HEAD_KNOTS)
+	{
+		reply_str("error: invalid calibration range\n");
+		return;
+	}
+
+	for (uint8_t i = 2; i < argc; i++)
+	{
+		if ((i > 2 || first) && argv[i] <= (i > 2 ? argv[i - 1] : (int32_t)head_calibration[first - 1]))
+		{
+			reply_str("error: positions must increase\n");
+			return;
+		}
+	}
+
+	if (!head_calibration)
+		head_calibration = pool_reserve(&sram_pool, "knots", HEAD_KNOTS * sizeof(float));
+	if (!head_calibration)
+	{
+		reply_str("error: no SRAM for the calibration\n");
+		return;
+	}
+
+	head_knot_spacing = spacing;
+	head_knots = first + count;
+	for (uint8_t i = 2; i < argc; i++)
+		head_calibration[first++] = argv[i];
+	reply_str("ok\n");
+}
+
+// Read a row resampled onto a uniform grid in binary:
+// M1108 <channel> <first um> <pitch um> <points> [<row>] sends the
+// counts at first, first + pitch, ... for points points, each
+// interpolated between the columns either side of its position through
+// the M1107 calibration.  The header has start 0 and end points - 1.
+static void command_m1108(const int32_t *argv, uint8_t argc)
+{
+	if (!readout_stable())
+	{
+		reply_str("error: cannot read counter while it is active\n");
+		return;
+	}
+
+	if (head_knots < 2)
+	{
+		reply_str("error: no calibration is loaded\n");
+		return;
+	}
+
+	if (argc < 4)
+	{
+		reply_str("error: resample command requires four or five arguments\n");
+		return;
+	}
+
+	int32_t channel = argv[0], pitch = argv[2], points = argv[3], row = argc > 4 ? argv[4] : 0;
+	if (channel < 0 || channel >= channel_count || row < 0 || row >= row_count)
+	{
+		reply_str("error: invalid channel or row\n");
+		return;
+	}
+
+	if (pitch < 1 || points < 1 || points > UINT16_MAX + 1)
+	{
+		reply_str("error: invalid grid\n");
+		return;
+	}
+
+	resample_channel = channel;
+	resample_row_base = row * column_count;
+	resample_first = argv[1];
+	resample_pitch = pitch;
+
+	readout_header_t header;
+	header.channel = READOUT_RESAMPLED;
+	header.start = 0;
+	header.end = points - 1;
+	header.length = points * sizeof(uint32_t);
+	header.crc = 0xFFFF;
+	header.width = sizeof(uint32_t);
+	header.flags = readout_flags(channel, resample_row_base, resample_row_base + column_count - 1);
+	header.reserved = channel;
+	resampled_payload(0, points - 1, &header.crc);
+
+	reply_str("ok\n");
+	if (readout_send_header(&header))
+		readout_job_start(READOUT_JOB_RESAMPLED, 1u << channel, false, 0, points - 1);
+}
+
+// Count pyramid: M1109 1 clears the coarse sums and keeps them with
+// every cell stored from then on, M1109 0 stops.  M1109 alone reports
+// "<on> <cells>", the cells the sums cover.
+static void command_m1109(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_u32(pyramid_on);
+		reply_char(' ');
+		reply_u32(pyramid_on ? Min(cell_count, PYRAMID_CELLS) : 0);
+		reply_str("\nok\n");
+		return;
+	}
+
+	if (argv[0] != 0 && argv[0] != 1)
+	{
+		reply_str("error: invalid pyramid option\n");
+		return;
+	}
+
+	if (argv[0] && !pyramid_copy)
+	{
+		pyramid = pool_reserve(&sram_pool, "pyramid", COUNTER_CHANNELS * PYRAMID_BINS * sizeof(uint32_t));
+		if (pyramid)
+			pyramid_copy = pool_reserve(&sram_pool, "pyramid copy", (PYRAMID_CELLS >> PYRAMID_SHIFT) * sizeof(uint32_t));
+	}
+	if (argv[0] && !pyramid_copy)
+	{
+		reply_str("error: no SRAM for the pyramid\n");
+		return;
+	}
+
+	// Cells already in the live bank are summed afresh, so the sums
+	// cover only what is counted from now on
+	irqflags_t flags = cpu_irq_save();
+	pyramid_on = argv[0];
+	pyramid_clear();
+	cpu_irq_restore(flags);
+	reply_str("ok\n");
+}
+
+// Read one level of the count pyramid in binary:
+// M1110 <level> <channel> [<first> <last>] sends the uint32_t sums of
+// bins first to last of level 1, 2 or 3, bins of 8, 64 and 512 cells,
+// all the bins over the cells in use by default.  The live bank is
+// read as it fills, so this works while counting.  The header's
+// reserved field has the channel in its low byte and the level above.
+static void command_m1110(const int32_t *argv, uint8_t argc)
+{
+	if (!pyramid_on)
+	{
+		reply_str("error: the pyramid is not enabled\n");
+		return;
+	}
+
+	if (argc < 2 || argc == 3)
+	{
+		reply_str("error: pyramid command requires two or four arguments\n");
+		return;
+	}
+
+	int32_t level = argv[0], channel = argv[1];
+	if (level < 1 || level > PYRAMID_LEVELS || channel < 0 || channel >= channel_count)
+	{
+		reply_str("error: invalid level or channel\n");
+		return;
+	}
+
+	int32_t bins = pyramid_bins(level);
+	int32_t first = argc > 2 ? argv[2] : 0, last = argc > 2 ? argv[3] : bins - 1;
+	if (first < 0 || last < first || last >= bins)
+	{
+		reply_str("error: invalid bin range\n");
+		return;
+	}
+
+	// Queued columns belong to the preview.  The bins go on filling while
+	// the job sends them, so it sends a copy.
+	defer_poll();
+	memcpy(&pyramid_copy[first], &pyramid[channel][PYRAMID_OFFSET(level) + first], (last - first + 1) * sizeof(uint32_t));
+
+	readout_header_t header;
+	header.channel = READOUT_PYRAMID;
+	header.start = first;
+	header.end = last;
+	header.length = (last - first + 1) * sizeof(uint32_t);
+	header.crc = 0xFFFF;
+	header.width = sizeof(uint32_t);
+	header.flags = 0;
+	header.reserved = channel | level << 8;
+	readout_emit(&pyramid_copy[first], header.length, &header.crc);
+
+	reply_str("ok\n");
+	if (readout_send_header(&header))
+		readout_job_start(READOUT_JOB_PYRAMID, 1u << channel, false, first, last);
+}
+
+// Read a rectangle of a 2D frame in binary:
+// M1111 <channel> <row> <column> <rows> <columns> sends the region
+// (tile_region_t) and then the cells as TILE_SIZE by TILE_SIZE tiles
+// from its corner, a row of tiles at a time, each tile row by row.
+// The copying and the transfer grow with the region rather than with
+// the rows it spans, and every tile goes out as one block.  The header
+// has start 0 and end the last tile.
+static void command_m1111(const int32_t *argv, uint8_t argc)
+{
+	if (!readout_stable())
+	{
+		reply_str("error: cannot read counter while it is active\n");
+		return;
+	}
+
+	if (argc < 5)
+	{
+		reply_str("error: tile command requires five arguments\n");
+		return;
+	}
+
+	int32_t channel = argv[0], row = argv[1], column = argv[2], rows = argv[3], columns = argv[4];
+	if (channel < 0 || channel >= channel_count)
+	{
+		reply_str("error: invalid channel\n");
+		return;
+	}
+
+	if (row < 0 || column < 0 || rows < 1 || columns < 1 || row + rows > row_count
+		|| column + columns > column_count)
+	{
+		reply_str("error: invalid region\n");
+		return;
+	}
+
+	tile_channel = channel;
+	tile_region.row = row;
+	tile_region.column = column;
+	tile_region.rows = rows;
+	tile_region.columns = columns;
+	int32_t tiles = tile_columns() * ((rows + TILE_SIZE - 1) / TILE_SIZE);
+
+	readout_header_t header;
+	header.channel = READOUT_TILES;
+	header.start = 0;
+	header.end = tiles - 1;
+	header.length = sizeof(tile_region) + tiles * TILE_BINS * sizeof(count_t);
+	header.crc = 0xFFFF;
+	header.width = sizeof(count_t);
+	header.flags = readout_flags(channel, row * column_count, (row + rows) * column_count - 1);
+	header.reserved = channel;
+	readout_emit(&tile_region, sizeof(tile_region), &header.crc);
+	tile_payload(0, tiles - 1, &header.crc);
+
+	reply_str("ok\n");
+	if (readout_send_header(&header))
+		readout_job_start(READOUT_JOB_TILES, 1u << channel, false, 0, tiles - 1);
+}
+
+#if !COUNT_PACKED_CHANNELS
+// Sent ahead of the READOUT_ALL_PLANAR readout of each sealed row
+typedef struct
+{
+	uint16_t magic;     // ROW_MAGIC
+	uint16_t row;
+	uint32_t sequence;  // Rows sealed since M1077 started, so a gap is a lost row
+	uint32_t sealed;    // sof_count at the reversal
+	uint32_t overruns;  // Reversals that found no free row, in total
+	uint32_t wall_sealed;     // Unix time of the reversal (M1123), 0 if the clock is not set
+	uint32_t wall_sealed_us;  // and microseconds into that second
+	readout_header_t header;
+} row_push_t;
+
+// Header not sent yet for the row at the front of the queue
+#define ROW_PUSH_HEADER -1
+
+// Sends the summary of a sealed row once its bins are all sent
+static void row_summary_send(const row_sealed_t *sealed)
+{
+	struct
+	{
+		row_summary_header_t header;
+		row_summary_channel_t channels[COUNTER_CHANNELS];
+	} record;
+
+	const row_summary_t *summary = &sealed->summary;
+	uint8_t channels = channel_count;
+	record.header.magic = ROW_SUMMARY_MAGIC;
+	record.header.row = sealed->row;
+	record.header.sequence = sealed->sequence;
+	record.header.first = summary->first;
+	record.header.last = summary->last;
+	record.header.channels = channels;
+	record.header.flags = summary->flags;
+	record.header.overflow = summary->overflow;
+	record.header.commits = summary->commits;
+	record.header.dwell = summary->commits ? sealed->sealed - summary->started : 0;
+	for (uint8_t c = 0; c < channels; c++)
+		record.channels[c] = summary->channels[c];
+
+	push_time(ROW_SUMMARY_MAGIC);
+	write_binary(&record, sizeof(record.header) + channels * sizeof(row_summary_channel_t));
+}
+
+static int32_t row_push_next = ROW_PUSH_HEADER;
+static uint8_t row_push_channel;
+
+// Checksums one block of a row into its prefetch, marking it done first
+// so that a commit into it meanwhile leaves it stale.  Returns false if
+// one did.
+static bool row_prefetch_block(row_prefetch_t *pre, uint16_t row, uint32_t block)
+{
+	uint32_t bit = 1UL << (block & 31);
+	irqflags_t flags = cpu_irq_save();
+	pre->done[block >> 5] |= bit;
+	cpu_irq_restore(flags);
+
+	uint32_t first = row * column_count + block * ROW_PREFETCH_BLOCK_COLUMNS;
+	uint32_t last = Min(first + ROW_PREFETCH_BLOCK_COLUMNS, (row + 1U) * column_count) - 1;
+	for (uint8_t c = 0; c < channel_count; c++)
+	{
+		pre->crc[c][block] = 0;
+		readout_payload(1u << c, first, last, false, &pre->crc[c][block]);
+	}
+	return pre->done[block >> 5] & bit;
+}
+
+// Checksums the next block behind the head of the row it is in, one
+// per main loop pass
+static void row_prefetch_poll(void)
+{
+	if (!row_sealing || column_count > ROW_PREFETCH_COLUMNS)
+		return;
+
+	irqflags_t flags = cpu_irq_save();
+	uint32_t sequence = row_sequence;
+	uint16_t row = head_row;
+	uint32_t column = head_column();
+	int32_t direction = row_seal_direction;
+	cpu_irq_restore(flags);
+
+	row_prefetch_t *pre = &row_prefetch[sequence & 1];
+	if (pre->sequence != sequence || pre->columns != column_count || pre->bank != readout_bank)
+	{
+		flags = cpu_irq_save();
+		memset((void *)pre->done, 0, sizeof(pre->done));
+		cpu_irq_restore(flags);
+		pre->sequence = sequence;
+		pre->columns = column_count;
+		pre->bank = readout_bank;
+	}
+
+	// The blocks the head has left, in the direction it runs
+	if (direction == 0)
+		return;
+	uint32_t head = column >> ROW_PREFETCH_BLOCK_SHIFT;
+	uint32_t blocks = (column_count + ROW_PREFETCH_BLOCK_COLUMNS - 1) >> ROW_PREFETCH_BLOCK_SHIFT;
+	uint32_t from = direction > 0 ? 0 : head + 1, to = direction > 0 ? head : blocks;
+	for (uint32_t block = from; block < to; block++)
+		if (!ROW_PREFETCH_DONE(pre, block))
+		{
+			row_prefetch_block(pre, row, block);
+			return;
+		}
+}
+
+// Fills in the CRC of a sealed row's planar push from its prefetch,
+// checksumming the blocks still to do, which the head has left now
+static bool row_prefetch_crc(const row_sealed_t *sealed, uint16_t *crc)
+{
+	row_prefetch_t *pre = &row_prefetch[sealed->sequence & 1];
+	if (pre->sequence != sealed->sequence || pre->columns != column_count || pre->bank != readout_bank
+		|| column_count > ROW_PREFETCH_COLUMNS || (sealed->summary.flags & ROW_SUMMARY_DEFERRED))
+		return false;
+
+	uint32_t blocks = (column_count + ROW_PREFETCH_BLOCK_COLUMNS - 1) >> ROW_PREFETCH_BLOCK_SHIFT;
+	for (uint32_t block = 0; block < blocks; block++)
+		if (!ROW_PREFETCH_DONE(pre, block) && !row_prefetch_block(pre, sealed->row, block))
+			return false;
+
+	if (row_shift_columns != column_count)
+	{
+		uint32_t last = column_count - (blocks - 1) * ROW_PREFETCH_BLOCK_COLUMNS;
+		crc16_shift_table(row_shift_block, ROW_PREFETCH_BLOCK_COLUMNS * sizeof(count_t));
+		crc16_shift_table(row_shift_last, last * sizeof(count_t));
+		row_shift_columns = column_count;
+	}
+
+	for (uint8_t c = 0; c < channel_count; c++)
+		for (uint32_t block = 0; block < blocks; block++)
+			*crc = crc16_shift(block + 1 < blocks ? row_shift_block : row_shift_last, *crc) ^ pre->crc[c][block];
+	return true;
+}
+
+// Zeroes the bins and tracks of cells in the counting bank, which the
+// head must have left
+static void clear_cells(uint32_t first, uint32_t cells)
+{
+	count_epoch++;
+	for (uint8_t c = 0; c < channel_count; c++)
+		for (uint32_t cell = first; cell < first + cells; cell++)
+		{
+			uint32_t index = count_bank + COUNT_INDEX(c, cell);
+			count_arena[index] = 0;
+#if COUNT_WIDTH == 16
+			// The word may hold bits of cells still being counted
+			irqflags_t flags = cpu_irq_save();
+			count_overflow[index >> 5] &= ~(1UL << (index & 31));
+			cpu_irq_restore(flags);
+#endif
+		}
+
+	for (uint32_t cell = first; cell < first + cells; cell++)
+	{
+		if (time_track)
+			COUNT_TIME_BANK(count_bank, cell) = 0;
+		if (coincidence_track)
+			COUNT_COINCIDENCE_BANK(count_bank, cell) = 0;
+		if (dwell_track)
+			COUNT_DWELL_BANK(count_bank, cell) = 0;
+		if (analog_track)
+			for (uint8_t input = 0; input < ANALOG_INPUTS; input++)
+				COUNT_ANALOG_BANK(count_bank, input, cell) = 0;
+	}
+}
+
+// Send a slice of the sealed row at the front of the queue, one channel
+// after another like M1016 0, and give the row back once it is all sent
+static void row_push_poll(void)
+{
+	if (ring_count(&row_queue) == 0 || frame_store_on)
+		return;
+
+	const row_sealed_t *sealed = &row_ring[ring_tail(&row_queue) & (ROW_QUEUE_SIZE - 1)];
+	int32_t first = sealed->row * column_count, last = first + column_count - 1;
+	if (row_push_next == ROW_PUSH_HEADER)
+	{
+		row_push_t push;
+		push.magic = ROW_MAGIC;
+		push.row = sealed->row;
+		push.sequence = sealed->sequence;
+		push.sealed = sealed->sealed;
+		push.overruns = row_overruns;
+		wall_time(sealed->sealed_us, &push.wall_sealed, &push.wall_sealed_us);
+
+		uint16_t mask = (1 << channel_count) - 1;
+		readout_header_t *header = &push.header;
+		header->channel = READOUT_ALL_PLANAR;
+		header->start = first;
+		header->end = last;
+		header->length = channel_count * column_count * sizeof(count_t);
+		header->crc = 0xFFFF;
+		header->width = sizeof(count_t);
+		header->flags = 0;
+		for (uint8_t c = 0; c < channel_count; c++)
+			header->flags |= readout_flags(c, first, last);
+		header->reserved = mask;
+		if (!row_prefetch_crc(sealed, &header->crc))
+			readout_payload(mask, first, last, false, &header->crc);
+
+		// The first slice goes with the header, into the same TX bank
+		push_time(ROW_MAGIC);
+		write_binary(&push, sizeof(push));
+		row_push_channel = 0;
+		row_push_next = first;
+	}
+
+	int32_t slice_end = Min(row_push_next + READOUT_SLICE_COLUMNS - 1, last);
+	readout_payload(1u << row_push_channel, row_push_next, slice_end, false, NULL);
+	row_push_next = slice_end + 1;
+	if (row_push_next <= last)
+		return;
+
+	if (++row_push_channel < channel_count)
+	{
+		row_push_next = first;
+		return;
+	}
+
+	row_summary_send(sealed);
+	clear_cells(first, column_count);
+	ring_release(&row_queue, 1);
+	row_push_next = ROW_PUSH_HEADER;
+}
+
+#if COUNTER_FRAME_STORE
+#if FRAME_STORE_ADDRESS_LINES == 21 && (COUNTER_SYNC || CAPTURE_DIRS)
+#error 21 frame store address lines need COUNTER_SYNC and CAPTURE_DIRS set to 0
+#endif
+
+static uint32_t frame_row_bins(void)
+{
+	return channel_count * column_count;
+}
+
+// Rows of the current partition that fit
+static uint32_t frame_store_capacity(void)
+{
+	return Min(FRAME_STORE_BYTES / (frame_row_bins() * sizeof(count_t)), FRAME_STORE_ROWS_MAX);
+}
+
+static void frame_store_init(void)
+{
+	pmc_enable_periph_clk(ID_SMC);
+	pmc_enable_periph_clk(ID_PIOC);
+	pio_configure(PIOC, PIO_TYPE_PIO_PERIPH_A, FRAME_STORE_PIOC_PINS, 0);
+	pio_configure(PIOA, PIO_TYPE_PIO_PERIPH_C, FRAME_STORE_PIOA_PINS, 0);
+
+	SmcCs_number *cs = &SMC->SMC_CS_NUMBER[0];
+	cs->SMC_SETUP = SMC_SETUP_NWE_SETUP(FRAME_STORE_SETUP_CYCLES) | SMC_SETUP_NCS_WR_SETUP(0)
+		| SMC_SETUP_NRD_SETUP(0) | SMC_SETUP_NCS_RD_SETUP(0);
+	cs->SMC_PULSE = SMC_PULSE_NWE_PULSE(FRAME_STORE_PULSE_CYCLES)
+		| SMC_PULSE_NCS_WR_PULSE(FRAME_STORE_SETUP_CYCLES + FRAME_STORE_PULSE_CYCLES)
+		| SMC_PULSE_NRD_PULSE(FRAME_STORE_PULSE_CYCLES + 1) | SMC_PULSE_NCS_RD_PULSE(FRAME_STORE_PULSE_CYCLES + 1);
+	cs->SMC_CYCLE = SMC_CYCLE_NWE_CYCLE(FRAME_STORE_CYCLE_CYCLES) | SMC_CYCLE_NRD_CYCLE(FRAME_STORE_CYCLE_CYCLES);
+	cs->SMC_MODE = SMC_MODE_READ_MODE | SMC_MODE_WRITE_MODE;
+
+	// A byte at each power of two finds a missing part and any address
+	// line that is stuck or shorted to another
+	volatile uint8_t *store = (volatile uint8_t *)EBI_CS0_ADDR;
+	store[0] = 0xA5;
+	for (uint8_t line = 0; line < FRAME_STORE_ADDRESS_LINES; line++)
+		store[1UL << line] = line;
+	frame_store_present = store[0] == 0xA5;
+	for (uint8_t line = 0; line < FRAME_STORE_ADDRESS_LINES; line++)
+		frame_store_present = frame_store_present && store[1UL << line] == line;
+}
+
+static void frame_copy_start(const row_sealed_t *sealed)
+{
+	uint32_t first = sealed->row * column_count;
+	uint32_t block_bins = COUNT_LAYOUT_INTERLEAVED ? frame_row_bins() : column_count;
+	uint32_t src = (uint32_t)&count_arena[count_bank + COUNT_INDEX(frame_store_block, first)];
+	uint32_t dst = (uint32_t)&FRAME_STORE_BIN((sealed->sequence % frame_rows) * frame_row_bins()
+		+ frame_store_block * block_bins);
+	uint32_t bytes = block_bins * sizeof(count_t);
+
+	// Words where the block allows, the SMC splits them into bytes
+	uint32_t width = ((src | dst | bytes) & 3) ? sizeof(uint16_t) : sizeof(uint32_t);
+	DmacCh_num *channel = &DMAC->DMAC_CH_NUM[FRAME_DMA_CHANNEL];
+	channel->DMAC_SADDR = src;
+	channel->DMAC_DADDR = dst;
+	channel->DMAC_DSCR = 0;
+	channel->DMAC_CTRLA = DMAC_CTRLA_BTSIZE(bytes / width) | (width == sizeof(uint32_t)
+		? DMAC_CTRLA_SRC_WIDTH_WORD | DMAC_CTRLA_DST_WIDTH_WORD
+		: DMAC_CTRLA_SRC_WIDTH_HALF_WORD | DMAC_CTRLA_DST_WIDTH_HALF_WORD);
+	channel->DMAC_CTRLB = DMAC_CTRLB_SRC_DSCR_FETCH_DISABLE | DMAC_CTRLB_DST_DSCR_FETCH_DISABLE
+		| DMAC_CTRLB_FC_MEM2MEM_DMA_FC | DMAC_CTRLB_SRC_INCR_INCREMENTING | DMAC_CTRLB_DST_INCR_INCREMENTING;
+	channel->DMAC_CFG = DMAC_CFG_SOD_ENABLE | DMAC_CFG_FIFOCFG_ALAP_CFG;
+
+	DMAC->DMAC_CHER = DMAC_CHER_ENA0 << FRAME_DMA_CHANNEL;
+	frame_store_busy = true;
+}
+
+// Moves the sealed rows into the store a block at a time, and clears
+// and gives back each one once it is all there.  The channel is polled
+// rather than interrupting, since DMAC_Handler acknowledges every
+// channel's status when it reads EBCISR.
+static void frame_store_poll(void)
+{
+	if (!frame_store_on || ring_count(&row_queue) == 0)
+		return;
+
+	const row_sealed_t *sealed = &row_ring[ring_tail(&row_queue) & (ROW_QUEUE_SIZE - 1)];
+	if (frame_store_busy)
+	{
+		if (DMAC->DMAC_CHSR & (DMAC_CHSR_ENA0 << FRAME_DMA_CHANNEL))
+			return;
+		frame_store_busy = false;
+
+		if (++frame_store_block < (COUNT_LAYOUT_INTERLEAVED ? 1 : channel_count))
+		{
+			frame_copy_start(sealed);
+			return;
+		}
+
+		uint32_t first = sealed->row * column_count, row = sealed->sequence % frame_rows;
+		bool overflow = false;
+		for (uint8_t c = 0; c < channel_count; c++)
+			overflow = overflow || (readout_flags(c, first, first + column_count - 1) & READOUT_FLAG_OVERFLOW);
+		if (overflow)
+			frame_overflow[row / 32] |= 1UL << (row & 31);
+		else
+			frame_overflow[row / 32] &= ~(1UL << (row & 31));
+
+		clear_cells(first, column_count);
+		ring_release(&row_queue, 1);
+		frame_stored++;
+		return;
+	}
+
+	frame_store_block = 0;
+	frame_copy_start(sealed);
+}
+
+// Lets the row being copied finish, so the store can stop or be read
+static void frame_store_wait(void)
+{
+	while (frame_store_busy)
+		frame_store_poll();
+}
+#endif
+#endif
+
+// Row sealing: M1077 <0|1> [<min steps>] seals the row on each reversal
+// after a run of at least min steps (ROW_SEAL_MIN_STEPS by default) and
+// pushes it to the data interface, followed by its summary.  Rows still
+// queued are dropped when it stops.  M1077 reports "<on> <sealed>
+// <queued> <overruns>".
+static void command_m1077(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_str("ok\n");
+		reply_u32(row_sealing);
+		reply_char(' ');
+		reply_u32(row_sequence);
+		reply_char(' ');
+		reply_u32(ring_count(&row_queue));
+		reply_char(' ');
+		reply_u32(row_overruns);
+		reply_char('\n');
+		return;
+	}
+
+	int32_t enable = argv[0], min = argc > 1 ? argv[1] : ROW_SEAL_MIN_STEPS;
+	if ((enable != 0 && enable != 1) || min < 1 || min > UINT16_MAX)
+	{
+		reply_str("error: row sealing command requires 0, or 1 and a run of 1-65535 steps\n");
+		return;
+	}
+
+#if COUNT_PACKED_CHANNELS
+	if (enable)
+	{
+		reply_str("error: rows cannot be cleared with packed channels\n");
+		return;
+	}
+#else
+	if (enable && row_count < 2)
+	{
+		reply_str("error: row sealing needs at least two rows\n");
+		return;
+	}
+
+	if (enable && (readout_bank != count_bank || cine_on))
+	{
+		reply_str("error: rows are sealed in a single bank\n");
+		return;
+	}
+
+	row_sealing = false;
+#if COUNTER_FRAME_STORE
+	frame_store_wait();
+#endif
+	ring_flush(&row_queue);
+	row_push_next = ROW_PUSH_HEADER;
+	row_prefetch_reset();
+	if (enable)
+	{
+		row_seal_min = min;
+		row_seal_direction = 0;
+		row_seal_run = 0;
+		row_sequence = 0;
+		row_overruns = 0;
+		row_summary_reset(&row_live);
+#if COUNTER_FRAME_STORE
+		// The frame starts over at store row 0
+		frame_stored = 0;
+#endif
+		row_sealing = true;
+	}
+#endif
+
+	reply_str("ok\n");
+}
+
+// Set the dead-time model: M1033 <dead time ns> <dwell per column us>,
+// or M1033 0 to send uncorrected counts
+static void command_m1033(const int32_t *argv, uint8_t argc)
+{
+	int32_t deadtime = argv[0], dwell = argv[1];
+	if (argc < 1 || deadtime < 0 || (deadtime && (argc < 2 || dwell < 1)))
+	{
+		reply_str("error: invalid dead time\n");
+		return;
+	}
+
+	deadtime_ratio = deadtime ? (float)deadtime / ((float)dwell * 1000.0f) : 0.0f;
+	reply_str("ok\n");
+}
+
+// Read dead-time corrected counts in binary
+static void command_m1034(const int32_t *argv, uint8_t argc)
+{
+	if (!readout_stable())
+	{
+		reply_str("error: cannot read counter while it is active\n");
+		return;
+	}
+
+	int32_t channel, start, end;
+	if (!parse_readout_args(argv, argc, &channel, &start, &end))
+		return;
+
+	readout_header_t header;
+	header.channel = channel;
+	header.start = start;
+	header.end = end;
+	header.length = (end - start + 1) * sizeof(uint32_t);
+	header.crc = 0xFFFF;
+	header.width = sizeof(uint32_t);
+	header.flags = readout_flags(channel, start, end) | READOUT_FLAG_CORRECTED;
+	header.reserved = 0;
+	corrected_payload(channel, start, end, false, &header.crc);
+
+	reply_str("ok\n");
+	if (readout_send_header(&header))
+		readout_job_start(READOUT_JOB_CORRECTED, 1u << channel, false, start, end);
+}
+
+// Build a calibration curve: M1035 <channel> clears it,
+// M1035 <channel> <count> <dose> appends a point
+static void command_m1035(const int32_t *argv, uint8_t argc)
+{
+	int32_t channel = argv[0], count = argv[1], dose = argv[2];
+	if (argc < 1 || channel < 0 || channel > 2 || argc == 2)
+	{
+		reply_str("error: invalid calibration\n");
+		return;
+	}
+
+	calibration_t *curve = &calibration[channel];
+	if (argc == 1)
+	{
+		curve->points = 0;
+		reply_str("ok\n");
+		return;
+	}
+
+	uint8_t n = curve->points;
+	float previous_count = n ? curve->count[n - 1] : 0.0f;
+	float previous_dose = n ? curve->dose[n - 1] : 0.0f;
+	if (n == CALIBRATION_POINTS || count <= previous_count || dose < 0)
+	{
+		reply_str("error: calibration points must have ascending counts\n");
+		return;
+	}
+
+	curve->count[n] = count;
+	curve->dose[n] = dose;
+	curve->slope[n] = ((float)dose - previous_dose) / ((float)count - previous_count);
+	curve->points = n + 1;
+	reply_str("ok\n");
+}
+
+// Read dose in binary: dead-time corrected counts through the calibration curve
+static void command_m1036(const int32_t *argv, uint8_t argc)
+{
+	if (!readout_stable())
+	{
+		reply_str("error: cannot read counter while it is active\n");
+		return;
+	}
+
+	int32_t channel, start, end;
+	if (!parse_readout_args(argv, argc, &channel, &start, &end))
+		return;
+
+	if (!calibration[channel].points)
+	{
+		reply_str("error: channel is not calibrated\n");
+		return;
+	}
+
+	readout_header_t header;
+	header.channel = channel;
+	header.start = start;
+	header.end = end;
+	header.length = (end - start + 1) * sizeof(uint32_t);
+	header.crc = 0xFFFF;
+	header.width = sizeof(uint32_t);
+	header.flags = readout_flags(channel, start, end) | READOUT_FLAG_CORRECTED | READOUT_FLAG_DOSE;
+	header.reserved = 0;
+	corrected_payload(channel, start, end, true, &header.crc);
+
+	reply_str("ok\n");
+	if (readout_send_header(&header))
+		readout_job_start(READOUT_JOB_DOSE, 1u << channel, false, start, end);
+}
+
+// Read the channel ratios in binary: M1037 <start> <end>
+static void command_m1037(const int32_t *argv, uint8_t argc)
+{
+	if (!readout_stable())
+	{
+		reply_str("error: cannot read counter while it is active\n");
+		return;
+	}
+
+	if (channel_count < 2)
+	{
+		reply_str("error: ratios need the secondary channel\n");
+		return;
+	}
+
+	if (argc < 2)
+	{
+		reply_str("error: read command requires two arguments\n");
+		return;
+	}
+
+	int32_t start = argv[0], end = argv[1];
+	if (!validate_column_range(start, end))
+		return;
+
+	readout_header_t header;
+	header.channel = READOUT_RATIOS;
+	header.start = start;
+	header.end = end;
+	header.length = (end - start + 1) * 2 * sizeof(uint16_t);
+	header.crc = 0xFFFF;
+	header.width = sizeof(uint16_t);
+	header.flags = 0;
+	for (uint8_t c = 0; c < channel_count; c++)
+		header.flags |= readout_flags(c, start, end);
+	header.reserved = 0;
+	ratio_payload(start, end, &header.crc);
+
+	reply_str("ok\n");
+	if (readout_send_header(&header))
+		readout_job_start(READOUT_JOB_RATIO, 1, false, start, end);
+}
+
+// Load the column gain map: M1057 <first column> <gains>..., where each
+// argument holds two Q1.15 gains, the lower half for the earlier column.
+// M1057 alone sets every gain back to 1.
+static void command_m1057(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		gain_map_reset();
+		reply_str("ok\n");
+		return;
+	}
+
+	int32_t first = argv[0];
+	uint32_t count = 2 * (argc - 1);
+	if (argc < 2 || first < 0 || first + count > GAIN_MAP_COLUMNS)
+	{
+		reply_str("error: invalid gain map range\n");
+		return;
+	}
+
+	for (uint8_t i = 1; i < argc; i++)
+	{
+		gain_map[first++] = (uint32_t)argv[i] & 0xFFFF;
+		gain_map[first++] = (uint32_t)argv[i] >> 16;
+	}
+	reply_str("ok\n");
+}
+
+// Multi-pass accumulation: M1060 1 clears the sums and starts adding every
+// pass to them, M1060 0 stops, keeping them for M1061.  M1060 alone reports
+// "<on> <cells> <fewest> <most>", the cells accumulated and the fewest and
+// most passes over any of them.
+static void command_m1060(const int32_t *argv, uint8_t argc)
+{
+	uint32_t cells = pass_visits ? Min(cell_count, PASS_CELLS) : 0;
+	if (argc == 0)
+	{
+		uint32_t fewest = UINT16_MAX, most = 0;
+		for (uint32_t i = 0; i < cells; i++)
+		{
+			fewest = Min(fewest, pass_visits[i]);
+			most = Max(most, pass_visits[i]);
+		}
+
+		reply_u32(pass_accumulate);
+		reply_char(' ');
+		reply_u32(cells);
+		reply_char(' ');
+		reply_u32(cells ? fewest : 0);
+		reply_char(' ');
+		reply_u32(most);
+		reply_str("\nok\n");
+		return;
+	}
+
+	if (argv[0] != 0 && argv[0] != 1)
+	{
+		reply_str("error: invalid multi-pass option\n");
+		return;
+	}
+
+	if (argv[0] && !pass_reserve())
+	{
+		reply_str("error: no SRAM for the multi-pass sums\n");
+		return;
+	}
+
+	if (argv[0])
+	{
+		pass_accumulate = false;
+		defer_poll();
+		pass_clear();
+	}
+	pass_accumulate = argv[0];
+	reply_str("ok\n");
+}
+
+// Pass sums are not banked, so they are read only while not counting,
+// and only over the cells that have them
+static bool pass_readout_ready(int32_t end)
+{
+	if (enable_count)
+	{
+		reply_str("error: cannot read counter while it is active\n");
+		return false;
+	}
+
+	if (!pass_visits)
+	{
+		reply_str("error: multi-pass is not enabled\n");
+		return false;
+	}
+
+	if ((uint32_t)end >= PASS_CELLS)
+	{
+		reply_str("error: range beyond the multi-pass cells\n");
+		return false;
+	}
+
+	// Queued columns belong to passes already made
+	defer_poll();
+	return true;
+}
+
+// Read the mean counts per pass in binary, as M1015: uint32_t values with
+// PASS_MEAN_SHIFT fraction bits
+static void command_m1061(const int32_t *argv, uint8_t argc)
+{
+	int32_t channel, start, end;
+	if (!parse_readout_args(argv, argc, &channel, &start, &end) || !pass_readout_ready(end))
+		return;
+
+	uint32_t fewest = UINT16_MAX;
+	for (int32_t i = start; i <= end; i++)
+		fewest = Min(fewest, pass_visits[i]);
+
+	readout_header_t header;
+	header.channel = channel;
+	header.start = start;
+	header.end = end;
+	header.length = (end - start + 1) * sizeof(uint32_t);
+	header.crc = 0xFFFF;
+	header.width = sizeof(uint32_t);
+	header.flags = 0;
+	header.reserved = fewest;
+	pass_payload(channel, start, end, &header.crc);
+
+	reply_str("ok\n");
+	if (readout_send_header(&header))
+		readout_job_start(READOUT_JOB_PASS, 1u << channel, false, start, end);
+}
+
+// Read the passes over each cell in binary: M1062 <start> <end>
+static void command_m1062(const int32_t *argv, uint8_t argc)
+{
+	if (argc < 2)
+	{
+		reply_str("error: read command requires two arguments\n");
+		return;
+	}
+
+	int32_t start = argv[0], end = argv[1];
+	if (!validate_column_range(start, end) || !pass_readout_ready(end))
+		return;
+
+	readout_header_t header;
+	header.channel = READOUT_PASS_VISITS;
+	header.start = start;
+	header.end = end;
+	header.length = (end - start + 1) * sizeof(uint16_t);
+	header.crc = 0xFFFF;
+	header.width = sizeof(uint16_t);
+	header.flags = 0;
+	header.reserved = 0;
+	readout_emit(&pass_visits[start], header.length, &header.crc);
+
+	reply_str("ok\n");
+	if (readout_send_header(&header))
+		readout_job_start(READOUT_JOB_VISITS, 1, false, start, end);
+}
+
+// Capture row <row> of every stored channel as the background: M1059 <row>,
+// or M1059 alone to clear it
+static void command_m1059(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		memset(background, 0, sizeof(background));
+		reply_str("ok\n");
+		return;
+	}
+
+	if (!readout_stable())
+	{
+		reply_str("error: cannot read counter while it is active\n");
+		return;
+	}
+
+	int32_t row = argv[0];
+	if (row < 0 || row >= row_count)
+	{
+		reply_str("error: invalid row\n");
+		return;
+	}
+
+	uint32_t columns = Min(column_count, BACKGROUND_COLUMNS);
+	uint32_t base = row * column_count;
+	memset(background, 0, sizeof(background));
+	for (uint8_t c = 0; c < channel_count; c++)
+		for (uint32_t i = 0; i < columns; i++)
+			background[c][i] = Min(COUNT_BIN(c, base + i), UINT16_MAX);
+	reply_str("ok\n");
+}
+
+// Read flat-field counts in binary: M1058 <channel> <start> <end> [subtract],
+// each count scaled by its column's gain after taking off the background
+// captured by M1059 when subtract is 1
+static void command_m1058(const int32_t *argv, uint8_t argc)
+{
+	if (!readout_stable())
+	{
+		reply_str("error: cannot read counter while it is active\n");
+		return;
+	}
+
+	int32_t channel, start, end;
+	if (!parse_readout_args(argv, argc, &channel, &start, &end))
+		return;
+
+	int32_t subtract = argc > 3 ? argv[3] : 0;
+	if (subtract != 0 && subtract != 1)
+	{
+		reply_str("error: invalid background option\n");
+		return;
+	}
+
+	readout_header_t header;
+	header.channel = channel;
+	header.start = start;
+	header.end = end;
+	header.length = (end - start + 1) * sizeof(count_t);
+	header.crc = 0xFFFF;
+	header.width = sizeof(count_t);
+	header.flags = readout_flags(channel, start, end) | READOUT_FLAG_GAIN;
+	header.reserved = subtract;
+	gain_payload(channel, start, end, subtract, &header.crc);
+
+	reply_str("ok\n");
+	if (readout_send_header(&header))
+	{
+		readout_job.subtract = subtract;
+		readout_job_start(READOUT_JOB_GAIN, 1u << channel, false, start, end);
+	}
+}
+
+// Report a channel's profile over a range: M1038 <channel> <start> <end>
+// replies with the sum, peak value, peak column, centroid and FWHM
+static void command_m1038(const int32_t *argv, uint8_t argc)
+{
+	if (!readout_stable())
+	{
+		reply_str("error: cannot read counter while it is active\n");
+		return;
+	}
+
+	int32_t channel, start, end;
+	if (!parse_readout_args(argv, argc, &channel, &start, &end))
+		return;
+
+	reply_str("ok\n");
+	profile_statistics(channel, start, end);
+}
+
+// Report the field edges of a channel's profile: M1098 <channel> <start> <end>
+// replies with the peak value and column, then the left and right
+// columns, in hundredths, where the profile crosses 20, 50 and 80% of
+// the peak.  Only the positions are sent instead of the whole profile.
+static void command_m1098(const int32_t *argv, uint8_t argc)
+{
+	if (!readout_stable())
+	{
+		reply_str("error: cannot read counter while it is active\n");
+		return;
+	}
+
+	int32_t channel, start, end;
+	if (!parse_readout_args(argv, argc, &channel, &start, &end))
+		return;
+
+	reply_str("ok\n");
+	profile_edges(channel, start, end);
+}
+
+// Upload the reference profile of M1100, packed like the gain map:
+// M1099 <first> <counts>..., each argument two uint16_t reference
+// counts, low half first.  Writing cells from first on makes the
+// reference end with the last of them, so it is sent from 0 up, and
+// M1099 0 removes it.  M1099 alone reports the cells loaded and their
+// peak.
+static void command_m1099(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		float peak = 0.0f;
+		uint32_t index;
+		if (reference_cells)
+			arm_max_f32(reference, reference_cells, &peak, &index);
+		reply_str("ok\n");
+		reply_u32(reference_cells);
+		reply_char(' ');
+		reply_u32((uint32_t)peak);
+		reply_char('\n');
+		return;
+	}
+
+	int32_t first = argv[0];
+	uint32_t count = 2 * (argc - 1);
+	if (first < 0 || (uint32_t)first > reference_cells || first + count > REFERENCE_CELLS)
+	{
+		reply_str("error: invalid reference range\n");
+		return;
+	}
+
+	if (!reference)
+		reference = pool_reserve(&sram_pool, "reference", REFERENCE_CELLS * sizeof(float));
+	if (!reference)
+	{
+		reply_str("error: no SRAM for the reference\n");
+		return;
+	}
+
+	reference_cells = first + count;
+	for (uint8_t i = 1; i < argc; i++)
+	{
+		reference[first++] = (uint32_t)argv[i] & 0xFFFF;
+		reference[first++] = (uint32_t)argv[i] >> 16;
+	}
+	reply_str("ok\n");
+}
+
+// Compare a channel's profile with the reference by 1D gamma index:
+// M1100 <channel> <start> <end> <dose> <distance> [<threshold> [<normalise>]]
+// dose is the dose difference in tenths of a percent of the reference
+// peak, distance the distance to agreement in hundredths of a column,
+// and threshold the percent of the peak below which reference cells are
+// left out, 10 by default.  normalise 1 scales the counts to the
+// reference peak first.  Replies with the cells evaluated, those passed
+// and the pass rate in percent, then a line of cell and gamma for each
+// of the worst failures.
+static void command_m1100(const int32_t *argv, uint8_t argc)
+{
+	if (!readout_stable())
+	{
+		reply_str("error: cannot read counter while it is active\n");
+		return;
+	}
+
+	if (argc < 5)
+	{
+		reply_str("error: gamma command requires five arguments\n");
+		return;
+	}
+
+	int32_t channel, start, end;
+	if (!parse_readout_args(argv, argc, &channel, &start, &end))
+		return;
+
+	if (!reference_cells || end >= (int32_t)reference_cells)
+	{
+		reply_str("error: range is beyond the reference\n");
+		return;
+	}
+
+	int32_t dose = argv[3], distance = argv[4];
+	int32_t threshold = argc >= 6 ? argv[5] : 10;
+	if (dose <= 0 || distance <= 0 || threshold < 0 || threshold > 100
+		|| (argc >= 7 && argv[6] != 0 && argv[6] != 1))
+	{
+		reply_str("error: invalid gamma criteria\n");
+		return;
+	}
+
+	gamma_result_t result;
+	gamma_evaluate(channel, start, end, dose / 1000.0f, distance / 100.0f, threshold / 100.0f,
+		argc >= 7 && argv[6], &result);
+
+	reply_str("ok\n");
+	reply_u32(result.evaluated);
+	reply_char(' ');
+	reply_u32(result.passed);
+	reply_char(' ');
+	reply_hundredths(result.evaluated ? 100.0f * result.passed / result.evaluated : 0.0f);
+	reply_char('\n');
+	for (uint8_t i = 0; i < result.worst_count; i++)
+	{
+		reply_i32(result.worst[i]);
+		reply_char(' ');
+		reply_hundredths(result.worst_gamma[i]);
+		reply_char('\n');
+	}
+}
+
+// Report the running totals: M1039 for the bank being filled,
+// M1039 1 for the readout bank.  One line per stored channel with
+// the total, the peak bin and the cell holding it.
+static void command_m1039(const int32_t *argv, uint8_t argc)
+{
+	if (argc >= 1 && argv[0] != 0 && argv[0] != 1)
+	{
+		reply_str("error: totals command takes 0 or 1\n");
+		return;
+	}
+
+	totals_t totals;
+	irqflags_t flags = cpu_irq_save();
+	totals = argc >= 1 && argv[0] ? readout_totals : live_totals;
+	cpu_irq_restore(flags);
+
+	reply_str("ok\n");
+	for (uint8_t c = 0; c < channel_count; c++)
+	{
+		reply_u64(totals.total[c]);
+		reply_char(' ');
+		reply_u32(totals.peak[c]);
+		reply_char(' ');
+		reply_u32(totals.peak_cell[c]);
+		reply_char('\n');
+	}
+}
+
+// Read decimated counts in binary: M1040 <channel> <stride> <start> <end> ...
+// with up to READOUT_MAX_ROIS column ranges.  Each value is the sum of
+// stride columns, and the ranges follow each other in one payload with
+// header.start and header.end taken from the first and last range.
+static void command_m1040(const int32_t *argv, uint8_t argc)
+{
+	if (!readout_stable())
+	{
+		reply_str("error: cannot read counter while it is active\n");
+		return;
+	}
+
+	if (argc < 4 || argc % 2 || (argc - 2) / 2 > READOUT_MAX_ROIS)
+	{
+		reply_str("error: decimated read requires a channel, a stride and up to 4 ranges\n");
+		return;
+	}
+
+	int32_t channel = argv[0], stride = argv[1];
+	if (channel < 0 || channel >= channel_count)
+	{
+		reply_str("error: invalid counter\n");
+		return;
+	}
+
+	if (stride < 1 || stride > UINT16_MAX)
+	{
+		reply_str("error: invalid stride\n");
+		return;
+	}
+
+	uint8_t rois = (argc - 2) / 2;
+	uint32_t values = 0;
+	for (uint8_t r = 0; r < rois; r++)
+	{
+		int32_t start = argv[2 + 2 * r], end = argv[3 + 2 * r];
+		if (!validate_column_range(start, end))
+			return;
+
+		readout_job.roi_start[r] = start;
+		readout_job.roi_end[r] = end;
+		values += (end - start + stride) / stride;
+	}
+
+	readout_header_t header;
+	header.channel = channel;
+	header.start = readout_job.roi_start[0];
+	header.end = readout_job.roi_end[rois - 1];
+	header.length = values * sizeof(uint32_t);
+	header.crc = 0xFFFF;
+	header.width = sizeof(uint32_t);
+	header.flags = READOUT_FLAG_DECIMATED;
+	header.reserved = 0;
+	for (uint8_t r = 0; r < rois; r++)
+	{
+		header.flags |= readout_flags(channel, readout_job.roi_start[r], readout_job.roi_end[r]);
+		decimated_payload(channel, readout_job.roi_start[r], readout_job.roi_end[r], stride, &header.crc);
+	}
+
+	reply_str("ok\n");
+	if (readout_send_header(&header))
+	{
+		readout_job.stride = stride;
+		readout_job.roi = 0;
+		readout_job.rois = rois;
+		readout_job_start(READOUT_JOB_DECIMATED, 1u << channel, false, readout_job.roi_start[0], readout_job.roi_end[0]);
+	}
+}
+
+// Read the cells touched since the last dirty readout in binary: M1041 <channel>.
+// Cells are sent in runs of whole DIRTY_BLOCK_CELLS blocks, and the
+// blocks are only marked clean once the whole readout is sent.
+static void command_m1041(const int32_t *argv, uint8_t argc)
+{
+	if (!readout_stable())
+	{
+		reply_str("error: cannot read counter while it is active\n");
+		return;
+	}
+
+	int32_t channel = argv[0];
+	if (argc < 1 || channel < 0 || channel >= channel_count)
+	{
+		reply_str("error: invalid counter\n");
+		return;
+	}
+
+	// Without a swap the readout bank is the one being filled
+	if (readout_bank == count_bank)
+	{
+		irqflags_t flags = cpu_irq_save();
+		for (uint32_t i = 0; i < DIRTY_WORDS; i++)
+		{
+			dirty_readout[i] |= dirty_live[i];
+			dirty_live[i] = 0;
+		}
+		cpu_irq_restore(flags);
+	}
+
+	readout_header_t header;
+	header.channel = channel;
+	header.start = 0;
+	header.end = cell_count - 1;
+	header.crc = 0xFFFF;
+	header.width = sizeof(count_t);
+	header.flags = readout_flags(channel, 0, cell_count - 1) | READOUT_FLAG_DIRTY;
+	header.reserved = 0;
+	dirty_payload(channel, &header.crc, &header.length);
+
+	int32_t start, end;
+	reply_str("ok\n");
+	if (!readout_send_header(&header))
+		return;
+
+	if (dirty_next_region(0, &start, &end))
+		readout_job_start(READOUT_JOB_DIRTY, 1u << channel, false, start, end);
+	// Nothing is dirty, so a compressed readout is an empty frame
+	else if (!readout_compress || (lz4_begin(readout_lz4, write_binary) && lz4_finish(readout_lz4)))
+		reply_str("ok\n");
+}
+
+// Pulse capture.  TC2 channel 2 runs in capture mode on TIMER_CLOCK1
+// (MCK/2) and loads RA on each rising edge of TIOA8 (PC11), which must be
+// jumpered to the pulse input of the channel under study.  RA, extended
+// by the counter wraps, gives each pulse a 32-bit time that feeds either
+// the interval histogram (M1070) or list mode (M1072).  A capture
+// interrupt per pulse bounds the rate it can follow: pulses that land
+// before RA is read are counted as missed (LOVRS).  The timer is shared
+// with output 3 of the load generator.
+#define PULSE_TC COUNTER_TC_BLOCK(PULSE_TC_NUMBER)
+#define PULSE_TC_CHANNEL COUNTER_TC_CHANNEL(PULSE_TC_NUMBER)
+#define PULSE_TC_CHANNEL_ID COUNTER_TC_ID(PULSE_TC_NUMBER)
+#define PULSE_TC_IRQn COUNTER_TC_IRQn(PULSE_TC_NUMBER)
+#define PULSE_IRQ_PRIORITY (COUNTER_IRQ_PRIORITY + 1)
+#define PULSE_GENERATOR_OUTPUT 3
+
+#define PULSE_CAPTURE_OFF 0
+#define PULSE_CAPTURE_HISTOGRAM 1
+#define PULSE_CAPTURE_EVENTS 2
+
+static volatile uint8_t pulse_capture = PULSE_CAPTURE_OFF;
+static volatile uint32_t pulse_missed;
+static uint32_t pulse_wraps;
+// Time of the previous pulse
+static uint32_t pulse_last;
+static bool pulse_primed;
+
+// Interval histogram: each pulse adds the interval since the previous
+// one, shifted down by histogram_shift, to one of HISTOGRAM_BINS bins;
+// the last bin also takes every longer interval.  With a column range set
+// only pulses while the head is over those columns are binned, so
+// repeated scans build up the histogram of one column.
+#define HISTOGRAM_BINS 256
+// At the widest bins the histogram spans a whole 16-bit counter wrap
+#define HISTOGRAM_SHIFT_MAX 8
+
+static uint8_t histogram_shift;
+static uint32_t histogram_first;  // Column range that is binned
+static uint32_t histogram_last;
+// Reserved from the SRAM pool by the first M1070 1
+static volatile uint32_t *histogram_bins;
+
+// List mode: each pulse goes into the stream ring as a stream_event_t,
+// in place of the column records of M1017, and out in stream blocks
+// with STREAM_EVENT_MAGIC under the same aggregation (M1067) and credit
+// (M1069) rules, to whichever data interface M1027 selected.  Bursts
+// up to the STREAM_RING_SIZE records the ring holds are absorbed, and
+// anything beyond is dropped and counted in the block headers.  The
+// sustained limit is the data interface: about 900 KB/s of full-speed
+// bulk payload, so EVENT_MAX_SUSTAINED_HZ 8-byte records a second,
+// well under what the capture interrupt itself keeps up with.
+#define EVENT_MAX_SUSTAINED_HZ 100000
+
+static uint8_t event_channel;   // Channel number the pulse input is tagged with
+static volatile uint32_t event_count;
+static bool event_missed;       // A pulse was missed since the last event
+
+static __always_inline void histogram_pulse(uint32_t time)
+{
+	uint32_t column = head_column();
+	if (pulse_primed && column >= histogram_first && column <= histogram_last)
+		histogram_bins[Min((time - pulse_last) >> histogram_shift, HISTOGRAM_BINS - 1)]++;
+}
+
+static __always_inline void event_pulse(uint32_t time)
+{
+	uint32_t slot;
+	if (!ring_reserve(&stream_queue, STREAM_RING_SIZE, &slot))
+	{
+		stream_dropped++;
+		return;
+	}
+
+	stream_event_t *event = (stream_event_t *)&stream_ring[slot];
+	uint32_t column = head_column();
+	event->time = time;
+	event->position = column < column_count ? head_row_base + column : EVENT_OUTSIDE;
+	event->channel = event_channel;
+	event->flags = event_missed ? EVENT_FLAG_MISSED : 0;
+	event_missed = false;
+	if (ring_count(&stream_queue) == 0)
+		stream_oldest = sof_count;
+	ring_commit(&stream_queue, 1);
+	event_count++;
+}
+
+static void pulse_capture_irq(void)
+{
+	TcChannel *channel = &PULSE_TC->TC_CHANNEL[PULSE_TC_CHANNEL];
+	uint32_t status = channel->TC_SR;
+	uint32_t wraps = pulse_wraps;
+
+	if (status & TC_SR_LOVRS)
+	{
+		pulse_missed++;
+		event_missed = true;
+	}
+
+	if (status & TC_SR_COVFS)
+		pulse_wraps++;
+
+	if (!(status & TC_SR_LDRAS))
+		return;
+
+	// An overflow seen with the capture came before it if RA is still
+	// low, otherwise it belongs to the next pulse
+	uint16_t ra = channel->TC_RA;
+	if ((status & TC_SR_COVFS) && ra < 0x8000)
+		wraps++;
+
+	uint32_t time = (wraps << 16) | ra;
+	if (pulse_capture == PULSE_CAPTURE_HISTOGRAM)
+		histogram_pulse(time);
+	else
+		event_pulse(time);
+
+	pulse_last = time;
+	pulse_primed = true;
+}
+
+static void pulse_capture_stop(void)
+{
+	tc_stop(PULSE_TC, PULSE_TC_CHANNEL);
+	tc_disable_interrupt(PULSE_TC, PULSE_TC_CHANNEL, TC_IDR_LDRAS | TC_IDR_COVFS);
+	NVIC_DisableIRQ(PULSE_TC_IRQn);
+	NVIC_ClearPendingIRQ(PULSE_TC_IRQn);
+	pio_configure(PULSE_PIO, PIO_TYPE_PIO_INPUT, PULSE_PIN, 0);
+	pulse_capture = PULSE_CAPTURE_OFF;
+}
+
+// Start timing pulses afresh for mode (PULSE_CAPTURE_*), at time 0
+static void pulse_capture_start(uint8_t mode)
+{
+	pulse_capture_stop();
+	pulse_missed = 0;
+	pulse_wraps = 0;
+	pulse_primed = false;
+
+	pmc_enable_periph_clk(PULSE_TC_CHANNEL_ID);
+	tc_init(PULSE_TC, PULSE_TC_CHANNEL, TC_CMR_TCCLKS_TIMER_CLOCK1 | TC_CMR_LDRA_RISING);
+	(void)PULSE_TC->TC_CHANNEL[PULSE_TC_CHANNEL].TC_SR;
+	tc_enable_interrupt(PULSE_TC, PULSE_TC_CHANNEL, TC_IER_LDRAS | TC_IER_COVFS);
+	NVIC_SetPriority(PULSE_TC_IRQn, PULSE_IRQ_PRIORITY);
+	NVIC_EnableIRQ(PULSE_TC_IRQn);
+	pio_configure(PULSE_PIO, PIO_TYPE_PIO_PERIPH_B, PULSE_PIN, 0);
+	pulse_capture = mode;
+	tc_start(PULSE_TC, PULSE_TC_CHANNEL);
+}
+
+// Load generator (M1043).  Spare TC channels in waveform mode drive
+// pins that are jumpered back to the inputs, giving a repeatable source
+// for checking counts at rate:
+//   output 0  TIOA5 (PC29) -> COUNTER_STEP_PIN, a fixed-rate step train
+//   output 1  TIOA3 (PC23) -> PA4
+//   output 2  TIOA7 (PC8)  -> PA28
+//   output 3  TIOA8 (PC11) -> PA29
+// Outputs 1-3 give pseudo-random pulses: each interval is
+// GENERATOR_MIN_TICKS plus an exponential draw, i.e. a Poisson source
+// seen through a non-paralysable dead time, with the requested mean rate.
+// Output 0 shares TC1 channel 2 with the M1042 benchmark, and output 2
+// is not available with COUNTER_POSITION_QDEC, whose decoder takes TC2
+// channel 1.
+#define GENERATOR_OUTPUTS 4
+#define GENERATOR_IRQ_PRIORITY (COUNTER_IRQ_PRIORITY + 1)
+
+// TIMER_CLOCK1 ticks (MCK/2) of each pulse, and the shortest interval
+#define GENERATOR_PULSE_TICKS 24
+#define GENERATOR_MIN_TICKS 48
+// A late interrupt must still leave RC ahead of the counter
+#define GENERATOR_MARGIN_TICKS 8
+
+#define GENERATOR_STEP_MAX_HZ 3000000
+// Counted step trains and pulse trains interrupt on every edge
+#define GENERATOR_COUNTED_MAX_HZ 200000
+#define GENERATOR_POISSON_MAX_HZ 100000
+#define GENERATOR_SEED 0x9E3779B9
+
+typedef struct
+{
+	Tc *tc;
+	uint8_t channel;
+	uint8_t id;
+	Pio *pio;
+	uint32_t pin;
+} generator_output_t;
+
+#define GENERATOR_OUTPUT(n) { COUNTER_TC_BLOCK(GENERATOR_OUTPUT##n##_TC), \
+	COUNTER_TC_CHANNEL(GENERATOR_OUTPUT##n##_TC), COUNTER_TC_ID(GENERATOR_OUTPUT##n##_TC), \
+	GENERATOR_PIO, GENERATOR_OUTPUT##n##_PIN }
+
+static const generator_output_t generator_outputs[GENERATOR_OUTPUTS] =
+{
+	GENERATOR_OUTPUT(0),
+	GENERATOR_OUTPUT(1),
+	GENERATOR_OUTPUT(2),
+	GENERATOR_OUTPUT(3),
+};
+
+// Bit per running output
+static volatile uint8_t generator_active = 0;
+// Edges sent since each output started; free-running step trains are not counted
+static volatile uint32_t generator_pulses[GENERATOR_OUTPUTS];
+static uint32_t generator_steps;
+static uint32_t generator_mean[GENERATOR_OUTPUTS];
+static uint32_t generator_seed[GENERATOR_OUTPUTS];
+
+// Next interval of a pulse output.  -ln(u) of the xorshift32 draw u is
+// taken as (32 - log2(u)) * ln 2, with the integer part of log2 from the
+// leading zero count and a quadratic for the fraction (within 0.008).
+// In 16.16 fixed point, so the interrupt never touches the FPU.
+#define GENERATOR_LOG_A 88244   // 1.3465
+#define GENERATOR_LOG_B 22708   // 0.3465
+#define GENERATOR_LN2 45426     // ln 2
+
+static inline uint32_t generator_interval(uint8_t output)
+{
+	uint32_t x = generator_seed[output];
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	generator_seed[output] = x;
+
+	uint32_t zeros = __CLZ(x);
+	uint32_t fraction = (x << zeros >> 15) & 0xFFFF;
+	uint32_t log2_u = ((31 - zeros) << 16)
+		+ (uint32_t)((uint64_t)fraction * (GENERATOR_LOG_A - (GENERATOR_LOG_B * fraction >> 16)) >> 16);
+	uint64_t scaled = (uint64_t)generator_mean[output] * ((32 << 16) - log2_u) >> 16;
+	return GENERATOR_MIN_TICKS + (uint32_t)(scaled * GENERATOR_LN2 >> 16);
+}
+
+static void generator_pulse(uint8_t output)
+{
+	TcChannel *channel = &generator_outputs[output].tc->TC_CHANNEL[generator_outputs[output].channel];
+
+	// Reading TC_SR acknowledges the compare
+	(void)channel->TC_SR;
+	generator_pulses[output]++;
+
+	uint32_t rc = generator_interval(output);
+	uint32_t floor = channel->TC_CV + GENERATOR_MARGIN_TICKS;
+	channel->TC_RC = rc > floor ? rc : floor;
+}
+
+#if !COUNTER_POSITION_QDEC
+// Scans (M1087) drive the motor from generator output 0, with TIOA5
+// jumpered to COUNTER_STEP_PIN as for counted step trains and
+// COUNTER_DIR_PIN driven as an output to the driver's direction input.
+// The step interrupt then counts the very steps the motor is given, so
+// the position is known without polling the external controller, which
+// must be disconnected.  A scan approaches its first column with
+// counting off, then starts counting as M1003 would and drives to its
+// last column, where the interrupt of the last step stops counting and
+// a stop_push_t follows.  Each move ramps from MOTION_MIN_HZ at the
+// scan acceleration, v^2 = v0^2 + 2as from whichever end of the move is
+// nearer, up to the scan rate; TC5_Handler sets each step's interval.
+// An adaptive scan (M1088) aims instead for motion_adapt_counts in
+// every column, a relative uncertainty of 1/sqrt(counts): each column
+// committed sets the rate that would have given it that many, which
+// the next column then ramps to within the same acceleration.  The
+// first column is crossed at MOTION_MIN_HZ.
+#define MOTION_IDLE 0
+#define MOTION_APPROACH 1
+#define MOTION_SCAN 2
+
+// TIMER_CLOCK2 (MCK/8) fits the slowest steps in the 16-bit counter
+#define MOTION_TICK_DIVIDER 8
+#define MOTION_MIN_HZ 250
+
+static volatile uint8_t motion_phase = MOTION_IDLE;
+// Steps sent of the current move, and its length
+static volatile uint32_t motion_done;
+static volatile uint32_t motion_total;
+static uint32_t motion_scan_steps;
+static bool motion_scan_forward;
+static uint32_t motion_tick_hz;
+// Squared rates (steps/s): the start, 2a and the last step's
+static float motion_start_sq;
+static float motion_accel2;
+static float motion_speed_sq;
+// The scan rate, and the rate aimed for, which motion_column sets from
+// the step interrupt and so is kept as an integer
+static uint32_t motion_rate_hz;
+static volatile uint32_t motion_target_hz;
+
+// Primary counts wanted per column, 0 for a fixed rate
+static uint32_t motion_adapt_counts;
+// Ticks of the steps sent, and their total as the last column was committed
+static volatile uint32_t motion_ticks;
+static uint32_t motion_column_ticks;
+
+// Sets the interval of step done of the current move
+static void motion_period(TcChannel *channel, uint32_t done)
+{
+	float rate_sq = (float)motion_target_hz * (float)motion_target_hz;
+	if (motion_accel2 > 0.0f)
+	{
+		// Within 2a of the last step, and able to stop at the end
+		float end_sq = motion_start_sq + motion_accel2 * (float)(motion_total - done - 1);
+		rate_sq = Min(rate_sq, motion_speed_sq + motion_accel2);
+		rate_sq = Max(rate_sq, motion_speed_sq - motion_accel2);
+		rate_sq = Max(Min(rate_sq, end_sq), motion_start_sq);
+	}
+	motion_speed_sq = rate_sq;
+	uint32_t rc = (uint32_t)((float)motion_tick_hz / sqrtf(rate_sq));
+
+	// High from RA to RC, so the step edge must still be ahead of the counter
+	uint32_t floor = channel->TC_CV + GENERATOR_MARGIN_TICKS;
+	uint32_t ra = Max(rc / 2, floor);
+	channel->TC_RA = ra;
+	channel->TC_RC = Max(rc, ra + GENERATOR_MARGIN_TICKS);
+}
+
+static void motion_move(uint32_t steps, bool forward)
+{
+	TcChannel *channel = COUNTER_TC_REGS(GENERATOR_OUTPUT0_TC);
+
+	if (forward)
+		COUNTER_PIO->PIO_SODR = COUNTER_DIR_PIN;
+	else
+		COUNTER_PIO->PIO_CODR = COUNTER_DIR_PIN;
+
+	motion_done = 0;
+	motion_total = steps;
+	motion_speed_sq = motion_start_sq - motion_accel2;
+	if (steps == 1)
+		channel->TC_CMR |= TC_CMR_CPCSTOP;
+	else
+		channel->TC_CMR &= ~TC_CMR_CPCSTOP;
+	motion_period(channel, 0);
+	channel->TC_CCR = TC_CCR_CLKEN | TC_CCR_SWTRG;
+}
+
+// Output 0 is stopped; gives the direction pin back to the external controller
+static void motion_release(void)
+{
+	motion_phase = MOTION_IDLE;
+	motion_adapting = false;
+	pio_configure(COUNTER_PIO, PIO_TYPE_PIO_INPUT, COUNTER_DIR_PIN, 0);
+}
+
+// Starts counting and the move from the first column to the last
+static void motion_scan(void)
+{
+	motion_phase = MOTION_SCAN;
+	if (motion_adapt_counts)
+	{
+		motion_target_hz = MOTION_MIN_HZ;
+		motion_column_ticks = motion_ticks;
+		motion_adapting = true;
+	}
+	count_start();
+	motion_move(motion_scan_steps, motion_scan_forward);
+}
+
+// The rate that would have given the column just committed
+// motion_adapt_counts, for the steps that follow.  Kept out of line,
+// off the usual step path, and in integers like the rest of the step
+// interrupt, which never touches the FPU (see fpu_stacking).
+COUNTER_ISR static __attribute__((noinline)) void motion_column(uint32_t counts)
+{
+	uint32_t ticks = motion_ticks - motion_column_ticks;
+	motion_column_ticks = motion_ticks;
+	if (ticks == 0)
+		return;
+
+	// Counts per second first, which a 32-bit count and tick rate keep in range
+	uint64_t rate = Min((uint64_t)counts * motion_tick_hz / ticks, UINT32_MAX);
+	uint64_t hz = rate * bin_factor / motion_adapt_counts;
+	motion_target_hz = Max(Min(hz, motion_rate_hz), MOTION_MIN_HZ);
+}
+
+static void motion_irq(void)
+{
+	TcChannel *channel = COUNTER_TC_REGS(GENERATOR_OUTPUT0_TC);
+	(void)channel->TC_SR;
+
+	// As for counted steps, the last one stops the clock with CPCSTOP
+	motion_ticks += channel->TC_RC;
+	uint32_t done = ++motion_done;
+	if (done + 1 == motion_total)
+		channel->TC_CMR |= TC_CMR_CPCSTOP;
+	if (done < motion_total)
+	{
+		motion_period(channel, done);
+		return;
+	}
+
+	if (motion_phase == MOTION_APPROACH)
+	{
+		motion_scan();
+		return;
+	}
+
+	// The step interrupt came half a period earlier and committed the last column
+	stop_fire(STOP_SCAN, sof_count - count_started);
+	channel->TC_IDR = TC_IDR_CPCS;
+	generator_active &= ~1;
+	motion_release();
+}
+#endif
+
+void COUNTER_TC_HANDLER(GENERATOR_OUTPUT0_TC)(void)
+{
+	TcChannel *channel = COUNTER_TC_REGS(GENERATOR_OUTPUT0_TC);
+#if !COUNTER_POSITION_QDEC
+	if (motion_phase != MOTION_IDLE)
+	{
+		motion_irq();
+		return;
+	}
+#endif
+	(void)channel->TC_SR;
+
+	// The last step stops the clock itself with CPCSTOP
+	uint32_t sent = ++generator_pulses[0];
+	if (sent + 1 == generator_steps)
+		channel->TC_CMR |= TC_CMR_CPCSTOP;
+	else if (sent == generator_steps)
+	{
+		channel->TC_IDR = TC_IDR_CPCS;
+		generator_active &= ~1;
+#if PROFILE_ENABLE
+		step_latency_source = NULL;
+#endif
+	}
+}
+
+void COUNTER_TC_HANDLER(GENERATOR_OUTPUT1_TC)(void)
+{
+	generator_pulse(1);
+}
+
+void COUNTER_TC_HANDLER(GENERATOR_OUTPUT2_TC)(void)
+{
+	generator_pulse(2);
+}
+
+void COUNTER_TC_HANDLER(GENERATOR_OUTPUT3_TC)(void)
+{
+	if (pulse_capture != PULSE_CAPTURE_OFF)
+		pulse_capture_irq();
+	else
+		generator_pulse(3);
+}
+
+static void generator_stop(uint8_t output)
+{
+	const generator_output_t *g = &generator_outputs[output];
+
+	tc_stop(g->tc, g->channel);
+	tc_disable_interrupt(g->tc, g->channel, TC_IDR_CPCS);
+	NVIC_DisableIRQ((IRQn_Type)g->id);
+	NVIC_ClearPendingIRQ((IRQn_Type)g->id);
+	pio_configure(g->pio, PIO_TYPE_PIO_INPUT, g->pin, 0);
+	generator_active &= ~(1 << output);
+#if !COUNTER_POSITION_QDEC
+	if (output == 0 && motion_phase != MOTION_IDLE)
+		motion_release();
+#endif
+#if PROFILE_ENABLE
+	if (output == 0)
+		step_latency_source = NULL;
+#endif
+}
+
+// Start output at hz; arg is the number of steps for output 0 (0 runs
+// until stopped) and the seed for the pulse outputs (0 for the default)
+static void generator_start(uint8_t output, uint32_t hz, uint32_t arg)
+{
+	const generator_output_t *g = &generator_outputs[output];
+	uint32_t ticks = sysclk_get_peripheral_hz() / 2 / hz;
+
+	generator_stop(output);
+	pmc_enable_periph_clk(g->id);
+	generator_pulses[output] = 0;
+
+	if (output == 0)
+	{
+		// High from RA to RC, as in the benchmark
+		uint32_t cmr = TC_CMR_TCCLKS_TIMER_CLOCK1 | TC_CMR_WAVE | TC_CMR_WAVSEL_UP_RC
+			| TC_CMR_ACPA_SET | TC_CMR_ACPC_CLEAR;
+		generator_steps = arg;
+		if (arg == 1)
+			cmr |= TC_CMR_CPCSTOP;
+		tc_init(g->tc, g->channel, cmr);
+		tc_write_ra(g->tc, g->channel, ticks / 2);
+		tc_write_rc(g->tc, g->channel, ticks);
+		if (arg)
+			tc_enable_interrupt(g->tc, g->channel, TC_IER_CPCS);
+	}
+	else
+	{
+		// Each RC compare starts a pulse of GENERATOR_PULSE_TICKS
+		tc_init(g->tc, g->channel, TC_CMR_TCCLKS_TIMER_CLOCK1 | TC_CMR_WAVE | TC_CMR_WAVSEL_UP_RC
+			| TC_CMR_ACPC_SET | TC_CMR_ACPA_CLEAR);
+		generator_mean[output] = ticks - GENERATOR_MIN_TICKS;
+		generator_seed[output] = arg ? arg : GENERATOR_SEED + output;
+		tc_write_ra(g->tc, g->channel, GENERATOR_PULSE_TICKS);
+		tc_write_rc(g->tc, g->channel, generator_interval(output));
+		tc_enable_interrupt(g->tc, g->channel, TC_IER_CPCS);
+	}
+
+	NVIC_SetPriority((IRQn_Type)g->id, GENERATOR_IRQ_PRIORITY);
+	NVIC_EnableIRQ((IRQn_Type)g->id);
+	pio_configure(g->pio, PIO_TYPE_PIO_PERIPH_B, g->pin, 0);
+	generator_active |= 1 << output;
+	tc_start(g->tc, g->channel);
+#if PROFILE_ENABLE
+	// A single step stops the counter, leaving nothing to measure later edges against
+	if (output == 0 && arg != 1)
+		step_latency_source = &g->tc->TC_CHANNEL[g->channel];
+#endif
+}
+
+// M1043 reports the edges sent by each output.  M1043 <output> <hz> [n]
+// starts an output (n steps for output 0, n the seed for outputs 1-3)
+// and M1043 <output> 0 stops it.
+static void command_m1043(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_str("ok\n");
+		for (uint8_t output = 0; output < GENERATOR_OUTPUTS; output++)
+		{
+			if (output)
+				reply_char(' ');
+			reply_u32(generator_pulses[output]);
+		}
+		reply_char('\n');
+		return;
+	}
+
+	if (argc < 2 || argv[0] < 0 || argv[0] >= GENERATOR_OUTPUTS)
+	{
+		reply_str("error: generator command requires an output of 0-3 and a rate\n");
+		return;
+	}
+
+	uint8_t output = argv[0];
+	if (COUNTER_USES_TC(generator_outputs[output].id))
+	{
+		reply_str("error: timer is used by a counter channel\n");
+		return;
+	}
+
+	if (FRAME_STORE_TAKES(generator_outputs[output].pio, generator_outputs[output].pin))
+	{
+		reply_str("error: pin is used by the frame store\n");
+		return;
+	}
+
+#if COUNTER_POSITION_QDEC
+	if (output == 2)
+	{
+		reply_str("error: output 2 is used by the quadrature decoder\n");
+		return;
+	}
+#endif
+	if (output == PULSE_GENERATOR_OUTPUT && pulse_capture != PULSE_CAPTURE_OFF)
+	{
+		reply_str("error: output 3 is used by pulse capture\n");
+		return;
+	}
+
+	uint32_t arg = argc > 2 ? (uint32_t)argv[2] : 0;
+	int32_t max_hz = output ? GENERATOR_POISSON_MAX_HZ : arg ? GENERATOR_COUNTED_MAX_HZ : GENERATOR_STEP_MAX_HZ;
+	if (argv[1] < 0 || argv[1] > max_hz)
+	{
+		reply_str("error: rate out of range\n");
+		return;
+	}
+
+	if (argv[1])
+		generator_start(output, argv[1], arg);
+	else
+		generator_stop(output);
+	reply_str("ok\n");
+}
+
+#if !COUNTER_POSITION_QDEC
+// M1087 reports the scan as "<phase> <steps> <total>", the steps sent
+// of the current move (1 approaching, 2 scanning).  M1087 <from> <to>
+// <hz> [<accel> [<swap>]] drives the head to column <from> from the
+// origin and counts on the way to column <to> at up to <hz> steps/s,
+// ramping at <accel> steps/s^2 (0 for none).  With <swap> 1 the frame
+// is swapped out at the end as by M1025.  M1087 0 aborts, stopping
+// counting if the scan had started it.  The steps come from output 0
+// of M1043, so stopping that aborts too, but leaves counting on.
+static void command_m1087(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_str("ok\n");
+		reply_u32(motion_phase);
+		reply_char(' ');
+		reply_u32(motion_done);
+		reply_char(' ');
+		reply_u32(motion_total);
+		reply_char('\n');
+		return;
+	}
+
+	if (argc == 1 && argv[0] == 0)
+	{
+		irqflags_t flags = cpu_irq_save();
+		if (motion_phase == MOTION_SCAN && enable_count)
+			stop_fire(STOP_SCAN, sof_count - count_started);
+		if (motion_phase != MOTION_IDLE)
+			generator_stop(0);
+		cpu_irq_restore(flags);
+		reply_str("ok\n");
+		return;
+	}
+
+	if (argc < 3)
+	{
+		reply_str("error: scan command requires two columns and a rate\n");
+		return;
+	}
+
+	int32_t from = argv[0], to = argv[1], hz = argv[2], accel = argc > 3 ? argv[3] : 0;
+	if (from + head_origin < 0 || from + head_origin >= travel_columns || to + head_origin < 0
+		|| to + head_origin >= travel_columns || from == to)
+	{
+		reply_str("error: invalid column range\n");
+		return;
+	}
+
+	if (hz < MOTION_MIN_HZ || hz > GENERATOR_COUNTED_MAX_HZ || accel < 0)
+	{
+		reply_str("error: rate out of range\n");
+		return;
+	}
+
+	if (COUNTER_USES_TC(COUNTER_TC_ID(GENERATOR_OUTPUT0_TC)))
+	{
+		reply_str("error: timer is used by a counter channel\n");
+		return;
+	}
+
+	if (FRAME_STORE_TAKES(GENERATOR_PIO, GENERATOR_OUTPUT0_PIN))
+	{
+		reply_str("error: pin is used by the frame store\n");
+		return;
+	}
+
+	if (enable_count || start_armed != START_ARMED_NONE || motion_phase != MOTION_IDLE)
+	{
+		reply_str("error: counter is active\n");
+		return;
+	}
+
+	if (generator_active & 1)
+	{
+		reply_str("error: step generator is active\n");
+		return;
+	}
+
+	if (count_mode == COUNT_MODE_CAPTURE || timed_active)
+	{
+		reply_str("error: the head does not follow the step input\n");
+		return;
+	}
+
+#if COUNTER_SYNC
+	if (sync_mode == SYNC_MODE_SLAVE)
+	{
+		reply_str("error: columns follow the sync master\n");
+		return;
+	}
+#endif
+
+	// Whole columns are stepped, and each step must move the head once
+	if (bin_phase != 0 || step_both_edges)
+	{
+		reply_str("error: scans need the head on a column and M1065 0\n");
+		return;
+	}
+
+	int32_t approach = from - (head_position - head_origin);
+	motion_scan_steps = (uint32_t)abs(to - from) * bin_factor;
+	motion_scan_forward = to > from;
+	motion_tick_hz = sysclk_get_peripheral_hz() / MOTION_TICK_DIVIDER;
+	motion_rate_hz = hz;
+	motion_target_hz = hz;
+	motion_start_sq = (float)MOTION_MIN_HZ * MOTION_MIN_HZ;
+	motion_accel2 = 2.0f * (float)accel;
+	stop_scan_swap = argc > 4 && argv[4];
+
+	generator_stop(0);
+	pmc_enable_periph_clk(COUNTER_TC_ID(GENERATOR_OUTPUT0_TC));
+	tc_init(COUNTER_TC_BLOCK(GENERATOR_OUTPUT0_TC), COUNTER_TC_CHANNEL(GENERATOR_OUTPUT0_TC),
+		TC_CMR_TCCLKS_TIMER_CLOCK2 | TC_CMR_WAVE | TC_CMR_WAVSEL_UP_RC | TC_CMR_ACPA_SET | TC_CMR_ACPC_CLEAR);
+	tc_enable_interrupt(COUNTER_TC_BLOCK(GENERATOR_OUTPUT0_TC), COUNTER_TC_CHANNEL(GENERATOR_OUTPUT0_TC), TC_IER_CPCS);
+	NVIC_SetPriority(COUNTER_TC_IRQn(GENERATOR_OUTPUT0_TC), GENERATOR_IRQ_PRIORITY);
+	NVIC_EnableIRQ(COUNTER_TC_IRQn(GENERATOR_OUTPUT0_TC));
+	pio_configure(GENERATOR_PIO, PIO_TYPE_PIO_PERIPH_B, GENERATOR_OUTPUT0_PIN, 0);
+	pio_configure(COUNTER_PIO, PIO_TYPE_PIO_OUTPUT_0, COUNTER_DIR_PIN, 0);
+	generator_pulses[0] = 0;
+	generator_active |= 1;
+
+	irqflags_t flags = cpu_irq_save();
+	if (approach)
+	{
+		motion_phase = MOTION_APPROACH;
+		motion_move((uint32_t)abs(approach) * bin_factor, approach > 0);
+	}
+	else
+		motion_scan();
+	cpu_irq_restore(flags);
+	reply_str("ok\n");
+}
+
+// M1088 reports "<counts> <hz>", the counts aimed for in each column
+// and the rate an adaptive scan is stepping at.  M1088 <counts> makes
+// the scans that follow adaptive, crossing each column at the rate
+// that gives about <counts> primary counts there (a relative
+// uncertainty of 1/sqrt(<counts>)) up to the M1087 rate, and M1088 0
+// goes back to a fixed rate.
+static void command_m1088(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		float speed = sqrtf(motion_speed_sq);
+		reply_str("ok\n");
+		reply_u32(motion_adapt_counts);
+		reply_char(' ');
+		reply_u32(motion_adapting ? (uint32_t)speed : 0);
+		reply_char('\n');
+		return;
+	}
+
+	if (argv[0] < 0)
+	{
+		reply_str("error: adaptive scan command requires a count of 0 or more\n");
+		return;
+	}
+
+	if (motion_phase != MOTION_IDLE)
+	{
+		reply_str("error: counter is active\n");
+		return;
+	}
+
+	motion_adapt_counts = argv[0];
+	reply_str("ok\n");
+}
+#endif
+
+// Whether the pulse timer can be taken for mode, replying with the error if not
+static bool pulse_capture_free(uint8_t mode)
+{
+	if (FRAME_STORE_TAKES(PULSE_PIO, PULSE_PIN))
+	{
+		reply_str("error: pin is used by the frame store\n");
+		return false;
+	}
+
+	if (generator_active & (1 << PULSE_GENERATOR_OUTPUT))
+	{
+		reply_str("error: timer is used by generator output 3\n");
+		return false;
+	}
+
+	if (pulse_capture != PULSE_CAPTURE_OFF && pulse_capture != mode)
+	{
+		reply_str(pulse_capture == PULSE_CAPTURE_HISTOGRAM ? "error: timer is used by the histogram\n"
+			: "error: timer is used by list mode\n");
+		return false;
+	}
+
+	return true;
+}
+
+// M1070 reports the interval histogram as "<on> <shift> <tick hz> <first>
+// <last> <missed>".  M1070 1 [<shift> [<first> <last>]] starts it afresh
+// with bins of 1 << shift TIMER_CLOCK1 ticks (0 to 8), binning only
+// pulses while the head is over columns first to last if given;
+// M1070 0 stops it, keeping the bins for M1071.
+static void command_m1070(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_str("ok\n");
+		reply_u32(pulse_capture == PULSE_CAPTURE_HISTOGRAM);
+		reply_char(' ');
+		reply_u32(histogram_shift);
+		reply_char(' ');
+		reply_u32(sysclk_get_peripheral_hz() / 2);
+		reply_char(' ');
+		reply_u32(histogram_first);
+		reply_char(' ');
+		reply_u32(histogram_last);
+		reply_char(' ');
+		reply_u32(pulse_missed);
+		reply_char('\n');
+		return;
+	}
+
+	if (argv[0] != 0 && argv[0] != 1)
+	{
+		reply_str("error: histogram command requires an argument of 0 or 1\n");
+		return;
+	}
+
+	if (argv[0] == 0)
+	{
+		if (pulse_capture == PULSE_CAPTURE_HISTOGRAM)
+			pulse_capture_stop();
+		reply_str("ok\n");
+		return;
+	}
+
+	int32_t shift = argc > 1 ? argv[1] : 0;
+	if (shift < 0 || shift > HISTOGRAM_SHIFT_MAX)
+	{
+		reply_str("error: histogram shift must be 0-8\n");
+		return;
+	}
+
+	int32_t first = 0, last = -1;
+	if (argc > 2)
+	{
+		if (argc < 4 || argv[2] < 0 || argv[3] < argv[2] || argv[3] >= column_count)
+		{
+			reply_str("error: invalid column range\n");
+			return;
+		}
+		first = argv[2];
+		last = argv[3];
+	}
+
+	if (!pulse_capture_free(PULSE_CAPTURE_HISTOGRAM))
+		return;
+
+	if (!histogram_bins)
+		histogram_bins = pool_reserve(&sram_pool, "histogram", HISTOGRAM_BINS * sizeof(uint32_t));
+	if (!histogram_bins)
+	{
+		reply_str("error: no SRAM for the histogram\n");
+		return;
+	}
+
+	histogram_shift = shift;
+	histogram_first = first;
+	histogram_last = last;
+	memset((void *)histogram_bins, 0, HISTOGRAM_BINS * sizeof(uint32_t));
+	pulse_capture_start(PULSE_CAPTURE_HISTOGRAM);
+	reply_str("ok\n");
+}
+
+// Read the interval histogram in binary: M1071 [clear].  The header's
+// reserved field holds the shift, and with clear set the bins start
+// over from the snapshot sent.
+static void command_m1071(const int32_t *argv, uint8_t argc)
+{
+	if (!histogram_bins)
+	{
+		reply_str("error: the histogram has not been started\n");
+		return;
+	}
+
+	// A snapshot, so the CRC still matches what is sent while binning goes on
+	uint32_t bins[HISTOGRAM_BINS];
+	irqflags_t flags = cpu_irq_save();
+	memcpy(bins, (const void *)histogram_bins, sizeof(bins));
+	if (argc > 0 && argv[0])
+		memset((void *)histogram_bins, 0, sizeof(bins));
+	cpu_irq_restore(flags);
+
+	readout_header_t header;
+	header.channel = READOUT_HISTOGRAM;
+	header.start = 0;
+	header.end = HISTOGRAM_BINS - 1;
+	header.length = sizeof(bins);
+	header.crc = crc16_update(0xFFFF, (const uint8_t *)bins, sizeof(bins));
+	header.width = sizeof(uint32_t);
+	header.flags = 0;
+	header.reserved = histogram_shift;
+
+	reply_str("ok\n");
+	if (write_binary(&header, sizeof(header)) && write_binary(bins, sizeof(bins)))
+		reply_str("ok\n");
+}
+
+// M1072 reports list mode as "<on> <channel> <events> <missed>".
+// M1072 1 [<channel>] starts it afresh, tagging every pulse with channel
+// (0 by default), and M1072 0 stops it; the events still in the ring
+// are sent after.  Column streaming (M1017) has to be off.
+static void command_m1072(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_str("ok\n");
+		reply_u32(pulse_capture == PULSE_CAPTURE_EVENTS);
+		reply_char(' ');
+		reply_u32(event_channel);
+		reply_char(' ');
+		reply_u32(event_count);
+		reply_char(' ');
+		reply_u32(pulse_missed);
+		reply_char('\n');
+		return;
+	}
+
+	int32_t channel = argc > 1 ? argv[1] : 0;
+	if ((argv[0] != 0 && argv[0] != 1) || channel < 0 || channel > UINT8_MAX)
+	{
+		reply_str("error: list mode command requires 0, or 1 and a channel of 0-255\n");
+		return;
+	}
+
+	if (argv[0] == 0)
+	{
+		if (pulse_capture == PULSE_CAPTURE_EVENTS)
+			pulse_capture_stop();
+		stream_events = false;
+		reply_str("ok\n");
+		return;
+	}
+
+	if (enable_stream)
+	{
+		reply_str("error: column streaming is on\n");
+		return;
+	}
+
+	if (!pulse_capture_free(PULSE_CAPTURE_EVENTS))
+		return;
+
+	pulse_capture_stop();
+	stream_restart(STREAM_EVENT_MAGIC);
+	event_channel = channel;
+	event_count = 0;
+	event_missed = false;
+	stream_events = true;
+	pulse_capture_start(PULSE_CAPTURE_EVENTS);
+	reply_str("ok\n");
+}
+
+// SRAM pool layout: M1078 reports a "<name> <offset> <bytes>" line for
+// each reservation and then "free <bytes> <size> <peak>".  M1078 0 gives
+// every reservation back once their modes are off, for the next mode to
+// reserve afresh.
+static void command_m1078(const int32_t *argv, uint8_t argc)
+{
+	if (argc > 0 && argv[0] != 0)
+	{
+		reply_str("error: pool command takes no argument or 0\n");
+		return;
+	}
+
+	if (argc > 0)
+	{
+		if (pass_accumulate || pyramid_on || pulse_capture == PULSE_CAPTURE_HISTOGRAM || sweep_active || sweep_done
+			|| readout_compress || preview_on)
+		{
+			reply_str("error: a mode is using the pool\n");
+			return;
+		}
+
+		pass_sum = NULL;
+		pass_visits = NULL;
+		pyramid = NULL;
+		pyramid_copy = NULL;
+		histogram_bins = NULL;
+		reference = NULL;
+		reference_cells = 0;
+		head_calibration = NULL;
+		head_knots = 0;
+		readout_lz4 = NULL;
+		sweep_counts = NULL;
+		kernel_bench = NULL;
+		preview = NULL;
+		pool_reset(&sram_pool);
+		reply_str("ok\n");
+		return;
+	}
+
+	reply_str("ok\n");
+	for (uint8_t i = 0; i < sram_pool.count; i++)
+	{
+		const pool_reservation_t *reservation = &sram_pool.reservations[i];
+		reply_str(reservation->name);
+		reply_char(' ');
+		reply_u32(reservation->offset);
+		reply_char(' ');
+		reply_u32(reservation->bytes);
+		reply_char('\n');
+	}
+	reply_str("free ");
+	reply_u32(pool_free(&sram_pool));
+	reply_char(' ');
+	reply_u32(sram_pool.size);
+	reply_char(' ');
+	reply_u32(sram_pool.peak);
+	reply_char('\n');
+}
+
+#if COUNTER_FRAME_STORE
+// Frame store: M1079 1 [rows] moves each row sealed by M1077 into
+// store row <sequence> % rows (all that fit by default) instead of
+// pushing it, and M1079 0 goes back to pushing.  A row has to be read
+// back before the store laps it.  M1079 reports
+// "<on> <rows> <stored> <capacity>".
+static void command_m1079(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_str("ok\n");
+		reply_u32(frame_store_on);
+		reply_char(' ');
+		reply_u32(frame_rows);
+		reply_char(' ');
+		reply_u32(frame_stored);
+		reply_char(' ');
+		reply_u32(frame_store_capacity());
+		reply_char('\n');
+		return;
+	}
+
+	int32_t enable = argv[0], rows = argc > 1 ? argv[1] : (int32_t)frame_store_capacity();
+	if ((enable != 0 && enable != 1) || rows < 1 || rows > (int32_t)frame_store_capacity())
+	{
+		reply_str("error: frame store command requires 0, or 1 and up to the rows that fit\n");
+		return;
+	}
+
+	if (enable && !frame_store_present)
+	{
+		reply_str("error: no SRAM answered on the frame store\n");
+		return;
+	}
+
+	// The host has the header of the row being pushed
+	if (row_push_next != ROW_PUSH_HEADER)
+	{
+		reply_str("error: a row is being pushed\n");
+		return;
+	}
+
+	frame_store_wait();
+	frame_store_on = false;
+	if (enable)
+	{
+		frame_rows = rows;
+		frame_stored = 0;
+		memset(frame_overflow, 0, sizeof(frame_overflow));
+		frame_store_on = true;
+	}
+
+	reply_str("ok\n");
+}
+
+// Read a stored row: M1080 <row> sends it like a row push, every channel
+// in the arena's layout, with the row's first cell in the frame as start
+static void command_m1080(const int32_t *argv, uint8_t argc)
+{
+	if (argc < 1)
+	{
+		reply_str("error: frame read command requires a row\n");
+		return;
+	}
+
+	int32_t row = argv[0];
+	if (row < 0 || row >= (int32_t)Min(frame_stored, frame_rows))
+	{
+		reply_str("error: row is not in the frame store\n");
+		return;
+	}
+
+	uint32_t bins = frame_row_bins(), first = row * bins;
+	readout_header_t header;
+	header.channel = COUNT_LAYOUT_INTERLEAVED ? READOUT_ALL_INTERLEAVED : READOUT_ALL_PLANAR;
+	header.start = row * column_count;
+	header.end = header.start + column_count - 1;
+	header.length = bins * sizeof(count_t);
+	header.crc = 0xFFFF;
+	header.width = sizeof(count_t);
+	header.flags = (frame_overflow[row / 32] & (1UL << (row & 31))) ? READOUT_FLAG_OVERFLOW : 0;
+	header.reserved = (1 << channel_count) - 1;
+	readout_emit(&FRAME_STORE_BIN(first), header.length, &header.crc);
+
+	reply_str("ok\n");
+	if (readout_send_header(&header))
+		readout_job_start(READOUT_JOB_FRAME, 1, false, first, first + bins - 1);
+}
+#endif
+
+#if COUNTER_BEAM_GATE
+static void beam_gate_set(bool on)
+{
+	beam_gate = on;
+	configure_counters(count_mode);
+}
+
+// M1083 reports "<on> <tick hz>" for the beam gate, M1083 <0|1> sets it
+// while the counter is stopped.  With it on, the tertiary channel's bins
+// are the time the gate was open in each column, in ticks of tick hz,
+// so it must be among the channels given to M1023.
+static void command_m1083(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_str("ok\n");
+		reply_u32(beam_gate);
+		reply_char(' ');
+		reply_u32(sysclk_get_peripheral_hz() / BEAM_GATE_DIVIDER);
+		reply_char('\n');
+		return;
+	}
+
+	if (argv[0] != 0 && argv[0] != 1)
+	{
+		reply_str("error: beam gate command requires an argument of 0 or 1\n");
+		return;
+	}
+
+	if (enable_count)
+	{
+		reply_str("error: counter is active\n");
+		return;
+	}
+
+	// XC2 carries the high half of the chained count
+	if (argv[0] && counter_chained)
+	{
+		reply_str("error: the primary channel is chained\n");
+		return;
+	}
+
+	beam_gate_set(argv[0]);
+	reply_str("ok\n");
+}
+#endif
+
+// Scan log: M1081 1 logs every frame from then on when counting stops,
+// M1081 0 stops logging after the frame being written, and M1081 2
+// erases the log.  M1081 reports
+// "<on> <records> <free pages> <pages> <laps> <errors>", records
+// counting every one written since the log was last erased.
+static void command_m1081(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_str("ok\n");
+		reply_u32(flash_log_on);
+		reply_char(' ');
+		reply_u32(flash_log_serial());
+		reply_char(' ');
+		reply_u32(flash_log_free_pages());
+		reply_char(' ');
+		reply_u32(flash_log_pages());
+		reply_char(' ');
+		reply_u32(flash_log_lap());
+		reply_char(' ');
+		reply_u32(flash_log_errors);
+		reply_char('\n');
+		return;
+	}
+
+	if (argv[0] < 0 || argv[0] > 2)
+	{
+		reply_str("error: scan log command requires 0, 1 or 2\n");
+		return;
+	}
+
+	// Erasing holds off the interrupts for seconds
+	if (argv[0] == 2 && enable_count)
+	{
+		reply_str("error: counter is active\n");
+		return;
+	}
+
+	if (argv[0] == 2 && readout_job.kind == READOUT_JOB_FLASH_LOG)
+	{
+		reply_str("error: the log is being read\n");
+		return;
+	}
+
+	flash_log_wait();
+	if (argv[0] == 2)
+	{
+		if (!flash_log_erase())
+		{
+			reply_str("error: flash erase failed\n");
+			return;
+		}
+	}
+	else
+	{
+		flash_log_on = argv[0];
+		flash_log_counting = enable_count;
+		flash_log_session = sof_count;
+		flash_log_frames = 0;
+		flash_log_errors = 0;
+	}
+
+	reply_str("ok\n");
+}
+
+// Dump the scan log: M1082 sends every record from the oldest, each as
+// its header page and payload pages straight from flash
+static void command_m1082(const int32_t *argv, uint8_t argc)
+{
+	flash_log_wait();
+	uint32_t first = flash_log_first();
+	if (first == FLASH_LOG_NONE)
+	{
+		reply_str("error: the log is empty\n");
+		return;
+	}
+
+	readout_header_t header;
+	header.channel = READOUT_FLASH_LOG;
+	header.start = flash_log_header(first)->serial;
+	header.length = 0;
+	header.crc = 0xFFFF;
+	header.width = 1;
+	header.flags = 0;
+	header.reserved = 0;
+	for (uint32_t page = first; page != FLASH_LOG_NONE; page = flash_log_next(page))
+	{
+		const flash_log_header_t *record = flash_log_header(page);
+		uint32_t bytes = flash_log_record_pages(record) * IFLASH_PAGE_SIZE;
+		readout_emit(record, bytes, &header.crc);
+		header.end = record->serial;
+		header.length += bytes;
+		header.reserved++;
+	}
+
+	reply_str("ok\n");
+	if (readout_send_header(&header))
+		readout_job_start(READOUT_JOB_FLASH_LOG, 1, false, first,
+			first + flash_log_record_pages(flash_log_header(first)) - 1);
+}
+
+#if COUNTER_SD_LOG
+// M1044 reports the frame log: "<on> <records> <next block> <errors>".
+// M1044 1 [first block] [auto] initialises the card and logs every bank
+// swapped out from then on, also swapping at each frame end with auto
+// set.  M1044 0 stops after the record being written.
+static void command_m1044(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_str("ok\n");
+		reply_u32(sd_log_enabled);
+		reply_char(' ');
+		reply_u32(sd_log_records);
+		reply_char(' ');
+		reply_u32(sd_log_next_block);
+		reply_char(' ');
+		reply_u32(sd_log_errors);
+		reply_char('\n');
+		return;
+	}
+
+	if (argv[0] != 0 && argv[0] != 1)
+	{
+		reply_str("error: log command requires an argument of 0 or 1\n");
+		return;
+	}
+
+	if (!argv[0])
+	{
+		sd_log_enabled = false;
+		reply_str("ok\n");
+		return;
+	}
+
+	if (sd_log_writing)
+	{
+		reply_str("error: the previous log is still being written\n");
+		return;
+	}
+
+	// Initialisation takes up to a second without a card
+	if (!sd_init())
+	{
+		reply_str("error: no SD card\n");
+		return;
+	}
+
+	uint32_t first = argc > 1 ? (uint32_t)argv[1] : 0;
+	if (first >= sd_blocks())
+	{
+		reply_str("error: first block is beyond the card\n");
+		return;
+	}
+
+	sd_log_session = sof_count;
+	sd_log_records = 0;
+	sd_log_errors = 0;
+	sd_log_next_block = first;
+	sd_log_auto = argc > 2 && argv[2];
+	sd_log_swaps_seen = bank_swaps;
+	sd_log_frames_seen = frame_ends;
+	sd_log_frames_pending = 0;
+	sd_log_enabled = true;
+	reply_str("ok\n");
+}
+#endif
+
+#if ETH_ENABLE
+// M1045 reports "<link> <a> <b> <c> <d>" for the Ethernet link state and
+// IP address; M1045 <a> <b> <c> <d> sets the address until reset.
+static void command_m1045(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		const uint8_t *ip = eth_address();
+		reply_str("ok\n");
+		reply_u32(eth_link_up());
+		for (uint8_t i = 0; i < 4; i++)
+		{
+			reply_char(' ');
+			reply_u32(ip[i]);
+		}
+		reply_char('\n');
+		return;
+	}
+
+	uint8_t ip[4];
+	for (uint8_t i = 0; i < 4; i++)
+	{
+		if (argc < 4 || argv[i] < 0 || argv[i] > 255)
+		{
+			reply_str("error: address command requires four numbers of 0-255\n");
+			return;
+		}
+		ip[i] = argv[i];
+	}
+
+	// Anything still queued for the old peer is sent first
+	reply_str("ok\n");
+	reply_drain();
+	eth_set_address(ip);
+}
+#endif
+
+#if COUNTER_SYNC
+// A slave's head follows the master's commits instead of its own steps.
+// In pulse mode the head still follows the steps, which no longer
+// commit, and only the rising edges of SYNC_IN_PIN interrupt.
+static void set_sync_mode(uint8_t mode)
+{
+	if (mode == sync_mode)
+		return;
+
+	if (sync_mode == SYNC_MODE_SLAVE || sync_mode == SYNC_MODE_PULSE)
+		pio_disable_interrupt(COUNTER_PIO, SYNC_IN_PIN);
+	if (sync_mode == SYNC_MODE_SLAVE)
+		head_tracking(true);
+	else if (mode == SYNC_MODE_SLAVE)
+		head_tracking(false);
+
+	if (mode == SYNC_MODE_PULSE)
+	{
+		COUNTER_PIO->PIO_ESR = SYNC_IN_PIN;
+		COUNTER_PIO->PIO_REHLSR = SYNC_IN_PIN;
+		COUNTER_PIO->PIO_AIMER = SYNC_IN_PIN;
+	}
+	else
+		COUNTER_PIO->PIO_AIMDR = SYNC_IN_PIN;
+
+	sync_mode = mode;
+#if COUNTER_FAST_STEP_ISR
+	step_handler_select(count_mode);
+#endif
+	if (mode == SYNC_MODE_SLAVE || mode == SYNC_MODE_PULSE)
+		pio_enable_interrupt(COUNTER_PIO, SYNC_IN_PIN);
+	zero_position();
+}
+
+// M1046 reports "<mode> <pulses>"; M1046 <mode> sets the sync mode to 0
+// (independent), 1 (master, driving SYNC_OUT_PIN), 2 (slave, following
+// SYNC_IN_PIN) or 3 (pulse, committing on each beam pulse).
+// A slave's columns advance one per master commit and wrap as in timed
+// acquisition, while its own row steps still select the row.  Send
+// M1003 to the slaves before the master, whose start edge resets them.
+// In pulse mode each rising edge of SYNC_IN_PIN reads and resets the
+// counters (reset or delta count mode) into the cell the steps have
+// brought the head to, and M1017 streams one stream_pulse_t per pulse.
+// Pulses counts the edges since M1003.
+static void command_m1046(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_str("ok\n");
+		reply_u32(sync_mode);
+		reply_char(' ');
+		reply_u32(sync_pulses);
+		reply_char('\n');
+		return;
+	}
+
+	if (argv[0] < SYNC_MODE_NONE || argv[0] > SYNC_MODE_PULSE)
+	{
+		reply_str("error: sync mode must be 0, 1, 2 or 3\n");
+		return;
+	}
+
+	if (enable_count || sync_armed || start_armed)
+	{
+		reply_str("error: counter is active\n");
+		return;
+	}
+
+	if (argv[0] == SYNC_MODE_SLAVE && timed_active)
+	{
+		reply_str("error: timed acquisition is active\n");
+		return;
+	}
+
+	if (argv[0] == SYNC_MODE_SLAVE && count_mode == COUNT_MODE_CAPTURE)
+	{
+		reply_str("error: capture mode follows the step input\n");
+		return;
+	}
+
+#if !COUNTER_POSITION_QDEC
+	if (argv[0] == SYNC_MODE_SLAVE && home_mode != HOME_OFF)
+	{
+		reply_str("error: the home input moves the head\n");
+		return;
+	}
+#endif
+
+	if (argv[0] == SYNC_MODE_PULSE)
+	{
+		if (timed_active)
+		{
+			reply_str("error: timed acquisition is active\n");
+			return;
+		}
+
+		if (count_mode != COUNT_MODE_RESET && count_mode != COUNT_MODE_DELTA)
+		{
+			reply_str("error: pulse mode requires count mode 0 or 2\n");
+			return;
+		}
+
+		// The main loop would stream deferred columns under a later pulse
+		if (defer_columns)
+		{
+			reply_str("error: deferred accumulation is on\n");
+			return;
+		}
+	}
+
+	// The records in the ring change with pulse mode
+	if ((argv[0] == SYNC_MODE_PULSE) != (sync_mode == SYNC_MODE_PULSE) && enable_stream)
+	{
+		reply_str("error: streaming is on\n");
+		return;
+	}
+
+	set_sync_mode(argv[0]);
+	reply_str("ok\n");
+}
+#endif
+
+// M1047 reports "<on> <queued> <dropped>" for deferred accumulation;
+// M1047 <0|1> turns it off or on while the counter is stopped.
+// Dropped records are columns lost to a full ring since it was enabled.
+static void command_m1047(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_str("ok\n");
+		reply_u32(defer_columns);
+		reply_char(' ');
+		reply_u32(ring_count(&defer_queue));
+		reply_char(' ');
+		reply_u32(defer_dropped);
+		reply_char('\n');
+		return;
+	}
+
+	if (argv[0] != 0 && argv[0] != 1)
+	{
+		reply_str("error: defer command requires an argument of 0 or 1\n");
+		return;
+	}
+
+	if (enable_count)
+	{
+		reply_str("error: counter is active\n");
+		return;
+	}
+
+#if COUNTER_SYNC
+	if (argv[0] && sync_mode == SYNC_MODE_PULSE)
+	{
+		reply_str("error: columns follow the beam pulses\n");
+		return;
+	}
+#endif
+
+	if (argv[0] && cine_on)
+	{
+		reply_str("error: cine frames are being counted\n");
+		return;
+	}
+
+	// A swap still in flight decides for itself whether to defer
+	clear_wait();
+	defer_poll();
+	if (argv[0] && !defer_columns)
+		defer_dropped = 0;
+	defer_columns = argv[0];
+	reply_str("ok\n");
+}
+
+#if !COUNTER_POSITION_QDEC
+// M1053 reports whether passes are bidirectional,
+// M1053 <0|1> sets it while the counter is stopped
+static void command_m1053(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_str("ok\n");
+		reply_u32(step_bidirectional);
+		reply_char('\n');
+		return;
+	}
+
+	if (argv[0] != 0 && argv[0] != 1)
+	{
+		reply_str("error: bidirectional command requires an argument of 0 or 1\n");
+		return;
+	}
+
+	if (enable_count)
+	{
+		reply_str("error: counter is active\n");
+		return;
+	}
+
+	step_bidirectional = argv[0];
+	reply_str("ok\n");
+}
+
+// Columns of each pass M1114 correlates, and the largest shift it looks
+// for between them
+#define BACKLASH_COLUMNS 128
+#define BACKLASH_MAX_SHIFT 32
+// Profiles are scaled to this, so that arm_correlate_q15 cannot saturate
+// a sum of BACKLASH_COLUMNS products
+#define BACKLASH_PROFILE_PEAK 0x7FF
+
+// Loads columns of a channel from cell on, less their mean, as q15
+// scaled to BACKLASH_PROFILE_PEAK, so only the shape of the profile counts
+static void backlash_profile(uint8_t channel, uint32_t cell, uint32_t columns, q15_t *profile)
+{
+	int64_t sum = 0;
+	for (uint32_t i = 0; i < columns; i++)
+		sum += COUNT_BIN(channel, cell + i);
+
+	int64_t mean = sum / columns, peak = 1;
+	for (uint32_t i = 0; i < columns; i++)
+	{
+		int64_t value = (int64_t)COUNT_BIN(channel, cell + i) - mean;
+		peak = Max(peak, value < 0 ? -value : value);
+	}
+
+	for (uint32_t i = 0; i < columns; i++)
+		profile[i] = ((int64_t)COUNT_BIN(channel, cell + i) - mean) * BACKLASH_PROFILE_PEAK / peak;
+}
+
+// Measure the backlash between a forward and a reverse pass, each sealed
+// into a row of its own by M1077: M1114 <channel> <forward row>
+// <reverse row> [<apply> [<first column>]] cross-correlates up to
+// BACKLASH_COLUMNS columns of the two from <first column> on and
+// reports "<shift> <peak>", the columns by which the reverse pass is
+// ahead of the forward one, within BACKLASH_MAX_SHIFT, and the q15
+// correlation there.  With <apply> 1 the shift is added to the M1115
+// compensation, so passes measured with it on give what is left over.
+static void command_m1114(const int32_t *argv, uint8_t argc)
+{
+	if (!readout_stable())
+	{
+		reply_str("error: cannot read counter while it is active\n");
+		return;
+	}
+
+	if (argc < 3)
+	{
+		reply_str("error: backlash command requires three to five arguments\n");
+		return;
+	}
+
+	int32_t channel = argv[0], forward = argv[1], reverse = argv[2];
+	bool apply = argc > 3 && argv[3];
+	int32_t first = argc > 4 ? argv[4] : 0;
+	if (channel < 0 || channel >= channel_count || forward < 0 || forward >= row_count
+		|| reverse < 0 || reverse >= row_count || first < 0 || first + 2 * BACKLASH_MAX_SHIFT >= column_count)
+	{
+		reply_str("error: invalid channel, row or column\n");
+		return;
+	}
+
+	if (apply && enable_count)
+	{
+		reply_str("error: counter is active\n");
+		return;
+	}
+
+	uint32_t columns = Min(column_count - first, BACKLASH_COLUMNS);
+	q15_t a[BACKLASH_COLUMNS], b[BACKLASH_COLUMNS], correlation[2 * BACKLASH_COLUMNS - 1];
+	backlash_profile(channel, forward * column_count + first, columns, a);
+	backlash_profile(channel, reverse * column_count + first, columns, b);
+
+	// Output i is the sum of a[k] * b[k + columns - 1 - i], so a reverse
+	// pass shifted by d columns peaks at i = columns - 1 - d
+	arm_correlate_q15(a, columns, b, columns, correlation);
+	int32_t shift = 0;
+	q15_t peak = INT16_MIN;
+	for (int32_t d = -BACKLASH_MAX_SHIFT; d <= BACKLASH_MAX_SHIFT; d++)
+		if (correlation[columns - 1 - d] > peak)
+		{
+			peak = correlation[columns - 1 - d];
+			shift = d;
+		}
+
+	if (apply)
+	{
+		backlash_shift += shift;
+		backlash_direction = 1;
+	}
+
+	reply_i32(shift);
+	reply_char(' ');
+	reply_i32(peak);
+	reply_str("\nok\n");
+}
+
+// M1115 reports the backlash compensation in columns, M1115 <columns>
+// sets it while the counter is stopped, taking the head to be on a
+// forward pass
+static void command_m1115(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_str("ok\n");
+		reply_i32(backlash_shift);
+		reply_char('\n');
+		return;
+	}
+
+	if (argv[0] <= -(int32_t)travel_columns || argv[0] >= (int32_t)travel_columns)
+	{
+		reply_str("error: backlash is beyond the travel\n");
+		return;
+	}
+
+	if (enable_count)
+	{
+		reply_str("error: counter is active\n");
+		return;
+	}
+
+	backlash_shift = argv[0];
+	backlash_direction = 1;
+	reply_str("ok\n");
+}
+
+// Interrupt on both edges of the step pin or on the rising one only,
+// with latch and capture modes following
+static void step_edges_set(bool both)
+{
+	step_both_edges = both;
+	if (both)
+		COUNTER_PIO->PIO_AIMDR = COUNTER_STEP_PIN;
+	else
+	{
+		COUNTER_PIO->PIO_ESR = COUNTER_STEP_PIN;
+		COUNTER_PIO->PIO_REHLSR = COUNTER_STEP_PIN;
+		COUNTER_PIO->PIO_AIMER = COUNTER_STEP_PIN;
+	}
+	configure_counters(count_mode);
+	steps_serviced = step_check_count();
+}
+
+// M1065 reports whether both step edges are counted, M1065 <0|1> sets it
+// while the counter is stopped.  M1020 gives the step interrupt load in
+// either mode.
+static void command_m1065(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_str("ok\n");
+		reply_u32(step_both_edges);
+		reply_char('\n');
+		return;
+	}
+
+	if (argv[0] != 0 && argv[0] != 1)
+	{
+		reply_str("error: edge command requires an argument of 0 or 1\n");
+		return;
+	}
+
+	if (enable_count)
+	{
+		reply_str("error: counter is active\n");
+		return;
+	}
+
+	step_edges_set(argv[0]);
+	reply_str("ok\n");
+}
+
+#if CAPTURE_DIRS
+// M1066 reports whether COUNT_MODE_CAPTURE captures the direction of each
+// step, M1066 <0|1> sets it while the counter is stopped
+static void command_m1066(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_str("ok\n");
+		reply_u32(capture_dirs_enabled);
+		reply_char('\n');
+		return;
+	}
+
+	if (argv[0] != 0 && argv[0] != 1)
+	{
+		reply_str("error: direction capture command requires an argument of 0 or 1\n");
+		return;
+	}
+
+	if (enable_count)
+	{
+		reply_str("error: counter is active\n");
+		return;
+	}
+
+	capture_dirs_enabled = argv[0];
+	if (count_mode == COUNT_MODE_CAPTURE)
+	{
+		capture_poll();
+		configure_counters(count_mode);
+	}
+	reply_str("ok\n");
+}
+#endif
+#endif
+
+// Input filter on the step pins, set by M1064.  The PIO filters the
+// step and row step inputs ahead of their edge interrupts:
+//   STEP_FILTER_NONE      edges are taken as they come
+//   STEP_FILTER_GLITCH    pulses under half an MCK cycle are dropped and
+//                         any of a whole one kept, so the interrupt
+//                         bounds the step rate long before the filter
+//                         does (the boot default)
+//   STEP_FILTER_DEBOUNCE  the slow clock divided down to step_cutoff Hz
+//                         drops pulses under half its period and keeps
+//                         any of a whole one
+// With debouncing a step must stay high and low for a period each, so
+// at most step_cutoff / 2 steps per second are tracked: 8192 with the
+// fastest divider (16384 Hz) down to 0.5 with the slowest (1 Hz).
+// The divider is shared by all of PIOA.  TIOA latch and capture inputs
+// go to the TC unfiltered.
+#define STEP_FILTER_NONE 0
+#define STEP_FILTER_GLITCH 1
+#define STEP_FILTER_DEBOUNCE 2
+
+#define STEP_CUTOFF_MAX ((int32_t)BOARD_FREQ_SLCK_XTAL / 2)
+
+static uint8_t step_filter = STEP_FILTER_GLITCH;
+static uint16_t step_cutoff;
+
+// pio_set_input would also turn the step interrupts off
+static void step_filter_set(uint8_t filter, uint16_t cutoff)
+{
+	if (filter == STEP_FILTER_NONE)
+		COUNTER_PIO->PIO_IFDR = COUNTER_STEP_PINS;
+	else
+	{
+		if (filter == STEP_FILTER_DEBOUNCE)
+			pio_set_debounce_filter(COUNTER_PIO, COUNTER_STEP_PINS, cutoff);
+		else
+			COUNTER_PIO->PIO_IFSCDR = COUNTER_STEP_PINS;
+		COUNTER_PIO->PIO_IFER = COUNTER_STEP_PINS;
+	}
+
+	step_filter = filter;
+	step_cutoff = filter == STEP_FILTER_DEBOUNCE ? cutoff : 0;
+}
+
+// M1064 <filter> [<cutoff Hz>] selects the step input filter while the
+// counter is stopped.  M1064 alone reports "<filter> <cutoff Hz> <max
+// steps per second>", the last 0 when the filter sets no bound.
+static void command_m1064(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		uint32_t max_hz = 0;
+		if (step_filter == STEP_FILTER_GLITCH)
+			max_hz = sysclk_get_peripheral_hz() / 2;
+		else if (step_filter == STEP_FILTER_DEBOUNCE)
+			max_hz = step_cutoff / 2;
+
+		reply_str("ok\n");
+		reply_u32(step_filter);
+		reply_char(' ');
+		reply_u32(step_cutoff);
+		reply_char(' ');
+		reply_u32(max_hz);
+		reply_char('\n');
+		return;
+	}
+
+	int32_t filter = argv[0], cutoff = argc > 1 ? argv[1] : 0;
+	if (filter < STEP_FILTER_NONE || filter > STEP_FILTER_DEBOUNCE
+		|| (filter == STEP_FILTER_DEBOUNCE && (cutoff < 1 || cutoff > STEP_CUTOFF_MAX)))
+	{
+		reply_str("error: invalid step filter\n");
+		return;
+	}
+
+	if (enable_count)
+	{
+		reply_str("error: counter is active\n");
+		return;
+	}
+
+	step_filter_set(filter, cutoff);
+	reply_str("ok\n");
+}
+
+#if !COUNTER_POSITION_QDEC
+// Self-test of the hot paths (M1042).  TC1 channel 2 generates step
+// edges on TIOA5 (PC29), which must be jumpered to COUNTER_STEP_PIN
+// alongside the TCLK6 step check input.
+#define BENCH_TC COUNTER_TC_BLOCK(BENCH_TC_NUMBER)
+#define BENCH_TC_CHANNEL COUNTER_TC_CHANNEL(BENCH_TC_NUMBER)
+#define BENCH_TC_CHANNEL_ID COUNTER_TC_ID(BENCH_TC_NUMBER)
+
+// Each rate runs for BENCH_DWELL_MS; the rate grows by an eighth per
+// step up to BENCH_MAX_HZ, which keeps the edges of one dwell within
+// the 16-bit step check counter
+#define BENCH_START_HZ 10000
+#define BENCH_MAX_HZ 3000000
+#define BENCH_DWELL_MS 20
+
+// The longest command line: an M1040 readout of READOUT_MAX_ROIS ranges
+// fills all COMMAND_MAX_ARGS arguments
+#define BENCH_PARSE_LINE "M1040 0 4 0 999 1000 1999 2000 2999 3000 3999"
+#define BENCH_PARSE_ARGS COMMAND_MAX_ARGS
+#define BENCH_PARSE_RUNS 1000
+
+// Generate steps at hz for one dwell and return how many the interrupt missed
+static uint16_t bench_steps(uint32_t hz)
+{
+	uint32_t rc = sysclk_get_peripheral_hz() / 2 / hz;
+	tc_write_ra(BENCH_TC, BENCH_TC_CHANNEL, rc / 2);
+	tc_write_rc(BENCH_TC, BENCH_TC_CHANNEL, rc);
+
+	irqflags_t flags = cpu_irq_save();
+	steps_serviced = step_check_count();
+	cpu_irq_restore(flags);
+
+	tc_start(BENCH_TC, BENCH_TC_CHANNEL);
+	uint32_t start = sof_count;
+	while (sof_count - start < BENCH_DWELL_MS)
+		;
+	tc_stop(BENCH_TC, BENCH_TC_CHANNEL);
+
+	// Let the last edge be serviced
+	uint32_t stopped = profile_cycles();
+	while (profile_cycles() - stopped < sysclk_get_cpu_hz() / 100000)
+		;
+
+	flags = cpu_irq_save();
+	uint16_t missed = step_check_count() - steps_serviced;
+	cpu_irq_restore(flags);
+	return missed;
+}
+
+// Run the benchmark: step rates until steps are missed, the time to send
+// a whole bank of counts, the time to checksum it, and the cycles to
+// parse a command line.
+// Counting runs during the sweep, so the counts are cleared afterwards.
+// The bank is sent as raw bytes between the "readout <bytes>" line and
+// its time in microseconds.
+static void command_m1042(const int32_t *argv, uint8_t argc)
+{
+	if (enable_count || timed_active)
+	{
+		reply_str("error: counter is active\n");
+		return;
+	}
+
+	if (generator_active & 1)
+	{
+		reply_str("error: step generator is active\n");
+		return;
+	}
+
+	if (COUNTER_USES_TC(BENCH_TC_CHANNEL_ID))
+	{
+		reply_str("error: timer is used by a counter channel\n");
+		return;
+	}
+
+	if (FRAME_STORE_TAKES(BENCH_PIO, BENCH_PIN))
+	{
+		reply_str("error: pin is used by the frame store\n");
+		return;
+	}
+
+	reply_str("ok\n");
+
+	pmc_enable_periph_clk(BENCH_TC_CHANNEL_ID);
+	pio_configure(BENCH_PIO, PIO_TYPE_PIO_PERIPH_B, BENCH_PIN, 0);
+	tc_init(BENCH_TC, BENCH_TC_CHANNEL, TC_CMR_TCCLKS_TIMER_CLOCK1 | TC_CMR_WAVE | TC_CMR_WAVSEL_UP_RC
+		| TC_CMR_ACPA_SET | TC_CMR_ACPC_CLEAR);
+
+	clear_wait();
+	memset(count_snapshot, 0, sizeof(count_snapshot));
+	counter_restart();
+	enable_count = true;
+
+	uint32_t headroom = 0;
+	for (uint32_t hz = BENCH_START_HZ; hz <= BENCH_MAX_HZ; hz += hz / 8)
+	{
+		uint16_t missed = bench_steps(hz);
+		reply_str("step ");
+		reply_u32(hz);
+		reply_char(' ');
+		reply_u32(missed);
+		reply_char('\n');
+		reply_flush();
+
+		if (missed)
+			break;
+		headroom = hz;
+	}
+
+	enable_count = false;
+	pio_configure(BENCH_PIO, PIO_TYPE_PIO_INPUT, BENCH_PIN, 0);
+	zero_position();
+	clear_counts();
+
+	reply_str("headroom ");
+	reply_u32(headroom);
+	reply_char('\n');
+
+	uint32_t cycles_per_us = sysclk_get_cpu_hz() / 1000000;
+	uint32_t bytes = bank_bins * sizeof(count_t);
+	reply_str("readout ");
+	reply_u32(bytes);
+	reply_char('\n');
+	clear_wait();
+	uint32_t start = profile_cycles();
+	write_binary((const void *)count_arena, bytes);
+	reply_u32((profile_cycles() - start) / cycles_per_us);
+	reply_char('\n');
+
+	// The checksums a binary readout (CRC-16) and a container (CRC-32)
+	// cost over the same bank: "crc <bytes> <crc16 us> <crc32 us>"
+	reply_str("crc ");
+	reply_u32(bytes);
+	start = profile_cycles();
+	crc16_update(0xFFFF, (const uint8_t *)count_arena, bytes);
+	reply_char(' ');
+	reply_u32((profile_cycles() - start) / cycles_per_us);
+	start = profile_cycles();
+	crc32_update(0, (const uint8_t *)count_arena, bytes);
+	reply_char(' ');
+	reply_u32((profile_cycles() - start) / cycles_per_us);
+	reply_char('\n');
+
+	int32_t values[BENCH_PARSE_ARGS];
+	uint8_t found;
+	start = profile_cycles();
+	for (uint32_t i = 0; i < BENCH_PARSE_RUNS; i++)
+		parse_command(BENCH_PARSE_LINE, NULL, UINT16_MAX, values, BENCH_PARSE_ARGS, &found);
+	reply_str("parse ");
+	reply_u32((profile_cycles() - start) / BENCH_PARSE_RUNS);
+	reply_char('\n');
+	reply_str("ok\n");
+}
+#endif
+
+// Acquisition self-test (M1127).  The self-test timer sends a square
+// wave on SELFTEST_PIN, which must be jumpered to the clock input of
+// every counter stored, while the time-based acquisition timer of the
+// same block commits a column every whole number of its periods.  Both
+// are restarted together by their block's sync, and the counted edge
+// comes half a period after each commit, so every column holds exactly
+// that many counts until the commit's jitter reaches half a period or
+// the counters drop edges.  The first column, begun by software just
+// after the sync, is not checked.  RC compare resets a timer on the
+// next tick, so a period of n ticks is RC n - 1.
+#define SELFTEST_TC COUNTER_TC_BLOCK(SELFTEST_TC_NUMBER)
+#define SELFTEST_TC_CHANNEL COUNTER_TC_CHANNEL(SELFTEST_TC_NUMBER)
+#define SELFTEST_TC_CHANNEL_ID COUNTER_TC_ID(SELFTEST_TC_NUMBER)
+
+// Rates grow by a quarter per step, each over SELFTEST_COLUMNS checked
+// columns of SELFTEST_COLUMN_US, which keeps the whole ladder under a
+// second and a column of the fastest within 16-bit bins
+#define SELFTEST_START_HZ 100000
+#define SELFTEST_MAX_HZ 20000000
+#define SELFTEST_PASS_HZ 1000000
+#define SELFTEST_COLUMNS 64
+#define SELFTEST_COLUMN_US 500
+
+// Counts columns committed with a pulse every period ticks and returns
+// the cells of the stored channels, in columns 1 to columns - 1, that
+// are not *expected
+static uint32_t selftest_rate(uint32_t period, uint32_t columns, uint32_t *expected)
+{
+	uint32_t ticks_per_us = sysclk_get_peripheral_hz() / 2 / 1000000;
+	uint32_t per_column = Max(SELFTEST_COLUMN_US * ticks_per_us / period, 1);
+	*expected = per_column;
+
+	tc_write_ra(SELFTEST_TC, SELFTEST_TC_CHANNEL, period / 2);
+	tc_write_rc(SELFTEST_TC, SELFTEST_TC_CHANNEL, period - 1);
+	tc_start(SELFTEST_TC, SELFTEST_TC_CHANNEL);
+	clear_wait();
+	clear_counts();
+	timed_start_ticks(per_column * period - 1);
+
+	irqflags_t flags = cpu_irq_save();
+	SELFTEST_TC->TC_BCR = TC_BCR_SYNC;
+	memset(count_snapshot, 0, sizeof(count_snapshot));
+	counter_restart();
+	uint32_t epoch = count_epoch;
+	enable_count = true;
+	cpu_irq_restore(flags);
+
+	// Stopped between the last commit and the next
+	uint32_t start = sof_count;
+	uint32_t timeout = 2 * columns * SELFTEST_COLUMN_US / 1000 + 10;
+	while (count_epoch - epoch < columns && sof_count - start < timeout)
+		;
+	flags = cpu_irq_save();
+	enable_count = false;
+	cpu_irq_restore(flags);
+	timed_stop();
+	tc_stop(SELFTEST_TC, SELFTEST_TC_CHANNEL);
+
+	uint32_t wrong = 0;
+	for (uint8_t c = 0; c < channel_count; c++)
+		for (uint32_t cell = 1; cell < columns; cell++)
+			wrong += preview_bin(c, cell) != per_column;
+	return wrong;
+}
+
+// M1127 [<pass hz>] runs the self-test: a line per rate from 100 kHz,
+// "rate <hz> <counts per column> <wrong cells>", up to the first rate
+// with a wrong cell or 20 MHz, then "accurate <hz>", the fastest rate
+// every cell was right at (0 for none), and "pass" if that reaches
+// <pass hz> (default 1 MHz) or "fail".  The counts are cleared after.
+static void command_m1127(const int32_t *argv, uint8_t argc)
+{
+	int32_t pass_hz = argc > 0 ? argv[0] : SELFTEST_PASS_HZ;
+	if (pass_hz < 1 || pass_hz > SELFTEST_MAX_HZ)
+	{
+		reply_str("error: pass rate must be between 1 Hz and 20 MHz\n");
+		return;
+	}
+
+	if (enable_count || start_armed != START_ARMED_NONE || timed_active || sweep_active || sweep_done)
+	{
+		reply_str("error: counter is active\n");
+		return;
+	}
+
+	if (generator_active)
+	{
+		reply_str("error: a generator output is active\n");
+		return;
+	}
+
+	if (COUNTER_USES_TC(SELFTEST_TC_CHANNEL_ID) || COUNTER_USES_TC(TIMED_TC_CHANNEL_ID))
+	{
+		reply_str("error: timer is used by a counter channel\n");
+		return;
+	}
+
+	if (FRAME_STORE_TAKES(SELFTEST_PIO, SELFTEST_PIN))
+	{
+		reply_str("error: pin is used by the frame store\n");
+		return;
+	}
+
+	if (count_mode == COUNT_MODE_CAPTURE)
+	{
+		reply_str("error: capture mode follows the step input\n");
+		return;
+	}
+
+#if COUNTER_SYNC
+	if (sync_mode == SYNC_MODE_SLAVE || sync_mode == SYNC_MODE_PULSE)
+	{
+		reply_str("error: columns follow the sync input\n");
+		return;
+	}
+#endif
+
+	if (defer_columns || cine_on || energy_binned)
+	{
+		reply_str("error: columns would not be stored as counted\n");
+		return;
+	}
+
+	// Row 0 from its first cell, as the time-based acquisition fills it
+	if (head_origin != window_start || column_count < 2)
+	{
+		reply_str("error: the origin must be the first of two or more columns\n");
+		return;
+	}
+
+	reply_str("ok\n");
+
+	pmc_enable_periph_clk(SELFTEST_TC_CHANNEL_ID);
+	pio_configure(SELFTEST_PIO, PIO_TYPE_PIO_PERIPH_B, SELFTEST_PIN, 0);
+	tc_init(SELFTEST_TC, SELFTEST_TC_CHANNEL, TC_CMR_TCCLKS_TIMER_CLOCK1 | TC_CMR_WAVE | TC_CMR_WAVSEL_UP_RC
+		| TC_CMR_ACPA_SET | TC_CMR_ACPC_CLEAR);
+
+	uint32_t columns = Min(column_count, SELFTEST_COLUMNS + 1);
+	uint32_t accurate = 0;
+	for (uint32_t step = SELFTEST_START_HZ; step <= SELFTEST_MAX_HZ; step += step / 4)
+	{
+		// The rate the whole ticks of TIMER_CLOCK1 give
+		uint32_t period = sysclk_get_peripheral_hz() / 2 / step;
+		uint32_t hz = sysclk_get_peripheral_hz() / 2 / period;
+		uint32_t expected;
+		uint32_t wrong = selftest_rate(period, columns, &expected);
+		reply_str("rate ");
+		reply_u32(hz);
+		reply_char(' ');
+		reply_u32(expected);
+		reply_char(' ');
+		reply_u32(wrong);
+		reply_char('\n');
+		reply_flush();
+
+		if (wrong)
+			break;
+		accurate = hz;
+	}
+
+	pio_configure(SELFTEST_PIO, PIO_TYPE_PIO_INPUT, SELFTEST_PIN, 0);
+	clear_counts();
+
+	reply_str("accurate ");
+	reply_u32(accurate);
+	reply_char('\n');
+	reply_str(accurate >= (uint32_t)pass_hz ? "pass\n" : "fail\n");
+	reply_str("ok\n");
+}
+
+// Commands arrive as binary frames rather than text lines (see reply.h)
+static bool command_binary = false;
+
+// Switch the command protocol: 0 text, 1 binary frames
+static void command_m1028(const int32_t *argv, uint8_t argc)
+{
+	if (argc < 1 || (argv[0] != 0 && argv[0] != 1))
+	{
+		reply_str("error: protocol command requires an argument of 0 or 1\n");
+		return;
+	}
+
+	// Takes effect from the next byte received, this reply
+	// is still sent in the protocol the command arrived in
+	command_binary = argv[0];
+	reply_str("ok\n");
+}
+
+// Push the head position: M1029 0 off, M1029 1 <ms>, M1029 2 <columns>
+static void command_m1029(const int32_t *argv, uint8_t argc)
+{
+	int32_t mode = argv[0], interval = argv[1];
+	if (argc < 1 || mode < POSITION_PUSH_OFF || mode > POSITION_PUSH_COLUMNS
+		|| (mode != POSITION_PUSH_OFF && (argc < 2 || interval < 1 || interval > UINT16_MAX)))
+	{
+		reply_str("error: invalid position push\n");
+		return;
+	}
+
+	position_push_mode = POSITION_PUSH_OFF;
+	position_push_interval = interval;
+	position_push_last = mode == POSITION_PUSH_PERIOD ? sof_count : (uint32_t)head_position;
+	position_push_mode = mode;
+	reply_str("ok\n");
+}
+
+// Whether time-based acquisition may start or stop now, replying with
+// the error if not
+static bool timed_allowed(void)
+{
+	if (enable_count)
+	{
+		reply_str("error: counter is active\n");
+		return false;
+	}
+
+#if COUNTER_SYNC
+	if (sync_mode == SYNC_MODE_SLAVE)
+	{
+		reply_str("error: columns follow the sync master\n");
+		return false;
+	}
+
+	if (sync_mode == SYNC_MODE_PULSE)
+	{
+		reply_str("error: columns follow the beam pulses\n");
+		return false;
+	}
+#endif
+
+#if !COUNTER_POSITION_QDEC
+	if (home_mode != HOME_OFF)
+	{
+		reply_str("error: the home input moves the head\n");
+		return false;
+	}
+#endif
+
+	if (COUNTER_USES_TC(TIMED_TC_CHANNEL_ID))
+	{
+		reply_str("error: timer is used by a counter channel\n");
+		return false;
+	}
+
+	if (count_mode == COUNT_MODE_CAPTURE)
+	{
+		reply_str("error: capture mode follows the step input\n");
+		return false;
+	}
+	return true;
+}
+
+// Commit columns at a fixed rate: M1032 <hz>, or M1032 0 to follow the head again
+static void command_m1032(const int32_t *argv, uint8_t argc)
+{
+	if (argc < 1 || argv[0] < 0 || argv[0] > TIMED_MAX_HZ)
+	{
+		reply_str("error: rate must be between 0 and 100000 Hz\n");
+		return;
+	}
+
+	if (!timed_allowed())
+		return;
+
+	if (argv[0])
+		timed_start(argv[0]);
+	else
+		timed_stop();
+	reply_str("ok\n");
+}
+
+// Boot timing for M1048: CYCCNT when step tracking was armed (still on
+// the 4 MHz RC), when sysclk_init() returned and when USB was started
+static uint32_t boot_tracking_cycles;
+static uint32_t boot_clock_cycles;
+static uint32_t boot_ready_cycles;
+
+// Report the boot times in microseconds from the start of main() (the
+// startup code zeroing .bss runs before and is not included)
+static void command_m1048(const int32_t *argv, uint8_t argc)
+{
+	const uint32_t rc_per_us = CHIP_FREQ_MAINCK_RC_4MHZ / 1000000;
+
+	reply_str("ok\n");
+	reply_str("tracking ");
+	reply_u32(boot_tracking_cycles / rc_per_us);
+	reply_str(" clock ");
+	reply_u32(boot_clock_cycles / rc_per_us);
+	reply_str(" ready ");
+	reply_u32(boot_clock_cycles / rc_per_us + (boot_ready_cycles - boot_clock_cycles) / (sysclk_get_cpu_hz() / 1000000));
+	reply_char('\n');
+}
+
+// Saved settings (M1049), applied at boot so that a session can start
+// acquiring without sending its setup commands again.  The block is
+// kept in the top flash pages (flash.h).  Everything but the calibration
+// curves is also copied to the GPBR, which survive a warm reset though
+// not a power cycle, and stand in when a reset during M1049 left the
+// flash block unfinished.
+#define SETTINGS_MAGIC 0x47464344 // "DCFG"
+#define SETTINGS_GPBR_MAGIC 0xD5C6
+
+#define SETTINGS_TIMESTAMPS 0x01 // M1030
+#define SETTINGS_DEFER 0x02      // M1047
+#define SETTINGS_BIDIRECTIONAL 0x04 // M1053
+#define SETTINGS_LIMITS 0x08     // M1055
+#define SETTINGS_BOTH_EDGES 0x10 // M1065
+#define SETTINGS_CAPTURE_DIRS 0x20 // M1066
+#define SETTINGS_BEAM_GATE 0x40  // M1083
+#define SETTINGS_THRESHOLDS 0x80 // M1091
+
+typedef struct
+{
+	uint16_t bin_factor;  // M1022
+	uint16_t columns;     // M1023
+	uint16_t rows;
+	uint16_t window_start; // M1054
+	uint16_t travel;
+	uint16_t origin;      // M1055
+	uint8_t channels;
+	uint8_t count_mode;   // M1018
+	uint8_t sync_mode;    // M1046
+	uint8_t flags;        // SETTINGS_*
+	uint8_t ip[4];        // M1045
+	float deadtime_ratio; // M1033
+	uint16_t step_cutoff; // M1064
+	uint8_t step_filter;
+	uint16_t thresholds[THRESHOLD_CHANNELS]; // M1091
+} settings_t;
+
+typedef struct
+{
+	uint32_t magic;
+	uint16_t length; // sizeof(settings_block_t), which follows COUNTER_CHANNELS
+	uint16_t crc;    // Of settings and calibration
+	settings_t settings;
+	calibration_t calibration[COUNTER_CHANNELS]; // M1035
+} settings_block_t;
+
+// The first GPBR holds the magic and the CRC of the settings after it
+#define SETTINGS_GPBR_WORDS (1 + (sizeof(settings_t) + 3) / 4)
+
+enum settings_source
+{
+	SETTINGS_DEFAULT = 0,
+	SETTINGS_FLASH = 1,
+	SETTINGS_GPBR = 2,
+};
+
+static uint8_t settings_source = SETTINGS_DEFAULT;
+
+static void settings_capture(settings_t *settings)
+{
+	memset(settings, 0, sizeof(*settings));
+	settings->bin_factor = bin_factor;
+	settings->columns = column_count;
+	settings->rows = row_count;
+	settings->window_start = window_start;
+	settings->travel = travel_columns;
+	settings->origin = head_origin;
+	settings->channels = channel_count;
+	settings->count_mode = count_mode;
+#if COUNTER_SYNC
+	settings->sync_mode = sync_mode;
+#endif
+	settings->flags = (time_track ? SETTINGS_TIMESTAMPS : 0) | (defer_columns ? SETTINGS_DEFER : 0);
+#if !COUNTER_POSITION_QDEC
+	settings->flags |= step_bidirectional ? SETTINGS_BIDIRECTIONAL : 0;
+	settings->flags |= step_both_edges ? SETTINGS_BOTH_EDGES : 0;
+#if CAPTURE_DIRS
+	settings->flags |= capture_dirs_enabled ? SETTINGS_CAPTURE_DIRS : 0;
+#endif
+#endif
+	settings->flags |= head_limits ? SETTINGS_LIMITS : 0;
+#if COUNTER_BEAM_GATE
+	settings->flags |= beam_gate ? SETTINGS_BEAM_GATE : 0;
+#endif
+#if ETH_ENABLE
+	memcpy(settings->ip, eth_address(), sizeof(settings->ip));
+#endif
+	settings->deadtime_ratio = deadtime_ratio;
+	settings->step_filter = step_filter;
+	settings->step_cutoff = step_cutoff;
+	if (threshold_enabled)
+	{
+		settings->flags |= SETTINGS_THRESHOLDS;
+		memcpy(settings->thresholds, thresholds, sizeof(thresholds));
+	}
+}
+
+// Apply saved settings at boot, with the checks of their commands.  A
+// setting that does not fit this build (or conflicts with an earlier
+// one) keeps its default.
+static void settings_apply(const settings_t *settings)
+{
+	partition_arena(settings->columns, settings->rows, settings->channels,
+		arena_tracks_with(ARENA_TRACK_TIME, settings->flags & SETTINGS_TIMESTAMPS));
+	set_window(settings->window_start, settings->travel);
+	if (settings->origin < travel_columns)
+	{
+		head_limits = settings->flags & SETTINGS_LIMITS;
+		head_origin = settings->origin;
+		zero_position();
+	}
+
+	if (settings->bin_factor >= 1)
+		bin_factor = settings->bin_factor;
+
+#if !COUNTER_POSITION_QDEC
+	// Ahead of the count mode, which follows the edges
+	if (settings->flags & SETTINGS_BOTH_EDGES)
+		step_edges_set(true);
+#if CAPTURE_DIRS
+	capture_dirs_enabled = settings->flags & SETTINGS_CAPTURE_DIRS;
+#endif
+#endif
+#if COUNTER_BEAM_GATE
+	if (settings->flags & SETTINGS_BEAM_GATE)
+		beam_gate_set(true);
+#endif
+
+	uint8_t mode = settings->count_mode;
+#if COUNTER_POSITION_QDEC
+	if (mode <= COUNT_MODE_DELTA && (mode != COUNT_MODE_LATCH || bin_factor == 1))
+#else
+	if (mode <= COUNT_MODE_CAPTURE && (mode != COUNT_MODE_LATCH || bin_factor == 1))
+#endif
+		set_count_mode(mode);
+
+#if COUNTER_SYNC
+	if (settings->sync_mode <= SYNC_MODE_SLAVE
+		&& (settings->sync_mode != SYNC_MODE_SLAVE || count_mode != COUNT_MODE_CAPTURE))
+		set_sync_mode(settings->sync_mode);
+	else if (settings->sync_mode == SYNC_MODE_PULSE && !(settings->flags & SETTINGS_DEFER)
+		&& (count_mode == COUNT_MODE_RESET || count_mode == COUNT_MODE_DELTA))
+		set_sync_mode(SYNC_MODE_PULSE);
+#endif
+
+	defer_columns = settings->flags & SETTINGS_DEFER;
+#if !COUNTER_POSITION_QDEC
+	step_bidirectional = settings->flags & SETTINGS_BIDIRECTIONAL;
+#endif
+	deadtime_ratio = settings->deadtime_ratio;
+	if (settings->step_filter < STEP_FILTER_DEBOUNCE
+		|| (settings->step_filter == STEP_FILTER_DEBOUNCE && settings->step_cutoff >= 1 && settings->step_cutoff <= STEP_CUTOFF_MAX))
+		step_filter_set(settings->step_filter, settings->step_cutoff);
+#if ETH_ENABLE
+	if (settings->ip[0])
+		eth_set_address(settings->ip);
+#endif
+	if (settings->flags & SETTINGS_THRESHOLDS)
+		for (uint8_t dac = 0; dac < THRESHOLD_CHANNELS; dac++)
+			threshold_set(dac, Min(settings->thresholds[dac], THRESHOLD_MAX));
+}
+
+static void settings_gpbr_write(const settings_t *settings)
+{
+	uint32_t words[SETTINGS_GPBR_WORDS] = { 0 };
+	memcpy(&words[1], settings, sizeof(*settings));
+	words[0] = ((uint32_t)SETTINGS_GPBR_MAGIC << 16) | crc16_update(0xFFFF, (const uint8_t *)settings, sizeof(*settings));
+
+	for (uint8_t i = 0; i < SETTINGS_GPBR_WORDS; i++)
+		GPBR->SYS_GPBR[i] = words[i];
+}
+
+static bool settings_gpbr_read(settings_t *settings)
+{
+	uint32_t words[SETTINGS_GPBR_WORDS];
+	for (uint8_t i = 0; i < SETTINGS_GPBR_WORDS; i++)
+		words[i] = GPBR->SYS_GPBR[i];
+
+	memcpy(settings, &words[1], sizeof(*settings));
+	return words[0] == (((uint32_t)SETTINGS_GPBR_MAGIC << 16) | crc16_update(0xFFFF, (const uint8_t *)settings, sizeof(*settings)));
+}
+
+static uint16_t settings_crc(const settings_block_t *block)
+{
+	uint16_t crc = crc16_update(0xFFFF, (const uint8_t *)&block->settings, sizeof(block->settings));
+	return crc16_update(crc, (const uint8_t *)block->calibration, sizeof(block->calibration));
+}
+
+// Called once the peripherals are up
+static void settings_load(void)
+{
+	const settings_block_t *block = flash_settings();
+	settings_t settings;
+
+	if (block->magic == SETTINGS_MAGIC && block->length == sizeof(*block) && block->crc == settings_crc(block))
+	{
+		memcpy(calibration, block->calibration, sizeof(calibration));
+		settings_apply(&block->settings);
+		settings_source = SETTINGS_FLASH;
+	}
+	else if (settings_gpbr_read(&settings))
+	{
+		settings_apply(&settings);
+		settings_source = SETTINGS_GPBR;
+	}
+}
+
+// M1049 reports where the settings were loaded from at boot: 0 defaults,
+// 1 flash, 2 GPBR.  M1049 1 saves the current settings and M1049 0
+// erases them, so the next boot starts from the defaults.  Saving masks
+// interrupts for the whole flash erase and write, so the counter must
+// be stopped.
+static void command_m1049(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_str("ok\n");
+		reply_u32(settings_source);
+		reply_char('\n');
+		return;
+	}
+
+	if (argv[0] != 0 && argv[0] != 1)
+	{
+		reply_str("error: settings command requires an argument of 0 or 1\n");
+		return;
+	}
+
+	if (enable_count || readout_job.kind != READOUT_JOB_NONE)
+	{
+		reply_str("error: counter is active\n");
+		return;
+	}
+#if COUNTER_SYNC
+	if (sync_armed)
+	{
+		reply_str("error: counter is active\n");
+		return;
+	}
+#endif
+
+	bool ok;
+	if (argv[0])
+	{
+		settings_block_t block;
+		memset(&block, 0, sizeof(block));
+		block.magic = SETTINGS_MAGIC;
+		block.length = sizeof(block);
+		settings_capture(&block.settings);
+		memcpy(block.calibration, calibration, sizeof(calibration));
+		block.crc = settings_crc(&block);
+
+		settings_gpbr_write(&block.settings);
+		ok = flash_settings_write(&block, sizeof(block));
+	}
+	else
+	{
+		for (uint8_t i = 0; i < SETTINGS_GPBR_WORDS; i++)
+			GPBR->SYS_GPBR[i] = 0;
+		ok = flash_settings_erase();
+	}
+
+	reply_str(ok ? "ok\n" : "error: flash write failed\n");
+}
+
+// Power-fail record (M1116, M1117).  The supply monitor interrupts as
+// VDDIO falls through POWERFAIL_THRESHOLD, and the handler saves where
+// the acquisition had got to: the head and row, the counting state, and
+// the range of dirty_live blocks touched since the last dirty readout.
+// The record goes first into the GPBR after the settings, which survive
+// a brownout reset, then into a page of the power-fail flash block
+// (flash.h), which survives the power going altogether.  The counts are
+// far too many to save in the hold-up time, so after the restart the
+// host rescans the touched cells only, from the head M1117 puts back.
+#define POWERFAIL_MAGIC 0xB0D5
+// SUPC_SMMR.SMTH code, near 3.0 V for the 3.3 V VDDIO
+#define POWERFAIL_THRESHOLD 0xC
+// Ahead of anything but the counting, which it cannot preempt
+#define POWERFAIL_IRQ_PRIORITY COUNTER_IRQ_PRIORITY
+
+#define POWERFAIL_COUNTING 0x01
+#define POWERFAIL_START_ARMED 0x02
+#define POWERFAIL_CINE 0x04
+
+#define POWERFAIL_NONE UINT16_MAX
+
+typedef struct
+{
+	uint16_t magic;
+	uint16_t crc;          // Of the fields after
+	int32_t position;      // head_position
+	int32_t row;           // head_row
+	uint32_t elapsed;      // ms since counting started
+	uint16_t columns;      // Partition when it was saved
+	uint16_t rows;
+	uint16_t first_block;  // Touched dirty blocks, first and last, or
+	uint16_t last_block;   // POWERFAIL_NONE
+	uint16_t blocks;       // and how many
+	uint8_t count_mode;
+	uint8_t flags;         // POWERFAIL_*
+} powerfail_t;
+
+#define POWERFAIL_GPBR_FIRST SETTINGS_GPBR_WORDS
+#define POWERFAIL_GPBR_WORDS (sizeof(powerfail_t) / 4)
+
+// Where the record found at boot came from, as for the settings
+static uint8_t powerfail_source = SETTINGS_DEFAULT;
+static powerfail_t powerfail_record;
+static volatile bool powerfail_armed;
+
+static uint16_t powerfail_crc(const powerfail_t *record)
+{
+	return crc16_update(0xFFFF, (const uint8_t *)&record->position, sizeof(*record) - offsetof(powerfail_t, position));
+}
+
+static bool powerfail_valid(const powerfail_t *record)
+{
+	return record->magic == POWERFAIL_MAGIC && record->crc == powerfail_crc(record);
+}
+
+// The supply monitor detected VDDIO under the threshold.  The interrupt
+// stays off until powerfail_poll sees the supply back, so a dip saves
+// one record however long it lasts.
+void SUPC_Handler(void)
+{
+	(void)SUPC->SUPC_SR;
+	SUPC->SUPC_SMMR &= ~SUPC_SMMR_SMIEN;
+	powerfail_armed = false;
+
+	powerfail_t record;
+	record.position = head_position;
+	record.row = head_row;
+	record.elapsed = enable_count ? sof_count - count_started : 0;
+	record.columns = column_count;
+	record.rows = row_count;
+	record.first_block = POWERFAIL_NONE;
+	record.last_block = POWERFAIL_NONE;
+	record.blocks = 0;
+	for (uint32_t w = 0; w < DIRTY_WORDS; w++)
+	{
+		uint32_t bits = dirty_live[w];
+		if (!bits)
+			continue;
+		if (record.first_block == POWERFAIL_NONE)
+			record.first_block = w * 32 + __builtin_ctz(bits);
+		record.last_block = w * 32 + 31 - __builtin_clz(bits);
+		record.blocks += __builtin_popcount(bits);
+	}
+	record.count_mode = count_mode;
+	record.flags = (enable_count ? POWERFAIL_COUNTING : 0)
+		| (start_armed != START_ARMED_NONE ? POWERFAIL_START_ARMED : 0)
+		| (cine_on ? POWERFAIL_CINE : 0);
+	record.magic = POWERFAIL_MAGIC;
+	record.crc = powerfail_crc(&record);
+
+	const uint32_t *words = (const uint32_t *)&record;
+	for (uint8_t i = 0; i < POWERFAIL_GPBR_WORDS; i++)
+		GPBR->SYS_GPBR[POWERFAIL_GPBR_FIRST + i] = words[i];
+	flash_powerfail_write(&record, sizeof(record));
+}
+
+// Arm the supply monitor once VDDIO is above the threshold, at boot and
+// after a dip that did not reset
+static void powerfail_poll(void)
+{
+	if (powerfail_armed || (SUPC->SUPC_SR & SUPC_SR_SMOS))
+		return;
+
+	powerfail_armed = true;
+	NVIC_ClearPendingIRQ(SUPC_IRQn);
+	SUPC->SUPC_SMMR |= SUPC_SMMR_SMIEN;
+}
+
+static void powerfail_clear(void)
+{
+	for (uint8_t i = 0; i < POWERFAIL_GPBR_WORDS; i++)
+		GPBR->SYS_GPBR[POWERFAIL_GPBR_FIRST + i] = 0;
+	if (flash_powerfail_used())
+		flash_powerfail_erase();
+}
+
+// Take the record left by the last run, the GPBR copy first as it is
+// the newer when both are there.  A full flash block is erased so the
+// next save has a page.
+static void powerfail_init(void)
+{
+	uint32_t *words = (uint32_t *)&powerfail_record;
+	for (uint8_t i = 0; i < POWERFAIL_GPBR_WORDS; i++)
+		words[i] = GPBR->SYS_GPBR[POWERFAIL_GPBR_FIRST + i];
+	uint32_t used = flash_powerfail_used();
+	if (powerfail_valid(&powerfail_record))
+		powerfail_source = SETTINGS_GPBR;
+	else if (used && powerfail_valid(flash_powerfail_page(used - 1)))
+	{
+		memcpy(&powerfail_record, flash_powerfail_page(used - 1), sizeof(powerfail_record));
+		powerfail_source = SETTINGS_FLASH;
+	}
+
+	if (used == FLASH_POWERFAIL_PAGES)
+		flash_powerfail_erase();
+
+	SUPC->SUPC_SMMR = SUPC_SMMR_SMTH(POWERFAIL_THRESHOLD) | SUPC_SMMR_SMSMPL_CSM;
+	NVIC_SetPriority(SUPC_IRQn, POWERFAIL_IRQ_PRIORITY);
+	NVIC_EnableIRQ(SUPC_IRQn);
+}
+
+// M1116 reports the power-fail record found at boot:
+//   <source> <position> <row> <mode> <flags> <elapsed ms> <columns> <rows> <first cell> <last cell> <blocks>
+// with source 1 flash or 2 GPBR and flags POWERFAIL_*, the cells
+// spanning the touched blocks; or just 0 if there was none.  M1116 0
+// discards it, erasing the flash copy.
+static void command_m1116(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_str("ok\n");
+		reply_u32(powerfail_source);
+		if (powerfail_source != SETTINGS_DEFAULT)
+		{
+			const powerfail_t *record = &powerfail_record;
+			uint32_t cells = record->columns * record->rows;
+			reply_char(' ');
+			reply_i32(record->position);
+			reply_char(' ');
+			reply_i32(record->row);
+			reply_char(' ');
+			reply_u32(record->count_mode);
+			reply_char(' ');
+			reply_u32(record->flags);
+			reply_char(' ');
+			reply_u32(record->elapsed);
+			reply_char(' ');
+			reply_u32(record->columns);
+			reply_char(' ');
+			reply_u32(record->rows);
+			reply_char(' ');
+			if (record->blocks)
+			{
+				reply_u32(record->first_block * DIRTY_BLOCK_CELLS);
+				reply_char(' ');
+				reply_u32(Min((uint32_t)(record->last_block + 1) * DIRTY_BLOCK_CELLS, cells) - 1);
+			}
+			else
+				reply_str("0 0");
+			reply_char(' ');
+			reply_u32(record->blocks);
+		}
+		reply_char('\n');
+		return;
+	}
+
+	if (argv[0] != 0)
+	{
+		reply_str("error: power-fail command requires an argument of 0\n");
+		return;
+	}
+
+	// The erase masks interrupts
+	if (enable_count || readout_job.kind != READOUT_JOB_NONE)
+	{
+		reply_str("error: counter is active\n");
+		return;
+	}
+
+	powerfail_clear();
+	powerfail_source = SETTINGS_DEFAULT;
+	reply_str("ok\n");
+}
+
+// M1117 puts the head and row back where the power-fail record left
+// them, so a rescan of the touched cells resumes there.  The partition
+// must be the one the record was saved with.  With the encoder the
+// head follows the encoder, so only the row is restored.
+static void command_m1117(const int32_t *argv, uint8_t argc)
+{
+	const powerfail_t *record = &powerfail_record;
+	if (powerfail_source == SETTINGS_DEFAULT)
+	{
+		reply_str("error: no power-fail record\n");
+		return;
+	}
+
+	if (enable_count)
+	{
+		reply_str("error: counter is active\n");
+		return;
+	}
+
+	if (record->columns != column_count || record->rows != row_count
+		|| record->row < 0 || record->row >= (int32_t)row_count
+		|| record->position < 0 || record->position >= (int32_t)travel_columns)
+	{
+		reply_str("error: the record does not fit the partition\n");
+		return;
+	}
+
+	irqflags_t flags = cpu_irq_save();
+#if !COUNTER_POSITION_QDEC
+	head_position = record->position;
+#endif
+	head_row_select(record->row);
+	cpu_irq_restore(flags);
+	reply_str("ok\n");
+}
+
+// Head shadow (M1118).  The main loop copies the head and row into the
+// GPBR after the power-fail record whenever they move, with the
+// partition and travel they belong to.  A watchdog or software reset
+// leaves the GPBR and the mechanics as they were, so the boot takes the
+// head back from the shadow rather than having the host home it again,
+// provided the settings it boots with give the same partition, travel
+// and origin.  After a power-up, a brownout or the reset pin the head
+// may have moved, and it starts from the origin as before.  With the
+// encoder the position is the encoder's, so there is no shadow.
+#define RESET_TYPE_WATCHDOG 2
+#define RESET_TYPE_SOFTWARE 3
+
+static uint8_t reset_type;
+
+#if !COUNTER_POSITION_QDEC
+#define SHADOW_MAGIC 0x5EAD
+#define SHADOW_GPBR_FIRST (POWERFAIL_GPBR_FIRST + POWERFAIL_GPBR_WORDS)
+// The last four of the 20, so the settings_t copy cannot grow
+#define SHADOW_GPBR_WORDS 4
+
+// The head, row and column count, and travel and origin, then the
+// magic and the CRC of the three words before
+static uint32_t shadow_words[SHADOW_GPBR_WORDS];
+static bool shadow_restored;
+
+static uint32_t shadow_check(const uint32_t *words)
+{
+	return (uint32_t)SHADOW_MAGIC << 16 | crc16_update(0xFFFF, (const uint8_t *)words, 3 * sizeof(uint32_t));
+}
+
+// A few loads and compares while the head stands still
+static void shadow_poll(void)
+{
+	uint32_t words[3];
+	words[0] = head_position;
+	words[1] = (uint16_t)head_row | (uint32_t)column_count << 16;
+	words[2] = travel_columns | (uint32_t)head_origin << 16;
+	if (!memcmp(words, shadow_words, sizeof(words)))
+		return;
+
+	memcpy(shadow_words, words, sizeof(words));
+	shadow_words[3] = shadow_check(words);
+	for (uint8_t i = 0; i < SHADOW_GPBR_WORDS; i++)
+		GPBR->SYS_GPBR[SHADOW_GPBR_FIRST + i] = shadow_words[i];
+}
+#endif
+
+// Called once the settings are applied
+static void shadow_restore(void)
+{
+	reset_type = (RSTC->RSTC_SR & RSTC_SR_RSTTYP_Msk) >> RSTC_SR_RSTTYP_Pos;
+#if !COUNTER_POSITION_QDEC
+	uint32_t words[SHADOW_GPBR_WORDS];
+	for (uint8_t i = 0; i < SHADOW_GPBR_WORDS; i++)
+		words[i] = GPBR->SYS_GPBR[SHADOW_GPBR_FIRST + i];
+
+	int32_t position = words[0];
+	uint16_t row = words[1];
+	if ((reset_type != RESET_TYPE_WATCHDOG && reset_type != RESET_TYPE_SOFTWARE)
+		|| words[3] != shadow_check(words)
+		|| words[1] >> 16 != column_count || words[2] != (travel_columns | (uint32_t)head_origin << 16)
+		|| position < 0 || position >= (int32_t)travel_columns || row >= row_count)
+		return;
+
+	irqflags_t flags = cpu_irq_save();
+	head_position = position;
+	head_row_select(row);
+	cpu_irq_restore(flags);
+	shadow_restored = true;
+#endif
+}
+
+// M1118 reports how the last boot started: the reset type from the
+// RSTC (0 power-up, 1 backup, 2 watchdog, 3 software, 4 reset pin) and
+// 1 if the head was taken from the shadow, 0 if it starts at the origin
+static void command_m1118(const int32_t *argv, uint8_t argc)
+{
+	reply_str("ok\n");
+	reply_u32(reset_type);
+	reply_char(' ');
+#if !COUNTER_POSITION_QDEC
+	reply_u32(shadow_restored);
+#else
+	reply_u32(0);
+#endif
+	reply_char('\n');
+}
+
+// M1119 reports the timebase as the time the command was queued and
+// the time of the reply, in microseconds: the device half of an NTP
+// exchange over any command channel.  TIME_QUERY on the USB command
+// port gives the same stamps with the main loop out of the way.
+static void command_m1119(const int32_t *argv, uint8_t argc)
+{
+	reply_str("ok\n");
+	reply_u64(command_received);
+	reply_char(' ');
+	reply_u64(time_us());
+	reply_char('\n');
+}
+
+// M1120 reports whether time pushes stamp the pushes and readout
+// headers, M1120 <0|1> turns them off or on
+static void command_m1120(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_str("ok\n");
+		reply_u32(time_pushes);
+		reply_char('\n');
+		return;
+	}
+
+	if (argv[0] != 0 && argv[0] != 1)
+	{
+		reply_str("error: time push command requires an argument of 0 or 1\n");
+		return;
+	}
+
+	time_pushes = argv[0];
+	reply_str("ok\n");
+}
+
+// Received commands are queued, then run from the main loop in order.
+// A slot holds a text line, a binary frame, or marks a line that was too
+// long and has been dropped up to its terminator.
+#define COMMAND_LINE_BYTES 256
+#define COMMAND_QUEUE_LENGTH 8  // Must be a power of two
+
+#define COMMAND_SLOT_LINE 0
+#define COMMAND_SLOT_FRAME 1
+#define COMMAND_SLOT_OVERFLOW 2
+
+typedef struct
+{
+	uint8_t kind;    // COMMAND_SLOT_*
+	uint8_t source;  // COMMAND_SOURCE_*
+	uint16_t length;
+	uint64_t received;  // time_us() when it was queued
+	char data[COMMAND_LINE_BYTES];
+} command_slot_t;
+
+static command_slot_t command_queue[COMMAND_QUEUE_LENGTH];
+// Free-running indices, the slot at command_tail is being assembled
+static uint32_t command_head = 0;
+static uint32_t command_tail = 0;
+// Most commands queued at once (M1050)
+static uint32_t command_peak;
+static uint16_t command_length = 0;
+static bool command_overflow = false;
+// A queued M1028 decides how the bytes after it are read
+static bool command_switch_pending = false;
+
+// Stack and queue headroom for M1050.  The stack below main's frame is
+// painted at boot, and the words still holding the pattern were never
+// used; the interrupts share the same (main) stack.
+#define STACK_PAINT 0xC5C5C5C5
+
+extern uint32_t _sstack;
+extern uint32_t _estack;
+
+static void __attribute__((noinline)) stack_paint(void)
+{
+	// Keep clear of this function's own frame
+	uint32_t msp = __get_MSP();
+	uint32_t *end = (uint32_t *)msp - 16;
+	for (uint32_t *word = &_sstack; word < end; word++)
+		*word = STACK_PAINT;
+}
+
+static uint32_t stack_unused(void)
+{
+	const uint32_t *word = &_sstack;
+	while (word < &_estack && *word == STACK_PAINT)
+		word++;
+	return (word - &_sstack) * 4;
+}
+
+static void reply_peak(const char *name, uint32_t peak, uint32_t size)
+{
+	reply_str(name);
+	reply_char(' ');
+	reply_u32(peak);
+	reply_char(' ');
+	reply_u32(size);
+	reply_char('\n');
+}
+
+// M1050 reports "<name> <peak> <size>" lines: stack bytes used, commands
+// queued, reply ring bytes, stream and defer ring records, and CDC TX
+// and RX buffer bytes.  M1050 1 also restarts the queue peaks; the stack
+// mark only ever grows.
+static void command_m1050(const int32_t *argv, uint8_t argc)
+{
+	bool clear = argc > 0 && argv[0];
+	uint32_t stack_size = (&_estack - &_sstack) * 4;
+
+	iram_size_t cdc_tx, cdc_rx;
+	iram_size_t cdc_size = udi_cdc_multi_get_peaks(0, &cdc_tx, &cdc_rx, clear);
+
+	reply_str("ok\n");
+	reply_peak("stack", stack_size - stack_unused(), stack_size);
+	reply_peak("commands", command_peak, COMMAND_QUEUE_LENGTH);
+	reply_peak("replies", reply_high_water(clear), REPLY_RING_BYTES);
+	reply_peak("stream", stream_queue.peak, STREAM_RING_SIZE);
+	reply_peak("defer", defer_queue.peak, DEFER_RING_SIZE);
+	reply_peak("cdc_tx", cdc_tx, cdc_size);
+	reply_peak("cdc_rx", cdc_rx, cdc_size);
+#if COUNT_PACKED_CHANNELS
+	reply_peak("escape", count_escape_peak, COUNT_ESCAPE_ENTRIES);
+#endif
+
+	if (clear)
+	{
+#if COUNT_PACKED_CHANNELS
+		count_escape_peak = Max(count_escape_used[0], count_escape_used[1]);
+#endif
+		command_peak = 0;
+		stream_queue.peak = 0;
+		defer_queue.peak = 0;
+	}
+}
+
+#if TRACE_ENABLE
+// Sent ahead of the events of a trace dump.  Cycle counts are at cpu_hz
+// except after a TRACE_CLOCK event slowing the clock down.
+typedef struct
+{
+	uint32_t magic;     // TRACE_MAGIC
+	uint32_t cpu_hz;
+	uint32_t recorded;  // Events since the last dump; more than count if the oldest were overwritten
+	uint16_t count;     // trace_event_t records that follow, oldest first
+	uint16_t crc;       // CRC-16/CCITT of the records
+} trace_header_t;
+
+#define TRACE_MAGIC 0x43525444  // "DTRC"
+
+// Dump the event trace in binary and start a new one
+static void command_m1051(const int32_t *argv, uint8_t argc)
+{
+	trace_paused = true;
+	uint32_t recorded = trace_index;
+	uint32_t count = Min(recorded, TRACE_EVENTS);
+	uint32_t first = (recorded - count) & (TRACE_EVENTS - 1);
+	// Events up to the end of the buffer, the rest wrapped to its start
+	uint32_t tail = Min(count, TRACE_EVENTS - first);
+
+	trace_header_t header;
+	header.magic = TRACE_MAGIC;
+	header.cpu_hz = sysclk_get_cpu_hz();
+	header.recorded = recorded;
+	header.count = count;
+	header.crc = crc16_update(0xFFFF, (const uint8_t *)&trace_buffer[first], tail * sizeof(trace_event_t));
+	header.crc = crc16_update(header.crc, (const uint8_t *)trace_buffer, (count - tail) * sizeof(trace_event_t));
+
+	reply_str("ok\n");
+	if (write_binary(&header, sizeof(header)) && write_binary(&trace_buffer[first], tail * sizeof(trace_event_t))
+		&& count > tail)
+		write_binary(trace_buffer, (count - tail) * sizeof(trace_event_t));
+
+	trace_reset();
+}
+#endif
+
+// Rates are taken over RATE_TICK_MS of USB frames, or over however long
+// the main loop kept the tick waiting
+#define RATE_TICK_MS 1000
+
+static uint32_t rate_tick;
+static uint32_t rate_steps_total;
+static uint32_t rate_counts_total[COUNTER_CHANNELS];
+static uint32_t rate_steps;
+static uint32_t rate_counts[COUNTER_CHANNELS];
+
+static uint32_t rate_per_second(uint32_t delta, uint32_t ms)
+{
+	return (uint32_t)((uint64_t)delta * 1000 / ms);
+}
+
+static void rate_poll(void)
+{
+	uint32_t ms = sof_count - rate_tick;
+	if (ms < RATE_TICK_MS)
+		return;
+	rate_tick += ms;
+
+	uint32_t steps = steps_processed;
+	rate_steps = rate_per_second(steps - rate_steps_total, ms);
+	rate_steps_total = steps;
+
+	for (uint8_t c = 0; c < COUNTER_CHANNELS; c++)
+	{
+		uint32_t total = count_totals[c];
+		rate_counts[c] = rate_per_second(total - rate_counts_total[c], ms);
+		rate_counts_total[c] = total;
+	}
+}
+
+// Throughput: steps processed and per second, counts per second of each
+// enabled channel, USB bytes sent and received, commands run, and ms
+// since counting started (0 while it is off)
+static void command_m1052(const int32_t *argv, uint8_t argc)
+{
+	reply_str("ok\n");
+	reply_str("steps ");
+	reply_u32(steps_processed);
+	reply_char(' ');
+	reply_u32(rate_steps);
+	reply_str(" counts");
+	for (uint8_t c = 0; c < channel_count; c++)
+	{
+		reply_char(' ');
+		reply_u32(rate_counts[c]);
+	}
+	reply_str(" usb ");
+	reply_u32(udd_get_in_bytes());
+	reply_char(' ');
+	reply_u32(udd_get_out_bytes());
+	reply_str(" commands ");
+	reply_u32(commands_processed);
+	reply_str(" active ");
+	reply_u32(enable_count ? sof_count - count_started : 0);
+	reply_char('\n');
+}
+
+// Set the readout schedule: M1063 <budget us> [<min slices>].
+// M1063 alone reports "<budget us> <min slices> <passes> <slices>
+// <overruns> <longest pass us>" since it was last set.
+static void command_m1063(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_str("ok\n");
+		reply_u32(readout_budget_us);
+		reply_char(' ');
+		reply_u32(readout_min_slices);
+		reply_char(' ');
+		reply_u32(readout_passes);
+		reply_char(' ');
+		reply_u32(readout_slices);
+		reply_char(' ');
+		reply_u32(readout_overruns);
+		reply_char(' ');
+		reply_u32(readout_pass_max / (sysclk_get_cpu_hz() / 1000000));
+		reply_char('\n');
+		return;
+	}
+
+	int32_t budget = argv[0], slices = argc > 1 ? argv[1] : 1;
+	if (budget < 0 || budget > 1000000 || slices < 1 || slices > UINT8_MAX)
+	{
+		reply_str("error: invalid readout schedule\n");
+		return;
+	}
+
+	readout_budget_us = budget;
+	readout_min_slices = slices;
+	readout_passes = 0;
+	readout_slices = 0;
+	readout_overruns = 0;
+	readout_pass_max = 0;
+	reply_str("ok\n");
+}
+
+// Stored program (M1089), a list of command lines the main loop runs
+// by itself, so a sequence such as home, arm, scan, swap, reverse, scan
+// needs no round trip per step.  Lines are recorded as they arrive
+// between M1089 1 and M1089 0 instead of being run.  M1090 in a program
+// holds it until the head reaches a column, counting stops, a scan
+// ends, a time passes or the head is homed; program_poll runs every
+// other line at once, as soon as the one before has finished, with the
+// replies going to whoever started the program.  A wait has to be a
+// line of its own rather than part of a batch.
+#define PROGRAM_BYTES 1024
+#define PROGRAM_LINES 64
+
+#define PROGRAM_IDLE 0
+#define PROGRAM_RECORDING 1
+#define PROGRAM_RUNNING 2
+
+#define PROGRAM_WAIT_POSITION 1
+#define PROGRAM_WAIT_STOP 2
+#define PROGRAM_WAIT_SCAN 3
+#define PROGRAM_WAIT_TIME 4
+#define PROGRAM_WAIT_HOME 5
+
+static char program_text[PROGRAM_BYTES];
+// Start of each line in program_text, each NUL-terminated
+static uint16_t program_starts[PROGRAM_LINES];
+static uint16_t program_lines;
+static uint16_t program_bytes;
+static bool program_overflow;
+
+static uint8_t program_state = PROGRAM_IDLE;
+static uint8_t program_source;
+static uint16_t program_line;
+// Runs left, 0 to repeat until stopped, and runs completed
+static uint32_t program_repeat;
+static uint32_t program_runs;
+// The M1090 being waited on, from when it was first reached
+static bool program_waiting;
+static uint8_t program_wait_kind;
+static int32_t program_wait_arg;
+static uint32_t program_wait_since;
+// The rest of a batch held up by a readout job, or NULL
+static const char *program_rest;
+#if !COUNTER_POSITION_QDEC
+static uint32_t program_wait_edges;
+#endif
+
+// Keeps a line arriving while recording, returning false for those to run now
+static bool program_record(const char *line, uint16_t length)
+{
+	const char *args = line;
+	if (program_state != PROGRAM_RECORDING || parse_code(&args, UINT16_MAX) == 1089)
+		return false;
+
+	if (program_lines == PROGRAM_LINES || program_bytes + length > PROGRAM_BYTES)
+	{
+		program_overflow = true;
+		reply_str("error: program is full\n");
+		return true;
+	}
+
+	program_starts[program_lines++] = program_bytes;
+	memcpy(&program_text[program_bytes], line, length);
+	program_bytes += length;
+	program_text[program_bytes - 1] = '\0';
+	reply_str("ok\n");
+	return true;
+}
+
+// Whether the M1090 the program is on has been met
+static bool program_wait_done(void)
+{
+	if (!program_waiting)
+	{
+		program_waiting = true;
+		program_wait_since = sof_count;
+#if !COUNTER_POSITION_QDEC
+		program_wait_edges = home_edges;
+#endif
+	}
+
+	switch (program_wait_kind)
+	{
+	case PROGRAM_WAIT_POSITION:
+		return head_position - head_origin == program_wait_arg;
+	case PROGRAM_WAIT_STOP:
+		return !enable_count && start_armed == START_ARMED_NONE;
+#if !COUNTER_POSITION_QDEC
+	case PROGRAM_WAIT_SCAN:
+		return motion_phase == MOTION_IDLE;
+	case PROGRAM_WAIT_HOME:
+		return home_edges != program_wait_edges;
+#endif
+	default:
+		return sof_count - program_wait_since >= (uint32_t)program_wait_arg;
+	}
+}
+
+// Runs the program from the main loop up to the next M1090 not yet met
+static void program_poll(void)
+{
+	while (program_state == PROGRAM_RUNNING && readout_job.kind == READOUT_JOB_NONE)
+	{
+		const char *line = &program_text[program_starts[program_line]];
+		int32_t argv[2] = {0};
+		uint8_t argc;
+		if (parse_command(line, NULL, UINT16_MAX, argv, 2, &argc) == 1090)
+		{
+			program_wait_kind = argv[0];
+			program_wait_arg = argv[1];
+			if (!program_wait_done())
+				return;
+			program_waiting = false;
+		}
+		else
+		{
+			select_source(program_source);
+			program_rest = parse_batch(program_rest ? program_rest : line);
+			if (program_rest)
+				return;
+		}
+
+		// M1089 3 may have come from the line itself
+		if (program_state != PROGRAM_RUNNING)
+			return;
+
+		if (++program_line == program_lines)
+		{
+			program_line = 0;
+			program_runs++;
+			if (program_repeat && --program_repeat == 0)
+				program_state = PROGRAM_IDLE;
+		}
+	}
+}
+
+// M1089 reports "<state> <lines> <line> <runs>", state 1 while
+// recording and 2 while running.  M1089 1 starts recording a program
+// afresh and M1089 0 ends it; M1089 2 [<runs>] runs it <runs> times
+// (once by default, 0 until stopped) and M1089 3 stops it.  A line
+// that does not fit is refused, leaving the program unable to run.
+static void command_m1089(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_str("ok\n");
+		reply_u32(program_state);
+		reply_char(' ');
+		reply_u32(program_lines);
+		reply_char(' ');
+		reply_u32(program_line);
+		reply_char(' ');
+		reply_u32(program_runs);
+		reply_char('\n');
+		return;
+	}
+
+	if (argv[0] < 0 || argv[0] > 3)
+	{
+		reply_str("error: program command requires an argument of 0 to 3\n");
+		return;
+	}
+
+	if (argv[0] == 3 || argv[0] == 0)
+	{
+		program_state = PROGRAM_IDLE;
+		reply_str("ok\n");
+		return;
+	}
+
+	if (argv[0] == 1)
+	{
+		program_lines = 0;
+		program_bytes = 0;
+		program_overflow = false;
+		program_state = PROGRAM_RECORDING;
+		reply_str("ok\n");
+		return;
+	}
+
+	if (argc > 1 && argv[1] < 0)
+	{
+		reply_str("error: invalid run count\n");
+		return;
+	}
+
+	if (program_lines == 0 || program_overflow)
+	{
+		reply_str("error: no program is stored\n");
+		return;
+	}
+
+	program_repeat = argc > 1 ? argv[1] : 1;
+	program_runs = 0;
+	program_line = 0;
+	program_waiting = false;
+	program_rest = NULL;
+	program_source = command_source;
+	program_state = PROGRAM_RUNNING;
+	reply_str("ok\n");
+}
+
+// M1090 <kind> [<arg>] holds a stored program until the head is at
+// column <arg> from the origin (1), counting has stopped and nothing is
+// armed (2), the scan has ended (3), <arg> ms have passed (4) or the
+// home input has had an edge (5).  Outside a program it does nothing.
+static void command_m1090(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0 || argv[0] < PROGRAM_WAIT_POSITION || argv[0] > PROGRAM_WAIT_HOME)
+	{
+		reply_str("error: wait command requires a kind of 1 to 5\n");
+		return;
+	}
+
+#if COUNTER_POSITION_QDEC
+	if (argv[0] == PROGRAM_WAIT_SCAN || argv[0] == PROGRAM_WAIT_HOME)
+	{
+		reply_str("error: not available with the quadrature decoder\n");
+		return;
+	}
+#endif
+	reply_str("ok\n");
+}
+
+// RAM budget.  flash.ld places .data, .bss and the __stack_size__ stack
+// from the start of the 128 KB of SRAM and leaves the rest to the SRAM
+// pool (M1078), and its only check is that the stack still fits.  A
+// buffer sized past that shows up as a pool too small for the modes
+// that reserve from it, or, once the stack overflows into .bss, as
+// corrupted state.  The buffers below make up most of .bss, and the
+// check keeps them, the stack and RAM_OTHER_BYTES for everything else
+// (the small state of each mode and of ASF, and .data) inside the part
+// with RAM_POOL_MIN_BYTES to spare.  M1128 reports what the linker
+// placed, so RAM_OTHER_BYTES can be held to the real figure.
+#define RAM_STACK_BYTES 0x3000  // __stack_size__ of flash.ld
+#define RAM_OTHER_BYTES 12288
+#define RAM_POOL_MIN_BYTES 2048
+// udi_cdc.c's RX and TX double buffers of each port at full speed
+#define RAM_CDC_BYTES (UDI_CDC_PORT_NB * 2 * 2 * 5 * UDI_CDC_DATA_EPS_FS_SIZE)
+
+#if COUNT_WIDTH == 16
+#define RAM_OVERFLOW_BYTES sizeof(count_overflow)
+#else
+#define RAM_OVERFLOW_BYTES 0
+#endif
+#if COUNTER_POSITION_QDEC
+#define RAM_CAPTURE_BYTES 0
+#elif CAPTURE_DIRS
+#define RAM_CAPTURE_BYTES (sizeof(capture_ring) + sizeof(capture_dirs))
+#else
+#define RAM_CAPTURE_BYTES sizeof(capture_ring)
+#endif
+
+// The buffers of ram_buffers, and those of other files, which M1128
+// counts in with the rest
+#define RAM_BUFFER_BYTES (sizeof(count_arena) + RAM_OVERFLOW_BYTES + sizeof(gain_map) + sizeof(background) \
+	+ sizeof(stream_ring) + sizeof(defer_ring) + sizeof(row_ring) + sizeof(row_marks) + RAM_CAPTURE_BYTES + sizeof(trace_buffer) \
+	+ sizeof(command_queue) + sizeof(program_text))
+#define RAM_FILE_BYTES (REPLY_RING_BYTES + RAM_CDC_BYTES)
+
+_Static_assert(RAM_BUFFER_BYTES + RAM_FILE_BYTES + RAM_OTHER_BYTES + RAM_STACK_BYTES + RAM_POOL_MIN_BYTES
+	<= IRAM_SIZE, "the count arena and the fixed buffers leave too little SRAM for the stack and the rest");
+
+typedef struct
+{
+	const char *name;
+	const volatile void *start;
+	uint32_t bytes;
+} ram_buffer_t;
+
+static const ram_buffer_t ram_buffers[] =
+{
+	{ "arena", count_arena, sizeof(count_arena) },
+#if COUNT_WIDTH == 16
+	{ "overflow", count_overflow, sizeof(count_overflow) },
+#endif
+	{ "gain", gain_map, sizeof(gain_map) },
+	{ "background", background, sizeof(background) },
+	{ "stream", stream_ring, sizeof(stream_ring) },
+	{ "defer", defer_ring, sizeof(defer_ring) },
+	{ "rows", row_ring, sizeof(row_ring) },
+	{ "marks", row_marks, sizeof(row_marks) },
+#if !COUNTER_POSITION_QDEC
+	{ "capture", capture_ring, sizeof(capture_ring) },
+#if CAPTURE_DIRS
+	{ "dirs", capture_dirs, sizeof(capture_dirs) },
+#endif
+#endif
+	{ "trace", trace_buffer, sizeof(trace_buffer) },
+	{ "commands", command_queue, sizeof(command_queue) },
+	{ "program", program_text, sizeof(program_text) },
+};
+
+extern uint32_t _srelocate, _erelocate, _szero, _ezero;
+
+static void reply_region(const char *name, const volatile void *start, uint32_t bytes)
+{
+	reply_str(name);
+	reply_char(' ');
+	reply_u32((uint32_t)start);
+	reply_char(' ');
+	reply_u32(bytes);
+	reply_char('\n');
+}
+
+// M1128 reports the memory map as the linker laid it out, a
+// "<name> <address> <bytes>" line each for .data, .bss, the stack and the
+// SRAM pool and then for each buffer of ram_buffers, and last
+// "other <bytes> <budget>": what .data and .bss hold besides those
+// buffers, against RAM_OTHER_BYTES.
+static void command_m1128(const int32_t *argv, uint8_t argc)
+{
+	uint32_t data = (&_erelocate - &_srelocate) * 4, bss = (&_ezero - &_szero) * 4;
+	uint32_t buffers = 0;
+
+	reply_str("ok\n");
+	reply_region("data", &_srelocate, data);
+	reply_region("bss", &_szero, bss);
+	reply_region("stack", &_sstack, (&_estack - &_sstack) * 4);
+	reply_region("pool", &_end, sram_pool.size);
+	for (uint32_t i = 0; i < sizeof(ram_buffers) / sizeof(ram_buffers[0]); i++)
+	{
+		reply_region(ram_buffers[i].name, ram_buffers[i].start, ram_buffers[i].bytes);
+		buffers += ram_buffers[i].bytes;
+	}
+	reply_str("other ");
+	reply_u32(data + bss - buffers);
+	reply_char(' ');
+	reply_u32(RAM_FILE_BYTES + RAM_OTHER_BYTES);
+	reply_char('\n');
+}
+
+// The pipes a striped readout can use now: the command port, and the
+// vendor bulk interface and the data port while the host has them open
+static uint8_t stripe_pipes_configured(void)
+{
+	uint8_t pipes = STRIPE_PIPE_CDC;
+	if (udi_vendor_bulk_is_enabled())
+		pipes |= STRIPE_PIPE_BULK;
+#if UDI_CDC_PORT_NB > 1
+	if (cdc_enabled[CDC_DATA_PORT])
+		pipes |= STRIPE_PIPE_CDC_DATA;
+#endif
+	return pipes;
+}
+
+// Read stored channels striped over several pipes (see stripe_chunk_t):
+// M1129 <interleave> <start> <end> [mask [pipes]], arguments as for
+// M1056, where bit n of pipes selects DATA_INTERFACE_* n (by default
+// every one configured).  The header goes where M1027 sends binary data,
+// marked READOUT_STRIPED, and the chunks follow, the final "ok" after
+// the last of them.  Striped payloads are never compressed.
+static void command_m1129(const int32_t *argv, uint8_t argc)
+{
+	int32_t mask;
+	if (!container_args(argv, argc, &mask))
+		return;
+
+	if (command_source == COMMAND_SOURCE_ETH)
+	{
+		reply_str("error: striped readouts are over USB only\n");
+		return;
+	}
+
+	int32_t configured = stripe_pipes_configured();
+	int32_t pipes = argc > 4 ? argv[4] : configured;
+	if (pipes <= 0 || (pipes & ~configured))
+	{
+		reply_str("error: invalid pipe mask\n");
+		return;
+	}
+
+	int32_t interleave = argv[0], start = argv[1], end = argv[2];
+	uint32_t slices = (end - start + READOUT_SLICE_COLUMNS) / READOUT_SLICE_COLUMNS;
+
+	readout_header_t header;
+	header.channel = (interleave ? READOUT_ALL_INTERLEAVED : READOUT_ALL_PLANAR) | READOUT_STRIPED;
+	header.start = start;
+	header.end = end;
+	header.length = __builtin_popcount(mask) * (end - start + 1) * sizeof(count_t);
+	header.crc = 0xFFFF;
+	header.width = sizeof(count_t);
+	header.flags = 0;
+	for (uint8_t c = 0; c < channel_count; c++)
+		if (mask & (1 << c))
+			header.flags |= readout_flags(c, start, end);
+	header.reserved = mask;
+	readout_payload(mask, start, end, interleave, &header.crc);
+
+	reply_str("ok\n");
+	if (!readout_send_header(&header))
+		return;
+
+	readout_job.pipes = pipes;
+	readout_job.chunk = 0;
+	readout_job.chunks = interleave ? slices : slices * __builtin_popcount(mask);
+	readout_job.offset = 0;
+	readout_job_start(READOUT_JOB_STRIPED, mask, interleave, start, end);
+}
+
+// Statistical early stop: M1130 <counts> <max ms> starts time-based
+// acquisition where each point ends once the primary channel has
+// counted <counts>, or after <max ms> short of them.  A relative
+// uncertainty u wants 1/u^2 counts, 10000 for 1%.  M1130 0 turns early
+// stop off and keeps the period; M1130 alone reports "<counts> <points
+// ended by the count> <points ended by the period>".
+static void command_m1130(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply_str("ok\n");
+		reply_u32(early_target);
+		reply_char(' ');
+		reply_u32(early_points);
+		reply_char(' ');
+		reply_u32(early_timeouts);
+		reply_char('\n');
+		return;
+	}
+
+	if (argv[0] == 0)
+	{
+		early_off();
+		reply_str("ok\n");
+		return;
+	}
+
+	uint32_t ticks_per_ms = sysclk_get_peripheral_hz() / 2 / 1000;
+	if (argc < 2 || argv[0] < 0 || argv[1] < 1 || (uint32_t)argv[1] > UINT32_MAX / ticks_per_ms)
+	{
+		reply_str("error: early stop requires a count and a time limit in ms\n");
+		return;
+	}
+
+	if (!timed_allowed())
+		return;
+
+	uint8_t counter = __builtin_ctz(channel_mask);
+	if (counter >= COUNTER_WIDE_CHANNELS || counter_chained)
+	{
+		reply_str("error: the primary counter has no compare interrupt\n");
+		return;
+	}
+
+	if (count_mode != COUNT_MODE_RESET && count_mode != COUNT_MODE_DELTA)
+	{
+		reply_str("error: early stop needs the reset or delta count mode\n");
+		return;
+	}
 
-void parse_gcode(const char *line, uint8_t length);
+	timed_start_ticks(ticks_per_ms * argv[1]);
+	early_points = 0;
+	early_timeouts = 0;
+	early_target = argv[0];
+	early_configure();
+	reply_str("ok\n");
+}
 
-static void Trigger_Step(uint32_t id, uint32_t pin)
+// Row alignment: M1131 <row> <shift> stores the row <shift> columns
+// further on from the next time the head enters it (or at once for the
+// head's row), M1131 <row> reports "<shift> <start> <end> <started>
+// <ended>" from its mark, positions as M1001 gives them, and M1131 -1 clears every shift and mark.
+static void command_m1131(const int32_t *argv, uint8_t argc)
 {
-	int32_t head_step = pio_get(COUNTER_PIO, PIO_INPUT, COUNTER_DIR_PIN) ? 1 : -1;
+	if (argc == 1 && argv[0] == -1)
+	{
+		irqflags_t flags = cpu_irq_save();
+		memset(row_shift, 0, sizeof(row_shift));
+		memset(row_marks, 0, sizeof(row_marks));
+		head_shift = 0;
+		cpu_irq_restore(flags);
+		reply_str("ok\n");
+		return;
+	}
 
-	if (enable_count)
+	if (argc < 1 || argv[0] < 0 || argv[0] >= ROW_ALIGN_ROWS
+		|| (argc > 1 && (argv[1] <= -(int32_t)column_count || argv[1] >= (int32_t)column_count)))
+	{
+		reply_str("error: alignment requires a row below 128 and a shift within the columns\n");
+		return;
+	}
+
+	uint16_t row = argv[0];
+	if (argc == 1)
 	{
-		primary_count[head_position] += (uint16_t)tc_read_cv(COUNTER_TC, PRIMARY_TC_CHANNEL);
-		secondary_count[head_position] += (uint16_t)tc_read_cv(COUNTER_TC, SECONDARY_TC_CHANNEL);
-		tertiary_count[head_position] += (uint16_t)tc_read_cv(COUNTER_TC, TERTIARY_TC_CHANNEL);
-		tc_sync_trigger(COUNTER_TC);
+		irqflags_t flags = cpu_irq_save();
+		row_mark_t mark = row_marks[row];
+		cpu_irq_restore(flags);
+		reply_str("ok\n");
+		reply_i32(row_shift[row]);
+		reply_char(' ');
+		reply_i32(mark.start - head_origin);
+		reply_char(' ');
+		reply_i32(mark.end - head_origin);
+		reply_char(' ');
+		reply_u32(mark.started);
+		reply_char(' ');
+		reply_u32(mark.ended);
+		reply_char('\n');
+		return;
 	}
 
-	head_position += head_step;
+	irqflags_t flags = cpu_irq_save();
+	row_shift[row] = argv[1];
+	if (head_row == row)
+		head_shift = argv[1];
+	cpu_irq_restore(flags);
+	reply_str("ok\n");
+}
+
+typedef void (*command_handler_t)(const int32_t *argv, uint8_t argc);
+
+typedef struct
+{
+	command_handler_t handler;
+	bool overlap;  // Only reports state, so may run while a readout job is sending
+} command_t;
+
+// Handlers indexed by M-code, so dispatch costs the same for every command.
+// Codes without a handler (or compiled out) are left NULL.
+#define COMMAND_FIRST 1001
+#define COMMAND_LAST 1131
+
+// COMMAND_MAX_ARGS (command.h) bounds the arguments of every command
+_Static_assert(COMMAND_MAX_ARGS >= 2 + 2 * READOUT_MAX_ROIS, "M1040 takes more arguments than COMMAND_MAX_ARGS");
+
+// Command timing, started by M1121 1: the DWT cycles each command takes
+// from its arguments being parsed to its handler returning, kept per
+// M-code as for the step interrupt (profile.h).  A command that starts a
+// readout job is timed up to the job starting, not to its last byte.
+// The table only takes SRAM once timing has been started.
+#define COMMAND_CODES (COMMAND_LAST - COMMAND_FIRST + 1)
+
+static profile_stats_t *command_stats;
+static bool command_timing;
 
-	// Check limits and loop around the buffer if we overflow
-	if (head_position < 0)
-		head_position += HEAD_STEPS_MAX;
-	
-	if (head_position >= HEAD_STEPS_MAX)
-		head_position -= HEAD_STEPS_MAX;
+static void command_stats_reset(void)
+{
+	memset(command_stats, 0, COMMAND_CODES * sizeof(profile_stats_t));
+	for (uint32_t i = 0; i < COMMAND_CODES; i++)
+		command_stats[i].min = UINT32_MAX;
 }
 
-void parse_gcode(const char *line, uint8_t length)
+static inline void command_time(uint32_t code, uint32_t start)
 {
-	// Really hacky fake-gcode interpreter
-	// This is only a prototype so it doesn't need to be robust.
-	// Assumes that there is exactly one command per line.
+	if (command_timing)
+		profile_record(&command_stats[code - COMMAND_FIRST], profile_cycles() - start);
+}
 
-	// Report current position
-	if (!strcmp(line, "M1001"))
+// M1121 reports command timing as "<on> <cpu hz>", then for each code
+// that has run "<code> <count> <min> <max> <mean>" and a line of the
+// PROFILE_HISTOGRAM_BINS log2 bins, all in CPU cycles, and a final "ok".
+// M1121 1 clears the figures and starts timing, M1121 0 stops it.
+static void command_m1121(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
 	{
-		printf("ok\n");
-		printf("%"PRId32"\n", head_position);
+		reply_str("ok\n");
+		reply_u32(command_timing);
+		reply_char(' ');
+		reply_u32(sysclk_get_cpu_hz());
+		reply_char('\n');
+		for (uint32_t i = 0; command_stats && i < COMMAND_CODES; i++)
+		{
+			// A copy, as this command is timed into the table itself
+			profile_stats_t stats = command_stats[i];
+			if (!stats.count)
+				continue;
+
+			reply_u32(COMMAND_FIRST + i);
+			reply_char(' ');
+			reply_u32(stats.count);
+			reply_char(' ');
+			reply_u32(stats.min);
+			reply_char(' ');
+			reply_u32(stats.max);
+			reply_char(' ');
+			reply_u32((uint32_t)(stats.total / stats.count));
+			reply_char('\n');
+			for (uint32_t bin = 0; bin < PROFILE_HISTOGRAM_BINS; bin++)
+			{
+				if (bin)
+					reply_char(' ');
+				reply_u32(stats.histogram[bin]);
+			}
+			reply_char('\n');
+		}
+		reply_str("ok\n");
 		return;
 	}
 
-	// Reset current position
-	if (!strcmp(line, "M1002"))
+	if (argv[0] != 0 && argv[0] != 1)
 	{
-		head_position = 0;
-		printf("ok\n");
+		reply_str("error: command timing requires an argument of 0 or 1\n");
 		return;
 	}
-	
-	// Enable counting
-	if (!strcmp(line, "M1003"))
+
+	if (argv[0])
 	{
-		if (enable_count)
+		if (!command_stats)
+			command_stats = pool_reserve(&sram_pool, "command timing", COMMAND_CODES * sizeof(profile_stats_t));
+		if (!command_stats)
 		{
-			printf("error: counter is already active\n");
+			reply_str("error: no SRAM for command timing\n");
 			return;
 		}
+		command_stats_reset();
+	}
 
-		tc_sync_trigger(COUNTER_TC);
-		enable_count = true;
-		printf("ok\n");
+	command_timing = argv[0];
+	reply_str("ok\n");
+}
+
+static const command_t command_table[COMMAND_LAST - COMMAND_FIRST + 1] =
+{
+	[1001 - COMMAND_FIRST] = { command_m1001, true },
+	[1002 - COMMAND_FIRST] = { command_m1002, false },
+	[1003 - COMMAND_FIRST] = { command_m1003, false },
+	[1004 - COMMAND_FIRST] = { command_m1004, false },
+	[1005 - COMMAND_FIRST] = { command_m1005, false },
+	[1006 - COMMAND_FIRST] = { command_m1006, false },
+	[1015 - COMMAND_FIRST] = { command_m1015, false },
+	[1016 - COMMAND_FIRST] = { command_m1016, false },
+	[1017 - COMMAND_FIRST] = { command_m1017, false },
+	[1018 - COMMAND_FIRST] = { command_m1018, false },
+	[1019 - COMMAND_FIRST] = { command_m1019, false },
+	[1020 - COMMAND_FIRST] = { command_m1020, true },
+#if !COUNTER_POSITION_QDEC
+	[1021 - COMMAND_FIRST] = { command_m1021, true },
+	[1022 - COMMAND_FIRST] = { command_m1022, false },
+#endif
+	[1023 - COMMAND_FIRST] = { command_m1023, false },
+	[1024 - COMMAND_FIRST] = { command_m1024, true },
+	[1025 - COMMAND_FIRST] = { command_m1025, false },
+	[1026 - COMMAND_FIRST] = { command_m1026, false },
+	[1027 - COMMAND_FIRST] = { command_m1027, false },
+	[1028 - COMMAND_FIRST] = { command_m1028, false },
+	[1029 - COMMAND_FIRST] = { command_m1029, false },
+	[1030 - COMMAND_FIRST] = { command_m1030, false },
+	[1031 - COMMAND_FIRST] = { command_m1031, false },
+	[1032 - COMMAND_FIRST] = { command_m1032, false },
+	[1033 - COMMAND_FIRST] = { command_m1033, false },
+	[1034 - COMMAND_FIRST] = { command_m1034, false },
+	[1035 - COMMAND_FIRST] = { command_m1035, false },
+	[1036 - COMMAND_FIRST] = { command_m1036, false },
+	[1037 - COMMAND_FIRST] = { command_m1037, false },
+	[1038 - COMMAND_FIRST] = { command_m1038, false },
+	[1039 - COMMAND_FIRST] = { command_m1039, true },
+	[1040 - COMMAND_FIRST] = { command_m1040, false },
+	[1041 - COMMAND_FIRST] = { command_m1041, false },
+#if !COUNTER_POSITION_QDEC
+	[1042 - COMMAND_FIRST] = { command_m1042, false },
+#endif
+	[1043 - COMMAND_FIRST] = { command_m1043, false },
+#if COUNTER_SD_LOG
+	[1044 - COMMAND_FIRST] = { command_m1044, false },
+#endif
+#if ETH_ENABLE
+	[1045 - COMMAND_FIRST] = { command_m1045, false },
+#endif
+#if COUNTER_SYNC
+	[1046 - COMMAND_FIRST] = { command_m1046, false },
+#endif
+	[1047 - COMMAND_FIRST] = { command_m1047, false },
+	[1048 - COMMAND_FIRST] = { command_m1048, true },
+	[1049 - COMMAND_FIRST] = { command_m1049, false },
+	[1050 - COMMAND_FIRST] = { command_m1050, true },
+#if TRACE_ENABLE
+	[1051 - COMMAND_FIRST] = { command_m1051, false },
+#endif
+	[1052 - COMMAND_FIRST] = { command_m1052, true },
+#if !COUNTER_POSITION_QDEC
+	[1053 - COMMAND_FIRST] = { command_m1053, false },
+#endif
+	[1054 - COMMAND_FIRST] = { command_m1054, false },
+	[1055 - COMMAND_FIRST] = { command_m1055, false },
+	[1056 - COMMAND_FIRST] = { command_m1056, false },
+	[1057 - COMMAND_FIRST] = { command_m1057, false },
+	[1058 - COMMAND_FIRST] = { command_m1058, false },
+	[1059 - COMMAND_FIRST] = { command_m1059, false },
+	[1060 - COMMAND_FIRST] = { command_m1060, false },
+	[1061 - COMMAND_FIRST] = { command_m1061, false },
+	[1062 - COMMAND_FIRST] = { command_m1062, false },
+	[1063 - COMMAND_FIRST] = { command_m1063, false },
+	[1064 - COMMAND_FIRST] = { command_m1064, false },
+#if !COUNTER_POSITION_QDEC
+	[1065 - COMMAND_FIRST] = { command_m1065, false },
+#if CAPTURE_DIRS
+	[1066 - COMMAND_FIRST] = { command_m1066, false },
+#endif
+#endif
+	[1067 - COMMAND_FIRST] = { command_m1067, false },
+	[1068 - COMMAND_FIRST] = { command_m1068, false },
+	[1069 - COMMAND_FIRST] = { command_m1069, false },
+	[1070 - COMMAND_FIRST] = { command_m1070, false },
+	[1071 - COMMAND_FIRST] = { command_m1071, false },
+	[1072 - COMMAND_FIRST] = { command_m1072, false },
+	[1073 - COMMAND_FIRST] = { command_m1073, false },
+	[1074 - COMMAND_FIRST] = { command_m1074, false },
+	[1075 - COMMAND_FIRST] = { command_m1075, false },
+	[1076 - COMMAND_FIRST] = { command_m1076, false },
+	[1077 - COMMAND_FIRST] = { command_m1077, false },
+	[1078 - COMMAND_FIRST] = { command_m1078, false },
+#if COUNTER_FRAME_STORE
+	[1079 - COMMAND_FIRST] = { command_m1079, false },
+	[1080 - COMMAND_FIRST] = { command_m1080, false },
+#endif
+	[1081 - COMMAND_FIRST] = { command_m1081, false },
+	[1082 - COMMAND_FIRST] = { command_m1082, false },
+#if COUNTER_BEAM_GATE
+	[1083 - COMMAND_FIRST] = { command_m1083, false },
+#endif
+	[1084 - COMMAND_FIRST] = { command_m1084, false },
+	[1085 - COMMAND_FIRST] = { command_m1085, false },
+#if !COUNTER_POSITION_QDEC
+	[1086 - COMMAND_FIRST] = { command_m1086, false },
+	[1087 - COMMAND_FIRST] = { command_m1087, false },
+	[1088 - COMMAND_FIRST] = { command_m1088, false },
+#endif
+	[1089 - COMMAND_FIRST] = { command_m1089, false },
+	[1090 - COMMAND_FIRST] = { command_m1090, false },
+	[1091 - COMMAND_FIRST] = { command_m1091, false },
+	[1092 - COMMAND_FIRST] = { command_m1092, false },
+	[1093 - COMMAND_FIRST] = { command_m1093, false },
+	[1094 - COMMAND_FIRST] = { command_m1094, false },
+	[1095 - COMMAND_FIRST] = { command_m1095, false },
+	[1096 - COMMAND_FIRST] = { command_m1096, false },
+	[1097 - COMMAND_FIRST] = { command_m1097, false },
+	[1098 - COMMAND_FIRST] = { command_m1098, false },
+	[1099 - COMMAND_FIRST] = { command_m1099, false },
+	[1100 - COMMAND_FIRST] = { command_m1100, false },
+	[1101 - COMMAND_FIRST] = { command_m1101, false },
+	[1102 - COMMAND_FIRST] = { command_m1102, false },
+	[1103 - COMMAND_FIRST] = { command_m1103, false },
+	[1104 - COMMAND_FIRST] = { command_m1104, false },
+	[1105 - COMMAND_FIRST] = { command_m1105, false },
+	[1106 - COMMAND_FIRST] = { command_m1106, false },
+	[1107 - COMMAND_FIRST] = { command_m1107, false },
+	[1108 - COMMAND_FIRST] = { command_m1108, false },
+	[1109 - COMMAND_FIRST] = { command_m1109, false },
+	[1110 - COMMAND_FIRST] = { command_m1110, false },
+	[1111 - COMMAND_FIRST] = { command_m1111, false },
+	[1112 - COMMAND_FIRST] = { command_m1112, false },
+	[1113 - COMMAND_FIRST] = { command_m1113, false },
+#if !COUNTER_POSITION_QDEC
+	[1114 - COMMAND_FIRST] = { command_m1114, false },
+	[1115 - COMMAND_FIRST] = { command_m1115, false },
+#endif
+	[1116 - COMMAND_FIRST] = { command_m1116, false },
+	[1117 - COMMAND_FIRST] = { command_m1117, false },
+	[1118 - COMMAND_FIRST] = { command_m1118, true },
+	[1119 - COMMAND_FIRST] = { command_m1119, true },
+	[1120 - COMMAND_FIRST] = { command_m1120, false },
+	[1121 - COMMAND_FIRST] = { command_m1121, true },
+	[1122 - COMMAND_FIRST] = { command_m1122, false },
+	[1123 - COMMAND_FIRST] = { command_m1123, false },
+	[1124 - COMMAND_FIRST] = { command_m1124, false },
+	[1125 - COMMAND_FIRST] = { command_m1125, false },
+	[1126 - COMMAND_FIRST] = { command_m1126, false },
+	[1127 - COMMAND_FIRST] = { command_m1127, false },
+	[1128 - COMMAND_FIRST] = { command_m1128, true },
+	[1129 - COMMAND_FIRST] = { command_m1129, false },
+	[1130 - COMMAND_FIRST] = { command_m1130, false },
+	[1131 - COMMAND_FIRST] = { command_m1131, false },
+};
+
+static const command_t *find_command(uint32_t code)
+{
+	if (code < COMMAND_FIRST || code > COMMAND_LAST || !command_table[code - COMMAND_FIRST].handler)
+		return NULL;
+
+	return &command_table[code - COMMAND_FIRST];
+}
+
+void parse_gcode(const char *line, uint16_t length)
+{
+	// Commands are "M<code>" optionally followed by a space and arguments,
+	// the length characters from line.  Assumes that there is exactly one
+	// command per call; parse_batch splits up lines with several, which
+	// are parsed in place.
+	uint32_t start = profile_cycles();
+	int32_t argv[COMMAND_MAX_ARGS] = {0};
+	uint8_t argc;
+	uint32_t code = parse_command(line, line + length, COMMAND_LAST, argv, COMMAND_MAX_ARGS, &argc);
+	const command_t *command = find_command(code);
+
+	if (command)
+	{
+		command_framed = false;
+		trace(TRACE_COMMAND, code);
+		command->handler(argv, argc);
+		trace(TRACE_COMMAND | TRACE_END, code);
+		command_time(code, start);
+		commands_processed++;
 		return;
 	}
-	
-	// Disable counting
-	if (!strcmp(line, "M1004"))
+
+	reply_str("error: unknown command '");
+	reply_write(line, length);
+	reply_str("'\n");
+}
+
+// Runs the commands of a line in turn, separated by ';', so a batch
+// such as "M1004;M1001;M1015 0 0 7999" takes one round trip: the
+// replies gather in the ring and go out in the same flush.  A readout
+// job one of them starts holds up the rest, which is returned for
+// running once the job is done; NULL means the whole line has run.
+static const char *parse_batch(const char *line)
+{
+	for (;;)
 	{
-		if (!enable_count)
+		const char *end = strchr(line, ';');
+		if (!end)
 		{
-			printf("error: counter is not active\n");
-			return;
+			parse_gcode(line, strlen(line));
+			return NULL;
 		}
 
-		enable_count = false;
-		printf("ok\n");
+		if (end > line)
+			parse_gcode(line, end - line);
+
+		line = end + 1;
+		while (*line == ' ')
+			line++;
+		if (*line == '\0')
+			return NULL;
+		if (readout_job.kind != READOUT_JOB_NONE)
+			return line;
+	}
+}
+
+// Check and run one binary command frame, replying with frames
+static void parse_frame(const uint8_t *frame, uint16_t length)
+{
+	frame_header_t header;
+	bool valid = frame_check(frame, length, &header);
+	reply_frame_begin(header.opcode, header.sequence);
+
+	const command_t *command = find_command(1000 + header.opcode);
+	if (!valid || !command)
+	{
+		reply_frame_end(FRAME_FLAG_ERROR);
 		return;
 	}
-	
-	// Read primary counts
-	if (!strncmp(line, "M1005", 5))
+
+	// Arguments are little-endian int32_t, as in memory
+	int32_t argv[COMMAND_MAX_ARGS] = {0};
+	memcpy(argv, &frame[sizeof(header)], header.length);
+
+	command_opcode = header.opcode;
+	command_sequence = header.sequence;
+	command_framed = true;
+	bool idle = readout_job.kind == READOUT_JOB_NONE;
+	uint32_t start = profile_cycles();
+	command->handler(argv, header.length / sizeof(int32_t));
+	command_time(1000 + header.opcode, start);
+	commands_processed++;
+
+	// A readout continues in later frames once the job is done
+	reply_frame_end(idle && readout_job.kind != READOUT_JOB_NONE ? FRAME_FLAG_MORE : 0);
+}
+
+// Where the bytes being assembled come from
+static uint8_t command_rx_source = COMMAND_SOURCE_USB;
+
+static command_slot_t *command_slot(uint32_t index)
+{
+	return &command_queue[index & (COMMAND_QUEUE_LENGTH - 1)];
+}
+
+static void command_push(uint8_t kind)
+{
+	command_slot_t *slot = command_slot(command_tail);
+	slot->kind = kind;
+	slot->source = command_rx_source;
+	slot->length = command_length;
+	slot->received = time_us();
+	command_length = 0;
+	command_tail++;
+	if (command_tail - command_head > command_peak)
+		command_peak = command_tail - command_head;
+
+	if (kind == COMMAND_SLOT_FRAME ? (uint8_t)slot->data[1] == 28 : !strncmp(slot->data, "M1028", 5))
+		command_switch_pending = true;
+}
+
+static void read_line_byte(char c)
+{
+	char *line = command_slot(command_tail)->data;
+	if (c == '\n' || c == '\r')
 	{
-		if (enable_count)
+		if (command_overflow)
+			command_push(COMMAND_SLOT_OVERFLOW);
+		else
 		{
-			printf("error: cannot read counter while it is active\n");
-			return;
+			line[command_length++] = '\0';
+			command_push(COMMAND_SLOT_LINE);
 		}
 
-		int32_t channel, start, end;
-		if (sscanf(line, "M1005 %"SCNd32" %"SCNd32" %"SCNd32, &channel, &start, &end) != 3)
-		{
-			printf("error: read command requires three arguments\n");
-			return;
-		}
+		command_overflow = false;
+	}
+	else if (command_length < COMMAND_LINE_BYTES - 1)
+		line[command_length++] = c;
+	else
+		command_overflow = true;
+}
+
+// Bytes before a sync byte are skipped, so the host can resynchronise
+// after a rejected frame.  A header with a bad length ends the frame
+// at once and is rejected by parse_frame.
+static void read_frame_byte(uint8_t c)
+{
+	uint8_t *frame = (uint8_t *)command_slot(command_tail)->data;
+	if (command_length == 0 && c != FRAME_SYNC_COMMAND)
+		return;
+
+	frame[command_length++] = c;
+	if (command_length < sizeof(frame_header_t))
+		return;
+
+	frame_header_t header;
+	memcpy(&header, frame, sizeof(header));
+	if (header.length > COMMAND_MAX_ARGS * sizeof(int32_t) || header.length % sizeof(int32_t)
+		|| command_length == sizeof(header) + header.length + sizeof(uint16_t))
+		command_push(COMMAND_SLOT_FRAME);
+}
+
+// Commands are assembled from whole CDC receive buffers rather than read
+// a byte at a time.  Input stops while the queue is full, so the host is
+// held off by the endpoint instead of commands being lost.
+static uint8_t command_rx[UDI_CDC_DATA_EPS_FS_SIZE];
+static const uint8_t *command_rx_data = command_rx;
+static uint16_t command_rx_length = 0;
+static uint16_t command_rx_next = 0;
+
+// Set by the CDC driver when received bytes become readable on the command
+// port, so the main loop (and main_idle) need not ask the driver each pass
+static volatile bool command_rx_ready = false;
+
+void main_cdc_rx_notify(uint8_t port)
+{
+	if (port == 0)
+		command_rx_ready = true;
+}
+
+// Position query fast path.  A packet holding just POSITION_QUERY on the
+// command port is taken out of the stream by the USB interrupt and
+// answered with "@<position>\n", the position M1001 would report,
+// without waiting for the main loop to reach the command queue.  The
+// answer goes straight into the CDC TX buffers when that cannot split
+// anything else being sent: text commands only, the port at the end of
+// a line, and no binary data under way on it.  Otherwise the main loop
+// sends it by position_poll as soon as the port is quiet.
+#define POSITION_QUERY 0x05  // ASCII ENQ
+// The same for the clock exchange: a packet holding just TIME_QUERY is
+// stamped as the USB interrupt takes it and answered with
+// "~<received> <sent>\n", both in time_us() microseconds, the second
+// taken as the answer goes into the TX buffers
+#define TIME_QUERY 0x16  // ASCII SYN
+
+// Set while run_commands runs a command, whose binary data may be sent
+// as several writes
+static volatile bool command_running;
+static volatile bool position_query_pending;
+static volatile bool time_query_pending;
+static uint64_t time_query_received;
+
+static bool position_quiet(void)
+{
+	return !command_framed && !cdc_command_writes && reply_at_line_end()
+		&& ((data_interface != DATA_INTERFACE_CDC && !stripe_on_command_port())
+			|| (!command_running && readout_job.kind == READOUT_JOB_NONE));
+}
+
+// Sends the answer if the port is quiet and it fits in the TX buffers
+// without waiting, called with the USB interrupt held off
+static void position_answer(void)
+{
+	if (!position_quiet())
+		return;
+
+	char text[2 + REPLY_U32_DIGITS + 1];
+	int32_t position = head_position - head_origin;
+	uint8_t length = 1;
+	text[0] = '@';
+	if (position < 0)
+		text[length++] = '-';
+	length += reply_format_u32(&text[length], position < 0 ? -(uint32_t)position : (uint32_t)position);
+	text[length++] = '\n';
+
+	if (udi_cdc_multi_get_free_tx_buffer(0) < length)
+		return;
+
+	udi_cdc_multi_write_buf_timeout(0, text, length, 0);
+	position_query_pending = false;
+}
+
+static void time_answer(void)
+{
+	if (!position_quiet())
+		return;
+
+	char text[1 + 2 * REPLY_U64_DIGITS + 2];
+	uint8_t length = 1;
+	text[0] = '~';
+	length += reply_format_u64(&text[length], time_query_received);
+	text[length++] = ' ';
+	uint8_t sent = length;
+	length += REPLY_U64_DIGITS + 1;
+	if (udi_cdc_multi_get_free_tx_buffer(0) < length)
+		return;
+
+	length = sent + reply_format_u64(&text[sent], time_us());
+	text[length++] = '\n';
+	udi_cdc_multi_write_buf_timeout(0, text, length, 0);
+	time_query_pending = false;
+}
+
+bool main_cdc_rx_filter(uint8_t port, const uint8_t *data, uint32_t length)
+{
+	if (port != 0 || length != 1)
+		return true;
+
+	if (data[0] == TIME_QUERY)
+	{
+		time_query_received = time_us();
+		time_query_pending = true;
+		time_answer();
+		return false;
+	}
+
+	if (data[0] != POSITION_QUERY)
+		return true;
+
+	position_query_pending = true;
+	position_answer();
+	return false;
+}
+
+#if USB_DFU_ENABLE
+// Each page of a firmware update masks the interrupts while it is
+// programmed, so updates wait for the acquisition to end
+bool main_dfu_allowed(void)
+{
+	return !enable_count && start_armed == START_ARMED_NONE && !timed_active && !sweep_active;
+}
+#endif
 
-		if (channel < 0 || channel > 2)
+static void position_poll(void)
+{
+	if (!position_query_pending && !time_query_pending)
+		return;
+
+	irqflags_t flags = cpu_irq_save();
+	if (position_query_pending)
+		position_answer();
+	if (time_query_pending)
+		time_answer();
+	cpu_irq_restore(flags);
+}
+
+#if ETH_ENABLE
+// Each UDP datagram holds whole commands, so one is only taken between
+// commands and whatever is left unterminated at its end is dropped.
+// Longer datagrams are cut short.
+#define COMMAND_DATAGRAM_BYTES 512
+static uint8_t command_datagram[COMMAND_DATAGRAM_BYTES];
+#endif
+
+// Refill the receive buffer, returning false if nothing has arrived
+static bool command_rx_fill(void)
+{
+#if ETH_ENABLE
+	if (command_rx_source == COMMAND_SOURCE_ETH)
+	{
+		command_length = 0;
+		command_overflow = false;
+		command_rx_source = COMMAND_SOURCE_USB;
+	}
+
+	if (command_length == 0)
+	{
+		uint16_t received = eth_receive(command_datagram, sizeof(command_datagram));
+		if (received)
 		{
-			printf("error: invalid counter\n");
-			return;
+			command_rx_data = command_datagram;
+			command_rx_length = received;
+			command_rx_next = 0;
+			command_rx_source = COMMAND_SOURCE_ETH;
+			return true;
 		}
+	}
+#endif
+
+	if (!command_rx_ready)
+		return false;
+
+	// Cleared before looking, so bytes arriving meanwhile notify again
+	command_rx_ready = false;
+	iram_size_t available = udi_cdc_get_nb_received_data();
+	iram_size_t received = Min(available, sizeof(command_rx));
+	if (received == 0)
+		return false;
+	if (available > received)
+		command_rx_ready = true;
+
+	udi_cdc_read_buf(command_rx, received);
+	command_rx_data = command_rx;
+	command_rx_length = received;
+	command_rx_next = 0;
+	return true;
+}
+
+#if COUNTER_TELEMETRY
+// Each sample writes TELEMETRY_PORT_SAMPLE first, then one 32-bit word to
+// each port below, as NRZ (UART) SWO at TELEMETRY_SWO_HZ.
+#define TELEMETRY_PERIOD_MS 100
+#define TELEMETRY_SWO_HZ 2000000
+
+#define TELEMETRY_PORT_SAMPLE 0   // Sample number
+#define TELEMETRY_PORT_STEPS 1    // Steps per second
+#define TELEMETRY_PORT_STEP_MAX 2 // Longest step interrupt in cycles since M1020
+#define TELEMETRY_PORT_USB 3      // USB IN bytes per second
+#define TELEMETRY_PORT_STREAM 4   // Stream ring records
+#define TELEMETRY_PORT_DEFER 5    // Defer ring records
+#define TELEMETRY_PORT_REPLY 6    // Reply ring bytes
+#define TELEMETRY_PORT_COMMANDS 7 // Commands queued
+#define TELEMETRY_PORTS 8
+
+// Lock Access Register, missing from ITM_Type in this CMSIS
+#define TELEMETRY_ITM_LAR (*(volatile uint32_t *)(ITM_BASE + 0xFB0))
+#define TELEMETRY_ITM_UNLOCK 0xC5ACCE55
+
+static uint32_t telemetry_sample;
+static uint16_t telemetry_steps;
+static uint32_t telemetry_usb_bytes;
+
+// Drops a word when a debugger has turned the port off, and otherwise
+// waits for the FIFO, which drains at the SWO rate with or without a probe
+static void telemetry_put(uint32_t port, uint32_t value)
+{
+	if (!(ITM->TCR & ITM_TCR_ITMENA_Msk) || !(ITM->TER & (1UL << port)))
+		return;
+
+	while (ITM->PORT[port].u32 == 0)
+		;
+	ITM->PORT[port].u32 = value;
+}
+
+static uint32_t telemetry_ticks;
+
+// From the timebase tick
+static void telemetry_tick(void)
+{
+	if (++telemetry_ticks < TELEMETRY_PERIOD_MS)
+		return;
+	telemetry_ticks = 0;
+
+	uint16_t steps = steps_serviced;
+	uint32_t usb_bytes = udd_get_in_bytes();
+
+	telemetry_put(TELEMETRY_PORT_SAMPLE, telemetry_sample++);
+	telemetry_put(TELEMETRY_PORT_STEPS, (uint16_t)(steps - telemetry_steps) * (1000 / TELEMETRY_PERIOD_MS));
+#if PROFILE_ENABLE
+	telemetry_put(TELEMETRY_PORT_STEP_MAX, profile_duration.max);
+#else
+	telemetry_put(TELEMETRY_PORT_STEP_MAX, 0);
+#endif
+	telemetry_put(TELEMETRY_PORT_USB, (usb_bytes - telemetry_usb_bytes) * (1000 / TELEMETRY_PERIOD_MS));
+	telemetry_put(TELEMETRY_PORT_STREAM, ring_count(&stream_queue));
+	telemetry_put(TELEMETRY_PORT_DEFER, ring_count(&defer_queue));
+	telemetry_put(TELEMETRY_PORT_REPLY, REPLY_RING_BYTES - reply_space());
+	telemetry_put(TELEMETRY_PORT_COMMANDS, command_tail - command_head);
 
-		if (start < 0 || start >= HEAD_STEPS_MAX || end < 0 || end >= HEAD_STEPS_MAX || start > end)
+	telemetry_steps = steps;
+	telemetry_usb_bytes = usb_bytes;
+}
+
+// The SWO baud divides the CPU clock, so it is set again whenever that
+// changes, as the timebase is
+static void telemetry_clock(uint32_t cpu_hz)
+{
+	TPI->ACPR = cpu_hz / TELEMETRY_SWO_HZ - 1;
+}
+
+// The probe only has to listen: the ITM and TPIU are set up here.
+// TRCENA is already on for the cycle counter (profile_init).
+static void telemetry_init(void)
+{
+	TPI->SPPR = 2;  // NRZ
+	TPI->FFCR = 0x100;  // Formatter off, ITM straight to SWO
+	TELEMETRY_ITM_LAR = TELEMETRY_ITM_UNLOCK;
+	ITM->TCR = (1UL << ITM_TCR_TraceBusID_Pos) | ITM_TCR_SYNCENA_Msk | ITM_TCR_ITMENA_Msk;
+	ITM->TER = (1UL << TELEMETRY_PORTS) - 1;
+
+	telemetry_clock(sysclk_get_cpu_hz());
+}
+#endif
+
+#if COUNTER_CLOCK_SCALING
+// 96 MHz / 8.  Everything timed from MCK (the M1032, M1042 and M1043
+// timers, SD transfers) keeps the clock up while it runs, since the
+// dividers are computed for the full speed.
+#define CLOCK_IDLE_PRES SYSCLK_PRES_8
+#define CLOCK_IDLE_MS 1000
+// How many times slower the CPU runs, for the trace (TRACE_CLOCK)
+#define CLOCK_IDLE_FACTOR (1u << ((CLOCK_IDLE_PRES - CONFIG_SYSCLK_PRES) >> PMC_MCKR_PRES_Pos))
+
+static bool clock_slow = false;
+static uint32_t clock_activity; // sof_count when command bytes last arrived
+
+// Return to the conf_clock.h speed before any command runs
+static void clock_full(void)
+{
+	clock_activity = sof_count;
+	if (!clock_slow)
+		return;
+
+	pmc_mck_set_prescaler(CONFIG_SYSCLK_PRES);
+	clock_slow = false;
+	trace(TRACE_CLOCK, 1);
+	time_clock(sysclk_get_cpu_hz());
+#if COUNTER_TELEMETRY
+	telemetry_clock(sysclk_get_cpu_hz());
+#endif
+}
+
+// Drop the clock once nothing needs it.  Without COUNTER_RTT_TICK the
+// SOFs stop with the bus, so an idle board without a USB host stays at
+// full speed.
+static void clock_poll(void)
+{
+	if (clock_slow || enable_count || start_armed || timed_active || generator_active || pulse_capture
+		|| readout_job.kind != READOUT_JOB_NONE || command_head != command_tail)
+		return;
+
+#if COUNTER_SYNC
+	if (sync_armed)
+		return;
+#endif
+#if !COUNTER_POSITION_QDEC
+	if (count_mode == COUNT_MODE_CAPTURE)
+		return;
+#endif
+#if COUNTER_SD_LOG
+	if (sd_log_writing)
+		return;
+#endif
+
+	if (sof_count - clock_activity < CLOCK_IDLE_MS)
+		return;
+
+	pmc_mck_set_prescaler(CLOCK_IDLE_PRES);
+	clock_slow = true;
+	trace(TRACE_CLOCK, CLOCK_IDLE_FACTOR);
+	time_clock(sysclk_get_cpu_hz() / CLOCK_IDLE_FACTOR);
+#if COUNTER_TELEMETRY
+	telemetry_clock(sysclk_get_cpu_hz() / CLOCK_IDLE_FACTOR);
+#endif
+}
+#endif
+
+static void read_commands(void)
+{
+	while (command_tail - command_head < COMMAND_QUEUE_LENGTH && !command_switch_pending)
+	{
+		if (command_rx_next == command_rx_length)
 		{
-			printf("error: invalid column range\n");
-			return;
+			if (!command_rx_fill())
+				return;
+#if COUNTER_CLOCK_SCALING
+			clock_full();
+#endif
 		}
 
-		printf("ok\n");
+		uint8_t c = command_rx_data[command_rx_next++];
+		if (command_binary)
+			read_frame_byte(c);
+		else
+			read_line_byte(c);
+	}
+}
+
+// While a readout job is sending, a queued command may run ahead of it only
+// if it just reports state and its reply can be told apart from the
+// readout: it must be a frame, and binary readout data must be on bulk
+// or the data port, a striped readout's included.
+static bool command_may_overlap(const command_slot_t *slot)
+{
+	if (slot->kind != COMMAND_SLOT_FRAME || slot->length < sizeof(frame_header_t))
+		return false;
 
-		// TODO: This really should transfer in binary,
-		// but text is easier to debug using a terminal
-		volatile uint16_t *counts[3] = { primary_count, secondary_count, tertiary_count };
-		for (int32_t i = start; i <= end; i++)
-			printf("%"PRIu16" ", counts[channel][i]);
-		printf("\n");
+	if (readout_job.kind != READOUT_JOB_TEXT && (data_interface == DATA_INTERFACE_CDC || stripe_on_command_port()))
+		return false;
 
-		printf("ok\n");
-		return;
+	const command_t *command = find_command(1000 + (uint8_t)slot->data[1]);
+	return command && command->overlap;
+}
+
+static void run_commands(void)
+{
+	if (readout_job.kind != READOUT_JOB_NONE)
+	{
+		select_source(readout_job.source);
+		readout_schedule();
 	}
-	
-	// Reset counts
-	if (!strcmp(line, "M1006"))
+
+	while (command_head != command_tail)
 	{
-		if (enable_count)
-		{
-			printf("error: cannot reset counter while it is active\n");
+		command_slot_t *slot = command_slot(command_head);
+		if (readout_job.kind != READOUT_JOB_NONE && !command_may_overlap(slot))
 			return;
+
+		select_source(slot->source);
+		command_received = slot->received;
+		command_running = true;
+		if (slot->kind == COMMAND_SLOT_LINE)
+		{
+			const char *rest = program_record(slot->data, slot->length) ? NULL : parse_batch(slot->data);
+			if (rest)
+			{
+				// The remaining commands run once the readout job is done
+				slot->length = strlen(rest) + 1;
+				memmove(slot->data, rest, slot->length);
+				command_running = false;
+				return;
+			}
 		}
+		else if (slot->kind == COMMAND_SLOT_FRAME)
+			parse_frame((const uint8_t *)slot->data, slot->length);
+		else
+			reply_str("WARNING: input buffer full.  Buffered data have been discarded.\r\n");
+		command_running = false;
+		command_head++;
+	}
 
-		memset((uint8_t *)primary_count, 0, 2 * HEAD_STEPS_MAX);
-		memset((uint8_t *)secondary_count, 0, 2 * HEAD_STEPS_MAX);
-		memset((uint8_t *)tertiary_count, 0, 2 * HEAD_STEPS_MAX);
-		printf("ok\n");
-		return;
+	// Everything up to a protocol switch has run
+	command_switch_pending = false;
+}
+
+#if COUNTER_IDLE_SLEEP
+// Whether the main loop would find no work on its next pass.  Everything
+// else the loop waits for arrives with an interrupt.
+static bool main_idle(void)
+{
+	if (readout_job.kind != READOUT_JOB_NONE || command_head != command_tail
+		|| command_rx_next != command_rx_length || command_rx_ready)
+		return false;
+
+#if ETH_ENABLE
+	if (eth_rx_pending())
+		return false;
+#endif
+#if USB_MSC_ENABLE
+	if (udi_msc_pending())
+		return false;
+#endif
+#if USB_DFU_ENABLE
+	if (udi_dfu_pending())
+		return false;
+#endif
+
+	// A block still waiting on the aggregation policy is rechecked at the
+	// next millisecond tick
+	if (stream_due())
+		return false;
+
+	if (ring_count(&defer_queue) || defer_swap || precompute_due())
+		return false;
+
+#if !COUNTER_POSITION_QDEC
+	// The PDC halves are polled
+	if (count_mode == COUNT_MODE_CAPTURE)
+		return false;
+#endif
+#if COUNTER_SD_LOG
+	// So is the HSMCI
+	if (sd_log_writing)
+		return false;
+#endif
+	return true;
+}
+
+// Sleep until the next interrupt if there is nothing to do.  The check
+// runs with interrupts off; one arriving between the check and the WFI
+// is only seen at the next interrupt (a millisecond tick at most 2 ms
+// later, or without COUNTER_RTT_TICK a SOF while the USB bus is active).
+static void main_sleep(void)
+{
+	cpu_irq_disable();
+	if (main_idle())
+		sleepmgr_enter_sleep();
+	else
+		cpu_irq_enable();
+}
+#endif
+
+#if UDD_USB_INT_LEVEL <= GENERATOR_IRQ_PRIORITY
+#error USB must not preempt the counting interrupts
+#endif
+
+// The interrupts that may share the step interrupt's priority
+static bool irq_counting(IRQn_Type irq)
+{
+#if COUNTER_POSITION_QDEC
+	if (irq == QDEC_TC_IRQn)
+		return true;
+#endif
+	if (irq < 32 && (COUNTER_WRAP_IRQS & (1UL << irq)))
+		return true;
+	return irq == (IRQn_Type)COUNTER_PIO_ID || irq == TIMED_TC_IRQn || irq == DMAC_IRQn;
+}
+
+// Make every priority bit preempt (no subpriority), and drop any other
+// interrupt left at the counting priority, enabled or not, since the
+// drivers leave them at 0.  IRQs set up later choose their own.
+static void irq_priority_check(void)
+{
+	NVIC_SetPriorityGrouping(7 - __NVIC_PRIO_BITS);
+
+	for (int32_t irq = 0; irq < PERIPH_COUNT_IRQn; irq++)
+	{
+		if (!irq_counting((IRQn_Type)irq) && NVIC_GetPriority((IRQn_Type)irq) <= COUNTER_IRQ_PRIORITY)
+			NVIC_SetPriority((IRQn_Type)irq, BACKGROUND_IRQ_PRIORITY);
 	}
+}
 
-	printf("error: unknown command '%s'\n", line);
+// Bus matrix arbitration for the SRAM.  The SAM4E has a single SRAM
+// slave, so the count arena, the stack and every buffer share it
+// whatever their placement, and the UDP endpoints are the UDP's own
+// DPRAM, which the CPU copies through.  The masters that contend with
+// the step interrupt are the DMAC clearing a bank, the PDC of the step
+// capture and the GMAC: their accesses are made to wait for the CPU
+// system bus, which carries the interrupt's data and, with
+// COUNTER_ISR_IN_RAM, its instructions too.  A fixed default master
+// also saves the CPU the arbitration cycle on its first access after
+// the SRAM has been idle.
+#define MATRIX_SLAVE_SRAM 0
+#define MATRIX_MASTER_CPU_SYSTEM 1
+#define MATRIX_DEFMSTR_FIXED 2
+#define MATRIX_PRIORITY_HIGHEST 3
+
+static void bus_priority_init(void)
+{
+	MATRIX->MATRIX_SCFG[MATRIX_SLAVE_SRAM] = (MATRIX->MATRIX_SCFG[MATRIX_SLAVE_SRAM] & MATRIX_SCFG_SLOT_CYCLE_Msk)
+		| MATRIX_SCFG_DEFMSTR_TYPE(MATRIX_DEFMSTR_FIXED) | MATRIX_SCFG_FIXED_DEFMSTR(MATRIX_MASTER_CPU_SYSTEM);
+	MATRIX->MATRIX_PRAS0 = MATRIX_PRAS0_M1PR(MATRIX_PRIORITY_HIGHEST);
 }
 
 int main (void)
 {
-	sysclk_init();
+	stack_paint();
+	pool_init(&sram_pool, &_end, &__ram_end__);
+	profile_init();
 	board_init();
 
+	// Start the crystal without waiting for it.  It settles while the step
+	// tracking is set up on the RC oscillator, and sysclk_init() then finds
+	// it ready and only waits for the PLL.
+	PMC->CKGR_MOR = (PMC->CKGR_MOR & ~CKGR_MOR_MOSCXTBY) | CKGR_MOR_KEY_PASSWD | CKGR_MOR_MOSCXTEN
+		| CKGR_MOR_MOSCXTST(pmc_us_to_moscxtst(BOARD_OSC_STARTUP_US, OSC_SLCK_32K_RC_HZ));
+
+#if COUNTER_ENABLE_CACHE
+	CMCC->CMCC_MAINT0 = CMCC_MAINT0_INVALL;
+	CMCC->CMCC_CTRL = CMCC_CTRL_CEN;
+#endif
+
 	irq_initialize_vectors();
-	cpu_irq_enable();
-	stdio_usb_init();
 
-	// Count primary counts in channel 0 (attached to TCLK0, PA4)
-	// Count secondary counts in channel 2 (attached to TCLK1, PA28)
-	// Count tertiary counts in channel 3 (attached to TCLK2, PA29)
-	pmc_enable_periph_clk(PRIMARY_TC_CHANNEL_ID);
-	pmc_enable_periph_clk(SECONDARY_TC_CHANNEL_ID);
-	pmc_enable_periph_clk(TERTIARY_TC_CHANNEL_ID);
+	// Count each channel's pulses on its TCLK input (see counter_channels)
 	pmc_enable_periph_clk(COUNTER_PIO_ID);
+	for (uint8_t c = 0; c < COUNTER_CHANNELS; c++)
+	{
+		const counter_channel_t *counter = &counter_channels[c];
+		uint32_t clock_pin = counter->clock_pin;
+		if (counter->pio == PIOA)
+			clock_pin &= ~COUNTER_SD_PINS;
 
-	pio_configure(COUNTER_PIO, PIO_TYPE_PIO_PERIPH_B, PIO_PA4 | PIO_PA28 | PIO_PA29, 0);
+		pmc_enable_periph_clk(counter->id);
+		pio_configure(counter->pio, PIO_TYPE_PIO_PERIPH_B, clock_pin, 0);
+	}
 
-	tc_init(COUNTER_TC, PRIMARY_TC_CHANNEL, TC_CMR_TCCLKS_XC0); // TCLK0 -> PA4
-	tc_init(COUNTER_TC, SECONDARY_TC_CHANNEL, TC_CMR_TCCLKS_XC1); // TCLK1 -> PA28
-	tc_init(COUNTER_TC, TERTIARY_TC_CHANNEL, TC_CMR_TCCLKS_XC2); // TCLK2 -> PA29
+	configure_counters(COUNT_MODE_RESET);
+	clear_init();
+#if COUNTER_FRAME_STORE
+	frame_store_init();
+#endif
 
-	tc_start(COUNTER_TC, PRIMARY_TC_CHANNEL);
-	tc_start(COUNTER_TC, SECONDARY_TC_CHANNEL);
-	tc_start(COUNTER_TC, TERTIARY_TC_CHANNEL);
+#if COUNTER_POSITION_QDEC
+	qdec_init();
+#elif !COUNTER_USES_TC(STEP_CHECK_TC_CHANNEL_ID) && !COUNTER_FRAME_STORE
+	// Count every step edge in hardware
+	pmc_enable_periph_clk(STEP_CHECK_TC_CHANNEL_ID);
+	pmc_enable_periph_clk(STEP_CHECK_PIO_ID);
+	pio_configure(STEP_CHECK_PIO, PIO_TYPE_PIO_PERIPH_B, STEP_CHECK_PIN, 0);
+	tc_init(STEP_CHECK_TC, STEP_CHECK_TC_CHANNEL, TC_CMR_TCCLKS_XC0); // TCLK6 -> PC7
+	tc_start(STEP_CHECK_TC, STEP_CHECK_TC_CHANNEL);
+#endif
 
 	// Enable step tracking
-	pmc_enable_periph_clk(COUNTER_PIO_ID);
-	pio_configure(COUNTER_PIO, PIO_TYPE_PIO_INPUT, COUNTER_STEP_PIN | COUNTER_DIR_PIN, 0);
+	pio_configure(COUNTER_PIO, PIO_TYPE_PIO_INPUT, COUNTER_STEP_PINS | COUNTER_DIR_PIN | ROW_DIR_PIN, 0);
+#if COUNTER_FAST_STEP_ISR
+	install_step_handler();
+	pio_configure_interrupt(COUNTER_PIO, COUNTER_STEP_PINS, PIO_IT_RISE_EDGE);
+#else
+#if !COUNTER_POSITION_QDEC
 	pio_handler_set(COUNTER_PIO, ID_PIOA, COUNTER_STEP_PIN, PIO_IT_RISE_EDGE, Trigger_Step);
-	pio_set_input(COUNTER_PIO, COUNTER_STEP_PIN, PIO_DEGLITCH);
+#endif
+	pio_handler_set(COUNTER_PIO, ID_PIOA, ROW_STEP_PIN, PIO_IT_RISE_EDGE, Trigger_Row);
+#endif
+	pio_set_input(COUNTER_PIO, COUNTER_STEP_PINS, PIO_DEGLITCH);
 
-	NVIC_EnableIRQ((IRQn_Type)COUNTER_PIO_ID);
+	// Also enables the IRQ, only once its priority is set
 	pio_handler_set_priority(COUNTER_PIO, (IRQn_Type)COUNTER_PIO_ID, COUNTER_IRQ_PRIORITY);
-	pio_enable_interrupt(COUNTER_PIO, COUNTER_STEP_PIN);
+	pio_enable_interrupt(COUNTER_PIO, COUNTER_STEP_PINS);
 
-	// The main loop only needs to parse commands.
-	// The counting and position monitoring is handled by interrupts.
-	char linebuf[256];
-	uint8_t buflen = 0;
+#if COUNTER_SYNC
+	// The slave input interrupts on both edges once M1046 enables it
+	pio_configure(COUNTER_PIO, PIO_TYPE_PIO_INPUT, SYNC_IN_PIN, PIO_DEGLITCH);
+	pio_configure(COUNTER_PIO, PIO_TYPE_PIO_OUTPUT_0, SYNC_OUT_PIN, 0);
+	COUNTER_PIO->PIO_OWER = SYNC_OUT_PIN;
+#if COUNTER_FAST_STEP_ISR
+	pio_configure_interrupt(COUNTER_PIO, SYNC_IN_PIN, 0);
+#else
+	pio_handler_set(COUNTER_PIO, ID_PIOA, SYNC_IN_PIN, 0, Trigger_Sync);
+#endif
+#endif
+
+	// The start input, which only starts counting once M1084 2 arms it
+	pio_configure(COUNTER_PIO, PIO_TYPE_PIO_INPUT, START_PIN, PIO_DEGLITCH);
+#if COUNTER_FAST_STEP_ISR
+	pio_configure_interrupt(COUNTER_PIO, START_PIN, PIO_IT_RISE_EDGE);
+#else
+	pio_handler_set(COUNTER_PIO, ID_PIOA, START_PIN, PIO_IT_RISE_EDGE, Trigger_Start);
+#endif
+	pio_enable_interrupt(COUNTER_PIO, START_PIN);
+
+#if !COUNTER_POSITION_QDEC
+	// The home input, which only moves the head once M1086 sets a mode
+	pio_configure(COUNTER_PIO, PIO_TYPE_PIO_INPUT, HOME_PIN, PIO_DEGLITCH);
+#if COUNTER_FAST_STEP_ISR
+	pio_configure_interrupt(COUNTER_PIO, HOME_PIN, PIO_IT_RISE_EDGE);
+#else
+	pio_handler_set(COUNTER_PIO, ID_PIOA, HOME_PIN, PIO_IT_RISE_EDGE, Trigger_Home);
+#endif
+	pio_enable_interrupt(COUNTER_PIO, HOME_PIN);
+#endif
+
+	// Coincidence inputs, which interrupt once M1073 enables them
+	pmc_enable_periph_clk(COINCIDENCE_PIO_ID);
+	pio_configure(COINCIDENCE_PIO, PIO_TYPE_PIO_INPUT, COINCIDENCE_PINS, 0);
+	pio_handler_set(COINCIDENCE_PIO, COINCIDENCE_PIO_ID, PIO_PE0, PIO_IT_RISE_EDGE, coincidence_edge);
+	pio_handler_set(COINCIDENCE_PIO, COINCIDENCE_PIO_ID, PIO_PE1, PIO_IT_RISE_EDGE, coincidence_edge);
+	pio_handler_set(COINCIDENCE_PIO, COINCIDENCE_PIO_ID, PIO_PE2, PIO_IT_RISE_EDGE, coincidence_edge);
+	pio_disable_interrupt(COINCIDENCE_PIO, COINCIDENCE_PINS);
+	pio_handler_set_priority(COINCIDENCE_PIO, COINCIDENCE_IRQn, COINCIDENCE_IRQ_PRIORITY);
+
+	// Steps are tracked from here on, also while the clocks switch over
+	cpu_irq_enable();
+	boot_tracking_cycles = profile_cycles();
+
+	sysclk_init();
+	boot_clock_cycles = profile_cycles();
 
+#if COUNTER_IDLE_SLEEP
+	// The counters need the clocks, so never go deeper than WFI
+	sleepmgr_init();
+	sleepmgr_lock_mode(SLEEPMGR_SLEEP_WFI);
+#endif
+	stdio_usb_init();
+#if ETH_ENABLE
+	eth_init();
+#endif
+	gain_map_reset();
+	settings_load();
+	shadow_restore();
+	flash_log_init();
+	irq_priority_check();
+	powerfail_init();
+	bus_priority_init();
+	fpu_stacking(true);
+	time_clock(sysclk_get_cpu_hz());
+	wall_init();
+#if COUNTER_RTT_TICK
+	rtt_init();
+#endif
+#if COUNTER_TELEMETRY
+	telemetry_init();
+#endif
+	boot_ready_cycles = profile_cycles();
+
+	// The main loop only needs to parse commands and forward streamed columns.
+	// The counting and position monitoring is handled by interrupts.
 	while (true)
 	{
-		while (udi_cdc_is_rx_ready())
-		{
-			// buflen will wrap to 0 on increment.  Notify the caller of the data loss
-			if (buflen == 255)
-			printf("WARNING: input buffer full.  Buffered data have been discarded.\r\n");
+#if ETH_ENABLE
+		eth_poll();
+#endif
+		read_commands();
+		position_poll();
+		run_commands();
+		program_poll();
+		defer_poll();
+#if !COUNTER_POSITION_QDEC
+		capture_poll();
+#endif
+		cine_poll();
+		precompute_poll();
+#if !COUNT_PACKED_CHANNELS
+		row_prefetch_poll();
+#endif
+		powerfail_poll();
+#if !COUNTER_POSITION_QDEC
+		shadow_poll();
+#endif
+#if USB_MSC_ENABLE
+		udi_msc_poll();
+#endif
+#if USB_DFU_ENABLE
+		udi_dfu_poll();
+#endif
 
-			char c = udi_cdc_getc();
-			if (c == '\n' || c == '\r')
-			{
-				linebuf[buflen++] = '\0';
-				parse_gcode(linebuf, buflen);
-				buflen = 0;
-			}
-			else
-				linebuf[buflen++] = c;
+		// Stream blocks and pushes would land in the middle of a readout
+		if (readout_job.kind == READOUT_JOB_NONE)
+		{
+			flush_stream();
+			push_position();
+			preview_poll();
+			stop_poll();
+			sweep_poll();
+#if !COUNT_PACKED_CHANNELS
+			row_push_poll();
+#endif
 		}
+#if COUNTER_FRAME_STORE
+		frame_store_poll();
+#endif
+		flash_log_poll();
+#if COUNTER_SD_LOG
+		sd_log_poll();
+#endif
+		reply_flush();
+		rate_poll();
+#if COUNTER_CLOCK_SCALING
+		clock_poll();
+#endif
+#if COUNTER_IDLE_SLEEP
+		main_sleep();
+#endif
 	}
 }
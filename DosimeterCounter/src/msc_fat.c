@@ -0,0 +1,213 @@
+#include <string.h>
+#include "flash.h"
+#include "udi_msc.h"
+
+// The disk behind udi_msc.c: a FAT12 volume made up sector by sector as
+// the host reads it, with one read-only file per scan log record, named
+// by its serial (R0000042.BIN for record 42) and holding its payload.
+// Nothing is stored: the boot sector, FATs and root directory are worked
+// out from a small index of the records taken by msc_disk_open, and the
+// file sectors are read straight through the flash mapping.  The index
+// holds the newest MSC_FAT_FILES records.  Records written after it was
+// taken appear when the host next attaches the disk, and a file whose
+// record has since been overwritten in the ring reads as zeros.
+
+#define MSC_FAT_CLUSTER_SECTORS 8
+#define MSC_FAT_CLUSTER_BYTES (MSC_FAT_CLUSTER_SECTORS * UDI_MSC_SECTOR_BYTES)
+#define MSC_FAT_ROOT_ENTRIES 128
+#define MSC_FAT_ROOT_SECTORS (MSC_FAT_ROOT_ENTRIES * 32 / UDI_MSC_SECTOR_BYTES)
+#define MSC_FAT_FILES (MSC_FAT_ROOT_ENTRIES - 1)   // After the volume label
+#define MSC_FAT_MIN_CLUSTERS 16
+// 2024-01-01, as the counter has no calendar
+#define MSC_FAT_DATE ((2024 - 1980) << 9 | 1 << 5 | 1)
+
+typedef struct
+{
+	uint32_t page;
+	uint32_t serial;
+	uint32_t bytes;
+	uint16_t first_cluster;
+	uint16_t clusters;
+} msc_file_t;
+
+static msc_file_t msc_files[MSC_FAT_FILES];
+static uint32_t msc_file_count;
+static uint32_t msc_clusters;
+static uint32_t msc_fat_sectors;
+static uint32_t msc_root_start;
+static uint32_t msc_data_start;
+static uint32_t msc_total_sectors;
+static uint32_t msc_volume_id;
+
+static inline void msc_put16(uint8_t *p, uint16_t value)
+{
+	p[0] = value;
+	p[1] = value >> 8;
+}
+
+static inline void msc_put32(uint8_t *p, uint32_t value)
+{
+	msc_put16(p, value);
+	msc_put16(p + 2, value >> 16);
+}
+
+uint32_t msc_disk_open(void)
+{
+	uint32_t records = 0;
+	for (uint32_t page = flash_log_first(); page != FLASH_LOG_NONE; page = flash_log_next(page))
+		records++;
+
+	uint32_t skip = records > MSC_FAT_FILES ? records - MSC_FAT_FILES : 0;
+	uint32_t cluster = 2;
+	msc_file_count = 0;
+	for (uint32_t page = flash_log_first(); page != FLASH_LOG_NONE; page = flash_log_next(page))
+	{
+		if (skip)
+		{
+			skip--;
+			continue;
+		}
+
+		const flash_log_header_t *header = flash_log_header(page);
+		msc_file_t *file = &msc_files[msc_file_count++];
+		file->page = page;
+		file->serial = header->serial;
+		file->bytes = header->bytes;
+		file->first_cluster = cluster;
+		file->clusters = (header->bytes + MSC_FAT_CLUSTER_BYTES - 1) / MSC_FAT_CLUSTER_BYTES;
+		cluster += file->clusters;
+	}
+
+	// FAT12 entries are a byte and a half, and clusters 0 and 1 are reserved
+	msc_clusters = Max(cluster - 2, MSC_FAT_MIN_CLUSTERS);
+	msc_fat_sectors = (((msc_clusters + 2) * 3 + 1) / 2 + UDI_MSC_SECTOR_BYTES - 1) / UDI_MSC_SECTOR_BYTES;
+	msc_root_start = 1 + 2 * msc_fat_sectors;
+	msc_data_start = msc_root_start + MSC_FAT_ROOT_SECTORS;
+	msc_total_sectors = msc_data_start + msc_clusters * MSC_FAT_CLUSTER_SECTORS;
+	// A new volume id whenever the log has grown, so hosts do not cache
+	msc_volume_id = flash_log_serial() ^ flash_log_lap() << 24;
+	return msc_total_sectors;
+}
+
+static void msc_boot_sector(uint8_t *data)
+{
+	static const uint8_t jump[] = { 0xEB, 0x3C, 0x90, 'M', 'S', 'D', 'O', 'S', '5', '.', '0' };
+	memcpy(data, jump, sizeof(jump));
+	msc_put16(&data[11], UDI_MSC_SECTOR_BYTES);
+	data[13] = MSC_FAT_CLUSTER_SECTORS;
+	msc_put16(&data[14], 1);                        // Reserved sectors
+	data[16] = 2;                                   // FATs
+	msc_put16(&data[17], MSC_FAT_ROOT_ENTRIES);
+	if (msc_total_sectors < 0x10000)
+		msc_put16(&data[19], msc_total_sectors);
+	else
+		msc_put32(&data[32], msc_total_sectors);
+	data[21] = 0xF8;                                // Fixed disk
+	msc_put16(&data[22], msc_fat_sectors);
+	msc_put16(&data[24], 32);                       // Sectors per track
+	msc_put16(&data[26], 64);                       // Heads
+	data[36] = 0x80;
+	data[38] = 0x29;                                // Extended boot signature
+	msc_put32(&data[39], msc_volume_id);
+	memcpy(&data[43], "DOSIMETER  FAT12   ", 19);
+	data[510] = 0x55;
+	data[511] = 0xAA;
+}
+
+// One sector of a FAT: each file is a single chain of clusters
+static void msc_fat_sector(uint32_t sector, uint8_t *data)
+{
+	int32_t base = sector * UDI_MSC_SECTOR_BYTES;
+	uint32_t first = base * 2 / 3, last = Min((uint32_t)(base + UDI_MSC_SECTOR_BYTES) * 2 / 3, msc_clusters + 1);
+	uint32_t f = 0;
+	for (uint32_t cluster = first; cluster <= last; cluster++)
+	{
+		uint16_t value = 0;
+		if (cluster < 2)
+			value = cluster ? 0xFFF : 0xFF8;
+		else
+		{
+			while (f < msc_file_count && msc_files[f].first_cluster + msc_files[f].clusters <= cluster)
+				f++;
+			if (f < msc_file_count && cluster >= msc_files[f].first_cluster)
+				value = cluster + 1 == msc_files[f].first_cluster + msc_files[f].clusters ? 0xFFF : cluster + 1;
+		}
+
+		// The entry's two bytes, of which the half byte shared with its
+		// neighbour is the high half of the first or the low half of the second
+		int32_t at = cluster * 3 / 2 - base;
+		uint16_t bytes = cluster & 1 ? value << 4 : value;
+		uint16_t mask = cluster & 1 ? 0xFFF0 : 0x0FFF;
+		if (at >= 0 && at < UDI_MSC_SECTOR_BYTES)
+			data[at] = (data[at] & ~mask) | (bytes & mask);
+		if (at + 1 >= 0 && at + 1 < UDI_MSC_SECTOR_BYTES)
+			data[at + 1] = (data[at + 1] & ~(mask >> 8)) | ((bytes & mask) >> 8);
+	}
+}
+
+static void msc_root_sector(uint32_t sector, uint8_t *data)
+{
+	for (uint32_t i = 0; i < UDI_MSC_SECTOR_BYTES / 32; i++)
+	{
+		uint8_t *entry = &data[i * 32];
+		uint32_t index = sector * (UDI_MSC_SECTOR_BYTES / 32) + i;
+		if (index == 0)
+		{
+			memcpy(entry, "DOSIMETER  ", 11);
+			entry[11] = 0x08;                           // Volume label
+		}
+		else if (index <= msc_file_count)
+		{
+			const msc_file_t *file = &msc_files[index - 1];
+			uint32_t serial = file->serial % 10000000;
+			entry[0] = 'R';
+			for (int32_t digit = 7; digit > 0; digit--, serial /= 10)
+				entry[digit] = '0' + serial % 10;
+			memcpy(&entry[8], "BIN", 3);
+			entry[11] = 0x01;                           // Read only
+			msc_put16(&entry[16], MSC_FAT_DATE);
+			msc_put16(&entry[18], MSC_FAT_DATE);
+			msc_put16(&entry[24], MSC_FAT_DATE);
+			msc_put16(&entry[26], file->bytes ? file->first_cluster : 0);
+			msc_put32(&entry[28], file->bytes);
+		}
+		else
+			break;
+	}
+}
+
+static void msc_data_sector(uint32_t sector, uint8_t *data)
+{
+	uint32_t cluster = sector / MSC_FAT_CLUSTER_SECTORS + 2;
+	for (uint32_t f = 0; f < msc_file_count; f++)
+	{
+		const msc_file_t *file = &msc_files[f];
+		if (cluster < file->first_cluster || cluster >= file->first_cluster + file->clusters)
+			continue;
+
+		// Zeros if the ring has since reached the record
+		const flash_log_header_t *header = flash_log_header(file->page);
+		if (header->magic != FLASH_LOG_MAGIC || header->serial != file->serial)
+			return;
+
+		uint32_t offset = (sector - (file->first_cluster - 2) * MSC_FAT_CLUSTER_SECTORS) * UDI_MSC_SECTOR_BYTES;
+		if (offset >= file->bytes)
+			return;
+		uint32_t bytes = Min(file->bytes - offset, UDI_MSC_SECTOR_BYTES);
+		memcpy(data, (const uint8_t *)flash_log_payload(file->page) + offset, bytes);
+		return;
+	}
+}
+
+void msc_disk_read(uint32_t sector, uint8_t *data)
+{
+	memset(data, 0, UDI_MSC_SECTOR_BYTES);
+	if (sector == 0)
+		msc_boot_sector(data);
+	else if (sector < msc_root_start)
+		msc_fat_sector((sector - 1) % msc_fat_sectors, data);
+	else if (sector < msc_data_start)
+		msc_root_sector(sector - msc_root_start, data);
+	else
+		msc_data_sector(sector - msc_data_start, data);
+}
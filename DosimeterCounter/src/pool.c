@@ -0,0 +1,54 @@
+#include <string.h>
+#include "pool.h"
+
+void pool_init(pool_t *pool, void *start, void *end)
+{
+	uintptr_t first = ((uintptr_t)start + POOL_ALIGN - 1) & ~(uintptr_t)(POOL_ALIGN - 1);
+	uintptr_t last = (uintptr_t)end & ~(uintptr_t)(POOL_ALIGN - 1);
+	pool->base = (uint8_t *)first;
+	pool->size = last > first ? last - first : 0;
+	pool->used = 0;
+	pool->peak = 0;
+	pool->count = 0;
+}
+
+void *pool_reserve(pool_t *pool, const char *name, uint32_t bytes)
+{
+	bytes = (bytes + POOL_ALIGN - 1) & ~(uint32_t)(POOL_ALIGN - 1);
+
+	pool_reservation_t *reservation = NULL;
+	for (uint8_t i = 0; i < pool->count; i++)
+		if (strcmp(pool->reservations[i].name, name) == 0)
+			reservation = &pool->reservations[i];
+
+	if (reservation && reservation != &pool->reservations[pool->count - 1])
+		return bytes <= reservation->bytes ? pool->base + reservation->offset : NULL;
+
+	// The last reservation grows or shrinks in place
+	if (reservation)
+	{
+		if (bytes > pool->size - reservation->offset)
+			return NULL;
+	}
+	else
+	{
+		if (pool->count == POOL_RESERVATIONS_MAX || bytes > pool_free(pool))
+			return NULL;
+
+		reservation = &pool->reservations[pool->count++];
+		reservation->name = name;
+		reservation->offset = pool->used;
+	}
+
+	reservation->bytes = bytes;
+	pool->used = reservation->offset + bytes;
+	if (pool->used > pool->peak)
+		pool->peak = pool->used;
+	return pool->base + reservation->offset;
+}
+
+void pool_reset(pool_t *pool)
+{
+	pool->used = 0;
+	pool->count = 0;
+}
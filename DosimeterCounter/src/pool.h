@@ -0,0 +1,48 @@
+#ifndef POOL_H_INCLUDED
+#define POOL_H_INCLUDED
+
+// Linear allocator for the buffers that only some modes need, so they
+// take SRAM when the mode is configured rather than in every build.
+// Each reservation is named and follows the one before it; a name that
+// is already reserved gets its buffer back if it is big enough, and the
+// last one can also be resized.  Everything is given back at once by
+// pool_reset, so the owners must have stopped using their buffers.
+// Like ring.c it has no hardware dependencies.
+#include <stdbool.h>
+#include <stdint.h>
+
+#define POOL_RESERVATIONS_MAX 8
+#define POOL_ALIGN 8
+
+typedef struct
+{
+	const char *name;
+	uint32_t offset;  // From the start of the pool
+	uint32_t bytes;
+} pool_reservation_t;
+
+typedef struct
+{
+	uint8_t *base;
+	uint32_t size;
+	uint32_t used;
+	uint32_t peak;    // Most bytes reserved at once
+	uint8_t count;
+	pool_reservation_t reservations[POOL_RESERVATIONS_MAX];
+} pool_t;
+
+// Set up an empty pool over start to end, trimmed to POOL_ALIGN
+void pool_init(pool_t *pool, void *start, void *end);
+
+// POOL_ALIGN aligned space of at least bytes under name, or NULL if it
+// does not fit.  name must stay valid, a string literal in practice.
+void *pool_reserve(pool_t *pool, const char *name, uint32_t bytes);
+
+void pool_reset(pool_t *pool);
+
+static inline uint32_t pool_free(const pool_t *pool)
+{
+	return pool->size - pool->used;
+}
+
+#endif /* POOL_H_INCLUDED */
@@ -0,0 +1,81 @@
+#include <asf.h>
+#include <string.h>
+#include "profile.h"
+#include "reply.h"
+
+volatile profile_stats_t profile_duration;
+volatile profile_stats_t profile_interval;
+volatile profile_stats_t profile_latency;
+volatile uint32_t profile_fp_saves;
+
+void profile_init(void)
+{
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+	profile_reset();
+}
+
+void profile_reset(void)
+{
+	irqflags_t flags = cpu_irq_save();
+	memset((uint8_t *)&profile_duration, 0, sizeof(profile_duration));
+	memset((uint8_t *)&profile_interval, 0, sizeof(profile_interval));
+	memset((uint8_t *)&profile_latency, 0, sizeof(profile_latency));
+	profile_duration.min = UINT32_MAX;
+	profile_interval.min = UINT32_MAX;
+	profile_latency.min = UINT32_MAX;
+	profile_fp_saves = 0;
+	cpu_irq_restore(flags);
+}
+
+static void print_stats(const char *name, const profile_stats_t *stats)
+{
+	uint32_t mean = stats->count ? (uint32_t)(stats->total / stats->count) : 0;
+	uint32_t min = stats->count ? stats->min : 0;
+
+	reply_str(name);
+	reply_str(" count ");
+	reply_u32(stats->count);
+	reply_str(" min ");
+	reply_u32(min);
+	reply_str(" max ");
+	reply_u32(stats->max);
+	reply_str(" mean ");
+	reply_u32(mean);
+	reply_char('\n');
+
+	reply_str(name);
+	reply_str(" histogram");
+	for (uint32_t i = 0; i < PROFILE_HISTOGRAM_BINS; i++)
+	{
+		reply_char(' ');
+		reply_u32(stats->histogram[i]);
+	}
+	reply_char('\n');
+}
+
+// Prints and clears the statistics, all figures in CPU cycles
+void profile_report(void)
+{
+	profile_stats_t duration, interval, latency;
+
+	// Take a consistent snapshot so that the slow USB output
+	// does not hold off the step interrupt
+	irqflags_t flags = cpu_irq_save();
+	memcpy(&duration, (const uint8_t *)&profile_duration, sizeof(duration));
+	memcpy(&interval, (const uint8_t *)&profile_interval, sizeof(interval));
+	memcpy(&latency, (const uint8_t *)&profile_latency, sizeof(latency));
+	uint32_t fp_saves = profile_fp_saves;
+	cpu_irq_restore(flags);
+	profile_reset();
+
+	print_stats("duration", &duration);
+	print_stats("interval", &interval);
+	print_stats("latency", &latency);
+
+	reply_str("fp saves ");
+	reply_u32(fp_saves);
+	reply_char('\n');
+}
@@ -0,0 +1,54 @@
+#ifndef PROFILE_H_INCLUDED
+#define PROFILE_H_INCLUDED
+
+#include <compiler.h>
+
+// Cycle profiling of the step interrupt using the DWT cycle counter.
+// Set to 0 to compile the instrumentation out of the step path.
+#define PROFILE_ENABLE 1
+
+// Histogram bin n counts samples of 2^n to 2^(n+1)-1 cycles;
+// the last bin collects everything longer.
+#define PROFILE_HISTOGRAM_BINS 16
+
+typedef struct {
+	uint32_t count;
+	uint32_t min;
+	uint32_t max;
+	uint64_t total;
+	uint32_t histogram[PROFILE_HISTOGRAM_BINS];
+} profile_stats_t;
+
+// Time spent servicing each step
+extern volatile profile_stats_t profile_duration;
+// Cycles between the starts of consecutive steps
+extern volatile profile_stats_t profile_interval;
+// Cycles from a generated step edge (M1043 output 0) to the step interrupt
+extern volatile profile_stats_t profile_latency;
+// Steps whose handler saved the interrupted code's FP registers, which
+// it only does if it runs an FP instruction (lazy stacking, see main.c)
+extern volatile uint32_t profile_fp_saves;
+
+void profile_init(void);
+void profile_reset(void);
+void profile_report(void);
+
+static __always_inline uint32_t profile_cycles(void)
+{
+	return DWT->CYCCNT;
+}
+
+static __always_inline void profile_record(volatile profile_stats_t *stats, uint32_t cycles)
+{
+	if (cycles < stats->min)
+		stats->min = cycles;
+	if (cycles > stats->max)
+		stats->max = cycles;
+	stats->total += cycles;
+	stats->count++;
+
+	uint32_t bin = cycles ? 31 - __CLZ(cycles) : 0;
+	stats->histogram[Min(bin, PROFILE_HISTOGRAM_BINS - 1)]++;
+}
+
+#endif /* PROFILE_H_INCLUDED */
@@ -0,0 +1,310 @@
+#include <asf.h>
+#include <string.h>
+#include "reply.h"
+#include "eth.h"
+
+#define REPLY_RING_MASK (REPLY_RING_BYTES - 1)
+
+static char reply_ring[REPLY_RING_BYTES];
+// Free-running indices, only the low bits address the ring
+static uint32_t reply_head;
+static uint32_t reply_tail;
+// Most bytes queued at once
+static uint32_t reply_peak;
+// Set while part of the ring is being handed to the sink
+static volatile bool reply_sending;
+
+// Length of the unsent data that is contiguous in the ring
+static uint32_t reply_span(void)
+{
+	uint32_t start = reply_tail & REPLY_RING_MASK;
+	return Min(reply_head - reply_tail, REPLY_RING_BYTES - start);
+}
+
+uint32_t reply_space(void)
+{
+	return REPLY_RING_BYTES - (reply_head - reply_tail);
+}
+
+uint32_t reply_high_water(bool clear)
+{
+	uint32_t peak = reply_peak;
+	if (clear)
+		reply_peak = reply_head - reply_tail;
+	return peak;
+}
+
+#if ETH_ENABLE
+// The ring goes to the Ethernet peer rather than the CDC port
+static bool reply_eth = false;
+#endif
+
+static uint32_t sink_space(void)
+{
+#if ETH_ENABLE
+	if (reply_eth)
+		return eth_stream_space();
+#endif
+	return udi_cdc_get_free_tx_buffer();
+}
+
+static bool sink_write(const void *data, uint32_t length)
+{
+#if ETH_ENABLE
+	if (reply_eth)
+		return eth_stream_write(data, length);
+#endif
+	return udi_cdc_multi_write_buf_timeout(0, data, length, UDI_CDC_TX_TIMEOUT_MS) == 0;
+}
+
+void reply_flush(void)
+{
+	while (reply_head != reply_tail)
+	{
+		uint32_t length = Min(reply_span(), sink_space());
+		if (length == 0)
+			return;
+
+		reply_sending = true;
+		sink_write(&reply_ring[reply_tail & REPLY_RING_MASK], length);
+		reply_tail += length;
+		reply_sending = false;
+	}
+}
+
+static void ring_drain(void)
+{
+	while (reply_head != reply_tail)
+	{
+		uint32_t length = reply_span();
+
+		// The port went away or the host stopped reading, there is
+		// nobody left to read the reply
+		reply_sending = true;
+		bool sent = sink_write(&reply_ring[reply_tail & REPLY_RING_MASK], length);
+		reply_tail = sent ? reply_tail + length : reply_head;
+		reply_sending = false;
+		if (!sent)
+			return;
+	}
+}
+
+bool reply_at_line_end(void)
+{
+	if (reply_sending)
+		return false;
+
+#if ETH_ENABLE
+	if (reply_eth)
+		return true;
+#endif
+	return reply_tail == 0 || reply_ring[(reply_tail - 1) & REPLY_RING_MASK] == '\n';
+}
+
+// Frame being assembled while a binary protocol command runs
+static bool frame_open = false;
+static frame_header_t frame_header;
+static uint8_t frame_payload[REPLY_FRAME_BYTES];
+
+static void ring_make_room(void)
+{
+	// Only replies longer than the ring (e.g. M1005) end up waiting here
+	if (reply_head - reply_tail == REPLY_RING_BYTES)
+	{
+		reply_flush();
+		if (reply_head - reply_tail == REPLY_RING_BYTES)
+			ring_drain();
+	}
+}
+
+static void ring_put(uint8_t value)
+{
+	ring_make_room();
+	reply_ring[reply_head++ & REPLY_RING_MASK] = value;
+	if (reply_head - reply_tail > reply_peak)
+		reply_peak = reply_head - reply_tail;
+}
+
+// Copies in runs up to the wrap point or the free space, whichever is first
+static void ring_write(const void *data, uint32_t length)
+{
+	const uint8_t *ptr = data;
+	while (length)
+	{
+		ring_make_room();
+		uint32_t start = reply_head & REPLY_RING_MASK;
+		uint32_t run = Min(Min(length, reply_space()), REPLY_RING_BYTES - start);
+		memcpy(&reply_ring[start], ptr, run);
+		reply_head += run;
+		ptr += run;
+		length -= run;
+	}
+
+	if (reply_head - reply_tail > reply_peak)
+		reply_peak = reply_head - reply_tail;
+}
+
+static void frame_send(uint8_t flags)
+{
+	frame_header.flags = flags;
+	uint16_t crc = crc16_update(0xFFFF, (const uint8_t *)&frame_header, sizeof(frame_header));
+	crc = crc16_update(crc, frame_payload, frame_header.length);
+
+	ring_write(&frame_header, sizeof(frame_header));
+	ring_write(frame_payload, frame_header.length);
+	ring_write(&crc, sizeof(crc));
+	frame_header.length = 0;
+}
+
+void reply_drain(void)
+{
+	// Binary data follows the frame holding the reply text so far
+	if (frame_open && frame_header.length)
+		frame_send(FRAME_FLAG_MORE);
+
+	ring_drain();
+}
+
+#if ETH_ENABLE
+void reply_to_eth(bool eth)
+{
+	if (eth == reply_eth)
+		return;
+
+	// What is queued belongs to the host of the previous command
+	reply_drain();
+	reply_eth = eth;
+}
+#endif
+
+void reply_frame_begin(uint8_t opcode, uint8_t sequence)
+{
+	frame_header.sync = FRAME_SYNC_REPLY;
+	frame_header.opcode = opcode;
+	frame_header.sequence = sequence;
+	frame_header.length = 0;
+	frame_open = true;
+}
+
+void reply_frame_end(uint8_t flags)
+{
+	frame_open = false;
+	frame_send(flags);
+}
+
+void reply_char(char c)
+{
+	if (!frame_open)
+	{
+		ring_put(c);
+		return;
+	}
+
+	if (frame_header.length == REPLY_FRAME_BYTES)
+		frame_send(FRAME_FLAG_MORE);
+	frame_payload[frame_header.length++] = c;
+}
+
+void reply_write(const char *text, uint32_t length)
+{
+	if (!frame_open)
+	{
+		ring_write(text, length);
+		return;
+	}
+
+	while (length)
+	{
+		if (frame_header.length == REPLY_FRAME_BYTES)
+			frame_send(FRAME_FLAG_MORE);
+		uint32_t run = Min(length, (uint32_t)(REPLY_FRAME_BYTES - frame_header.length));
+		memcpy(&frame_payload[frame_header.length], text, run);
+		frame_header.length += run;
+		text += run;
+		length -= run;
+	}
+}
+
+void reply_str(const char *s)
+{
+	reply_write(s, strlen(s));
+}
+
+// Two digits per divide, looked up rather than worked out a digit at a time
+static const char digit_pairs[200] =
+	"00010203040506070809101112131415161718192021222324"
+	"25262728293031323334353637383940414243444546474849"
+	"50515253545556575859606162636465666768697071727374"
+	"75767778798081828384858687888990919293949596979899";
+
+uint8_t reply_format_u32(char *text, uint32_t value)
+{
+	char digits[REPLY_U32_DIGITS];
+	char *ptr = digits + sizeof(digits);
+
+	while (value >= 100)
+	{
+		const char *pair = &digit_pairs[value % 100 * 2];
+		value /= 100;
+		*--ptr = pair[1];
+		*--ptr = pair[0];
+	}
+
+	if (value >= 10)
+	{
+		*--ptr = digit_pairs[value * 2 + 1];
+		*--ptr = digit_pairs[value * 2];
+	}
+	else
+		*--ptr = '0' + value;
+
+	uint8_t length = digits + sizeof(digits) - ptr;
+	memcpy(text, ptr, length);
+	return length;
+}
+
+void reply_u32(uint32_t value)
+{
+	char text[REPLY_U32_DIGITS];
+	reply_write(text, reply_format_u32(text, value));
+}
+
+void reply_i32(int32_t value)
+{
+	if (value < 0)
+	{
+		reply_char('-');
+		reply_u32(-(uint32_t)value);
+	}
+	else
+		reply_u32(value);
+}
+
+// As reply_u64, splitting off nine digits at a time
+uint8_t reply_format_u64(char *text, uint64_t value)
+{
+	if (value <= UINT32_MAX)
+		return reply_format_u32(text, value);
+
+	uint8_t length = reply_format_u64(text, value / 1000000000);
+	uint32_t low = value % 1000000000;
+	for (uint32_t scale = 100000000; scale; scale /= 10)
+		text[length++] = '0' + low / scale % 10;
+	return length;
+}
+
+void reply_u64(uint64_t value)
+{
+	// Split so that only the rare large value needs a 64-bit divide
+	if (value <= UINT32_MAX)
+	{
+		reply_u32(value);
+		return;
+	}
+
+	reply_u64(value / 1000000000);
+
+	uint32_t low = value % 1000000000;
+	for (uint32_t scale = 100000000; scale; scale /= 10)
+		reply_char('0' + low / scale % 10);
+}
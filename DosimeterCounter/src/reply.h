@@ -0,0 +1,56 @@
+#ifndef REPLY_H_INCLUDED
+#define REPLY_H_INCLUDED
+
+#include <compiler.h>
+#include "command.h"
+
+// Command replies are formatted into a RAM ring and sent to the CDC port
+// (or the Ethernet peer) by reply_flush() from the main loop, so a reply
+// never waits for the host.
+// Must be a power of two.
+#define REPLY_RING_BYTES 1024
+
+void reply_char(char c);
+void reply_str(const char *s);
+// Copies a run of text at once, rather than a character at a time
+void reply_write(const char *text, uint32_t length);
+void reply_u32(uint32_t value);
+void reply_i32(int32_t value);
+void reply_u64(uint64_t value);
+
+// Most characters a uint32_t takes in decimal
+#define REPLY_U32_DIGITS 10
+
+// Writes value in decimal to text, without a terminator, and returns
+// the number of characters; for building up a run for reply_write()
+uint8_t reply_format_u32(char *text, uint32_t value);
+
+// Most characters a uint64_t takes in decimal
+#define REPLY_U64_DIGITS 20
+
+uint8_t reply_format_u64(char *text, uint64_t value);
+
+// Bytes that can be added before the ring is full
+uint32_t reply_space(void);
+// Most bytes queued in the ring at once, optionally restarting the count
+uint32_t reply_high_water(bool clear);
+// Moves as much of the ring to the CDC TX buffers as fits without blocking
+void reply_flush(void);
+// Sends the whole ring, blocking; used before binary data so it stays in order
+void reply_drain(void);
+// Whether the text sent so far ends a line and no write is under way,
+// so that a line from an interrupt would not land inside another
+bool reply_at_line_end(void);
+
+// Send replies to the Ethernet peer (true) or the CDC port, draining what
+// is already queued to the old one first
+void reply_to_eth(bool eth);
+
+// Longest reply payload per frame, longer replies continue in the next frame
+#define REPLY_FRAME_BYTES 240
+
+// Reply text between these calls is sent as reply frames for the command
+void reply_frame_begin(uint8_t opcode, uint8_t sequence);
+void reply_frame_end(uint8_t flags);
+
+#endif /* REPLY_H_INCLUDED */
@@ -0,0 +1,73 @@
+#include "rice.h"
+
+// Append the low n bits of value, n at most 32
+static bool rice_put(rice_block_t *block, uint32_t value, uint8_t n, uint16_t *crc)
+{
+	block->bits |= (uint64_t)value << block->pending;
+	block->pending += n;
+	while (block->pending >= 8)
+	{
+		block->bytes[block->length++] = (uint8_t)block->bits;
+		block->bits >>= 8;
+		block->pending -= 8;
+		block->total++;
+		if (block->length == sizeof(block->bytes))
+		{
+			block->length = 0;
+			if (!block->emit(block->bytes, sizeof(block->bytes), crc))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+void rice_begin(rice_block_t *block, uint8_t width, rice_emit_t emit)
+{
+	block->length = 0;
+	block->total = 0;
+	block->bits = 0;
+	block->pending = 0;
+	block->width = width;
+	block->sum = 4;
+	block->count = 1;
+	block->emit = emit;
+}
+
+// Least k with count << k >= sum, from the difference of their logs
+// and one compare instead of a loop
+static inline uint32_t rice_parameter(uint32_t sum, uint32_t count)
+{
+	int32_t k = __builtin_clz(count) - __builtin_clz(sum | 1);
+	if (k < 0)
+		return 0;
+	return k + ((count << k) < sum);
+}
+
+bool rice_residual(rice_block_t *block, int32_t residual, uint16_t *crc)
+{
+	uint32_t m = ((uint32_t)residual << 1) ^ (uint32_t)(residual >> 31);
+	uint32_t k = rice_parameter(block->sum, block->count);
+	uint32_t q = m >> k;
+	bool sent;
+	if (q < RICE_LIMIT)
+		sent = rice_put(block, 1u << q, q + 1, crc) && rice_put(block, m & ((1u << k) - 1), k, crc);
+	else
+		sent = rice_put(block, 1u << RICE_LIMIT, RICE_LIMIT + 1, crc) && rice_put(block, m, block->width, crc);
+
+	block->sum += m < RICE_SUM_CAP ? m : RICE_SUM_CAP;
+	if (++block->count == RICE_RESET)
+	{
+		block->sum >>= 1;
+		block->count >>= 1;
+	}
+	return sent;
+}
+
+bool rice_finish(rice_block_t *block, uint16_t *crc)
+{
+	if (block->pending && !rice_put(block, 0, 8 - block->pending, crc))
+		return false;
+
+	return block->length == 0 || block->emit(block->bytes, block->length, crc);
+}
@@ -0,0 +1,49 @@
+#ifndef RICE_H_INCLUDED
+#define RICE_H_INCLUDED
+
+// Adaptive Rice coder for the predictive readout (M1101).
+// Each residual r is zigzag mapped to m and written with the parameter
+// k as m >> k zero bits, a one bit, then the low k bits of m.  A
+// quotient of RICE_LIMIT or more is written as RICE_LIMIT zero bits, a
+// one bit and m in full, width bits.  Bits fill each byte from its least
+// significant end, and the last byte is padded with zero bits.
+// k is the least k with count << k >= sum, sum and count being the
+// running total of the m so far, each at most RICE_SUM_CAP, and
+// their number.  Both start at 4 and 1 and are halved whenever count
+// reaches RICE_RESET, as in JPEG-LS, so k follows the local noise.
+// Like rle.c it has no hardware dependencies.
+#include <stdbool.h>
+#include <stdint.h>
+
+// One full-speed bulk packet
+#define RICE_BLOCK_BYTES 64
+#define RICE_LIMIT 24
+#define RICE_RESET 64
+#define RICE_SUM_CAP (1u << 24)
+
+// Receives each full staging buffer; crc is passed through unchanged
+typedef bool (*rice_emit_t)(const volatile void *data, uint32_t length, uint16_t *crc);
+
+// Staging buffer and coder state
+typedef struct
+{
+	uint8_t bytes[RICE_BLOCK_BYTES];
+	uint32_t length;
+	uint32_t total;    // Bytes produced so far
+	uint64_t bits;     // Bits not yet in bytes[], the oldest lowest
+	uint8_t pending;   // and how many
+	uint8_t width;     // Bits of an escaped value
+	uint32_t sum;
+	uint32_t count;
+	rice_emit_t emit;
+} rice_block_t;
+
+void rice_begin(rice_block_t *block, uint8_t width, rice_emit_t emit);
+
+// Encode a residual, already wrapped to width bits and sign extended
+bool rice_residual(rice_block_t *block, int32_t residual, uint16_t *crc);
+
+// Pad the last byte and emit what is left in the staging buffer
+bool rice_finish(rice_block_t *block, uint16_t *crc);
+
+#endif /* RICE_H_INCLUDED */
@@ -0,0 +1,36 @@
+#include <string.h>
+#include "ring.h"
+
+uint32_t ring_push(ring_t *ring, void *slots, uint32_t size, uint32_t item_bytes, const void *items, uint32_t count)
+{
+	uint32_t head = ring->head;
+	uint32_t space = size - (head - ring_tail(ring));
+	if (count > space)
+		count = space;
+	if (size - space + count > ring->peak)
+		ring->peak = size - space + count;
+
+	uint32_t first = head & (size - 1);
+	uint32_t run = count < size - first ? count : size - first;
+	memcpy((uint8_t *)slots + first * item_bytes, items, run * item_bytes);
+	memcpy(slots, (const uint8_t *)items + run * item_bytes, (count - run) * item_bytes);
+
+	ring_commit(ring, count);
+	return count;
+}
+
+uint32_t ring_pop(ring_t *ring, const void *slots, uint32_t size, uint32_t item_bytes, void *items, uint32_t count)
+{
+	uint32_t tail = ring->tail;
+	uint32_t available = ring_head(ring) - tail;
+	if (count > available)
+		count = available;
+
+	uint32_t first = tail & (size - 1);
+	uint32_t run = count < size - first ? count : size - first;
+	memcpy(items, (const uint8_t *)slots + first * item_bytes, run * item_bytes);
+	memcpy((uint8_t *)items + run * item_bytes, slots, (count - run) * item_bytes);
+
+	ring_release(ring, count);
+	return count;
+}
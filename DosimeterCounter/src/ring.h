@@ -0,0 +1,76 @@
+#ifndef RING_H_INCLUDED
+#define RING_H_INCLUDED
+
+// Indices of a single-producer single-consumer ring, for handing records
+// from an interrupt to the main loop or back without masking either.
+// The slots are an array the user keeps, of a power-of-two size passed
+// to each call.  head and tail run freely, so head - tail is the fill
+// level, and each side writes only its own index.  Word stores are
+// atomic on the Cortex-M4, so no exclusive access is needed; the index
+// stores are releases and the loads of the other side's index acquires,
+// which keeps slot accesses from moving past them.
+// Like command.c it has no hardware dependencies.
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct
+{
+	volatile uint32_t head; // Written by the producer only
+	volatile uint32_t tail; // Written by the consumer only
+	uint32_t peak;          // Most slots filled at once, kept by the producer
+} ring_t;
+
+static inline uint32_t ring_head(const ring_t *ring)
+{
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+}
+
+static inline uint32_t ring_tail(const ring_t *ring)
+{
+	return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+// Slots filled and not yet taken
+static inline uint32_t ring_count(const ring_t *ring)
+{
+	return ring_head(ring) - ring_tail(ring);
+}
+
+// Producer: find the next free slot, false if the ring is full.  The
+// slot is filled in place and handed over with ring_commit.
+static inline bool ring_reserve(ring_t *ring, uint32_t size, uint32_t *slot)
+{
+	uint32_t head = ring->head;
+	uint32_t used = head - ring_tail(ring);
+	if (used >= size)
+		return false;
+
+	if (used >= ring->peak)
+		ring->peak = used + 1;
+	*slot = head & (size - 1);
+	return true;
+}
+
+static inline void ring_commit(ring_t *ring, uint32_t count)
+{
+	__atomic_store_n(&ring->head, ring->head + count, __ATOMIC_RELEASE);
+}
+
+// Consumer: give back count slots once they have been read
+static inline void ring_release(ring_t *ring, uint32_t count)
+{
+	__atomic_store_n(&ring->tail, ring->tail + count, __ATOMIC_RELEASE);
+}
+
+// Consumer: drop everything queued
+static inline void ring_flush(ring_t *ring)
+{
+	__atomic_store_n(&ring->tail, ring_head(ring), __ATOMIC_RELEASE);
+}
+
+// Copy up to count items of item_bytes into or out of the slots, in at
+// most two runs around the wrap, and return how many were moved
+uint32_t ring_push(ring_t *ring, void *slots, uint32_t size, uint32_t item_bytes, const void *items, uint32_t count);
+uint32_t ring_pop(ring_t *ring, const void *slots, uint32_t size, uint32_t item_bytes, void *items, uint32_t count);
+
+#endif /* RING_H_INCLUDED */
@@ -0,0 +1,57 @@
+#include "rle.h"
+
+// Append one LEB128 varint token
+static bool rle_put(rle_block_t *block, uint64_t token, uint16_t *crc)
+{
+	do
+	{
+		uint8_t byte = token & 0x7F;
+		token >>= 7;
+		if (token)
+			byte |= 0x80;
+
+		block->bytes[block->length++] = byte;
+		block->total++;
+		if (block->length == sizeof(block->bytes))
+		{
+			block->length = 0;
+			if (!block->emit(block->bytes, sizeof(block->bytes), crc))
+				return false;
+		}
+	} while (token);
+
+	return true;
+}
+
+void rle_begin(rle_block_t *block, rle_emit_t emit)
+{
+	block->length = 0;
+	block->total = 0;
+	block->previous = 0;
+	block->run = 0;
+	block->emit = emit;
+}
+
+bool rle_change(rle_block_t *block, uint32_t value, uint16_t *crc)
+{
+	if (block->run && !rle_put(block, ((uint64_t)block->run << 1) | 1, crc))
+		return false;
+	block->run = 0;
+
+	int64_t delta = (int64_t)value - block->previous;
+	uint64_t zigzag = delta < 0 ? ((uint64_t)-delta << 1) - 1 : (uint64_t)delta << 1;
+	if (!rle_put(block, zigzag << 1, crc))
+		return false;
+
+	block->previous = value;
+	return true;
+}
+
+bool rle_finish(rle_block_t *block, uint16_t *crc)
+{
+	if (block->run && !rle_put(block, ((uint64_t)block->run << 1) | 1, crc))
+		return false;
+	block->run = 0;
+
+	return block->length == 0 || block->emit(block->bytes, block->length, crc);
+}
@@ -0,0 +1,51 @@
+#ifndef RLE_H_INCLUDED
+#define RLE_H_INCLUDED
+
+// Run-length/delta encoder for the compressed readout (M1026).
+// The output is a sequence of LEB128 varint tokens relative to the
+// previous value, which starts at 0:
+//   (n << 1) | 1      the previous value repeats n times
+//   zigzag(d) << 1    the next value is the previous value plus d
+// Like command.c it has no hardware dependencies.
+#include <stdbool.h>
+#include <stdint.h>
+
+// One full-speed bulk packet
+#define RLE_BLOCK_BYTES 64
+
+// Receives each full staging buffer; crc is passed through unchanged
+typedef bool (*rle_emit_t)(const volatile void *data, uint32_t length, uint16_t *crc);
+
+// Staging buffer and encoder state
+typedef struct
+{
+	uint8_t bytes[RLE_BLOCK_BYTES];
+	uint32_t length;
+	uint32_t total;     // Bytes produced so far
+	uint32_t previous;  // Last value encoded
+	uint32_t run;       // Repeats of previous not yet encoded
+	rle_emit_t emit;
+} rle_block_t;
+
+void rle_begin(rle_block_t *block, rle_emit_t emit);
+
+// Encode a value that differs from block->previous
+bool rle_change(rle_block_t *block, uint32_t value, uint16_t *crc);
+
+// Encode any pending run and emit what is left in the staging buffer
+bool rle_finish(rle_block_t *block, uint16_t *crc);
+
+// Encode the next value.  Runs only bump a counter, so empty and flat
+// regions cost no call.
+static inline bool rle_value(rle_block_t *block, uint32_t value, uint16_t *crc)
+{
+	if (value == block->previous)
+	{
+		block->run++;
+		return true;
+	}
+
+	return rle_change(block, value, crc);
+}
+
+#endif /* RLE_H_INCLUDED */
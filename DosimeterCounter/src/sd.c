@@ -0,0 +1,261 @@
+#include <asf.h>
+#include "sd.h"
+
+#define SD_PIO PIOA
+#define SD_PINS (PIO_PA26C_MCDA2 | PIO_PA27C_MCDA3 | PIO_PA28C_MCCDA \
+	| PIO_PA30C_MCDA0 | PIO_PA31C_MCDA1)
+#define SD_CLOCK_PIN PIO_PA29C_MCCK
+
+#define SD_INIT_HZ 400000
+#define SD_TRANSFER_HZ 25000000
+
+// ACMD41 attempts while the card powers up (about a second at SD_INIT_HZ)
+#define SD_INIT_TRIES 4000
+
+#define SD_NORESP (HSMCI_CMDR_RSPTYP_NORESP | HSMCI_CMDR_MAXLAT)
+#define SD_R1 (HSMCI_CMDR_RSPTYP_48_BIT | HSMCI_CMDR_MAXLAT)
+#define SD_R1B (HSMCI_CMDR_RSPTYP_R1B | HSMCI_CMDR_MAXLAT)
+#define SD_R2 (HSMCI_CMDR_RSPTYP_136_BIT | HSMCI_CMDR_MAXLAT)
+
+#define SD_CMD_ERRORS (HSMCI_SR_CSTOE | HSMCI_SR_RTOE | HSMCI_SR_RENDE \
+	| HSMCI_SR_RCRCE | HSMCI_SR_RDIRE | HSMCI_SR_RINDE)
+#define SD_DATA_ERRORS (HSMCI_SR_UNRE | HSMCI_SR_OVRE | HSMCI_SR_DTOE | HSMCI_SR_DCRCE)
+
+// OCR bits of the ACMD41 argument and response
+#define SD_OCR_VOLTAGES 0x00FF8000
+#define SD_OCR_CCS (1UL << 30)
+#define SD_OCR_READY (1UL << 31)
+
+typedef enum
+{
+	SD_WRITE_NONE = 0,
+	SD_WRITE_DATA,     // PDC feeding the CMD25 transfer
+	SD_WRITE_STOPPING, // CMD12 sent, card programming
+} sd_write_state_t;
+
+static uint32_t sd_rca;
+static bool sd_block_addressed;
+static uint32_t sd_capacity;
+
+static sd_write_state_t sd_state;
+static uint32_t sd_unqueued;
+
+static void sd_set_clock(uint32_t hz)
+{
+	// MCK / (2 * CLKDIV + CLKODD + 2)
+	uint32_t divider = (sysclk_get_peripheral_hz() + hz - 1) / hz;
+	if (divider < 2)
+		divider = 2;
+	divider -= 2;
+
+	HSMCI->HSMCI_MR = (HSMCI->HSMCI_MR & ~(HSMCI_MR_CLKDIV_Msk | HSMCI_MR_CLKODD))
+		| HSMCI_MR_CLKDIV(divider / 2) | ((divider & 1) ? HSMCI_MR_CLKODD : 0);
+}
+
+static bool sd_command(uint32_t cmdr, uint32_t arg, uint32_t ignore)
+{
+	HSMCI->HSMCI_ARGR = arg;
+	HSMCI->HSMCI_CMDR = cmdr;
+
+	uint32_t sr;
+	do
+		sr = HSMCI->HSMCI_SR;
+	while (!(sr & HSMCI_SR_CMDRDY));
+
+	if (sr & SD_CMD_ERRORS & ~ignore)
+		return false;
+
+	if ((cmdr & HSMCI_CMDR_RSPTYP_Msk) == HSMCI_CMDR_RSPTYP_R1B)
+		while (!(HSMCI->HSMCI_SR & HSMCI_SR_NOTBUSY))
+			;
+	return true;
+}
+
+// Application commands are prefixed by CMD55
+static bool sd_app_command(uint32_t cmdr, uint32_t arg, uint32_t ignore)
+{
+	return sd_command(SD_R1 | HSMCI_CMDR_CMDNB(55), sd_rca << 16, 0)
+		&& sd_command(cmdr, arg, ignore);
+}
+
+// Field of the CSD, numbered from bit 0 of the 128-bit register;
+// csd[0] holds bits 127..96 as returned by successive RSPR reads
+static uint32_t csd_bits(const uint32_t *csd, uint32_t position, uint32_t width)
+{
+	uint32_t word = 3 - position / 32;
+	uint32_t shift = position % 32;
+	uint64_t value = csd[word] >> shift;
+	if (shift + width > 32)
+		value |= (uint64_t)csd[word - 1] << (32 - shift);
+	return value & ((1ULL << width) - 1);
+}
+
+static uint32_t csd_capacity(const uint32_t *csd)
+{
+	if (csd_bits(csd, 126, 2) == 1)
+		return (csd_bits(csd, 48, 22) + 1) * 1024;
+
+	uint32_t blocks = (csd_bits(csd, 62, 12) + 1) << (csd_bits(csd, 47, 3) + 2);
+	return blocks << csd_bits(csd, 80, 4) >> 9;
+}
+
+bool sd_init(void)
+{
+	sd_capacity = 0;
+	sd_rca = 0;
+	sd_state = SD_WRITE_NONE;
+
+	pmc_enable_periph_clk(ID_HSMCI);
+	pio_configure(SD_PIO, PIO_TYPE_PIO_PERIPH_C, SD_PINS, PIO_PULLUP);
+	pio_configure(SD_PIO, PIO_TYPE_PIO_PERIPH_C, SD_CLOCK_PIN, 0);
+
+	HSMCI->HSMCI_CR = HSMCI_CR_SWRST;
+	HSMCI->HSMCI_CR = HSMCI_CR_MCIDIS | HSMCI_CR_PWSDIS;
+	HSMCI->HSMCI_DTOR = HSMCI_DTOR_DTOMUL_1048576 | HSMCI_DTOR_DTOCYC(2);
+	HSMCI->HSMCI_CSTOR = HSMCI_CSTOR_CSTOMUL_1048576 | HSMCI_CSTOR_CSTOCYC(2);
+	HSMCI->HSMCI_CFG = HSMCI_CFG_FIFOMODE | HSMCI_CFG_FERRCTRL;
+	// Proof bits pause the card clock instead of under-running the FIFO
+	HSMCI->HSMCI_MR = HSMCI_MR_PWSDIV(7) | HSMCI_MR_RDPROOF | HSMCI_MR_WRPROOF;
+	sd_set_clock(SD_INIT_HZ);
+	HSMCI->HSMCI_CR = HSMCI_CR_MCIEN;
+	HSMCI->HSMCI_SDCR = HSMCI_SDCR_SDCSEL_SLOTA | HSMCI_SDCR_SDCBUS_1;
+
+	// 74 clocks, GO_IDLE_STATE, then SEND_IF_COND for 2.7-3.6 V
+	sd_command(SD_NORESP | HSMCI_CMDR_SPCMD_INIT, 0, 0);
+	sd_command(SD_NORESP | HSMCI_CMDR_CMDNB(0), 0, 0);
+	bool v2 = sd_command(SD_R1 | HSMCI_CMDR_CMDNB(8), 0x1AA, 0)
+		&& (HSMCI->HSMCI_RSPR[0] & 0xFFF) == 0x1AA;
+
+	// SD_SEND_OP_COND until the card is powered up; R3 carries no CRC
+	uint32_t ocr = 0;
+	for (uint32_t i = 0; i < SD_INIT_TRIES && !(ocr & SD_OCR_READY); i++)
+	{
+		if (!sd_app_command(SD_R1 | HSMCI_CMDR_CMDNB(41),
+				SD_OCR_VOLTAGES | (v2 ? SD_OCR_CCS : 0), HSMCI_SR_RCRCE))
+			return false;
+		ocr = HSMCI->HSMCI_RSPR[0];
+	}
+	if (!(ocr & SD_OCR_READY))
+		return false;
+	sd_block_addressed = ocr & SD_OCR_CCS;
+
+	// ALL_SEND_CID, SEND_RELATIVE_ADDR, SEND_CSD
+	if (!sd_command(SD_R2 | HSMCI_CMDR_CMDNB(2), 0, HSMCI_SR_RCRCE)
+		|| !sd_command(SD_R1 | HSMCI_CMDR_CMDNB(3), 0, 0))
+		return false;
+	sd_rca = HSMCI->HSMCI_RSPR[0] >> 16;
+
+	if (!sd_command(SD_R2 | HSMCI_CMDR_CMDNB(9), sd_rca << 16, HSMCI_SR_RCRCE))
+		return false;
+	uint32_t csd[4];
+	for (uint8_t i = 0; i < 4; i++)
+		csd[i] = HSMCI->HSMCI_RSPR[0];
+
+	// SELECT_CARD, SET_BUS_WIDTH 4 and, for byte-addressed cards, SET_BLOCKLEN
+	if (!sd_command(SD_R1B | HSMCI_CMDR_CMDNB(7), sd_rca << 16, 0)
+		|| !sd_app_command(SD_R1 | HSMCI_CMDR_CMDNB(6), 2, 0))
+		return false;
+	HSMCI->HSMCI_SDCR = HSMCI_SDCR_SDCSEL_SLOTA | HSMCI_SDCR_SDCBUS_4;
+	if (!sd_block_addressed && !sd_command(SD_R1 | HSMCI_CMDR_CMDNB(16), SD_BLOCK_BYTES, 0))
+		return false;
+
+	sd_set_clock(SD_TRANSFER_HZ);
+	sd_capacity = csd_capacity(csd);
+	return true;
+}
+
+uint32_t sd_blocks(void)
+{
+	return sd_capacity;
+}
+
+bool sd_write_start(uint32_t block, uint32_t count)
+{
+	if (sd_state != SD_WRITE_NONE || !count || !sd_capacity)
+		return false;
+
+	HSMCI->HSMCI_PTCR = HSMCI_PTCR_TXTDIS | HSMCI_PTCR_RXTDIS;
+	HSMCI->HSMCI_TCR = 0;
+	HSMCI->HSMCI_TNCR = 0;
+	HSMCI->HSMCI_MR |= HSMCI_MR_PDCMODE;
+	HSMCI->HSMCI_BLKR = HSMCI_BLKR_BCNT(count) | HSMCI_BLKR_BLKLEN(SD_BLOCK_BYTES);
+
+	// WRITE_MULTIPLE_BLOCK
+	uint32_t address = sd_block_addressed ? block : block * SD_BLOCK_BYTES;
+	if (!sd_command(SD_R1 | HSMCI_CMDR_CMDNB(25) | HSMCI_CMDR_TRCMD_START_DATA
+			| HSMCI_CMDR_TRTYP_MULTIPLE, address, 0))
+	{
+		HSMCI->HSMCI_MR &= ~HSMCI_MR_PDCMODE;
+		return false;
+	}
+
+	sd_unqueued = count;
+	sd_state = SD_WRITE_DATA;
+	HSMCI->HSMCI_PTCR = HSMCI_PTCR_TXTEN;
+	return true;
+}
+
+bool sd_write_queue(const void *data, uint32_t blocks)
+{
+	if (sd_state != SD_WRITE_DATA || blocks > sd_unqueued)
+		return false;
+
+	// TCR and TNCR count words; the next buffer moves up as the current one ends
+	uint32_t words = blocks * (SD_BLOCK_BYTES / 4);
+	if (!HSMCI->HSMCI_TCR)
+	{
+		HSMCI->HSMCI_TPR = (uint32_t)data;
+		HSMCI->HSMCI_TCR = words;
+	}
+	else if (!HSMCI->HSMCI_TNCR)
+	{
+		HSMCI->HSMCI_TNPR = (uint32_t)data;
+		HSMCI->HSMCI_TNCR = words;
+	}
+	else
+		return false;
+
+	sd_unqueued -= blocks;
+	return true;
+}
+
+sd_status_t sd_write_poll(void)
+{
+	uint32_t sr = HSMCI->HSMCI_SR;
+
+	switch (sd_state)
+	{
+	case SD_WRITE_NONE:
+		return SD_IDLE;
+
+	case SD_WRITE_DATA:
+		if (sr & SD_DATA_ERRORS)
+			break;
+		if (sd_unqueued || !(sr & HSMCI_SR_TXBUFE) || !(sr & HSMCI_SR_XFRDONE))
+			return SD_BUSY;
+
+		// STOP_TRANSMISSION; the card stays busy while it programs
+		HSMCI->HSMCI_PTCR = HSMCI_PTCR_TXTDIS;
+		HSMCI->HSMCI_MR &= ~HSMCI_MR_PDCMODE;
+		HSMCI->HSMCI_ARGR = 0;
+		HSMCI->HSMCI_CMDR = SD_R1B | HSMCI_CMDR_CMDNB(12) | HSMCI_CMDR_TRCMD_STOP_DATA
+			| HSMCI_CMDR_TRTYP_MULTIPLE;
+		sd_state = SD_WRITE_STOPPING;
+		return SD_BUSY;
+
+	case SD_WRITE_STOPPING:
+		if (!(sr & HSMCI_SR_CMDRDY) || !(sr & HSMCI_SR_NOTBUSY))
+			return SD_BUSY;
+		if (sr & SD_CMD_ERRORS)
+			break;
+		sd_state = SD_WRITE_NONE;
+		return SD_IDLE;
+	}
+
+	// Leave the card usable for the next write if it recovers
+	HSMCI->HSMCI_PTCR = HSMCI_PTCR_TXTDIS;
+	HSMCI->HSMCI_MR &= ~HSMCI_MR_PDCMODE;
+	sd_command(SD_R1B | HSMCI_CMDR_CMDNB(12) | HSMCI_CMDR_TRCMD_STOP_DATA, 0, SD_CMD_ERRORS);
+	sd_state = SD_WRITE_NONE;
+	return SD_ERROR;
+}
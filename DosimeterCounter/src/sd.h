@@ -0,0 +1,41 @@
+#ifndef SD_H_INCLUDED
+#define SD_H_INCLUDED
+
+#include <compiler.h>
+
+// Minimal SD card driver on the HSMCI, 4-bit bus on slot A.
+// Only what the frame log needs: card initialisation and multi-block
+// writes fed by the HSMCI PDC, which the main loop drives by polling.
+//
+// The HSMCI pins (PA26-PA31, peripheral C) overlap TIOA2 and the
+// TCLK1/TCLK2 inputs of the secondary and tertiary channels.
+
+#define SD_BLOCK_BYTES 512
+
+typedef enum
+{
+	SD_IDLE = 0,
+	SD_BUSY,
+	SD_ERROR,
+} sd_status_t;
+
+// Bring up the controller and card; false if there is no usable card
+bool sd_init(void);
+
+// Capacity in blocks, 0 before a successful sd_init
+uint32_t sd_blocks(void);
+
+// Begin writing count blocks from block onwards.  The data is then
+// handed over with sd_write_queue, in as many pieces as needed.
+bool sd_write_start(uint32_t block, uint32_t count);
+
+// Queue blocks of data (word aligned) for the write in progress.
+// Returns false while both PDC buffers are taken; the data must stay
+// unchanged until sd_write_poll reports the write finished.
+bool sd_write_queue(const void *data, uint32_t blocks);
+
+// Advance the write in progress: SD_BUSY until the card has taken every
+// block, then SD_IDLE, or SD_ERROR if the card or bus failed
+sd_status_t sd_write_poll(void);
+
+#endif /* SD_H_INCLUDED */
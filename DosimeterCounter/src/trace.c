@@ -0,0 +1,16 @@
+#include <asf.h>
+#include <string.h>
+#include "trace.h"
+
+trace_event_t trace_buffer[TRACE_EVENTS];
+volatile uint32_t trace_index;
+volatile bool trace_paused;
+
+void trace_reset(void)
+{
+	irqflags_t flags = cpu_irq_save();
+	memset(trace_buffer, 0, sizeof(trace_buffer));
+	trace_index = 0;
+	trace_paused = false;
+	cpu_irq_restore(flags);
+}
@@ -0,0 +1,57 @@
+#ifndef TRACE_H_INCLUDED
+#define TRACE_H_INCLUDED
+
+#include <compiler.h>
+
+// Event trace of the hot paths for seeing how steps, USB interrupts and
+// commands interleave.  Each event is stored with the DWT cycle count in
+// a RAM ring that M1051 dumps.  Set to 1 to compile the trace points in.
+#define TRACE_ENABLE 0
+
+// Events kept, the oldest are overwritten.  Must be a power of two.
+#define TRACE_EVENTS 512
+
+// Event ids; TRACE_END marks the end of a span begun with the same id
+#define TRACE_STEP 1       // Trigger_Step, arg: low 16 bits of head_position
+#define TRACE_USB_EP 2     // udd_ep_interrupt, arg: low 16 bits of UDP_ISR
+#define TRACE_CDC_SENT 3   // udi_cdc_data_sent, arg: bytes sent
+#define TRACE_COMMAND 4    // parse_gcode, arg: command code
+#define TRACE_CLOCK 5      // MCK prescaler changed, arg: times slower than full speed
+#define TRACE_END 0x8000
+
+typedef struct
+{
+	uint32_t cycles;  // DWT->CYCCNT when recorded
+	uint16_t event;   // TRACE_* id
+	uint16_t arg;
+} trace_event_t;
+
+extern trace_event_t trace_buffer[TRACE_EVENTS];
+// Events recorded since trace_reset(); the next one goes to
+// trace_index % TRACE_EVENTS
+extern volatile uint32_t trace_index;
+// Set while the ring is being read out
+extern volatile bool trace_paused;
+
+void trace_reset(void);
+
+// Claims a slot with one exclusive add, so any interrupt level may record
+// without masking the others; an event costs a few loads and stores.
+static __always_inline void trace(uint16_t event, uint16_t arg)
+{
+#if TRACE_ENABLE
+	if (trace_paused)
+		return;
+
+	uint32_t cycles = DWT->CYCCNT;
+	trace_event_t *slot = &trace_buffer[__atomic_fetch_add(&trace_index, 1, __ATOMIC_RELAXED) & (TRACE_EVENTS - 1)];
+	slot->cycles = cycles;
+	slot->event = event;
+	slot->arg = arg;
+#else
+	UNUSED(event);
+	UNUSED(arg);
+#endif
+}
+
+#endif /* TRACE_H_INCLUDED */
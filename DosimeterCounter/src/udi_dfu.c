@@ -0,0 +1,295 @@
+#include "conf_usb.h"
+#include "udd.h"
+#include "flash.h"
+#include "udi_dfu.h"
+
+static bool udi_dfu_enable(void);
+static void udi_dfu_disable(void);
+static bool udi_dfu_setup(void);
+static uint8_t udi_dfu_getsetting(void);
+
+UDC_DESC_STORAGE udi_api_t udi_api_dfu = {
+	.enable = udi_dfu_enable,
+	.disable = udi_dfu_disable,
+	.setup = udi_dfu_setup,
+	.getsetting = udi_dfu_getsetting,
+	.sof_notify = NULL,
+};
+
+#define DFU_REQ_DETACH 0
+#define DFU_REQ_DNLOAD 1
+#define DFU_REQ_UPLOAD 2
+#define DFU_REQ_GETSTATUS 3
+#define DFU_REQ_CLRSTATUS 4
+#define DFU_REQ_GETSTATE 5
+#define DFU_REQ_ABORT 6
+
+// The DFU mode states of DFU 1.1
+#define DFU_STATE_IDLE 2
+#define DFU_STATE_DNLOAD_SYNC 3
+#define DFU_STATE_DNBUSY 4
+#define DFU_STATE_DNLOAD_IDLE 5
+#define DFU_STATE_MANIFEST_SYNC 6
+#define DFU_STATE_MANIFEST 7
+#define DFU_STATE_MANIFEST_WAIT_RESET 8
+#define DFU_STATE_ERROR 10
+
+// bStatus codes
+#define DFU_STATUS_OK 0x00
+#define DFU_STATUS_ERR_WRITE 0x03
+#define DFU_STATUS_ERR_ADDRESS 0x08
+#define DFU_STATUS_ERR_FIRMWARE 0x0A
+#define DFU_STATUS_ERR_VENDOR 0x0B     // The counter is acquiring
+#define DFU_STATUS_ERR_STALLEDPKT 0x0F
+
+static volatile uint8_t dfu_state = DFU_STATE_IDLE;
+static volatile uint8_t dfu_status = DFU_STATUS_OK;
+
+// Blocks received and blocks programmed, counted on from boot.  Block n
+// is in dfu_buffers[n % 2], for page dfu_pages[n % 2] of the update
+// area, so the host sends one while the other is programmed.
+static volatile uint32_t dfu_received;
+static volatile uint32_t dfu_programmed;
+// The first block after the last reset, before which blocks are dropped
+static volatile uint32_t dfu_first;
+static uint16_t dfu_lengths[2];
+static uint16_t dfu_pages[2];
+COMPILER_WORD_ALIGNED static uint8_t dfu_buffers[2][UDI_DFU_BLOCK_BYTES];
+
+// Download since the last reset of the state machine
+static uint32_t dfu_next_page;
+static uint32_t dfu_image_bytes;
+static bool dfu_ended;              // A short block ended the image
+static volatile bool dfu_checked;   // The image is whole and was checked
+static volatile bool dfu_install;
+
+static uint16_t dfu_setup_length;
+COMPILER_WORD_ALIGNED static uint8_t dfu_reply[6];
+
+static void dfu_reset(void)
+{
+	dfu_first = dfu_received;
+	dfu_next_page = 0;
+	dfu_image_bytes = 0;
+	dfu_ended = false;
+	dfu_checked = false;
+	dfu_status = DFU_STATUS_OK;
+	dfu_state = DFU_STATE_IDLE;
+}
+
+static void dfu_fail(uint8_t status)
+{
+	dfu_status = status;
+	dfu_state = DFU_STATE_ERROR;
+}
+
+static bool udi_dfu_enable(void)
+{
+	dfu_reset();
+	return true;
+}
+
+static void udi_dfu_disable(void)
+{
+}
+
+static uint8_t udi_dfu_getsetting(void)
+{
+	return 0;
+}
+
+// End of the data stage of a DNLOAD
+static void dfu_received_block(void)
+{
+	uint8_t slot = dfu_received % 2;
+	dfu_lengths[slot] = dfu_setup_length;
+	dfu_pages[slot] = dfu_next_page++;
+	dfu_image_bytes += dfu_setup_length;
+	dfu_ended = dfu_setup_length < UDI_DFU_BLOCK_BYTES;
+	dfu_received++;
+	if (dfu_state != DFU_STATE_ERROR)
+		dfu_state = DFU_STATE_DNLOAD_SYNC;
+}
+
+static bool dfu_download(uint16_t length)
+{
+	if (dfu_state != DFU_STATE_IDLE && dfu_state != DFU_STATE_DNLOAD_IDLE)
+		return false;
+
+	// A zero-length block ends the download
+	if (length == 0)
+	{
+		if (dfu_state != DFU_STATE_DNLOAD_IDLE)
+			return false;
+		dfu_state = DFU_STATE_MANIFEST_SYNC;
+		return true;
+	}
+
+	if (dfu_state == DFU_STATE_IDLE && !UDI_DFU_ALLOWED_EXT())
+	{
+		dfu_fail(DFU_STATUS_ERR_VENDOR);
+		return false;
+	}
+
+	// Only the last block may be short, and both buffers must not be full
+	if (length > UDI_DFU_BLOCK_BYTES || dfu_ended || dfu_next_page >= FLASH_UPDATE_PAGES
+		|| dfu_received - dfu_programmed >= 2)
+	{
+		dfu_fail(DFU_STATUS_ERR_ADDRESS);
+		return false;
+	}
+
+	dfu_setup_length = length;
+	udd_g_ctrlreq.payload = dfu_buffers[dfu_received % 2];
+	udd_g_ctrlreq.payload_size = length;
+	udd_g_ctrlreq.callback = dfu_received_block;
+	return true;
+}
+
+// Installs once the status naming the reset has gone out
+static void dfu_status_sent(void)
+{
+	dfu_install = true;
+}
+
+static void dfu_get_status(void)
+{
+	uint32_t poll_ms = 0;
+	switch (dfu_state)
+	{
+	case DFU_STATE_DNLOAD_SYNC:
+	case DFU_STATE_DNBUSY:
+		if (dfu_received - dfu_programmed >= 2)
+		{
+			dfu_state = DFU_STATE_DNBUSY;
+			poll_ms = UDI_DFU_POLL_MS;
+		}
+		else
+			dfu_state = DFU_STATE_DNLOAD_IDLE;
+		break;
+
+	case DFU_STATE_MANIFEST_SYNC:
+	case DFU_STATE_MANIFEST:
+		if (dfu_checked)
+		{
+			dfu_state = DFU_STATE_MANIFEST_WAIT_RESET;
+			udd_g_ctrlreq.callback = dfu_status_sent;
+		}
+		else
+		{
+			dfu_state = DFU_STATE_MANIFEST;
+			poll_ms = UDI_DFU_MANIFEST_POLL_MS;
+		}
+		break;
+	}
+
+	dfu_reply[0] = dfu_status;
+	dfu_reply[1] = poll_ms;
+	dfu_reply[2] = poll_ms >> 8;
+	dfu_reply[3] = poll_ms >> 16;
+	dfu_reply[4] = dfu_state;
+	dfu_reply[5] = 0;
+}
+
+// A request DFU does not allow in the state stalls and leaves the
+// state machine in dfuERROR until the host clears it
+static bool udi_dfu_setup(void)
+{
+	if (Udd_setup_type() != USB_REQ_TYPE_CLASS)
+		return false;
+
+	uint16_t length = udd_g_ctrlreq.req.wLength;
+	bool ok = false;
+	if (Udd_setup_is_out())
+	{
+		switch (udd_g_ctrlreq.req.bRequest)
+		{
+		case DFU_REQ_DETACH:
+			// Already in DFU mode
+			ok = true;
+			break;
+
+		case DFU_REQ_DNLOAD:
+			ok = dfu_download(length);
+			break;
+
+		case DFU_REQ_CLRSTATUS:
+			ok = dfu_state == DFU_STATE_ERROR;
+			if (ok)
+				dfu_reset();
+			break;
+
+		case DFU_REQ_ABORT:
+			ok = dfu_state == DFU_STATE_IDLE || dfu_state == DFU_STATE_DNLOAD_IDLE;
+			if (ok)
+				dfu_reset();
+			break;
+		}
+	}
+	else if (udd_g_ctrlreq.req.bRequest == DFU_REQ_GETSTATUS && length >= sizeof(dfu_reply))
+	{
+		dfu_get_status();
+		udd_g_ctrlreq.payload = dfu_reply;
+		udd_g_ctrlreq.payload_size = sizeof(dfu_reply);
+		ok = true;
+	}
+	else if (udd_g_ctrlreq.req.bRequest == DFU_REQ_GETSTATE && length >= 1)
+	{
+		dfu_reply[4] = dfu_state;
+		udd_g_ctrlreq.payload = &dfu_reply[4];
+		udd_g_ctrlreq.payload_size = 1;
+		ok = true;
+	}
+
+	if (!ok && dfu_state != DFU_STATE_ERROR)
+		dfu_fail(DFU_STATUS_ERR_STALLEDPKT);
+	return ok;
+}
+
+// A program image starts with its vector table: the initial stack
+// pointer, in SRAM, and the reset handler, a Thumb address within it
+static bool dfu_image_valid(void)
+{
+	const uint32_t *vectors = flash_update_page(0);
+	if (dfu_image_bytes < 8)
+		return false;
+	uint32_t sp = vectors[0], reset = vectors[1];
+	return sp > IRAM_ADDR && sp <= IRAM_ADDR + IRAM_SIZE && (reset & 1)
+		&& reset - IFLASH_ADDR < dfu_image_bytes;
+}
+
+bool udi_dfu_pending(void)
+{
+	return dfu_programmed != dfu_received || dfu_install
+		|| (dfu_state == DFU_STATE_MANIFEST_SYNC && !dfu_checked)
+		|| (dfu_state == DFU_STATE_MANIFEST && !dfu_checked);
+}
+
+void udi_dfu_poll(void)
+{
+	// One page per pass, programmed while the host sends the next
+	if (dfu_programmed != dfu_received)
+	{
+		uint8_t slot = dfu_programmed % 2;
+		bool current = (int32_t)(dfu_programmed - dfu_first) >= 0;
+		if (current && dfu_state != DFU_STATE_ERROR && !UDI_DFU_ALLOWED_EXT())
+			dfu_fail(DFU_STATUS_ERR_VENDOR);
+		if (current && dfu_state != DFU_STATE_ERROR
+			&& !flash_update_write(dfu_pages[slot], dfu_buffers[slot], dfu_lengths[slot]))
+			dfu_fail(DFU_STATUS_ERR_WRITE);
+		dfu_programmed++;
+		return;
+	}
+
+	if (dfu_install)
+		flash_update_install(dfu_image_bytes);
+
+	uint8_t state = dfu_state;
+	if ((state == DFU_STATE_MANIFEST_SYNC || state == DFU_STATE_MANIFEST) && !dfu_checked)
+	{
+		if (dfu_image_valid())
+			dfu_checked = true;
+		else
+			dfu_fail(DFU_STATUS_ERR_FIRMWARE);
+	}
+}
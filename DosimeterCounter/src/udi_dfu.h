@@ -0,0 +1,71 @@
+#ifndef UDI_DFU_H_INCLUDED
+#define UDI_DFU_H_INCLUDED
+
+#include "conf_usb.h"
+#include "usb_protocol.h"
+#include "udc_desc.h"
+#include "udi.h"
+
+// Firmware update interface (USB_DFU_ENABLE): a DFU 1.1 interface in
+// DFU mode within the composite device, so dfu-util writes a new program
+// image without a detach.  It needs no endpoints, as DFU runs on the
+// default control pipe.  Blocks are staged in the update area of the
+// flash (flash.h) by udi_dfu_poll from the main loop, each one while the
+// host sends the next, and the image replaces the program and the
+// device resets once the host ends the download.  Uploads are not
+// supported.
+
+// Bytes per DNLOAD, one flash page
+#define UDI_DFU_BLOCK_BYTES 512
+// Time the host waits after a block finds both buffers full
+#define UDI_DFU_POLL_MS 10
+// Time the host waits before it asks again while the image is checked
+#define UDI_DFU_MANIFEST_POLL_MS 100
+
+extern UDC_DESC_STORAGE udi_api_t udi_api_dfu;
+
+COMPILER_PACK_SET(1)
+typedef struct {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint8_t bmAttributes;
+	le16_t wDetachTimeOut;
+	le16_t wTransferSize;
+	le16_t bcdDFUVersion;
+} udi_dfu_functional_desc_t;
+
+typedef struct {
+	usb_iface_desc_t iface;
+	udi_dfu_functional_desc_t functional;
+} udi_dfu_desc_t;
+COMPILER_PACK_RESET()
+
+// Application specific class, DFU subclass, DFU mode protocol.
+// bmAttributes: bitCanDnload, and as the image takes effect through a
+// reset, not bitManifestationTolerant
+#define UDI_DFU_DESC { \
+   .iface.bLength                = sizeof(usb_iface_desc_t),\
+   .iface.bDescriptorType        = USB_DT_INTERFACE,\
+   .iface.bInterfaceNumber       = UDI_DFU_IFACE_NUMBER,\
+   .iface.bAlternateSetting      = 0,\
+   .iface.bNumEndpoints          = 0,\
+   .iface.bInterfaceClass        = 0xFE,\
+   .iface.bInterfaceSubClass     = 0x01,\
+   .iface.bInterfaceProtocol     = 0x02,\
+   .iface.iInterface             = 0,\
+   .functional.bLength           = sizeof(udi_dfu_functional_desc_t),\
+   .functional.bDescriptorType   = 0x21,\
+   .functional.bmAttributes      = 0x01,\
+   .functional.wDetachTimeOut    = LE16(1000),\
+   .functional.wTransferSize     = LE16(UDI_DFU_BLOCK_BYTES),\
+   .functional.bcdDFUVersion     = LE16(0x0110),\
+   }
+
+// Programs the blocks received, and installs the image once the
+// download has ended
+void udi_dfu_poll(void);
+
+// True while a block or the end of the download waits for udi_dfu_poll
+bool udi_dfu_pending(void);
+
+#endif /* UDI_DFU_H_INCLUDED */
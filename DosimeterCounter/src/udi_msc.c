@@ -0,0 +1,377 @@
+#include <string.h>
+#include "conf_usb.h"
+#include "udd.h"
+#include "udi_msc.h"
+
+static bool udi_msc_enable(void);
+static void udi_msc_disable(void);
+static bool udi_msc_setup(void);
+static uint8_t udi_msc_getsetting(void);
+
+UDC_DESC_STORAGE udi_api_t udi_api_msc = {
+	.enable = udi_msc_enable,
+	.disable = udi_msc_disable,
+	.setup = udi_msc_setup,
+	.getsetting = udi_msc_getsetting,
+	.sof_notify = NULL,
+};
+
+// Bulk-only transport: a command block wrapper from the host, the data,
+// then a command status wrapper back
+#define MSC_CBW_SIGNATURE 0x43425355
+#define MSC_CSW_SIGNATURE 0x53425355
+#define MSC_CBW_IN 0x80
+
+#define MSC_REQ_GET_MAX_LUN 0xFE
+#define MSC_REQ_RESET 0xFF
+
+#define MSC_CSW_PASSED 0
+#define MSC_CSW_FAILED 1
+
+// SCSI operation codes
+#define SCSI_TEST_UNIT_READY 0x00
+#define SCSI_REQUEST_SENSE 0x03
+#define SCSI_INQUIRY 0x12
+#define SCSI_MODE_SENSE_6 0x1A
+#define SCSI_START_STOP_UNIT 0x1B
+#define SCSI_PREVENT_ALLOW_REMOVAL 0x1E
+#define SCSI_READ_FORMAT_CAPACITIES 0x23
+#define SCSI_READ_CAPACITY_10 0x25
+#define SCSI_READ_10 0x28
+#define SCSI_WRITE_10 0x2A
+#define SCSI_VERIFY_10 0x2F
+#define SCSI_MODE_SENSE_10 0x5A
+
+// Sense keys and additional sense codes
+#define SCSI_SENSE_NONE 0x00
+#define SCSI_SENSE_ILLEGAL_REQUEST 0x05
+#define SCSI_SENSE_DATA_PROTECT 0x07
+#define SCSI_ASC_NONE 0x00
+#define SCSI_ASC_INVALID_COMMAND 0x20
+#define SCSI_ASC_LBA_OUT_OF_RANGE 0x21
+#define SCSI_ASC_INVALID_FIELD 0x24
+#define SCSI_ASC_WRITE_PROTECTED 0x27
+
+COMPILER_PACK_SET(1)
+typedef struct {
+	le32_t signature;
+	le32_t tag;
+	le32_t data_length;
+	uint8_t flags;
+	uint8_t lun;
+	uint8_t cb_length;
+	uint8_t cb[16];
+} msc_cbw_t;
+
+typedef struct {
+	le32_t signature;
+	le32_t tag;
+	le32_t residue;
+	uint8_t status;
+} msc_csw_t;
+COMPILER_PACK_RESET()
+
+static volatile bool msc_enabled;
+static bool msc_opened;             // msc_disk_open has been called since
+static uint32_t msc_sectors;
+static volatile bool msc_busy;      // An endpoint transfer is running
+static volatile bool msc_cbw_armed;
+static volatile bool msc_cbw_ready;
+static volatile uint32_t msc_cbw_bytes;
+static volatile bool msc_halted;    // Waiting for the host to clear a stall or reset
+static bool msc_csw_pending;
+static uint32_t msc_read_next;      // Sectors of a READ still to send
+static uint32_t msc_read_left;
+static uint8_t msc_sense_key;
+static uint8_t msc_sense_asc;
+
+COMPILER_WORD_ALIGNED static msc_cbw_t msc_cbw;
+COMPILER_WORD_ALIGNED static msc_csw_t msc_csw;
+COMPILER_WORD_ALIGNED static uint8_t msc_buffer[UDI_MSC_SECTOR_BYTES];
+static uint8_t msc_max_lun;
+
+// "VUW", "2D Dosimeter log" and a revision, padded with spaces
+static const uint8_t msc_inquiry[36] = {
+	0x00, 0x80, 0x04, 0x02, 31, 0, 0, 0,
+	'V', 'U', 'W', ' ', ' ', ' ', ' ', ' ',
+	'2', 'D', ' ', 'D', 'o', 's', 'i', 'm', 'e', 't', 'e', 'r', ' ', 'l', 'o', 'g',
+	'1', '.', '0', ' ',
+};
+
+static void msc_reset(void)
+{
+	msc_cbw_armed = false;
+	msc_cbw_ready = false;
+	msc_halted = false;
+	msc_csw_pending = false;
+	msc_read_left = 0;
+	msc_sense_key = SCSI_SENSE_NONE;
+	msc_sense_asc = SCSI_ASC_NONE;
+}
+
+// The endpoints themselves are allocated and freed by the UDC
+static bool udi_msc_enable(void)
+{
+	msc_reset();
+	msc_opened = false;
+	msc_enabled = true;
+	return true;
+}
+
+static void udi_msc_disable(void)
+{
+	msc_enabled = false;
+}
+
+static bool udi_msc_setup(void)
+{
+	if (Udd_setup_type() != USB_REQ_TYPE_CLASS)
+		return false;
+
+	if (Udd_setup_is_in() && udd_g_ctrlreq.req.bRequest == MSC_REQ_GET_MAX_LUN
+		&& udd_g_ctrlreq.req.wLength == 1)
+	{
+		udd_g_ctrlreq.payload = &msc_max_lun;
+		udd_g_ctrlreq.payload_size = 1;
+		return true;
+	}
+
+	// Reset recovery; the host clears the halts itself
+	if (Udd_setup_is_out() && udd_g_ctrlreq.req.bRequest == MSC_REQ_RESET
+		&& udd_g_ctrlreq.req.wLength == 0)
+	{
+		udd_ep_abort(UDI_MSC_EP_IN);
+		udd_ep_abort(UDI_MSC_EP_OUT);
+		msc_reset();
+		return true;
+	}
+
+	return false;
+}
+
+static uint8_t udi_msc_getsetting(void)
+{
+	return 0;
+}
+
+// Also called with UDD_EP_TRANSFER_ABORT on reset or disconnect
+static void msc_done(udd_ep_status_t status, iram_size_t nb_transfered, udd_ep_id_t ep)
+{
+	if (ep == UDI_MSC_EP_OUT)
+	{
+		msc_cbw_armed = false;
+		msc_cbw_bytes = nb_transfered;
+		msc_cbw_ready = status == UDD_EP_TRANSFER_OK;
+	}
+	msc_busy = false;
+}
+
+static void msc_stall_cleared(void)
+{
+	msc_halted = false;
+}
+
+static void msc_send(const void *data, uint32_t length, bool short_packet)
+{
+	msc_busy = true;
+	if (!udd_ep_run(UDI_MSC_EP_IN, short_packet, (uint8_t *)data, length, msc_done))
+		msc_busy = false;
+}
+
+// Stall the data the host still expects, then report
+static void msc_end(uint8_t status)
+{
+	msc_csw.status = status;
+	msc_csw_pending = true;
+	if (msc_csw.residue)
+	{
+		udd_ep_id_t ep = (msc_cbw.flags & MSC_CBW_IN) ? UDI_MSC_EP_IN : UDI_MSC_EP_OUT;
+		msc_halted = true;
+		udd_ep_set_halt(ep);
+		udd_ep_wait_stall_clear(ep, msc_stall_cleared);
+	}
+}
+
+static void msc_fail(uint8_t key, uint8_t asc)
+{
+	msc_sense_key = key;
+	msc_sense_asc = asc;
+	msc_end(MSC_CSW_FAILED);
+}
+
+// Send length bytes of msc_buffer, or as many as the host asked for,
+// ending with a short packet if that is fewer
+static void msc_reply(uint32_t length)
+{
+	if (!(msc_cbw.flags & MSC_CBW_IN) || msc_csw.residue == 0)
+	{
+		msc_end(MSC_CSW_PASSED);
+		return;
+	}
+
+	length = Min(length, msc_csw.residue);
+	msc_csw.residue -= length;
+	msc_csw.status = MSC_CSW_PASSED;
+	msc_csw_pending = true;
+	msc_send(msc_buffer, length, msc_csw.residue != 0);
+}
+
+static inline void msc_put_be32(uint8_t *p, uint32_t value)
+{
+	p[0] = value >> 24;
+	p[1] = value >> 16;
+	p[2] = value >> 8;
+	p[3] = value;
+}
+
+static void msc_command(void)
+{
+	const uint8_t *cb = msc_cbw.cb;
+	if (msc_cbw_bytes != sizeof(msc_cbw) || le32_to_cpu(msc_cbw.signature) != MSC_CBW_SIGNATURE
+		|| msc_cbw.cb_length < 1 || msc_cbw.cb_length > sizeof(msc_cbw.cb))
+	{
+		// Not meaningful: stall both ways until the host resets
+		msc_halted = true;
+		udd_ep_set_halt(UDI_MSC_EP_IN);
+		udd_ep_set_halt(UDI_MSC_EP_OUT);
+		return;
+	}
+
+	msc_csw.signature = cpu_to_le32(MSC_CSW_SIGNATURE);
+	msc_csw.tag = msc_cbw.tag;
+	msc_csw.residue = le32_to_cpu(msc_cbw.data_length);
+	if (msc_cbw.lun != 0)
+	{
+		msc_fail(SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ASC_INVALID_FIELD);
+		return;
+	}
+
+	memset(msc_buffer, 0, 36);
+	switch (cb[0])
+	{
+	case SCSI_TEST_UNIT_READY:
+	case SCSI_PREVENT_ALLOW_REMOVAL:
+	case SCSI_START_STOP_UNIT:
+	case SCSI_VERIFY_10:
+		msc_end(MSC_CSW_PASSED);
+		return;
+
+	case SCSI_REQUEST_SENSE:
+		msc_buffer[0] = 0x70;
+		msc_buffer[2] = msc_sense_key;
+		msc_buffer[7] = 10;
+		msc_buffer[12] = msc_sense_asc;
+		msc_sense_key = SCSI_SENSE_NONE;
+		msc_sense_asc = SCSI_ASC_NONE;
+		msc_reply(18);
+		return;
+
+	case SCSI_INQUIRY:
+		memcpy(msc_buffer, msc_inquiry, sizeof(msc_inquiry));
+		msc_reply(sizeof(msc_inquiry));
+		return;
+
+	// No mode pages, only the header with the write protect bit
+	case SCSI_MODE_SENSE_6:
+		msc_buffer[0] = 3;
+		msc_buffer[2] = 0x80;
+		msc_reply(4);
+		return;
+
+	case SCSI_MODE_SENSE_10:
+		msc_buffer[1] = 6;
+		msc_buffer[3] = 0x80;
+		msc_reply(8);
+		return;
+
+	case SCSI_READ_FORMAT_CAPACITIES:
+		msc_buffer[3] = 8;
+		msc_put_be32(&msc_buffer[4], msc_sectors);
+		msc_put_be32(&msc_buffer[8], 0x02000000 | UDI_MSC_SECTOR_BYTES);
+		msc_reply(12);
+		return;
+
+	case SCSI_READ_CAPACITY_10:
+		msc_put_be32(&msc_buffer[0], msc_sectors - 1);
+		msc_put_be32(&msc_buffer[4], UDI_MSC_SECTOR_BYTES);
+		msc_reply(8);
+		return;
+
+	case SCSI_READ_10:
+	{
+		uint32_t sector = (uint32_t)cb[2] << 24 | (uint32_t)cb[3] << 16 | cb[4] << 8 | cb[5];
+		uint32_t count = cb[7] << 8 | cb[8];
+		if (!(msc_cbw.flags & MSC_CBW_IN) || msc_csw.residue != count * UDI_MSC_SECTOR_BYTES)
+			msc_fail(SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ASC_INVALID_FIELD);
+		else if (sector >= msc_sectors || count > msc_sectors - sector)
+			msc_fail(SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ASC_LBA_OUT_OF_RANGE);
+		else
+		{
+			msc_read_next = sector;
+			msc_read_left = count;
+			msc_csw.status = MSC_CSW_PASSED;
+			msc_csw_pending = true;
+		}
+		return;
+	}
+
+	case SCSI_WRITE_10:
+		msc_fail(SCSI_SENSE_DATA_PROTECT, SCSI_ASC_WRITE_PROTECTED);
+		return;
+
+	default:
+		msc_fail(SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ASC_INVALID_COMMAND);
+		return;
+	}
+}
+
+bool udi_msc_pending(void)
+{
+	return msc_enabled && !msc_busy && !msc_halted
+		&& (!msc_opened || msc_cbw_ready || msc_read_left || msc_csw_pending || !msc_cbw_armed);
+}
+
+void udi_msc_poll(void)
+{
+	if (!udi_msc_pending())
+		return;
+
+	if (!msc_opened)
+	{
+		msc_sectors = msc_disk_open();
+		msc_opened = true;
+	}
+
+	// One sector per pass, made up while the last one goes out
+	if (msc_read_left)
+	{
+		msc_disk_read(msc_read_next++, msc_buffer);
+		msc_read_left--;
+		msc_csw.residue -= UDI_MSC_SECTOR_BYTES;
+		msc_send(msc_buffer, UDI_MSC_SECTOR_BYTES, false);
+		return;
+	}
+
+	if (msc_csw_pending)
+	{
+		msc_csw_pending = false;
+		msc_csw.residue = cpu_to_le32(msc_csw.residue);
+		msc_send(&msc_csw, sizeof(msc_csw), false);
+		return;
+	}
+
+	if (msc_cbw_ready)
+	{
+		msc_cbw_ready = false;
+		msc_command();
+		return;
+	}
+
+	msc_cbw_armed = true;
+	msc_busy = true;
+	if (!udd_ep_run(UDI_MSC_EP_OUT, false, (uint8_t *)&msc_cbw, sizeof(msc_cbw), msc_done))
+	{
+		msc_cbw_armed = false;
+		msc_busy = false;
+	}
+}
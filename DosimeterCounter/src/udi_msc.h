@@ -0,0 +1,65 @@
+#ifndef UDI_MSC_H_INCLUDED
+#define UDI_MSC_H_INCLUDED
+
+#include "conf_usb.h"
+#include "usb_protocol.h"
+#include "udc_desc.h"
+#include "udi.h"
+
+// Read-only mass storage interface (USB_MSC_ENABLE): the bulk-only
+// transport and the few SCSI commands hosts send to a read-only disk.
+// The sectors come from msc_disk_read, so the disk can be made up on
+// the fly (see msc_fat.c).  Commands are run by udi_msc_poll from the
+// main loop rather than in the USB interrupt.
+
+#define UDI_MSC_EPS_SIZE 64
+#define UDI_MSC_SECTOR_BYTES 512
+
+extern UDC_DESC_STORAGE udi_api_t udi_api_msc;
+
+COMPILER_PACK_SET(1)
+typedef struct {
+	usb_iface_desc_t iface;
+	usb_ep_desc_t ep_in;
+	usb_ep_desc_t ep_out;
+} udi_msc_desc_t;
+COMPILER_PACK_RESET()
+
+// SCSI transparent command set over the bulk-only transport
+#define UDI_MSC_DESC { \
+   .iface.bLength                = sizeof(usb_iface_desc_t),\
+   .iface.bDescriptorType        = USB_DT_INTERFACE,\
+   .iface.bInterfaceNumber       = UDI_MSC_IFACE_NUMBER,\
+   .iface.bAlternateSetting      = 0,\
+   .iface.bNumEndpoints          = 2,\
+   .iface.bInterfaceClass        = 0x08,\
+   .iface.bInterfaceSubClass     = 0x06,\
+   .iface.bInterfaceProtocol     = 0x50,\
+   .iface.iInterface             = 0,\
+   .ep_in.bLength                = sizeof(usb_ep_desc_t),\
+   .ep_in.bDescriptorType        = USB_DT_ENDPOINT,\
+   .ep_in.bEndpointAddress       = UDI_MSC_EP_IN,\
+   .ep_in.bmAttributes           = USB_EP_TYPE_BULK,\
+   .ep_in.wMaxPacketSize         = LE16(UDI_MSC_EPS_SIZE),\
+   .ep_in.bInterval              = 0,\
+   .ep_out.bLength               = sizeof(usb_ep_desc_t),\
+   .ep_out.bDescriptorType       = USB_DT_ENDPOINT,\
+   .ep_out.bEndpointAddress      = UDI_MSC_EP_OUT,\
+   .ep_out.bmAttributes          = USB_EP_TYPE_BULK,\
+   .ep_out.wMaxPacketSize        = LE16(UDI_MSC_EPS_SIZE),\
+   .ep_out.bInterval             = 0,\
+   }
+
+// Runs the command the host has sent, a sector of a read at a time
+void udi_msc_poll(void);
+
+// True while a command is waiting for udi_msc_poll
+bool udi_msc_pending(void);
+
+// Supplied by the disk.  msc_disk_open is called before the first
+// command after the host configures the interface, and returns the
+// sectors of the disk as it will be until the next time.
+uint32_t msc_disk_open(void);
+void msc_disk_read(uint32_t sector, uint8_t *data);
+
+#endif /* UDI_MSC_H_INCLUDED */
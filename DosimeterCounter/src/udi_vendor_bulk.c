@@ -0,0 +1,72 @@
+#include "conf_usb.h"
+#include "udd.h"
+#include "udi_vendor_bulk.h"
+
+static bool udi_vendor_bulk_enable(void);
+static void udi_vendor_bulk_disable(void);
+static bool udi_vendor_bulk_setup(void);
+static uint8_t udi_vendor_bulk_getsetting(void);
+
+UDC_DESC_STORAGE udi_api_t udi_api_vendor_bulk = {
+	.enable = udi_vendor_bulk_enable,
+	.disable = udi_vendor_bulk_disable,
+	.setup = udi_vendor_bulk_setup,
+	.getsetting = udi_vendor_bulk_getsetting,
+	.sof_notify = NULL,
+};
+
+static volatile bool udi_vendor_bulk_enabled;
+static volatile bool udi_vendor_bulk_busy;
+static volatile bool udi_vendor_bulk_ok;
+
+// The endpoint itself is allocated and freed by the UDC
+static bool udi_vendor_bulk_enable(void)
+{
+	udi_vendor_bulk_enabled = true;
+	return true;
+}
+
+static void udi_vendor_bulk_disable(void)
+{
+	udi_vendor_bulk_enabled = false;
+}
+
+static bool udi_vendor_bulk_setup(void)
+{
+	return false;
+}
+
+static uint8_t udi_vendor_bulk_getsetting(void)
+{
+	return 0;
+}
+
+// Also called with UDD_EP_TRANSFER_ABORT on reset or disconnect
+static void udi_vendor_bulk_done(udd_ep_status_t status, iram_size_t nb_transfered, udd_ep_id_t ep)
+{
+	udi_vendor_bulk_ok = (status == UDD_EP_TRANSFER_OK);
+	udi_vendor_bulk_busy = false;
+}
+
+bool udi_vendor_bulk_is_enabled(void)
+{
+	return udi_vendor_bulk_enabled;
+}
+
+bool udi_vendor_bulk_write(const void *buf, iram_size_t size)
+{
+	if (!udi_vendor_bulk_enabled)
+		return false;
+
+	udi_vendor_bulk_busy = true;
+	if (!udd_ep_run(UDI_VENDOR_BULK_EP_IN, false, (uint8_t *)buf, size, udi_vendor_bulk_done))
+	{
+		udi_vendor_bulk_busy = false;
+		return false;
+	}
+
+	while (udi_vendor_bulk_busy)
+		;
+
+	return udi_vendor_bulk_ok;
+}
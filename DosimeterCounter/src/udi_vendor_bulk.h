@@ -0,0 +1,50 @@
+#ifndef UDI_VENDOR_BULK_H_INCLUDED
+#define UDI_VENDOR_BULK_H_INCLUDED
+
+#include "conf_usb.h"
+#include "usb_protocol.h"
+#include "udc_desc.h"
+#include "udi.h"
+
+// Vendor-specific interface with a single bulk IN endpoint.
+// Count data can be sent here while commands and their text
+// replies stay on the CDC interface.
+
+#define UDI_VENDOR_BULK_EPS_SIZE 64
+
+extern UDC_DESC_STORAGE udi_api_t udi_api_vendor_bulk;
+
+COMPILER_PACK_SET(1)
+typedef struct {
+	usb_iface_desc_t iface;
+	usb_ep_desc_t ep_in;
+} udi_vendor_bulk_desc_t;
+COMPILER_PACK_RESET()
+
+#define UDI_VENDOR_BULK_DESC { \
+   .iface.bLength                = sizeof(usb_iface_desc_t),\
+   .iface.bDescriptorType        = USB_DT_INTERFACE,\
+   .iface.bInterfaceNumber       = UDI_VENDOR_BULK_IFACE_NUMBER,\
+   .iface.bAlternateSetting      = 0,\
+   .iface.bNumEndpoints          = 1,\
+   .iface.bInterfaceClass        = CLASS_VENDOR_SPECIFIC,\
+   .iface.bInterfaceSubClass     = 0,\
+   .iface.bInterfaceProtocol     = 0,\
+   .iface.iInterface             = 0,\
+   .ep_in.bLength                = sizeof(usb_ep_desc_t),\
+   .ep_in.bDescriptorType        = USB_DT_ENDPOINT,\
+   .ep_in.bEndpointAddress       = UDI_VENDOR_BULK_EP_IN,\
+   .ep_in.bmAttributes           = USB_EP_TYPE_BULK,\
+   .ep_in.wMaxPacketSize         = LE16(UDI_VENDOR_BULK_EPS_SIZE),\
+   .ep_in.bInterval              = 0,\
+   }
+
+// True while the host has the interface configured
+bool udi_vendor_bulk_is_enabled(void);
+
+// Sends size bytes from buf and waits for the transfer to complete.
+// No zero-length packet is added, so consecutive writes form one
+// continuous stream that the host splits using the readout headers.
+bool udi_vendor_bulk_write(const void *buf, iram_size_t size);
+
+#endif /* UDI_VENDOR_BULK_H_INCLUDED */
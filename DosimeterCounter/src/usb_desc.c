@@ -0,0 +1,131 @@
+#include "conf_usb.h"
+#include "udd.h"
+#include "udc_desc.h"
+#include "udi_cdc.h"
+#include "udi_vendor_bulk.h"
+#if USB_MSC_ENABLE
+#include "udi_msc.h"
+#endif
+#if USB_DFU_ENABLE
+#include "udi_dfu.h"
+#endif
+
+// Composite device: one CDC function for commands and optionally a
+// second for data, each grouped by an interface association, followed
+// by the vendor bulk interface and, with USB_MSC_ENABLE, the mass
+// storage interface, then with USB_DFU_ENABLE the DFU interface.
+// This replaces the single-function descriptors of udi_cdc_desc.c.
+
+#define USB_DEVICE_NB_INTERFACE (2 * UDI_CDC_PORT_NB + 1 + USB_MSC_ENABLE + USB_DFU_ENABLE)
+
+//! USB Device Descriptor
+COMPILER_WORD_ALIGNED
+UDC_DESC_STORAGE usb_dev_desc_t udc_device_desc = {
+	.bLength                   = sizeof(usb_dev_desc_t),
+	.bDescriptorType           = USB_DT_DEVICE,
+	.bcdUSB                    = LE16(USB_V2_0),
+	.bDeviceClass              = CLASS_IAD,
+	.bDeviceSubClass           = SUB_CLASS_IAD,
+	.bDeviceProtocol           = PROTOCOL_IAD,
+	.bMaxPacketSize0           = USB_DEVICE_EP_CTRL_SIZE,
+	.idVendor                  = LE16(USB_DEVICE_VENDOR_ID),
+	.idProduct                 = LE16(USB_DEVICE_PRODUCT_ID),
+	.bcdDevice                 = LE16((USB_DEVICE_MAJOR_VERSION << 8)
+			| USB_DEVICE_MINOR_VERSION),
+#ifdef USB_DEVICE_MANUFACTURE_NAME
+	.iManufacturer             = 1,
+#else
+	.iManufacturer             = 0,  // No manufacture string
+#endif
+#ifdef USB_DEVICE_PRODUCT_NAME
+	.iProduct                  = 2,
+#else
+	.iProduct                  = 0,  // No product string
+#endif
+#ifdef USB_DEVICE_SERIAL_NAME
+	.iSerialNumber             = 3,
+#else
+	.iSerialNumber             = 0,  // No serial string
+#endif
+	.bNumConfigurations        = 1
+};
+
+//! Structure for USB Device Configuration Descriptor
+COMPILER_PACK_SET(1)
+typedef struct {
+	usb_conf_desc_t conf;
+	usb_iad_desc_t udi_cdc_iad_0;
+	udi_cdc_comm_desc_t udi_cdc_comm_0;
+	udi_cdc_data_desc_t udi_cdc_data_0;
+#if UDI_CDC_PORT_NB > 1
+	usb_iad_desc_t udi_cdc_iad_1;
+	udi_cdc_comm_desc_t udi_cdc_comm_1;
+	udi_cdc_data_desc_t udi_cdc_data_1;
+#endif
+	udi_vendor_bulk_desc_t udi_vendor_bulk;
+#if USB_MSC_ENABLE
+	udi_msc_desc_t udi_msc;
+#endif
+#if USB_DFU_ENABLE
+	udi_dfu_desc_t udi_dfu;
+#endif
+} udc_desc_t;
+COMPILER_PACK_RESET()
+
+//! USB Device Configuration Descriptor filled for full speed
+COMPILER_WORD_ALIGNED
+UDC_DESC_STORAGE udc_desc_t udc_desc_fs = {
+	.conf.bLength              = sizeof(usb_conf_desc_t),
+	.conf.bDescriptorType      = USB_DT_CONFIGURATION,
+	.conf.wTotalLength         = LE16(sizeof(udc_desc_t)),
+	.conf.bNumInterfaces       = USB_DEVICE_NB_INTERFACE,
+	.conf.bConfigurationValue  = 1,
+	.conf.iConfiguration       = 0,
+	.conf.bmAttributes         = USB_CONFIG_ATTR_MUST_SET | USB_DEVICE_ATTR,
+	.conf.bMaxPower            = USB_CONFIG_MAX_POWER(USB_DEVICE_POWER),
+	.udi_cdc_iad_0             = UDI_CDC_IAD_DESC_0,
+	.udi_cdc_comm_0            = UDI_CDC_COMM_DESC_0,
+	.udi_cdc_data_0            = UDI_CDC_DATA_DESC_0_FS,
+#if UDI_CDC_PORT_NB > 1
+	.udi_cdc_iad_1             = UDI_CDC_IAD_DESC_1,
+	.udi_cdc_comm_1            = UDI_CDC_COMM_DESC_1,
+	.udi_cdc_data_1            = UDI_CDC_DATA_DESC_1_FS,
+#endif
+	.udi_vendor_bulk           = UDI_VENDOR_BULK_DESC,
+#if USB_MSC_ENABLE
+	.udi_msc                   = UDI_MSC_DESC,
+#endif
+#if USB_DFU_ENABLE
+	.udi_dfu                   = UDI_DFU_DESC,
+#endif
+};
+
+//! Associate an UDI for each USB interface
+UDC_DESC_STORAGE udi_api_t *udi_apis[USB_DEVICE_NB_INTERFACE] = {
+	&udi_api_cdc_comm,
+	&udi_api_cdc_data,
+#if UDI_CDC_PORT_NB > 1
+	&udi_api_cdc_comm,
+	&udi_api_cdc_data,
+#endif
+	&udi_api_vendor_bulk,
+#if USB_MSC_ENABLE
+	&udi_api_msc,
+#endif
+#if USB_DFU_ENABLE
+	&udi_api_dfu,
+#endif
+};
+
+//! Add UDI with USB Descriptors FS
+UDC_DESC_STORAGE udc_config_speed_t udc_config_fs[1] = { {
+	.desc          = (usb_conf_desc_t UDC_DESC_STORAGE*)&udc_desc_fs,
+	.udi_apis      = udi_apis,
+}};
+
+//! Add all information about USB Device in global structure for UDC
+UDC_DESC_STORAGE udc_config_t udc_config = {
+	.confdev_lsfs = &udc_device_desc,
+	.conf_lsfs = udc_config_fs,
+	.conf_bos = NULL,
+};
@@ -0,0 +1,507 @@
+// Multi-device aggregator for dual-head and multi-scanner setups.
+//
+//   dosimeter_aggregate [options] <port>...
+//
+// Every device is read with M1056 on an I/O thread of its own, all of
+// them on the same host ticks of -i ms, and each thread decodes its own
+// frames, so the work grows with the number of devices across the cores
+// rather than on one.  Frames are timed on a common clock:
+//   wall  the device's wall clock (M1123) gives when counting started,
+//         and the header's sof_count stamps how long after that the
+//         readout was taken.  --set-clock sets every device's clock from
+//         the host's first, as on boards whose columns follow a shared
+//         sync line (M1046) the counting started at the same instant.
+//   host  a device without its clock set is timed by when the host had
+//         its frame, less the least delay seen from its sof_count stamps,
+//         which is only as good as the link's latency is steady.
+// The merger takes one frame from each device each time their times are
+// all within the tolerance, and drops any frame too early to have a
+// partner from every other device.  A merged frame (MergedHeader in
+// dosimeter.hpp) holds the planes of every device's channels in turn.
+//
+// Options
+//   -n <frames>        merged frames to take, 0 until interrupted (default 10)
+//   -r <start> <end>   cell range read from every device (default 0 4095)
+//   -m <mask>          channels read from every device (default 1)
+//   -i <ms>            interval between readouts (default 100)
+//   -t <ms>            tolerance between the frames merged (default half the interval)
+//   --set-clock        set every device's wall clock (M1123) before reading
+//   -o <file>          append the merged frames to a file
+//   --publish <name>   publish them to the ring <name>-merged (ring.hpp)
+
+#include "dosimeter.hpp"
+#include "ring.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+// Frames waiting for their partners in front of the merger, per device
+constexpr size_t QUEUE_FRAMES = 8;
+// As M1123: the stamps follow a new time once two second events have passed
+constexpr auto CLOCK_SETTLE = std::chrono::milliseconds(2500);
+constexpr auto START_DELAY = std::chrono::milliseconds(100);
+// A device is given up after this many readouts in a row fail
+constexpr int FAILURES_MAX = 3;
+
+struct Options
+{
+	int frames = 10;
+	uint16_t start = 0;
+	uint16_t end = 4095;
+	uint16_t mask = 1;
+	int interval_ms = 100;
+	int tolerance_ms = -1;
+	bool set_clock = false;
+	std::string out;
+	std::string publish;
+	std::vector<std::string> ports;
+};
+
+std::atomic<bool> stopping = false;
+
+void on_signal(int)
+{
+	stopping = true;
+}
+
+int64_t unix_us()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// A device's frame, decoded to one plane of cells counts per channel
+struct DeviceFrame
+{
+	int64_t time_us;
+	uint8_t clock;
+	uint8_t flags;
+	std::vector<uint32_t> counts;
+};
+using FramePtr = std::unique_ptr<DeviceFrame>;
+
+struct DeviceTotals
+{
+	uint64_t frames = 0;
+	uint64_t unmatched = 0;
+	uint64_t errors = 0;
+	uint64_t bytes = 0;
+	uint8_t clock = dosimeter::MERGED_CLOCK_HOST;
+};
+
+// Planar blocks hold each channel's columns in turn, interleaved ones all
+// channels of a column together
+void decode(const dosimeter::ContainerHeader &h, std::span<const std::byte> payload, std::vector<uint32_t> &counts)
+{
+	size_t count = std::popcount(h.mask);
+	size_t cells = h.end - h.start + 1;
+	counts.resize(count * cells);
+
+	const std::byte *p = payload.data();
+	for (size_t first = 0; first < cells; first += h.block_columns)
+	{
+		size_t columns = std::min<size_t>(h.block_columns, cells - first);
+		for (size_t k = 0; k < count; k++)
+		{
+			uint32_t *out = counts.data() + k * cells + first;
+			size_t base = h.interleaved ? k : k * columns;
+			size_t step = h.interleaved ? count : 1;
+			for (size_t i = 0; i < columns; i++)
+			{
+				if (h.width == 2)
+				{
+					uint16_t v;
+					std::memcpy(&v, p + (base + i * step) * 2, 2);
+					out[i] = v;
+				}
+				else
+					std::memcpy(&out[i], p + (base + i * step) * 4, 4);
+			}
+		}
+		p += columns * count * h.width + sizeof(uint32_t);
+	}
+}
+
+// Writes merged frames to a file, a ring or both
+class Output
+{
+public:
+	Output(const Options &options, size_t bytes) : bytes_(bytes), frame_(bytes)
+	{
+		if (!options.out.empty())
+		{
+			file_.open(options.out, std::ios::binary | std::ios::app);
+			if (!file_)
+				throw std::runtime_error("cannot open " + options.out);
+		}
+		if (!options.publish.empty())
+			ring_ = std::make_unique<dosimeter::RingWriter>(options.publish + "-merged", QUEUE_FRAMES * 2, bytes);
+	}
+
+	// Where the next frame is built: the ring slot it is published from,
+	// or a buffer when there is no ring
+	std::span<std::byte> frame()
+	{
+		if (ring_)
+			return ring_->claim(ring_->head()).first(bytes_);
+		return frame_;
+	}
+
+	void commit(std::span<const std::byte> frame)
+	{
+		if (file_.is_open())
+			file_.write(reinterpret_cast<const char *>(frame.data()), frame.size());
+		if (ring_)
+			ring_->publish(frame.size(), dosimeter::RING_KIND_MERGED);
+	}
+
+private:
+	size_t bytes_;
+	std::vector<std::byte> frame_;
+	std::ofstream file_;
+	std::unique_ptr<dosimeter::RingWriter> ring_;
+};
+
+class Merger
+{
+public:
+	Merger(const Options &options, Output &output)
+		: options_(options), output_(output), queues_(options.ports.size()), totals_(options.ports.size()),
+		  channels_(std::popcount(options.mask)),
+		  tolerance_us_(1000 * (options.tolerance_ms >= 0 ? options.tolerance_ms : options.interval_ms / 2))
+	{
+	}
+
+	// A frame read from a device; the oldest waiting is dropped if the
+	// device is a queue ahead of the others
+	void push(size_t device, FramePtr frame, size_t bytes)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		DeviceTotals &totals = totals_[device];
+		totals.frames++;
+		totals.bytes += bytes;
+		totals.clock = frame->clock;
+		if (queues_[device].size() == QUEUE_FRAMES)
+		{
+			queues_[device].pop_front();
+			totals.unmatched++;
+		}
+		queues_[device].push_back(std::move(frame));
+		ready_.notify_one();
+	}
+
+	void error(size_t device)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		totals_[device].errors++;
+	}
+
+	// The device's thread has ended; nothing can be merged without it
+	void finish()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		finished_ = true;
+		ready_.notify_one();
+	}
+
+	bool done() const
+	{
+		return done_ || stopping;
+	}
+
+	// Merges until enough frames are taken, a device ends or a signal
+	void run()
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		while (!done_)
+		{
+			ready_.wait_for(lock, std::chrono::milliseconds(100), [this] {
+				return finished_ || stopping || std::all_of(queues_.begin(), queues_.end(),
+					[](const std::deque<FramePtr> &q) { return !q.empty(); });
+			});
+			if (finished_ || stopping)
+				break;
+			if (!std::all_of(queues_.begin(), queues_.end(), [](const std::deque<FramePtr> &q) { return !q.empty(); }))
+				continue;
+
+			// A frame earlier than the latest by more than the tolerance
+			// has missed its partner from that device
+			int64_t latest = INT64_MIN, earliest = INT64_MAX;
+			for (const std::deque<FramePtr> &q : queues_)
+				latest = std::max(latest, q.front()->time_us);
+			bool dropped = false;
+			for (size_t d = 0; d < queues_.size(); d++)
+				if (queues_[d].front()->time_us < latest - tolerance_us_)
+				{
+					queues_[d].pop_front();
+					totals_[d].unmatched++;
+					dropped = true;
+				}
+			if (dropped)
+				continue;
+
+			std::vector<FramePtr> frames;
+			int64_t sum = 0;
+			for (std::deque<FramePtr> &q : queues_)
+			{
+				earliest = std::min(earliest, q.front()->time_us);
+				sum += q.front()->time_us;
+				frames.push_back(std::move(q.front()));
+				q.pop_front();
+			}
+
+			lock.unlock();
+			emit(frames, sum / static_cast<int64_t>(frames.size()), latest - earliest);
+			lock.lock();
+		}
+		done_ = true;
+	}
+
+	void report(double seconds) const
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		std::printf("merged %llu frames of %zu devices in %.3f s: %.1f frames/s, spread mean %.0f us, max %lld us\n",
+			static_cast<unsigned long long>(merged_), queues_.size(), seconds, merged_ / seconds,
+			merged_ ? double(spread_sum_) / merged_ : 0.0, static_cast<long long>(spread_max_));
+		for (size_t d = 0; d < totals_.size(); d++)
+		{
+			const DeviceTotals &t = totals_[d];
+			std::printf("  %-24s %s clock, %llu frames, %llu unmatched, %llu errors, %.2f MB\n",
+				options_.ports[d].c_str(), t.clock == dosimeter::MERGED_CLOCK_WALL ? "wall" : "host",
+				static_cast<unsigned long long>(t.frames), static_cast<unsigned long long>(t.unmatched),
+				static_cast<unsigned long long>(t.errors), t.bytes / 1e6);
+		}
+	}
+
+	bool clean() const
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		return std::none_of(totals_.begin(), totals_.end(), [](const DeviceTotals &t) { return t.errors; });
+	}
+
+private:
+	void emit(const std::vector<FramePtr> &frames, int64_t time_us, int64_t spread_us)
+	{
+		std::span<std::byte> out = output_.frame();
+		dosimeter::MergedHeader header{};
+		header.magic = dosimeter::MERGED_MAGIC;
+		header.version = dosimeter::MERGED_VERSION;
+		header.devices = frames.size();
+		header.planes = frames.size() * channels_;
+		header.start = options_.start;
+		header.end = options_.end;
+		header.time_us = time_us;
+		header.spread_us = spread_us;
+		header.sequence = merged_;
+		std::memcpy(out.data(), &header, sizeof(header));
+
+		std::byte *p = out.data() + sizeof(header);
+		for (const FramePtr &frame : frames)
+		{
+			dosimeter::MergedDevice device{options_.mask, frame->flags, frame->clock,
+				static_cast<int32_t>(frame->time_us - time_us)};
+			std::memcpy(p, &device, sizeof(device));
+			p += sizeof(device);
+		}
+		for (const FramePtr &frame : frames)
+		{
+			std::memcpy(p, frame->counts.data(), frame->counts.size() * sizeof(uint32_t));
+			p += frame->counts.size() * sizeof(uint32_t);
+		}
+		output_.commit(out.first(p - out.data()));
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		merged_++;
+		spread_sum_ += spread_us;
+		spread_max_ = std::max(spread_max_, spread_us);
+		if (options_.frames > 0 && merged_ >= static_cast<uint64_t>(options_.frames))
+			done_ = true;
+	}
+
+	const Options &options_;
+	Output &output_;
+	mutable std::mutex mutex_;
+	std::condition_variable ready_;
+	std::vector<std::deque<FramePtr>> queues_;
+	std::vector<DeviceTotals> totals_;
+	size_t channels_;
+	int64_t tolerance_us_;
+	std::atomic<bool> done_ = false;
+	bool finished_ = false;
+	uint64_t merged_ = 0;
+	int64_t spread_sum_ = 0;
+	int64_t spread_max_ = 0;
+};
+
+void set_clock(dosimeter::Client &client, const std::string &port)
+{
+	int64_t now = unix_us();
+	const int32_t args[] = {static_cast<int32_t>(now / 1000000), static_cast<int32_t>(now % 1000000)};
+	dosimeter::Reply reply = client.command(1123, args).get();
+	if (reply.error)
+		std::fprintf(stderr, "%s: M1123 failed, frames are timed by the host\n", port.c_str());
+}
+
+void device_thread(size_t device, const std::string &port, const Options &options, Clock::time_point t0,
+	Merger &merger)
+{
+	dosimeter::Client client(port);
+	if (options.set_clock)
+		set_clock(client, port);
+
+	size_t cells = options.end - options.start + 1;
+	std::vector<std::byte> buffer(dosimeter::container_capacity(cells, options.mask));
+	auto interval = std::chrono::milliseconds(options.interval_ms);
+	// Host time less the device's sof_count, the least seen
+	int64_t host_offset_us = INT64_MAX;
+	int failures = 0;
+
+	for (int64_t tick = 0; !merger.done() && failures < FAILURES_MAX; tick++)
+	{
+		// Ticks missed by a slow readout are skipped, not made up
+		tick = std::max<int64_t>(tick, (Clock::now() - t0) / interval);
+		std::this_thread::sleep_until(t0 + tick * interval);
+
+		try
+		{
+			dosimeter::ContainerHeader h = client.read_container(false, options.start, options.end, options.mask, buffer).get();
+			int64_t now = unix_us();
+
+			auto frame = std::make_unique<DeviceFrame>();
+			frame->flags = h.flags;
+			host_offset_us = std::min(host_offset_us, now - int64_t(h.read) * 1000);
+			if (h.version >= 2 && h.wall_started)
+			{
+				frame->clock = dosimeter::MERGED_CLOCK_WALL;
+				frame->time_us = int64_t(h.wall_started) * 1000000 + h.wall_started_us
+					+ int64_t(uint32_t(h.read - h.started)) * 1000;
+			}
+			else
+			{
+				frame->clock = dosimeter::MERGED_CLOCK_HOST;
+				frame->time_us = int64_t(h.read) * 1000 + host_offset_us;
+			}
+
+			size_t bytes = dosimeter::container_payload_bytes(h);
+			decode(h, std::span<const std::byte>(buffer).first(bytes), frame->counts);
+			merger.push(device, std::move(frame), bytes);
+			failures = 0;
+		}
+		catch (const std::exception &e)
+		{
+			std::fprintf(stderr, "%s: %s\n", port.c_str(), e.what());
+			merger.error(device);
+			failures++;
+		}
+	}
+}
+
+bool parse_options(int argc, char **argv, Options &options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		auto more = [&](int count) { return i + count < argc; };
+		if (arg == "-n" && more(1))
+			options.frames = std::atoi(argv[++i]);
+		else if (arg == "-r" && more(2))
+		{
+			options.start = std::atoi(argv[++i]);
+			options.end = std::atoi(argv[++i]);
+		}
+		else if (arg == "-m" && more(1))
+			options.mask = std::strtoul(argv[++i], nullptr, 0);
+		else if (arg == "-i" && more(1))
+			options.interval_ms = std::atoi(argv[++i]);
+		else if (arg == "-t" && more(1))
+			options.tolerance_ms = std::atoi(argv[++i]);
+		else if (arg == "--set-clock")
+			options.set_clock = true;
+		else if (arg == "-o" && more(1))
+			options.out = argv[++i];
+		else if (arg == "--publish" && more(1))
+			options.publish = argv[++i];
+		else if (arg.size() > 1 && arg[0] == '-')
+			return false;
+		else
+			options.ports.push_back(arg);
+	}
+
+	return !options.ports.empty() && options.frames >= 0 && options.interval_ms > 0
+		&& options.end >= options.start && options.mask;
+}
+
+}  // namespace
+
+int main(int argc, char **argv)
+{
+	Options options;
+	if (!parse_options(argc, argv, options))
+	{
+		std::fprintf(stderr, "usage: %s [-n frames] [-r start end] [-m mask] [-i ms] [-t ms] [--set-clock]\n"
+			"    [-o file] [--publish name] <port>...\n", argv[0]);
+		return 2;
+	}
+
+	std::signal(SIGINT, on_signal);
+	std::signal(SIGTERM, on_signal);
+	try
+	{
+		size_t cells = options.end - options.start + 1;
+		size_t planes = options.ports.size() * std::popcount(options.mask);
+		Output output(options, sizeof(dosimeter::MergedHeader) + options.ports.size() * sizeof(dosimeter::MergedDevice)
+			+ planes * cells * sizeof(uint32_t));
+		Merger merger(options, output);
+
+		// Every device is read on the same ticks, once any new clock has settled
+		auto t0 = Clock::now() + (options.set_clock ? CLOCK_SETTLE : START_DELAY);
+		auto start = Clock::now();
+		std::vector<std::thread> devices;
+		for (size_t d = 0; d < options.ports.size(); d++)
+			devices.emplace_back([&, d] {
+				try
+				{
+					device_thread(d, options.ports[d], options, t0, merger);
+				}
+				catch (const std::exception &e)
+				{
+					std::fprintf(stderr, "%s: %s\n", options.ports[d].c_str(), e.what());
+					merger.error(d);
+				}
+				merger.finish();
+			});
+
+		merger.run();
+		for (std::thread &t : devices)
+			t.join();
+
+		double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+		merger.report(seconds);
+		return merger.clean() ? 0 : 1;
+	}
+	catch (const std::exception &e)
+	{
+		std::fprintf(stderr, "dosimeter_aggregate: %s\n", e.what());
+		return 1;
+	}
+}
@@ -0,0 +1,308 @@
+#include "archive.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace dosimeter {
+
+namespace {
+
+[[noreturn]] void throw_errno(const std::string &what)
+{
+	throw std::system_error(errno, std::generic_category(), what);
+}
+
+// The map's columns, or the whole range as one row if the header has none
+size_t map_columns(const ContainerHeader &header)
+{
+	return header.columns ? header.columns : header.end + 1;
+}
+
+uint32_t index_crc(const std::vector<ArchiveFrame> &frames, const std::vector<ArchiveRow> &rows)
+{
+	uint32_t crc = crc32(frames.data(), frames.size() * sizeof(ArchiveFrame));
+	return crc32(rows.data(), rows.size() * sizeof(ArchiveRow), crc);
+}
+
+// The tables and the trailer, written where the containers end
+void write_index(std::ostream &out, uint64_t offset, const std::vector<ArchiveFrame> &frames,
+	const std::vector<ArchiveRow> &rows)
+{
+	ArchiveTrailer trailer{};
+	trailer.magic = ARCHIVE_MAGIC;
+	trailer.version = ARCHIVE_VERSION;
+	trailer.trailer_bytes = sizeof(trailer);
+	trailer.index_offset = offset;
+	trailer.frames = frames.size();
+	trailer.rows = rows.size();
+	trailer.index_crc = index_crc(frames, rows);
+	trailer.crc = crc32(&trailer, offsetof(ArchiveTrailer, crc));
+
+	out.write(reinterpret_cast<const char *>(frames.data()), frames.size() * sizeof(ArchiveFrame));
+	out.write(reinterpret_cast<const char *>(rows.data()), rows.size() * sizeof(ArchiveRow));
+	out.write(reinterpret_cast<const char *>(&trailer), sizeof(trailer));
+}
+
+// Adds a container at offset to the tables
+void index_container(const ContainerHeader &header, uint64_t offset, std::vector<ArchiveFrame> &frames,
+	std::vector<ArchiveRow> &rows)
+{
+	if (frames.size() >= UINT32_MAX || rows.size() >= UINT32_MAX - UINT16_MAX)
+		throw std::length_error("archive index full");
+
+	uint16_t first;
+	uint32_t count;
+	container_rows(header, first, count);
+	uint32_t frame = frames.size();
+	frames.push_back({offset, static_cast<uint32_t>(rows.size()), count});
+	for (uint32_t i = 0; i < count; i++)
+		rows.push_back({frame, static_cast<uint16_t>(first + i), 0});
+}
+
+}  // namespace
+
+void container_rows(const ContainerHeader &header, uint16_t &first, uint32_t &rows)
+{
+	size_t columns = map_columns(header);
+	first = header.start / columns;
+	rows = header.end / columns - first + 1;
+}
+
+ArchiveWriter::ArchiveWriter(const std::string &path)
+	: path_(path), file_(path, std::ios::binary | std::ios::trunc)
+{
+	if (!file_)
+		throw std::runtime_error("cannot create " + path);
+}
+
+ArchiveWriter::~ArchiveWriter()
+{
+	try
+	{
+		close();
+	}
+	catch (const std::exception &)
+	{
+		// Without its index the archive is still read by walking it
+	}
+}
+
+void ArchiveWriter::append(const ContainerHeader &header, std::span<const std::byte> payload)
+{
+	if (closed_)
+		throw std::logic_error("archive closed");
+	if (!container_valid(header) || payload.size() != container_payload_bytes(header))
+		throw std::invalid_argument("not a container");
+
+	index_container(header, offset_, frames_, rows_);
+	// Padded to header_bytes, so the blocks are where the header says
+	static const char zeros[256] = {};
+	file_.write(reinterpret_cast<const char *>(&header), sizeof(header));
+	for (size_t pad = header.header_bytes - sizeof(header); pad; )
+	{
+		size_t n = std::min(pad, sizeof(zeros));
+		file_.write(zeros, n);
+		pad -= n;
+	}
+	file_.write(reinterpret_cast<const char *>(payload.data()), payload.size());
+	if (!file_)
+		throw std::runtime_error("cannot write " + path_);
+	offset_ += header.header_bytes + payload.size();
+}
+
+void ArchiveWriter::close()
+{
+	if (closed_)
+		return;
+	closed_ = true;
+	write_index(file_, offset_, frames_, rows_);
+	file_.close();
+	if (!file_)
+		throw std::runtime_error("cannot write " + path_);
+}
+
+size_t archive_index(const std::string &path)
+{
+	std::vector<ArchiveFrame> frames;
+	std::vector<ArchiveRow> rows;
+	uint64_t offset;
+	{
+		ArchiveReader reader(path);
+		if (reader.indexed())
+			return reader.frames();
+		for (size_t i = 0; i < reader.frames(); i++)
+			frames.push_back(reader.frame(i));
+		for (size_t i = 0; i < reader.rows(); i++)
+			rows.push_back(reader.row(i));
+		offset = reader.data_bytes();
+	}
+
+	if (::truncate(path.c_str(), offset) != 0)
+		throw_errno("truncate " + path);
+	std::ofstream file(path, std::ios::binary | std::ios::app);
+	write_index(file, offset, frames, rows);
+	file.close();
+	if (!file)
+		throw std::runtime_error("cannot write " + path);
+	return frames.size();
+}
+
+ArchiveReader::ArchiveReader(const std::string &path)
+{
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw_errno("open " + path);
+	struct stat st;
+	if (::fstat(fd, &st) != 0)
+	{
+		int error = errno;
+		::close(fd);
+		errno = error;
+		throw_errno("stat " + path);
+	}
+	size_ = st.st_size;
+	void *map = size_ ? ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0) : nullptr;
+	int error = errno;
+	::close(fd);
+	if (map == MAP_FAILED)
+	{
+		errno = error;
+		throw_errno("mmap " + path);
+	}
+	data_ = static_cast<const std::byte *>(map);
+
+	ArchiveTrailer trailer{};
+	if (size_ >= sizeof(trailer))
+		std::memcpy(&trailer, data_ + size_ - sizeof(trailer), sizeof(trailer));
+	uint64_t tables = uint64_t(trailer.frames) * sizeof(ArchiveFrame) + uint64_t(trailer.rows) * sizeof(ArchiveRow);
+	indexed_ = trailer.magic == ARCHIVE_MAGIC && trailer.version == ARCHIVE_VERSION
+		&& trailer.trailer_bytes == sizeof(trailer) && trailer.crc == crc32(&trailer, offsetof(ArchiveTrailer, crc))
+		&& trailer.index_offset <= size_ && size_ - trailer.index_offset == tables + sizeof(trailer);
+	if (indexed_)
+	{
+		const std::byte *index = data_ + trailer.index_offset;
+		frames_.resize(trailer.frames);
+		rows_.resize(trailer.rows);
+		std::memcpy(frames_.data(), index, frames_.size() * sizeof(ArchiveFrame));
+		std::memcpy(rows_.data(), index + frames_.size() * sizeof(ArchiveFrame), rows_.size() * sizeof(ArchiveRow));
+		indexed_ = trailer.index_crc == index_crc(frames_, rows_);
+	}
+
+	if (indexed_)
+	{
+		data_bytes_ = trailer.index_offset;
+		// A viewer goes wherever it is sent, so read ahead buys nothing
+		::madvise(map, size_, MADV_RANDOM);
+	}
+	else
+	{
+		frames_.clear();
+		rows_.clear();
+		walk();
+	}
+}
+
+ArchiveReader::~ArchiveReader()
+{
+	if (data_)
+		::munmap(const_cast<std::byte *>(data_), size_);
+}
+
+void ArchiveReader::walk()
+{
+	uint64_t offset = 0;
+	while (size_ - offset >= sizeof(ContainerHeader))
+	{
+		ContainerHeader h;
+		std::memcpy(&h, data_ + offset, sizeof(h));
+		if (!container_valid(h) || size_ - offset - sizeof(h) < h.header_bytes - sizeof(h)
+			|| size_ - offset - h.header_bytes < container_payload_bytes(h))
+			break;
+		index_container(h, offset, frames_, rows_);
+		offset += h.header_bytes + container_payload_bytes(h);
+	}
+	data_bytes_ = offset;
+}
+
+ContainerHeader ArchiveReader::header(size_t frame) const
+{
+	ContainerHeader h;
+	std::memcpy(&h, data_ + frames_.at(frame).offset, sizeof(h));
+	if (!container_valid(h))
+		throw std::runtime_error("container header corrupt in frame " + std::to_string(frame));
+	return h;
+}
+
+std::span<const std::byte> ArchiveReader::payload(size_t frame) const
+{
+	ContainerHeader h = header(frame);
+	return {data_ + frames_[frame].offset + h.header_bytes, container_payload_bytes(h)};
+}
+
+size_t ArchiveReader::read_row(size_t index, uint16_t channel, std::span<uint32_t> out) const
+{
+	const ArchiveRow &r = rows_.at(index);
+	ContainerHeader h = header(r.frame);
+	if (channel >= 16 || !(h.mask & (1u << channel)))
+		throw std::invalid_argument("channel " + std::to_string(channel) + " not in frame " + std::to_string(r.frame));
+	size_t columns = map_columns(h);
+	if (out.size() < columns)
+		throw std::length_error("row buffer too small");
+	std::fill(out.begin(), out.begin() + columns, 0);
+
+	// The cells of the row the frame holds, and the blocks they are in.  Every
+	// block but the last is block_columns cells, so each is found directly.
+	size_t count = std::popcount(h.mask);
+	size_t k = std::popcount(static_cast<uint16_t>(h.mask & ((1u << channel) - 1)));
+	size_t cells = h.end - h.start + 1;
+	size_t row_start = size_t(r.row) * columns;
+	size_t first = std::max<size_t>(h.start, row_start) - h.start;
+	size_t last = std::min<size_t>(h.end, row_start + columns - 1) - h.start;
+	size_t block_bytes = h.block_columns * count * h.width + sizeof(uint32_t);
+	std::span<const std::byte> blocks = payload(r.frame);
+
+	for (size_t block = first / h.block_columns; block <= last / h.block_columns; block++)
+	{
+		size_t block_first = block * h.block_columns;
+		size_t block_cells = std::min<size_t>(h.block_columns, cells - block_first);
+		const std::byte *p = blocks.data() + block * block_bytes;
+		size_t length = block_cells * count * h.width;
+		uint32_t crc;
+		std::memcpy(&crc, p + length, sizeof(crc));
+		if (crc != crc32(p, length))
+			throw std::runtime_error("block CRC mismatch in frame " + std::to_string(r.frame));
+
+		// Planar blocks hold each channel's cells in turn, interleaved ones
+		// all channels of a cell together
+		size_t base = h.interleaved ? k : k * block_cells;
+		size_t step = h.interleaved ? count : 1;
+		size_t from = std::max(first, block_first), to = std::min(last, block_first + block_cells - 1);
+		for (size_t cell = from; cell <= to; cell++)
+		{
+			const std::byte *v = p + (base + (cell - block_first) * step) * h.width;
+			uint32_t value;
+			if (h.width == 2)
+			{
+				uint16_t v16;
+				std::memcpy(&v16, v, sizeof(v16));
+				value = v16;
+			}
+			else
+				std::memcpy(&value, v, sizeof(value));
+			out[h.start + cell - row_start] = value;
+		}
+	}
+	return columns;
+}
+
+}  // namespace dosimeter
@@ -0,0 +1,142 @@
+// Frame archive: M1056 containers appended to one file as they are read,
+// followed by an index, so a viewer maps a session of any size and goes
+// straight to one frame or one row of it.
+//
+//   container 0, container 1, ...   as the device sent them, header and blocks
+//   ArchiveFrame[frames]            where each container starts
+//   ArchiveRow[rows]                the frame and map row of each row of
+//                                   the session, in the order recorded
+//   ArchiveTrailer                  the last bytes of the file
+//
+// A row of the session is one row of the map (ContainerHeader rows by
+// columns cells) as one frame holds it, whole or, at the ends of a range
+// that is not row aligned, in part.  A file without a trailer, from a
+// writer that never closed or from before the index, is still a run of
+// containers: ArchiveReader indexes it by walking them, and
+// dosimeter_archive index writes the index onto it.
+
+#pragma once
+
+#include "dosimeter.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <span>
+#include <string>
+#include <vector>
+
+namespace dosimeter {
+
+struct ArchiveFrame
+{
+	uint64_t offset;     // Of the container header from the start of the file
+	uint32_t first_row;  // Index of its first row of the session
+	uint32_t rows;
+};
+static_assert(sizeof(ArchiveFrame) == 16);
+
+struct ArchiveRow
+{
+	uint32_t frame;
+	uint16_t row;  // Of the map
+	uint16_t reserved;
+};
+static_assert(sizeof(ArchiveRow) == 8);
+
+struct ArchiveTrailer
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t trailer_bytes;
+	uint64_t index_offset;  // Of the first ArchiveFrame
+	uint32_t frames;
+	uint32_t rows;
+	uint32_t index_crc;     // CRC-32 of the ArchiveFrame and ArchiveRow tables
+	uint32_t crc;           // CRC-32 of the fields above
+};
+static_assert(sizeof(ArchiveTrailer) == 32);
+
+constexpr uint32_t ARCHIVE_MAGIC = 0x58444944;  // "DIDX"
+constexpr uint16_t ARCHIVE_VERSION = 1;
+
+// The map rows a container holds cells of: first, and how many
+void container_rows(const ContainerHeader &header, uint16_t &first, uint32_t &rows);
+
+class ArchiveWriter
+{
+public:
+	// Creates the file, or replaces it
+	explicit ArchiveWriter(const std::string &path);
+	// Closes the archive if close() was not called
+	~ArchiveWriter();
+
+	ArchiveWriter(const ArchiveWriter &) = delete;
+	ArchiveWriter &operator=(const ArchiveWriter &) = delete;
+
+	// A container with its blocks, as read_container gives them
+	void append(const ContainerHeader &header, std::span<const std::byte> payload);
+	// Writes the index and the trailer
+	void close();
+
+	size_t frames() const { return frames_.size(); }
+
+private:
+	std::string path_;
+	std::ofstream file_;
+	uint64_t offset_ = 0;
+	std::vector<ArchiveFrame> frames_;
+	std::vector<ArchiveRow> rows_;
+	bool closed_ = false;
+};
+
+// Writes the index of an archive that has none, walking its containers.
+// Returns the frames indexed; bytes after the last whole container are cut.
+size_t archive_index(const std::string &path);
+
+class ArchiveReader
+{
+public:
+	// Maps the file and reads its index, or builds one by walking the
+	// containers up to the first that is not whole
+	explicit ArchiveReader(const std::string &path);
+	~ArchiveReader();
+
+	ArchiveReader(const ArchiveReader &) = delete;
+	ArchiveReader &operator=(const ArchiveReader &) = delete;
+
+	// Whether the file has an index of its own
+	bool indexed() const { return indexed_; }
+	uint64_t bytes() const { return size_; }
+	// Where the last whole container ends
+	uint64_t data_bytes() const { return data_bytes_; }
+
+	size_t frames() const { return frames_.size(); }
+	size_t rows() const { return rows_.size(); }
+	const ArchiveFrame &frame(size_t index) const { return frames_.at(index); }
+	const ArchiveRow &row(size_t index) const { return rows_.at(index); }
+
+	// The header and the blocks of a frame, in the mapping and unchecked.
+	// Containers of 16-bit counts need not start 4-byte aligned, so the
+	// header is a copy.
+	ContainerHeader header(size_t frame) const;
+	std::span<const std::byte> payload(size_t frame) const;
+
+	// The counts of one channel along a row of the session, decoded from
+	// the blocks holding it, which are checked.  out holds a count for
+	// each column of the map; columns outside the frame's range are 0.
+	// Returns the columns of the map.
+	size_t read_row(size_t index, uint16_t channel, std::span<uint32_t> out) const;
+
+private:
+	void walk();
+
+	const std::byte *data_ = nullptr;
+	size_t size_ = 0;
+	bool indexed_ = false;
+	uint64_t data_bytes_ = 0;
+	std::vector<ArchiveFrame> frames_;
+	std::vector<ArchiveRow> rows_;
+};
+
+}  // namespace dosimeter
@@ -0,0 +1,247 @@
+// Frame archives (archive.hpp): recording, indexing and random access.
+//
+//   dosimeter_archive record [options] <port> <file>
+//   dosimeter_archive index <file>
+//   dosimeter_archive info <file>
+//   dosimeter_archive row [-c channel] <file> <row>
+//
+// record reads M1056 frames, -d at a time, and appends each to the archive
+// as it arrives; the index is written once it stops, after -n frames or on
+// SIGINT or SIGTERM.  index writes the index onto an archive without one,
+// such as a recording that was killed or an older file of containers,
+// cutting off a container it holds only part of.  info prints the frames
+// and rows of an archive, and row prints one row of the session (0 is the
+// first row recorded) as counts of one channel, one line, reading only the
+// blocks that hold it.
+//
+// Options of record
+//   -n <frames>        frames recorded, 0 until stopped (default 0)
+//   -r <start> <end>   cell range of frames (default 0 4095)
+//   -m <mask>          channels of frames (default 1)
+//   -d <depth>         readouts kept in flight (default 2)
+//   -i <ms>            interval between frames, 0 for back to back (default 0)
+//   --capture <path>   record the device session, for dosimeter_replay
+
+#include "archive.hpp"
+#include "dosimeter.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <future>
+#include <string>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+struct Options
+{
+	uint64_t frames = 0;
+	uint16_t start = 0;
+	uint16_t end = 4095;
+	uint16_t mask = 1;
+	int depth = 2;
+	int interval_ms = 0;
+	uint16_t channel = 0;
+	bool channel_set = false;
+	std::string capture;
+	std::vector<std::string> positional;  // The command and its arguments
+};
+
+std::atomic<bool> stopping = false;
+
+void on_signal(int)
+{
+	stopping = true;
+}
+
+int record(const std::string &port, const std::string &path, const Options &options)
+{
+	size_t cells = options.end - options.start + 1;
+	size_t capacity = dosimeter::container_capacity(cells, options.mask);
+
+	dosimeter::Client client(port, options.capture);
+	dosimeter::ArchiveWriter archive(path);
+
+	struct Readout
+	{
+		std::vector<std::byte> buffer;
+		std::future<dosimeter::ContainerHeader> done;
+	};
+	std::deque<Readout> readouts;
+	uint64_t requested = 0, errors = 0, bytes = 0;
+	auto interval = std::chrono::milliseconds(options.interval_ms);
+	auto due = Clock::now();
+	auto t0 = Clock::now();
+
+	for (;;)
+	{
+		bool more = !stopping && (!options.frames || requested < options.frames);
+		if (more && readouts.size() < static_cast<size_t>(options.depth) && Clock::now() >= due)
+		{
+			Readout &r = readouts.emplace_back();
+			r.buffer.resize(capacity);
+			r.done = client.read_container(false, options.start, options.end, options.mask, r.buffer);
+			requested++;
+			due = std::max(due + interval, Clock::now());
+			continue;
+		}
+		if (readouts.empty())
+		{
+			if (!more)
+				break;
+			std::this_thread::sleep_until(due);
+			continue;
+		}
+
+		Readout &front = readouts.front();
+		if (more && readouts.size() < static_cast<size_t>(options.depth)
+			&& front.done.wait_until(due) != std::future_status::ready)
+			continue;
+		try
+		{
+			dosimeter::ContainerHeader header = front.done.get();
+			size_t length = dosimeter::container_payload_bytes(header);
+			archive.append(header, std::span<const std::byte>(front.buffer).first(length));
+			bytes += header.header_bytes + length;
+		}
+		catch (const std::exception &e)
+		{
+			std::fprintf(stderr, "%s: %s\n", port.c_str(), e.what());
+			errors++;
+		}
+		readouts.pop_front();
+	}
+
+	archive.close();
+	double seconds = std::chrono::duration<double>(Clock::now() - t0).count();
+	std::printf("%zu frames to %s in %.2f s, %.2f MB/s, errors %llu\n", archive.frames(), path.c_str(), seconds,
+		bytes / seconds / 1e6, static_cast<unsigned long long>(errors));
+	return errors ? 1 : 0;
+}
+
+int info(const std::string &path)
+{
+	dosimeter::ArchiveReader archive(path);
+	std::printf("%s: %zu frames, %zu rows, %llu bytes, %s\n", path.c_str(), archive.frames(), archive.rows(),
+		static_cast<unsigned long long>(archive.bytes()), archive.indexed() ? "indexed" : "no index");
+	if (!archive.indexed() && archive.data_bytes() < archive.bytes())
+		std::printf("  %llu bytes after the last whole container\n",
+			static_cast<unsigned long long>(archive.bytes() - archive.data_bytes()));
+	if (archive.frames())
+	{
+		dosimeter::ContainerHeader first = archive.header(0), last = archive.header(archive.frames() - 1);
+		std::printf("  cells %u-%u, mask 0x%x, %u x %u map, started %u ms to %u ms\n", first.start, first.end,
+			first.mask, first.rows, first.columns, first.started, last.started);
+	}
+	return 0;
+}
+
+int row(const std::string &path, size_t index, const Options &options)
+{
+	dosimeter::ArchiveReader archive(path);
+	if (index >= archive.rows())
+	{
+		std::fprintf(stderr, "%s has %zu rows\n", path.c_str(), archive.rows());
+		return 1;
+	}
+	const dosimeter::ArchiveRow &r = archive.row(index);
+	dosimeter::ContainerHeader h = archive.header(r.frame);
+	uint16_t channel = options.channel_set ? options.channel : std::countr_zero(h.mask);
+
+	std::vector<uint32_t> counts(h.columns ? h.columns : h.end + 1);
+	size_t columns = archive.read_row(index, channel, counts);
+	std::printf("# frame %u row %u channel %u started %u ms\n", r.frame, r.row, channel, h.started);
+	for (size_t c = 0; c < columns; c++)
+		std::printf(c ? " %u" : "%u", counts[c]);
+	std::printf("\n");
+	return 0;
+}
+
+bool parse_options(int argc, char **argv, Options &options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		auto more = [&](int count) { return i + count < argc; };
+		if (arg == "-n" && more(1))
+			options.frames = std::strtoull(argv[++i], nullptr, 0);
+		else if (arg == "-r" && more(2))
+		{
+			options.start = std::atoi(argv[++i]);
+			options.end = std::atoi(argv[++i]);
+		}
+		else if (arg == "-m" && more(1))
+			options.mask = std::strtoul(argv[++i], nullptr, 0);
+		else if (arg == "-d" && more(1))
+			options.depth = std::atoi(argv[++i]);
+		else if (arg == "-i" && more(1))
+			options.interval_ms = std::atoi(argv[++i]);
+		else if (arg == "-c" && more(1))
+		{
+			options.channel = std::atoi(argv[++i]);
+			options.channel_set = true;
+		}
+		else if (arg == "--capture" && more(1))
+			options.capture = argv[++i];
+		else if (arg.size() > 1 && arg[0] == '-')
+			return false;
+		else
+			options.positional.push_back(arg);
+	}
+
+	if (options.positional.empty())
+		return false;
+	const std::string &command = options.positional[0];
+	size_t arguments = command == "record" || command == "row" ? 3 : command == "index" || command == "info" ? 2 : 0;
+	return options.positional.size() == arguments && options.depth > 0 && options.interval_ms >= 0
+		&& options.end >= options.start && options.mask && options.channel < 16;
+}
+
+}  // namespace
+
+int main(int argc, char **argv)
+{
+	Options options;
+	if (!parse_options(argc, argv, options))
+	{
+		std::fprintf(stderr, "usage: %s record [-n frames] [-r start end] [-m mask] [-d depth] [-i ms]\n"
+			"    [--capture path] <port> <file>\n"
+			"       %s index <file>\n"
+			"       %s info <file>\n"
+			"       %s row [-c channel] <file> <row>\n", argv[0], argv[0], argv[0], argv[0]);
+		return 2;
+	}
+
+	std::signal(SIGINT, on_signal);
+	std::signal(SIGTERM, on_signal);
+	try
+	{
+		const std::vector<std::string> &p = options.positional;
+		if (p[0] == "record")
+			return record(p[1], p[2], options);
+		if (p[0] == "index")
+		{
+			size_t frames = dosimeter::archive_index(p[1]);
+			std::printf("%s: %zu frames indexed\n", p[1].c_str(), frames);
+			return 0;
+		}
+		if (p[0] == "info")
+			return info(p[1]);
+		return row(p[1], std::strtoull(p[2].c_str(), nullptr, 0), options);
+	}
+	catch (const std::exception &e)
+	{
+		std::fprintf(stderr, "dosimeter_archive: %s\n", e.what());
+		return 1;
+	}
+}
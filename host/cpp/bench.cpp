@@ -0,0 +1,73 @@
+// Readout throughput and command latency over the framed protocol.
+//
+//   dosimeter_bench <port> [channel] [start] [end] [rounds] [depth]
+//
+// Keeps depth M1015 readouts in flight at once, which is how the client
+// is meant to be driven when streaming a profile.
+
+#include "dosimeter.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+	{
+		std::fprintf(stderr, "usage: %s <port> [channel] [start] [end] [rounds] [depth]\n", argv[0]);
+		return 2;
+	}
+
+	uint8_t channel = argc > 2 ? std::atoi(argv[2]) : 0;
+	uint16_t start = argc > 3 ? std::atoi(argv[3]) : 0;
+	uint16_t end = argc > 4 ? std::atoi(argv[4]) : 4095;
+	int rounds = argc > 5 ? std::atoi(argv[5]) : 200;
+	int depth = argc > 6 ? std::atoi(argv[6]) : 4;
+	if (end < start || rounds < 1 || depth < 1)
+	{
+		std::fprintf(stderr, "bad arguments\n");
+		return 2;
+	}
+
+	try
+	{
+		dosimeter::Client client(argv[1]);
+
+		// Round trip of the smallest command, one at a time
+		const int pings = 100;
+		auto t0 = Clock::now();
+		for (int i = 0; i < pings; i++)
+			client.command(1001).get();
+		double latency = std::chrono::duration<double, std::micro>(Clock::now() - t0).count() / pings;
+		std::printf("latency %.1f us\n", latency);
+
+		size_t cells = end - start + 1;
+		std::vector<std::vector<uint16_t>> buffers(depth, std::vector<uint16_t>(cells));
+		std::vector<std::future<dosimeter::ReadoutHeader>> inflight(depth);
+
+		uint64_t bytes = 0;
+		t0 = Clock::now();
+		for (int i = 0; i < rounds + depth; i++)
+		{
+			int slot = i % depth;
+			if (inflight[slot].valid())
+				bytes += inflight[slot].get().length;
+			if (i < rounds)
+				inflight[slot] = client.read_counts(channel, start, end, buffers[slot]);
+		}
+		double seconds = std::chrono::duration<double>(Clock::now() - t0).count();
+		std::printf("readout %d x %zu cells, depth %d: %.2f MB/s, %.1f readouts/s\n",
+			rounds, cells, depth, bytes / seconds / 1e6, rounds / seconds);
+	}
+	catch (const std::exception &e)
+	{
+		std::fprintf(stderr, "error: %s\n", e.what());
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,301 @@
+// Fuzzing and throughput of the firmware's command parser and frame check,
+// built natively from command.c.
+//
+//   dosimeter_command_fuzz [options]
+//
+// Draws a pool of inputs from the seed and checks what the firmware does
+// with each:
+//   lines    random bytes and well-formed "M<code> <args>" lines through
+//            parse_command, bounded by end or by their terminator; the code
+//            and arguments must match a plain model of the syntax, and
+//            digits placed just past end must never be read
+//   frames   random, well-formed and corrupted command frames through
+//            frame_check; a frame passes exactly if its length holds whole
+//            arguments, at most COMMAND_MAX_ARGS, agrees with the bytes
+//            received and its CRC-16 matches
+// then runs each over the pool -n times in all and reports the calls per
+// second.  Prints each failed input and exits 1 if there was any.
+//
+// The step generators, counters and encoders in main.c still drive the
+// TC and PIO registers themselves, so there is no mock of those here;
+// only the parts of the firmware without hardware access build natively.
+//
+// Options
+//   -n <calls>         calls timed of each kind (default 1000000)
+//   -p <inputs>        inputs of each kind drawn and checked (default 100000)
+//   -s <seed>          seed of the inputs (default 1)
+
+extern "C" {
+#include "command.h"
+#include "crc.h"
+}
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+// The dispatch limit of main.c: codes past it are not accumulated further
+constexpr uint32_t CODE_LIMIT = 1131;
+// Follows the line, past end, so reading beyond it changes the arguments
+constexpr std::string_view PAST_END = " 7 77 777";
+
+struct Options
+{
+	long calls = 1000000;
+	long inputs = 100000;
+	unsigned seed = 1;
+};
+
+struct Line
+{
+	std::string text;  // The line, then PAST_END unless bounded by its terminator
+	size_t length;     // Bytes up to end
+	bool bounded;      // Passed end rather than NULL
+	uint8_t max;
+};
+
+struct Command
+{
+	uint32_t code = 0;
+	std::vector<int32_t> args;
+};
+
+int failures = 0;
+
+void fail(const char *what, std::string_view input)
+{
+	if (failures++ < 20)
+	{
+		std::fprintf(stderr, "%s:", what);
+		for (unsigned char c : input)
+			std::fprintf(stderr, " %02X", c);
+		std::fprintf(stderr, "\n");
+	}
+}
+
+// The command syntax as command.h describes it, over text already cut at
+// end and its terminator
+Command model_command(std::string_view text, uint8_t max)
+{
+	text = text.substr(0, text.find('\0'));
+	auto digit = [&](size_t p) { return p < text.size() && text[p] >= '0' && text[p] <= '9'; };
+
+	Command command;
+	size_t p = 0;
+	if (p < text.size() && text[p++] == 'M')
+		while (digit(p) && command.code <= CODE_LIMIT)
+			command.code = command.code * 10 + (text[p++] - '0');
+	if (p < text.size() && text[p] != ' ')
+		return {};
+
+	while (command.args.size() < max)
+	{
+		size_t q = p;
+		while (q < text.size() && (text[q] == ' ' || text[q] == '\t'))
+			q++;
+		bool negative = q < text.size() && text[q] == '-';
+		if (q < text.size() && (text[q] == '-' || text[q] == '+'))
+			q++;
+		if (!digit(q))
+			break;
+
+		int64_t magnitude = 0;
+		while (digit(q))
+			magnitude = std::min<int64_t>(magnitude * 10 + (text[q++] - '0'), INT32_MAX);
+		command.args.push_back(static_cast<int32_t>(negative ? -magnitude : magnitude));
+		p = q;
+	}
+	return command;
+}
+
+Line random_line(std::mt19937 &random)
+{
+	static constexpr std::string_view SYMBOLS = "M0123456789 -+\tx";
+	Line line;
+	if (random() % 2)
+	{
+		// Well formed, with arguments up to past COMMAND_MAX_ARGS and out
+		// of the int32_t range
+		char word[24];
+		std::snprintf(word, sizeof(word), "M%u", static_cast<unsigned>(1001 + random() % 140));
+		line.text = word;
+		for (uint32_t n = random() % (COMMAND_MAX_ARGS + 3); n; n--)
+		{
+			long long value = random() % 4 ? static_cast<int32_t>(random()) % 100000 : static_cast<long long>(random()) << 8;
+			std::snprintf(word, sizeof(word), "%s%lld", random() % 2 ? " " : "  ", random() % 2 ? value : -value);
+			line.text += word;
+		}
+	}
+	else
+	{
+		for (uint32_t n = random() % 32; n; n--)
+			line.text += random() % 8 ? SYMBOLS[random() % SYMBOLS.size()] : static_cast<char>(random());
+	}
+
+	line.length = line.text.size();
+	line.bounded = random() % 2;
+	line.max = random() % (COMMAND_MAX_ARGS + 1);
+	if (line.bounded)
+		line.text += PAST_END;
+	return line;
+}
+
+uint32_t parse_line(const Line &line, int32_t *argv, uint8_t *argc)
+{
+	const char *text = line.text.c_str();
+	return parse_command(text, line.bounded ? text + line.length : nullptr, CODE_LIMIT, argv, line.max, argc);
+}
+
+void check_line(const Line &line)
+{
+	int32_t argv[COMMAND_MAX_ARGS];
+	uint8_t argc;
+	uint32_t code = parse_line(line, argv, &argc);
+	Command expected = model_command(std::string_view(line.text).substr(0, line.length), line.max);
+	if (code != expected.code || argc != expected.args.size()
+		|| !std::equal(expected.args.begin(), expected.args.end(), argv))
+		fail("line", std::string_view(line.text).substr(0, line.length));
+}
+
+std::vector<uint8_t> random_frame(std::mt19937 &random)
+{
+	std::vector<uint8_t> frame;
+	uint32_t kind = random() % 4;
+	if (kind == 0)
+	{
+		frame.resize(sizeof(frame_header_t) + random() % 64);
+		for (uint8_t &byte : frame)
+			byte = static_cast<uint8_t>(random());
+		return frame;
+	}
+
+	// Well formed, some with lengths that are not whole arguments or too
+	// long, and some then corrupted
+	frame_header_t header = {FRAME_SYNC_COMMAND, static_cast<uint8_t>(random() % 132),
+		static_cast<uint8_t>(random()), 0, static_cast<uint16_t>(4 * (random() % (COMMAND_MAX_ARGS + 1)))};
+	if (kind == 1)
+		header.length = random() % 3 ? random() % (4 * COMMAND_MAX_ARGS + 8) : static_cast<uint16_t>(random());
+	uint32_t payload = std::min<uint32_t>(header.length, 256);
+	frame.resize(sizeof(header) + payload + sizeof(uint16_t));
+	std::memcpy(frame.data(), &header, sizeof(header));
+	for (uint32_t i = 0; i < payload; i++)
+		frame[sizeof(header) + i] = static_cast<uint8_t>(random());
+	uint16_t crc = crc16_update(0xFFFF, frame.data(), sizeof(header) + payload);
+	std::memcpy(&frame[sizeof(header) + payload], &crc, sizeof(crc));
+
+	if (kind == 3)
+	{
+		if (random() % 2)
+			frame[random() % frame.size()] ^= static_cast<uint8_t>(1 + random() % 255);
+		else
+			frame.resize(random() % 2 ? frame.size() - 1 : frame.size() + 1);
+	}
+	if (frame.size() < sizeof(header))
+		frame.resize(sizeof(header));
+	return frame;
+}
+
+void check_frame(const std::vector<uint8_t> &frame)
+{
+	frame_header_t header;
+	bool valid = frame_check(frame.data(), static_cast<uint16_t>(frame.size()), &header);
+
+	frame_header_t expected;
+	std::memcpy(&expected, frame.data(), sizeof(expected));
+	uint32_t payload_end = sizeof(expected) + expected.length;
+	uint16_t crc = 0;
+	bool whole = expected.length <= COMMAND_MAX_ARGS * sizeof(int32_t) && expected.length % sizeof(int32_t) == 0
+		&& frame.size() == payload_end + sizeof(crc);
+	if (whole)
+		std::memcpy(&crc, &frame[payload_end], sizeof(crc));
+	bool accept = whole && crc == crc16_update(0xFFFF, frame.data(), payload_end);
+
+	if (valid != accept || std::memcmp(&header, &expected, sizeof(header)))
+		fail("frame", std::string_view(reinterpret_cast<const char *>(frame.data()), frame.size()));
+}
+
+// Calls per second of call over the pool, calls times in all
+template <typename T, typename F>
+double rate(const std::vector<T> &pool, long calls, F call)
+{
+	auto start = Clock::now();
+	for (long i = 0; i < calls; i++)
+		call(pool[i % pool.size()]);
+	return calls / std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+bool parse_options(int argc, char **argv, Options &options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		auto more = [&](int count) { return i + count < argc; };
+		if (arg == "-n" && more(1))
+			options.calls = std::atol(argv[++i]);
+		else if (arg == "-p" && more(1))
+			options.inputs = std::atol(argv[++i]);
+		else if (arg == "-s" && more(1))
+			options.seed = std::strtoul(argv[++i], nullptr, 0);
+		else
+			return false;
+	}
+	return options.calls > 0 && options.inputs > 0;
+}
+
+}  // namespace
+
+int main(int argc, char **argv)
+{
+	Options options;
+	if (!parse_options(argc, argv, options))
+	{
+		std::fprintf(stderr, "usage: %s [-n calls] [-p inputs] [-s seed]\n", argv[0]);
+		return 2;
+	}
+
+	std::mt19937 random(options.seed);
+	std::vector<Line> lines;
+	std::vector<std::vector<uint8_t>> frames;
+	for (long i = 0; i < options.inputs; i++)
+	{
+		lines.push_back(random_line(random));
+		frames.push_back(random_frame(random));
+	}
+
+	for (const Line &line : lines)
+		check_line(line);
+	for (const std::vector<uint8_t> &frame : frames)
+		check_frame(frame);
+	if (failures)
+	{
+		std::fprintf(stderr, "%d of %ld inputs failed\n", failures, 2 * options.inputs);
+		return 1;
+	}
+
+	// The results go into a volatile so that the calls are not dropped
+	volatile uint32_t sink = 0;
+	double line_rate = rate(lines, options.calls, [&](const Line &line) {
+		int32_t args[COMMAND_MAX_ARGS];
+		uint8_t found;
+		sink = sink + parse_line(line, args, &found);
+	});
+	double frame_rate = rate(frames, options.calls, [&](const std::vector<uint8_t> &frame) {
+		frame_header_t header;
+		sink = sink + frame_check(frame.data(), static_cast<uint16_t>(frame.size()), &header);
+	});
+	std::printf("%ld inputs checked\n", 2 * options.inputs);
+	std::printf("parse_command  %.2f M/s\n", line_rate / 1e6);
+	std::printf("frame_check    %.2f M/s\n", frame_rate / 1e6);
+	return 0;
+}
@@ -0,0 +1,802 @@
+#include "dosimeter.hpp"
+
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <termios.h>
+#include <unistd.h>
+
+static_assert(std::endian::native == std::endian::little, "the wire format is little-endian");
+
+namespace dosimeter {
+
+namespace {
+
+constexpr uint8_t FRAME_SYNC_COMMAND = 0xA5;
+constexpr uint8_t FRAME_SYNC_REPLY = 0x5A;
+constexpr uint8_t FRAME_FLAG_MORE = 0x01;
+constexpr uint8_t FRAME_FLAG_ERROR = 0x02;
+constexpr size_t FRAME_HEADER_BYTES = 6;
+constexpr size_t COMMAND_MAX_ARGS = 10;
+
+constexpr int POLL_MS = 100;
+constexpr auto SWITCH_TIMEOUT = std::chrono::milliseconds(500);
+// For the chunks still on their way over the other pipes once the final
+// frame of a striped readout is in
+constexpr auto STRIPE_TIMEOUT = std::chrono::milliseconds(1000);
+
+// Whether a byte could start a stream block: the magics differ only in
+// their low byte, which comes first
+bool stream_sync(uint8_t byte)
+{
+	return byte == (STREAM_MAGIC & 0xFF) || byte == (STREAM_EVENT_MAGIC & 0xFF) || byte == (STREAM_PULSE_MAGIC & 0xFF);
+}
+
+bool stripe_valid(const StripeChunk &chunk)
+{
+	return chunk.magic == STRIPE_MAGIC && chunk.chunk < chunk.chunks && chunk.length <= STRIPE_MAX_CHUNK_BYTES;
+}
+
+[[noreturn]] void throw_errno(const char *what)
+{
+	throw std::system_error(errno, std::generic_category(), what);
+}
+
+// Connect to "<host>:<port>", as served by dosimeter_emulator -t
+int connect_tcp(const std::string &address)
+{
+	size_t colon = address.rfind(':');
+	if (colon == std::string::npos)
+		throw std::invalid_argument("expected tcp:<host>:<port>");
+
+	addrinfo hints{};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	addrinfo *found;
+	int error = getaddrinfo(address.substr(0, colon).c_str(), address.substr(colon + 1).c_str(), &hints, &found);
+	if (error)
+		throw std::runtime_error(gai_strerror(error));
+
+	int fd = -1;
+	for (addrinfo *a = found; a && fd < 0; a = a->ai_next)
+	{
+		fd = ::socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if (fd >= 0 && ::connect(fd, a->ai_addr, a->ai_addrlen) != 0)
+		{
+			::close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(found);
+	if (fd < 0)
+		throw_errno("connect");
+
+	// Commands are small and latency bound
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+}  // namespace
+
+uint16_t crc16(const void *data, size_t length, uint16_t crc)
+{
+	const uint8_t *p = static_cast<const uint8_t *>(data);
+	while (length--)
+	{
+		crc ^= static_cast<uint16_t>(*p++) << 8;
+		for (int i = 0; i < 8; i++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+	return crc;
+}
+
+uint32_t crc32(const void *data, size_t length, uint32_t crc)
+{
+	static const auto table = [] {
+		std::array<uint32_t, 256> t{};
+		for (uint32_t i = 0; i < 256; i++)
+		{
+			uint32_t c = i;
+			for (int k = 0; k < 8; k++)
+				c = (c & 1) ? (c >> 1) ^ 0xEDB88320 : c >> 1;
+			t[i] = c;
+		}
+		return t;
+	}();
+
+	const uint8_t *p = static_cast<const uint8_t *>(data);
+	crc = ~crc;
+	while (length--)
+		crc = (crc >> 8) ^ table[(crc ^ *p++) & 0xFF];
+	return ~crc;
+}
+
+bool container_valid(const ContainerHeader &header)
+{
+	return header.magic == CONTAINER_MAGIC && header.header_bytes >= sizeof(header) && header.end >= header.start
+		&& header.block_columns && header.crc == crc32(&header, offsetof(ContainerHeader, crc));
+}
+
+size_t container_payload_bytes(const ContainerHeader &header)
+{
+	size_t cells = header.end - header.start + 1;
+	return cells * std::popcount(header.mask) * header.width + header.blocks * sizeof(uint32_t);
+}
+
+size_t container_capacity(size_t cells, uint16_t mask)
+{
+	return cells * (std::popcount(mask) * sizeof(uint32_t) + sizeof(uint32_t));
+}
+
+bool container_blocks_valid(const ContainerHeader &header, std::span<const std::byte> payload)
+{
+	if (payload.size() != container_payload_bytes(header))
+		return false;
+
+	size_t column_bytes = std::popcount(header.mask) * header.width;
+	size_t cells = header.end - header.start + 1;
+	size_t offset = 0;
+	for (size_t first = 0; first < cells; first += header.block_columns)
+	{
+		size_t length = std::min<size_t>(header.block_columns, cells - first) * column_bytes;
+		uint32_t crc;
+		std::memcpy(&crc, payload.data() + offset + length, sizeof(crc));
+		if (crc != crc32(payload.data() + offset, length))
+			return false;
+		offset += length + sizeof(crc);
+	}
+	return offset == payload.size();
+}
+
+int open_port(const std::string &port)
+{
+	if (port.rfind(TCP_PREFIX, 0) == 0)
+		return connect_tcp(port.substr(sizeof(TCP_PREFIX) - 1));
+
+	int fd = ::open(port.c_str(), O_RDWR | O_NOCTTY);
+	if (fd < 0)
+		throw_errno("open");
+
+	termios tio{};
+	if (tcgetattr(fd, &tio) != 0)
+	{
+		::close(fd);
+		throw_errno("tcgetattr");
+	}
+	cfmakeraw(&tio);
+	tio.c_cc[VMIN] = 0;
+	tio.c_cc[VTIME] = 0;
+	tcsetattr(fd, TCSANOW, &tio);
+	tcflush(fd, TCIOFLUSH);
+	return fd;
+}
+
+Client::Client(const std::string &port, const std::string &capture)
+{
+	if (!capture.empty())
+	{
+		capture_.open(capture, std::ios::binary | std::ios::trunc);
+		if (!capture_)
+			throw std::runtime_error("cannot create " + capture);
+		CaptureHeader header{CAPTURE_MAGIC, CAPTURE_VERSION, 0};
+		capture_.write(reinterpret_cast<const char *>(&header), sizeof(header));
+		capture_start_ = std::chrono::steady_clock::now();
+	}
+
+	fd_ = open_port(port);
+
+	// A device still in text mode answers "ok"; one already taking
+	// frames ignores text, so a timeout means it is framed already
+	static const char select_frames[] = "\nM1028 1\n";
+	write_all(select_frames, sizeof(select_frames) - 1);
+
+	std::string text;
+	auto deadline = std::chrono::steady_clock::now() + SWITCH_TIMEOUT;
+	while (text.find("ok\n") == std::string::npos && std::chrono::steady_clock::now() < deadline)
+	{
+		char chunk[64];
+		pollfd p{fd_, POLLIN, 0};
+		if (poll(&p, 1, 10) > 0)
+		{
+			ssize_t n = ::read(fd_, chunk, sizeof(chunk));
+			if (n > 0)
+			{
+				record(CAPTURE_FROM_DEVICE, chunk, n);
+				text.append(chunk, n);
+			}
+		}
+	}
+
+	reader_ = std::thread(&Client::reader, this);
+}
+
+Client::~Client()
+{
+	stopping_ = true;
+	reader_.join();
+	if (data_reader_.joinable())
+		data_reader_.join();
+	fail_all("client closed");
+	::close(fd_);
+	if (data_fd_ >= 0)
+		::close(data_fd_);
+}
+
+void Client::record(uint8_t direction, const void *data, size_t length)
+{
+	if (!capture_.is_open())
+		return;
+
+	CaptureRecord header{};
+	header.time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now() - capture_start_).count();
+	header.direction = direction;
+	header.length = length;
+	std::lock_guard<std::mutex> lock(capture_mutex_);
+	capture_.write(reinterpret_cast<const char *>(&header), sizeof(header));
+	capture_.write(static_cast<const char *>(data), length);
+}
+
+void Client::write_all(const void *data, size_t length)
+{
+	record(CAPTURE_TO_DEVICE, data, length);
+	const uint8_t *p = static_cast<const uint8_t *>(data);
+	while (length)
+	{
+		ssize_t n = ::write(fd_, p, length);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			throw_errno("write");
+		}
+		p += n;
+		length -= n;
+	}
+}
+
+void Client::send(uint16_t code, std::span<const int32_t> args, Pending &&pending)
+{
+	if (args.size() > COMMAND_MAX_ARGS)
+		throw std::invalid_argument("too many arguments");
+
+	std::vector<uint8_t> frame(FRAME_HEADER_BYTES + args.size_bytes() + sizeof(uint16_t));
+	uint16_t length = static_cast<uint16_t>(args.size_bytes());
+
+	std::lock_guard<std::mutex> write_lock(write_mutex_);
+	uint8_t sequence = next_sequence_++;
+	frame[0] = FRAME_SYNC_COMMAND;
+	frame[1] = static_cast<uint8_t>(code - 1000);
+	frame[2] = sequence;
+	frame[3] = 0;
+	std::memcpy(&frame[4], &length, sizeof(length));
+	if (length)
+		std::memcpy(&frame[FRAME_HEADER_BYTES], args.data(), length);
+	uint16_t crc = crc16(frame.data(), FRAME_HEADER_BYTES + length);
+	std::memcpy(&frame[FRAME_HEADER_BYTES + length], &crc, sizeof(crc));
+
+	// Queued before writing, so the reply can never arrive first
+	pending.sequence = sequence;
+	{
+		std::lock_guard<std::mutex> lock(pending_mutex_);
+		pending_.push_back(std::move(pending));
+	}
+	write_all(frame.data(), frame.size());
+}
+
+std::future<Reply> Client::command(uint16_t code, std::span<const int32_t> args)
+{
+	Pending pending{};
+	pending.binary = false;
+	pending.stage = Stage::Reply;
+	std::future<Reply> result = pending.reply.get_future();
+	send(code, args, std::move(pending));
+	return result;
+}
+
+std::future<ReadoutHeader> Client::readout(uint16_t code, std::span<const int32_t> args, std::span<std::byte> out)
+{
+	Pending pending{};
+	pending.binary = true;
+	pending.stage = Stage::Reply;
+	pending.out = out;
+	std::future<ReadoutHeader> result = pending.done.get_future();
+	send(code, args, std::move(pending));
+	return result;
+}
+
+std::future<ContainerHeader> Client::read_container(bool interleave, uint16_t start, uint16_t end, uint16_t mask,
+	std::span<std::byte> out)
+{
+	const int32_t args[] = {interleave, start, end, mask};
+	Pending pending{};
+	pending.binary = true;
+	pending.container = true;
+	pending.stage = Stage::Reply;
+	pending.out = out;
+	std::future<ContainerHeader> result = pending.container_done.get_future();
+	send(1056, args, std::move(pending));
+	return result;
+}
+
+std::future<ContainerHeader> Client::resend_container(bool interleave, uint16_t start, uint16_t end, uint16_t mask,
+	uint32_t first, uint32_t blocks, std::span<std::byte> out)
+{
+	const int32_t args[] = {interleave, start, end, mask, static_cast<int32_t>(first), static_cast<int32_t>(blocks)};
+	Pending pending{};
+	pending.binary = true;
+	pending.container = true;
+	pending.stage = Stage::Reply;
+	pending.out = out;
+	std::future<ContainerHeader> result = pending.container_done.get_future();
+	send(1068, args, std::move(pending));
+	return result;
+}
+
+void Client::attach_data_port(const std::string &port)
+{
+	if (data_fd_ >= 0)
+		throw std::logic_error("data port already attached");
+	data_fd_ = open_port(port);
+	data_reader_ = std::thread(&Client::data_reader, this);
+}
+
+std::future<ReadoutHeader> Client::read_striped(bool interleave, uint16_t start, uint16_t end, uint16_t mask,
+	uint8_t pipes, std::span<std::byte> out)
+{
+	uint8_t readable = STRIPE_PIPE_CDC | (data_fd_ >= 0 ? STRIPE_PIPE_CDC_DATA : 0);
+	if (!pipes || (pipes & ~readable))
+		throw std::invalid_argument("striped readout on a pipe that is not attached");
+
+	const int32_t args[] = {interleave, start, end, mask, pipes};
+	Pending pending{};
+	pending.binary = true;
+	pending.striped = true;
+	pending.stage = Stage::Reply;
+	pending.out = out;
+	std::future<ReadoutHeader> result = pending.done.get_future();
+	stripes_++;
+	send(1129, args, std::move(pending));
+	return result;
+}
+
+void Client::on_stream(StreamHandler handler)
+{
+	stream_handler_ = std::move(handler);
+}
+
+void Client::on_position(PositionHandler handler)
+{
+	position_handler_ = std::move(handler);
+}
+
+void Client::on_preview(PreviewHandler handler)
+{
+	preview_handler_ = std::move(handler);
+}
+
+bool Client::push_sync(uint8_t byte) const
+{
+	return (stream_handler_ && stream_sync(byte)) || (position_handler_ && byte == (POSITION_MAGIC & 0xFF))
+		|| (preview_handler_ && byte == (PREVIEW_MAGIC & 0xFF)) || (stripes_ && byte == (STRIPE_MAGIC & 0xFF));
+}
+
+std::future<ReadoutHeader> Client::read_counts(uint8_t channel, uint16_t start, uint16_t end, std::span<uint16_t> out)
+{
+	const int32_t args[] = {channel, start, end};
+	return readout(1015, args, std::as_writable_bytes(out));
+}
+
+// Read more from the port into buffer_, false once the client is closing
+bool Client::fill()
+{
+	if (buffer_start_ && buffer_start_ == buffer_.size())
+	{
+		buffer_.clear();
+		buffer_start_ = 0;
+	}
+
+	while (!stopping_)
+	{
+		pollfd p{fd_, POLLIN, 0};
+		if (poll(&p, 1, POLL_MS) <= 0)
+			continue;
+
+		uint8_t chunk[4096];
+		ssize_t n = ::read(fd_, chunk, sizeof(chunk));
+		if (n > 0)
+		{
+			record(CAPTURE_FROM_DEVICE, chunk, n);
+			buffer_.insert(buffer_.end(), chunk, chunk + n);
+			return true;
+		}
+		if (n < 0 && errno != EINTR && errno != EAGAIN)
+			return false;
+	}
+	return false;
+}
+
+// Consume exactly length bytes.  Whatever is already buffered is copied,
+// the rest is read from the port straight into data.
+bool Client::take(void *data, size_t length)
+{
+	uint8_t *p = static_cast<uint8_t *>(data);
+	size_t buffered = std::min(length, buffer_.size() - buffer_start_);
+	std::memcpy(p, buffer_.data() + buffer_start_, buffered);
+	buffer_start_ += buffered;
+	p += buffered;
+	length -= buffered;
+
+	while (length && !stopping_)
+	{
+		pollfd fds{fd_, POLLIN, 0};
+		if (poll(&fds, 1, POLL_MS) <= 0)
+			continue;
+
+		ssize_t n = ::read(fd_, p, length);
+		if (n < 0 && errno != EINTR && errno != EAGAIN)
+			return false;
+		if (n > 0)
+		{
+			record(CAPTURE_FROM_DEVICE, p, n);
+			p += n;
+			length -= n;
+		}
+	}
+	return length == 0;
+}
+
+void Client::reader()
+{
+	std::vector<std::byte> discard;
+	while (!stopping_)
+	{
+		Pending *front = nullptr;
+		{
+			std::lock_guard<std::mutex> lock(pending_mutex_);
+			if (!pending_.empty())
+				front = &pending_.front();
+		}
+
+		if (front && front->stage == Stage::Header)
+		{
+			if (front->container)
+			{
+				if (!take(&front->container_header, sizeof(front->container_header)))
+					break;
+				// A corrupt header gives no payload length; the bytes that
+				// follow are skipped while looking for the final frame
+				front->header.length = container_valid(front->container_header)
+					? container_payload_bytes(front->container_header) : 0;
+			}
+			else if (!take(&front->header, sizeof(front->header)))
+				break;
+			front->stage = Stage::Final;
+			continue;
+		}
+
+		if (front && front->stage == Stage::Payload)
+		{
+			// A payload that does not fit is still read, to stay in step
+			uint32_t length = front->header.length;
+			std::byte *target = front->out.data();
+			if (length > front->out.size_bytes())
+			{
+				discard.resize(length);
+				target = discard.data();
+			}
+			if (!take(target, length))
+				break;
+
+			front->received = length;
+			front->stage = Stage::Final;
+			if (target == discard.data())
+				front->out = {};
+			continue;
+		}
+
+		// Frames start with FRAME_SYNC_REPLY and, with a handler, stream
+		// blocks, position pushes and previews with the low byte of their
+		// magic, as do stripe chunks while a striped readout is pending;
+		// anything else is skipped
+		while (buffer_start_ < buffer_.size() && buffer_[buffer_start_] != FRAME_SYNC_REPLY
+			&& !push_sync(buffer_[buffer_start_]))
+			buffer_start_++;
+		if (buffer_start_ < buffer_.size() && position_handler_ && buffer_[buffer_start_] == (POSITION_MAGIC & 0xFF))
+		{
+			if (buffer_.size() - buffer_start_ < sizeof(PositionPush))
+			{
+				if (!fill())
+					break;
+				continue;
+			}
+			PositionPush push;
+			std::memcpy(&push, buffer_.data() + buffer_start_, sizeof(push));
+			if (push.magic == POSITION_MAGIC)
+			{
+				buffer_start_ += sizeof(push);
+				position_handler_(push);
+			}
+			else
+				buffer_start_++;
+			continue;
+		}
+		if (buffer_start_ < buffer_.size() && preview_handler_ && buffer_[buffer_start_] == (PREVIEW_MAGIC & 0xFF))
+		{
+			if (buffer_.size() - buffer_start_ < sizeof(PreviewHeader))
+			{
+				if (!fill())
+					break;
+				continue;
+			}
+			PreviewHeader preview;
+			std::memcpy(&preview, buffer_.data() + buffer_start_, sizeof(preview));
+			if (preview.magic == PREVIEW_MAGIC && preview.points && preview.points <= PREVIEW_MAX_POINTS && preview.mask)
+			{
+				buffer_start_ += sizeof(preview);
+				preview_sums_.resize(size_t(preview.points) * std::popcount(preview.mask));
+				if (!take(preview_sums_.data(), preview_sums_.size() * sizeof(uint32_t)))
+					break;
+				preview_handler_(preview, preview_sums_);
+			}
+			else
+				buffer_start_++;
+			continue;
+		}
+		if (buffer_start_ < buffer_.size() && stripes_ && buffer_[buffer_start_] == (STRIPE_MAGIC & 0xFF))
+		{
+			if (buffer_.size() - buffer_start_ < sizeof(StripeChunk))
+			{
+				if (!fill())
+					break;
+				continue;
+			}
+			StripeChunk chunk;
+			std::memcpy(&chunk, buffer_.data() + buffer_start_, sizeof(chunk));
+			if (stripe_valid(chunk))
+			{
+				buffer_start_ += sizeof(chunk);
+				chunk_bytes_.resize(chunk.length);
+				if (!take(chunk_bytes_.data(), chunk.length))
+					break;
+				place_chunk(chunk, chunk_bytes_.data());
+			}
+			else
+				buffer_start_++;
+			continue;
+		}
+		if (buffer_start_ < buffer_.size() && buffer_[buffer_start_] != FRAME_SYNC_REPLY)
+		{
+			if (buffer_.size() - buffer_start_ < sizeof(StreamHeader))
+			{
+				if (!fill())
+					break;
+				continue;
+			}
+			StreamHeader stream;
+			std::memcpy(&stream, buffer_.data() + buffer_start_, sizeof(stream));
+			if ((stream.magic == STREAM_MAGIC || stream.magic == STREAM_EVENT_MAGIC || stream.magic == STREAM_PULSE_MAGIC)
+				&& stream.records <= STREAM_BLOCK_MAX_RECORDS)
+			{
+				buffer_start_ += sizeof(stream);
+				stream_records_.resize(stream.records);
+				if (!take(stream_records_.data(), stream.records * sizeof(StreamRecord)))
+					break;
+				stream_handler_(stream, stream_records_);
+			}
+			else
+				buffer_start_++;
+			continue;
+		}
+		if (buffer_.size() - buffer_start_ < FRAME_HEADER_BYTES)
+		{
+			if (!fill())
+				break;
+			continue;
+		}
+
+		const uint8_t *header = buffer_.data() + buffer_start_;
+		uint16_t length;
+		std::memcpy(&length, header + 4, sizeof(length));
+		size_t total = FRAME_HEADER_BYTES + length + sizeof(uint16_t);
+		if (buffer_.size() - buffer_start_ < total)
+		{
+			if (!fill())
+				break;
+			continue;
+		}
+
+		header = buffer_.data() + buffer_start_;
+		uint16_t crc;
+		std::memcpy(&crc, header + FRAME_HEADER_BYTES + length, sizeof(crc));
+		if (crc != crc16(header, FRAME_HEADER_BYTES + length))
+		{
+			// Not a frame after all, look for the next sync byte
+			buffer_start_++;
+			continue;
+		}
+
+		buffer_start_ += total;
+		on_frame(header[2], header[3], header + FRAME_HEADER_BYTES, length);
+	}
+
+	fail_all("connection lost");
+}
+
+// Reads the chunks of striped readouts from the data port, skipping
+// anything else, until the client closes
+void Client::data_reader()
+{
+	std::vector<uint8_t> buffer;
+	size_t start = 0;
+	while (!stopping_)
+	{
+		while (start < buffer.size() && buffer[start] != (STRIPE_MAGIC & 0xFF))
+			start++;
+		if (buffer.size() - start >= sizeof(StripeChunk))
+		{
+			StripeChunk chunk;
+			std::memcpy(&chunk, buffer.data() + start, sizeof(chunk));
+			if (!stripe_valid(chunk))
+			{
+				start++;
+				continue;
+			}
+			if (buffer.size() - start - sizeof(chunk) >= chunk.length)
+			{
+				place_chunk(chunk, buffer.data() + start + sizeof(chunk));
+				start += sizeof(chunk) + chunk.length;
+				continue;
+			}
+		}
+
+		// Only the start of a chunk is left, or nothing
+		buffer.erase(buffer.begin(), buffer.begin() + start);
+		start = 0;
+		pollfd p{data_fd_, POLLIN, 0};
+		if (poll(&p, 1, POLL_MS) <= 0)
+			continue;
+
+		uint8_t chunk[4096];
+		ssize_t n = ::read(data_fd_, chunk, sizeof(chunk));
+		if (n > 0)
+			buffer.insert(buffer.end(), chunk, chunk + n);
+		else if (n < 0 && errno != EINTR && errno != EAGAIN)
+			return;
+	}
+}
+
+// Copies a chunk into the striped readout it belongs to, matched by
+// sequence.  One that does not fit leaves the readout without its buffer.
+void Client::place_chunk(const StripeChunk &chunk, const void *data)
+{
+	std::lock_guard<std::mutex> lock(pending_mutex_);
+	for (Pending &pending : pending_)
+	{
+		if (!pending.striped || pending.sequence != chunk.sequence)
+			continue;
+		if (uint64_t(chunk.offset) + chunk.length <= pending.out.size_bytes())
+			std::memcpy(pending.out.data() + chunk.offset, data, chunk.length);
+		else
+			pending.out = {};
+		pending.chunks = chunk.chunks;
+		pending.chunks_received++;
+		pending.received += chunk.length;
+		chunk_placed_.notify_all();
+		return;
+	}
+}
+
+void Client::on_frame(uint8_t sequence, uint8_t flags, const uint8_t *payload, uint16_t length)
+{
+	std::unique_lock<std::mutex> lock(pending_mutex_);
+	if (pending_.empty() || pending_.front().sequence != sequence)
+		return;
+	Pending &pending = pending_.front();
+	lock.unlock();
+
+	pending.text.append(reinterpret_cast<const char *>(payload), length);
+	bool error = (flags & FRAME_FLAG_ERROR) || pending.text.rfind("error", 0) == 0;
+
+	if (flags & FRAME_FLAG_MORE)
+	{
+		if (!pending.binary || error)
+			return;
+
+		// The header follows the first "ok", and the payload the empty frame after it
+		if (pending.stage == Stage::Reply && pending.text.rfind("ok\n", 0) == 0)
+		{
+			pending.stage = Stage::Header;
+			pending.text.clear();
+		}
+		else if (!pending.striped && pending.stage == Stage::Final && pending.received == 0 && pending.header.length)
+			pending.stage = Stage::Payload;
+		return;
+	}
+
+	// The device sends the final frame after the last chunk, but those on
+	// the other pipes may not have been read yet
+	bool complete = true;
+	if (pending.striped && !error && pending.stage == Stage::Final)
+	{
+		lock.lock();
+		complete = chunk_placed_.wait_for(lock, STRIPE_TIMEOUT,
+			[&] { return pending.chunks && pending.chunks_received == pending.chunks; })
+			&& pending.received == pending.header.length;
+		lock.unlock();
+	}
+
+	if (!pending.binary)
+		pending.reply.set_value(Reply{pending.text, error});
+	else if (pending.container)
+		finish_container(pending, error);
+	else if (error || pending.stage != Stage::Final)
+		pending.done.set_exception(std::make_exception_ptr(std::runtime_error(
+			pending.text.empty() ? "readout failed" : pending.text)));
+	else if (!complete)
+		pending.done.set_exception(std::make_exception_ptr(std::runtime_error("striped readout incomplete")));
+	else if (pending.header.length && pending.out.empty())
+		pending.done.set_exception(std::make_exception_ptr(std::length_error("readout buffer too small")));
+	else if (pending.header.length && crc16(pending.out.data(), pending.header.length) != pending.header.crc)
+		pending.done.set_exception(std::make_exception_ptr(std::runtime_error("readout CRC mismatch")));
+	else
+		pending.done.set_value(pending.header);
+
+	lock.lock();
+	if (pending.striped)
+		stripes_--;
+	pending_.pop_front();
+}
+
+void Client::finish_container(Pending &pending, bool error)
+{
+	const ContainerHeader &header = pending.container_header;
+	if (error || pending.stage != Stage::Final)
+		fail(pending, pending.text.empty() ? "readout failed" : pending.text);
+	else if (!container_valid(header))
+		fail(pending, "container header corrupt");
+	else if (pending.out.empty())
+		pending.container_done.set_exception(std::make_exception_ptr(std::length_error("readout buffer too small")));
+	else if (!container_blocks_valid(header, pending.out.first(pending.header.length)))
+		fail(pending, "container block CRC mismatch");
+	else
+		pending.container_done.set_value(header);
+}
+
+void Client::fail(Pending &pending, const std::string &reason)
+{
+	auto error = std::make_exception_ptr(std::runtime_error(reason));
+	if (pending.container)
+		pending.container_done.set_exception(error);
+	else if (pending.binary)
+		pending.done.set_exception(error);
+	else
+		pending.reply.set_exception(error);
+}
+
+void Client::fail_all(const std::string &reason)
+{
+	std::lock_guard<std::mutex> lock(pending_mutex_);
+	while (!pending_.empty())
+	{
+		fail(pending_.front(), reason);
+		if (pending_.front().striped)
+			stripes_--;
+		pending_.pop_front();
+	}
+}
+
+}  // namespace dosimeter
@@ -0,0 +1,394 @@
+// Host client for the DosimeterCounter binary command protocol (M1028).
+//
+// Commands are sent as frames and may be pipelined: each call returns a
+// future straight away, and replies are matched to requests by sequence
+// number on a background reader thread.  Binary readouts are received
+// straight into a caller-provided buffer, with no intermediate copies
+// or text parsing.
+//
+// A binary readout arrives as
+//   reply frame (MORE) "ok\n"
+//   readout_header_t
+//   empty reply frame (MORE)     omitted when the payload is empty
+//   payload
+//   reply frame "ok\n"
+//
+// An M1056 container arrives the same way, with a ContainerHeader in place
+// of the readout_header_t and its blocks as the payload.  An M1129
+// striped readout has no empty frame: its payload comes as StripeChunks
+// spread over the command port and any attached data port, and the
+// final frame waits for the last of them.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace dosimeter {
+
+// Matches readout_header_t in main.c
+struct ReadoutHeader
+{
+	uint16_t channel;
+	uint16_t start;
+	uint16_t end;
+	uint16_t crc;
+	uint32_t length;
+	uint8_t width;
+	uint8_t flags;
+	uint16_t reserved;
+};
+static_assert(sizeof(ReadoutHeader) == 16);
+
+constexpr uint8_t READOUT_FLAG_OVERFLOW = 0x01;
+constexpr uint8_t READOUT_FLAG_RLE = 0x02;
+// Set in ReadoutHeader channel when the payload came as stripe chunks
+constexpr uint16_t READOUT_STRIPED = 0x4000;
+
+// Matches stripe_chunk_t in main.c (M1129): a slice of a striped
+// readout's payload, followed by its length bytes
+struct StripeChunk
+{
+	uint16_t magic;
+	uint16_t chunk;
+	uint16_t chunks;
+	uint8_t pipe;      // STRIPE_PIPE_* bit it was sent on
+	uint8_t sequence;  // Of the M1129 frame
+	uint32_t offset;   // Of its bytes in the payload
+	uint32_t length;
+};
+static_assert(sizeof(StripeChunk) == 16);
+
+constexpr uint16_t STRIPE_MAGIC = 0x5AAF;
+// Pipes of a striped readout, as DATA_INTERFACE_* in main.c: the command
+// port, the vendor bulk interface and the second CDC port
+constexpr uint8_t STRIPE_PIPE_CDC = 0x01;
+constexpr uint8_t STRIPE_PIPE_BULK = 0x02;
+constexpr uint8_t STRIPE_PIPE_CDC_DATA = 0x04;
+// A slice of up to 16 channels of 32-bit counts
+constexpr size_t STRIPE_MAX_CHUNK_BYTES = 64 * 16 * sizeof(uint32_t);
+
+// Matches container_header_t in main.c (M1056).  The header is followed by
+// blocks of block_columns columns, each with the CRC-32 of its payload.
+struct ContainerHeader
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t header_bytes;
+	uint32_t build_id;
+	uint16_t firmware;
+	uint16_t mask;
+	uint16_t start;
+	uint16_t end;
+	uint16_t columns;
+	uint16_t rows;
+	uint16_t bin_factor;
+	uint16_t block_columns;
+	uint8_t width;
+	uint8_t interleaved;
+	uint8_t flags;
+	uint8_t reserved;
+	uint32_t started;
+	uint32_t read;
+	uint32_t blocks;
+	// Version 2: Unix time (M1123) counting last started and stopped, 0 if unset
+	uint32_t wall_started;
+	uint32_t wall_started_us;
+	uint32_t wall_stopped;
+	uint32_t wall_stopped_us;
+	uint32_t crc;
+};
+static_assert(sizeof(ContainerHeader) == 64);
+
+constexpr uint32_t CONTAINER_MAGIC = 0x52464344;
+
+// A merged frame written by dosimeter_aggregate: a MergedHeader, a
+// MergedDevice for each device, then planes of cells uint32 counts, the
+// channels of the first device in mask order, then those of the next.
+struct MergedHeader
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t devices;
+	uint16_t planes;
+	uint16_t start;
+	uint16_t end;
+	uint16_t reserved;
+	uint64_t time_us;    // Unix time of the frames, their mean
+	uint32_t spread_us;  // Between the earliest and the latest of them
+	uint32_t sequence;   // Of the merged frames since the aggregator started
+};
+static_assert(sizeof(MergedHeader) == 32);
+
+struct MergedDevice
+{
+	uint16_t mask;
+	uint8_t flags;      // Of its container, READOUT_FLAG_*
+	uint8_t clock;      // MERGED_CLOCK_*
+	int32_t offset_us;  // Of its frame from time_us
+};
+static_assert(sizeof(MergedDevice) == 8);
+
+constexpr uint32_t MERGED_MAGIC = 0x47524D44;  // "DMRG"
+constexpr uint16_t MERGED_VERSION = 1;
+// How a device's frame was timed: by its wall clock (M1123), or by when
+// the host had it, less the least delay seen
+constexpr uint8_t MERGED_CLOCK_WALL = 0;
+constexpr uint8_t MERGED_CLOCK_HOST = 1;
+
+// Ports starting with this are TCP addresses, as dosimeter_emulator serves
+constexpr char TCP_PREFIX[] = "tcp:";
+
+// Opens a CDC port raw, or connects to TCP_PREFIX<host>:<port>, and
+// returns the descriptor
+int open_port(const std::string &port);
+
+// Capture of a session (see Client), replayed by dosimeter_replay: a
+// CaptureHeader, then a CaptureRecord and its bytes for each write to
+// the device and each read from it, in the order they happened.  A
+// write is a whole command, or the text that switches to frames.
+struct CaptureHeader
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t reserved;
+};
+
+struct CaptureRecord
+{
+	uint64_t time_ns;   // Since the client opened the port
+	uint32_t length;    // Bytes that follow
+	uint8_t direction;  // CAPTURE_TO_DEVICE or CAPTURE_FROM_DEVICE
+	uint8_t reserved[3];
+};
+static_assert(sizeof(CaptureRecord) == 16);
+
+constexpr uint32_t CAPTURE_MAGIC = 0x50414344;  // "DCAP"
+constexpr uint16_t CAPTURE_VERSION = 1;
+constexpr uint8_t CAPTURE_TO_DEVICE = 0;
+constexpr uint8_t CAPTURE_FROM_DEVICE = 1;
+
+// Whether the magic and header CRC are right
+bool container_valid(const ContainerHeader &header);
+// Bytes of the blocks and their CRCs that follow the header
+size_t container_payload_bytes(const ContainerHeader &header);
+// Room for the payload of any container of cells columns of the channels
+// in mask: 32-bit counts and a CRC per block of a single column
+size_t container_capacity(size_t cells, uint16_t mask);
+// Whether every block of a payload matches its CRC
+bool container_blocks_valid(const ContainerHeader &header, std::span<const std::byte> payload);
+
+// Matches stream_header_t and stream_record_t in main.c.  While streaming
+// is on (M1017 1) the device sends blocks of records, each a header and
+// its records, between the reply frames.  List-mode events (M1072) and
+// sync pulses (M1046 3) come in records of the same 8 bytes under their
+// own magic.
+struct StreamHeader
+{
+	uint16_t magic;
+	uint16_t records;
+	uint32_t dropped;  // Records lost to ring overflow since streaming was enabled
+};
+
+struct StreamRecord
+{
+	uint16_t position;
+	uint16_t primary;
+	uint16_t secondary;
+	uint16_t tertiary;
+};
+static_assert(sizeof(StreamRecord) == 8);
+
+constexpr uint16_t STREAM_MAGIC = 0x5AA5;
+constexpr uint16_t STREAM_EVENT_MAGIC = 0x5AA7;
+constexpr uint16_t STREAM_PULSE_MAGIC = 0x5AA9;
+// STREAM_BLOCK_MAX_BYTES (M1067) less the header
+constexpr size_t STREAM_BLOCK_MAX_RECORDS = (8 * 64 - sizeof(StreamHeader)) / sizeof(StreamRecord);
+
+// Called on the reader thread with each stream block received
+using StreamHandler = std::function<void(const StreamHeader &, std::span<const StreamRecord>)>;
+
+// Matches position_push_t in main.c, sent between the reply frames in
+// place of polled M1001 replies while M1029 is on
+struct PositionPush
+{
+	uint16_t magic;
+	uint16_t frame;  // USB frame number (1 ms) when sampled
+	int32_t position;
+	int32_t row;
+};
+static_assert(sizeof(PositionPush) == 12);
+
+constexpr uint16_t POSITION_MAGIC = 0x5AA6;
+
+// Called on the reader thread with each position push received
+using PositionHandler = std::function<void(const PositionPush &)>;
+
+// Matches preview_header_t in main.c.  While M1125 is on the row the head
+// is on comes every period as this header and, for each channel of mask
+// in turn, points uint32 sums of stride columns.
+struct PreviewHeader
+{
+	uint16_t magic;
+	uint16_t points;
+	uint16_t stride;
+	uint16_t mask;
+	int32_t row;
+	uint32_t sequence;  // Previews sent since M1125 turned them on
+	uint32_t built;     // Device milliseconds when summed
+};
+static_assert(sizeof(PreviewHeader) == 20);
+
+constexpr uint16_t PREVIEW_MAGIC = 0x5AAD;
+constexpr size_t PREVIEW_MAX_POINTS = 256;
+
+// Called on the reader thread with each preview and its sums, the planes
+// of the channels of mask one after another
+using PreviewHandler = std::function<void(const PreviewHeader &, std::span<const uint32_t>)>;
+
+// Text reply of a command, without the frame headers
+struct Reply
+{
+	std::string text;
+	bool error;  // FRAME_FLAG_ERROR, or the text starts with "error:"
+};
+
+class Client
+{
+public:
+	// Opens the port as open_port does and switches the device to framed
+	// commands.  With a capture path every byte sent and received from
+	// then on is recorded there with its time.
+	explicit Client(const std::string &port, const std::string &capture = {});
+	~Client();
+
+	Client(const Client &) = delete;
+	Client &operator=(const Client &) = delete;
+
+	// Any command with a text reply
+	std::future<Reply> command(uint16_t code, std::span<const int32_t> args = {});
+
+	// Any binary readout command; the payload is written to out, which
+	// must stay valid until the future is ready.  The future holds an
+	// exception if the device refuses the command or out is too small.
+	std::future<ReadoutHeader> readout(uint16_t code, std::span<const int32_t> args, std::span<std::byte> out);
+
+	// M1015 for 16-bit count builds.  A start past end wraps: out holds
+	// the cells from start to the last and on from cell 0 to end.
+	std::future<ReadoutHeader> read_counts(uint8_t channel, uint16_t start, uint16_t end, std::span<uint16_t> out);
+
+	// M1056: the cell range of the channels in mask as a container.  The
+	// blocks and their CRCs are written to out, which must hold
+	// container_payload_bytes(); the header and every block are checked.
+	std::future<ContainerHeader> read_container(bool interleave, uint16_t start, uint16_t end, uint16_t mask,
+		std::span<std::byte> out);
+
+	// M1068: blocks first..first + blocks - 1 of the container read_container
+	// would send with the same arguments, as a container of their own
+	std::future<ContainerHeader> resend_container(bool interleave, uint16_t start, uint16_t end, uint16_t mask,
+		uint32_t first, uint32_t blocks, std::span<std::byte> out);
+
+	// Opens the device's second CDC port, as open_port does, for the
+	// chunks of striped readouts sent on STRIPE_PIPE_CDC_DATA.  Its bytes
+	// are not captured.
+	void attach_data_port(const std::string &port);
+
+	// M1129: the payload read_container's blocks hold, without their
+	// CRCs, as M1016 sends it, striped over the pipes given: the command
+	// port and, once attached, the data port.  The bulk interface needs a
+	// USB library this client does not use.  The chunks are put in place
+	// in out as they arrive, and the whole is checked against the header.
+	std::future<ReadoutHeader> read_striped(bool interleave, uint16_t start, uint16_t end, uint16_t mask,
+		uint8_t pipes, std::span<std::byte> out);
+
+	// Stream blocks are skipped unless a handler is set, which must be
+	// done before streaming is turned on
+	void on_stream(StreamHandler handler);
+	// Position pushes likewise, before M1029 turns them on
+	void on_position(PositionHandler handler);
+	// And previews, before M1125 turns them on
+	void on_preview(PreviewHandler handler);
+
+private:
+	enum class Stage { Reply, Header, Payload, Final };
+
+	struct Pending
+	{
+		uint8_t sequence;
+		bool binary;
+		bool container;  // The binary header is a ContainerHeader
+		bool striped;    // The payload comes as stripe chunks (M1129)
+		uint16_t chunks;  // Of a striped readout, once the first has come
+		uint16_t chunks_received;
+		Stage stage;
+		std::string text;
+		ReadoutHeader header;  // For containers only length is used
+		ContainerHeader container_header;
+		std::span<std::byte> out;
+		uint32_t received;
+		std::promise<Reply> reply;
+		std::promise<ReadoutHeader> done;
+		std::promise<ContainerHeader> container_done;
+	};
+
+	void send(uint16_t code, std::span<const int32_t> args, Pending &&pending);
+	void record(uint8_t direction, const void *data, size_t length);
+	void write_all(const void *data, size_t length);
+	void reader();
+	bool fill();
+	bool take(void *data, size_t length);
+	bool push_sync(uint8_t byte) const;
+	void data_reader();
+	void place_chunk(const StripeChunk &chunk, const void *data);
+	void on_frame(uint8_t sequence, uint8_t flags, const uint8_t *payload, uint16_t length);
+	void finish_container(Pending &pending, bool error);
+	void fail(Pending &pending, const std::string &reason);
+	void fail_all(const std::string &reason);
+
+	int fd_;
+	uint8_t next_sequence_ = 0;
+	std::mutex write_mutex_;
+	std::mutex pending_mutex_;
+	std::deque<Pending> pending_;
+	std::thread reader_;
+	std::atomic<bool> stopping_ = false;
+
+	// The data port, and striped readouts not yet finished
+	int data_fd_ = -1;
+	std::thread data_reader_;
+	std::atomic<int> stripes_ = 0;
+	std::condition_variable chunk_placed_;
+	std::vector<std::byte> chunk_bytes_;
+
+	std::ofstream capture_;
+	std::mutex capture_mutex_;
+	std::chrono::steady_clock::time_point capture_start_;
+
+	StreamHandler stream_handler_;
+	std::vector<StreamRecord> stream_records_;
+	PositionHandler position_handler_;
+	PreviewHandler preview_handler_;
+	std::vector<uint32_t> preview_sums_;
+
+	// Bytes read from the port but not yet consumed
+	std::vector<uint8_t> buffer_;
+	size_t buffer_start_ = 0;
+};
+
+uint16_t crc16(const void *data, size_t length, uint16_t crc = 0xFFFF);
+// As crc32_update in crc.c (and zlib): start from 0 to begin
+uint32_t crc32(const void *data, size_t length, uint32_t crc = 0);
+
+}  // namespace dosimeter
@@ -0,0 +1,1545 @@
+// Device emulator for load testing the host pipeline and client library.
+//
+//   dosimeter_emulator [options]
+//
+// Each emulated device runs the portable core of the firmware natively:
+// command.c reads the text lines and checks the M1028 frames, crc.c
+// checksums the readouts and rle.c encodes M1026, over a count arena laid
+// out as main.c lays out its own, two banks of planar count_t bins.  The
+// head is stepped by a synthetic scan, or by the steps of an M1051 trace
+// dump replayed in a loop, and while counting each step adds Poisson
+// counts around a beam profile to the cell under the head.
+//
+// The devices are served on pseudo-terminals, whose paths are printed as
+// they open and are given to dosimeter_pipeline or dosimeter_bench like
+// CDC ports, or on a TCP port with a device per connection, given to
+// them as tcp:<host>:<port>.  Each device answers, with the firmware's
+// replies and errors and in text or framed mode,
+//   M1001 M1002 M1003 M1004 M1005 M1006 M1015 M1016 M1017 M1025 M1026
+//   M1028 M1029 M1056 M1068 M1125 M1129
+// and any other command is unknown to it.  It has only the one link, so
+// striped readouts (M1129) take the command port as their only pipe.  Streamed records (M1017) go
+// out between replies as the firmware's boot aggregation sends them, a
+// packet's worth at most per block and no waiting, and position pushes
+// (M1029) and previews (M1125, from the live bins, as without the
+// pyramid) likewise.
+//
+// Options
+//   -n <devices>      pseudo-terminals to open (default 1)
+//   -t <port>         serve on a TCP port instead
+//   -c <cells>        cells per channel (default 8000, as the firmware's arena)
+//   -s <rate>         steps per second of the synthetic scan (default 10000)
+//   -m <counts>       mean counts per step at the peak of the profile (default 20)
+//   -b <bytes/s>      link bandwidth, 0 for none (default 1000000, about USB
+//                     full speed)
+//   --trace <file>    replay the TRACE_STEP events of an M1051 dump instead
+//   --counting        count from the start, and swap the bank out at the end
+//                     of each pass over the cells as M1025 would, so M1056
+//                     reads whole frames while counting goes on
+
+extern "C" {
+#include "command.h"
+#include "crc.h"
+#include "rle.h"
+}
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <termios.h>
+#include <unistd.h>
+
+static_assert(std::endian::native == std::endian::little, "the wire format is little-endian");
+
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+// As main.c with its default build: three channels of 16-bit counts
+using count_t = uint16_t;
+constexpr count_t COUNT_MAX = UINT16_MAX;
+constexpr int CHANNELS = 3;
+constexpr int DEFAULT_CELLS = 48000 / CHANNELS / sizeof(count_t);
+
+// From main.c and reply.h; COMMAND_MAX_ARGS comes with command.h
+constexpr size_t COMMAND_LINE_BYTES = 256;
+constexpr size_t REPLY_FRAME_BYTES = 240;
+constexpr int CONTAINER_BLOCK_COLUMNS = 64;
+constexpr uint32_t CONTAINER_MAGIC = 0x52464344;
+constexpr uint16_t CONTAINER_VERSION = 2;
+constexpr uint16_t FIRMWARE_VERSION = 0x0100;
+constexpr uint8_t READOUT_FLAG_OVERFLOW = 0x01;
+constexpr uint8_t READOUT_FLAG_RLE = 0x02;
+constexpr uint16_t READOUT_ALL_PLANAR = 0x100;
+constexpr uint16_t READOUT_ALL_INTERLEAVED = 0x101;
+constexpr uint16_t READOUT_STRIPED = 0x4000;
+constexpr int READOUT_SLICE_COLUMNS = 64;
+
+// Striped readout (M1129) from main.c
+constexpr uint16_t STRIPE_MAGIC = 0x5AAF;
+constexpr int32_t STRIPE_PIPE_CDC = 0x01;
+
+// Streaming (M1017) from main.c, with its boot aggregation
+constexpr uint16_t STREAM_MAGIC = 0x5AA5;
+constexpr size_t STREAM_RING_SIZE = 512;
+constexpr size_t STREAM_BLOCK_RECORDS = 7;
+
+// Position push (M1029) from main.c
+constexpr uint16_t POSITION_MAGIC = 0x5AA6;
+constexpr int32_t POSITION_PUSH_OFF = 0;
+constexpr int32_t POSITION_PUSH_PERIOD = 1;
+constexpr int32_t POSITION_PUSH_COLUMNS = 2;
+
+// Live preview (M1125) from main.c
+constexpr uint16_t PREVIEW_MAGIC = 0x5AAD;
+constexpr int32_t PREVIEW_POINTS = 256;
+constexpr int32_t PREVIEW_PERIOD_MS = 100;
+
+// From trace.h and the M1051 dump of main.c
+constexpr uint32_t TRACE_MAGIC = 0x43525444;
+constexpr uint16_t TRACE_STEP = 1;
+constexpr uint16_t TRACE_CLOCK = 5;
+constexpr uint16_t TRACE_END = 0x8000;
+
+// As UDI_CDC_TX_TIMEOUT_MS: output nobody reads for this long is dropped
+constexpr int TX_TIMEOUT_MS = 1000;
+// Longest wait for input before the steps due are counted
+constexpr int STEP_POLL_MS = 1;
+// Writes are paced to the bandwidth in pieces of this size
+constexpr size_t LINK_CHUNK_BYTES = 4096;
+
+struct readout_header_t
+{
+	uint16_t channel;
+	uint16_t start;
+	uint16_t end;
+	uint16_t crc;
+	uint32_t length;
+	uint8_t width;
+	uint8_t flags;
+	uint16_t reserved;
+};
+static_assert(sizeof(readout_header_t) == 16);
+
+struct container_header_t
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t header_bytes;
+	uint32_t build_id;
+	uint16_t firmware;
+	uint16_t mask;
+	uint16_t start;
+	uint16_t end;
+	uint16_t columns;
+	uint16_t rows;
+	uint16_t bin_factor;
+	uint16_t block_columns;
+	uint8_t width;
+	uint8_t interleaved;
+	uint8_t flags;
+	uint8_t reserved;
+	uint32_t started;
+	uint32_t read;
+	uint32_t blocks;
+	uint32_t wall_started;
+	uint32_t wall_started_us;
+	uint32_t wall_stopped;
+	uint32_t wall_stopped_us;
+	uint32_t crc;
+};
+static_assert(sizeof(container_header_t) == 64);
+
+struct stream_header_t
+{
+	uint16_t magic;
+	uint16_t records;
+	uint32_t dropped;
+};
+
+struct stream_record_t
+{
+	uint16_t position;
+	uint16_t primary;
+	uint16_t secondary;
+	uint16_t tertiary;
+};
+static_assert(sizeof(stream_header_t) + STREAM_BLOCK_RECORDS * sizeof(stream_record_t) <= 64);
+
+struct position_push_t
+{
+	uint16_t magic;
+	uint16_t frame;
+	int32_t position;
+	int32_t row;
+};
+
+struct preview_header_t
+{
+	uint16_t magic;
+	uint16_t points;
+	uint16_t stride;
+	uint16_t mask;
+	int32_t row;
+	uint32_t sequence;
+	uint32_t built;
+};
+static_assert(sizeof(preview_header_t) == 20);
+
+struct stripe_chunk_t
+{
+	uint16_t magic;
+	uint16_t chunk;
+	uint16_t chunks;
+	uint8_t pipe;
+	uint8_t sequence;
+	uint32_t offset;
+	uint32_t length;
+};
+static_assert(sizeof(stripe_chunk_t) == 16);
+
+struct Options
+{
+	int devices = 1;
+	int tcp_port = 0;
+	int cells = DEFAULT_CELLS;
+	double rate = 10000.0;
+	double peak = 20.0;
+	double bandwidth = 1e6;
+	std::string trace;
+	bool counting = false;
+};
+
+// Steps of a recorded trace, in seconds from its first event
+struct Step
+{
+	double time;
+	uint16_t position;
+};
+
+struct Scan
+{
+	std::vector<Step> steps;  // Empty for the synthetic scan
+	double period = 0.0;      // Length of one loop of the trace
+};
+
+// Mean counts per step of each channel over the cells: a beam across the
+// middle of the scan on a flat background, weaker on each later channel
+std::vector<double> beam_profile(const Options &options)
+{
+	std::vector<double> mean(CHANNELS * options.cells);
+	double centre = options.cells / 2.0, width = options.cells / 8.0;
+	for (int c = 0; c < CHANNELS; c++)
+		for (int i = 0; i < options.cells; i++)
+		{
+			double x = (i - centre) / width;
+			mean[c * options.cells + i] = options.peak * (0.02 + std::exp(-x * x / 2)) / (1 << c);
+		}
+	return mean;
+}
+
+// The TRACE_STEP events of an M1051 dump: a header of magic, cpu_hz,
+// events recorded, events kept and the CRC-16 of the events, then the
+// trace_event_t of each
+bool load_trace(const std::string &path, Scan &scan)
+{
+	std::ifstream file(path, std::ios::binary);
+	std::vector<uint8_t> dump((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	constexpr size_t HEADER_BYTES = 16, EVENT_BYTES = 8;
+	if (dump.size() < HEADER_BYTES)
+		return false;
+
+	uint32_t magic, cpu_hz;
+	uint16_t count, crc;
+	std::memcpy(&magic, &dump[0], sizeof(magic));
+	std::memcpy(&cpu_hz, &dump[4], sizeof(cpu_hz));
+	std::memcpy(&count, &dump[12], sizeof(count));
+	std::memcpy(&crc, &dump[14], sizeof(crc));
+	if (magic != TRACE_MAGIC || !cpu_hz || dump.size() < HEADER_BYTES + count * EVENT_BYTES
+		|| crc16_update(0xFFFF, &dump[HEADER_BYTES], count * EVENT_BYTES) != crc)
+		return false;
+
+	// As chrome_trace in readout.py: the cycle counts wrap, and are of a
+	// clock slowed by the factor of the last TRACE_CLOCK event
+	double time = 0.0;
+	uint32_t factor = 1, previous = 0;
+	for (size_t e = 0; e < count; e++)
+	{
+		const uint8_t *event = &dump[HEADER_BYTES + e * EVENT_BYTES];
+		uint32_t cycles;
+		uint16_t id, arg;
+		std::memcpy(&cycles, event, sizeof(cycles));
+		std::memcpy(&id, event + 4, sizeof(id));
+		std::memcpy(&arg, event + 6, sizeof(arg));
+		if (e)
+			time += static_cast<int32_t>(cycles - previous) * static_cast<double>(factor) / cpu_hz;
+		previous = cycles;
+
+		if ((id & ~TRACE_END) == TRACE_CLOCK)
+			factor = std::max<uint16_t>(arg, 1);
+		else if (id == TRACE_STEP)
+			scan.steps.push_back({time, arg});
+	}
+	if (scan.steps.empty())
+		return false;
+
+	// The loop starts again one mean step interval after the last step
+	double span = scan.steps.back().time - scan.steps.front().time;
+	scan.period = span + (scan.steps.size() > 1 ? span / (scan.steps.size() - 1) : 1e-3);
+	double first = scan.steps.front().time;
+	for (Step &step : scan.steps)
+		step.time -= first;
+	return true;
+}
+
+class Device
+{
+public:
+	Device(int fd, const Options &options, const Scan &scan, const std::vector<double> &profile, uint32_t seed)
+		: fd_(fd), options_(options), scan_(scan), cells_(options.cells),
+		  arena_(2 * CHANNELS * cells_), overflow_(arena_.size()), random_(seed), boot_(Clock::now())
+	{
+		for (double mean : profile)
+			counts_.emplace_back(mean);
+		// Counting starts into the second bank, so readouts are taken from
+		// the first, empty, until the first pass ends
+		if (options.counting)
+		{
+			bank_swap();
+			counting_ = true;
+		}
+	}
+
+	// Serve the link until it closes
+	void run();
+
+private:
+	using Handler = void (Device::*)(const int32_t *, uint8_t);
+	struct Command
+	{
+		uint16_t code;
+		Handler handler;
+	};
+	static const Command commands_[];
+
+	// Link
+	void receive(const uint8_t *data, size_t length);
+	void read_line_byte(char c);
+	void read_frame_byte(uint8_t c);
+	bool flush();
+	void flush_stream();
+	void push_position();
+	void push_preview();
+
+	// Steps and counting
+	uint32_t ms() const;
+	void advance();
+	void step(int32_t position);
+	void bank_swap();
+	size_t index(int bank, int channel, int cell) const { return (bank * CHANNELS + channel) * cells_ + cell; }
+
+	// Replies, as reply.c builds them
+	void reply(std::string_view text);
+	void reply_binary(const void *data, size_t length);
+	void frame_begin(uint8_t opcode, uint8_t sequence);
+	void frame_end(uint8_t flags);
+	void frame_send(uint8_t flags);
+
+	// Commands, as parse_batch, parse_gcode and parse_frame in main.c
+	void parse_batch(const std::string &line);
+	void parse_gcode(const char *line);
+	void parse_frame(const uint8_t *frame, uint16_t length);
+	const Command *find_command(uint32_t code) const;
+	void finish_job();
+
+	bool readout_stable(std::string_view what = "read");
+	bool validate_column_range(int32_t start, int32_t end, bool wraps = false);
+	bool parse_readout_args(const int32_t *argv, uint8_t argc, bool wraps = false);
+	bool container_args(const int32_t *argv, uint8_t argc, int32_t *mask, bool wraps = false);
+	uint8_t readout_flags(int channel, int32_t start, int32_t end) const;
+	void readout_plane(std::vector<uint8_t> &out, int channel, int32_t start, int32_t end) const;
+	void readout_payload(std::vector<uint8_t> &out, uint16_t mask, int32_t start, int32_t end, bool interleave) const;
+	void readout_send(readout_header_t &header);
+	void container_send(bool interleave, int32_t start, int32_t end, uint16_t mask);
+
+	void command_m1001(const int32_t *argv, uint8_t argc);
+	void command_m1002(const int32_t *argv, uint8_t argc);
+	void command_m1003(const int32_t *argv, uint8_t argc);
+	void command_m1004(const int32_t *argv, uint8_t argc);
+	void command_m1005(const int32_t *argv, uint8_t argc);
+	void command_m1006(const int32_t *argv, uint8_t argc);
+	void command_m1015(const int32_t *argv, uint8_t argc);
+	void command_m1016(const int32_t *argv, uint8_t argc);
+	void command_m1017(const int32_t *argv, uint8_t argc);
+	void command_m1025(const int32_t *argv, uint8_t argc);
+	void command_m1026(const int32_t *argv, uint8_t argc);
+	void command_m1028(const int32_t *argv, uint8_t argc);
+	void command_m1029(const int32_t *argv, uint8_t argc);
+	void command_m1056(const int32_t *argv, uint8_t argc);
+	void command_m1068(const int32_t *argv, uint8_t argc);
+	void command_m1125(const int32_t *argv, uint8_t argc);
+	void command_m1129(const int32_t *argv, uint8_t argc);
+
+	int fd_;
+	const Options &options_;
+	const Scan &scan_;
+	int cells_;
+
+	// Bank b, channel c, cell i is arena_[index(b, c, i)]
+	std::vector<count_t> arena_;
+	std::vector<bool> overflow_;
+	int count_bank_ = 0;
+	int readout_bank_ = 0;
+	bool counting_ = false;
+	uint32_t count_started_ = 0;
+
+	std::vector<std::poisson_distribution<uint32_t>> counts_;
+	std::mt19937 random_;
+	Clock::time_point boot_;
+	uint64_t steps_ = 0;  // Steps taken since boot
+	int32_t head_position_ = 0;
+	int32_t head_origin_ = 0;
+
+	// Records of the steps counted while streaming, not yet sent
+	bool stream_ = false;
+	std::deque<stream_record_t> stream_queue_;
+	uint32_t stream_dropped_ = 0;
+
+	int32_t position_push_mode_ = POSITION_PUSH_OFF;
+	uint32_t position_push_interval_ = 0;
+	uint32_t position_push_last_ = 0;  // ms() or head position at the last push
+
+	bool preview_on_ = false;
+	int32_t preview_points_max_ = PREVIEW_POINTS;
+	int32_t preview_period_ = PREVIEW_PERIOD_MS;
+	uint16_t preview_mask_ = 0;
+	uint32_t preview_last_ = 0;  // ms() at the last preview
+	uint32_t preview_sequence_ = 0;
+	uint32_t preview_late_ = 0;
+
+	// Command input, as assembled by read_line_byte and read_frame_byte
+	bool binary_ = false;
+	std::vector<uint8_t> command_;
+	bool command_overflow_ = false;
+
+	// Reply frame of the framed command being run
+	bool frame_open_ = false;
+	frame_header_t frame_header_{};
+	std::vector<uint8_t> frame_payload_;
+	uint8_t command_opcode_ = 0;
+	uint8_t command_sequence_ = 0;
+	bool command_framed_ = false;
+
+	// What a readout command leaves to send once its own reply has ended
+	enum class Job { None, Binary, Text };
+	Job job_ = Job::None;
+	std::vector<uint8_t> job_payload_;
+
+	std::vector<uint8_t> out_;
+	Clock::time_point link_free_ = Clock::now();
+	bool link_lost_ = false;
+};
+
+const Device::Command Device::commands_[] = {
+	{1001, &Device::command_m1001},
+	{1002, &Device::command_m1002},
+	{1003, &Device::command_m1003},
+	{1004, &Device::command_m1004},
+	{1005, &Device::command_m1005},
+	{1006, &Device::command_m1006},
+	{1015, &Device::command_m1015},
+	{1016, &Device::command_m1016},
+	{1017, &Device::command_m1017},
+	{1025, &Device::command_m1025},
+	{1026, &Device::command_m1026},
+	{1028, &Device::command_m1028},
+	{1029, &Device::command_m1029},
+	{1056, &Device::command_m1056},
+	{1068, &Device::command_m1068},
+	{1125, &Device::command_m1125},
+	{1129, &Device::command_m1129},
+};
+
+void Device::run()
+{
+	while (!link_lost_)
+	{
+		pollfd p{fd_, POLLIN, 0};
+		int ready = poll(&p, 1, STEP_POLL_MS);
+		if (ready > 0)
+		{
+			uint8_t chunk[4096];
+			ssize_t n = ::read(fd_, chunk, sizeof(chunk));
+			if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN))
+				return;
+			if (n > 0)
+				receive(chunk, n);
+		}
+		advance();
+		flush_stream();
+		push_position();
+		push_preview();
+	}
+}
+
+void Device::receive(const uint8_t *data, size_t length)
+{
+	for (size_t i = 0; i < length && !link_lost_; i++)
+	{
+		if (binary_)
+			read_frame_byte(data[i]);
+		else
+			read_line_byte(data[i]);
+	}
+}
+
+void Device::read_line_byte(char c)
+{
+	if (c != '\n' && c != '\r')
+	{
+		if (command_.size() < COMMAND_LINE_BYTES - 1)
+			command_.push_back(c);
+		else
+			command_overflow_ = true;
+		return;
+	}
+
+	if (command_overflow_)
+		reply("WARNING: input buffer full.  Buffered data have been discarded.\r\n");
+	else
+		parse_batch(std::string(command_.begin(), command_.end()));
+	command_.clear();
+	command_overflow_ = false;
+	flush();
+}
+
+// Bytes before a sync byte are skipped, and a header with a bad length
+// ends the frame at once, for parse_frame to reject
+void Device::read_frame_byte(uint8_t c)
+{
+	if (command_.empty() && c != FRAME_SYNC_COMMAND)
+		return;
+
+	command_.push_back(c);
+	if (command_.size() < sizeof(frame_header_t))
+		return;
+
+	frame_header_t header;
+	std::memcpy(&header, command_.data(), sizeof(header));
+	if (header.length > COMMAND_MAX_ARGS * sizeof(int32_t) || header.length % sizeof(int32_t)
+		|| command_.size() == sizeof(header) + header.length + sizeof(uint16_t))
+	{
+		parse_frame(command_.data(), command_.size());
+		command_.clear();
+		flush();
+	}
+}
+
+// Write out_ at the link bandwidth, dropping it if the host stops reading
+bool Device::flush()
+{
+	size_t sent = 0;
+	while (sent < out_.size())
+	{
+		size_t length = std::min(out_.size() - sent, LINK_CHUNK_BYTES);
+		if (options_.bandwidth > 0)
+		{
+			auto now = Clock::now();
+			if (link_free_ > now)
+				std::this_thread::sleep_until(link_free_);
+			link_free_ = std::max(link_free_, now) + std::chrono::duration_cast<Clock::duration>(
+				std::chrono::duration<double>(length / options_.bandwidth));
+		}
+
+		pollfd p{fd_, POLLOUT, 0};
+		if (poll(&p, 1, TX_TIMEOUT_MS) <= 0)
+			break;
+		ssize_t n = ::write(fd_, out_.data() + sent, length);
+		if (n < 0 && errno != EINTR && errno != EAGAIN)
+		{
+			link_lost_ = true;
+			break;
+		}
+		if (n > 0)
+			sent += n;
+	}
+
+	bool whole = sent == out_.size();
+	out_.clear();
+	return whole;
+}
+
+// Send the records queued, in blocks of a packet each.  Replies are
+// always whole by now, so blocks never land in the middle of one.
+void Device::flush_stream()
+{
+	while (!stream_queue_.empty() && !link_lost_)
+	{
+		stream_header_t header{STREAM_MAGIC, 0, stream_dropped_};
+		header.records = std::min(stream_queue_.size(), STREAM_BLOCK_RECORDS);
+		const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&header);
+		out_.insert(out_.end(), bytes, bytes + sizeof(header));
+		for (int i = 0; i < header.records; i++)
+		{
+			bytes = reinterpret_cast<const uint8_t *>(&stream_queue_.front());
+			out_.insert(out_.end(), bytes, bytes + sizeof(stream_record_t));
+			stream_queue_.pop_front();
+		}
+		flush();
+	}
+}
+
+void Device::push_position()
+{
+	if (position_push_mode_ == POSITION_PUSH_OFF)
+		return;
+
+	if (position_push_mode_ == POSITION_PUSH_PERIOD)
+	{
+		uint32_t now = ms();
+		if (now - position_push_last_ < position_push_interval_)
+			return;
+		position_push_last_ = now;
+	}
+	else
+	{
+		// The head wraps around the cells, so take the shorter way round
+		uint32_t moved = std::abs(head_position_ - static_cast<int32_t>(position_push_last_));
+		if (moved > static_cast<uint32_t>(cells_) / 2)
+			moved = cells_ - moved;
+		if (moved < position_push_interval_)
+			return;
+		position_push_last_ = head_position_;
+	}
+
+	position_push_t push{POSITION_MAGIC, static_cast<uint16_t>(ms() & 0x7FF), head_position_ - head_origin_, 0};
+	const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&push);
+	out_.insert(out_.end(), bytes, bytes + sizeof(push));
+	flush();
+}
+
+// The cells are the one row, summed from the live bank
+void Device::push_preview()
+{
+	uint32_t now = ms();
+	if (!preview_on_ || now - preview_last_ < static_cast<uint32_t>(preview_period_))
+		return;
+	if (now - preview_last_ >= 2u * preview_period_)
+		preview_late_++;
+	preview_last_ = now;
+
+	int32_t stride = (cells_ + preview_points_max_ - 1) / preview_points_max_;
+	int32_t points = (cells_ + stride - 1) / stride;
+	preview_header_t header{PREVIEW_MAGIC, static_cast<uint16_t>(points), static_cast<uint16_t>(stride), preview_mask_, 0,
+		preview_sequence_++, now};
+	const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&header);
+	out_.insert(out_.end(), bytes, bytes + sizeof(header));
+	for (int c = 0; c < CHANNELS; c++)
+	{
+		if (!(preview_mask_ & (1u << c)))
+			continue;
+		for (int32_t p = 0; p < points; p++)
+		{
+			uint32_t sum = 0;
+			for (int32_t cell = p * stride; cell < std::min((p + 1) * stride, cells_); cell++)
+				sum += arena_[index(count_bank_, c, cell)];
+			bytes = reinterpret_cast<const uint8_t *>(&sum);
+			out_.insert(out_.end(), bytes, bytes + sizeof(sum));
+		}
+	}
+	flush();
+}
+
+// Milliseconds since boot, as sof_count
+uint32_t Device::ms() const
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - boot_).count();
+}
+
+// Take the steps due by now.  The synthetic scan sweeps the cells in
+// order and flies back to the first; a trace is replayed in a loop.
+// Either way the end of a pass over the cells ends a frame.
+void Device::advance()
+{
+	double elapsed = std::chrono::duration<double>(Clock::now() - boot_).count();
+	if (scan_.steps.empty())
+	{
+		uint64_t due = static_cast<uint64_t>(elapsed * options_.rate);
+		for (; steps_ < due; steps_++)
+		{
+			step(steps_ % cells_);
+			if (steps_ % cells_ == static_cast<uint64_t>(cells_ - 1) && options_.counting && counting_)
+				bank_swap();
+		}
+		return;
+	}
+
+	size_t length = scan_.steps.size();
+	for (;;)
+	{
+		uint64_t loop = steps_ / length;
+		const Step &next = scan_.steps[steps_ % length];
+		if (loop * scan_.period + next.time > elapsed)
+			return;
+
+		step(next.position);
+		steps_++;
+		if (steps_ % length == 0 && options_.counting && counting_)
+			bank_swap();
+	}
+}
+
+void Device::step(int32_t position)
+{
+	head_position_ = position;
+	if (!counting_)
+		return;
+
+	int cell = position % cells_;
+	uint32_t counts[CHANNELS];
+	for (int c = 0; c < CHANNELS; c++)
+	{
+		size_t i = index(count_bank_, c, cell);
+		counts[c] = counts_[c * cells_ + cell](random_);
+		uint32_t sum = arena_[i] + counts[c];
+		if (sum > COUNT_MAX)
+		{
+			sum = COUNT_MAX;
+			overflow_[i] = true;
+		}
+		arena_[i] = sum;
+	}
+
+	// Records carry the first three channels, saturated to 16 bits
+	if (stream_)
+	{
+		if (stream_queue_.size() < STREAM_RING_SIZE)
+		{
+			auto saturate = [](uint32_t count) { return static_cast<uint16_t>(std::min<uint32_t>(count, UINT16_MAX)); };
+			stream_queue_.push_back({static_cast<uint16_t>(cell), saturate(counts[0]), saturate(counts[1]),
+				saturate(counts[2])});
+		}
+		else
+			stream_dropped_++;
+	}
+}
+
+// Continue into the other bank, cleared, and read out the one just counted
+void Device::bank_swap()
+{
+	readout_bank_ = count_bank_;
+	count_bank_ ^= 1;
+	auto first = arena_.begin() + index(count_bank_, 0, 0);
+	std::fill(first, first + CHANNELS * cells_, 0);
+	auto flags = overflow_.begin() + index(count_bank_, 0, 0);
+	std::fill(flags, flags + CHANNELS * cells_, false);
+}
+
+void Device::reply(std::string_view text)
+{
+	if (!frame_open_)
+	{
+		out_.insert(out_.end(), text.begin(), text.end());
+		return;
+	}
+
+	while (!text.empty())
+	{
+		if (frame_payload_.size() == REPLY_FRAME_BYTES)
+			frame_send(FRAME_FLAG_MORE);
+		size_t run = std::min(text.size(), REPLY_FRAME_BYTES - frame_payload_.size());
+		frame_payload_.insert(frame_payload_.end(), text.begin(), text.begin() + run);
+		text.remove_prefix(run);
+	}
+}
+
+// Binary data follows the frame holding the reply text so far
+void Device::reply_binary(const void *data, size_t length)
+{
+	if (frame_open_ && !frame_payload_.empty())
+		frame_send(FRAME_FLAG_MORE);
+	const uint8_t *bytes = static_cast<const uint8_t *>(data);
+	out_.insert(out_.end(), bytes, bytes + length);
+}
+
+void Device::frame_begin(uint8_t opcode, uint8_t sequence)
+{
+	frame_header_.sync = FRAME_SYNC_REPLY;
+	frame_header_.opcode = opcode;
+	frame_header_.sequence = sequence;
+	frame_payload_.clear();
+	frame_open_ = true;
+}
+
+void Device::frame_end(uint8_t flags)
+{
+	frame_open_ = false;
+	frame_send(flags);
+}
+
+void Device::frame_send(uint8_t flags)
+{
+	frame_header_.flags = flags;
+	frame_header_.length = frame_payload_.size();
+	uint16_t crc = crc16_update(0xFFFF, reinterpret_cast<const uint8_t *>(&frame_header_), sizeof(frame_header_));
+	crc = crc16_update(crc, frame_payload_.data(), frame_payload_.size());
+
+	const uint8_t *header = reinterpret_cast<const uint8_t *>(&frame_header_);
+	out_.insert(out_.end(), header, header + sizeof(frame_header_));
+	out_.insert(out_.end(), frame_payload_.begin(), frame_payload_.end());
+	out_.insert(out_.end(), reinterpret_cast<const uint8_t *>(&crc), reinterpret_cast<const uint8_t *>(&crc + 1));
+	frame_payload_.clear();
+}
+
+// Commands separated by ';' run in turn, each readout finishing before
+// the next command
+void Device::parse_batch(const std::string &line)
+{
+	size_t start = 0;
+	for (;;)
+	{
+		size_t end = line.find(';', start);
+		std::string command = line.substr(start, end == std::string::npos ? std::string::npos : end - start);
+		if (end == std::string::npos || !command.empty())
+		{
+			parse_gcode(command.c_str());
+			finish_job();
+		}
+		if (end == std::string::npos)
+			return;
+
+		start = line.find_first_not_of(' ', end + 1);
+		if (start == std::string::npos)
+			return;
+	}
+}
+
+const Device::Command *Device::find_command(uint32_t code) const
+{
+	for (const Command &command : commands_)
+		if (command.code == code)
+			return &command;
+	return nullptr;
+}
+
+void Device::parse_gcode(const char *line)
+{
+	int32_t argv[COMMAND_MAX_ARGS] = {0};
+	uint8_t argc;
+	uint32_t code = parse_command(line, nullptr, UINT16_MAX, argv, COMMAND_MAX_ARGS, &argc);
+	const Command *command = find_command(code);
+
+	if (command)
+	{
+		command_framed_ = false;
+		(this->*command->handler)(argv, argc);
+		return;
+	}
+
+	reply("error: unknown command '");
+	reply(line);
+	reply("'\n");
+}
+
+void Device::parse_frame(const uint8_t *frame, uint16_t length)
+{
+	frame_header_t header;
+	bool valid = frame_check(frame, length, &header);
+	frame_begin(header.opcode, header.sequence);
+
+	const Command *command = find_command(1000 + header.opcode);
+	if (!valid || !command)
+	{
+		frame_end(FRAME_FLAG_ERROR);
+		return;
+	}
+
+	int32_t argv[COMMAND_MAX_ARGS] = {0};
+	std::memcpy(argv, &frame[sizeof(header)], header.length);
+
+	command_opcode_ = header.opcode;
+	command_sequence_ = header.sequence;
+	command_framed_ = true;
+	(this->*command->handler)(argv, header.length / sizeof(int32_t));
+
+	// A readout continues in later frames
+	frame_end(job_ != Job::None ? FRAME_FLAG_MORE : 0);
+	finish_job();
+}
+
+// Send what a readout left once its command has replied: the payload and
+// a final "ok", or for a text readout the values and the "ok" after them
+void Device::finish_job()
+{
+	if (job_ == Job::None)
+		return;
+
+	if (job_ == Job::Binary)
+		reply_binary(job_payload_.data(), job_payload_.size());
+	if (command_framed_)
+		frame_begin(command_opcode_, command_sequence_);
+	if (job_ == Job::Text)
+		reply(std::string_view(reinterpret_cast<const char *>(job_payload_.data()), job_payload_.size()));
+	reply("ok\n");
+	if (command_framed_)
+		frame_end(0);
+
+	job_ = Job::None;
+	job_payload_.clear();
+}
+
+// The readout bank can be read while counting once it has been swapped out
+bool Device::readout_stable(std::string_view what)
+{
+	if (counting_ && readout_bank_ == count_bank_)
+	{
+		reply("error: cannot ");
+		reply(what);
+		reply(" counter while it is active\n");
+		return false;
+	}
+	return true;
+}
+
+// With wraps, a start past the end is a range that wraps from the last
+// cell to the first, as M1005, M1015 and M1016 take
+bool Device::validate_column_range(int32_t start, int32_t end, bool wraps)
+{
+	if (start < 0 || start >= cells_ || end < 0 || end >= cells_ || (start > end && !wraps))
+	{
+		reply("error: invalid column range\n");
+		return false;
+	}
+	return true;
+}
+
+bool Device::parse_readout_args(const int32_t *argv, uint8_t argc, bool wraps)
+{
+	if (argc < 3)
+	{
+		reply("error: read command requires three arguments\n");
+		return false;
+	}
+
+	if (argv[0] < 0 || argv[0] >= CHANNELS)
+	{
+		reply("error: invalid counter\n");
+		return false;
+	}
+
+	return validate_column_range(argv[1], argv[2], wraps);
+}
+
+// Check the <interleave> <start> <end> [mask] arguments of M1016, M1056 and M1068
+bool Device::container_args(const int32_t *argv, uint8_t argc, int32_t *mask, bool wraps)
+{
+	if (!readout_stable())
+		return false;
+
+	if (argc < 3)
+	{
+		reply("error: read command requires three arguments\n");
+		return false;
+	}
+
+	if (argv[0] != 0 && argv[0] != 1)
+	{
+		reply("error: invalid layout\n");
+		return false;
+	}
+
+	int32_t all = (1 << CHANNELS) - 1;
+	*mask = argc > 3 ? argv[3] : all;
+	if (*mask <= 0 || (*mask & ~all))
+	{
+		reply("error: invalid channel mask\n");
+		return false;
+	}
+
+	return validate_column_range(argv[1], argv[2], wraps);
+}
+
+// Here and in readout_plane and readout_payload a start past the end wraps
+uint8_t Device::readout_flags(int channel, int32_t start, int32_t end) const
+{
+	if (start > end)
+		return readout_flags(channel, start, cells_ - 1) | readout_flags(channel, 0, end);
+	for (int32_t i = start; i <= end; i++)
+		if (overflow_[index(readout_bank_, channel, i)])
+			return READOUT_FLAG_OVERFLOW;
+	return 0;
+}
+
+void Device::readout_plane(std::vector<uint8_t> &out, int channel, int32_t start, int32_t end) const
+{
+	if (start > end)
+	{
+		readout_plane(out, channel, start, cells_ - 1);
+		readout_plane(out, channel, 0, end);
+		return;
+	}
+	const uint8_t *first = reinterpret_cast<const uint8_t *>(&arena_[index(readout_bank_, channel, start)]);
+	out.insert(out.end(), first, first + (end - start + 1) * sizeof(count_t));
+}
+
+// The channels in mask over start..end, planar or interleaved per column
+void Device::readout_payload(std::vector<uint8_t> &out, uint16_t mask, int32_t start, int32_t end,
+	bool interleave) const
+{
+	if (!interleave)
+	{
+		for (int c = 0; c < CHANNELS; c++)
+			if (mask & (1 << c))
+				readout_plane(out, c, start, end);
+		return;
+	}
+
+	for (int32_t i = start;; i = (i + 1) % cells_)
+	{
+		for (int c = 0; c < CHANNELS; c++)
+			if (mask & (1 << c))
+			{
+				count_t value = arena_[index(readout_bank_, c, i)];
+				const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&value);
+				out.insert(out.end(), bytes, bytes + sizeof(value));
+			}
+		if (i == end)
+			break;
+	}
+}
+
+// Reply with the header of a binary readout whose payload is job_payload_
+void Device::readout_send(readout_header_t &header)
+{
+	header.length = job_payload_.size();
+	header.crc = crc16_update(0xFFFF, job_payload_.data(), job_payload_.size());
+	header.width = sizeof(count_t);
+	reply("ok\n");
+	reply_binary(&header, sizeof(header));
+	job_ = Job::Binary;
+}
+
+void Device::container_send(bool interleave, int32_t start, int32_t end, uint16_t mask)
+{
+	static const char build[] = __DATE__ " " __TIME__;
+
+	container_header_t header{};
+	header.magic = CONTAINER_MAGIC;
+	header.version = CONTAINER_VERSION;
+	header.header_bytes = sizeof(header);
+	header.build_id = crc32_update(0, reinterpret_cast<const uint8_t *>(build), sizeof(build) - 1);
+	header.firmware = FIRMWARE_VERSION;
+	header.mask = mask;
+	header.start = start;
+	header.end = end;
+	header.columns = cells_;
+	header.rows = 1;
+	header.bin_factor = 1;
+	header.block_columns = CONTAINER_BLOCK_COLUMNS;
+	header.width = sizeof(count_t);
+	header.interleaved = interleave;
+	for (int c = 0; c < CHANNELS; c++)
+		if (mask & (1 << c))
+			header.flags |= readout_flags(c, start, end);
+	header.started = count_started_;
+	header.read = ms();
+	header.blocks = (end - start + CONTAINER_BLOCK_COLUMNS) / CONTAINER_BLOCK_COLUMNS;
+	// The wall clock (M1123) is never set, so its stamps stay 0
+	header.crc = crc32_update(0, reinterpret_cast<const uint8_t *>(&header), offsetof(container_header_t, crc));
+
+	// Each block is followed by the CRC-32 of its payload
+	job_payload_.clear();
+	for (int32_t first = start; first <= end; first += CONTAINER_BLOCK_COLUMNS)
+	{
+		size_t offset = job_payload_.size();
+		readout_payload(job_payload_, mask, first, std::min(end, first + CONTAINER_BLOCK_COLUMNS - 1), interleave);
+		uint32_t crc = crc32_update(0, &job_payload_[offset], job_payload_.size() - offset);
+		const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&crc);
+		job_payload_.insert(job_payload_.end(), bytes, bytes + sizeof(crc));
+	}
+
+	reply("ok\n");
+	reply_binary(&header, sizeof(header));
+	job_ = Job::Binary;
+}
+
+// Report current position
+void Device::command_m1001(const int32_t *, uint8_t)
+{
+	reply("ok\n");
+	reply(std::to_string(head_position_ - head_origin_));
+	reply("\n");
+}
+
+// Reset current position
+void Device::command_m1002(const int32_t *, uint8_t)
+{
+	head_origin_ = head_position_;
+	reply("ok\n");
+}
+
+// Enable counting
+void Device::command_m1003(const int32_t *, uint8_t)
+{
+	if (counting_)
+	{
+		reply("error: counter is already active\n");
+		return;
+	}
+
+	counting_ = true;
+	count_started_ = ms();
+	reply("ok\n");
+}
+
+// Disable counting
+void Device::command_m1004(const int32_t *, uint8_t)
+{
+	if (!counting_)
+	{
+		reply("error: counter is not active\n");
+		return;
+	}
+
+	counting_ = false;
+	reply("ok\n");
+}
+
+// Read counts as text, the range wrapping if start is past end
+void Device::command_m1005(const int32_t *argv, uint8_t argc)
+{
+	if (!readout_stable() || !parse_readout_args(argv, argc, true))
+		return;
+
+	std::string text;
+	for (int32_t i = argv[1];; i = (i + 1) % cells_)
+	{
+		text += std::to_string(arena_[index(readout_bank_, argv[0], i)]);
+		text += ' ';
+		if (i == argv[2])
+			break;
+	}
+	text += '\n';
+
+	reply("ok\n");
+	job_payload_.assign(text.begin(), text.end());
+	job_ = Job::Text;
+}
+
+// Reset counts; while counting only the readout bank is cleared
+void Device::command_m1006(const int32_t *, uint8_t)
+{
+	if (!readout_stable("reset"))
+		return;
+
+	for (int bank = 0; bank < 2; bank++)
+		if (!counting_ || bank == readout_bank_)
+		{
+			auto first = arena_.begin() + index(bank, 0, 0);
+			std::fill(first, first + CHANNELS * cells_, 0);
+			auto flags = overflow_.begin() + index(bank, 0, 0);
+			std::fill(flags, flags + CHANNELS * cells_, false);
+		}
+	reply("ok\n");
+}
+
+// Read counts in binary, the range wrapping if start is past end
+void Device::command_m1015(const int32_t *argv, uint8_t argc)
+{
+	if (!readout_stable() || !parse_readout_args(argv, argc, true))
+		return;
+
+	readout_header_t header{};
+	header.channel = argv[0];
+	header.start = argv[1];
+	header.end = argv[2];
+	header.flags = readout_flags(argv[0], argv[1], argv[2]);
+	readout_plane(job_payload_, argv[0], argv[1], argv[2]);
+	readout_send(header);
+}
+
+// Enable or disable streaming of counted columns
+void Device::command_m1017(const int32_t *argv, uint8_t argc)
+{
+	int32_t enable = argv[0];
+	if (argc < 1 || (enable != 0 && enable != 1))
+	{
+		reply("error: stream command requires an argument of 0 or 1\n");
+		return;
+	}
+
+	stream_queue_.clear();
+	stream_dropped_ = 0;
+	stream_ = enable;
+	reply("ok\n");
+}
+
+// Read stored channels in binary: M1016 <interleave> <start> <end> [mask],
+// the range wrapping if start is past end
+void Device::command_m1016(const int32_t *argv, uint8_t argc)
+{
+	int32_t mask;
+	if (!container_args(argv, argc, &mask, true))
+		return;
+
+	readout_header_t header{};
+	header.channel = argv[0] ? READOUT_ALL_INTERLEAVED : READOUT_ALL_PLANAR;
+	header.start = argv[1];
+	header.end = argv[2];
+	for (int c = 0; c < CHANNELS; c++)
+		if (mask & (1 << c))
+			header.flags |= readout_flags(c, argv[1], argv[2]);
+	header.reserved = mask;
+	readout_payload(job_payload_, mask, argv[1], argv[2], argv[0]);
+	readout_send(header);
+}
+
+// Continue acquiring into a cleared bank and expose the current one for readout
+void Device::command_m1025(const int32_t *, uint8_t)
+{
+	bank_swap();
+	reply("ok\n");
+}
+
+// The encoder of rle.c hands each full block to a plain function, which
+// appends it to the payload of the device whose thread is encoding
+thread_local std::vector<uint8_t> *rle_output;
+
+bool rle_emit(const volatile void *data, uint32_t length, uint16_t *)
+{
+	const uint8_t *bytes = static_cast<const uint8_t *>(const_cast<const void *>(data));
+	rle_output->insert(rle_output->end(), bytes, bytes + length);
+	return true;
+}
+
+// Read counts in binary, compressed
+void Device::command_m1026(const int32_t *argv, uint8_t argc)
+{
+	if (!readout_stable() || !parse_readout_args(argv, argc))
+		return;
+
+	rle_block_t block;
+	rle_output = &job_payload_;
+	rle_begin(&block, rle_emit);
+	for (int32_t i = argv[1]; i <= argv[2]; i++)
+		rle_value(&block, arena_[index(readout_bank_, argv[0], i)], nullptr);
+	rle_finish(&block, nullptr);
+
+	readout_header_t header{};
+	header.channel = argv[0];
+	header.start = argv[1];
+	header.end = argv[2];
+	header.flags = readout_flags(argv[0], argv[1], argv[2]) | READOUT_FLAG_RLE;
+	readout_send(header);
+}
+
+// Switch the command protocol: 0 text, 1 binary frames
+void Device::command_m1028(const int32_t *argv, uint8_t argc)
+{
+	if (argc < 1 || (argv[0] != 0 && argv[0] != 1))
+	{
+		reply("error: protocol command requires an argument of 0 or 1\n");
+		return;
+	}
+
+	// Takes effect from the next byte received
+	binary_ = argv[0];
+	reply("ok\n");
+}
+
+// Push the head position: M1029 0 off, M1029 1 <ms>, M1029 2 <columns>
+void Device::command_m1029(const int32_t *argv, uint8_t argc)
+{
+	int32_t mode = argv[0], interval = argv[1];
+	if (argc < 1 || mode < POSITION_PUSH_OFF || mode > POSITION_PUSH_COLUMNS
+		|| (mode != POSITION_PUSH_OFF && (argc < 2 || interval < 1 || interval > UINT16_MAX)))
+	{
+		reply("error: invalid position push\n");
+		return;
+	}
+
+	position_push_interval_ = interval;
+	position_push_last_ = mode == POSITION_PUSH_PERIOD ? ms() : static_cast<uint32_t>(head_position_);
+	position_push_mode_ = mode;
+	reply("ok\n");
+}
+
+// Live preview: M1125 1 [<points> [<period ms> [<mask>]]], M1125 0, or
+// M1125 alone for "<on> <points> <period> <mask> <sent> <late> <level>"
+void Device::command_m1125(const int32_t *argv, uint8_t argc)
+{
+	if (argc == 0)
+	{
+		reply("ok\n");
+		reply(std::to_string(preview_on_) + ' ' + std::to_string(preview_points_max_) + ' '
+			+ std::to_string(preview_period_) + ' ' + std::to_string(preview_mask_) + ' '
+			+ std::to_string(preview_sequence_) + ' ' + std::to_string(preview_late_) + " 0");
+		reply("\n");
+		return;
+	}
+
+	int32_t points = argc > 1 ? argv[1] : PREVIEW_POINTS;
+	int32_t period = argc > 2 ? argv[2] : PREVIEW_PERIOD_MS;
+	int32_t mask = argc > 3 ? argv[3] : (1 << CHANNELS) - 1;
+	if ((argv[0] != 0 && argv[0] != 1) || points < 1 || points > PREVIEW_POINTS || period < 1 || period > UINT16_MAX
+		|| mask < 1 || mask >= (1 << CHANNELS))
+	{
+		reply("error: preview requires 0 or 1, up to 256 points, a period of 1 to 65535 ms and a mask of counters\n");
+		return;
+	}
+
+	preview_on_ = argv[0];
+	if (preview_on_)
+	{
+		preview_points_max_ = points;
+		preview_period_ = period;
+		preview_mask_ = mask;
+		preview_last_ = ms();
+		preview_sequence_ = 0;
+		preview_late_ = 0;
+	}
+	reply("ok\n");
+}
+
+// Read stored channels striped: M1129 <interleave> <start> <end> [mask
+// [pipes]], the payload M1016 would send as a chunk per slice, each
+// channel's range in turn when planar, all on the command port
+void Device::command_m1129(const int32_t *argv, uint8_t argc)
+{
+	int32_t mask;
+	if (!container_args(argv, argc, &mask))
+		return;
+
+	if (argc > 4 && argv[4] != STRIPE_PIPE_CDC)
+	{
+		reply("error: invalid pipe mask\n");
+		return;
+	}
+
+	readout_header_t header{};
+	header.channel = (argv[0] ? READOUT_ALL_INTERLEAVED : READOUT_ALL_PLANAR) | READOUT_STRIPED;
+	header.start = argv[1];
+	header.end = argv[2];
+	for (int c = 0; c < CHANNELS; c++)
+		if (mask & (1 << c))
+			header.flags |= readout_flags(c, argv[1], argv[2]);
+	header.reserved = mask;
+	readout_payload(job_payload_, mask, argv[1], argv[2], argv[0]);
+	readout_send(header);
+
+	std::vector<uint8_t> payload = std::move(job_payload_);
+	job_payload_.clear();
+	size_t column_bytes = (argv[0] ? std::popcount(static_cast<uint16_t>(mask)) : 1) * sizeof(count_t);
+	size_t range_bytes = (argv[2] - argv[1] + 1) * column_bytes;
+	size_t slice_bytes = READOUT_SLICE_COLUMNS * column_bytes;
+	size_t slices = (range_bytes + slice_bytes - 1) / slice_bytes;
+	stripe_chunk_t chunk{STRIPE_MAGIC, 0, static_cast<uint16_t>(payload.size() / range_bytes * slices), 0,
+		static_cast<uint8_t>(command_framed_ ? command_sequence_ : 0), 0, 0};
+	for (size_t offset = 0; offset < payload.size(); offset += chunk.length, chunk.chunk++)
+	{
+		chunk.offset = offset;
+		chunk.length = std::min(slice_bytes, range_bytes - offset % range_bytes);
+		const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&chunk);
+		job_payload_.insert(job_payload_.end(), bytes, bytes + sizeof(chunk));
+		job_payload_.insert(job_payload_.end(), &payload[offset], &payload[offset] + chunk.length);
+	}
+}
+
+// Read stored channels as a container: M1056 <interleave> <start> <end> [mask]
+void Device::command_m1056(const int32_t *argv, uint8_t argc)
+{
+	int32_t mask;
+	if (container_args(argv, argc, &mask))
+		container_send(argv[0], argv[1], argv[2], mask);
+}
+
+// Resend part of a container: M1068 <interleave> <start> <end> <mask>
+// <first block> [<blocks>]
+void Device::command_m1068(const int32_t *argv, uint8_t argc)
+{
+	int32_t mask;
+	if (argc < 5)
+	{
+		reply("error: resend command requires five arguments\n");
+		return;
+	}
+
+	if (!container_args(argv, argc, &mask))
+		return;
+
+	int32_t start = argv[1], end = argv[2], first = argv[4];
+	int32_t blocks = (end - start + CONTAINER_BLOCK_COLUMNS) / CONTAINER_BLOCK_COLUMNS;
+	int32_t count = argc > 5 ? argv[5] : blocks - first;
+	if (first < 0 || first >= blocks || count <= 0 || count > blocks - first)
+	{
+		reply("error: invalid block range\n");
+		return;
+	}
+
+	start += first * CONTAINER_BLOCK_COLUMNS;
+	end = std::min(end, start + count * CONTAINER_BLOCK_COLUMNS - 1);
+	container_send(argv[0], start, end, mask);
+}
+
+[[noreturn]] void fail(const char *what)
+{
+	throw std::system_error(errno, std::generic_category(), what);
+}
+
+// A pseudo-terminal for a device, its path printed for the host tools.
+// The emulator holds the slave open, raw, so the master never sees a
+// hangup between clients and nothing it writes is echoed back.
+int open_pty()
+{
+	int master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0)
+		fail("posix_openpt");
+
+	const char *path = ptsname(master);
+	int slave = ::open(path, O_RDWR | O_NOCTTY);
+	termios tio{};
+	if (slave < 0 || tcgetattr(slave, &tio) != 0)
+		fail("open pty");
+	cfmakeraw(&tio);
+	tcsetattr(slave, TCSANOW, &tio);
+
+	fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+	std::printf("%s\n", path);
+	std::fflush(stdout);
+	return master;
+}
+
+int listen_tcp(int port)
+{
+	int fd = ::socket(AF_INET6, SOCK_STREAM, 0);
+	if (fd < 0)
+		fail("socket");
+	int on = 1, off = 0;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+
+	sockaddr_in6 address{};
+	address.sin6_family = AF_INET6;
+	address.sin6_addr = in6addr_any;
+	address.sin6_port = htons(port);
+	if (::bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || ::listen(fd, 64) != 0)
+		fail("listen");
+	std::printf("tcp:localhost:%d\n", port);
+	std::fflush(stdout);
+	return fd;
+}
+
+bool parse_options(int argc, char **argv, Options &options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		auto more = [&](int count) { return i + count < argc; };
+		if (arg == "-n" && more(1))
+			options.devices = std::atoi(argv[++i]);
+		else if (arg == "-t" && more(1))
+			options.tcp_port = std::atoi(argv[++i]);
+		else if (arg == "-c" && more(1))
+			options.cells = std::atoi(argv[++i]);
+		else if (arg == "-s" && more(1))
+			options.rate = std::strtod(argv[++i], nullptr);
+		else if (arg == "-m" && more(1))
+			options.peak = std::strtod(argv[++i], nullptr);
+		else if (arg == "-b" && more(1))
+			options.bandwidth = std::strtod(argv[++i], nullptr);
+		else if (arg == "--trace" && more(1))
+			options.trace = argv[++i];
+		else if (arg == "--counting")
+			options.counting = true;
+		else
+			return false;
+	}
+
+	return options.devices > 0 && options.tcp_port >= 0 && options.tcp_port <= UINT16_MAX && options.cells > 0
+		&& options.cells <= UINT16_MAX && options.rate > 0 && options.peak > 0 && options.bandwidth >= 0;
+}
+
+}  // namespace
+
+int main(int argc, char **argv)
+{
+	Options options;
+	if (!parse_options(argc, argv, options))
+	{
+		std::fprintf(stderr, "usage: %s [-n devices | -t port] [-c cells] [-s steps/s] [-m counts]\n"
+			"    [-b bytes/s] [--trace dump] [--counting]\n", argv[0]);
+		return 2;
+	}
+
+	Scan scan;
+	if (!options.trace.empty() && !load_trace(options.trace, scan))
+	{
+		std::fprintf(stderr, "%s: not an M1051 dump with steps\n", options.trace.c_str());
+		return 1;
+	}
+	const std::vector<double> profile = beam_profile(options);
+
+	try
+	{
+		std::vector<std::thread> devices;
+		auto serve = [&](int fd, uint32_t seed) {
+			devices.emplace_back([&options, &scan, &profile, fd, seed] {
+				Device(fd, options, scan, profile, seed).run();
+				::close(fd);
+			});
+		};
+
+		if (options.tcp_port)
+		{
+			int server = listen_tcp(options.tcp_port);
+			for (uint32_t seed = 0;; seed++)
+			{
+				int fd = ::accept(server, nullptr, nullptr);
+				if (fd < 0)
+				{
+					if (errno == EINTR)
+						continue;
+					fail("accept");
+				}
+				int one = 1;
+				setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+				fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+				serve(fd, seed);
+				devices.back().detach();
+			}
+		}
+
+		for (int i = 0; i < options.devices; i++)
+			serve(open_pty(), i);
+		for (std::thread &t : devices)
+			t.join();
+	}
+	catch (const std::exception &e)
+	{
+		std::fprintf(stderr, "error: %s\n", e.what());
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,471 @@
+// Columnar export of frames to HDF5, written as they are read.
+//
+//   dosimeter_export [options] <source> <file.h5>
+//
+// The source is a device port or tcp:<host>:<port>, read with M1056, or a
+// frame archive (archive.hpp).  Each frame is decoded and appended to the
+// dataset /counts, frames x channels x rows x columns over the map of the
+// first frame, the channels in mask order as the attribute channels lists
+// them.  /counts grows by a frame at a time and is chunked a frame and a
+// channel by up to 16 rows (the M1111 tile) by the whole row, compressed
+// with shuffle and deflate, so a frame is only ever held while it is
+// written and a reader takes rows or tiles without inflating the rest.
+// Cells of a frame outside its range read as 0; rows it holds none of are
+// not stored at all.  /started, /read, /wall_started, /start, /end and
+// /flags give each frame's header fields alongside.  Frames whose mask or
+// map differ from the first are skipped.
+//
+// Options
+//   -n <frames>        frames read from a device, 0 until stopped (default 0)
+//   -r <start> <end>   cell range read from a device (default 0 4095)
+//   -m <mask>          channels read from a device (default 1)
+//   -d <depth>         readouts kept in flight (default 2)
+//   -i <ms>            interval between readouts, 0 back to back (default 0)
+//   -z <level>         deflate level, 0 for none (default 1)
+
+#include "archive.hpp"
+#include "dosimeter.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <future>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <hdf5.h>
+#include <sys/stat.h>
+
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+constexpr hsize_t TILE_ROWS = 16;     // TILE_SIZE in main.c
+constexpr hsize_t SERIES_CHUNK = 1024;  // Frames per chunk of the per-frame datasets
+
+struct Options
+{
+	uint64_t frames = 0;
+	uint16_t start = 0;
+	uint16_t end = 4095;
+	uint16_t mask = 1;
+	int depth = 2;
+	int interval_ms = 0;
+	int level = 1;
+	std::string source;
+	std::string out;
+};
+
+std::atomic<bool> stopping = false;
+
+void on_signal(int)
+{
+	stopping = true;
+}
+
+bool is_device(const std::string &path)
+{
+	struct stat st;
+	return path.rfind(dosimeter::TCP_PREFIX, 0) == 0 || (stat(path.c_str(), &st) == 0 && S_ISCHR(st.st_mode));
+}
+
+hid_t check(hid_t id, const char *what)
+{
+	if (id < 0)
+		throw std::runtime_error(std::string("HDF5: ") + what);
+	return id;
+}
+
+// An HDF5 identifier, closed with its kind's close function
+class Hid
+{
+public:
+	Hid() = default;
+	Hid(hid_t id, herr_t (*close)(hid_t), const char *what) : id_(check(id, what)), close_(close) {}
+	~Hid()
+	{
+		if (id_ >= 0)
+			close_(id_);
+	}
+
+	Hid(const Hid &) = delete;
+	Hid &operator=(const Hid &) = delete;
+	Hid &operator=(Hid &&other) noexcept
+	{
+		std::swap(id_, other.id_);
+		std::swap(close_, other.close_);
+		return *this;
+	}
+
+	operator hid_t() const { return id_; }
+
+private:
+	hid_t id_ = -1;
+	herr_t (*close_)(hid_t) = nullptr;
+};
+
+// A dataset extended by a frame at a time along its first dimension
+class Extendible
+{
+public:
+	void create(hid_t file, const char *name, hid_t type, std::vector<hsize_t> shape, std::vector<hsize_t> chunk,
+		int level)
+	{
+		name_ = name;
+		shape_ = shape;
+		shape_[0] = 0;
+		std::vector<hsize_t> max = shape_;
+		max[0] = H5S_UNLIMITED;
+		Hid space(H5Screate_simple(shape_.size(), shape_.data(), max.data()), H5Sclose, name);
+		Hid properties(H5Pcreate(H5P_DATASET_CREATE), H5Pclose, name);
+		check(H5Pset_chunk(properties, chunk.size(), chunk.data()), name);
+		if (level > 0)
+		{
+			check(H5Pset_shuffle(properties), name);
+			check(H5Pset_deflate(properties, level), name);
+		}
+		dataset_ = Hid(H5Dcreate2(file, name, type, space, H5P_DEFAULT, properties, H5P_DEFAULT), H5Dclose, name);
+	}
+
+	// Grows the dataset by a frame, to be written with write()
+	void extend()
+	{
+		shape_[0]++;
+		check(H5Dset_extent(dataset_, shape_.data()), name_);
+	}
+
+	// Writes count[i] elements from offset[i] of the last frame
+	void write(hid_t memory_type, const void *data, std::vector<hsize_t> offset, std::vector<hsize_t> count)
+	{
+		offset.insert(offset.begin(), shape_[0] - 1);
+		count.insert(count.begin(), 1);
+		Hid file_space(H5Dget_space(dataset_), H5Sclose, name_);
+		check(H5Sselect_hyperslab(file_space, H5S_SELECT_SET, offset.data(), nullptr, count.data(), nullptr), name_);
+		Hid memory_space(H5Screate_simple(count.size(), count.data(), nullptr), H5Sclose, name_);
+		check(H5Dwrite(dataset_, memory_type, memory_space, file_space, H5P_DEFAULT, data), name_);
+	}
+
+	hid_t dataset() const { return dataset_; }
+
+private:
+	const char *name_ = nullptr;
+	std::vector<hsize_t> shape_;
+	Hid dataset_;
+};
+
+template <typename T>
+void attribute(hid_t object, const char *name, hid_t type, const std::vector<T> &values)
+{
+	hsize_t n = values.size();
+	Hid space(H5Screate_simple(1, &n, nullptr), H5Sclose, name);
+	Hid a(H5Acreate2(object, name, type, space, H5P_DEFAULT, H5P_DEFAULT), H5Aclose, name);
+	check(H5Awrite(a, type, values.data()), name);
+}
+
+class Exporter
+{
+public:
+	Exporter(const std::string &path, int level) : level_(level)
+	{
+		file_ = Hid(H5Fcreate(path.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT), H5Fclose, path.c_str());
+	}
+
+	// Returns false for a frame whose layout differs from the first
+	bool write(const dosimeter::ContainerHeader &h, std::span<const std::byte> payload)
+	{
+		if (!frames_)
+			create(h);
+		else if (h.mask != mask_ || map_columns(h) != columns_ || std::max<size_t>(h.rows, 1) != rows_)
+			return false;
+
+		uint16_t first_row;
+		uint32_t rows;
+		dosimeter::container_rows(h, first_row, rows);
+		decode(h, payload, first_row, rows);
+
+		counts_.extend();
+		counts_.write(H5T_NATIVE_UINT32, plane_.data(), {0, first_row, 0}, {channels_.size(), rows, columns_});
+
+		double wall = h.wall_started + h.wall_started_us / 1e6;
+		series_[0].extend();
+		series_[0].write(H5T_NATIVE_UINT32, &h.started, {}, {});
+		series_[1].extend();
+		series_[1].write(H5T_NATIVE_UINT32, &h.read, {}, {});
+		series_[2].extend();
+		series_[2].write(H5T_NATIVE_DOUBLE, &wall, {}, {});
+		series_[3].extend();
+		series_[3].write(H5T_NATIVE_UINT16, &h.start, {}, {});
+		series_[4].extend();
+		series_[4].write(H5T_NATIVE_UINT16, &h.end, {}, {});
+		series_[5].extend();
+		series_[5].write(H5T_NATIVE_UINT8, &h.flags, {}, {});
+		frames_++;
+		return true;
+	}
+
+	uint64_t frames() const { return frames_; }
+
+private:
+	static size_t map_columns(const dosimeter::ContainerHeader &h)
+	{
+		return h.columns ? h.columns : h.end + 1;
+	}
+
+	void create(const dosimeter::ContainerHeader &h)
+	{
+		mask_ = h.mask;
+		columns_ = map_columns(h);
+		rows_ = std::max<size_t>(h.rows, 1);
+		for (uint16_t c = 0; c < 16; c++)
+			if (h.mask & (1u << c))
+				channels_.push_back(c);
+
+		// 16-bit counts are stored as such; the planes are uint32 either way
+		hid_t type = h.width == 2 ? H5T_NATIVE_UINT16 : H5T_NATIVE_UINT32;
+		hsize_t n = channels_.size();
+		counts_.create(file_, "counts", type, {0, n, rows_, columns_}, {1, 1, std::min(rows_, TILE_ROWS), columns_},
+			level_);
+		attribute(counts_.dataset(), "channels", H5T_NATIVE_UINT16, channels_);
+		attribute(counts_.dataset(), "map", H5T_NATIVE_UINT32, std::vector<uint32_t>{uint32_t(rows_), uint32_t(columns_)});
+		attribute(file_, "build_id", H5T_NATIVE_UINT32, std::vector<uint32_t>{h.build_id});
+		attribute(file_, "firmware", H5T_NATIVE_UINT16, std::vector<uint16_t>{h.firmware});
+		attribute(file_, "bin_factor", H5T_NATIVE_UINT16, std::vector<uint16_t>{h.bin_factor});
+
+		const struct
+		{
+			const char *name;
+			hid_t type;
+		} series[] = {
+			{"started", H5T_NATIVE_UINT32},
+			{"read", H5T_NATIVE_UINT32},
+			{"wall_started", H5T_NATIVE_DOUBLE},
+			{"start", H5T_NATIVE_UINT16},
+			{"end", H5T_NATIVE_UINT16},
+			{"flags", H5T_NATIVE_UINT8},
+		};
+		for (size_t i = 0; i < std::size(series); i++)
+			series_[i].create(file_, series[i].name, series[i].type, {0}, {SERIES_CHUNK}, level_);
+	}
+
+	// Into plane_, channels x rows x columns from the first row the frame
+	// holds.  Planar blocks hold each channel's cells in turn, interleaved
+	// ones all channels of a cell together.
+	void decode(const dosimeter::ContainerHeader &h, std::span<const std::byte> payload, size_t first_row, size_t rows)
+	{
+		size_t count = channels_.size();
+		size_t cells = h.end - h.start + 1;
+		size_t plane = rows * columns_;
+		size_t skip = h.start - first_row * columns_;  // Cells of the first row before the range
+		plane_.assign(count * plane, 0);
+
+		const std::byte *p = payload.data();
+		for (size_t first = 0; first < cells; first += h.block_columns)
+		{
+			size_t block = std::min<size_t>(h.block_columns, cells - first);
+			for (size_t k = 0; k < count; k++)
+			{
+				uint32_t *out = plane_.data() + k * plane + skip + first;
+				size_t base = h.interleaved ? k : k * block;
+				size_t step = h.interleaved ? count : 1;
+				for (size_t i = 0; i < block; i++)
+				{
+					if (h.width == 2)
+					{
+						uint16_t v;
+						std::memcpy(&v, p + (base + i * step) * 2, 2);
+						out[i] = v;
+					}
+					else
+						std::memcpy(&out[i], p + (base + i * step) * 4, 4);
+				}
+			}
+			p += block * count * h.width + sizeof(uint32_t);
+		}
+	}
+
+	int level_;
+	Hid file_;
+	Extendible counts_;
+	Extendible series_[6];
+	uint16_t mask_ = 0;
+	hsize_t columns_ = 0;
+	hsize_t rows_ = 0;
+	std::vector<uint16_t> channels_;
+	std::vector<uint32_t> plane_;
+	uint64_t frames_ = 0;
+};
+
+struct Totals
+{
+	uint64_t bytes = 0;
+	uint64_t skipped = 0;
+	uint64_t errors = 0;
+};
+
+void export_frame(Exporter &exporter, const dosimeter::ContainerHeader &h, std::span<const std::byte> payload,
+	Totals &totals)
+{
+	if (exporter.write(h, payload))
+		totals.bytes += h.header_bytes + payload.size();
+	else
+		totals.skipped++;
+}
+
+void from_device(Exporter &exporter, const Options &options, Totals &totals)
+{
+	size_t cells = options.end - options.start + 1;
+	size_t capacity = dosimeter::container_capacity(cells, options.mask);
+	dosimeter::Client client(options.source);
+
+	struct Readout
+	{
+		std::vector<std::byte> buffer;
+		std::future<dosimeter::ContainerHeader> done;
+	};
+	std::deque<Readout> readouts;
+	uint64_t requested = 0;
+	auto interval = std::chrono::milliseconds(options.interval_ms);
+	auto due = Clock::now();
+
+	// The next readouts are in flight while a frame is compressed and written
+	for (;;)
+	{
+		bool more = !stopping && (!options.frames || requested < options.frames);
+		if (more && readouts.size() < static_cast<size_t>(options.depth) && Clock::now() >= due)
+		{
+			Readout &r = readouts.emplace_back();
+			r.buffer.resize(capacity);
+			r.done = client.read_container(false, options.start, options.end, options.mask, r.buffer);
+			requested++;
+			due = std::max(due + interval, Clock::now());
+			continue;
+		}
+		if (readouts.empty())
+		{
+			if (!more)
+				break;
+			std::this_thread::sleep_until(due);
+			continue;
+		}
+
+		Readout &front = readouts.front();
+		if (more && readouts.size() < static_cast<size_t>(options.depth)
+			&& front.done.wait_until(due) != std::future_status::ready)
+			continue;
+		try
+		{
+			dosimeter::ContainerHeader header = front.done.get();
+			size_t length = dosimeter::container_payload_bytes(header);
+			export_frame(exporter, header, std::span<const std::byte>(front.buffer).first(length), totals);
+		}
+		catch (const std::exception &e)
+		{
+			std::fprintf(stderr, "%s: %s\n", options.source.c_str(), e.what());
+			totals.errors++;
+		}
+		readouts.pop_front();
+	}
+}
+
+void from_archive(Exporter &exporter, const Options &options, Totals &totals)
+{
+	dosimeter::ArchiveReader archive(options.source);
+	for (size_t i = 0; i < archive.frames() && !stopping; i++)
+	{
+		dosimeter::ContainerHeader header = archive.header(i);
+		std::span<const std::byte> payload = archive.payload(i);
+		if (!dosimeter::container_blocks_valid(header, payload))
+		{
+			std::fprintf(stderr, "%s: block CRC mismatch in frame %zu\n", options.source.c_str(), i);
+			totals.errors++;
+			continue;
+		}
+		export_frame(exporter, header, payload, totals);
+	}
+}
+
+bool parse_options(int argc, char **argv, Options &options)
+{
+	std::vector<std::string> positional;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		auto more = [&](int count) { return i + count < argc; };
+		if (arg == "-n" && more(1))
+			options.frames = std::strtoull(argv[++i], nullptr, 0);
+		else if (arg == "-r" && more(2))
+		{
+			options.start = std::atoi(argv[++i]);
+			options.end = std::atoi(argv[++i]);
+		}
+		else if (arg == "-m" && more(1))
+			options.mask = std::strtoul(argv[++i], nullptr, 0);
+		else if (arg == "-d" && more(1))
+			options.depth = std::atoi(argv[++i]);
+		else if (arg == "-i" && more(1))
+			options.interval_ms = std::atoi(argv[++i]);
+		else if (arg == "-z" && more(1))
+			options.level = std::atoi(argv[++i]);
+		else if (arg.size() > 1 && arg[0] == '-')
+			return false;
+		else
+			positional.push_back(arg);
+	}
+
+	if (positional.size() != 2)
+		return false;
+	options.source = positional[0];
+	options.out = positional[1];
+	return options.depth > 0 && options.interval_ms >= 0 && options.level >= 0 && options.level <= 9
+		&& options.end >= options.start && options.mask;
+}
+
+}  // namespace
+
+int main(int argc, char **argv)
+{
+	Options options;
+	if (!parse_options(argc, argv, options))
+	{
+		std::fprintf(stderr, "usage: %s [-n frames] [-r start end] [-m mask] [-d depth] [-i ms] [-z level]\n"
+			"    <source> <file.h5>\n", argv[0]);
+		return 2;
+	}
+
+	std::signal(SIGINT, on_signal);
+	std::signal(SIGTERM, on_signal);
+	// Failures are reported through the exceptions check() throws
+	H5Eset_auto2(H5E_DEFAULT, nullptr, nullptr);
+	try
+	{
+		Totals totals;
+		auto t0 = Clock::now();
+		uint64_t frames;
+		{
+			Exporter exporter(options.out, options.level);
+			if (is_device(options.source))
+				from_device(exporter, options, totals);
+			else
+				from_archive(exporter, options, totals);
+			frames = exporter.frames();
+		}
+		double seconds = std::chrono::duration<double>(Clock::now() - t0).count();
+		std::printf("%llu frames to %s in %.2f s, %.2f MB/s, skipped %llu, errors %llu\n",
+			static_cast<unsigned long long>(frames), options.out.c_str(), seconds, totals.bytes / seconds / 1e6,
+			static_cast<unsigned long long>(totals.skipped), static_cast<unsigned long long>(totals.errors));
+		return totals.errors ? 1 : 0;
+	}
+	catch (const std::exception &e)
+	{
+		std::fprintf(stderr, "dosimeter_export: %s\n", e.what());
+		return 1;
+	}
+}
@@ -0,0 +1,391 @@
+// End-to-end scan throughput: frames per minute at the statistics asked for.
+//
+//   dosimeter_frames [options] <port>
+//
+// Each frame is one M1087 scan of the columns -c, counting the M1043
+// pulse outputs jumpered to the channels of -m (output c + 1 to channel
+// c, as for checking counts at rate), then its readout into counts per
+// cell as a viewer gets them.  With -t the scans are adaptive (M1088),
+// crossing each column at the rate that gives it about that many primary
+// counts, up to -s; without, every column is crossed at -s.  The frame is
+// read as an M1056 container once the scan has swapped it out, or with
+// --stream taken from the M1017 records that came in while it ran.  For
+// each frame it times
+//   scan     M1087 sent until it reports the device idle again, polled
+//            every -q ms, the approach to the first column included
+//   readout  the end of the scan until the frame is decoded; streamed
+//            frames end with the last record, STREAM_QUIET after which
+//            nothing more has come
+//   idle     the rest of the time from the last frame's end to this
+//            one's: commands, polling and the host's own work
+// and reports their means, the steps/s the scans reached over their
+// columns, and frames per minute over the whole run.  -o appends the
+// same as one CSV row under the label -l, so that releases line up.
+//
+// Options
+//   -n <frames>        frames scanned (default 10)
+//   -c <from> <to>     columns of the scan, and cells of row 0 read (default 0 999)
+//   -s <hz>            scan rate (default 20000)
+//   -a <accel>         ramp in steps/s^2, 0 for none (default 0)
+//   -t <counts>        primary counts per column, 0 for a fixed rate (default 0)
+//   -p <hz>            mean rate of each pulse output (default 50000)
+//   -m <mask>          channels counted and read, of 0-2 (default 1)
+//   -q <ms>            scan poll interval (default 1)
+//   --stream           read frames from the stream rather than containers
+//   -o <file>          append the results as CSV
+//   -l <label>         label of the CSV row (default the port)
+
+#include "dosimeter.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+constexpr auto STREAM_QUIET = std::chrono::milliseconds(50);
+// Pulse outputs 1-3 feed channels 0-2
+constexpr int PULSE_CHANNELS = 3;
+
+struct Options
+{
+	int frames = 10;
+	int32_t from = 0;
+	int32_t to = 999;
+	int32_t hz = 20000;
+	int32_t accel = 0;
+	int32_t counts = 0;
+	int32_t pulse_hz = 50000;
+	uint16_t mask = 1;
+	int poll_ms = 1;
+	bool stream = false;
+	std::string out;
+	std::string label;
+	std::string port;
+};
+
+struct FrameTimes
+{
+	double scan = 0, readout = 0, idle = 0;  // Seconds
+	double sweep = 0;                        // Of the scan, over its columns
+	uint32_t steps = 0;
+};
+
+double seconds(Clock::duration d)
+{
+	return std::chrono::duration<double>(d).count();
+}
+
+dosimeter::Reply checked(dosimeter::Client &client, uint16_t code, std::span<const int32_t> args = {})
+{
+	dosimeter::Reply reply = client.command(code, args).get();
+	if (reply.error)
+		throw std::runtime_error("M" + std::to_string(code) + ": " + reply.text);
+	return reply;
+}
+
+// Spreads the blocks of a container into counts per cell of the first
+// channel, as a viewer would before drawing the frame
+void decode(const dosimeter::ContainerHeader &h, std::span<const std::byte> payload, std::vector<uint32_t> &counts)
+{
+	size_t count = std::popcount(h.mask);
+	size_t cells = h.end - h.start + 1;
+	counts.assign(cells, 0);
+	const std::byte *p = payload.data();
+	for (size_t first = 0; first < cells; first += h.block_columns)
+	{
+		size_t columns = std::min<size_t>(h.block_columns, cells - first);
+		size_t step = h.interleaved ? count : 1;
+		for (size_t i = 0; i < columns; i++)
+		{
+			const std::byte *v = p + i * step * h.width;
+			if (h.width == 2)
+			{
+				uint16_t v16;
+				std::memcpy(&v16, v, sizeof(v16));
+				counts[first + i] = v16;
+			}
+			else
+				std::memcpy(&counts[first + i], v, sizeof(uint32_t));
+		}
+		p += columns * count * h.width + sizeof(uint32_t);
+	}
+}
+
+// Stream records of the frame being scanned, from the client's reader thread
+class StreamFrame
+{
+public:
+	StreamFrame(uint16_t first, size_t cells) : first_(first), counts_(cells) {}
+
+	void add(std::span<const dosimeter::StreamRecord> records)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		for (const dosimeter::StreamRecord &r : records)
+			if (static_cast<uint16_t>(r.position - first_) < counts_.size())
+				counts_[r.position - first_] = r.primary;
+		last_ = Clock::now();
+		records_ += records.size();
+	}
+
+	void start()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		std::fill(counts_.begin(), counts_.end(), 0);
+		last_ = {};
+	}
+
+	Clock::time_point last()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		return last_;
+	}
+
+	uint64_t records()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		return records_;
+	}
+
+private:
+	std::mutex mutex_;
+	uint16_t first_;
+	std::vector<uint32_t> counts_;
+	Clock::time_point last_;
+	uint64_t records_ = 0;
+};
+
+FrameTimes scan_frame(dosimeter::Client &client, const Options &options, StreamFrame &stream,
+	std::vector<std::byte> &buffer, std::vector<uint32_t> &counts)
+{
+	FrameTimes times;
+	uint16_t first = std::min(options.from, options.to), last = std::max(options.from, options.to);
+	stream.start();
+
+	auto t0 = Clock::now();
+	const int32_t scan[] = {options.from, options.to, options.hz, options.accel, options.stream ? 0 : 1};
+	checked(client, 1087, scan);
+
+	// "<phase> <steps> <total>": 1 approaching, 2 scanning, 0 once done
+	Clock::time_point sweep0{}, sweep1{};
+	for (;;)
+	{
+		dosimeter::Reply reply = checked(client, 1087);
+		unsigned phase = 0, steps = 0, total = 0;
+		if (std::sscanf(reply.text.c_str(), "ok %u %u %u", &phase, &steps, &total) != 3)
+			throw std::runtime_error("M1087: unexpected reply " + reply.text);
+		auto now = Clock::now();
+		if (phase == 2)
+		{
+			if (sweep0 == Clock::time_point{})
+				sweep0 = now;
+			times.steps = total;
+			sweep1 = now;
+		}
+		else if (phase == 0)
+		{
+			if (sweep0 != Clock::time_point{})
+				sweep1 = now;
+			break;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(options.poll_ms));
+	}
+	auto t1 = Clock::now();
+	times.scan = seconds(t1 - t0);
+	times.sweep = seconds(sweep1 - sweep0);
+
+	if (options.stream)
+	{
+		for (;;)
+		{
+			Clock::time_point arrived = stream.last();
+			if (Clock::now() - std::max(arrived, t1) >= STREAM_QUIET)
+			{
+				times.readout = arrived > t1 ? seconds(arrived - t1) : 0;
+				break;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+	else
+	{
+		dosimeter::ContainerHeader header = client.read_container(false, first, last, options.mask, buffer).get();
+		decode(header, std::span<const std::byte>(buffer).first(dosimeter::container_payload_bytes(header)), counts);
+		times.readout = seconds(Clock::now() - t1);
+	}
+	return times;
+}
+
+void report(const std::vector<FrameTimes> &frames, double total, const Options &options)
+{
+	FrameTimes mean, peak;
+	double sweep = 0;
+	uint64_t steps = 0;
+	for (const FrameTimes &f : frames)
+	{
+		mean.scan += f.scan / frames.size();
+		mean.readout += f.readout / frames.size();
+		mean.idle += f.idle / frames.size();
+		peak.scan = std::max(peak.scan, f.scan);
+		peak.readout = std::max(peak.readout, f.readout);
+		peak.idle = std::max(peak.idle, f.idle);
+		sweep += f.sweep;
+		steps += f.steps;
+	}
+	double per_minute = frames.size() / total * 60;
+	double steps_per_second = sweep > 0 ? steps / sweep : 0;
+
+	std::printf("%zu frames in %.2f s, %.2f frames/min\n", frames.size(), total, per_minute);
+	std::printf("%-8s %10s %10s\n", "", "mean ms", "max ms");
+	std::printf("%-8s %10.1f %10.1f\n", "scan", mean.scan * 1e3, peak.scan * 1e3);
+	std::printf("%-8s %10.1f %10.1f\n", "readout", mean.readout * 1e3, peak.readout * 1e3);
+	std::printf("%-8s %10.1f %10.1f\n", "idle", mean.idle * 1e3, peak.idle * 1e3);
+	std::printf("%.0f steps/s over the scanned columns\n", steps_per_second);
+
+	if (options.out.empty())
+		return;
+	std::ofstream csv(options.out, std::ios::app);
+	if (!csv)
+		throw std::runtime_error("cannot open " + options.out);
+	csv << options.label << ',' << (options.stream ? "stream" : "bulk") << ',' << frames.size() << ','
+		<< per_minute << ',' << mean.scan * 1e3 << ',' << mean.readout * 1e3 << ',' << mean.idle * 1e3 << ','
+		<< steps_per_second << '\n';
+}
+
+int run(const Options &options)
+{
+	size_t cells = std::abs(options.to - options.from) + 1;
+	std::vector<std::byte> buffer(dosimeter::container_capacity(cells, options.mask));
+	std::vector<uint32_t> counts;
+	StreamFrame stream(std::min(options.from, options.to), cells);
+
+	dosimeter::Client client(options.port);
+	if (options.stream)
+	{
+		client.on_stream([&](const dosimeter::StreamHeader &, std::span<const dosimeter::StreamRecord> records) {
+			stream.add(records);
+		});
+		const int32_t on[] = {1};
+		checked(client, 1017, on);
+	}
+	const int32_t target[] = {options.counts};
+	checked(client, 1088, target);
+	for (int c = 0; c < PULSE_CHANNELS; c++)
+		if (options.mask & (1u << c))
+		{
+			const int32_t pulses[] = {c + 1, options.pulse_hz, c + 1};
+			checked(client, 1043, pulses);
+		}
+
+	std::vector<FrameTimes> frames;
+	auto t0 = Clock::now(), previous = t0;
+	for (int i = 0; i < options.frames; i++)
+	{
+		FrameTimes f = scan_frame(client, options, stream, buffer, counts);
+		auto now = Clock::now();
+		f.idle = std::max(0.0, seconds(now - previous) - f.scan - f.readout);
+		previous = now;
+		frames.push_back(f);
+	}
+	double total = seconds(Clock::now() - t0);
+
+	for (int c = 0; c < PULSE_CHANNELS; c++)
+		if (options.mask & (1u << c))
+		{
+			const int32_t off[] = {c + 1, 0};
+			client.command(1043, off).get();
+		}
+	const int32_t fixed[] = {0};
+	client.command(1088, fixed).get();
+	if (options.stream)
+	{
+		const int32_t off[] = {0};
+		client.command(1017, off).get();
+		std::printf("%llu stream records\n", static_cast<unsigned long long>(stream.records()));
+	}
+
+	report(frames, total, options);
+	return 0;
+}
+
+bool parse_options(int argc, char **argv, Options &options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		auto more = [&](int count) { return i + count < argc; };
+		if (arg == "-n" && more(1))
+			options.frames = std::atoi(argv[++i]);
+		else if (arg == "-c" && more(2))
+		{
+			options.from = std::atoi(argv[++i]);
+			options.to = std::atoi(argv[++i]);
+		}
+		else if (arg == "-s" && more(1))
+			options.hz = std::atoi(argv[++i]);
+		else if (arg == "-a" && more(1))
+			options.accel = std::atoi(argv[++i]);
+		else if (arg == "-t" && more(1))
+			options.counts = std::atoi(argv[++i]);
+		else if (arg == "-p" && more(1))
+			options.pulse_hz = std::atoi(argv[++i]);
+		else if (arg == "-m" && more(1))
+			options.mask = std::strtoul(argv[++i], nullptr, 0);
+		else if (arg == "-q" && more(1))
+			options.poll_ms = std::atoi(argv[++i]);
+		else if (arg == "--stream")
+			options.stream = true;
+		else if (arg == "-o" && more(1))
+			options.out = argv[++i];
+		else if (arg == "-l" && more(1))
+			options.label = argv[++i];
+		else if (arg.size() > 1 && arg[0] == '-')
+			return false;
+		else if (options.port.empty())
+			options.port = arg;
+		else
+			return false;
+	}
+
+	if (options.label.empty())
+		options.label = options.port;
+	return !options.port.empty() && options.frames > 0 && options.from >= 0 && options.to >= 0
+		&& options.from <= UINT16_MAX && options.to <= UINT16_MAX && options.from != options.to
+		&& options.hz > 0 && options.accel >= 0 && options.counts >= 0 && options.pulse_hz >= 0
+		&& options.mask && options.mask < (1u << PULSE_CHANNELS) && options.poll_ms >= 0;
+}
+
+}  // namespace
+
+int main(int argc, char **argv)
+{
+	Options options;
+	if (!parse_options(argc, argv, options))
+	{
+		std::fprintf(stderr, "usage: %s [-n frames] [-c from to] [-s hz] [-a accel] [-t counts] [-p hz] [-m mask]\n"
+			"    [-q ms] [--stream] [-o file] [-l label] <port>\n", argv[0]);
+		return 2;
+	}
+
+	try
+	{
+		return run(options);
+	}
+	catch (const std::exception &e)
+	{
+		std::fprintf(stderr, "error: %s\n", e.what());
+		return 1;
+	}
+}
@@ -0,0 +1,324 @@
+// Device hub: owns the connection to a device and publishes what it reads
+// into shared-memory rings (ring.hpp), so the display, the archiver and
+// QA analysis on one host are all fed by a single read of the device.
+//
+//   dosimeter_hub [options] <port> <name>
+//   dosimeter_hub --attach <name>
+//
+// Frames are read with M1056, with depth readouts in flight, each straight
+// into the slot of the ring <name>-frames it is then published from as a
+// RING_KIND_CONTAINER entry: a ContainerHeader and its blocks, already
+// checked, which consumers read in place.  With --stream, M1017 is turned
+// on and each stream block is published to the ring <name>-stream as a
+// RING_KIND_STREAM entry, a StreamHeader and its records.  Stream blocks
+// arrive between replies, so they are copied once from the client's
+// buffer into their slot.  Once a second the hub prints what it has
+// published and how far behind each consumer is; a consumer that falls
+// more than a ring behind loses the entries it missed, never the hub.
+//
+// --attach is a consumer: it follows both rings, checks each container in
+// place, and prints what it has read once a second.
+//
+// Options
+//   -r <start> <end>   cell range of frames (default 0 4095)
+//   -m <mask>          channels of frames (default 1)
+//   -d <depth>         readouts kept in flight (default 2)
+//   -i <ms>            interval between frames, 0 for back to back (default 0)
+//   -s <slots>         frames the ring holds (default 16)
+//   --stream           publish streamed records too
+//   --capture <path>   record the device session, for dosimeter_replay
+
+#include "dosimeter.hpp"
+#include "ring.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <future>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+constexpr uint32_t STREAM_SLOTS = 4096;
+constexpr auto REPORT_INTERVAL = std::chrono::seconds(1);
+constexpr int ATTACH_WAIT_MS = 10;
+
+struct Options
+{
+	uint16_t start = 0;
+	uint16_t end = 4095;
+	uint16_t mask = 1;
+	int depth = 2;
+	int interval_ms = 0;
+	uint32_t slots = 16;
+	bool stream = false;
+	std::string capture;
+	std::string attach;
+	std::vector<std::string> positional;  // <port> <name>
+};
+
+std::atomic<bool> stopping = false;
+
+void on_signal(int)
+{
+	stopping = true;
+}
+
+void report_consumers(dosimeter::RingWriter &ring)
+{
+	for (const dosimeter::RingWriter::Consumer &c : ring.consumers())
+		std::fprintf(stderr, "  %s consumer %d: %llu behind, %llu lost\n", ring.name().c_str(), c.pid,
+			static_cast<unsigned long long>(c.behind), static_cast<unsigned long long>(c.lost));
+}
+
+int serve(const std::string &port, const std::string &name, const Options &options)
+{
+	size_t cells = options.end - options.start + 1;
+	size_t capacity = dosimeter::container_capacity(cells, options.mask);
+
+	dosimeter::RingWriter frames(name + "-frames", options.slots, sizeof(dosimeter::ContainerHeader) + capacity);
+	std::unique_ptr<dosimeter::RingWriter> stream;
+	std::atomic<uint64_t> stream_records = 0;
+
+	dosimeter::Client client(port, options.capture);
+	if (options.stream)
+	{
+		stream = std::make_unique<dosimeter::RingWriter>(name + "-stream", STREAM_SLOTS,
+			sizeof(dosimeter::StreamHeader) + dosimeter::STREAM_BLOCK_MAX_RECORDS * sizeof(dosimeter::StreamRecord));
+		// The stream ring is only written from the client's reader thread
+		client.on_stream([&](const dosimeter::StreamHeader &header, std::span<const dosimeter::StreamRecord> records) {
+			std::span<std::byte> slot = stream->claim(stream->head());
+			std::memcpy(slot.data(), &header, sizeof(header));
+			std::memcpy(slot.data() + sizeof(header), records.data(), records.size_bytes());
+			stream->publish(sizeof(header) + records.size_bytes(), dosimeter::RING_KIND_STREAM);
+			stream_records += records.size();
+		});
+		const int32_t on[] = {1};
+		dosimeter::Reply reply = client.command(1017, on).get();
+		if (reply.error)
+			throw std::runtime_error("M1017: " + reply.text);
+	}
+	std::fprintf(stderr, "publishing %s to %s\n", port.c_str(), frames.name().c_str());
+
+	struct Readout
+	{
+		std::span<std::byte> slot;
+		std::future<dosimeter::ContainerHeader> done;
+	};
+	std::deque<Readout> readouts;
+	uint64_t next = frames.head();
+	uint64_t published = 0, errors = 0, bytes = 0;
+	auto interval = std::chrono::milliseconds(options.interval_ms);
+	auto due = Clock::now();
+	auto t0 = Clock::now();
+	auto report = t0 + REPORT_INTERVAL;
+
+	for (;;)
+	{
+		auto now = Clock::now();
+		if (!stopping && readouts.size() < static_cast<size_t>(options.depth) && now >= due)
+		{
+			std::span<std::byte> slot = frames.claim(next++);
+			std::span<std::byte> out = slot.subspan(sizeof(dosimeter::ContainerHeader));
+			readouts.push_back({slot, client.read_container(false, options.start, options.end, options.mask, out)});
+			due = std::max(due + interval, now);
+			continue;
+		}
+		if (stopping && readouts.empty())
+			break;
+
+		if (now >= report)
+		{
+			double seconds = std::chrono::duration<double>(now - t0).count();
+			std::fprintf(stderr, "frames %llu (%.1f/s, %.2f MB/s), stream records %llu, errors %llu\n",
+				static_cast<unsigned long long>(published), published / seconds, bytes / seconds / 1e6,
+				static_cast<unsigned long long>(stream_records.load()), static_cast<unsigned long long>(errors));
+			report_consumers(frames);
+			if (stream)
+				report_consumers(*stream);
+			report += REPORT_INTERVAL;
+			continue;
+		}
+
+		// Wait for the oldest readout, or until the next one or the report is due
+		auto until = std::min(report, readouts.size() < static_cast<size_t>(options.depth) ? due : report);
+		if (readouts.empty())
+		{
+			std::this_thread::sleep_until(until);
+			continue;
+		}
+		Readout &front = readouts.front();
+		if (front.done.wait_until(until) != std::future_status::ready)
+			continue;
+
+		try
+		{
+			dosimeter::ContainerHeader header = front.done.get();
+			std::memcpy(front.slot.data(), &header, sizeof(header));
+			size_t length = sizeof(header) + dosimeter::container_payload_bytes(header);
+			frames.publish(length, dosimeter::RING_KIND_CONTAINER);
+			published++;
+			bytes += length;
+		}
+		catch (const std::exception &e)
+		{
+			// Published empty, so the entries stay in order
+			std::fprintf(stderr, "%s: %s\n", port.c_str(), e.what());
+			frames.publish(0, dosimeter::RING_KIND_CONTAINER);
+			errors++;
+		}
+		readouts.pop_front();
+	}
+
+	if (options.stream)
+	{
+		const int32_t off[] = {0};
+		client.command(1017, off).get();
+	}
+	return errors ? 1 : 0;
+}
+
+int attach(const std::string &name)
+{
+	dosimeter::RingReader frames(name + "-frames");
+	std::optional<dosimeter::RingReader> stream;
+	try
+	{
+		stream.emplace(name + "-stream");
+	}
+	catch (const std::exception &)
+	{
+		// The hub is not streaming
+	}
+
+	uint64_t read = 0, bad = 0, blocks = 0, records = 0;
+	uint32_t started = 0, read_ms = 0;
+	auto report = Clock::now() + REPORT_INTERVAL;
+	while (!stopping)
+	{
+		if (std::optional<dosimeter::RingEntry> entry = frames.wait(stream ? 0 : ATTACH_WAIT_MS))
+		{
+			std::span<const std::byte> payload = entry->payload;
+			const auto *header = reinterpret_cast<const dosimeter::ContainerHeader *>(payload.data());
+			bool good = entry->kind == dosimeter::RING_KIND_CONTAINER && payload.size() >= sizeof(*header)
+				&& dosimeter::container_valid(*header)
+				&& dosimeter::container_blocks_valid(*header, payload.subspan(sizeof(*header)));
+			if (good)
+			{
+				started = header->started;
+				read_ms = header->read;
+			}
+			// Counted only if the hub did not overwrite it while it was checked
+			if (frames.valid(*entry))
+			{
+				read++;
+				bad += !good;
+			}
+		}
+
+		if (stream)
+		{
+			std::optional<dosimeter::RingEntry> entry = stream->wait(ATTACH_WAIT_MS);
+			if (entry && entry->kind == dosimeter::RING_KIND_STREAM && entry->payload.size() >= sizeof(dosimeter::StreamHeader))
+			{
+				const auto *header = reinterpret_cast<const dosimeter::StreamHeader *>(entry->payload.data());
+				uint16_t n = header->records;
+				if (stream->valid(*entry))
+				{
+					blocks++;
+					records += n;
+				}
+			}
+		}
+
+		if (Clock::now() >= report)
+		{
+			std::printf("frames %llu (bad %llu, lost %llu), last started %u read %u", static_cast<unsigned long long>(read),
+				static_cast<unsigned long long>(bad), static_cast<unsigned long long>(frames.lost()), started, read_ms);
+			if (stream)
+				std::printf(", stream blocks %llu records %llu (lost %llu)", static_cast<unsigned long long>(blocks),
+					static_cast<unsigned long long>(records), static_cast<unsigned long long>(stream->lost()));
+			std::printf("\n");
+			std::fflush(stdout);
+			report += REPORT_INTERVAL;
+		}
+	}
+	return bad ? 1 : 0;
+}
+
+bool parse_options(int argc, char **argv, Options &options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		auto more = [&](int count) { return i + count < argc; };
+		if (arg == "-r" && more(2))
+		{
+			options.start = std::atoi(argv[++i]);
+			options.end = std::atoi(argv[++i]);
+		}
+		else if (arg == "-m" && more(1))
+			options.mask = std::strtoul(argv[++i], nullptr, 0);
+		else if (arg == "-d" && more(1))
+			options.depth = std::atoi(argv[++i]);
+		else if (arg == "-i" && more(1))
+			options.interval_ms = std::atoi(argv[++i]);
+		else if (arg == "-s" && more(1))
+			options.slots = std::atoi(argv[++i]);
+		else if (arg == "--stream")
+			options.stream = true;
+		else if (arg == "--capture" && more(1))
+			options.capture = argv[++i];
+		else if (arg == "--attach" && more(1))
+			options.attach = argv[++i];
+		else if (arg.size() > 1 && arg[0] == '-')
+			return false;
+		else
+			options.positional.push_back(arg);
+	}
+
+	return options.positional.size() == (options.attach.empty() ? 2 : 0) && options.depth > 0
+		&& options.interval_ms >= 0 && options.slots >= static_cast<uint32_t>(options.depth)
+		&& options.end >= options.start && options.mask;
+}
+
+}  // namespace
+
+int main(int argc, char **argv)
+{
+	Options options;
+	if (!parse_options(argc, argv, options))
+	{
+		std::fprintf(stderr, "usage: %s [-r start end] [-m mask] [-d depth] [-i ms] [-s slots] [--stream]\n"
+			"    [--capture path] <port> <name>\n"
+			"       %s --attach <name>\n", argv[0], argv[0]);
+		return 2;
+	}
+
+	std::signal(SIGINT, on_signal);
+	std::signal(SIGTERM, on_signal);
+	try
+	{
+		if (!options.attach.empty())
+			return attach(options.attach);
+		return serve(options.positional[0], options.positional[1], options);
+	}
+	catch (const std::exception &e)
+	{
+		std::fprintf(stderr, "dosimeter_hub: %s\n", e.what());
+		return 1;
+	}
+}
@@ -0,0 +1,353 @@
+// Head position latency, polled and pushed, idle and under bulk readout.
+//
+//   dosimeter_latency [options] <port>
+//
+// Over -n samples each it measures
+//   framed  M1001 round trips over the framed protocol (M1028), one at a time
+//   push    gaps between position pushes (M1029 1 <ms>): the longest a
+//           pushed position is stale, to set against a polled round trip
+//   text    M1001 round trips as text lines, after M1028 0 switches back
+// while idle, then framed and push again with -d M1056 readouts kept in
+// flight alongside (bulk).  A text command cannot run beside a readout, so
+// text is measured idle only.  The report gives p50, p99, p99.9 and the
+// maximum in microseconds, and -o appends the same rows as CSV under the
+// label -l, so that runs before and after a change line up.
+//
+// Options
+//   -n <samples>       per measurement (default 10000)
+//   -r <start> <end>   cells of the bulk readouts (default 0 4095)
+//   -m <mask>          channels of the bulk readouts (default 1)
+//   -d <depth>         bulk readouts in flight (default 2)
+//   -p <ms>            push period (default 1)
+//   -o <file>          append the results as CSV
+//   -l <label>         label of the CSV rows (default the port)
+
+#include "dosimeter.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <unistd.h>
+
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+// Beyond the pushes due, for the period to be missed before giving up
+constexpr auto PUSH_SLACK = std::chrono::seconds(5);
+constexpr int TEXT_TIMEOUT_MS = 1000;
+
+struct Options
+{
+	int samples = 10000;
+	uint16_t start = 0;
+	uint16_t end = 4095;
+	uint16_t mask = 1;
+	int depth = 2;
+	int push_ms = 1;
+	std::string out;
+	std::string label;
+	std::string port;
+};
+
+struct Result
+{
+	const char *variant;
+	const char *load;
+	std::vector<double> us;  // Empty if the device does not support it
+};
+
+double since_us(Clock::time_point t0, Clock::time_point t1)
+{
+	return std::chrono::duration<double, std::micro>(t1 - t0).count();
+}
+
+// Keeps depth M1056 readouts in flight on the client until stopped
+class Bulk
+{
+public:
+	Bulk(dosimeter::Client &client, const Options &options) : client_(client), options_(options)
+	{
+		size_t cells = options.end - options.start + 1;
+		size_t capacity = dosimeter::container_capacity(cells, options.mask);
+		buffers_.assign(options.depth, std::vector<std::byte>(capacity));
+		thread_ = std::thread(&Bulk::run, this);
+	}
+
+	~Bulk()
+	{
+		stopping_ = true;
+		thread_.join();
+	}
+
+	uint64_t bytes() const { return bytes_; }
+
+private:
+	void run()
+	{
+		std::vector<std::future<dosimeter::ContainerHeader>> inflight(options_.depth);
+		for (size_t i = 0;; i++)
+		{
+			size_t slot = i % inflight.size();
+			if (inflight[slot].valid())
+				bytes_ += dosimeter::container_payload_bytes(inflight[slot].get());
+			if (stopping_ && std::none_of(inflight.begin(), inflight.end(), [](auto &f) { return f.valid(); }))
+				return;
+			if (!stopping_)
+				inflight[slot] = client_.read_container(false, options_.start, options_.end, options_.mask, buffers_[slot]);
+		}
+	}
+
+	dosimeter::Client &client_;
+	const Options &options_;
+	std::vector<std::vector<std::byte>> buffers_;
+	std::atomic<bool> stopping_ = false;
+	std::atomic<uint64_t> bytes_ = 0;
+	std::thread thread_;
+};
+
+std::vector<double> framed_round_trips(dosimeter::Client &client, int samples)
+{
+	std::vector<double> us;
+	us.reserve(samples);
+	for (int i = 0; i < samples; i++)
+	{
+		auto t0 = Clock::now();
+		dosimeter::Reply reply = client.command(1001).get();
+		auto t1 = Clock::now();
+		if (reply.error)
+			throw std::runtime_error("M1001: " + reply.text);
+		us.push_back(since_us(t0, t1));
+	}
+	return us;
+}
+
+// Pushes are timed on arrival by the client's reader thread
+class PushTimes
+{
+public:
+	void record()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (recording_)
+			times_.push_back(Clock::now());
+	}
+
+	void start()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		times_.clear();
+		recording_ = true;
+	}
+
+	size_t count()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		return times_.size();
+	}
+
+	std::vector<double> gaps()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		recording_ = false;
+		std::vector<double> us;
+		for (size_t i = 1; i < times_.size(); i++)
+			us.push_back(since_us(times_[i - 1], times_[i]));
+		return us;
+	}
+
+private:
+	std::mutex mutex_;
+	bool recording_ = false;
+	std::vector<Clock::time_point> times_;
+};
+
+std::vector<double> push_gaps(dosimeter::Client &client, PushTimes &times, const Options &options)
+{
+	const int32_t on[] = {1, options.push_ms};
+	times.start();
+	if (client.command(1029, on).get().error)
+	{
+		times.gaps();
+		return {};
+	}
+
+	auto deadline = Clock::now() + std::chrono::milliseconds(options.push_ms) * (options.samples + 1) + PUSH_SLACK;
+	while (times.count() <= static_cast<size_t>(options.samples) && Clock::now() < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	const int32_t off[] = {0};
+	client.command(1029, off).get();
+	std::vector<double> us = times.gaps();
+	if (us.size() > static_cast<size_t>(options.samples))
+		us.resize(options.samples);
+	return us;
+}
+
+// Reads a text reply through its last line; "ok\n<position>\n" has two
+bool read_lines(int fd, int lines)
+{
+	int seen = 0;
+	while (seen < lines)
+	{
+		pollfd p{fd, POLLIN, 0};
+		if (poll(&p, 1, TEXT_TIMEOUT_MS) <= 0)
+			return false;
+		char chunk[64];
+		ssize_t n = ::read(fd, chunk, sizeof(chunk));
+		if (n <= 0)
+			return false;
+		seen += std::count(chunk, chunk + n, '\n');
+	}
+	return true;
+}
+
+std::vector<double> text_round_trips(const std::string &port, int samples)
+{
+	int fd = dosimeter::open_port(port);
+	std::vector<double> us;
+	us.reserve(samples);
+	static const char command[] = "M1001\n";
+	for (int i = 0; i < samples; i++)
+	{
+		auto t0 = Clock::now();
+		if (::write(fd, command, sizeof(command) - 1) != static_cast<ssize_t>(sizeof(command) - 1) || !read_lines(fd, 2))
+		{
+			::close(fd);
+			throw std::runtime_error("no text reply to M1001");
+		}
+		us.push_back(since_us(t0, Clock::now()));
+	}
+	::close(fd);
+	return us;
+}
+
+double percentile(const std::vector<double> &sorted, double q)
+{
+	return sorted[std::min(sorted.size() - 1, static_cast<size_t>(q * sorted.size()))];
+}
+
+void report(std::vector<Result> &results, const Options &options)
+{
+	std::ofstream csv;
+	if (!options.out.empty())
+	{
+		csv.open(options.out, std::ios::app);
+		if (!csv)
+			throw std::runtime_error("cannot open " + options.out);
+	}
+
+	std::printf("%-8s %-5s %8s %10s %10s %10s %10s\n", "variant", "load", "samples", "p50 us", "p99 us", "p99.9 us",
+		"max us");
+	for (Result &r : results)
+	{
+		if (r.us.empty())
+		{
+			std::printf("%-8s %-5s   unsupported\n", r.variant, r.load);
+			continue;
+		}
+		std::sort(r.us.begin(), r.us.end());
+		double p50 = percentile(r.us, 0.5), p99 = percentile(r.us, 0.99), p999 = percentile(r.us, 0.999);
+		std::printf("%-8s %-5s %8zu %10.1f %10.1f %10.1f %10.1f\n", r.variant, r.load, r.us.size(), p50, p99, p999,
+			r.us.back());
+		if (csv.is_open())
+			csv << options.label << ',' << r.variant << ',' << r.load << ',' << r.us.size() << ',' << p50 << ','
+				<< p99 << ',' << p999 << ',' << r.us.back() << '\n';
+	}
+}
+
+bool parse_options(int argc, char **argv, Options &options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		auto more = [&](int count) { return i + count < argc; };
+		if (arg == "-n" && more(1))
+			options.samples = std::atoi(argv[++i]);
+		else if (arg == "-r" && more(2))
+		{
+			options.start = std::atoi(argv[++i]);
+			options.end = std::atoi(argv[++i]);
+		}
+		else if (arg == "-m" && more(1))
+			options.mask = std::strtoul(argv[++i], nullptr, 0);
+		else if (arg == "-d" && more(1))
+			options.depth = std::atoi(argv[++i]);
+		else if (arg == "-p" && more(1))
+			options.push_ms = std::atoi(argv[++i]);
+		else if (arg == "-o" && more(1))
+			options.out = argv[++i];
+		else if (arg == "-l" && more(1))
+			options.label = argv[++i];
+		else if (arg.size() > 1 && arg[0] == '-')
+			return false;
+		else if (options.port.empty())
+			options.port = arg;
+		else
+			return false;
+	}
+
+	if (options.label.empty())
+		options.label = options.port;
+	return !options.port.empty() && options.samples > 0 && options.depth > 0 && options.push_ms > 0
+		&& options.push_ms <= UINT16_MAX && options.end >= options.start && options.mask;
+}
+
+}  // namespace
+
+int main(int argc, char **argv)
+{
+	Options options;
+	if (!parse_options(argc, argv, options))
+	{
+		std::fprintf(stderr, "usage: %s [-n samples] [-r start end] [-m mask] [-d depth] [-p ms] [-o file] [-l label]\n"
+			"    <port>\n", argv[0]);
+		return 2;
+	}
+
+	try
+	{
+		std::vector<Result> results;
+		{
+			PushTimes times;
+			dosimeter::Client client(options.port);
+			client.on_position([&](const dosimeter::PositionPush &) { times.record(); });
+
+			results.push_back({"framed", "idle", framed_round_trips(client, options.samples)});
+			results.push_back({"push", "idle", push_gaps(client, times, options)});
+			{
+				Bulk bulk(client, options);
+				auto t0 = Clock::now();
+				results.push_back({"framed", "bulk", framed_round_trips(client, options.samples)});
+				results.push_back({"push", "bulk", push_gaps(client, times, options)});
+				double seconds = std::chrono::duration<double>(Clock::now() - t0).count();
+				std::printf("bulk readout %.2f MB/s beside the measurements\n", bulk.bytes() / seconds / 1e6);
+			}
+
+			// Back to text for the last measurement, from a fresh connection
+			const int32_t text[] = {0};
+			client.command(1028, text).get();
+		}
+		results.push_back({"text", "idle", text_round_trips(options.port, options.samples)});
+
+		report(results, options);
+	}
+	catch (const std::exception &e)
+	{
+		std::fprintf(stderr, "error: %s\n", e.what());
+		return 1;
+	}
+	return 0;
+}
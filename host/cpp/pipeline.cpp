@@ -0,0 +1,620 @@
+// Frame reconstruction for one or more scanners.
+//
+//   dosimeter_pipeline [options] <source>...
+//
+// A source is a device port or tcp:<host>:<port>, read with M1056
+// containers, or an archive file of containers saved from one (archive.hpp).  Each frame goes through
+//   decode -> dead-time correction -> calibration -> flat-field -> assembly
+// and every stage runs on its own pool of threads with a bounded queue in
+// front of it, so frames from all sources are in flight at once and a
+// slow stage only holds up the ones behind it.
+//
+// Options
+//   -n <frames>              frames read from each device (default 10)
+//   -r <start> <end>         cell range read from devices (default 0 4095)
+//   -m <mask>                channels read from devices (default 1)
+//   -d <depth>               readouts kept in flight per device (default 2)
+//   -j <threads>             threads per stage (default cores / 4, at least 1)
+//   --deadtime <ns> <us>     dead time and dwell per column, as M1033
+//   --calibrate <channel> <count>:<dose>,...
+//                            piecewise-linear curve through the origin, as M1035
+//   --flat <channel> <file>  float32 response per cell; cells are divided by it
+//                            relative to its mean
+//   -o <directory>           write each channel of each frame as a PFM image
+//   --capture <prefix>       record each device session to <prefix>.<source>,
+//                            for dosimeter_replay
+
+#include "archive.hpp"
+#include "dosimeter.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <new>
+#include <optional>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+// Frames waiting in front of each stage, which bounds the memory in flight
+constexpr size_t QUEUE_FRAMES = 8;
+// Cache line (and AVX-512 vector) alignment of the planes
+constexpr size_t PLANE_ALIGN = 64;
+constexpr int CALIBRATION_POINTS = 8;
+constexpr int MAX_CHANNELS = 16;
+
+// float values of one channel over a frame's cells, aligned so
+// the stage loops vectorise without peeling
+class Plane
+{
+public:
+	explicit Plane(size_t size)
+		: values_(static_cast<float *>(::operator new[](size * sizeof(float), std::align_val_t(PLANE_ALIGN)))),
+		  size_(size)
+	{
+	}
+	~Plane() { ::operator delete[](values_, std::align_val_t(PLANE_ALIGN)); }
+
+	Plane(const Plane &) = delete;
+	Plane &operator=(const Plane &) = delete;
+
+	float *data() { return std::assume_aligned<PLANE_ALIGN>(values_); }
+	const float *data() const { return std::assume_aligned<PLANE_ALIGN>(values_); }
+	size_t size() const { return size_; }
+
+private:
+	float *values_;
+	size_t size_;
+};
+
+struct Frame
+{
+	size_t source;
+	uint64_t index;
+	dosimeter::ContainerHeader header;
+	std::vector<std::byte> owned;        // Device frames
+	std::span<const std::byte> payload;  // Into owned or an archive mapping
+	bool checked;                        // Block CRCs already verified
+	std::unique_ptr<Plane> planes[MAX_CHANNELS];
+	Clock::time_point arrived;
+};
+
+using FramePtr = std::unique_ptr<Frame>;
+
+// Bounded multi-producer, multi-consumer queue.  pop() returns nothing
+// once the queue is closed and empty.
+class Queue
+{
+public:
+	void push(FramePtr frame)
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		not_full_.wait(lock, [this] { return frames_.size() < QUEUE_FRAMES; });
+		frames_.push(std::move(frame));
+		not_empty_.notify_one();
+	}
+
+	std::optional<FramePtr> pop()
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		not_empty_.wait(lock, [this] { return !frames_.empty() || closed_; });
+		if (frames_.empty())
+			return std::nullopt;
+		FramePtr frame = std::move(frames_.front());
+		frames_.pop();
+		not_full_.notify_one();
+		return frame;
+	}
+
+	void close()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		closed_ = true;
+		not_empty_.notify_all();
+	}
+
+private:
+	std::mutex mutex_;
+	std::condition_variable not_empty_;
+	std::condition_variable not_full_;
+	std::queue<FramePtr> frames_;
+	bool closed_ = false;
+};
+
+struct Calibration
+{
+	int points = 0;
+	float count[CALIBRATION_POINTS];
+	float dose[CALIBRATION_POINTS];
+	float slope[CALIBRATION_POINTS];
+};
+
+struct Options
+{
+	std::vector<std::string> sources;
+	int frames = 10;
+	uint16_t start = 0;
+	uint16_t end = 4095;
+	uint16_t mask = 1;
+	int depth = 2;
+	int threads = std::max(1u, std::thread::hardware_concurrency() / 4);
+	float deadtime_ratio = 0.0f;
+	Calibration calibration[MAX_CHANNELS];
+	std::vector<float> flat[MAX_CHANNELS];  // Reciprocal gain per cell
+	std::string out;
+	std::string capture;
+};
+
+// Frames whose header does not describe a container
+class FormatError : public std::runtime_error
+{
+	using std::runtime_error::runtime_error;
+};
+
+std::vector<uint16_t> mask_channels(uint16_t mask)
+{
+	std::vector<uint16_t> channels;
+	for (uint16_t c = 0; c < MAX_CHANNELS; c++)
+		if (mask & (1u << c))
+			channels.push_back(c);
+	return channels;
+}
+
+// Spread the blocks over one plane per channel
+void decode(Frame &frame)
+{
+	const dosimeter::ContainerHeader &h = frame.header;
+	if (!frame.checked && !dosimeter::container_blocks_valid(h, frame.payload))
+		throw FormatError("block CRC mismatch");
+
+	std::vector<uint16_t> channels = mask_channels(h.mask);
+	size_t count = channels.size();
+	size_t cells = h.end - h.start + 1;
+	for (uint16_t c : channels)
+		frame.planes[c] = std::make_unique<Plane>(cells);
+
+	const std::byte *p = frame.payload.data();
+	for (size_t first = 0; first < cells; first += h.block_columns)
+	{
+		size_t columns = std::min<size_t>(h.block_columns, cells - first);
+		for (size_t k = 0; k < count; k++)
+		{
+			float *out = frame.planes[channels[k]]->data() + first;
+			// Planar blocks hold each channel's columns in turn,
+			// interleaved ones all channels of a column together
+			size_t base = h.interleaved ? k : k * columns;
+			size_t step = h.interleaved ? count : 1;
+			if (h.width == 2)
+				for (size_t i = 0; i < columns; i++)
+				{
+					uint16_t v;
+					std::memcpy(&v, p + (base + i * step) * 2, 2);
+					out[i] = v;
+				}
+			else
+				for (size_t i = 0; i < columns; i++)
+				{
+					uint32_t v;
+					std::memcpy(&v, p + (base + i * step) * 4, 4);
+					out[i] = v;
+				}
+		}
+		p += columns * count * h.width + sizeof(uint32_t);
+	}
+
+	// The raw bytes are no longer needed
+	frame.owned = {};
+	frame.payload = {};
+}
+
+// Non-paralyzable model as in the firmware: m / (1 - m * tau / T),
+// infinite at or beyond saturation
+void correct_deadtime(Frame &frame, const Options &options)
+{
+	const float ratio = options.deadtime_ratio;
+	if (ratio == 0.0f)
+		return;
+
+	for (auto &plane : frame.planes)
+	{
+		if (!plane)
+			continue;
+		float *v = plane->data();
+		for (size_t i = 0, n = plane->size(); i < n; i++)
+		{
+			float live = 1.0f - v[i] * ratio;
+			v[i] = live > 0.0f ? v[i] / live : INFINITY;
+		}
+	}
+}
+
+void calibrate(Frame &frame, const Options &options)
+{
+	for (int c = 0; c < MAX_CHANNELS; c++)
+	{
+		const Calibration &curve = options.calibration[c];
+		if (!frame.planes[c] || !curve.points)
+			continue;
+
+		float *v = frame.planes[c]->data();
+		for (size_t i = 0, n = frame.planes[c]->size(); i < n; i++)
+		{
+			int k = 0;
+			while (k < curve.points - 1 && v[i] > curve.count[k])
+				k++;
+			v[i] = std::max(0.0f, curve.dose[k] + (v[i] - curve.count[k]) * curve.slope[k]);
+		}
+	}
+}
+
+void flat_field(Frame &frame, const Options &options)
+{
+	for (int c = 0; c < MAX_CHANNELS; c++)
+	{
+		const std::vector<float> &gain = options.flat[c];
+		if (!frame.planes[c] || gain.empty())
+			continue;
+		if (gain.size() <= frame.header.end)
+			throw FormatError("flat field smaller than the frame");
+
+		float *v = frame.planes[c]->data();
+		const float *g = gain.data() + frame.header.start;
+		for (size_t i = 0, n = frame.planes[c]->size(); i < n; i++)
+			v[i] *= g[i];
+	}
+}
+
+// Place the cells in a rows x columns image per channel, cells outside
+// the range read left at 0, and write it out as a PFM
+void assemble(Frame &frame, const Options &options)
+{
+	if (options.out.empty())
+		return;
+
+	const dosimeter::ContainerHeader &h = frame.header;
+	size_t width = h.columns, height = h.rows;
+	std::vector<float> image(width * height);
+	for (int c = 0; c < MAX_CHANNELS; c++)
+	{
+		if (!frame.planes[c])
+			continue;
+		std::fill(image.begin(), image.end(), 0.0f);
+		const float *v = frame.planes[c]->data();
+		size_t cells = std::min(frame.planes[c]->size(), image.size() - std::min<size_t>(h.start, image.size()));
+		std::copy(v, v + cells, image.begin() + std::min<size_t>(h.start, image.size()));
+
+		char name[64];
+		std::snprintf(name, sizeof(name), "/s%zu_f%06llu_c%d.pfm", frame.source,
+			static_cast<unsigned long long>(frame.index), c);
+		std::ofstream file(options.out + name, std::ios::binary);
+		// PFM rows run bottom to top; a negative scale means little-endian
+		file << "Pf\n" << width << ' ' << height << "\n-1.0\n";
+		for (size_t row = height; row-- > 0;)
+			file.write(reinterpret_cast<const char *>(&image[row * width]), width * sizeof(float));
+		if (!file)
+			throw std::runtime_error("cannot write " + options.out + name);
+	}
+}
+
+struct Stage
+{
+	Stage(const char *name, std::function<void(Frame &)> run) : name(name), run(std::move(run)) {}
+
+	const char *name;
+	std::function<void(Frame &)> run;
+	Queue in;
+	std::atomic<uint64_t> busy_ns = 0;
+};
+
+struct Totals
+{
+	std::atomic<uint64_t> frames = 0;
+	std::atomic<uint64_t> bytes = 0;
+	std::atomic<uint64_t> errors = 0;
+	std::atomic<uint64_t> latency_ns = 0;
+};
+
+// Read frames from a device, keeping depth readouts in flight
+void device_source(size_t source, const std::string &port, const Options &options, Queue &out, Totals &totals)
+{
+	std::string capture = options.capture.empty() ? std::string() : options.capture + "." + std::to_string(source);
+	dosimeter::Client client(port, capture);
+
+	size_t cells = options.end - options.start + 1;
+	size_t capacity = dosimeter::container_capacity(cells, options.mask);
+
+	struct Slot
+	{
+		FramePtr frame;
+		std::future<dosimeter::ContainerHeader> done;
+	};
+	std::vector<Slot> slots(options.depth);
+
+	for (int i = 0; i < options.frames + options.depth; i++)
+	{
+		Slot &slot = slots[i % options.depth];
+		if (slot.frame)
+		{
+			try
+			{
+				slot.frame->header = slot.done.get();
+				slot.frame->payload = std::span<const std::byte>(slot.frame->owned)
+					.first(dosimeter::container_payload_bytes(slot.frame->header));
+				slot.frame->checked = true;
+				slot.frame->arrived = Clock::now();
+				totals.bytes += slot.frame->payload.size();
+				out.push(std::move(slot.frame));
+			}
+			catch (const std::exception &e)
+			{
+				std::fprintf(stderr, "%s: %s\n", port.c_str(), e.what());
+				totals.errors++;
+				slot.frame.reset();
+			}
+		}
+
+		if (i < options.frames)
+		{
+			slot.frame = std::make_unique<Frame>();
+			slot.frame->source = source;
+			slot.frame->index = i;
+			slot.frame->owned.resize(capacity);
+			slot.done = client.read_container(false, options.start, options.end, options.mask, slot.frame->owned);
+		}
+	}
+}
+
+// Queue the frames of a memory-mapped archive (archive.hpp).  Frames point
+// into the mapping, which outlives the pipeline.
+void file_source(size_t source, const std::string &path, Queue &out, Totals &totals,
+	std::vector<std::unique_ptr<dosimeter::ArchiveReader>> &archives, std::mutex &archives_mutex)
+{
+	auto owned = std::make_unique<dosimeter::ArchiveReader>(path);
+	dosimeter::ArchiveReader &archive = *owned;
+	{
+		std::lock_guard<std::mutex> lock(archives_mutex);
+		archives.push_back(std::move(owned));
+	}
+
+	for (size_t index = 0; index < archive.frames(); index++)
+	{
+		auto frame = std::make_unique<Frame>();
+		frame->header = archive.header(index);
+		frame->source = source;
+		frame->index = index;
+		frame->payload = archive.payload(index);
+		frame->checked = false;
+		frame->arrived = Clock::now();
+		totals.bytes += frame->header.header_bytes + frame->payload.size();
+		out.push(std::move(frame));
+	}
+	if (!archive.indexed() && archive.data_bytes() < archive.bytes())
+	{
+		std::fprintf(stderr, "%s: no whole container at offset %llu\n", path.c_str(),
+			static_cast<unsigned long long>(archive.data_bytes()));
+		totals.errors++;
+	}
+}
+
+bool parse_calibration(const char *points, Calibration &curve)
+{
+	float last_count = 0.0f, last_dose = 0.0f;
+	while (*points)
+	{
+		char *end;
+		float count = std::strtof(points, &end);
+		if (end == points || *end != ':' || curve.points == CALIBRATION_POINTS || count <= last_count)
+			return false;
+		points = end + 1;
+		float dose = std::strtof(points, &end);
+		if (end == points || (*end && *end != ','))
+			return false;
+		points = *end ? end + 1 : end;
+
+		curve.count[curve.points] = count;
+		curve.dose[curve.points] = dose;
+		curve.slope[curve.points] = (dose - last_dose) / (count - last_count);
+		curve.points++;
+		last_count = count;
+		last_dose = dose;
+	}
+	return curve.points > 0;
+}
+
+bool load_flat(const char *path, std::vector<float> &gain)
+{
+	std::ifstream file(path, std::ios::binary | std::ios::ate);
+	if (!file)
+		return false;
+	gain.resize(file.tellg() / sizeof(float));
+	file.seekg(0);
+	file.read(reinterpret_cast<char *>(gain.data()), gain.size() * sizeof(float));
+	if (!file || gain.empty())
+		return false;
+
+	double mean = 0.0;
+	for (float g : gain)
+		mean += g;
+	mean /= gain.size();
+	for (float &g : gain)
+		g = g > 0.0f ? static_cast<float>(mean / g) : 0.0f;
+	return true;
+}
+
+bool parse_options(int argc, char **argv, Options &options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		auto more = [&](int count) { return i + count < argc; };
+		if (arg == "-n" && more(1))
+			options.frames = std::atoi(argv[++i]);
+		else if (arg == "-r" && more(2))
+		{
+			options.start = std::atoi(argv[++i]);
+			options.end = std::atoi(argv[++i]);
+		}
+		else if (arg == "-m" && more(1))
+			options.mask = std::strtoul(argv[++i], nullptr, 0);
+		else if (arg == "-d" && more(1))
+			options.depth = std::atoi(argv[++i]);
+		else if (arg == "-j" && more(1))
+			options.threads = std::atoi(argv[++i]);
+		else if (arg == "--deadtime" && more(2))
+		{
+			float deadtime = std::strtof(argv[++i], nullptr);
+			float dwell = std::strtof(argv[++i], nullptr);
+			if (dwell <= 0.0f)
+				return false;
+			options.deadtime_ratio = deadtime / (dwell * 1000.0f);
+		}
+		else if (arg == "--calibrate" && more(2))
+		{
+			int channel = std::atoi(argv[++i]);
+			if (channel < 0 || channel >= MAX_CHANNELS || !parse_calibration(argv[++i], options.calibration[channel]))
+				return false;
+		}
+		else if (arg == "--flat" && more(2))
+		{
+			int channel = std::atoi(argv[++i]);
+			if (channel < 0 || channel >= MAX_CHANNELS || !load_flat(argv[++i], options.flat[channel]))
+				return false;
+		}
+		else if (arg == "-o" && more(1))
+			options.out = argv[++i];
+		else if (arg == "--capture" && more(1))
+			options.capture = argv[++i];
+		else if (arg.size() > 1 && arg[0] == '-')
+			return false;
+		else
+			options.sources.push_back(arg);
+	}
+
+	return !options.sources.empty() && options.frames > 0 && options.depth > 0 && options.threads > 0
+		&& options.end >= options.start && options.mask;
+}
+
+bool is_device(const std::string &path)
+{
+	struct stat st;
+	return path.rfind(dosimeter::TCP_PREFIX, 0) == 0 || (stat(path.c_str(), &st) == 0 && S_ISCHR(st.st_mode));
+}
+
+}  // namespace
+
+int main(int argc, char **argv)
+{
+	Options options;
+	if (!parse_options(argc, argv, options))
+	{
+		std::fprintf(stderr, "usage: %s [-n frames] [-r start end] [-m mask] [-d depth] [-j threads]\n"
+			"    [--deadtime ns us] [--calibrate channel count:dose,...] [--flat channel file]\n"
+			"    [-o directory] [--capture prefix] <port or archive>...\n", argv[0]);
+		return 2;
+	}
+
+	Stage stages[] = {
+		{"decode", decode},
+		{"deadtime", [&](Frame &f) { correct_deadtime(f, options); }},
+		{"calibrate", [&](Frame &f) { calibrate(f, options); }},
+		{"flat", [&](Frame &f) { flat_field(f, options); }},
+		{"assemble", [&](Frame &f) { assemble(f, options); }},
+	};
+	constexpr size_t STAGES = std::size(stages);
+
+	Totals totals;
+	std::vector<std::unique_ptr<dosimeter::ArchiveReader>> archives;
+	std::mutex archives_mutex;
+	auto t0 = Clock::now();
+
+	// Each stage's threads hand frames on to the next stage; the last
+	// closes the queue behind it once all its threads are done
+	std::vector<std::thread> workers;
+	std::atomic<int> running[STAGES];
+	for (size_t s = 0; s < STAGES; s++)
+	{
+		running[s] = options.threads;
+		for (int t = 0; t < options.threads; t++)
+			workers.emplace_back([&, s] {
+				while (std::optional<FramePtr> frame = stages[s].in.pop())
+				{
+					auto start = Clock::now();
+					try
+					{
+						stages[s].run(**frame);
+					}
+					catch (const std::exception &e)
+					{
+						std::fprintf(stderr, "source %zu frame %llu: %s: %s\n", (*frame)->source,
+							static_cast<unsigned long long>((*frame)->index), stages[s].name, e.what());
+						totals.errors++;
+						frame->reset();
+					}
+					auto now = Clock::now();
+					stages[s].busy_ns += std::chrono::nanoseconds(now - start).count();
+
+					if (!*frame)
+						continue;
+					if (s + 1 < STAGES)
+						stages[s + 1].in.push(std::move(*frame));
+					else
+					{
+						totals.frames++;
+						totals.latency_ns += std::chrono::nanoseconds(now - (*frame)->arrived).count();
+					}
+				}
+				if (--running[s] == 0 && s + 1 < STAGES)
+					stages[s + 1].in.close();
+			});
+	}
+
+	std::vector<std::thread> sources;
+	for (size_t i = 0; i < options.sources.size(); i++)
+		sources.emplace_back([&, i] {
+			const std::string &source = options.sources[i];
+			try
+			{
+				if (is_device(source))
+					device_source(i, source, options, stages[0].in, totals);
+				else
+					file_source(i, source, stages[0].in, totals, archives, archives_mutex);
+			}
+			catch (const std::exception &e)
+			{
+				std::fprintf(stderr, "%s: %s\n", source.c_str(), e.what());
+				totals.errors++;
+			}
+		});
+
+	for (std::thread &t : sources)
+		t.join();
+	stages[0].in.close();
+	for (std::thread &t : workers)
+		t.join();
+
+	double seconds = std::chrono::duration<double>(Clock::now() - t0).count();
+	uint64_t frames = totals.frames;
+	std::printf("frames %llu in %.3f s: %.1f frames/s, %.2f MB/s, latency %.2f ms, errors %llu\n",
+		static_cast<unsigned long long>(frames), seconds, frames / seconds, totals.bytes / seconds / 1e6,
+		frames ? totals.latency_ns / 1e6 / frames : 0.0, static_cast<unsigned long long>(totals.errors.load()));
+	for (Stage &stage : stages)
+		std::printf("  %-10s %8.3f ms busy per frame\n", stage.name, frames ? stage.busy_ns / 1e6 / frames : 0.0);
+	return totals.errors ? 1 : 0;
+}
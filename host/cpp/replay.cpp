@@ -0,0 +1,406 @@
+// Replay of a session captured by Client (see CaptureHeader) against a
+// device or dosimeter_emulator, to time changes to the command path and
+// the readouts against real traffic.
+//
+//   dosimeter_replay <capture> <port> [speed]
+//
+// Each write of the capture is sent again at its recorded time divided by
+// speed (default 1), or with speed 0 as soon as the writes before it have
+// gone.  A command frame waits until the one before it with the same
+// sequence number has been answered, so replies still match.  Each command
+// is timed from its frame to the last reply frame of its sequence, and
+// the latency per command is reported beside the latency in the capture,
+// with the throughput of both.
+//
+// Replies are found by their sync byte and CRC, as Client finds them
+// between binary data.  A payload that happens to hold a valid frame of
+// an unanswered sequence would end that command early, which the 16-bit
+// CRC makes rare enough not to matter for timing.
+
+#include "dosimeter.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <unistd.h>
+
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+constexpr uint8_t FRAME_SYNC_COMMAND = 0xA5;
+constexpr uint8_t FRAME_SYNC_REPLY = 0x5A;
+constexpr uint8_t FRAME_FLAG_MORE = 0x01;
+constexpr uint8_t FRAME_FLAG_ERROR = 0x02;
+constexpr size_t FRAME_HEADER_BYTES = 6;
+// REPLY_FRAME_BYTES in reply.h, so longer lengths are not frames
+constexpr size_t REPLY_FRAME_BYTES = 240;
+
+constexpr int POLL_MS = 100;
+// Longest wait for a reply before its command counts as lost
+constexpr auto REPLY_TIMEOUT = std::chrono::seconds(5);
+
+struct Write
+{
+	uint64_t time_ns;
+	std::vector<uint8_t> bytes;
+	int code;  // M-code of a command frame, 0 for other bytes
+	uint8_t sequence;
+};
+
+struct Read
+{
+	uint64_t time_ns;
+	std::vector<uint8_t> bytes;
+};
+
+struct Capture
+{
+	std::vector<Write> writes;
+	std::vector<Read> reads;
+};
+
+Capture load_capture(const char *path)
+{
+	std::ifstream file(path, std::ios::binary);
+	dosimeter::CaptureHeader header;
+	if (!file.read(reinterpret_cast<char *>(&header), sizeof(header)) || header.magic != dosimeter::CAPTURE_MAGIC
+		|| header.version != dosimeter::CAPTURE_VERSION)
+		throw std::runtime_error("not a capture");
+
+	Capture capture;
+	dosimeter::CaptureRecord record;
+	while (file.read(reinterpret_cast<char *>(&record), sizeof(record)))
+	{
+		std::vector<uint8_t> bytes(record.length);
+		if (!file.read(reinterpret_cast<char *>(bytes.data()), bytes.size()))
+			throw std::runtime_error("capture cut short");
+
+		if (record.direction == dosimeter::CAPTURE_FROM_DEVICE)
+		{
+			capture.reads.push_back({record.time_ns, std::move(bytes)});
+			continue;
+		}
+
+		// Client writes each command frame whole
+		Write write{record.time_ns, std::move(bytes), 0, 0};
+		const std::vector<uint8_t> &b = write.bytes;
+		if (b.size() >= FRAME_HEADER_BYTES + sizeof(uint16_t) && b[0] == FRAME_SYNC_COMMAND)
+		{
+			uint16_t length, crc;
+			std::memcpy(&length, &b[4], sizeof(length));
+			if (b.size() == FRAME_HEADER_BYTES + length + sizeof(crc))
+			{
+				std::memcpy(&crc, &b[FRAME_HEADER_BYTES + length], sizeof(crc));
+				if (crc == dosimeter::crc16(b.data(), FRAME_HEADER_BYTES + length))
+				{
+					write.code = 1000 + b[1];
+					write.sequence = b[2];
+				}
+			}
+		}
+		capture.writes.push_back(std::move(write));
+	}
+	return capture;
+}
+
+// Finds the reply frames in the bytes from the device
+class ReplyScanner
+{
+public:
+	template<typename OnFrame> void feed(const uint8_t *data, size_t length, OnFrame on_frame)
+	{
+		buffer_.insert(buffer_.end(), data, data + length);
+		size_t start = 0;
+		while (buffer_.size() - start >= FRAME_HEADER_BYTES)
+		{
+			const uint8_t *header = &buffer_[start];
+			uint16_t payload;
+			std::memcpy(&payload, header + 4, sizeof(payload));
+			if (header[0] != FRAME_SYNC_REPLY || payload > REPLY_FRAME_BYTES)
+			{
+				start++;
+				continue;
+			}
+
+			size_t total = FRAME_HEADER_BYTES + payload + sizeof(uint16_t);
+			if (buffer_.size() - start < total)
+				break;
+
+			uint16_t crc;
+			std::memcpy(&crc, header + FRAME_HEADER_BYTES + payload, sizeof(crc));
+			if (crc != dosimeter::crc16(header, FRAME_HEADER_BYTES + payload))
+			{
+				start++;
+				continue;
+			}
+
+			on_frame(header[2], header[3]);
+			start += total;
+		}
+		buffer_.erase(buffer_.begin(), buffer_.begin() + start);
+	}
+
+private:
+	std::vector<uint8_t> buffer_;
+};
+
+// Commands waiting for their last reply frame, by sequence number
+class Outstanding
+{
+public:
+	void sent(int code, uint8_t sequence, uint64_t time_ns)
+	{
+		slots_[sequence] = {code, time_ns};
+	}
+
+	bool waiting(uint8_t sequence) const { return slots_[sequence].code != 0; }
+	bool any() const
+	{
+		return std::any_of(slots_.begin(), slots_.end(), [](const Slot &s) { return s.code != 0; });
+	}
+
+	// Record the latency of the command a final frame answers
+	bool answered(uint8_t sequence, uint8_t flags, uint64_t time_ns)
+	{
+		Slot &slot = slots_[sequence];
+		if (!slot.code || (flags & FRAME_FLAG_MORE))
+			return false;
+		latency_ms[slot.code].push_back((time_ns - slot.time_ns) / 1e6);
+		if (flags & FRAME_FLAG_ERROR)
+			errors++;
+		slot.code = 0;
+		return true;
+	}
+
+	size_t drop()
+	{
+		size_t lost = 0;
+		for (Slot &slot : slots_)
+			if (slot.code)
+			{
+				slot.code = 0;
+				lost++;
+			}
+		return lost;
+	}
+
+	std::map<int, std::vector<double>> latency_ms;
+	size_t errors = 0;
+
+private:
+	struct Slot
+	{
+		int code;
+		uint64_t time_ns;
+	};
+	std::array<Slot, 256> slots_{};
+};
+
+uint64_t since(Clock::time_point start)
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+}
+
+void write_all(int fd, const uint8_t *p, size_t length)
+{
+	while (length)
+	{
+		ssize_t n = ::write(fd, p, length);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			throw std::system_error(errno, std::generic_category(), "write");
+		}
+		p += n;
+		length -= n;
+	}
+}
+
+struct Replayed
+{
+	Outstanding outstanding;
+	uint64_t bytes = 0;
+	uint64_t duration_ns = 0;
+	size_t lost = 0;
+};
+
+void replay(const Capture &capture, const char *port, double speed, Replayed &result)
+{
+	int fd = dosimeter::open_port(port);
+	std::mutex mutex;
+	std::condition_variable answered;
+	std::atomic<bool> stopping = false;
+	auto start = Clock::now();
+
+	std::thread reader([&] {
+		ReplyScanner scanner;
+		uint8_t chunk[4096];
+		while (!stopping)
+		{
+			pollfd p{fd, POLLIN, 0};
+			if (poll(&p, 1, POLL_MS) <= 0)
+				continue;
+			ssize_t n = ::read(fd, chunk, sizeof(chunk));
+			if (n <= 0)
+			{
+				if (n < 0 && (errno == EINTR || errno == EAGAIN))
+					continue;
+				break;
+			}
+
+			uint64_t now = since(start);
+			std::lock_guard<std::mutex> lock(mutex);
+			result.bytes += n;
+			scanner.feed(chunk, n, [&](uint8_t sequence, uint8_t flags) {
+				if (result.outstanding.answered(sequence, flags, now))
+					answered.notify_all();
+			});
+		}
+	});
+
+	try
+	{
+		for (const Write &write : capture.writes)
+		{
+			if (speed > 0)
+				std::this_thread::sleep_until(start + std::chrono::nanoseconds(
+					static_cast<uint64_t>(write.time_ns / speed)));
+
+			if (write.code)
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				if (!answered.wait_for(lock, REPLY_TIMEOUT,
+						[&] { return !result.outstanding.waiting(write.sequence); }))
+					result.lost += result.outstanding.drop();
+				result.outstanding.sent(write.code, write.sequence, since(start));
+			}
+			write_all(fd, write.bytes.data(), write.bytes.size());
+		}
+
+		std::unique_lock<std::mutex> lock(mutex);
+		if (!answered.wait_for(lock, REPLY_TIMEOUT, [&] { return !result.outstanding.any(); }))
+			result.lost += result.outstanding.drop();
+		result.duration_ns = since(start);
+	}
+	catch (...)
+	{
+		stopping = true;
+		reader.join();
+		::close(fd);
+		throw;
+	}
+
+	stopping = true;
+	reader.join();
+	::close(fd);
+}
+
+// The latencies as the capture recorded them
+Outstanding captured_latency(const Capture &capture)
+{
+	Outstanding outstanding;
+	ReplyScanner scanner;
+	size_t w = 0;
+	for (const Read &read : capture.reads)
+	{
+		for (; w < capture.writes.size() && capture.writes[w].time_ns <= read.time_ns; w++)
+			if (capture.writes[w].code)
+				outstanding.sent(capture.writes[w].code, capture.writes[w].sequence, capture.writes[w].time_ns);
+		scanner.feed(read.bytes.data(), read.bytes.size(), [&](uint8_t sequence, uint8_t flags) {
+			outstanding.answered(sequence, flags, read.time_ns);
+		});
+	}
+	return outstanding;
+}
+
+struct Summary
+{
+	double mean = 0.0, p50 = 0.0, p99 = 0.0;
+};
+
+Summary summarise(std::vector<double> values)
+{
+	Summary summary;
+	if (values.empty())
+		return summary;
+	std::sort(values.begin(), values.end());
+	for (double v : values)
+		summary.mean += v;
+	summary.mean /= values.size();
+	summary.p50 = values[(values.size() - 1) / 2];
+	summary.p99 = values[(values.size() - 1) * 99 / 100];
+	return summary;
+}
+
+}  // namespace
+
+int main(int argc, char **argv)
+{
+	if (argc < 3)
+	{
+		std::fprintf(stderr, "usage: %s <capture> <port> [speed]\n", argv[0]);
+		return 2;
+	}
+
+	double speed = argc > 3 ? std::strtod(argv[3], nullptr) : 1.0;
+	if (speed < 0)
+	{
+		std::fprintf(stderr, "bad arguments\n");
+		return 2;
+	}
+
+	try
+	{
+		Capture capture = load_capture(argv[1]);
+		Outstanding original = captured_latency(capture);
+		uint64_t captured_bytes = 0, captured_ns = 0;
+		for (const Read &read : capture.reads)
+			captured_bytes += read.bytes.size();
+		if (!capture.reads.empty())
+			captured_ns = capture.reads.back().time_ns;
+
+		Replayed replayed;
+		replay(capture, argv[2], speed, replayed);
+
+		std::printf("%-8s %8s   %-26s   %s\n", "command", "count", "captured mean/p50/p99 ms",
+			"replayed mean/p50/p99 ms");
+		for (auto &[code, latencies] : replayed.outstanding.latency_ms)
+		{
+			Summary before = summarise(original.latency_ms[code]);
+			Summary after = summarise(latencies);
+			std::printf("M%-7d %8zu   %8.3f %8.3f %8.3f   %8.3f %8.3f %8.3f\n", code, latencies.size(),
+				before.mean, before.p50, before.p99, after.mean, after.p50, after.p99);
+		}
+
+		auto rate = [](uint64_t bytes, uint64_t ns) { return ns ? bytes * 1e3 / ns : 0.0; };
+		std::printf("captured %.2f MB in %.3f s: %.2f MB/s\n", captured_bytes / 1e6, captured_ns / 1e9,
+			rate(captured_bytes, captured_ns));
+		std::printf("replayed %.2f MB in %.3f s: %.2f MB/s, %zu errors, %zu lost\n", replayed.bytes / 1e6,
+			replayed.duration_ns / 1e9, rate(replayed.bytes, replayed.duration_ns),
+			replayed.outstanding.errors, replayed.lost);
+	}
+	catch (const std::exception &e)
+	{
+		std::fprintf(stderr, "error: %s\n", e.what());
+		return 1;
+	}
+	return 0;
+}
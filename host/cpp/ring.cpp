@@ -0,0 +1,265 @@
+#include "ring.hpp"
+
+#include <cerrno>
+#include <chrono>
+#include <new>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace dosimeter {
+
+namespace {
+
+constexpr size_t SLOT_ALIGN = 64;
+constexpr auto WAIT_POLL = std::chrono::microseconds(200);
+
+[[noreturn]] void throw_errno(const char *what)
+{
+	throw std::system_error(errno, std::generic_category(), what);
+}
+
+std::string segment_name(const std::string &name)
+{
+	if (name.empty() || name.find('/') != std::string::npos)
+		throw std::invalid_argument("ring names must be non-empty and without '/'");
+	return "/dosimeter-" + name;
+}
+
+constexpr size_t align(size_t bytes)
+{
+	return (bytes + SLOT_ALIGN - 1) / SLOT_ALIGN * SLOT_ALIGN;
+}
+
+constexpr size_t SLOTS_OFFSET = align(sizeof(RingHeader));
+
+}  // namespace
+
+RingMapping::~RingMapping()
+{
+	if (header_)
+		::munmap(header_, bytes_);
+}
+
+void RingMapping::map(int fd, size_t bytes)
+{
+	void *p = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	int error = errno;
+	::close(fd);
+	if (p == MAP_FAILED)
+	{
+		errno = error;
+		throw_errno("mmap");
+	}
+	header_ = static_cast<RingHeader *>(p);
+	bytes_ = bytes;
+}
+
+RingSlot &RingMapping::slot(uint64_t entry) const
+{
+	std::byte *base = reinterpret_cast<std::byte *>(header_) + SLOTS_OFFSET;
+	return *reinterpret_cast<RingSlot *>(base + entry % header_->slots * header_->slot_bytes);
+}
+
+std::byte *RingMapping::payload(uint64_t entry) const
+{
+	return reinterpret_cast<std::byte *>(&slot(entry)) + sizeof(RingSlot);
+}
+
+RingWriter::RingWriter(const std::string &name, uint32_t slots, size_t payload_bytes)
+{
+	if (slots == 0 || payload_bytes > UINT32_MAX - SLOT_ALIGN - sizeof(RingSlot))
+		throw std::invalid_argument("ring too large or without slots");
+	name_ = segment_name(name);
+	uint32_t slot_bytes = align(sizeof(RingSlot) + payload_bytes);
+	size_t bytes = SLOTS_OFFSET + static_cast<size_t>(slots) * slot_bytes;
+
+	// A writer that exited without removing its segment left it behind.
+	// It is replaced, not reused, so readers still attached to it keep a
+	// ring that no longer advances rather than one that changes under them.
+	::shm_unlink(name_.c_str());
+	int fd = ::shm_open(name_.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0)
+		throw_errno("shm_open");
+	if (::ftruncate(fd, bytes) != 0)
+	{
+		int error = errno;
+		::close(fd);
+		::shm_unlink(name_.c_str());
+		errno = error;
+		throw_errno("ftruncate");
+	}
+	map(fd, bytes);
+
+	// The file is new and zero-filled, so every slot is unpublished and
+	// every cursor free
+	RingHeader *header = new (header_) RingHeader{};
+	header->slots = slots;
+	header->slot_bytes = slot_bytes;
+	header->version = RING_VERSION;
+	for (uint32_t i = 0; i < slots; i++)
+		new (&slot(i)) RingSlot{};
+	std::atomic_thread_fence(std::memory_order_release);
+	header->magic = RING_MAGIC;
+}
+
+RingWriter::~RingWriter()
+{
+	::shm_unlink(name_.c_str());
+}
+
+std::span<std::byte> RingWriter::claim(uint64_t entry)
+{
+	uint64_t head = header_->head.load(std::memory_order_relaxed);
+	if (entry < head || entry - head >= header_->slots)
+		throw std::out_of_range("entry outside the slots the writer may claim");
+
+	// Readers of the entry that was in the slot see it go before any of
+	// its bytes change
+	slot(entry).entry.store(RING_WRITING, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	return {payload(entry), ring_payload_bytes(header_->slot_bytes)};
+}
+
+void RingWriter::publish(uint32_t bytes, uint32_t kind)
+{
+	uint64_t head = header_->head.load(std::memory_order_relaxed);
+	RingSlot &s = slot(head);
+	s.bytes = bytes;
+	s.kind = kind;
+	s.entry.store(head + 1, std::memory_order_release);
+	header_->head.store(head + 1, std::memory_order_release);
+}
+
+std::vector<RingWriter::Consumer> RingWriter::consumers()
+{
+	uint64_t head = header_->head.load(std::memory_order_acquire);
+	std::vector<Consumer> found;
+	for (RingConsumer &c : header_->consumers)
+	{
+		int32_t pid = c.pid.load(std::memory_order_acquire);
+		// -1 is a reader still setting its cursor up
+		if (pid <= 0)
+			continue;
+		if (::kill(pid, 0) != 0 && errno == ESRCH)
+		{
+			c.pid.compare_exchange_strong(pid, 0);
+			continue;
+		}
+		uint64_t cursor = c.cursor.load(std::memory_order_relaxed);
+		found.push_back({pid, head > cursor ? head - cursor : 0, c.lost.load(std::memory_order_relaxed)});
+	}
+	return found;
+}
+
+RingReader::RingReader(const std::string &name)
+{
+	name_ = segment_name(name);
+	int fd = ::shm_open(name_.c_str(), O_RDWR, 0);
+	if (fd < 0)
+		throw_errno("shm_open");
+	struct stat st;
+	if (::fstat(fd, &st) != 0)
+	{
+		int error = errno;
+		::close(fd);
+		errno = error;
+		throw_errno("fstat");
+	}
+	if (static_cast<size_t>(st.st_size) < SLOTS_OFFSET)
+	{
+		::close(fd);
+		throw std::runtime_error(name + ": not a ring, or its writer is still creating it");
+	}
+	map(fd, st.st_size);
+
+	if (header_->magic != RING_MAGIC || header_->version != RING_VERSION
+		|| SLOTS_OFFSET + static_cast<size_t>(header_->slots) * header_->slot_bytes > bytes_)
+		throw std::runtime_error(name + ": not a ring, or its writer is still creating it");
+	std::atomic_thread_fence(std::memory_order_acquire);
+
+	pid_t self = ::getpid();
+	for (RingConsumer &c : header_->consumers)
+	{
+		int32_t free = 0;
+		// Claimed first, so the cursor is never seen unset
+		if (c.pid.compare_exchange_strong(free, -1))
+		{
+			c.cursor.store(head(), std::memory_order_relaxed);
+			c.lost.store(0, std::memory_order_relaxed);
+			c.pid.store(self, std::memory_order_release);
+			consumer_ = &c;
+			break;
+		}
+	}
+	if (!consumer_)
+		throw std::runtime_error(name + ": all consumer cursors are taken");
+}
+
+RingReader::~RingReader()
+{
+	if (consumer_)
+		consumer_->pid.store(0, std::memory_order_release);
+}
+
+std::optional<RingEntry> RingReader::next()
+{
+	uint64_t head = header_->head.load(std::memory_order_acquire);
+	uint64_t cursor = consumer_->cursor.load(std::memory_order_relaxed);
+	uint64_t lost = 0;
+
+	// Entries the writer has lapped are gone whatever is in their slots
+	if (head - cursor > header_->slots)
+	{
+		lost += head - header_->slots - cursor;
+		cursor = head - header_->slots;
+	}
+
+	std::optional<RingEntry> found;
+	while (!found && cursor < head)
+	{
+		RingSlot &s = slot(cursor);
+		if (s.entry.load(std::memory_order_acquire) != cursor + 1)
+			lost++;
+		else if (s.bytes > 0)
+			found = RingEntry{cursor, s.kind, {payload(cursor), s.bytes}};
+		cursor++;
+	}
+
+	consumer_->cursor.store(cursor, std::memory_order_relaxed);
+	if (lost)
+		consumer_->lost.fetch_add(lost, std::memory_order_relaxed);
+	return found;
+}
+
+std::optional<RingEntry> RingReader::wait(int timeout_ms)
+{
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+	for (;;)
+	{
+		if (std::optional<RingEntry> entry = next())
+			return entry;
+		if (std::chrono::steady_clock::now() >= deadline)
+			return std::nullopt;
+		std::this_thread::sleep_for(WAIT_POLL);
+	}
+}
+
+bool RingReader::valid(const RingEntry &entry) const
+{
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return slot(entry.entry).entry.load(std::memory_order_relaxed) == entry.entry + 1;
+}
+
+uint64_t RingReader::lost() const
+{
+	return consumer_->lost.load(std::memory_order_relaxed);
+}
+
+}  // namespace dosimeter
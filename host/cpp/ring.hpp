@@ -0,0 +1,156 @@
+// Shared-memory ring through which dosimeter_hub publishes what it reads
+// from a device, so any number of local consumers read it in place.
+//
+// The segment, /dev/shm/dosimeter-<name>, holds a RingHeader and then
+// slots of slot_bytes, each a RingSlot and its payload.  Entry n goes to
+// slot n % slots.  The writer never waits for consumers: it marks the
+// slot as being written, fills it, stores n + 1 in the slot and then
+// advances head.  A consumer checks once it is done with an entry that
+// the slot still holds it (RingReader::valid); if the writer has lapped
+// it in the meantime it counts the entry as lost and moves on.
+//
+// Each consumer owns a cursor in the header, the next entry it will read,
+// so the writer can tell how far behind every consumer is.
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+namespace dosimeter {
+
+constexpr uint32_t RING_MAGIC = 0x474E5244;  // "DRNG"
+constexpr uint16_t RING_VERSION = 1;
+constexpr size_t RING_MAX_CONSUMERS = 16;
+
+// Kinds of entry dosimeter_hub and dosimeter_aggregate publish
+constexpr uint32_t RING_KIND_CONTAINER = 1;  // A ContainerHeader and its checked blocks (M1056)
+constexpr uint32_t RING_KIND_STREAM = 2;     // A StreamHeader and its records (M1017)
+constexpr uint32_t RING_KIND_MERGED = 3;     // A merged frame of dosimeter_aggregate (MergedHeader)
+
+struct RingConsumer
+{
+	std::atomic<int32_t> pid;      // 0 when free
+	uint32_t reserved;
+	std::atomic<uint64_t> cursor;  // Next entry to read
+	std::atomic<uint64_t> lost;    // Entries overwritten before they were read
+};
+
+struct RingHeader
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t reserved;
+	uint32_t slots;
+	uint32_t slot_bytes;         // RingSlot included, a multiple of 64
+	std::atomic<uint64_t> head;  // Entries published
+	RingConsumer consumers[RING_MAX_CONSUMERS];
+};
+
+struct RingSlot
+{
+	std::atomic<uint64_t> entry;  // Entry + 1 once published, RING_WRITING while written
+	uint32_t bytes;
+	uint32_t kind;
+};
+static_assert(sizeof(RingSlot) == 16);
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<int32_t>::is_always_lock_free,
+	"the ring is shared between processes");
+
+constexpr uint64_t RING_WRITING = UINT64_MAX;
+
+// Payload bytes a slot of slot_bytes holds
+constexpr size_t ring_payload_bytes(uint32_t slot_bytes)
+{
+	return slot_bytes - sizeof(RingSlot);
+}
+
+// A mapped segment, shared by the writer and the readers
+class RingMapping
+{
+public:
+	RingMapping(const RingMapping &) = delete;
+	RingMapping &operator=(const RingMapping &) = delete;
+
+	const std::string &name() const { return name_; }
+	uint32_t slots() const { return header_->slots; }
+	uint64_t head() const { return header_->head.load(std::memory_order_acquire); }
+
+protected:
+	RingMapping() = default;
+	~RingMapping();
+
+	void map(int fd, size_t bytes);
+	RingSlot &slot(uint64_t entry) const;
+	std::byte *payload(uint64_t entry) const;
+
+	std::string name_;
+	RingHeader *header_ = nullptr;
+	size_t bytes_ = 0;
+};
+
+// The single writer, which creates the segment and removes it again
+class RingWriter : public RingMapping
+{
+public:
+	// slots entries of up to payload_bytes each
+	RingWriter(const std::string &name, uint32_t slots, size_t payload_bytes);
+	~RingWriter();
+
+	// The payload of an entry from head to head + slots - 1, which stops
+	// being readable until it is published
+	std::span<std::byte> claim(uint64_t entry);
+	// Publishes the entry at head with bytes of its payload.  An entry of
+	// no bytes, such as a readout that failed, is passed over by readers.
+	void publish(uint32_t bytes, uint32_t kind);
+
+	struct Consumer
+	{
+		pid_t pid;
+		uint64_t behind;  // Entries published that it has still to read
+		uint64_t lost;
+	};
+	// The consumers attached, after freeing the cursors of any that exited
+	std::vector<Consumer> consumers();
+};
+
+// An entry as it lies in the segment
+struct RingEntry
+{
+	uint64_t entry;
+	uint32_t kind;
+	std::span<const std::byte> payload;
+};
+
+// A consumer, attached to a cursor of its own
+class RingReader : public RingMapping
+{
+public:
+	// Attaches to the segment of a running writer, from the next entry it
+	// publishes on
+	explicit RingReader(const std::string &name);
+	~RingReader();
+
+	// The next entry, or none if every entry published has been read.
+	// The payload is the writer's and may be overwritten at any time, so
+	// check valid() once done with it before relying on what was read.
+	std::optional<RingEntry> next();
+	// As next, but waits up to timeout_ms for an entry to be published
+	std::optional<RingEntry> wait(int timeout_ms);
+	// Whether the entry was still whole while it was read
+	bool valid(const RingEntry &entry) const;
+
+	uint64_t lost() const;
+
+private:
+	RingConsumer *consumer_ = nullptr;
+};
+
+}  // namespace dosimeter
@@ -0,0 +1,175 @@
+// Checks of the firmware's ring.c against a plain queue, built natively.
+//
+//   dosimeter_ring_test
+//
+// Covers the empty and full rings, bulk pushes and pops that wrap around
+// the end of the slots, reserve and commit mixed with them, head and tail
+// running past 2^32, and the peak fill level.  Prints each failed check
+// and exits 1 if there was any.
+
+extern "C" {
+#include "ring.h"
+}
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <random>
+#include <vector>
+
+namespace {
+
+constexpr uint32_t SIZE = 16;
+
+int failures = 0;
+
+void check(bool ok, const char *what, int line)
+{
+	if (!ok)
+	{
+		std::fprintf(stderr, "ring_test.cpp:%d: %s\n", line, what);
+		failures++;
+	}
+}
+
+#define CHECK(x) check((x), #x, __LINE__)
+
+void empty_and_full()
+{
+	ring_t ring = {};
+	uint32_t slots[SIZE];
+	uint32_t items[SIZE + 4];
+	for (uint32_t i = 0; i < SIZE + 4; i++)
+		items[i] = i;
+
+	uint32_t slot;
+	CHECK(ring_count(&ring) == 0);
+	CHECK(ring_pop(&ring, slots, SIZE, sizeof(*slots), items, 1) == 0);
+
+	// Only SIZE of them fit, and then nothing more
+	CHECK(ring_push(&ring, slots, SIZE, sizeof(*slots), items, SIZE + 4) == SIZE);
+	CHECK(ring_count(&ring) == SIZE);
+	CHECK(ring.peak == SIZE);
+	CHECK(!ring_reserve(&ring, SIZE, &slot));
+	CHECK(ring_push(&ring, slots, SIZE, sizeof(*slots), items, 1) == 0);
+
+	uint32_t out[SIZE + 4] = {};
+	CHECK(ring_pop(&ring, slots, SIZE, sizeof(*slots), out, SIZE + 4) == SIZE);
+	CHECK(ring_count(&ring) == 0);
+	for (uint32_t i = 0; i < SIZE; i++)
+		CHECK(out[i] == i);
+
+	// A flush empties the ring without reading it
+	CHECK(ring_push(&ring, slots, SIZE, sizeof(*slots), items, 5) == 5);
+	ring_flush(&ring);
+	CHECK(ring_count(&ring) == 0);
+	CHECK(ring_reserve(&ring, SIZE, &slot));
+}
+
+void wrap_around()
+{
+	// Start just short of the end of the slots, and of uint32_t
+	ring_t ring = {};
+	ring.head = UINT32_MAX - 2;
+	ring.tail = UINT32_MAX - 2;
+	uint16_t slots[SIZE];
+	uint16_t items[SIZE];
+	for (uint32_t i = 0; i < SIZE; i++)
+		items[i] = static_cast<uint16_t>(1000 + i);
+
+	// Past the end of the slots the run continues at slot 0
+	CHECK(ring_push(&ring, slots, SIZE, sizeof(*slots), items, 10) == 10);
+	CHECK(ring_count(&ring) == 10);
+	CHECK(slots[SIZE - 3] == 1000);
+	CHECK(slots[SIZE - 1] == 1002);
+	CHECK(slots[0] == 1003);
+	CHECK(slots[6] == 1009);
+
+	uint16_t out[SIZE] = {};
+	CHECK(ring_pop(&ring, slots, SIZE, sizeof(*slots), out, 4) == 4);
+	CHECK(ring_pop(&ring, slots, SIZE, sizeof(*slots), out + 4, SIZE) == 6);
+	for (uint32_t i = 0; i < 10; i++)
+		CHECK(out[i] == 1000 + i);
+	CHECK(ring.head == 7 && ring.tail == 7);
+}
+
+// Random pushes, reserves and pops against a std::deque
+void bulk()
+{
+	struct record
+	{
+		uint32_t sequence;
+		uint8_t bytes[5];
+	};
+
+	ring_t ring = {};
+	ring.head = UINT32_MAX - 100;
+	ring.tail = UINT32_MAX - 100;
+	record slots[SIZE];
+	std::deque<uint32_t> model;
+	std::mt19937 random(1);
+	uint32_t next = 0;
+	uint32_t peak = 0;
+
+	for (int step = 0; step < 20000; step++)
+	{
+		uint32_t count = random() % (SIZE + 3);
+		uint32_t action = random() % 3;
+		if (action == 0)
+		{
+			std::vector<record> items(count);
+			for (uint32_t i = 0; i < count; i++)
+				items[i] = {next + i, {}};
+			uint32_t pushed = ring_push(&ring, slots, SIZE, sizeof(*slots), items.data(), count);
+			CHECK(pushed == std::min<uint32_t>(count, SIZE - static_cast<uint32_t>(model.size())));
+			for (uint32_t i = 0; i < pushed; i++)
+				model.push_back(items[i].sequence);
+			next += pushed;
+		}
+		else if (action == 1)
+		{
+			uint32_t slot;
+			bool reserved = ring_reserve(&ring, SIZE, &slot);
+			CHECK(reserved == (model.size() < SIZE));
+			if (reserved)
+			{
+				slots[slot] = {next, {}};
+				model.push_back(next++);
+				ring_commit(&ring, 1);
+			}
+		}
+		else
+		{
+			std::vector<record> items(count);
+			uint32_t popped = ring_pop(&ring, slots, SIZE, sizeof(*slots), items.data(), count);
+			CHECK(popped == std::min<uint32_t>(count, static_cast<uint32_t>(model.size())));
+			for (uint32_t i = 0; i < popped; i++)
+			{
+				CHECK(items[i].sequence == model.front());
+				model.pop_front();
+			}
+		}
+		CHECK(ring_count(&ring) == model.size());
+		peak = std::max<uint32_t>(peak, static_cast<uint32_t>(model.size()));
+		CHECK(ring.peak == peak);
+		if (failures)
+			return;
+	}
+}
+
+}  // namespace
+
+int main()
+{
+	empty_and_full();
+	wrap_around();
+	bulk();
+	if (failures)
+	{
+		std::fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	std::printf("ring: all checks passed\n");
+	return 0;
+}
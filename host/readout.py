@@ -0,0 +1,778 @@
+"""Decoding of the DosimeterCounter binary readout replies.
+
+A binary reply is "ok\\n", a 16-byte readout header, the payload and a
+final "ok\\n".  decode_readout() takes the header and payload bytes.
+
+After "M1028 1" commands are sent as frames built by encode_command() and
+each reply arrives as one or more frames read by decode_frame().  Binary
+readout data follows the reply frame flagged FRAME_FLAG_MORE that holds
+the first "ok\\n".
+"""
+
+import struct
+import zlib
+
+HEADER = struct.Struct('<HHHHIBBH')
+
+READOUT_FLAG_OVERFLOW = 0x01
+READOUT_FLAG_RLE = 0x02
+READOUT_FLAG_CORRECTED = 0x04  # uint32 dead-time corrected counts (M1034)
+READOUT_FLAG_DOSE = 0x08  # uint32 calibrated dose (M1036)
+READOUT_FLAG_DECIMATED = 0x10  # uint32 sums of column runs (M1040)
+READOUT_FLAG_DIRTY = 0x20  # regions of touched cells (M1041)
+READOUT_FLAG_LIMIT = 0x40  # steps dropped beyond the hard limits (M1055)
+READOUT_FLAG_GAIN = 0x80  # counts scaled by the column gain map (M1058)
+
+GAIN_ONE = 0x8000  # Q1.15 column gains (M1057)
+
+READOUT_ALL_PLANAR = 0x100
+READOUT_ALL_INTERLEAVED = 0x101
+READOUT_PASS_VISITS = 0x104  # uint16 passes over each cell (M1062)
+READOUT_HISTOGRAM = 0x105  # uint32 pulse interval bins (M1071)
+READOUT_COINCIDENCES = 0x106  # uint16 coincidences in each cell (M1074)
+READOUT_RATES = 0x107  # uint32 counts per second over the dwell (M1076)
+READOUT_FLASH_LOG = 0x108  # scan log records as they are in flash (M1082)
+READOUT_ANALOG = 0x109  # uint16 AFEC samples of one input per cell (M1094)
+READOUT_UNCERTAINTY = 0x10A  # uint32 count, uint32 sqrt(count) per cell (M1095)
+READOUT_SMOOTHED = 0x10B  # uint32 counts through the M1096 FIR filter (M1097)
+READOUT_PREDICTED = 0x10C  # Row-predicted, Rice coded counts (M1101)
+READOUT_RESAMPLED = 0x10D  # uint32 counts on a uniform um grid (M1108)
+READOUT_PYRAMID = 0x10E  # uint32 sums of 8, 64 or 512 cells (M1110)
+READOUT_TILES = 0x10F  # A rectangle of counts as 16 x 16 tiles (M1111)
+
+READOUT_LZ4 = 0x8000  # Channel bit: the payload is an LZ4 frame of it (M1102)
+LZ4_MAGIC = 0x184D2204
+
+RICE_LIMIT = 24  # Quotients from which the value is sent in full (rice.h)
+RICE_RESET = 64
+RICE_SUM_CAP = 1 << 24
+
+PASS_MEAN_SHIFT = 8  # Fraction bits of the M1061 mean counts per pass
+UNCERTAINTY_SHIFT = 8  # Fraction bits of the M1095 uncertainties
+
+DIRTY_REGION = struct.Struct('<HH')
+
+TILE_SIZE = 16  # Rows and columns of an M1111 tile
+TILE_REGION = struct.Struct('<HHHH')  # row, column, rows, columns
+
+# Readout container (M1056): header, then blocks of block_columns columns
+# (the last may be shorter), each followed by the uint32 CRC-32 of its payload.
+# M1068 resends a run of blocks as a container starting at the first of them.
+# Version 2 added the wall clock (M1123) start and stop, seconds and us.
+CONTAINER_HEADER = struct.Struct('<IHHIHHHHHHHHBBBBIIIIIIII')
+CONTAINER_MAGIC = 0x52464344
+CONTAINER_CRC = struct.Struct('<I')
+ARCHIVE_TRAILER = struct.Struct('<IHHQIIII')  # Frame archives (archive.hpp)
+ARCHIVE_FRAME = struct.Struct('<QII')  # offset, first row, rows
+ARCHIVE_ROW = struct.Struct('<IHH')  # frame, map row, reserved
+ARCHIVE_MAGIC = 0x58444944
+
+FRAME = struct.Struct('<BBBBH')
+
+# Record header of the SD frame log (M1044), one per 512-byte block run
+SD_LOG_HEADER = struct.Struct('<IIIIIIIHHBBBB')
+SD_LOG_MAGIC = 0x474C5344
+SD_LOG_FLAG_TIMESTAMPS = 0x40
+SD_LOG_FLAG_INTERLEAVED = 0x80
+SD_BLOCK_BYTES = 512
+
+# Scan log in the internal flash (M1081, flash.h): a header page, then the
+# payload pages of a flash_log_row_t and each channel's bins of the row
+FLASH_LOG_HEADER = struct.Struct('<IIIIHH')
+FLASH_LOG_MAGIC = 0x474C4644
+FLASH_LOG_ROW = struct.Struct('<IIIIHHHBBB3xIIII')
+FLASH_PAGE_BYTES = 512
+
+# UDP transport (eth.h): commands go to this port, and every datagram
+# back starts with the uint32 offset of its bytes in the reply stream
+ETH_UDP_PORT = 4700
+
+# Event trace dump (M1051, trace.h): header then TRACE_EVENT records
+TRACE_HEADER = struct.Struct('<IIIHH')
+TRACE_EVENT = struct.Struct('<IHH')
+TRACE_MAGIC = 0x43525444
+TRACE_END = 0x8000
+TRACE_STEP = 1
+TRACE_COMMAND = 4
+TRACE_CLOCK = 5
+TRACE_NAMES = {1: 'step', 2: 'usb_ep', 3: 'cdc_sent', 4: 'command', 5: 'clock'}
+
+# Device timebase (M1119, M1120): microseconds since boot.  A lone
+# TIME_QUERY byte on the USB command port is answered with
+# "~<received> <sent>\n"; with M1120 1 a TIME_PUSH precedes each push
+# and readout header.
+TIME_QUERY = 0x16
+TIME_PUSH = struct.Struct('<HHII')  # magic, magic of the push stamped, low, high
+TIME_MAGIC = 0x5AAC
+
+# Live preview (M1125): the head's row as uint32 sums of stride columns
+PREVIEW_HEADER = struct.Struct('<HHHHiII')  # magic, points, stride, mask, row, sequence, built
+PREVIEW_MAGIC = 0x5AAD
+
+# Row summary (M1077), pushed after the bins of each sealed row
+ROW_SUMMARY_HEADER = struct.Struct('<HHIHHBBHII')  # magic, row, sequence, first, last, channels,
+                                                  # flags, overflow, commits, dwell
+ROW_SUMMARY_CHANNEL = struct.Struct('<IIHH')  # sum, peak, peak column, reserved
+ROW_SUMMARY_MAGIC = 0x5AAE
+ROW_SUMMARY_DEFERRED = 0x01
+
+FRAME_SYNC_COMMAND = 0xA5
+FRAME_SYNC_REPLY = 0x5A
+FRAME_FLAG_MORE = 0x01
+FRAME_FLAG_ERROR = 0x02
+
+
+def crc16(data, crc=0xFFFF):
+    """CRC-16/CCITT as computed by crc16_update in command.c."""
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else crc << 1
+            crc &= 0xFFFF
+    return crc
+
+
+def decode_rle(payload, count):
+    """Expand an M1026 payload into a list of count values (see rle_payload)."""
+    values = []
+    previous = 0
+    token = 0
+    shift = 0
+    for byte in payload:
+        token |= (byte & 0x7F) << shift
+        shift += 7
+        if byte & 0x80:
+            continue
+
+        if token & 1:
+            values.extend([previous] * (token >> 1))
+        else:
+            zigzag = token >> 1
+            previous += -((zigzag + 1) >> 1) if zigzag & 1 else zigzag >> 1
+            values.append(previous)
+        token = 0
+        shift = 0
+
+    if shift or len(values) != count:
+        raise ValueError('truncated compressed payload')
+    return values
+
+
+def decode_dirty(payload, width):
+    """Return {first cell: values} for the regions of an M1041 payload."""
+    regions = {}
+    offset = 0
+    while offset < len(payload):
+        first, cells = DIRTY_REGION.unpack_from(payload, offset)
+        offset += DIRTY_REGION.size
+        regions[first] = list(struct.unpack_from('<%d%s' % (cells, 'H' if width == 2 else 'I'), payload, offset))
+        offset += cells * width
+    return regions
+
+
+def decode_lz4_frame(data):
+    """Return (content, frame bytes) of an LZ4 frame as M1102 sends it.
+
+    Only the independent blocks without checksums that the device
+    writes are handled; lz4.frame.decompress reads the same frames.
+    """
+    magic, flg, bd, hc = struct.unpack_from('<IBBB', data)
+    if magic != LZ4_MAGIC or flg & 0xDF != 0x40:
+        raise ValueError('not an LZ4 frame')
+    offset = 7
+    out = bytearray()
+    while True:
+        (size,) = struct.unpack_from('<I', data, offset)
+        offset += 4
+        if size == 0:
+            return bytes(out), offset
+        block = data[offset:offset + (size & 0x7FFFFFFF)]
+        offset += len(block)
+        if size & 0x80000000:
+            out += block
+            continue
+        i = 0
+        while i < len(block):
+            token = block[i]
+            i += 1
+            literals = token >> 4
+            if literals == 15:
+                while True:
+                    literals += block[i]
+                    i += 1
+                    if block[i - 1] != 255:
+                        break
+            out += block[i:i + literals]
+            i += literals
+            if i >= len(block):
+                break
+            back = block[i] | block[i + 1] << 8
+            i += 2
+            match = token & 15
+            if match == 15:
+                while True:
+                    match += block[i]
+                    i += 1
+                    if block[i - 1] != 255:
+                        break
+            for _ in range(match + 4):
+                out.append(out[-back])
+
+
+def decode_readout(data):
+    """Return (header fields, values) for a header followed by its payload.
+
+    Readouts sent while M1102 compression is on are decompressed first.  A
+    start past the end is an M1005, M1015 or M1016 range that wraps: the
+    values run from start to the last cell and on from cell 0 to end.
+    """
+    channel, start, end, crc, length, width, flags, reserved = HEADER.unpack_from(data)
+    if channel & READOUT_LZ4:
+        channel &= ~READOUT_LZ4
+        content, _ = decode_lz4_frame(data[HEADER.size:])
+        data = bytes(data[:HEADER.size]) + content
+    payload = data[HEADER.size:HEADER.size + length]
+    if len(payload) != length:
+        raise ValueError('short payload')
+    if crc16(payload) != crc:
+        raise ValueError('CRC mismatch')
+
+    header = {'channel': channel, 'start': start, 'end': end,
+              'width': width, 'flags': flags}
+    if channel in (READOUT_ALL_PLANAR, READOUT_ALL_INTERLEAVED):
+        header['mask'] = reserved  # Channels sent, bit n for channel n (M1016)
+    elif flags & READOUT_FLAG_GAIN:
+        header['subtracted'] = bool(reserved)  # Background taken off (M1058 ... 1)
+    elif channel == READOUT_HISTOGRAM:
+        header['shift'] = reserved  # Bins of 1 << shift TIMER_CLOCK1 ticks (M1070)
+    elif channel == READOUT_COINCIDENCES:
+        header['window_ns'] = reserved  # Coincidence window (M1073)
+    elif channel in (READOUT_RATES, READOUT_UNCERTAINTY, READOUT_SMOOTHED, READOUT_PREDICTED, READOUT_RESAMPLED,
+                     READOUT_TILES):
+        header['counter'] = reserved  # Channel the values are of
+    elif channel == READOUT_PYRAMID:
+        header['counter'] = reserved & 0xFF
+        header['level'] = reserved >> 8  # Bins of 8 ** level cells
+    elif channel == READOUT_ANALOG:
+        header['input'] = reserved  # AFEC input sampled (M1093)
+    elif channel == READOUT_FLASH_LOG:
+        header['records'] = reserved
+        return header, list(read_flash_log(payload))
+    if channel == READOUT_PREDICTED:
+        header['columns'] = struct.unpack_from('<H', payload)[0]
+        values = decode_predicted(payload[2:], end - start + 1, header['columns'], start % header['columns'], width)
+    elif channel == READOUT_TILES:
+        header['row'], header['column'], header['rows'], header['columns'] = TILE_REGION.unpack_from(payload)
+        values = decode_tiles(payload[TILE_REGION.size:], header['rows'], header['columns'], width)
+    elif flags & READOUT_FLAG_RLE:
+        values = decode_rle(payload, end - start + 1)
+    elif flags & READOUT_FLAG_DIRTY:
+        values = decode_dirty(payload, width)
+    else:
+        values = list(struct.unpack('<%d%s' % (length // width, 'H' if width == 2 else 'I'), payload))
+    if channel == READOUT_UNCERTAINTY:
+        # (count, sigma) per cell
+        values = [(count, sigma / (1 << UNCERTAINTY_SHIFT)) for count, sigma in zip(values[0::2], values[1::2])]
+    return header, values
+
+
+def decode_rice(payload, count, width):
+    """Return count residuals of an M1101 payload (see rice.h)."""
+    bits = int.from_bytes(payload, 'little')
+    position = 0
+    total, seen = 4, 1
+    residuals = []
+    for _ in range(count):
+        k = 0
+        while seen << k < total:
+            k += 1
+        q = 0
+        while not bits >> (position + q) & 1:
+            q += 1
+        position += q + 1
+        if q >= RICE_LIMIT:
+            m = bits >> position & ((1 << width) - 1)
+            position += width
+        else:
+            m = q << k | bits >> position & ((1 << k) - 1)
+            position += k
+        residuals.append(m >> 1 ^ -(m & 1))
+        total += min(m, RICE_SUM_CAP)
+        seen += 1
+        if seen == RICE_RESET:
+            total >>= 1
+            seen >>= 1
+    return residuals
+
+
+def median_predict(a, b, c):
+    """The LOCO-I predictor of M1101 from left, above and above left."""
+    if c >= max(a, b):
+        return min(a, b)
+    if c <= min(a, b):
+        return max(a, b)
+    return a + b - c
+
+
+def decode_predicted(payload, count, columns, column, width):
+    """Return the counts of an M1101 payload after its row width.
+
+    column is the column of the first cell, start % columns.
+    """
+    mask = (1 << width * 8) - 1
+    values = []
+    for i, residual in enumerate(decode_rice(payload, count, width * 8)):
+        left, above = column > 0 and i > 0, i >= columns
+        if left and above:
+            b = values[i - columns]
+            prediction = median_predict(values[i - 1], b, values[i - columns - 1] if i > columns else b)
+        elif left:
+            prediction = values[i - 1]
+        elif above:
+            prediction = values[i - columns]
+        else:
+            prediction = 0
+        values.append((prediction + residual) & mask)
+        column = column + 1 if column + 1 < columns else 0
+    return values
+
+
+def decode_tiles(payload, rows, columns, width):
+    """Return the rows of an M1111 region from its tiles."""
+    tiles = struct.unpack('<%d%s' % (len(payload) // width, 'H' if width == 2 else 'I'), payload)
+    across = (columns + TILE_SIZE - 1) // TILE_SIZE
+    bins = TILE_SIZE * TILE_SIZE
+    values = []
+    for y in range(rows):
+        first = y // TILE_SIZE * across * bins + y % TILE_SIZE * TILE_SIZE
+        values.append([tiles[first + x // TILE_SIZE * bins + x % TILE_SIZE] for x in range(columns)])
+    return values
+
+
+def wall_time(seconds, us):
+    """Return a wall clock stamp (M1123) as Unix seconds, or None if unset."""
+    return seconds + us / 1e6 if seconds else None
+
+
+def decode_container_header(data):
+    """Return the header fields of an M1056 container (or archive file)."""
+    fields = CONTAINER_HEADER.unpack_from(data)
+    if fields[0] != CONTAINER_MAGIC:
+        raise ValueError('not a readout container')
+    if zlib.crc32(bytes(data[:CONTAINER_HEADER.size - 4])) != fields[-1]:
+        raise ValueError('header CRC mismatch')
+    names = ('magic', 'version', 'header_bytes', 'build_id', 'firmware', 'mask', 'start', 'end',
+             'columns', 'rows', 'bin_factor', 'block_columns', 'width', 'interleaved', 'flags',
+             'reserved', 'started', 'read', 'blocks', 'wall_started', 'wall_started_us',
+             'wall_stopped', 'wall_stopped_us', 'crc')
+    header = dict(zip(names, fields))
+    header['channels'] = bin(header['mask']).count('1')
+    return header
+
+
+def container_block_offset(header, block):
+    """Return (offset, columns) of a block's payload from the container start."""
+    block_bytes = header['block_columns'] * header['channels'] * header['width']
+    offset = header['header_bytes'] + block * (block_bytes + CONTAINER_CRC.size)
+    columns = min(header['block_columns'], header['end'] - header['start'] + 1 - block * header['block_columns'])
+    return offset, columns
+
+
+def read_container_block(data, header, block):
+    """Return {channel: values} for one block of a container.
+
+    data only needs random access, so a memory-mapped archive file works
+    and only the block asked for is read.
+    """
+    offset, columns = container_block_offset(header, block)
+    length = columns * header['channels'] * header['width']
+    payload = bytes(data[offset:offset + length])
+    if len(payload) != length:
+        raise ValueError('short payload')
+    if zlib.crc32(payload) != CONTAINER_CRC.unpack_from(data, offset + length)[0]:
+        raise ValueError('CRC mismatch in block %d' % block)
+
+    values = struct.unpack('<%d%s' % (length // header['width'], 'H' if header['width'] == 2 else 'I'), payload)
+    channels = [c for c in range(16) if header['mask'] & (1 << c)]
+    count = len(channels)
+    if header['interleaved']:
+        return {c: list(values[i::count]) for i, c in enumerate(channels)}
+    return {c: list(values[i * columns:(i + 1) * columns]) for i, c in enumerate(channels)}
+
+
+def container_good_blocks(data, header):
+    """Return the indices of the blocks of a partly received container that
+    arrived whole and match their CRC.
+
+    The rest can be asked for again with M1068, whose reply is a container
+    of its own starting at the first block sent.
+    """
+    good = []
+    for block in range(header['blocks']):
+        try:
+            read_container_block(data, header, block)
+        except (ValueError, struct.error):
+            continue
+        good.append(block)
+    return good
+
+
+def container_resend_range(header, good):
+    """Return (first block, blocks) of the first run a container is missing,
+    or None once every block is in good: the arguments M1068 takes after
+    interleave, start, end and mask."""
+    good = set(good)
+    missing = [b for b in range(header['blocks']) if b not in good]
+    if not missing:
+        return None
+    first = missing[0]
+    count = 1
+    while count < len(missing) and missing[count] == first + count:
+        count += 1
+    return first, count
+
+
+def read_container_cell(data, header, row, column):
+    """Return {channel: value} for one cell, reading only its block."""
+    cell = row * header['columns'] + column
+    if not header['start'] <= cell <= header['end']:
+        raise ValueError('cell outside the container')
+    block, index = divmod(cell - header['start'], header['block_columns'])
+    return {c: values[index] for c, values in read_container_block(data, header, block).items()}
+
+
+def read_archive_index(data):
+    """Return (frames, rows) of a frame archive written by dosimeter_archive,
+    or None if it has no index.
+
+    frames holds (offset, first row, rows) for each container and rows
+    (frame, map row) for each row of the session, in the order recorded.
+    Only the trailer and the tables are read, so a mapped file of any size
+    opens at once.
+    """
+    if len(data) < ARCHIVE_TRAILER.size:
+        return None
+    trailer = ARCHIVE_TRAILER.unpack_from(data, len(data) - ARCHIVE_TRAILER.size)
+    magic, version, trailer_bytes, index_offset, frames, rows, index_crc, crc = trailer
+    if (magic != ARCHIVE_MAGIC or trailer_bytes != ARCHIVE_TRAILER.size
+            or zlib.crc32(bytes(data[len(data) - ARCHIVE_TRAILER.size:len(data) - 4])) != crc):
+        return None
+    tables = bytes(data[index_offset:len(data) - ARCHIVE_TRAILER.size])
+    if len(tables) != frames * ARCHIVE_FRAME.size + rows * ARCHIVE_ROW.size or zlib.crc32(tables) != index_crc:
+        return None
+    row_table = frames * ARCHIVE_FRAME.size
+    return ([ARCHIVE_FRAME.unpack_from(tables, i * ARCHIVE_FRAME.size) for i in range(frames)],
+            [ARCHIVE_ROW.unpack_from(tables, row_table + i * ARCHIVE_ROW.size)[:2] for i in range(rows)])
+
+
+def read_archive_row(data, index, row):
+    """Return (header, map row, {channel: values}) for one row of the session
+    of an archive, from read_archive_index(), reading only the blocks that
+    hold it.  Columns outside the frame's cell range are None."""
+    frames, rows = index
+    frame, map_row = rows[row]
+    offset = frames[frame][0]
+    header = decode_container_header(data[offset:offset + CONTAINER_HEADER.size])
+    columns = header['columns'] or header['end'] + 1
+    first = max(header['start'], map_row * columns)
+    last = min(header['end'], map_row * columns + columns - 1)
+    values = {c: [None] * columns for c in range(16) if header['mask'] & (1 << c)}
+    container = data[offset:]
+    for block in range((first - header['start']) // header['block_columns'],
+                       (last - header['start']) // header['block_columns'] + 1):
+        block_first = header['start'] + block * header['block_columns']
+        for c, counts in read_container_block(container, header, block).items():
+            for i, v in enumerate(counts):
+                if first <= block_first + i <= last:
+                    values[c][block_first + i - map_row * columns] = v
+    return header, map_row, values
+
+
+def pass_means(values):
+    """Return the M1061 fixed-point means as counts per pass."""
+    return [v / (1 << PASS_MEAN_SHIFT) for v in values]
+
+
+def gain_map_commands(gains, first=0, per_command=9):
+    """Yield the M1057 argument lists that load gains (floats below 2.0).
+
+    Each argument after the first column packs two Q1.15 gains, the
+    lower half for the earlier column.  An odd count is padded with 1.0.
+    """
+    q = [min(0xFFFF, max(0, int(round(g * GAIN_ONE)))) for g in gains]
+    if len(q) % 2:
+        q.append(GAIN_ONE)
+    pairs = [q[i] | q[i + 1] << 16 for i in range(0, len(q), 2)]
+    for i in range(0, len(pairs), per_command):
+        # Arguments are int32 on the wire
+        yield [first + 2 * i] + [p - (1 << 32) if p & 0x80000000 else p for p in pairs[i:i + per_command]]
+
+
+def fir_commands(taps, per_command=9):
+    """Yield the M1096 argument lists that load FIR taps (floats in [-1, 1)).
+
+    Taps pack two signed Q15 values per argument like gain_map_commands.
+    An odd count is padded with 0, which leaves the filter and its centre
+    unchanged.
+    """
+    q = [min(0x7FFF, max(-0x8000, int(round(t * 0x8000)))) & 0xFFFF for t in taps]
+    if len(q) % 2:
+        q.append(0)
+    pairs = [q[i] | q[i + 1] << 16 for i in range(0, len(q), 2)]
+    for i in range(0, len(pairs), per_command):
+        yield [2 * i] + [p - (1 << 32) if p & 0x80000000 else p for p in pairs[i:i + per_command]]
+
+
+def reference_commands(counts, per_command=9):
+    """Yield the M1099 argument lists that load a gamma reference profile.
+
+    Counts pack two uint16 values per argument like gain_map_commands,
+    and an odd count is padded with 0.
+    """
+    q = [min(0xFFFF, max(0, int(round(c)))) for c in counts]
+    if len(q) % 2:
+        q.append(0)
+    pairs = [q[i] | q[i + 1] << 16 for i in range(0, len(q), 2)]
+    for i in range(0, len(pairs), per_command):
+        yield [2 * i] + [p - (1 << 32) if p & 0x80000000 else p for p in pairs[i:i + per_command]]
+
+
+def calibration_commands(positions, spacing, per_command=8):
+    """Yield the M1107 argument lists that load a head position calibration.
+
+    positions are the increasing positions in micrometres of columns 0,
+    spacing, 2 * spacing and so on, one knot per argument.
+    """
+    um = [int(round(p)) for p in positions]
+    for i in range(0, len(um), per_command):
+        yield [spacing, i] + um[i:i + per_command]
+
+
+def decode_trace(data):
+    """Return (header fields, [(cycles, event, arg)]) for an M1051 dump."""
+    magic, cpu_hz, recorded, count, crc = TRACE_HEADER.unpack_from(data)
+    if magic != TRACE_MAGIC:
+        raise ValueError('not a trace dump')
+    payload = data[TRACE_HEADER.size:TRACE_HEADER.size + count * TRACE_EVENT.size]
+    if len(payload) != count * TRACE_EVENT.size:
+        raise ValueError('short payload')
+    if crc16(payload) != crc:
+        raise ValueError('CRC mismatch')
+    header = {'cpu_hz': cpu_hz, 'recorded': recorded, 'lost': recorded - count}
+    return header, list(TRACE_EVENT.iter_unpack(payload))
+
+
+def chrome_trace(header, events):
+    """Convert decoded trace events to the Chrome trace event format.
+
+    The result, written out with json.dump(), loads in chrome://tracing or
+    Perfetto.  Each event id gets its own track; spans recorded with
+    TRACE_END become durations, the others instants.  Times are in
+    microseconds from the first event.
+    """
+    records = []
+    time = 0.0
+    factor = 1
+    previous = events[0][0] if events else 0
+    for cycles, event, arg in events:
+        # 32-bit cycle counts wrap; an interrupt may also record between
+        # another event's timestamp and its slot, so steps can be negative
+        step = (cycles - previous + 0x80000000) % 0x100000000 - 0x80000000
+        time += step * factor * 1e6 / header['cpu_hz']
+        previous = cycles
+
+        kind = event & ~TRACE_END
+        if kind == TRACE_CLOCK:
+            factor = arg
+        record = {'name': TRACE_NAMES.get(kind, 'event %d' % kind), 'ts': time,
+                  'pid': 0, 'tid': kind, 'args': {'arg': arg}}
+        if event & TRACE_END:
+            record['ph'] = 'E'
+        elif kind in (TRACE_STEP, TRACE_COMMAND):
+            record['ph'] = 'B'
+        else:
+            record['ph'] = 'i'
+            record['s'] = 't'
+        records.append(record)
+    return {'traceEvents': records, 'displayTimeUnit': 'ns'}
+
+
+def encode_command(code, sequence, *args):
+    """Frame M<code> and its integer arguments for the binary protocol."""
+    payload = struct.pack('<%di' % len(args), *args)
+    frame = FRAME.pack(FRAME_SYNC_COMMAND, code - 1000, sequence & 0xFF, 0, len(payload)) + payload
+    return frame + struct.pack('<H', crc16(frame))
+
+
+def decode_frame(data):
+    """Return (code, sequence, flags, text, rest) for the reply frame at the start of data."""
+    sync, opcode, sequence, flags, length = FRAME.unpack_from(data)
+    if sync != FRAME_SYNC_REPLY:
+        raise ValueError('not a reply frame')
+    end = FRAME.size + length
+    if len(data) < end + 2:
+        raise ValueError('short frame')
+    crc, = struct.unpack_from('<H', data, end)
+    if crc16(data[:end]) != crc:
+        raise ValueError('CRC mismatch')
+    return opcode + 1000, sequence, flags, data[FRAME.size:end].decode('ascii'), data[end + 2:]
+
+
+def read_sd_log(image, first_block=0):
+    """Yield (header fields, bank bytes) for each record of an M1044 log.
+
+    image is a file opened on the raw card (or a copy of it).  Reading
+    stops at the first block without the magic or from another session.
+    """
+    image.seek(first_block * SD_BLOCK_BYTES)
+    session = None
+    while True:
+        block = image.read(SD_BLOCK_BYTES)
+        if len(block) < SD_LOG_HEADER.size:
+            return
+        (magic, record_session, record, frames, sof, blocks, length,
+         columns, rows, channels, width, flags, _) = SD_LOG_HEADER.unpack_from(block)
+        if magic != SD_LOG_MAGIC or session not in (None, record_session):
+            return
+        session = record_session
+
+        bank = image.read((blocks - 1) * SD_BLOCK_BYTES)[:length]
+        if len(bank) != length:
+            return
+        header = {'session': record_session, 'record': record, 'frames': frames, 'sof': sof,
+                  'columns': columns, 'rows': rows, 'channels': channels,
+                  'width': width, 'flags': flags}
+        yield header, bank
+
+
+def read_flash_log(dump):
+    """Yield (row fields, per-channel bins) for each record of an M1082 dump."""
+    offset = 0
+    while offset + FLASH_PAGE_BYTES <= len(dump):
+        magic, serial, lap, length, payload_crc, _ = FLASH_LOG_HEADER.unpack_from(dump, offset)
+        if magic != FLASH_LOG_MAGIC:
+            raise ValueError('not a scan log record')
+        payload = dump[offset + FLASH_PAGE_BYTES:offset + FLASH_PAGE_BYTES + length]
+        if crc16(payload) != payload_crc:
+            raise ValueError('record %d CRC mismatch' % serial)
+        offset += FLASH_PAGE_BYTES * (1 + (length + FLASH_PAGE_BYTES - 1) // FLASH_PAGE_BYTES)
+
+        (session, frame, started, stopped, row, rows, columns, channels, width, flags,
+         wall_started, wall_started_us, wall_stopped, wall_stopped_us) = FLASH_LOG_ROW.unpack_from(payload)
+        values = struct.unpack_from('<%d%s' % (channels * columns, 'H' if width == 2 else 'I'),
+                                    payload, FLASH_LOG_ROW.size)
+        header = {'serial': serial, 'lap': lap, 'session': session, 'frame': frame,
+                  'started': started, 'stopped': stopped, 'row': row, 'rows': rows,
+                  'columns': columns, 'channels': channels, 'width': width, 'flags': flags,
+                  'wall_started': wall_time(wall_started, wall_started_us),
+                  'wall_stopped': wall_time(wall_stopped, wall_stopped_us)}
+        yield header, [list(values[c * columns:(c + 1) * columns]) for c in range(channels)]
+
+
+def decode_time_push(data):
+    """Return (magic of the push it stamps or 0, device microseconds)."""
+    magic, stamped, low, high = TIME_PUSH.unpack_from(data)
+    if magic != TIME_MAGIC:
+        raise ValueError('not a time push')
+    return stamped, low | high << 32
+
+
+def decode_preview(data):
+    """Return (header fields, {channel: sums}) of an M1125 preview."""
+    magic, points, stride, mask, row, sequence, built = PREVIEW_HEADER.unpack_from(data)
+    if magic != PREVIEW_MAGIC:
+        raise ValueError('not a preview')
+    channels = [c for c in range(16) if mask & (1 << c)]
+    sums = struct.unpack_from('<%dI' % (points * len(channels)), data, PREVIEW_HEADER.size)
+    header = {'points': points, 'stride': stride, 'mask': mask, 'row': row, 'sequence': sequence,
+              'built': built}
+    return header, {c: list(sums[i * points:(i + 1) * points]) for i, c in enumerate(channels)}
+
+
+def decode_row_summary(data):
+    """Return (header fields, per-channel dicts) of an M1077 row summary.
+
+    dwell is in milliseconds; first > last if no column was committed.
+    """
+    (magic, row, sequence, first, last, channels, flags, overflow, commits,
+     dwell) = ROW_SUMMARY_HEADER.unpack_from(data)
+    if magic != ROW_SUMMARY_MAGIC:
+        raise ValueError('not a row summary')
+    header = {'row': row, 'sequence': sequence, 'first': first, 'last': last, 'commits': commits,
+              'dwell': dwell, 'deferred': bool(flags & ROW_SUMMARY_DEFERRED), 'overflow': overflow}
+    entries = []
+    for c in range(channels):
+        total, peak, peak_column, _ = ROW_SUMMARY_CHANNEL.unpack_from(
+            data, ROW_SUMMARY_HEADER.size + c * ROW_SUMMARY_CHANNEL.size)
+        entries.append({'sum': total, 'peak': peak, 'peak_column': peak_column,
+                        'overflow': bool(overflow & (1 << c))})
+    return header, entries
+
+
+def parse_time_answer(line):
+    """Return (received, sent) from a TIME_QUERY answer or an M1119 reply."""
+    received, sent = line.strip().lstrip('~').split()
+    return int(received), int(sent)
+
+
+def clock_sample(t1, t2, t3, t4):
+    """Return (offset, delay) of one exchange, NTP style.
+
+    t1 and t4 are the host clock as the query left and the answer came
+    back, t2 and t3 the device stamps, all in microseconds; device time
+    plus offset is host time.
+    """
+    return ((t1 - t2) + (t4 - t3)) / 2, (t4 - t1) - (t3 - t2)
+
+
+def clock_fit(samples, keep=0.5):
+    """Fit host time against device time from several exchanges.
+
+    samples are (t1, t2, t3, t4) tuples as for clock_sample.  Only the
+    fraction keep with the shortest round trips is used, as queueing
+    only ever delays, and a least squares line through their midpoints
+    gives both the offset and the crystal's rate error.  Returns
+    (rate, offset) for device_to_host.
+    """
+    rated = sorted(samples, key=lambda s: clock_sample(*s)[1])
+    rated = rated[:max(2, int(len(rated) * keep))]
+    xs = [(t2 + t3) / 2 for t1, t2, t3, t4 in rated]
+    ys = [(t1 + t4) / 2 for t1, t2, t3, t4 in rated]
+    if len(rated) < 2 or max(xs) == min(xs):
+        t1, t2, t3, t4 = rated[0]
+        return 1.0, clock_sample(t1, t2, t3, t4)[0]
+    mx, my = sum(xs) / len(xs), sum(ys) / len(ys)
+    rate = sum((x - mx) * (y - my) for x, y in zip(xs, ys)) / sum((x - mx) ** 2 for x in xs)
+    return rate, my - rate * mx
+
+
+def device_to_host(us, fit):
+    """Convert device microseconds to host microseconds with a clock_fit."""
+    rate, offset = fit
+    return us * rate + offset
+
+
+class DatagramStream:
+    """Reassemble the reply stream from the datagrams of the UDP transport."""
+
+    def __init__(self):
+        self.offset = 0
+        self.data = bytearray()
+
+    def feed(self, datagram):
+        """Append a datagram; raises ValueError if one went missing."""
+        offset, = struct.unpack_from('<I', datagram)
+        if offset < self.offset:
+            return  # Resent or duplicated
+        if offset != self.offset:
+            raise ValueError('lost %d stream bytes' % (offset - self.offset))
+        self.data += datagram[4:]
+        self.offset += len(datagram) - 4
+
+    def take(self, count):
+        """Remove and return the first count bytes, or None until they arrive."""
+        if len(self.data) < count:
+            return None
+        chunk = bytes(self.data[:count])
+        del self.data[:count]
+        return chunk
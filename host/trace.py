@@ -0,0 +1,29 @@
+"""Convert an M1051 trace dump to a Chrome trace JSON file.
+
+The dump is the bytes that follow the "ok\\n" of M1051, saved as they
+arrived:
+
+    python trace.py dump.bin trace.json
+
+then open trace.json in chrome://tracing or https://ui.perfetto.dev.
+"""
+
+import json
+import sys
+
+from readout import chrome_trace, decode_trace
+
+
+def main(argv):
+    if len(argv) != 3:
+        sys.exit(__doc__)
+    with open(argv[1], 'rb') as dump:
+        header, events = decode_trace(dump.read())
+    if header['lost']:
+        print('%d oldest events were overwritten' % header['lost'], file=sys.stderr)
+    with open(argv[2], 'w') as out:
+        json.dump(chrome_trace(header, events), out)
+
+
+if __name__ == '__main__':
+    main(sys.argv)